@@ -0,0 +1,458 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/*
+ * db-bench: benchmark for the statement patterns of the sqlite store.
+ *
+ * Builds a synthetic store with the schema of src/lib/db.c, N tobjects spread
+ * across T tokens, and times the statements the library issues:
+ *  - load-tokens: per token, the sealobjects and tobjects queries run by
+ *    C_Initialize when the tokens are loaded.
+ *  - update-attrs: the per object attribute UPDATE run by C_SetAttributeValue
+ *    and friends.
+ * Each case runs with statements prepared on every call, as the library used
+ * to, and with statements prepared once and reset, both before and after the
+ * schema version 5 tokid indexes are created. The report is JSON.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#define DEFAULT_OBJECTS 100000
+#define DEFAULT_TOKENS  255
+#define DEFAULT_UPDATES 10000
+
+/* roughly the size of the YAML attributes of an RSA key */
+#define ATTRS_LEN 2048
+
+typedef struct bench bench;
+struct bench {
+    sqlite3 *db;
+    unsigned long objects;
+    unsigned long tokens;
+    unsigned long updates;
+    const char *path;
+    const char *output;
+    bool keep;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static bool exec(sqlite3 *db, const char *sql) {
+
+    char *err = NULL;
+    int rc = sqlite3_exec(db, sql, NULL, NULL, &err);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "\"%s\" failed: %s\n", sql, err);
+        sqlite3_free(err);
+        return false;
+    }
+
+    return true;
+}
+
+static bool populate(bench *b) {
+
+    static const char *schema[] = {
+        "CREATE TABLE tokens("
+            "id INTEGER PRIMARY KEY,"
+            "pid INTEGER NOT NULL,"
+            "label TEXT UNIQUE,"
+            "config TEXT NOT NULL"
+        ");",
+        "CREATE TABLE sealobjects("
+            "id INTEGER PRIMARY KEY,"
+            "tokid INTEGER NOT NULL,"
+            "userpub BLOB,"
+            "userpriv BLOB,"
+            "userauthsalt TEXT,"
+            "sopub BLOB NOT NULL,"
+            "sopriv BLOB NOT NULL,"
+            "soauthsalt TEXT NOT NULL"
+        ");",
+        "CREATE TABLE tobjects("
+            "id INTEGER PRIMARY KEY,"
+            "tokid INTEGER NOT NULL,"
+            "attrs TEXT NOT NULL"
+        ");",
+    };
+
+    size_t i;
+    for (i = 0; i < sizeof(schema)/sizeof(schema[0]); i++) {
+        if (!exec(b->db, schema[i])) {
+            return false;
+        }
+    }
+
+    if (!exec(b->db, "BEGIN TRANSACTION;")) {
+        return false;
+    }
+
+    sqlite3_stmt *tok = NULL;
+    sqlite3_stmt *seal = NULL;
+    sqlite3_stmt *tobj = NULL;
+    bool result = false;
+
+    int rc = sqlite3_prepare_v2(b->db,
+            "INSERT INTO tokens (id, pid, label, config) VALUES (?, 1, ?, 'token-init: true');",
+            -1, &tok, NULL);
+    rc |= sqlite3_prepare_v2(b->db,
+            "INSERT INTO sealobjects (tokid, userpub, userpriv, userauthsalt, "
+            "sopub, sopriv, soauthsalt) VALUES (?, zeroblob(90), zeroblob(160), "
+            "'00112233445566778899aabbccddeeff', zeroblob(90), zeroblob(160), "
+            "'00112233445566778899aabbccddeeff');",
+            -1, &seal, NULL);
+    rc |= sqlite3_prepare_v2(b->db,
+            "INSERT INTO tobjects (tokid, attrs) VALUES (?, ?);",
+            -1, &tobj, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "prepare failed: %s\n", sqlite3_errmsg(b->db));
+        goto out;
+    }
+
+    unsigned long t;
+    for (t = 1; t <= b->tokens; t++) {
+        char label[32];
+        snprintf(label, sizeof(label), "token-%lu", t);
+
+        sqlite3_bind_int64(tok, 1, t);
+        sqlite3_bind_text(tok, 2, label, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(seal, 1, t);
+        if (sqlite3_step(tok) != SQLITE_DONE || sqlite3_step(seal) != SQLITE_DONE) {
+            fprintf(stderr, "insert failed: %s\n", sqlite3_errmsg(b->db));
+            goto out;
+        }
+        sqlite3_reset(tok);
+        sqlite3_reset(seal);
+    }
+
+    char attrs[ATTRS_LEN + 1];
+    memset(attrs, 'a', ATTRS_LEN);
+    attrs[ATTRS_LEN] = '\0';
+
+    unsigned long o;
+    for (o = 0; o < b->objects; o++) {
+        /* interleave the tokens like objects created over time would be */
+        sqlite3_bind_int64(tobj, 1, o % b->tokens + 1);
+        sqlite3_bind_text(tobj, 2, attrs, ATTRS_LEN, SQLITE_STATIC);
+        if (sqlite3_step(tobj) != SQLITE_DONE) {
+            fprintf(stderr, "insert failed: %s\n", sqlite3_errmsg(b->db));
+            goto out;
+        }
+        sqlite3_reset(tobj);
+    }
+
+    result = exec(b->db, "COMMIT;");
+
+out:
+    sqlite3_finalize(tok);
+    sqlite3_finalize(seal);
+    sqlite3_finalize(tobj);
+    return result;
+}
+
+typedef struct stmt_ctx stmt_ctx;
+struct stmt_ctx {
+    sqlite3 *db;
+    bool cached;
+    sqlite3_stmt *stmt;
+};
+
+static int ctx_get(stmt_ctx *c, const char *sql, sqlite3_stmt **stmt) {
+
+    if (c->cached && c->stmt) {
+        *stmt = c->stmt;
+        return SQLITE_OK;
+    }
+
+    int rc = sqlite3_prepare_v2(c->db, sql, -1, stmt, NULL);
+    if (rc == SQLITE_OK && c->cached) {
+        c->stmt = *stmt;
+    }
+
+    return rc;
+}
+
+static void ctx_put(stmt_ctx *c, sqlite3_stmt *stmt) {
+
+    if (c->cached) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    } else {
+        sqlite3_finalize(stmt);
+    }
+}
+
+static void ctx_free(stmt_ctx *c) {
+    sqlite3_finalize(c->stmt);
+    c->stmt = NULL;
+}
+
+/* mirrors __real_init_sealobjects() and __real_init_tobjects() */
+static bool load_tokens(bench *b, bool cached, unsigned long *ops) {
+
+    stmt_ctx seal = { .db = b->db, .cached = cached };
+    stmt_ctx tobj = { .db = b->db, .cached = cached };
+    bool result = false;
+    unsigned long rows = 0;
+
+    unsigned long t;
+    for (t = 1; t <= b->tokens; t++) {
+        sqlite3_stmt *stmt;
+        if (ctx_get(&seal, "SELECT * FROM sealobjects WHERE tokid=?", &stmt) != SQLITE_OK) {
+            goto out;
+        }
+        sqlite3_bind_int64(stmt, 1, t);
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            ctx_put(&seal, stmt);
+            goto out;
+        }
+        ctx_put(&seal, stmt);
+
+        if (ctx_get(&tobj, "SELECT * FROM tobjects WHERE tokid=?", &stmt) != SQLITE_OK) {
+            goto out;
+        }
+        sqlite3_bind_int64(stmt, 1, t);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            /* touch the attributes like db_tobject_new() does */
+            rows += sqlite3_column_bytes(stmt, 2) ? 1 : 0;
+        }
+        ctx_put(&tobj, stmt);
+    }
+
+    result = rows == b->objects;
+    if (!result) {
+        fprintf(stderr, "expected %lu objects, got %lu\n", b->objects, rows);
+    }
+
+    *ops = b->tokens;
+
+out:
+    ctx_free(&seal);
+    ctx_free(&tobj);
+    return result;
+}
+
+/* mirrors db_update_tobject_attrs() */
+static bool update_attrs(bench *b, bool cached, unsigned long *ops) {
+
+    stmt_ctx upd = { .db = b->db, .cached = cached };
+    bool result = false;
+
+    char attrs[ATTRS_LEN + 1];
+    memset(attrs, 'b', ATTRS_LEN);
+    attrs[ATTRS_LEN] = '\0';
+
+    if (!exec(b->db, "BEGIN TRANSACTION;")) {
+        return false;
+    }
+
+    unsigned long i;
+    for (i = 0; i < b->updates; i++) {
+        sqlite3_stmt *stmt;
+        if (ctx_get(&upd, "UPDATE tobjects SET attrs=? WHERE id=?;", &stmt) != SQLITE_OK) {
+            goto out;
+        }
+        sqlite3_bind_text(stmt, 1, attrs, ATTRS_LEN, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, i % b->objects + 1);
+        int rc = sqlite3_step(stmt);
+        ctx_put(&upd, stmt);
+        if (rc != SQLITE_DONE) {
+            goto out;
+        }
+    }
+
+    *ops = b->updates;
+    result = true;
+
+out:
+    ctx_free(&upd);
+    return exec(b->db, result ? "COMMIT;" : "ROLLBACK;") && result;
+}
+
+typedef bool (*bench_fn)(bench *b, bool cached, unsigned long *ops);
+
+static bool run_case(bench *b, FILE *out, const char *name, bench_fn fn,
+        bool indexed, bool cached, bool *first) {
+
+    unsigned long ops = 0;
+    uint64_t start = now_ns();
+    if (!fn(b, cached, &ops)) {
+        fprintf(stderr, "case %s failed: %s\n", name, sqlite3_errmsg(b->db));
+        return false;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    fprintf(out, "%s\n    {\"case\":\"%s\",\"indexed\":%s,\"cached\":%s,"
+            "\"ops\":%lu,\"seconds\":%.3f,\"per_op_us\":%.1f}",
+            *first ? "" : ",", name,
+            indexed ? "true" : "false", cached ? "true" : "false",
+            ops, elapsed / 1e9, ops ? elapsed / 1e3 / ops : 0.0);
+    *first = false;
+
+    return true;
+}
+
+static void usage(const char *prog) {
+
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "\n"
+        "Options:\n"
+        "  -n, --objects N   number of tobjects, default %u\n"
+        "  -t, --tokens T    number of tokens, default %u\n"
+        "  -u, --updates U   number of attribute updates, default %u\n"
+        "  -p, --path FILE   store path, default a temporary file\n"
+        "  -k, --keep        keep the store after the run\n"
+        "  -o, --output FILE write the JSON report to FILE, default stdout\n"
+        "  -h, --help        this help\n",
+        prog, DEFAULT_OBJECTS, DEFAULT_TOKENS, DEFAULT_UPDATES);
+}
+
+static bool parse_ul(const char *s, unsigned long *v) {
+
+    char *end = NULL;
+    errno = 0;
+    *v = strtoul(s, &end, 0);
+    return !errno && end && !*end && s[0] && *v;
+}
+
+int main(int argc, char *argv[]) {
+
+    bench b = {
+        .objects = DEFAULT_OBJECTS,
+        .tokens = DEFAULT_TOKENS,
+        .updates = DEFAULT_UPDATES,
+    };
+
+    static const struct option long_opts[] = {
+        { "objects", required_argument, NULL, 'n' },
+        { "tokens",  required_argument, NULL, 't' },
+        { "updates", required_argument, NULL, 'u' },
+        { "path",    required_argument, NULL, 'p' },
+        { "keep",    no_argument,       NULL, 'k' },
+        { "output",  required_argument, NULL, 'o' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:t:u:p:ko:h", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'n':
+            if (!parse_ul(optarg, &b.objects)) {
+                goto bad_arg;
+            }
+            break;
+        case 't':
+            if (!parse_ul(optarg, &b.tokens)) {
+                goto bad_arg;
+            }
+            break;
+        case 'u':
+            if (!parse_ul(optarg, &b.updates)) {
+                goto bad_arg;
+            }
+            break;
+        case 'p':
+            b.path = optarg;
+            break;
+        case 'k':
+            b.keep = true;
+            break;
+        case 'o':
+            b.output = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    char tmp[] = "/tmp/db-bench-XXXXXX";
+    if (!b.path) {
+        int fd = mkstemp(tmp);
+        if (fd < 0) {
+            fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+            return 1;
+        }
+        close(fd);
+        unlink(tmp);
+        b.path = tmp;
+    }
+
+    if (sqlite3_open(b.path, &b.db) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open \"%s\": %s\n", b.path, sqlite3_errmsg(b.db));
+        return 1;
+    }
+
+    int ret = 1;
+    FILE *out = stdout;
+
+    fprintf(stderr, "populating %lu objects across %lu tokens in \"%s\"\n",
+            b.objects, b.tokens, b.path);
+    if (!populate(&b)) {
+        goto out;
+    }
+
+    if (b.output) {
+        out = fopen(b.output, "w");
+        if (!out) {
+            fprintf(stderr, "Cannot open \"%s\": %s\n", b.output, strerror(errno));
+            out = stdout;
+            goto out;
+        }
+    }
+
+    fprintf(out, "{\"objects\":%lu,\"tokens\":%lu,\"results\":[", b.objects, b.tokens);
+
+    bool first = true;
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        bool indexed = pass == 1;
+        if (indexed && (!exec(b.db, "CREATE INDEX tobjects_tokid ON tobjects(tokid);")
+                || !exec(b.db, "CREATE INDEX sealobjects_tokid ON sealobjects(tokid);"))) {
+            goto out;
+        }
+
+        if (!run_case(&b, out, "load-tokens", load_tokens, indexed, false, &first)
+                || !run_case(&b, out, "load-tokens", load_tokens, indexed, true, &first)
+                || !run_case(&b, out, "update-attrs", update_attrs, indexed, false, &first)
+                || !run_case(&b, out, "update-attrs", update_attrs, indexed, true, &first)) {
+            goto out;
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    ret = 0;
+
+out:
+    if (out != stdout) {
+        fclose(out);
+    }
+    sqlite3_close(b.db);
+    if (!b.keep) {
+        unlink(b.path);
+    }
+    return ret;
+
+bad_arg:
+    fprintf(stderr, "Invalid argument for -%c: \"%s\"\n", c, optarg);
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,253 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/*
+ * ecdsa-bench: cost of verifying PKCS#11 ECDSA signatures.
+ *
+ * C_Verify gets r || s, OpenSSL verifies a DER ECDSA-Sig-Value, so every
+ * ECDSA verify converts one to the other. For each curve this times the
+ * conversion of src/lib/ssl_util.c, the BIGNUM and ECDSA_SIG one it replaced
+ * and a whole ssl_util_sig_verify(). The report is JSON.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+
+#include "ssl_util.h"
+#include "utils.h"
+
+#define DEFAULT_ITERATIONS 100000
+
+typedef struct curve curve;
+struct curve {
+    const char *name;
+    int nid;
+    size_t len;
+};
+
+static const curve curves[] = {
+    { "P-256", NID_X9_62_prime256v1, 32 },
+    { "P-384", NID_secp384r1,        48 },
+};
+
+typedef struct sample sample;
+struct sample {
+    EVP_PKEY *pkey;
+    CK_BYTE digest[32];
+    CK_BYTE sig[SSL_UTIL_ECDSA_MAX_SIG_LEN];
+    CK_ULONG siglen;
+};
+
+typedef bool (*bench_fn)(sample *s);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static bool sample_init(sample *s, const curve *c) {
+
+    memset(s, 0, sizeof(*s));
+    memset(s->digest, 0x5a, sizeof(s->digest));
+
+    EC_KEY *key = EC_KEY_new_by_curve_name(c->nid);
+    if (!key || !EC_KEY_generate_key(key)) {
+        fprintf(stderr, "Cannot make a %s key\n", c->name);
+        EC_KEY_free(key);
+        return false;
+    }
+
+    ECDSA_SIG *esig = ECDSA_do_sign(s->digest, sizeof(s->digest), key);
+    if (!esig) {
+        fprintf(stderr, "Cannot sign with the %s key\n", c->name);
+        EC_KEY_free(key);
+        return false;
+    }
+
+    const BIGNUM *r = NULL;
+    const BIGNUM *sv = NULL;
+    ECDSA_SIG_get0(esig, &r, &sv);
+    BN_bn2binpad(r, s->sig, c->len);
+    BN_bn2binpad(sv, &s->sig[c->len], c->len);
+    s->siglen = 2 * c->len;
+    ECDSA_SIG_free(esig);
+
+    s->pkey = EVP_PKEY_new();
+    if (!s->pkey || !EVP_PKEY_assign_EC_KEY(s->pkey, key)) {
+        fprintf(stderr, "oom\n");
+        EC_KEY_free(key);
+        return false;
+    }
+
+    return true;
+}
+
+static bool bench_to_der(sample *s) {
+
+    CK_BYTE der[SSL_UTIL_ECDSA_DER_MAX(SSL_UTIL_ECDSA_MAX_SIG_LEN)];
+    CK_ULONG derlen = sizeof(der);
+    return ssl_util_ecdsa_sig_to_der(s->sig, s->siglen, der, &derlen) == CKR_OK;
+}
+
+/* what the verify path did before it encoded the DER itself */
+static bool bench_to_ecdsa_sig(sample *s) {
+
+    size_t len = s->siglen >> 1;
+
+    BIGNUM *r = BN_bin2bn(s->sig, len, NULL);
+    BIGNUM *sv = BN_bin2bn(&s->sig[len], len, NULL);
+    ECDSA_SIG *esig = ECDSA_SIG_new();
+    if (!r || !sv || !esig || !ECDSA_SIG_set0(esig, r, sv)) {
+        BN_free(r);
+        BN_free(sv);
+        ECDSA_SIG_free(esig);
+        return false;
+    }
+
+    ECDSA_SIG_free(esig);
+    return true;
+}
+
+static bool bench_verify(sample *s) {
+
+    return ssl_util_sig_verify(s->pkey, 0, NULL, s->digest, sizeof(s->digest),
+            s->sig, s->siglen) == CKR_OK;
+}
+
+static bool run(FILE *out, const char *curve_name, const char *op, bench_fn fn,
+        sample *s, unsigned long iterations, bool *first) {
+
+    uint64_t start = now_ns();
+    unsigned long i;
+    for (i = 0; i < iterations; i++) {
+        if (!fn(s)) {
+            fprintf(stderr, "%s failed for %s\n", op, curve_name);
+            return false;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    fprintf(out, "%s\n    {\"curve\":\"%s\",\"op\":\"%s\",\"iterations\":%lu,"
+            "\"ns_per_op\":%.1f}",
+            *first ? "" : ",", curve_name, op, iterations,
+            (double)elapsed / iterations);
+    *first = false;
+
+    return true;
+}
+
+static void usage(const char *prog) {
+
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "\n"
+        "Times the conversion of PKCS#11 ECDSA signatures to DER and whole\n"
+        "verifies for P-256 and P-384.\n"
+        "\n"
+        "Options:\n"
+        "  -i, --iterations N operations per measurement, default %u\n"
+        "  -o, --output FILE  write the JSON report to FILE, default stdout\n"
+        "  -h, --help         this help\n",
+        prog, DEFAULT_ITERATIONS);
+}
+
+int main(int argc, char *argv[]) {
+
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    const char *output = NULL;
+
+    static const struct option long_opts[] = {
+        { "iterations", required_argument, NULL, 'i' },
+        { "output",     required_argument, NULL, 'o' },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "i:o:h", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'i': {
+            char *end = NULL;
+            errno = 0;
+            iterations = strtoul(optarg, &end, 0);
+            if (errno || !end || *end || !optarg[0] || !iterations) {
+                fprintf(stderr, "Invalid argument for -%c: \"%s\"\n", c, optarg);
+                usage(argv[0]);
+                return 1;
+            }
+        } break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            fprintf(stderr, "Cannot open \"%s\": %s\n", output, strerror(errno));
+            return 1;
+        }
+    }
+
+    int ret = 1;
+
+    fprintf(out, "{\"results\":[");
+
+    bool first = true;
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(curves); i++) {
+        sample s;
+        if (!sample_init(&s, &curves[i])) {
+            EVP_PKEY_free(s.pkey);
+            goto out;
+        }
+
+        /* whole verifies are slow, a hundredth of the conversions will do */
+        unsigned long verifies = iterations / 100 ? iterations / 100 : 1;
+
+        bool ok = run(out, curves[i].name, "to-der", bench_to_der,
+                    &s, iterations, &first)
+                && run(out, curves[i].name, "to-ecdsa-sig", bench_to_ecdsa_sig,
+                    &s, iterations, &first)
+                && run(out, curves[i].name, "verify", bench_verify,
+                    &s, verifies, &first);
+        EVP_PKEY_free(s.pkey);
+        if (!ok) {
+            goto out;
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    ret = 0;
+
+out:
+    if (out != stdout) {
+        fclose(out);
+    }
+    return ret;
+}
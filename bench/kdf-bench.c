@@ -0,0 +1,188 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/*
+ * kdf-bench: cost of deriving seal object auths from PINs.
+ *
+ * Times utils_hash_pass(), which every user and SO login and every PIN change
+ * runs once, for each pin-kdf config given on the command line, to pick the
+ * cost of a token: a login pays it once on top of the TPM commands, and so
+ * does every guess of an attacker holding the store. The report is JSON.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "twist.h"
+#include "utils.h"
+
+#define DEFAULT_ITERATIONS 10
+
+static const char *default_kdfs[] = {
+    "sha256",
+    "scrypt:ln=12,r=8,p=1",
+    "scrypt:ln=14,r=8,p=1",
+    "scrypt:ln=15,r=8,p=1",
+    "scrypt:ln=16,r=8,p=1",
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static bool run_kdf(FILE *out, const char *kdf, unsigned long iterations, bool *first) {
+
+    pin_kdf k;
+    if (!utils_pin_kdf_parse(kdf, &k)) {
+        return false;
+    }
+
+    bool result = false;
+    twist auth = NULL;
+    twist salt = NULL;
+
+    twist pin = twist_new("bench-pin-1234");
+    if (!pin) {
+        fprintf(stderr, "oom\n");
+        return false;
+    }
+
+    /* a salt naming the KDF, as a PIN change makes it */
+    CK_RV rv = utils_setup_new_object_auth(pin, kdf, &auth, &salt);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "Cannot make a salt for \"%s\": 0x%lx\n", kdf, rv);
+        goto out;
+    }
+
+    uint64_t min = UINT64_MAX, max = 0, total = 0;
+    unsigned long i;
+    for (i = 0; i < iterations; i++) {
+        uint64_t start = now_ns();
+        twist again = utils_hash_pass(pin, salt);
+        uint64_t elapsed = now_ns() - start;
+        if (!again || strcmp(again, auth)) {
+            fprintf(stderr, "Derivation with \"%s\" does not repeat\n", kdf);
+            twist_free(again);
+            goto out;
+        }
+        twist_free(again);
+
+        total += elapsed;
+        min = elapsed < min ? elapsed : min;
+        max = elapsed > max ? elapsed : max;
+    }
+
+    unsigned long long mem_kib = k.alg == pin_kdf_scrypt ?
+            128ULL * k.r * (1ULL << k.ln) / 1024 : 0;
+
+    fprintf(out, "%s\n    {\"kdf\":\"%s\",\"iterations\":%lu,\"memory_kib\":%llu,"
+            "\"ms\":{\"min\":%.3f,\"mean\":%.3f,\"max\":%.3f}}",
+            *first ? "" : ",", kdf, iterations, mem_kib,
+            min / 1e6, total / 1e6 / iterations, max / 1e6);
+    *first = false;
+
+    result = true;
+
+out:
+    twist_free(pin);
+    twist_free(auth);
+    twist_free(salt);
+    return result;
+}
+
+static void usage(const char *prog) {
+
+    fprintf(stderr,
+        "Usage: %s [options] [pin-kdf...]\n"
+        "\n"
+        "Times the seal object auth derivation for each pin-kdf token config,\n"
+        "by default sha256 and scrypt with ln from 12 to 16.\n"
+        "\n"
+        "Options:\n"
+        "  -i, --iterations N derivations per config, default %u\n"
+        "  -o, --output FILE  write the JSON report to FILE, default stdout\n"
+        "  -h, --help         this help\n",
+        prog, DEFAULT_ITERATIONS);
+}
+
+int main(int argc, char *argv[]) {
+
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    const char *output = NULL;
+
+    static const struct option long_opts[] = {
+        { "iterations", required_argument, NULL, 'i' },
+        { "output",     required_argument, NULL, 'o' },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "i:o:h", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'i': {
+            char *end = NULL;
+            errno = 0;
+            iterations = strtoul(optarg, &end, 0);
+            if (errno || !end || *end || !optarg[0] || !iterations) {
+                fprintf(stderr, "Invalid argument for -%c: \"%s\"\n", c, optarg);
+                usage(argv[0]);
+                return 1;
+            }
+        } break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    const char **kdfs = default_kdfs;
+    size_t kdf_count = ARRAY_LEN(default_kdfs);
+    if (optind < argc) {
+        kdfs = (const char **)&argv[optind];
+        kdf_count = argc - optind;
+    }
+
+    FILE *out = stdout;
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            fprintf(stderr, "Cannot open \"%s\": %s\n", output, strerror(errno));
+            return 1;
+        }
+    }
+
+    int ret = 1;
+
+    fprintf(out, "{\"results\":[");
+
+    bool first = true;
+    size_t i;
+    for (i = 0; i < kdf_count; i++) {
+        if (!run_kdf(out, kdfs[i], iterations, &first)) {
+            goto out;
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    ret = 0;
+
+out:
+    if (out != stdout) {
+        fclose(out);
+    }
+    return ret;
+}
@@ -0,0 +1,924 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/*
+ * p11-bench: throughput and latency benchmark for a PKCS#11 module.
+ *
+ * Loads the module with dlopen(), resolves C_GetFunctionList and runs one or
+ * more workloads across N threads, each thread driving M sessions in a round
+ * robin fashion. Results, ops/s and latency percentiles, are written as JSON.
+ *
+ * The keys used by the workloads are looked up by label, bench/setup-store.sh
+ * provisions a store containing them. The TPM to use is selected the usual
+ * way, via TPM2_PKCS11_TCTI, so it works against swtpm or the mssim simulator.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pkcs11.h"
+
+#define ARRAY_LEN(x) (sizeof(x)/sizeof(x[0]))
+
+#define DEFAULT_MODULE       "libtpm2_pkcs11.so"
+#define DEFAULT_PIN          "myuserpin"
+#define DEFAULT_LABEL_PREFIX "p11-bench"
+#define DEFAULT_DURATION     10
+
+#define MAX_LABEL 64
+
+typedef struct bench bench;
+typedef struct bench_thread bench_thread;
+typedef struct workload workload;
+
+enum key_needs {
+    need_none = 0,
+    need_rsa  = 1 << 0,
+    need_ecc  = 1 << 1,
+    need_aes  = 1 << 2,
+};
+
+struct workload {
+    const char *name;
+    /* the timed operation */
+    CK_RV (*op)(bench_thread *t, CK_SESSION_HANDLE s);
+    /* optional untimed cleanup after each operation */
+    CK_RV (*post)(bench_thread *t, CK_SESSION_HANDLE s);
+    unsigned needs;
+    /* login state is token wide, these cannot run concurrently */
+    bool single_session;
+};
+
+struct bench {
+    CK_FUNCTION_LIST_PTR f;
+    void *dlhandle;
+
+    /* options */
+    const char *module;
+    const char *pin;
+    const char *label_prefix;
+    const char *output;
+    CK_SLOT_ID slot;
+    bool slot_set;
+    unsigned threads;
+    unsigned sessions;
+    unsigned duration;
+    unsigned long iterations;
+
+    /* keys */
+    CK_OBJECT_HANDLE rsa_priv;
+    CK_OBJECT_HANDLE rsa_pub;
+    CK_OBJECT_HANDLE ecc_priv;
+    CK_OBJECT_HANDLE aes;
+    CK_BYTE oaep_ctext[512];
+    CK_ULONG oaep_ctext_len;
+
+    /* run state */
+    int stop;
+    bool go;
+    pthread_mutex_t gate_lock;
+    pthread_cond_t gate;
+};
+
+struct bench_thread {
+    bench *b;
+    const workload *w;
+    pthread_t tid;
+
+    CK_SESSION_HANDLE *sessions;
+    unsigned session_cnt;
+
+    unsigned long ops;
+    unsigned long errors;
+    CK_RV first_error;
+
+    uint64_t *lat;
+    size_t lat_len;
+    size_t lat_cap;
+
+    /* scratch for ops that create objects */
+    CK_OBJECT_HANDLE created[2];
+};
+
+static CK_BBOOL ck_true = CK_TRUE;
+static CK_BBOOL ck_false = CK_FALSE;
+
+static CK_BYTE p256_params[] = {
+    0x06, 0x08, 0x2a, 0x86, 0x48,
+    0xce, 0x3d, 0x03, 0x01, 0x07
+};
+
+static CK_BYTE bench_data[64] = {
+    'p', '1', '1', '-', 'b', 'e', 'n', 'c', 'h'
+};
+
+static CK_RSA_PKCS_OAEP_PARAMS oaep_params = {
+    .hashAlg = CKM_SHA256,
+    .mgf = CKG_MGF1_SHA256,
+    .source = CKZ_DATA_SPECIFIED,
+    .pSourceData = NULL,
+    .ulSourceDataLen = 0,
+};
+
+static CK_BYTE aes_iv[16];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Workload operations
+ */
+static CK_RV op_sign(bench_thread *t, CK_SESSION_HANDLE s, CK_MECHANISM_TYPE m,
+        CK_OBJECT_HANDLE key, CK_ULONG datalen) {
+
+    CK_FUNCTION_LIST_PTR f = t->b->f;
+    CK_MECHANISM mech = { m, NULL, 0 };
+
+    CK_RV rv = f->C_SignInit(s, &mech, key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_BYTE sig[512];
+    CK_ULONG siglen = sizeof(sig);
+    return f->C_Sign(s, bench_data, datalen, sig, &siglen);
+}
+
+static CK_RV op_sign_rsa(bench_thread *t, CK_SESSION_HANDLE s) {
+    return op_sign(t, s, CKM_SHA256_RSA_PKCS, t->b->rsa_priv, sizeof(bench_data));
+}
+
+static CK_RV op_sign_ecdsa(bench_thread *t, CK_SESSION_HANDLE s) {
+    /* raw ECDSA over a SHA256 sized digest */
+    return op_sign(t, s, CKM_ECDSA, t->b->ecc_priv, 32);
+}
+
+static CK_RV op_oaep_decrypt(bench_thread *t, CK_SESSION_HANDLE s) {
+
+    CK_FUNCTION_LIST_PTR f = t->b->f;
+    CK_MECHANISM mech = { CKM_RSA_PKCS_OAEP, &oaep_params, sizeof(oaep_params) };
+
+    CK_RV rv = f->C_DecryptInit(s, &mech, t->b->rsa_priv);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_BYTE ptext[512];
+    CK_ULONG ptextlen = sizeof(ptext);
+    return f->C_Decrypt(s, t->b->oaep_ctext, t->b->oaep_ctext_len, ptext, &ptextlen);
+}
+
+static CK_RV op_aes_encrypt(bench_thread *t, CK_SESSION_HANDLE s) {
+
+    CK_FUNCTION_LIST_PTR f = t->b->f;
+    CK_MECHANISM mech = { CKM_AES_CBC, aes_iv, sizeof(aes_iv) };
+
+    CK_RV rv = f->C_EncryptInit(s, &mech, t->b->aes);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_BYTE ctext[sizeof(bench_data)];
+    CK_ULONG ctextlen = sizeof(ctext);
+    return f->C_Encrypt(s, bench_data, sizeof(bench_data), ctext, &ctextlen);
+}
+
+static CK_RV op_find_objects(bench_thread *t, CK_SESSION_HANDLE s) {
+
+    CK_FUNCTION_LIST_PTR f = t->b->f;
+
+    CK_OBJECT_CLASS cls = CKO_PRIVATE_KEY;
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &cls, sizeof(cls) },
+    };
+
+    CK_RV rv = f->C_FindObjectsInit(s, tmpl, ARRAY_LEN(tmpl));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_OBJECT_HANDLE objs[16];
+    CK_ULONG count;
+    do {
+        rv = f->C_FindObjects(s, objs, ARRAY_LEN(objs), &count);
+    } while (rv == CKR_OK && count == ARRAY_LEN(objs));
+
+    CK_RV rv2 = f->C_FindObjectsFinal(s);
+
+    return rv != CKR_OK ? rv : rv2;
+}
+
+static CK_RV op_get_attribute(bench_thread *t, CK_SESSION_HANDLE s) {
+
+    CK_FUNCTION_LIST_PTR f = t->b->f;
+
+    CK_BYTE modulus[512];
+    CK_BYTE exponent[8];
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_MODULUS, modulus, sizeof(modulus) },
+        { CKA_PUBLIC_EXPONENT, exponent, sizeof(exponent) },
+    };
+
+    return f->C_GetAttributeValue(s, t->b->rsa_pub, tmpl, ARRAY_LEN(tmpl));
+}
+
+static CK_RV op_random(bench_thread *t, CK_SESSION_HANDLE s) {
+
+    CK_BYTE buf[32];
+    return t->b->f->C_GenerateRandom(s, buf, sizeof(buf));
+}
+
+static CK_RV op_login_logout(bench_thread *t, CK_SESSION_HANDLE s) {
+
+    CK_FUNCTION_LIST_PTR f = t->b->f;
+
+    CK_RV rv = f->C_Logout(s);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return f->C_Login(s, CKU_USER, (CK_UTF8CHAR_PTR)t->b->pin, strlen(t->b->pin));
+}
+
+static CK_RV op_keygen(bench_thread *t, CK_SESSION_HANDLE s, bool is_rsa) {
+
+    CK_FUNCTION_LIST_PTR f = t->b->f;
+
+    CK_UTF8CHAR label[] = "p11-bench-keygen";
+    CK_ULONG bits = 2048;
+    CK_BYTE exp[] = { 0x01, 0x00, 0x01 };
+
+    CK_ATTRIBUTE rsa_pub[] = {
+        { CKA_TOKEN, &ck_true, sizeof(ck_true) },
+        { CKA_VERIFY, &ck_true, sizeof(ck_true) },
+        { CKA_MODULUS_BITS, &bits, sizeof(bits) },
+        { CKA_PUBLIC_EXPONENT, exp, sizeof(exp) },
+        { CKA_LABEL, label, sizeof(label) - 1 },
+    };
+
+    CK_ATTRIBUTE ecc_pub[] = {
+        { CKA_TOKEN, &ck_true, sizeof(ck_true) },
+        { CKA_VERIFY, &ck_true, sizeof(ck_true) },
+        { CKA_EC_PARAMS, p256_params, sizeof(p256_params) },
+        { CKA_LABEL, label, sizeof(label) - 1 },
+    };
+
+    CK_ATTRIBUTE priv[] = {
+        { CKA_TOKEN, &ck_true, sizeof(ck_true) },
+        { CKA_PRIVATE, &ck_true, sizeof(ck_true) },
+        { CKA_SIGN, &ck_true, sizeof(ck_true) },
+        { CKA_EXTRACTABLE, &ck_false, sizeof(ck_false) },
+        { CKA_LABEL, label, sizeof(label) - 1 },
+    };
+
+    CK_MECHANISM mech = {
+        is_rsa ? CKM_RSA_PKCS_KEY_PAIR_GEN : CKM_EC_KEY_PAIR_GEN, NULL, 0
+    };
+
+    return f->C_GenerateKeyPair(s, &mech,
+            is_rsa ? rsa_pub : ecc_pub,
+            is_rsa ? ARRAY_LEN(rsa_pub) : ARRAY_LEN(ecc_pub),
+            priv, ARRAY_LEN(priv),
+            &t->created[0], &t->created[1]);
+}
+
+static CK_RV op_keygen_rsa(bench_thread *t, CK_SESSION_HANDLE s) {
+    return op_keygen(t, s, true);
+}
+
+static CK_RV op_keygen_ecc(bench_thread *t, CK_SESSION_HANDLE s) {
+    return op_keygen(t, s, false);
+}
+
+static CK_RV post_destroy_created(bench_thread *t, CK_SESSION_HANDLE s) {
+
+    CK_RV rv = CKR_OK;
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(t->created); i++) {
+        if (t->created[i] != CK_INVALID_HANDLE) {
+            CK_RV tmp = t->b->f->C_DestroyObject(s, t->created[i]);
+            if (tmp != CKR_OK) {
+                rv = tmp;
+            }
+            t->created[i] = CK_INVALID_HANDLE;
+        }
+    }
+
+    return rv;
+}
+
+static const workload workloads[] = {
+    { .name = "sign-rsa",       .op = op_sign_rsa,       .needs = need_rsa },
+    { .name = "sign-ecdsa",     .op = op_sign_ecdsa,     .needs = need_ecc },
+    { .name = "oaep-decrypt",   .op = op_oaep_decrypt,   .needs = need_rsa },
+    { .name = "aes-encrypt",    .op = op_aes_encrypt,    .needs = need_aes },
+    { .name = "find-objects",   .op = op_find_objects,   .needs = need_none },
+    { .name = "get-attribute",  .op = op_get_attribute,  .needs = need_rsa },
+    { .name = "random",         .op = op_random,         .needs = need_none },
+    { .name = "login-logout",   .op = op_login_logout,   .needs = need_none,
+            .single_session = true },
+    { .name = "keygen-rsa",     .op = op_keygen_rsa,     .needs = need_none,
+            .post = post_destroy_created },
+    { .name = "keygen-ecc",     .op = op_keygen_ecc,     .needs = need_none,
+            .post = post_destroy_created },
+};
+
+static const workload *workload_find(const char *name) {
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(workloads); i++) {
+        if (!strcmp(workloads[i].name, name)) {
+            return &workloads[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Setup
+ */
+static CK_RV load_module(bench *b) {
+
+    b->dlhandle = dlopen(b->module, RTLD_NOW | RTLD_LOCAL);
+    if (!b->dlhandle) {
+        fprintf(stderr, "dlopen(%s): %s\n", b->module, dlerror());
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_C_GetFunctionList get_func_list =
+            (CK_C_GetFunctionList)dlsym(b->dlhandle, "C_GetFunctionList");
+    if (!get_func_list) {
+        fprintf(stderr, "dlsym(C_GetFunctionList): %s\n", dlerror());
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = get_func_list(&b->f);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "C_GetFunctionList: 0x%lx\n", rv);
+        return rv;
+    }
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    rv = b->f->C_Initialize(&args);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "C_Initialize: 0x%lx\n", rv);
+    }
+
+    return rv;
+}
+
+static CK_RV find_slot(bench *b) {
+
+    if (b->slot_set) {
+        return CKR_OK;
+    }
+
+    CK_SLOT_ID slots[64];
+    CK_ULONG count = ARRAY_LEN(slots);
+    CK_RV rv = b->f->C_GetSlotList(CK_TRUE, slots, &count);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "C_GetSlotList: 0x%lx\n", rv);
+        return rv;
+    }
+
+    CK_ULONG i;
+    for (i = 0; i < count; i++) {
+        CK_TOKEN_INFO info;
+        rv = b->f->C_GetTokenInfo(slots[i], &info);
+        if (rv == CKR_OK && (info.flags & CKF_TOKEN_INITIALIZED)) {
+            b->slot = slots[i];
+            return CKR_OK;
+        }
+    }
+
+    fprintf(stderr, "No initialized token found, see bench/setup-store.sh\n");
+    return CKR_TOKEN_NOT_PRESENT;
+}
+
+static CK_OBJECT_HANDLE find_key(bench *b, CK_SESSION_HANDLE s,
+        CK_OBJECT_CLASS cls, const char *suffix) {
+
+    char label[MAX_LABEL];
+    snprintf(label, sizeof(label), "%s-%s", b->label_prefix, suffix);
+
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &cls, sizeof(cls) },
+        { CKA_LABEL, label, strlen(label) },
+    };
+
+    CK_OBJECT_HANDLE obj = CK_INVALID_HANDLE;
+    CK_RV rv = b->f->C_FindObjectsInit(s, tmpl, ARRAY_LEN(tmpl));
+    if (rv != CKR_OK) {
+        return CK_INVALID_HANDLE;
+    }
+
+    CK_ULONG count = 0;
+    rv = b->f->C_FindObjects(s, &obj, 1, &count);
+    b->f->C_FindObjectsFinal(s);
+
+    return (rv == CKR_OK && count == 1) ? obj : CK_INVALID_HANDLE;
+}
+
+static CK_RV setup(bench *b, CK_SESSION_HANDLE *s) {
+
+    CK_RV rv = b->f->C_OpenSession(b->slot, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+            NULL, NULL, s);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "C_OpenSession: 0x%lx\n", rv);
+        return rv;
+    }
+
+    /* login state is shared by all sessions of the application */
+    rv = b->f->C_Login(*s, CKU_USER, (CK_UTF8CHAR_PTR)b->pin, strlen(b->pin));
+    if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
+        fprintf(stderr, "C_Login: 0x%lx\n", rv);
+        return rv;
+    }
+
+    b->rsa_priv = find_key(b, *s, CKO_PRIVATE_KEY, "rsa");
+    b->rsa_pub = find_key(b, *s, CKO_PUBLIC_KEY, "rsa");
+    b->ecc_priv = find_key(b, *s, CKO_PRIVATE_KEY, "ecc");
+    b->aes = find_key(b, *s, CKO_SECRET_KEY, "aes");
+
+    if (b->rsa_pub != CK_INVALID_HANDLE) {
+        CK_MECHANISM mech = { CKM_RSA_PKCS_OAEP, &oaep_params, sizeof(oaep_params) };
+        rv = b->f->C_EncryptInit(*s, &mech, b->rsa_pub);
+        if (rv == CKR_OK) {
+            b->oaep_ctext_len = sizeof(b->oaep_ctext);
+            rv = b->f->C_Encrypt(*s, bench_data, 32, b->oaep_ctext, &b->oaep_ctext_len);
+        }
+        if (rv != CKR_OK) {
+            fprintf(stderr, "Could not create OAEP ciphertext: 0x%lx\n", rv);
+            b->oaep_ctext_len = 0;
+        }
+    }
+
+    return CKR_OK;
+}
+
+static bool workload_runnable(bench *b, const workload *w) {
+
+    if ((w->needs & need_rsa)
+            && (b->rsa_priv == CK_INVALID_HANDLE || b->rsa_pub == CK_INVALID_HANDLE
+                    || !b->oaep_ctext_len)) {
+        return false;
+    }
+
+    if ((w->needs & need_ecc) && b->ecc_priv == CK_INVALID_HANDLE) {
+        return false;
+    }
+
+    if ((w->needs & need_aes) && b->aes == CK_INVALID_HANDLE) {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Runner
+ */
+static bool lat_push(bench_thread *t, uint64_t v) {
+
+    if (t->lat_len == t->lat_cap) {
+        size_t cap = t->lat_cap ? t->lat_cap * 2 : 4096;
+        uint64_t *tmp = realloc(t->lat, cap * sizeof(*tmp));
+        if (!tmp) {
+            return false;
+        }
+        t->lat = tmp;
+        t->lat_cap = cap;
+    }
+
+    t->lat[t->lat_len++] = v;
+    return true;
+}
+
+static void *thread_main(void *arg) {
+
+    bench_thread *t = (bench_thread *)arg;
+    bench *b = t->b;
+    const workload *w = t->w;
+
+    /* all threads start together once the main thread opens the gate */
+    pthread_mutex_lock(&b->gate_lock);
+    while (!b->go) {
+        pthread_cond_wait(&b->gate, &b->gate_lock);
+    }
+    pthread_mutex_unlock(&b->gate_lock);
+
+    unsigned long i;
+    for (i = 0; ; i++) {
+        if (__atomic_load_n(&b->stop, __ATOMIC_RELAXED)
+                || (b->iterations && i >= b->iterations)) {
+            break;
+        }
+
+        CK_SESSION_HANDLE s = t->sessions[i % t->session_cnt];
+
+        uint64_t start = now_ns();
+        CK_RV rv = w->op(t, s);
+        uint64_t end = now_ns();
+
+        if (w->post) {
+            CK_RV tmp = w->post(t, s);
+            if (rv == CKR_OK) {
+                rv = tmp;
+            }
+        }
+
+        t->ops++;
+        if (rv != CKR_OK) {
+            if (!t->errors) {
+                t->first_error = rv;
+            }
+            t->errors++;
+            continue;
+        }
+
+        if (!lat_push(t, end - start)) {
+            fprintf(stderr, "oom recording latency\n");
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p) {
+
+    if (!n) {
+        return 0;
+    }
+
+    size_t idx = (size_t)((p / 100.0) * (double)n + 0.999999);
+    if (idx == 0) {
+        idx = 1;
+    }
+    if (idx > n) {
+        idx = n;
+    }
+
+    return sorted[idx - 1];
+}
+
+static CK_RV run_workload(bench *b, const workload *w, FILE *out, bool first) {
+
+    unsigned threads = w->single_session ? 1 : b->threads;
+    unsigned sessions = w->single_session ? 1 : b->sessions;
+
+    if (w->single_session && (b->threads > 1 || b->sessions > 1)) {
+        fprintf(stderr, "%s: login state is token wide, running with 1 thread and 1 session\n",
+                w->name);
+    }
+
+    bench_thread *t = calloc(threads, sizeof(*t));
+    if (!t) {
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_RV rv = CKR_OK;
+    unsigned i, j;
+    for (i = 0; i < threads; i++) {
+        t[i].b = b;
+        t[i].w = w;
+        t[i].sessions = calloc(sessions, sizeof(CK_SESSION_HANDLE));
+        if (!t[i].sessions) {
+            rv = CKR_HOST_MEMORY;
+            goto out;
+        }
+        for (j = 0; j < sessions; j++) {
+            rv = b->f->C_OpenSession(b->slot, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+                    NULL, NULL, &t[i].sessions[j]);
+            if (rv != CKR_OK) {
+                fprintf(stderr, "C_OpenSession: 0x%lx\n", rv);
+                goto out;
+            }
+            t[i].session_cnt++;
+        }
+    }
+
+    b->stop = 0;
+    b->go = false;
+
+    unsigned started = 0;
+    for (i = 0; i < threads; i++) {
+        int rc = pthread_create(&t[i].tid, NULL, thread_main, &t[i]);
+        if (rc) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            /* let the threads that did start run out immediately */
+            __atomic_store_n(&b->stop, 1, __ATOMIC_RELAXED);
+            rv = CKR_GENERAL_ERROR;
+            break;
+        }
+        started++;
+    }
+
+    pthread_mutex_lock(&b->gate_lock);
+    b->go = true;
+    pthread_cond_broadcast(&b->gate);
+    pthread_mutex_unlock(&b->gate_lock);
+
+    uint64_t start = now_ns();
+
+    if (rv == CKR_OK && !b->iterations) {
+        sleep(b->duration);
+        __atomic_store_n(&b->stop, 1, __ATOMIC_RELAXED);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(t[i].tid, NULL);
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
+    /* merge */
+    unsigned long ops = 0, errors = 0;
+    size_t n = 0;
+    CK_RV first_error = CKR_OK;
+    for (i = 0; i < threads; i++) {
+        ops += t[i].ops;
+        errors += t[i].errors;
+        n += t[i].lat_len;
+        if (first_error == CKR_OK && t[i].errors) {
+            first_error = t[i].first_error;
+        }
+    }
+
+    uint64_t *all = malloc((n ? n : 1) * sizeof(*all));
+    if (!all) {
+        rv = CKR_HOST_MEMORY;
+        goto out;
+    }
+
+    size_t off = 0;
+    uint64_t sum = 0;
+    for (i = 0; i < threads; i++) {
+        memcpy(&all[off], t[i].lat, t[i].lat_len * sizeof(*all));
+        off += t[i].lat_len;
+    }
+    for (off = 0; off < n; off++) {
+        sum += all[off];
+    }
+
+    qsort(all, n, sizeof(*all), cmp_u64);
+
+    double secs = (double)elapsed / 1e9;
+    fprintf(out, "%s\n    {\"workload\":\"%s\",\"threads\":%u,\"sessions_per_thread\":%u,"
+            "\"ops\":%lu,\"errors\":%lu,\"first_error\":\"0x%lx\",\"seconds\":%.3f,"
+            "\"ops_per_sec\":%.2f,\"latency_us\":{\"min\":%.1f,\"mean\":%.1f,"
+            "\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}",
+            first ? "" : ",", w->name, threads, sessions, ops, errors, first_error,
+            secs, secs > 0 ? (double)(ops - errors) / secs : 0.0,
+            n ? (double)all[0] / 1e3 : 0.0,
+            n ? (double)sum / (double)n / 1e3 : 0.0,
+            (double)percentile(all, n, 50.0) / 1e3,
+            (double)percentile(all, n, 90.0) / 1e3,
+            (double)percentile(all, n, 99.0) / 1e3,
+            (double)percentile(all, n, 99.9) / 1e3,
+            n ? (double)all[n - 1] / 1e3 : 0.0);
+
+    free(all);
+
+out:
+    for (i = 0; i < threads; i++) {
+        for (j = 0; j < t[i].session_cnt; j++) {
+            b->f->C_CloseSession(t[i].sessions[j]);
+        }
+        free(t[i].sessions);
+        free(t[i].lat);
+    }
+    free(t);
+
+    return rv;
+}
+
+static void usage(const char *prog) {
+
+    fprintf(stderr,
+        "Usage: %s [options] [workload ...]\n"
+        "\n"
+        "Options:\n"
+        "  -m, --module PATH      PKCS#11 module, default $TPM2_PKCS11_MODULE or " DEFAULT_MODULE "\n"
+        "  -s, --slot ID          slot to use, default is the first initialized token\n"
+        "  -p, --pin PIN          user pin, default " DEFAULT_PIN "\n"
+        "  -l, --label-prefix P   key label prefix, default " DEFAULT_LABEL_PREFIX "\n"
+        "  -t, --threads N        number of threads, default 1\n"
+        "  -S, --sessions M       sessions per thread, default 1\n"
+        "  -d, --duration SECS    run each workload for SECS seconds, default %u\n"
+        "  -n, --iterations N     run each workload N times per thread instead\n"
+        "  -o, --output FILE      write the JSON report to FILE, default stdout\n"
+        "  -h, --help             this help\n"
+        "\n"
+        "Workloads, default all:\n",
+        prog, DEFAULT_DURATION);
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(workloads); i++) {
+        fprintf(stderr, "  %s\n", workloads[i].name);
+    }
+}
+
+static bool parse_ul(const char *s, unsigned long *v) {
+
+    char *end = NULL;
+    errno = 0;
+    *v = strtoul(s, &end, 0);
+    return !errno && end && !*end && s[0];
+}
+
+int main(int argc, char *argv[]) {
+
+    bench b = {
+        .module = getenv("TPM2_PKCS11_MODULE"),
+        .pin = DEFAULT_PIN,
+        .label_prefix = DEFAULT_LABEL_PREFIX,
+        .threads = 1,
+        .sessions = 1,
+        .duration = DEFAULT_DURATION,
+        .gate_lock = PTHREAD_MUTEX_INITIALIZER,
+        .gate = PTHREAD_COND_INITIALIZER,
+    };
+
+    if (!b.module) {
+        b.module = DEFAULT_MODULE;
+    }
+
+    static const struct option long_opts[] = {
+        { "module",       required_argument, NULL, 'm' },
+        { "slot",         required_argument, NULL, 's' },
+        { "pin",          required_argument, NULL, 'p' },
+        { "label-prefix", required_argument, NULL, 'l' },
+        { "threads",      required_argument, NULL, 't' },
+        { "sessions",     required_argument, NULL, 'S' },
+        { "duration",     required_argument, NULL, 'd' },
+        { "iterations",   required_argument, NULL, 'n' },
+        { "output",       required_argument, NULL, 'o' },
+        { "help",         no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int c;
+    unsigned long v;
+    while ((c = getopt_long(argc, argv, "m:s:p:l:t:S:d:n:o:h", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'm':
+            b.module = optarg;
+            break;
+        case 's':
+            if (!parse_ul(optarg, &v)) {
+                goto bad_arg;
+            }
+            b.slot = v;
+            b.slot_set = true;
+            break;
+        case 'p':
+            b.pin = optarg;
+            break;
+        case 'l':
+            b.label_prefix = optarg;
+            break;
+        case 't':
+            if (!parse_ul(optarg, &v) || !v || v > 1024) {
+                goto bad_arg;
+            }
+            b.threads = v;
+            break;
+        case 'S':
+            if (!parse_ul(optarg, &v) || !v || v > 1024) {
+                goto bad_arg;
+            }
+            b.sessions = v;
+            break;
+        case 'd':
+            if (!parse_ul(optarg, &v) || !v) {
+                goto bad_arg;
+            }
+            b.duration = v;
+            break;
+        case 'n':
+            if (!parse_ul(optarg, &v) || !v) {
+                goto bad_arg;
+            }
+            b.iterations = v;
+            break;
+        case 'o':
+            b.output = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    int i;
+    for (i = optind; i < argc; i++) {
+        if (!workload_find(argv[i])) {
+            fprintf(stderr, "Unknown workload: %s\n", argv[i]);
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    FILE *out = stdout;
+    if (b.output) {
+        out = fopen(b.output, "w");
+        if (!out) {
+            fprintf(stderr, "fopen(%s): %s\n", b.output, strerror(errno));
+            return 1;
+        }
+    }
+
+    int ret = 1;
+    CK_SESSION_HANDLE setup_session = CK_INVALID_HANDLE;
+
+    CK_RV rv = load_module(&b);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
+    rv = find_slot(&b);
+    if (rv != CKR_OK) {
+        goto finalize;
+    }
+
+    rv = setup(&b, &setup_session);
+    if (rv != CKR_OK) {
+        goto finalize;
+    }
+
+    fprintf(out, "{\"module\":\"%s\",\"slot\":%lu,\"results\":[", b.module, b.slot);
+
+    bool first = true;
+    size_t nworkloads = optind < argc ? (size_t)(argc - optind) : ARRAY_LEN(workloads);
+    size_t k;
+    for (k = 0; k < nworkloads; k++) {
+        const workload *w = optind < argc ? workload_find(argv[optind + k]) : &workloads[k];
+        if (!workload_runnable(&b, w)) {
+            fprintf(stderr, "Skipping %s: required key \"%s-*\" not found\n",
+                    w->name, b.label_prefix);
+            continue;
+        }
+
+        fprintf(stderr, "Running %s\n", w->name);
+        rv = run_workload(&b, w, out, first);
+        if (rv != CKR_OK) {
+            fprintf(stderr, "%s failed: 0x%lx\n", w->name, rv);
+            break;
+        }
+        first = false;
+    }
+
+    fprintf(out, "\n]}\n");
+
+    ret = rv == CKR_OK ? 0 : 1;
+
+finalize:
+    if (setup_session != CK_INVALID_HANDLE) {
+        b.f->C_CloseSession(setup_session);
+    }
+    b.f->C_Finalize(NULL);
+out:
+    if (b.dlhandle) {
+        dlclose(b.dlhandle);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return ret;
+
+bad_arg:
+    fprintf(stderr, "Invalid argument for -%c: %s\n", c, optarg);
+    usage(argv[0]);
+    return 2;
+}
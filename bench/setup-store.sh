@@ -0,0 +1,67 @@
+# SPDX-License-Identifier: BSD-2-Clause
+#!/usr/bin/env bash
+#
+# Creates a tpm2-pkcs11 store populated with the keys p11-bench looks for.
+#
+# The TPM is selected with TPM2TOOLS_TCTI for tpm2_ptool and TPM2_PKCS11_TCTI
+# for the library, for example for swtpm:
+#   export TPM2TOOLS_TCTI=swtpm:port=2321
+#   export TPM2_PKCS11_TCTI=swtpm:port=2321
+#
+
+set -e
+
+usage_error ()
+{
+    echo "$0: $*" >&2
+    print_usage >&2
+    exit 2
+}
+print_usage ()
+{
+    cat <<END
+Usage:
+	setup-store.sh --path=STORE [--userpin=PIN] [--sopin=PIN] [--key-label-prefix=PREFIX]
+
+END
+}
+
+STORE=""
+USERPIN="myuserpin"
+SOPIN="mysopin"
+PREFIX="p11-bench"
+while test $# -gt 0; do
+    case $1 in
+    --help) print_usage; exit $?;;
+    -p|--path) STORE=$2; shift;;
+    -p=*|--path=*) STORE="${1#*=}";;
+    --userpin=*) USERPIN="${1#*=}";;
+    --sopin=*) SOPIN="${1#*=}";;
+    --key-label-prefix=*) PREFIX="${1#*=}";;
+    --) shift; break;;
+    -*) usage_error "invalid option: '$1'";;
+     *) break;;
+    esac
+    shift
+done
+
+if [ -z "$STORE" ]; then
+    usage_error "--path is required"
+fi
+
+if ! which tpm2_ptool > /dev/null; then
+    echo "tpm2_ptool NOT ON PATH, ADD TO PATH"
+    exit 1
+fi
+
+mkdir -p "$STORE"
+
+tpm2_ptool init --path="$STORE"
+tpm2_ptool addtoken --pid=1 --sopin="$SOPIN" --userpin="$USERPIN" --label=p11-bench --path="$STORE"
+
+# C_GenerateKey is not supported by the library, so the AES key has to come from here.
+tpm2_ptool addkey --algorithm=rsa2048 --label=p11-bench --key-label="$PREFIX-rsa" --userpin="$USERPIN" --path="$STORE"
+tpm2_ptool addkey --algorithm=ecc256 --label=p11-bench --key-label="$PREFIX-ecc" --userpin="$USERPIN" --path="$STORE"
+tpm2_ptool addkey --algorithm=aes256 --label=p11-bench --key-label="$PREFIX-aes" --userpin="$USERPIN" --path="$STORE"
+
+echo "Store created, run p11-bench with TPM2_PKCS11_STORE=$STORE"
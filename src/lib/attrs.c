@@ -169,6 +169,7 @@ static attr_handler2 attr_handlers[] = {
     ADD_ATTR_HANDLER(CKA_TPM2_OBJAUTH_ENC, TYPE_BYTE_HEX_STR),
     ADD_ATTR_HANDLER(CKA_TPM2_PUB_BLOB, TYPE_BYTE_HEX_STR),
     ADD_ATTR_HANDLER(CKA_TPM2_PRIV_BLOB, TYPE_BYTE_HEX_STR),
+    ADD_ATTR_HANDLER(CKA_TPM2_PERSISTENT_TR, TYPE_BYTE_HEX_STR),
 };
 
 static attr_handler2 default_handler = { .memtype = 0 };
@@ -209,6 +210,38 @@ bool attr_list_add_buf(attr_list *l, CK_ATTRIBUTE_TYPE type, CK_BYTE_PTR value,
     return _attr_list_add(l, type, len, value, TYPE_BYTE_HEX_STR);
 }
 
+bool attr_list_add_typed(attr_list *l, CK_ATTRIBUTE_TYPE type, CK_BYTE memtype,
+        CK_BYTE_PTR value, CK_ULONG len) {
+
+    switch (memtype) {
+    case TYPE_BYTE_INT:
+        if (len != sizeof(CK_ULONG)) {
+            LOGE("Expected CK_ULONG for 0x%lx, got %lu bytes", type, len);
+            return false;
+        }
+        break;
+    case TYPE_BYTE_BOOL:
+        if (len != sizeof(CK_BBOOL)) {
+            LOGE("Expected CK_BBOOL for 0x%lx, got %lu bytes", type, len);
+            return false;
+        }
+        break;
+    case TYPE_BYTE_INT_SEQ:
+        if (len % sizeof(CK_ULONG)) {
+            LOGE("Expected CK_ULONG array for 0x%lx, got %lu bytes", type, len);
+            return false;
+        }
+        break;
+    case TYPE_BYTE_HEX_STR:
+        break;
+    default:
+        LOGE("Unknown type data for 0x%lx, got: %u", type, memtype);
+        return false;
+    }
+
+    return _attr_list_add(l, type, len, value, memtype);
+}
+
 CK_ULONG attr_list_get_count(attr_list *l) {
     assert(l);
     return l->count;
@@ -15,6 +15,7 @@
 #define CKA_TPM2_PUB_BLOB    (CKA_VENDOR_DEFINED|CKA_VENDOR_TPM2_DEFINED|0x2UL)
 #define CKA_TPM2_PRIV_BLOB   (CKA_VENDOR_DEFINED|CKA_VENDOR_TPM2_DEFINED|0x3UL)
 #define CKA_TPM2_ENC_BLOB    (CKA_VENDOR_DEFINED|CKA_VENDOR_TPM2_DEFINED|0x4UL)
+#define CKA_TPM2_PERSISTENT_TR (CKA_VENDOR_DEFINED|CKA_VENDOR_TPM2_DEFINED|0x5UL)
 
 /* Invalid values for error detection */
 #define CK_OBJECT_CLASS_BAD (~(CK_OBJECT_CLASS)0)
@@ -104,6 +105,25 @@ bool attr_list_add_bool(attr_list *l, CK_ATTRIBUTE_TYPE type, CK_BBOOL value);
  */
 bool attr_list_add_int(attr_list *l, CK_ATTRIBUTE_TYPE type, CK_ULONG value);
 
+/**
+ * Adds a buffer to the attribute list with the given type data, for values
+ * that were stored along with their type, see type_from_ptr().
+ * @param l
+ *  The list to add to.
+ * @param type
+ *  The attribute type to add.
+ * @param memtype
+ *  One of the TYPE_BYTE_* values.
+ * @param value
+ *  The buffer, can be NULL.
+ * @param len
+ *  The length of the buffer, it must match memtype for ints and bools.
+ * @return
+ *  true on success, false otherwise.
+ */
+bool attr_list_add_typed(attr_list *l, CK_ATTRIBUTE_TYPE type, CK_BYTE memtype,
+        CK_BYTE_PTR value, CK_ULONG len);
+
 /**
  * Returns the count items in the attribute list.
  *
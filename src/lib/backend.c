@@ -306,7 +306,7 @@ CK_RV backend_update_tobject_attrs(token *tok, tobject *tobj, attr_list *attrs)
 
     switch (tok->type) {
     case token_type_esysdb:
-        return backend_esysdb_update_tobject_attrs(tobj, attrs);
+        return backend_esysdb_update_tobject_attrs(tok, tobj, attrs);
     case token_type_fapi:
         return backend_fapi_update_tobject_attrs(tok, tobj, attrs);
     default:
@@ -328,7 +328,7 @@ CK_RV backend_rm_tobject(token *tok, tobject *tobj) {
 
     switch (tok->type) {
     case token_type_esysdb:
-        return backend_esysdb_rm_tobject(tobj);
+        return backend_esysdb_rm_tobject(tok, tobj);
     case token_type_fapi:
         return backend_fapi_rm_tobject(tok, tobj);
     default:
@@ -337,6 +337,279 @@ CK_RV backend_rm_tobject(token *tok, tobject *tobj) {
     }
 }
 
+/**
+ * Picks up tobjects other processes added, modified or removed in the backend
+ * since the token was loaded or last refreshed.
+ * @param tok
+ *  The token to refresh.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV backend_refresh_tobjects(token *tok) {
+
+    switch (tok->type) {
+    case token_type_esysdb:
+        return backend_esysdb_refresh_tobjects(tok);
+    case token_type_fapi:
+        /* FAPI objects are only read at C_Initialize */
+        return CKR_OK;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
+/**
+ * Asks the backend for the objects that can match a search template, so a
+ * search does not have to compare every object of a large token.
+ * @param tok
+ *  The token to search.
+ * @param templ
+ *  The search template.
+ * @param count
+ *  The number of attributes in templ.
+ * @param ids
+ *  The ids of the candidate tobjects in ascending order, they still need
+ *  to be matched against templ. Free with free().
+ * @param len
+ *  The number of ids.
+ * @return
+ *  CKR_OK on success, CKR_FUNCTION_NOT_SUPPORTED when the backend cannot
+ *  narrow the search and every object is a candidate, anything else is an
+ *  error.
+ */
+CK_RV backend_find_tobjects(token *tok, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        unsigned **ids, size_t *len) {
+
+    switch (tok->type) {
+    case token_type_esysdb:
+        return backend_esysdb_find_tobjects(tok, templ, count, ids, len);
+    case token_type_fapi:
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
+/**
+ * Reads a CKA_VALUE the backend keeps out of the attributes of a tobject,
+ * see tobject::ext_value_len.
+ * @param tok
+ *  The token the tobject belongs to.
+ * @param tobj
+ *  The tobject to read the value of.
+ * @param buf
+ *  The buffer to read the value into.
+ * @param len
+ *  The length of buf, must be the length of the value.
+ * @return
+ *  CKR_OK on success, CKR_FUNCTION_NOT_SUPPORTED if the backend keeps all
+ *  values in the attributes.
+ */
+CK_RV backend_read_tobject_value(token *tok, tobject *tobj, CK_BYTE_PTR buf, CK_ULONG len) {
+
+    switch (tok->type) {
+    case token_type_esysdb:
+        return backend_esysdb_read_tobject_value(tok, tobj, buf, len);
+    case token_type_fapi:
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
+/**
+ * Adds a key created ahead of time to the key pool of a token.
+ * @param tok
+ *  The token owning the key.
+ * @param template
+ *  The marshalled TPM2B_PUBLIC the key was created from.
+ * @param pubblob
+ *  The public blob of the key.
+ * @param privblob
+ *  The private blob of the key.
+ * @param objauth
+ *  The wrapped auth value of the key.
+ * @return
+ *  CKR_OK on success, CKR_FUNCTION_NOT_SUPPORTED if the backend has no
+ *  key pool.
+ */
+CK_RV backend_keypool_add(token *tok, twist template, twist pubblob,
+        twist privblob, twist objauth) {
+
+    switch (tok->type) {
+    case token_type_esysdb:
+        return backend_esysdb_keypool_add(tok, template, pubblob, privblob, objauth);
+    case token_type_fapi:
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
+/**
+ * Takes a key created from template out of the key pool of a token.
+ * @param tok
+ *  The token owning the key.
+ * @param template
+ *  The marshalled TPM2B_PUBLIC the key must have been created from.
+ * @param pubblob
+ *  The public blob of the key, NULL when the pool had no such key.
+ * @param privblob
+ *  The private blob of the key.
+ * @param objauth
+ *  The wrapped auth value of the key.
+ * @return
+ *  CKR_OK on success, CKR_FUNCTION_NOT_SUPPORTED if the backend has no
+ *  key pool.
+ */
+CK_RV backend_keypool_claim(token *tok, twist template, twist *pubblob,
+        twist *privblob, twist *objauth) {
+
+    switch (tok->type) {
+    case token_type_esysdb:
+        return backend_esysdb_keypool_claim(tok, template, pubblob, privblob, objauth);
+    case token_type_fapi:
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
+/**
+ * Counts the keys created from template in the key pool of a token.
+ * @param tok
+ *  The token owning the keys.
+ * @param template
+ *  The marshalled TPM2B_PUBLIC.
+ * @param count
+ *  The number of keys.
+ * @return
+ *  CKR_OK on success, CKR_FUNCTION_NOT_SUPPORTED if the backend has no
+ *  key pool.
+ */
+CK_RV backend_keypool_count(token *tok, twist template, unsigned *count) {
+
+    switch (tok->type) {
+    case token_type_esysdb:
+        return backend_esysdb_keypool_count(tok, template, count);
+    case token_type_fapi:
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
+/**
+ * Reads the context a process saved of the transient primary object of a
+ * token, so it can be loaded rather than created.
+ * @param tok
+ *  The token whose primary object to look up.
+ * @param reset_count
+ *  The TPM resetCount the context was saved at.
+ * @param context
+ *  The marshalled TPMS_CONTEXT, NULL when none was saved.
+ * @return
+ *  CKR_OK on success, CKR_FUNCTION_NOT_SUPPORTED if the backend does not
+ *  keep contexts.
+ */
+CK_RV backend_get_pobject_context(token *tok, uint32_t *reset_count, twist *context) {
+
+    switch (tok->type) {
+    case token_type_esysdb:
+        return backend_esysdb_get_pobject_context(tok, reset_count, context);
+    case token_type_fapi:
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
+/**
+ * Saves the context of the transient primary object of a token for other
+ * processes.
+ * @param tok
+ *  The token whose primary object was created.
+ * @param reset_count
+ *  The TPM resetCount the context is valid for.
+ * @param context
+ *  The marshalled TPMS_CONTEXT.
+ * @return
+ *  CKR_OK on success, CKR_FUNCTION_NOT_SUPPORTED if the backend does not
+ *  keep contexts.
+ */
+CK_RV backend_set_pobject_context(token *tok, uint32_t reset_count, twist context) {
+
+    switch (tok->type) {
+    case token_type_esysdb:
+        return backend_esysdb_set_pobject_context(tok, reset_count, context);
+    case token_type_fapi:
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
+/**
+ * Commits object writes the backends hold back for tokens with batch
+ * durability.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV backend_flush(void) {
+
+    /* FAPI writes through on every call */
+    if (!esysdb_init) {
+        return CKR_OK;
+    }
+
+    return backend_esysdb_flush();
+}
+
+/**
+ * Commits the batched object writes that are due, see db_flush_due().
+ */
+void backend_flush_due(void) {
+
+    if (esysdb_init) {
+        backend_esysdb_flush_due();
+    }
+}
+
+/**
+ * Looks for the user wrapping key of a token in the login cache, see
+ * login_cache_get(). A hit needs no TPM commands, so it is tried before
+ * the primary object and the auth session are brought up.
+ * @param tok
+ *  The token, its wrapping key is set on a hit.
+ * @param tpin
+ *  The user PIN of the login.
+ * @param hit
+ *  Whether the cache held the wrapping key for the PIN.
+ * @return
+ *  CKR_OK on success, a miss included, CKR_FUNCTION_NOT_SUPPORTED if the
+ *  backend does not cache logins.
+ */
+CK_RV backend_token_login_cache_get(token *tok, twist tpin, bool *hit) {
+
+    switch (tok->type) {
+    case token_type_esysdb:
+        return backend_esysdb_token_login_cache_get(tok, tpin, hit);
+    case token_type_fapi:
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
 /** Unseal a token's wrapping key.
  *
  * Unseal a token's wrapping key as part of the Login process.
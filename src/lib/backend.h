@@ -30,6 +30,31 @@ CK_RV backend_update_tobject_attrs(token *tok, tobject *tobj, attr_list *attrs);
 
 CK_RV backend_rm_tobject(token *tok, tobject *tobj);
 
+CK_RV backend_refresh_tobjects(token *tok);
+
+CK_RV backend_find_tobjects(token *tok, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        unsigned **ids, size_t *len);
+
+CK_RV backend_read_tobject_value(token *tok, tobject *tobj, CK_BYTE_PTR buf, CK_ULONG len);
+
+CK_RV backend_keypool_add(token *tok, twist template, twist pubblob,
+        twist privblob, twist objauth);
+
+CK_RV backend_keypool_claim(token *tok, twist template, twist *pubblob,
+        twist *privblob, twist *objauth);
+
+CK_RV backend_keypool_count(token *tok, twist template, unsigned *count);
+
+CK_RV backend_get_pobject_context(token *tok, uint32_t *reset_count, twist *context);
+
+CK_RV backend_set_pobject_context(token *tok, uint32_t reset_count, twist context);
+
+CK_RV backend_flush(void);
+
+void backend_flush_due(void);
+
+CK_RV backend_token_login_cache_get(token *tok, twist tpin, bool *hit);
+
 CK_RV backend_token_unseal_wrapping_key(token *tok, bool user, twist tpin);
 
 CK_RV backend_token_changeauth(token *tok, bool user, twist toldpin, twist tnewpin);
@@ -1,18 +1,46 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
 #include "config.h"
+
+#include <openssl/crypto.h>
+
 #include "backend_esysdb.h"
 #include "db.h"
+#include "login_cache.h"
+#include "snapshot.h"
 #include "tpm.h"
 
+/* tokens come from a read-only snapshot instead of the sqlite store */
+static bool use_snapshot;
+
+#define check_writable(t) \
+    do { \
+        if ((t)->read_only) { \
+            LOGE("Token \"%.*s\" is read only", \
+                    (int)sizeof((t)->label), (t)->label); \
+            return CKR_TOKEN_WRITE_PROTECTED; \
+        } \
+    } while (0)
+
 CK_RV backend_esysdb_init(void) {
     tpm_init();
 
+    const char *snapshot = getenv(SNAPSHOT_ENV);
+    if (snapshot) {
+        use_snapshot = true;
+        return snapshot_init(snapshot);
+    }
+
     return db_init();
 }
 
 CK_RV backend_esysdb_destroy(void) {
-    db_destroy();
+    if (use_snapshot) {
+        snapshot_destroy();
+        use_snapshot = false;
+    } else {
+        db_destroy();
+    }
 
     tpm_destroy();
 
@@ -109,6 +137,8 @@ static CK_RV get_or_create_primary(token *t) {
 CK_RV backend_esysdb_create_token_seal(token *t, const twist hexwrappingkey,
                        const twist newauth, const twist newsalthex) {
 
+    check_writable(t);
+
     CK_RV rv = CKR_GENERAL_ERROR;
 
     /*
@@ -156,7 +186,8 @@ error:
  * See backend_get_tokens()
  */
 CK_RV backend_esysdb_get_tokens(token **tok, size_t *len) {
-    return db_get_tokens(tok, len);
+    return use_snapshot ? snapshot_get_tokens(tok, len) :
+            db_get_tokens(tok, len);
 }
 
 static void change_token_mem_data(token *tok, bool is_so,
@@ -194,6 +225,8 @@ static void change_token_mem_data(token *tok, bool is_so,
  */
 CK_RV backend_esysdb_init_user(token *tok, const twist sealdata,
                         const twist newauthhex, const twist newsalthex) {
+    check_writable(tok);
+
     CK_RV rv = CKR_GENERAL_ERROR;
 
     twist newpubblob = NULL;
@@ -244,6 +277,7 @@ out:
  * See backend_add_object()
  */
 CK_RV backend_esysdb_add_object(token *t, tobject *tobj) {
+    check_writable(t);
     LOGV("Adding object to esysdb backend");
     return db_add_new_object(t, tobj);
 }
@@ -253,18 +287,172 @@ CK_RV backend_esysdb_add_object(token *t, tobject *tobj) {
  * See backend_update_token_config()
  */
 CK_RV backend_esysdb_update_token_config (token *tok) {
+    check_writable(tok);
 
     return db_update_token_config(tok);
 }
 
-CK_RV backend_esysdb_update_tobject_attrs(tobject *tobj, attr_list *attrs) {
+CK_RV backend_esysdb_update_tobject_attrs(token *tok, tobject *tobj, attr_list *attrs) {
+    check_writable(tok);
+
+    if (tok->config.attr_store == token_attr_store_table) {
+        return db_update_tobject_attr_rows(tok, tobj, attrs);
+    }
+
+    return db_update_tobject_attrs(tok, tobj, attrs);
+}
+
+CK_RV backend_esysdb_read_tobject_value(token *tok, tobject *tobj,
+        CK_BYTE_PTR buf, CK_ULONG len) {
+    UNUSED(tok);
+
+    /* snapshot objects carry their value in the attrs */
+    if (use_snapshot) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    return db_read_tobject_value(tobj, buf, len);
+}
+
+CK_RV backend_esysdb_keypool_add(token *tok, twist template, twist pubblob,
+        twist privblob, twist objauth) {
+    check_writable(tok);
+
+    return db_keypool_add(tok, template, pubblob, privblob, objauth);
+}
+
+CK_RV backend_esysdb_keypool_claim(token *tok, twist template, twist *pubblob,
+        twist *privblob, twist *objauth) {
+    check_writable(tok);
+
+    return db_keypool_claim(tok, template, pubblob, privblob, objauth);
+}
+
+CK_RV backend_esysdb_keypool_count(token *tok, twist template, unsigned *count) {
+
+    /* a snapshot has no pool */
+    if (use_snapshot) {
+        *count = 0;
+        return CKR_OK;
+    }
 
-    return db_update_tobject_attrs(tobj->id, attrs);
+    return db_keypool_count(tok, template, count);
 }
 
-CK_RV backend_esysdb_rm_tobject(tobject *tobj) {
+CK_RV backend_esysdb_get_pobject_context(token *tok, uint32_t *reset_count, twist *context) {
+
+    /* the snapshot carries no contexts, the primary is created */
+    if (use_snapshot) {
+        *context = NULL;
+        return CKR_OK;
+    }
 
-    return db_delete_object(tobj);
+    return db_get_pobject_context(tok->pid, reset_count, context);
+}
+
+CK_RV backend_esysdb_set_pobject_context(token *tok, uint32_t reset_count, twist context) {
+    check_writable(tok);
+
+    return db_set_pobject_context(tok->pid, reset_count, context);
+}
+
+CK_RV backend_esysdb_find_tobjects(token *tok, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        unsigned **ids, size_t *len) {
+
+    /* only the table attribute store can be searched */
+    if (use_snapshot || tok->config.attr_store != token_attr_store_table) {
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    }
+
+    return db_find_tobjects(tok, templ, count, ids, len);
+}
+
+CK_RV backend_esysdb_refresh_tobjects(token *tok) {
+
+    /* a snapshot never changes */
+    if (use_snapshot) {
+        return CKR_OK;
+    }
+
+    return db_refresh_tobjects(tok);
+}
+
+CK_RV backend_esysdb_rm_tobject(token *tok, tobject *tobj) {
+    check_writable(tok);
+
+    return db_delete_object(tok, tobj);
+}
+
+CK_RV backend_esysdb_flush(void) {
+
+    return use_snapshot ? CKR_OK : db_flush();
+}
+
+void backend_esysdb_flush_due(void) {
+
+    if (!use_snapshot) {
+        db_flush_due();
+    }
+}
+
+/*
+ * Identifies the user seal object of a token in the login cache. A new PIN
+ * comes with a new salt, which orphans the old entry.
+ */
+static twist login_cache_id(token *tok) {
+
+    sealobject *sealobj = &tok->esysdb.sealobject;
+
+    binarybuffer parts[] = {
+        { .data = sealobj->userpub, .size = twist_len(sealobj->userpub) },
+        { .data = sealobj->userauthsalt, .size = twist_len(sealobj->userauthsalt) },
+    };
+
+    twist id = twistbin_create(parts, ARRAY_LEN(parts));
+    if (!id) {
+        LOGE("oom");
+    }
+
+    return id;
+}
+
+/** Look for a token's user wrapping key in the login cache.
+ *
+ * see backend_token_login_cache_get()
+ */
+CK_RV backend_esysdb_token_login_cache_get(token *tok, twist tpin, bool *hit) {
+
+    *hit = false;
+
+    sealobject *sealobj = &tok->esysdb.sealobject;
+    if (!tok->config.login_cache_ttl || !sealobj->userpub) {
+        return CKR_OK;
+    }
+
+    twist cache_id = login_cache_id(tok);
+    if (!cache_id) {
+        return CKR_HOST_MEMORY;
+    }
+
+    /*
+     * Another process of this session may have left the wrapping key in the
+     * keyring, it can only be used with the right PIN.
+     */
+    twist cached = NULL;
+    *hit = login_cache_get(cache_id, tpin, &cached);
+    twist_free(cache_id);
+    if (!*hit) {
+        return CKR_OK;
+    }
+
+    if (tok->wrappingkey) {
+        OPENSSL_cleanse((void *)cached, twist_len(cached));
+        twist_free(cached);
+    } else {
+        tok->wrappingkey = cached;
+    }
+
+    return CKR_OK;
 }
 
 /** Unseal a token's wrapping key.
@@ -302,7 +490,7 @@ CK_RV backend_esysdb_token_unseal_wrapping_key(token *tok, bool user, twist tpin
     twist pobjauth = tok->pobject.objauth;
     uint32_t sealhandle;
 
-    rv = tpm_loadobj(tok->tctx, pobj_handle, pobjauth, sealpub, sealpriv, &sealhandle);
+    rv = tpm_loadobj(tok->tctx, 0, pobj_handle, pobjauth, sealpub, sealpriv, &sealhandle);
     if (rv != CKR_OK) {
         goto error;
     }
@@ -315,13 +503,20 @@ CK_RV backend_esysdb_token_unseal_wrapping_key(token *tok, bool user, twist tpin
     }
 
     twist wrappingkeyhex = tpm_unseal(tok->tctx, sealhandle, sealobjauth);
-    twist_free(sealobjauth);
     tpm_flushcontext(tok->tctx, sealhandle);
     if (!wrappingkeyhex) {
+        twist_free(sealobjauth);
         rv = CKR_PIN_INCORRECT;
         goto error;
     }
 
+    /* keep the result of the KDF for C_SetPIN, see token_sealauth_for_pin() */
+    if (user) {
+        token_user_sealauth_set(tok, sealobjauth);
+    } else {
+        twist_free(sealobjauth);
+    }
+
     if (tok->wrappingkey) {
         twist_free(wrappingkeyhex);
     } else {
@@ -333,6 +528,16 @@ CK_RV backend_esysdb_token_unseal_wrapping_key(token *tok, bool user, twist tpin
         }
     }
 
+    /* the next login of this session need not unseal it again */
+    if (user && tok->config.login_cache_ttl) {
+        twist cache_id = login_cache_id(tok);
+        if (cache_id) {
+            login_cache_put(cache_id, tpin, tok->config.pin_kdf,
+                    tok->wrappingkey, tok->config.login_cache_ttl);
+            twist_free(cache_id);
+        }
+    }
+
     return CKR_OK;
 
 error:
@@ -344,10 +549,9 @@ error:
 }
 
 CK_RV backend_esysdb_token_changeauth(token *tok, bool user, twist toldpin, twist tnewpin) {
+    check_writable(tok);
 
     CK_RV rv = CKR_GENERAL_ERROR;
-    bool is_anyone_logged_in = token_is_any_user_logged_in(tok);
-
     bool session_started = false;
 
     /* new seal auth data */
@@ -362,7 +566,8 @@ CK_RV backend_esysdb_token_changeauth(token *tok, bool user, twist toldpin, twis
      * This will be used to update the sealobjects table, the columns:
      *  - (so|user)authsalt  --> newsalt
      */
-    rv = utils_setup_new_object_auth(tnewpin, &newauthhex, &newsalthex);
+    rv = utils_setup_new_object_auth(tnewpin, tok->config.pin_kdf,
+            &newauthhex, &newsalthex);
     if (rv != CKR_OK) {
         goto out;
     }
@@ -372,14 +577,18 @@ CK_RV backend_esysdb_token_changeauth(token *tok, bool user, twist toldpin, twis
      */
     twist oldsalt = !user ? tok->esysdb.sealobject.soauthsalt : tok->esysdb.sealobject.userauthsalt;
 
-    twist oldauth = utils_hash_pass(toldpin, oldsalt);
+    twist oldauth = token_sealauth_for_pin(tok, user, toldpin, oldsalt);
     if (!oldauth) {
+        rv = CKR_GENERAL_ERROR;
         goto out;
     }
 
 
-    /* if no one is logged in, we need to start a session with the TPM */
-    if (!is_anyone_logged_in) {
+    /*
+     * if no one is logged in, we need to start a session with the TPM, nor
+     * does a user login served by the login cache start one
+     */
+    if (!tpm_session_active(tok->tctx)) {
         rv = tpm_session_start(tok->tctx, tok->pobject.objauth, tok->pobject.handle);
         if (rv != CKR_OK) {
             LOGE("Could not start session with TPM");
@@ -396,7 +605,7 @@ CK_RV backend_esysdb_token_changeauth(token *tok, bool user, twist toldpin, twis
 
     uint32_t sealhandle;
 
-    rv = tpm_loadobj(tok->tctx, tok->pobject.handle, tok->pobject.objauth,
+    rv = tpm_loadobj(tok->tctx, 0, tok->pobject.handle, tok->pobject.objauth,
             sealpub, sealpriv, &sealhandle);
     if (rv != CKR_OK) {
         goto out;
@@ -440,6 +649,10 @@ CK_RV backend_esysdb_token_changeauth(token *tok, bool user, twist toldpin, twis
      */
     change_token_mem_data(tok, !user, newsalthex, newprivblob, NULL);
 
+    if (user && tok->login_state == token_user_logged_in) {
+        token_user_sealauth_set(tok, twist_dup(newauthhex));
+    }
+
     rv = CKR_OK;
 
 out:
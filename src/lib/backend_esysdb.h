@@ -25,9 +25,35 @@ CK_RV backend_esysdb_add_object(token *t, tobject *tobj);
 
 CK_RV backend_esysdb_update_token_config (token *tok);
 
-CK_RV backend_esysdb_update_tobject_attrs(tobject *tobj, attr_list *attrs);
+CK_RV backend_esysdb_update_tobject_attrs(token *tok, tobject *tobj, attr_list *attrs);
 
-CK_RV backend_esysdb_rm_tobject(tobject *tobj);
+CK_RV backend_esysdb_rm_tobject(token *tok, tobject *tobj);
+
+CK_RV backend_esysdb_refresh_tobjects(token *tok);
+
+CK_RV backend_esysdb_find_tobjects(token *tok, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        unsigned **ids, size_t *len);
+
+CK_RV backend_esysdb_read_tobject_value(token *tok, tobject *tobj,
+        CK_BYTE_PTR buf, CK_ULONG len);
+
+CK_RV backend_esysdb_keypool_add(token *tok, twist template, twist pubblob,
+        twist privblob, twist objauth);
+
+CK_RV backend_esysdb_keypool_claim(token *tok, twist template, twist *pubblob,
+        twist *privblob, twist *objauth);
+
+CK_RV backend_esysdb_keypool_count(token *tok, twist template, unsigned *count);
+
+CK_RV backend_esysdb_get_pobject_context(token *tok, uint32_t *reset_count, twist *context);
+
+CK_RV backend_esysdb_set_pobject_context(token *tok, uint32_t reset_count, twist context);
+
+CK_RV backend_esysdb_flush(void);
+
+void backend_esysdb_flush_due(void);
+
+CK_RV backend_esysdb_token_login_cache_get(token *tok, twist tpin, bool *hit);
 
 CK_RV backend_esysdb_token_unseal_wrapping_key(token *tok, bool user, twist tpin);
 
@@ -1,39 +1,1368 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include "config.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_FAPI
 #include <tss2/tss2_fapi.h>
+#include <yaml.h>
 #endif
 
-#include "backend_fapi.h"
-#include "emitter.h"
-#include "parser.h"
-#include "utils.h"
+#include "backend_fapi.h"
+#include "emitter.h"
+#include "parser.h"
+#include "utils.h"
+
+#ifdef HAVE_FAPI
+FAPI_CONTEXT *fctx = NULL;
+/*
+ * The objects of a token live next to the FAPI keystore, one file per
+ * tobject named by its id, so adding, updating or removing an object only
+ * touches that file:
+ *
+ *   <store>/token-<tokid>/manifest
+ *   <store>/token-<tokid>/lock
+ *   <store>/token-<tokid>/<id>
+ *
+ * The store is a directory in the user keystore of the FAPI config, so it
+ * goes wherever the seals of the tokens go. The manifest holds the format
+ * version and the highest id the token ever used, so ids of removed objects
+ * are not handed out again, see fapi_tobject_id_claim(). Older tokens kept
+ * every object in the appdata of the SO seal, they are copied on load, see
+ * fapi_migrate_appdata().
+ */
+#define FAPI_STORE_ENV_VAR "TPM2_PKCS11_FAPI_STORE"
+#define FAPI_STORE_DIR "tpm2-pkcs11"
+#define FAPI_MANIFEST "manifest"
+#define FAPI_MANIFEST_VERSION 1
+#define FAPI_LOCK "lock"
+
+/* the object store directory, set by fapi_store_init() */
+static char *store_root = NULL;
+
+/* gets the path of name in the object store */
+static CK_RV fapi_store_path(const char *name, char *path, size_t len) {
+
+    if (!store_root) {
+        LOGE("No FAPI object store, set "FAPI_STORE_ENV_VAR" or user_dir"
+                " in the FAPI config");
+        return CKR_GENERAL_ERROR;
+    }
+
+    unsigned l = snprintf(path, len, "%s/%s", store_root, name);
+    if (l >= len) {
+        LOGE("Completed FAPI object store path was longer than PATH_MAX");
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+static CK_RV fapi_token_dir(unsigned tokid, char *path, size_t len) {
+
+    char name[16];
+    snprintf(name, sizeof(name), "token-%08x", tokid);
+
+    return fapi_store_path(name, path, len);
+}
+
+static CK_RV fapi_tobject_path(unsigned tokid, const char *name, char *path, size_t len) {
+
+    char dir[PATH_MAX];
+    CK_RV rv = fapi_token_dir(tokid, dir, sizeof(dir));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    unsigned l = snprintf(path, len, "%s/%s", dir, name);
+    if (l >= len) {
+        LOGE("Completed FAPI object path was longer than PATH_MAX");
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+static CK_RV fapi_tobject_id_path(unsigned tokid, unsigned id, char *path, size_t len) {
+
+    char name[9];
+    snprintf(name, sizeof(name), "%08x", id);
+
+    return fapi_tobject_path(tokid, name, path, len);
+}
+
+/* creates the token directory and any missing parent */
+static CK_RV fapi_mkdirs(const char *dir) {
+
+    char path[PATH_MAX];
+    unsigned l = snprintf(path, sizeof(path), "%s", dir);
+    if (l >= sizeof(path)) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    char *p;
+    for (p = &path[1]; ; p++) {
+        bool last = *p == '\0';
+        if (*p != '/' && !last) {
+            continue;
+        }
+
+        *p = '\0';
+        if (mkdir(path, 0700) && errno != EEXIST) {
+            LOGE("Could not create directory \"%s\": %s", path, strerror(errno));
+            return CKR_GENERAL_ERROR;
+        }
+
+        if (last) {
+            return CKR_OK;
+        }
+        *p = '/';
+    }
+}
+
+/*
+ * Replaces a file with data, through a temporary file and a rename, so
+ * readers see either the old or the new contents.
+ */
+static CK_RV fapi_write_file(const char *path, const char *data, size_t len) {
+
+    char tmp[PATH_MAX];
+    unsigned l = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (l >= sizeof(tmp)) {
+        LOGE("Temporary file path is longer than PATH_MAX");
+        return CKR_GENERAL_ERROR;
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("Could not open \"%s\": %s", tmp, strerror(errno));
+        return CKR_GENERAL_ERROR;
+    }
+
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, &data[off], len - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            LOGE("Could not write \"%s\": %s", tmp, strerror(errno));
+            goto error;
+        }
+        off += n;
+    }
+
+    if (fsync(fd)) {
+        LOGE("Could not sync \"%s\": %s", tmp, strerror(errno));
+        goto error;
+    }
+
+    close(fd);
+
+    if (rename(tmp, path)) {
+        LOGE("Could not rename \"%s\": %s", tmp, strerror(errno));
+        unlink(tmp);
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+
+error:
+    close(fd);
+    unlink(tmp);
+    return CKR_GENERAL_ERROR;
+}
+
+static CK_RV fapi_manifest_read(unsigned tokid, unsigned *maxid) {
+
+    char path[PATH_MAX];
+    CK_RV rv = fapi_tobject_path(tokid, FAPI_MANIFEST, path, sizeof(path));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    FILE *f = fopen(path, "re");
+    if (!f) {
+        if (errno == ENOENT) {
+            *maxid = 0;
+            return CKR_OK;
+        }
+        LOGE("Could not open \"%s\": %s", path, strerror(errno));
+        return CKR_GENERAL_ERROR;
+    }
+
+    unsigned version = 0;
+    int cnt = fscanf(f, "%u %08x", &version, maxid);
+    fclose(f);
+    if (cnt != 2) {
+        LOGE("Malformed FAPI object manifest \"%s\"", path);
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (version != FAPI_MANIFEST_VERSION) {
+        LOGE("Unknown FAPI object manifest version %u, expected %u",
+                version, FAPI_MANIFEST_VERSION);
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+static CK_RV fapi_manifest_write(unsigned tokid, unsigned maxid) {
+
+    char path[PATH_MAX];
+    CK_RV rv = fapi_tobject_path(tokid, FAPI_MANIFEST, path, sizeof(path));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    char buf[32];
+    int l = snprintf(buf, sizeof(buf), "%u %08x\n", FAPI_MANIFEST_VERSION, maxid);
+
+    return fapi_write_file(path, buf, l);
+}
+
+static CK_RV fapi_tobject_write(unsigned tokid, unsigned id, const char *attrs) {
+
+    char path[PATH_MAX];
+    CK_RV rv = fapi_tobject_id_path(tokid, id, path, sizeof(path));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return fapi_write_file(path, attrs, strlen(attrs));
+}
+
+/*
+ * Takes the lock of a token directory, which orders the processes writing
+ * the manifest. Release it with fapi_token_unlock().
+ */
+static CK_RV fapi_token_lock(unsigned tokid, int *fd) {
+
+    char lock[PATH_MAX];
+    CK_RV rv = fapi_tobject_path(tokid, FAPI_LOCK, lock, sizeof(lock));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    int lockfd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lockfd < 0) {
+        LOGE("Could not open \"%s\": %s", lock, strerror(errno));
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (flock(lockfd, LOCK_EX)) {
+        LOGE("Could not flock \"%s\": %s", lock, strerror(errno));
+        close(lockfd);
+        return CKR_GENERAL_ERROR;
+    }
+
+    *fd = lockfd;
+    return CKR_OK;
+}
+
+static void fapi_token_unlock(int fd) {
+
+    if (flock(fd, LOCK_UN)) {
+        LOGW("Could not unlock FAPI token directory: %s", strerror(errno));
+    }
+    close(fd);
+}
+
+/*
+ * Claims a new id of a token for an object added by any process. The lock
+ * of the token directory orders the adds of all processes, so each reads
+ * the manifest the one before it wrote, and the file of the id is created
+ * exclusively, so an id is never handed out twice even if the manifest is
+ * behind. The file is left empty until the object is written, loads skip
+ * it until then.
+ */
+DEBUG_VISIBILITY CK_RV fapi_tobject_id_claim(unsigned tokid, unsigned *id) {
+
+    int lockfd;
+    CK_RV rv = fapi_token_lock(tokid, &lockfd);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    unsigned maxid = 0;
+    rv = fapi_manifest_read(tokid, &maxid);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
+    char path[PATH_MAX];
+    unsigned claimed = maxid;
+    for (;;) {
+        safe_add(claimed, claimed, 1);
+
+        rv = fapi_tobject_id_path(tokid, claimed, path, sizeof(path));
+        if (rv != CKR_OK) {
+            goto out;
+        }
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            close(fd);
+            break;
+        }
+
+        if (errno != EEXIST) {
+            LOGE("Could not create \"%s\": %s", path, strerror(errno));
+            rv = CKR_GENERAL_ERROR;
+            goto out;
+        }
+
+        LOGV("FAPI object id %u of token %u is taken", claimed, tokid);
+    }
+
+    rv = fapi_manifest_write(tokid, claimed);
+    if (rv != CKR_OK) {
+        unlink(path);
+        goto out;
+    }
+
+    *id = claimed;
+
+out:
+    fapi_token_unlock(lockfd);
+    return rv;
+}
+
+static bool fapi_tobject_name_to_id(const char *name, unsigned *id) {
+
+    if (strlen(name) != 8) {
+        return false;
+    }
+
+    char *end = NULL;
+    unsigned long val = strtoul(name, &end, 16);
+    if (*end != '\0' || !val || val > UINT_MAX) {
+        return false;
+    }
+
+    *id = (unsigned)val;
+    return true;
+}
+
+/* removes the directory of a token and the files in it */
+static CK_RV fapi_token_dir_remove(unsigned tokid) {
+
+    char dir[PATH_MAX];
+    CK_RV rv = fapi_token_dir(tokid, dir, sizeof(dir));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        if (errno == ENOENT) {
+            return CKR_OK;
+        }
+        LOGE("Could not open \"%s\": %s", dir, strerror(errno));
+        return CKR_GENERAL_ERROR;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+            continue;
+        }
+
+        char path[PATH_MAX];
+        unsigned l = snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (l >= sizeof(path) || (unlink(path) && errno != ENOENT)) {
+            LOGE("Could not remove \"%s/%s\"", dir, e->d_name);
+            rv = CKR_GENERAL_ERROR;
+        }
+    }
+
+    closedir(d);
+
+    if (rv == CKR_OK && rmdir(dir) && errno != ENOENT) {
+        LOGE("Could not remove \"%s\": %s", dir, strerror(errno));
+        rv = CKR_GENERAL_ERROR;
+    }
+
+    return rv;
+}
+
+/*
+ * Removes the directories of tokens whose SO seal is gone. Their objects are
+ * of no use without the seal, and a later token with the same id must not
+ * find them.
+ */
+static void fapi_store_sweep(token *tok, size_t len) {
+
+    if (!store_root) {
+        return;
+    }
+
+    DIR *d = opendir(store_root);
+    if (!d) {
+        return;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        unsigned id;
+        if (strncmp(e->d_name, "token-", 6)
+                || !fapi_tobject_name_to_id(&e->d_name[6], &id)) {
+            continue;
+        }
+
+        size_t i;
+        for (i = 0; i < len; i++) {
+            if (tok[i].type == token_type_fapi && tok[i].id == id) {
+                break;
+            }
+        }
+
+        if (i == len) {
+            LOGV("Removing the objects of deleted FAPI token %u", id);
+            UNUSED(fapi_token_dir_remove(id));
+        }
+    }
+
+    closedir(d);
+}
+
+/*
+ * Copies the objects a token keeps in the appdata of its SO seal to their
+ * own files. The manifest is written last: once it exists the files are the
+ * objects of the token and the appdata ones are ignored, until then the
+ * next load copies them again. The appdata is left as it is, so a library
+ * that predates the object store still finds the objects as they were.
+ * Copies are made under the lock of the token directory, so a process that
+ * loads the token at the same time does not copy them over its objects.
+ */
+DEBUG_VISIBILITY CK_RV fapi_migrate_appdata(token *t, uint8_t *appdata, size_t appdata_len) {
+
+    size_t salt_len = strlen((char *)appdata);
+    size_t offset = 0;
+    safe_add(offset, salt_len, 1);
+    if (offset >= appdata_len) {
+        return CKR_OK;
+    }
+
+    char manifest[PATH_MAX];
+    CK_RV rv = fapi_tobject_path(t->id, FAPI_MANIFEST, manifest, sizeof(manifest));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (!access(manifest, F_OK)) {
+        return CKR_OK;
+    }
+
+    LOGV("Copying the objects of token %u out of the FAPI appdata", t->id);
+
+    char dir[PATH_MAX];
+    rv = fapi_token_dir(t->id, dir, sizeof(dir));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = fapi_mkdirs(dir);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    int lockfd;
+    rv = fapi_token_lock(t->id, &lockfd);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    /* another process copied them while this one waited */
+    if (!access(manifest, F_OK)) {
+        goto out;
+    }
+
+    unsigned maxid = 0;
+
+    uint8_t *yaml = &appdata[offset];
+    while ((size_t)(yaml - appdata) < appdata_len) {
+
+        if (((size_t)(yaml - appdata) > appdata_len - 9) ||
+                (strlen((char*)yaml) < 10)) {
+            LOGE("Incomplete tobj in appdata");
+            rv = CKR_GENERAL_ERROR;
+            goto out;
+        }
+
+        unsigned id;
+        if (sscanf((char*)yaml, "%08x:", &id) != 1) {
+            LOGE("Could not scan tobj id");
+            rv = CKR_GENERAL_ERROR;
+            goto out;
+        }
+
+        rv = fapi_tobject_write(t->id, id, (char *)&yaml[9]);
+        if (rv != CKR_OK) {
+            goto out;
+        }
+
+        maxid = maxid > id ? maxid : id;
+
+        offset = 0;
+        safe_add(offset, strlen((char *)yaml), 1);
+        yaml += offset;
+    }
+
+    rv = fapi_manifest_write(t->id, maxid);
+
+out:
+    fapi_token_unlock(lockfd);
+    return rv;
+}
+
+static int fapi_id_cmp(const void *a, const void *b) {
+
+    unsigned x = *(const unsigned *)a;
+    unsigned y = *(const unsigned *)b;
+
+    return (x > y) - (x < y);
+}
+
+static CK_RV fapi_tobject_load(token *t, unsigned id) {
+
+    char path[PATH_MAX];
+    CK_RV rv = fapi_tobject_id_path(t->id, id, path, sizeof(path));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    FILE *f = fopen(path, "re");
+    if (!f) {
+        if (errno == ENOENT) {
+            LOGV("FAPI object %u of token %u was removed", id, t->id);
+            return CKR_OK;
+        }
+        LOGE("Could not open \"%s\": %s", path, strerror(errno));
+        return CKR_GENERAL_ERROR;
+    }
+
+    struct stat sb;
+    if (fstat(fileno(f), &sb) || sb.st_size < 0) {
+        LOGE("Could not stat \"%s\"", path);
+        fclose(f);
+        return CKR_GENERAL_ERROR;
+    }
+
+    /* claimed by an add that has not written the object yet */
+    if (!sb.st_size) {
+        LOGV("FAPI object %u of token %u is not written yet", id, t->id);
+        fclose(f);
+        return CKR_OK;
+    }
+
+    size_t yaml_len = sb.st_size;
+    char *yaml = malloc(yaml_len + 1);
+    if (!yaml) {
+        LOGE("oom");
+        fclose(f);
+        return CKR_HOST_MEMORY;
+    }
+
+    size_t got = fread(yaml, 1, yaml_len, f);
+    fclose(f);
+    if (got != yaml_len) {
+        LOGE("Could not read \"%s\"", path);
+        free(yaml);
+        return CKR_GENERAL_ERROR;
+    }
+    yaml[yaml_len] = '\0';
+
+    tobject *tobj = tobject_new();
+    if (!tobj) {
+        LOGE("oom");
+        free(yaml);
+        return CKR_HOST_MEMORY;
+    }
+
+    tobj->id = id;
+
+    if (!parse_attributes_from_string((uint8_t *)yaml, yaml_len, &tobj->attrs)) {
+        LOGE("Could not parse FAPI attrs, got: \"%s\"", yaml);
+        free(yaml);
+        tobject_free(tobj);
+        return CKR_GENERAL_ERROR;
+    }
+    free(yaml);
+
+    rv = object_init_from_attrs(tobj);
+    if (rv != CKR_OK) {
+        LOGE("Object initialization failed");
+        tobject_free(tobj);
+        return rv;
+    }
+
+    rv = token_add_tobject_last(t, tobj);
+    if (rv != CKR_OK) {
+        LOGE("Failed to initialize tobject from FAPI");
+        tobject_free(tobj);
+        return rv;
+    }
+
+    return CKR_OK;
+}
+
+/* loads the objects of a token from their files, in id order */
+DEBUG_VISIBILITY CK_RV fapi_tobjects_load(token *t) {
+
+    char dir[PATH_MAX];
+    CK_RV rv = fapi_token_dir(t->id, dir, sizeof(dir));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        if (errno == ENOENT) {
+            LOGV("Token %u has no FAPI objects", t->id);
+            return CKR_OK;
+        }
+        LOGE("Could not open \"%s\": %s", dir, strerror(errno));
+        return CKR_GENERAL_ERROR;
+    }
+
+    unsigned *ids = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        unsigned id;
+        if (!fapi_tobject_name_to_id(e->d_name, &id)) {
+            continue;
+        }
+
+        if (len == cap) {
+            size_t newcap = cap ? cap * 2 : 16;
+            unsigned *tmp = realloc(ids, newcap * sizeof(*ids));
+            if (!tmp) {
+                LOGE("oom");
+                rv = CKR_HOST_MEMORY;
+                goto out;
+            }
+            ids = tmp;
+            cap = newcap;
+        }
+        ids[len++] = id;
+    }
+
+    qsort(ids, len, sizeof(*ids), fapi_id_cmp);
+
+    size_t i;
+    for (i = 0; i < len; i++) {
+        rv = fapi_tobject_load(t, ids[i]);
+        if (rv != CKR_OK) {
+            goto out;
+        }
+    }
+
+    rv = CKR_OK;
+
+out:
+    closedir(d);
+    free(ids);
+    return rv;
+}
+
+/*
+ * Every FAPI call below reads and parses a JSON file of the keystore. The
+ * descriptions, appdata, ESYS blobs and listings the backend asks for are
+ * kept in a cache file in the object store, each with the inode, size and
+ * mtime of the keystore files it came from. As long as those match, they
+ * are served from the cache. The cache is a host local file in native
+ * byte order, it is not meant to be copied around.
+ */
+#define FAPI_CACHE_ENV_VAR "TPM2_PKCS11_FAPI_CACHE"
+#define FAPI_CACHE_FILE "cache"
+#define FAPI_CACHE_MAGIC "TPM2FAPC"
+#define FAPI_CACHE_VERSION 1
+#define FAPI_CONFIG_ENV_VAR "TSS2_FAPICONF"
+#ifndef FAPI_CONFIG_DEFAULT
+#define FAPI_CONFIG_DEFAULT "/etc/tpm2-tss/fapi-config.json"
+#endif
+
+enum fapi_keystore {
+    fapi_keystore_user = 0,
+    fapi_keystore_system,
+    fapi_keystore_max,
+};
+
+/* identifies the version of a keystore file, all zero when it does not exist */
+typedef struct fapi_stamp fapi_stamp;
+struct fapi_stamp {
+    uint64_t ino;
+    uint64_t size;
+    int64_t sec;
+    int64_t nsec;
+};
+
+enum fapi_cache_field {
+    fapi_cache_list        = 1 << 0,
+    fapi_cache_description = 1 << 1,
+    fapi_cache_appdata     = 1 << 2,
+    fapi_cache_esys        = 1 << 3,
+};
+
+typedef struct fapi_cache_entry fapi_cache_entry;
+struct fapi_cache_entry {
+    char *path;
+    uint8_t is_dir;        /** a listing of path rather than its object */
+    fapi_stamp stamp[fapi_keystore_max];
+    uint8_t fields;        /** the cached fields, see enum fapi_cache_field */
+    twist list;
+    twist description;
+    twist appdata;
+    twist esys;
+    uint8_t esys_type;
+    fapi_cache_entry *next;
+};
+
+static struct {
+    bool enabled;
+    bool dirty;
+    char *profile;
+    char *dirs[fapi_keystore_max];
+    fapi_cache_entry *head;
+} cache;
+
+static void fapi_cache_entry_clear(fapi_cache_entry *e) {
+    twist_free(e->list);
+    twist_free(e->description);
+    twist_free(e->appdata);
+    twist_free(e->esys);
+    e->list = e->description = e->appdata = e->esys = NULL;
+    e->fields = 0;
+}
+
+static void fapi_cache_entries_free(void) {
+
+    fapi_cache_entry *e = cache.head;
+    while (e) {
+        fapi_cache_entry *next = e->next;
+        fapi_cache_entry_clear(e);
+        free(e->path);
+        free(e);
+        e = next;
+    }
+    cache.head = NULL;
+}
+
+/* drops all entries, after the backend changed the keystore itself */
+static void fapi_cache_reset(void) {
+
+    if (!cache.enabled) {
+        return;
+    }
+
+    fapi_cache_entries_free();
+    cache.dirty = true;
+}
+
+/* expands a leading ~ or $HOME the way FAPI does for the keystore dirs */
+static char *fapi_expand_home(const char *dir) {
+
+    const char *rest = NULL;
+    if (dir[0] == '~') {
+        rest = &dir[1];
+    } else if (!strncmp(dir, "$HOME", 5)) {
+        rest = &dir[5];
+    } else {
+        return strdup(dir);
+    }
+
+    const char *home = getenv("HOME");
+    if (!home) {
+        return NULL;
+    }
+
+    size_t len = 0;
+    safe_add(len, strlen(home), strlen(rest));
+    safe_adde(len, 1);
+
+    char *path = malloc(len);
+    if (!path) {
+        return NULL;
+    }
+
+    snprintf(path, len, "%s%s", home, rest);
+    return path;
+}
+
+/* gets the keystore dirs and profile out of the FAPI config, JSON is YAML enough */
+static bool fapi_cache_config_load(void) {
+
+    const char *config = getenv(FAPI_CONFIG_ENV_VAR);
+    if (!config) {
+        config = FAPI_CONFIG_DEFAULT;
+    }
+
+    FILE *f = fopen(config, "re");
+    if (!f) {
+        LOGV("Cannot open FAPI config \"%s\", not caching", config);
+        return false;
+    }
+
+    yaml_parser_t parser;
+    if (!yaml_parser_initialize(&parser)) {
+        fclose(f);
+        return false;
+    }
+    yaml_parser_set_input_file(&parser, f);
+
+    char *key = NULL;
+    int depth = 0;
+    bool done = false;
+    bool ok = true;
+    while (!done) {
+        yaml_event_t event;
+        if (!yaml_parser_parse(&parser, &event)) {
+            LOGV("Cannot parse FAPI config \"%s\", not caching", config);
+            ok = false;
+            break;
+        }
+
+        switch (event.type) {
+        case YAML_MAPPING_START_EVENT:
+        case YAML_SEQUENCE_START_EVENT:
+            depth++;
+            free(key);
+            key = NULL;
+            break;
+        case YAML_MAPPING_END_EVENT:
+        case YAML_SEQUENCE_END_EVENT:
+            depth--;
+            break;
+        case YAML_SCALAR_EVENT:
+            if (depth != 1) {
+                break;
+            }
+            if (!key) {
+                key = strdup((char *)event.data.scalar.value);
+                ok = key != NULL;
+                break;
+            }
+
+            const char *value = (char *)event.data.scalar.value;
+            if (!strcmp(key, "user_dir")) {
+                cache.dirs[fapi_keystore_user] = fapi_expand_home(value);
+            } else if (!strcmp(key, "system_dir")) {
+                cache.dirs[fapi_keystore_system] = fapi_expand_home(value);
+            } else if (!strcmp(key, "profile_name")) {
+                cache.profile = strdup(value);
+            }
+            free(key);
+            key = NULL;
+            break;
+        case YAML_STREAM_END_EVENT:
+            done = true;
+            break;
+        default:
+            break;
+        }
+
+        yaml_event_delete(&event);
+        if (!ok) {
+            break;
+        }
+    }
+
+    free(key);
+    yaml_parser_delete(&parser);
+    fclose(f);
+
+    return ok && cache.profile &&
+            cache.dirs[fapi_keystore_user] && cache.dirs[fapi_keystore_system];
+}
+
+/*
+ * Stamps the keystore files behind path, its object.json or, for a
+ * listing, its directory. That only notices objects added or removed
+ * right below path, which is where the token seals are. Paths without a
+ * profile are in the default one.
+ */
+static void fapi_stamp_get(const char *path, bool is_dir, fapi_stamp stamp[fapi_keystore_max]) {
+
+    memset(stamp, 0, sizeof(*stamp) * fapi_keystore_max);
+
+    bool has_profile = !strncmp(path, "/P_", 3);
+
+    unsigned i;
+    for (i = 0; i < fapi_keystore_max; i++) {
+        char file[PATH_MAX];
+        unsigned l = snprintf(file, sizeof(file), "%s%s%s%s%s",
+                cache.dirs[i],
+                has_profile ? "" : "/", has_profile ? "" : cache.profile,
+                path, is_dir ? "" : "/object.json");
+        if (l >= sizeof(file)) {
+            continue;
+        }
+
+        struct stat sb;
+        if (stat(file, &sb)) {
+            continue;
+        }
+
+        stamp[i].ino = sb.st_ino;
+        stamp[i].size = sb.st_size;
+        stamp[i].sec = sb.st_mtim.tv_sec;
+        stamp[i].nsec = sb.st_mtim.tv_nsec;
+    }
+}
+
+/*
+ * Gets the entry of path, after dropping what it cached if the keystore
+ * changed since. The stamp is taken before FAPI reads the keystore, so a
+ * concurrent change at worst costs another read next time.
+ */
+static fapi_cache_entry *fapi_cache_entry_get(const char *path, bool is_dir) {
+
+    fapi_stamp stamp[fapi_keystore_max];
+    fapi_stamp_get(path, is_dir, stamp);
+
+    fapi_cache_entry *e;
+    for (e = cache.head; e; e = e->next) {
+        if (e->is_dir == is_dir && !strcmp(e->path, path)) {
+            break;
+        }
+    }
+
+    if (!e) {
+        e = calloc(1, sizeof(*e));
+        if (!e) {
+            return NULL;
+        }
+        e->path = strdup(path);
+        if (!e->path) {
+            free(e);
+            return NULL;
+        }
+        e->is_dir = is_dir;
+        e->next = cache.head;
+        cache.head = e;
+    }
+
+    if (memcmp(e->stamp, stamp, sizeof(stamp))) {
+        fapi_cache_entry_clear(e);
+        memcpy(e->stamp, stamp, sizeof(stamp));
+    }
+
+    return e;
+}
+
+static TSS2_RC fapi_cached_list(FAPI_CONTEXT *ctx, const char *path, char **list) {
+
+    fapi_cache_entry *e = cache.enabled ? fapi_cache_entry_get(path, true) : NULL;
+    if (e && (e->fields & fapi_cache_list)) {
+        *list = strndup(e->list, twist_len(e->list));
+        return *list ? TSS2_RC_SUCCESS : TSS2_FAPI_RC_MEMORY;
+    }
+
+    char *fapi_list = NULL;
+    TSS2_RC rc = Fapi_List(ctx, path, &fapi_list);
+    if (rc) {
+        return rc;
+    }
+
+    *list = strdup(fapi_list);
+    Fapi_Free(fapi_list);
+    if (!*list) {
+        return TSS2_FAPI_RC_MEMORY;
+    }
+
+    if (e) {
+        e->list = twist_new(*list);
+        if (e->list) {
+            e->fields |= fapi_cache_list;
+            cache.dirty = true;
+        }
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC fapi_cached_get_description(FAPI_CONTEXT *ctx, const char *path, char **description) {
+
+    fapi_cache_entry *e = cache.enabled ? fapi_cache_entry_get(path, false) : NULL;
+    if (e && (e->fields & fapi_cache_description)) {
+        *description = strndup(e->description, twist_len(e->description));
+        return *description ? TSS2_RC_SUCCESS : TSS2_FAPI_RC_MEMORY;
+    }
+
+    char *fapi_description = NULL;
+    TSS2_RC rc = Fapi_GetDescription(ctx, path, &fapi_description);
+    if (rc) {
+        return rc;
+    }
+
+    *description = strdup(fapi_description ? fapi_description : "");
+    Fapi_Free(fapi_description);
+    if (!*description) {
+        return TSS2_FAPI_RC_MEMORY;
+    }
+
+    if (e) {
+        e->description = twist_new(*description);
+        if (e->description) {
+            e->fields |= fapi_cache_description;
+            cache.dirty = true;
+        }
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC fapi_cached_get_appdata(FAPI_CONTEXT *ctx, const char *path, twist *appdata) {
+
+    fapi_cache_entry *e = cache.enabled ? fapi_cache_entry_get(path, false) : NULL;
+    if (e && (e->fields & fapi_cache_appdata)) {
+        *appdata = twist_dup(e->appdata);
+        return *appdata ? TSS2_RC_SUCCESS : TSS2_FAPI_RC_MEMORY;
+    }
+
+    uint8_t *data = NULL;
+    size_t len = 0;
+    TSS2_RC rc = Fapi_GetAppData(ctx, path, &data, &len);
+    if (rc) {
+        return rc;
+    }
+
+    *appdata = twistbin_new(data, len);
+    Fapi_Free(data);
+    if (!*appdata) {
+        return TSS2_FAPI_RC_MEMORY;
+    }
+
+    if (e) {
+        e->appdata = twist_dup(*appdata);
+        if (e->appdata) {
+            e->fields |= fapi_cache_appdata;
+            cache.dirty = true;
+        }
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC fapi_cached_get_esys_blob(FAPI_CONTEXT *ctx, const char *path,
+        uint8_t *type, twist *blob) {
+
+    fapi_cache_entry *e = cache.enabled ? fapi_cache_entry_get(path, false) : NULL;
+    if (e && (e->fields & fapi_cache_esys)) {
+        *type = e->esys_type;
+        *blob = twist_dup(e->esys);
+        return *blob ? TSS2_RC_SUCCESS : TSS2_FAPI_RC_MEMORY;
+    }
+
+    uint8_t *data = NULL;
+    size_t length = 0;
+    TSS2_RC rc = Fapi_GetEsysBlob(ctx, path, type, &data, &length);
+    if (rc) {
+        return rc;
+    }
+
+    *blob = twistbin_new(data, length);
+    Fapi_Free(data);
+    if (!*blob) {
+        return TSS2_FAPI_RC_MEMORY;
+    }
+
+    if (e) {
+        e->esys = twist_dup(*blob);
+        if (e->esys) {
+            e->esys_type = *type;
+            e->fields |= fapi_cache_esys;
+            cache.dirty = true;
+        }
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+
+static bool fapi_cache_write_bytes(FILE *f, const void *data, size_t len) {
+    return fwrite(data, 1, len, f) == len;
+}
+
+static bool fapi_cache_write_twist(FILE *f, twist t) {
+    uint32_t len = t ? twist_len(t) : 0;
+    return fapi_cache_write_bytes(f, &len, sizeof(len))
+            && fapi_cache_write_bytes(f, t, len);
+}
+
+static bool fapi_cache_write_str(FILE *f, const char *s) {
+    uint32_t len = strlen(s);
+    return fapi_cache_write_bytes(f, &len, sizeof(len))
+            && fapi_cache_write_bytes(f, s, len);
+}
+
+static bool fapi_cache_read_bytes(FILE *f, void *data, size_t len) {
+    return fread(data, 1, len, f) == len;
+}
+
+static twist fapi_cache_read_twist(FILE *f) {
+
+    uint32_t len;
+    if (!fapi_cache_read_bytes(f, &len, sizeof(len))) {
+        return NULL;
+    }
+
+    /* entries are small, anything bigger is a corrupt file */
+    if (len > 1024 * 1024) {
+        return NULL;
+    }
+
+    uint8_t *buf = malloc(len ? len : 1);
+    if (!buf) {
+        return NULL;
+    }
+
+    twist t = NULL;
+    if (fapi_cache_read_bytes(f, buf, len)) {
+        t = twistbin_new(buf, len);
+    }
+    free(buf);
+
+    return t;
+}
+
+static bool fapi_cache_read_str_eq(FILE *f, const char *s) {
+
+    twist t = fapi_cache_read_twist(f);
+    bool eq = t && twist_len(t) == strlen(s) && !memcmp(t, s, twist_len(t));
+    twist_free(t);
+    return eq;
+}
+
+static void fapi_cache_load(void) {
+
+    char path[PATH_MAX];
+    if (fapi_store_path(FAPI_CACHE_FILE, path, sizeof(path)) != CKR_OK) {
+        return;
+    }
+
+    FILE *f = fopen(path, "re");
+    if (!f) {
+        return;
+    }
+
+    char magic[8];
+    uint32_t version = 0;
+    uint32_t count = 0;
+    if (!fapi_cache_read_bytes(f, magic, sizeof(magic))
+            || memcmp(magic, FAPI_CACHE_MAGIC, sizeof(magic))
+            || !fapi_cache_read_bytes(f, &version, sizeof(version))
+            || version != FAPI_CACHE_VERSION
+            /* written for another keystore */
+            || !fapi_cache_read_str_eq(f, cache.profile)
+            || !fapi_cache_read_str_eq(f, cache.dirs[fapi_keystore_user])
+            || !fapi_cache_read_str_eq(f, cache.dirs[fapi_keystore_system])
+            || !fapi_cache_read_bytes(f, &count, sizeof(count))) {
+        LOGV("Ignoring FAPI cache \"%s\"", path);
+        goto out;
+    }
 
-#ifdef HAVE_FAPI
-FAPI_CONTEXT *fctx = NULL;
-unsigned maxobjectid = 0;
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        fapi_cache_entry *e = calloc(1, sizeof(*e));
+        if (!e) {
+            goto error;
+        }
+        e->next = cache.head;
+        cache.head = e;
+
+        twist p = fapi_cache_read_twist(f);
+        if (!p) {
+            goto error;
+        }
+        e->path = strndup(p, twist_len(p));
+        twist_free(p);
+        if (!e->path
+                || !fapi_cache_read_bytes(f, &e->is_dir, sizeof(e->is_dir))
+                || !fapi_cache_read_bytes(f, e->stamp, sizeof(e->stamp))
+                || !fapi_cache_read_bytes(f, &e->fields, sizeof(e->fields))
+                || !fapi_cache_read_bytes(f, &e->esys_type, sizeof(e->esys_type))) {
+            goto error;
+        }
+
+        if ((e->fields & fapi_cache_list) && !(e->list = fapi_cache_read_twist(f))) {
+            goto error;
+        }
+        if ((e->fields & fapi_cache_description) && !(e->description = fapi_cache_read_twist(f))) {
+            goto error;
+        }
+        if ((e->fields & fapi_cache_appdata) && !(e->appdata = fapi_cache_read_twist(f))) {
+            goto error;
+        }
+        if ((e->fields & fapi_cache_esys) && !(e->esys = fapi_cache_read_twist(f))) {
+            goto error;
+        }
+    }
+
+out:
+    fclose(f);
+    return;
+
+error:
+    LOGW("Dropping corrupt FAPI cache \"%s\"", path);
+    /* a half read entry must not be used */
+    fapi_cache_entries_free();
+    goto out;
+}
+
+static void fapi_cache_save(void) {
+
+    if (!cache.enabled || !cache.dirty) {
+        return;
+    }
+
+    char root[PATH_MAX];
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    if (fapi_store_path("", root, sizeof(root)) != CKR_OK
+            || fapi_store_path(FAPI_CACHE_FILE, path, sizeof(path)) != CKR_OK
+            || fapi_store_path(FAPI_CACHE_FILE ".tmp", tmp, sizeof(tmp)) != CKR_OK
+            || fapi_mkdirs(root) != CKR_OK) {
+        return;
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!f) {
+        LOGW("Could not write FAPI cache \"%s\": %s", tmp, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    uint32_t version = FAPI_CACHE_VERSION;
+    uint32_t count = 0;
+    fapi_cache_entry *e;
+    for (e = cache.head; e; e = e->next) {
+        count++;
+    }
+
+    bool ok = fapi_cache_write_bytes(f, FAPI_CACHE_MAGIC, 8)
+            && fapi_cache_write_bytes(f, &version, sizeof(version))
+            && fapi_cache_write_str(f, cache.profile)
+            && fapi_cache_write_str(f, cache.dirs[fapi_keystore_user])
+            && fapi_cache_write_str(f, cache.dirs[fapi_keystore_system])
+            && fapi_cache_write_bytes(f, &count, sizeof(count));
+
+    for (e = cache.head; ok && e; e = e->next) {
+        ok = fapi_cache_write_str(f, e->path)
+                && fapi_cache_write_bytes(f, &e->is_dir, sizeof(e->is_dir))
+                && fapi_cache_write_bytes(f, e->stamp, sizeof(e->stamp))
+                && fapi_cache_write_bytes(f, &e->fields, sizeof(e->fields))
+                && fapi_cache_write_bytes(f, &e->esys_type, sizeof(e->esys_type))
+                && (!(e->fields & fapi_cache_list) || fapi_cache_write_twist(f, e->list))
+                && (!(e->fields & fapi_cache_description) || fapi_cache_write_twist(f, e->description))
+                && (!(e->fields & fapi_cache_appdata) || fapi_cache_write_twist(f, e->appdata))
+                && (!(e->fields & fapi_cache_esys) || fapi_cache_write_twist(f, e->esys));
+    }
+
+    ok = !fflush(f) && !fsync(fileno(f)) && ok;
+    ok = !fclose(f) && ok;
+    if (!ok || rename(tmp, path)) {
+        LOGW("Could not write FAPI cache \"%s\"", path);
+        unlink(tmp);
+        return;
+    }
+
+    cache.dirty = false;
+}
+
+/*
+ * Finds the object store, TPM2_PKCS11_FAPI_STORE or else a directory in the
+ * user keystore. Must follow fapi_cache_config_load().
+ */
+static void fapi_store_init(void) {
+
+    const char *env_path = getenv(FAPI_STORE_ENV_VAR);
+    if (env_path) {
+        store_root = strdup(env_path);
+    } else if (cache.dirs[fapi_keystore_user]) {
+        size_t len = 0;
+        safe_add(len, strlen(cache.dirs[fapi_keystore_user]),
+                sizeof("/" FAPI_STORE_DIR));
+        store_root = malloc(len);
+        if (store_root) {
+            snprintf(store_root, len, "%s/" FAPI_STORE_DIR,
+                    cache.dirs[fapi_keystore_user]);
+        }
+    } else {
+        LOGW("No user_dir in the FAPI config, FAPI tokens cannot keep objects");
+        return;
+    }
+
+    if (!store_root) {
+        LOGE("oom");
+    }
+}
+
+static void fapi_cache_init(void) {
+
+    /* the keystore dirs locate the object store, cached or not */
+    bool config_ok = fapi_cache_config_load();
+    fapi_store_init();
+
+    const char *env = getenv(FAPI_CACHE_ENV_VAR);
+    if (env && !strcmp(env, "0")) {
+        LOGV("FAPI cache disabled");
+        return;
+    }
+
+    cache.enabled = config_ok;
+    if (cache.enabled) {
+        fapi_cache_load();
+    }
+}
+
+static void fapi_cache_destroy(void) {
+
+    fapi_cache_save();
+    fapi_cache_entries_free();
+
+    free(cache.profile);
+    unsigned i;
+    for (i = 0; i < fapi_keystore_max; i++) {
+        free(cache.dirs[i]);
+    }
+    memset(&cache, 0, sizeof(cache));
+
+    free(store_root);
+    store_root = NULL;
+}
 
 static CK_RV get_key(FAPI_CONTEXT *fapictx, tpm_ctx *tctx, const char *path, uint32_t *esysHandle, uint32_t *tpmHandle) {
 
     bool ret;
     TSS2_RC rc;
     uint8_t type;
-    uint8_t *data;
-    size_t length;
+    twist twistdata = NULL;
 
-    rc = Fapi_GetEsysBlob(fapictx, path, &type, &data, &length);
+    rc = fapi_cached_get_esys_blob(fapictx, path, &type, &twistdata);
+    if (rc == TSS2_FAPI_RC_MEMORY) {
+        return CKR_HOST_MEMORY;
+    }
     if (rc != TSS2_RC_SUCCESS) {
         LOGE("Cannot get Esys blob for key %s", path);
         return CKR_GENERAL_ERROR;
     }
 
-    twist twistdata = twistbin_new(data, length);
-    Fapi_Free(data);
-    if (!twistdata) {
-        return CKR_HOST_MEMORY;
-    }
-
     switch(type) {
     case FAPI_ESYSBLOB_CONTEXTLOAD:
         ret = tpm_contextload_handle(tctx, twistdata, esysHandle);
@@ -59,6 +1388,7 @@ static CK_RV get_key(FAPI_CONTEXT *fapictx, tpm_ctx *tctx, const char *path, uin
     }
 }
 
+
 CK_RV backend_fapi_init(void) {
     if (fctx) {
         LOGW("Backend FAPI already initialized.");
@@ -70,10 +1400,12 @@ CK_RV backend_fapi_init(void) {
         LOGW("Could not initialize FAPI");
         return CKR_GENERAL_ERROR;
     }
+    fapi_cache_init();
     return CKR_OK;
 }
 
 CK_RV backend_fapi_destroy(void) {
+    fapi_cache_destroy();
     LOGV("Calling Fapi_Finalize");
     Fapi_Finalize(&fctx);
     return CKR_OK;
@@ -133,6 +1465,14 @@ CK_RV backend_fapi_create_token_seal(token *t, const twist hexwrappingkey,
                        const twist newauth, const twist newsalthex) {
     TSS2_RC rc;
 
+    fapi_cache_reset();
+
+    /* objects left behind by an earlier token with this id are not ours */
+    CK_RV rv = fapi_token_dir_remove(t->id);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
     char *path = tss_path_from_id(t->id, "so");
     if (!path) {
         LOGE("No path constructed.");
@@ -204,7 +1544,7 @@ CK_RV backend_fapi_create_token_seal(token *t, const twist hexwrappingkey,
         return CKR_HOST_MEMORY;
     }
 
-    CK_RV rv = get_key(t->fapi.ctx, t->tctx, parentpath, &t->pobject.handle, &t->pid);
+    rv = get_key(t->fapi.ctx, t->tctx, parentpath, &t->pobject.handle, &t->pid);
     free(parentpath);
     if (rv != CKR_OK) {
         LOGE("Error getting parent key");
@@ -223,7 +1563,7 @@ CK_RV backend_fapi_add_tokens(token *tok, size_t *len) {
     TSS2_RC rc;
     char *pathlist;
 
-    rc = Fapi_List(fctx, "/HS/SRK", &pathlist);
+    rc = fapi_cached_list(fctx, "/HS/SRK", &pathlist);
     if (rc == TSS2_FAPI_RC_IO_ERROR) {
         /* If no token seals were found, we're done here. */
         LOGV("No FAPI token seals found.");
@@ -268,8 +1608,15 @@ CK_RV backend_fapi_add_tokens(token *tok, size_t *len) {
             goto error;
         }
 
-        //FIXME
-        t->fapi.ctx = fctx;
+        /*
+         * The primary is needed to read the token, its tpm context is cheap
+         * as it shares FAPI's TCTI. The rest is left to token_tpm_load().
+         */
+        rv = backend_fapi_ctx_new(t);
+        if (rv) {
+            LOGE("Could not initialize tpm ctx: 0x%lx", rv);
+            goto error;
+        }
 
         char *parentpath = path_get_parent(path);
         if (!parentpath) {
@@ -284,93 +1631,41 @@ CK_RV backend_fapi_add_tokens(token *tok, size_t *len) {
         }
 
         char *label;
-        rc = Fapi_GetDescription(t->fapi.ctx, path, &label);
+        rc = fapi_cached_get_description(t->fapi.ctx, path, &label);
         if (rc) {
             LOGE("Getting FAPI seal description failed.");
             goto error;
         }
-        memcpy(&t->label[0], label, strlen(label));
-        Fapi_Free(label);
+        memcpy(&t->label[0], label, strnlen(label, sizeof(t->label)));
+        free(label);
 
         LOGV("Parsing objects for token %i:%s", t->id, &t->label[0]);
 
-        uint8_t *appdata;
-        size_t appdata_len;
-
-        rc = Fapi_GetAppData(t->fapi.ctx, path, &appdata, &appdata_len);
+        twist appdata = NULL;
+        rc = fapi_cached_get_appdata(t->fapi.ctx, path, &appdata);
         if (rc) {
             LOGE("Getting FAPI seal appdata failed.");
             goto error;
         }
 
-        t->fapi.soauthsalt = twistbin_new(appdata, strlen((char *)appdata));
+        t->fapi.soauthsalt = twistbin_new(appdata, strlen(appdata));
         if (!t->fapi.soauthsalt) {
             LOGE("OOM");
-            Fapi_Free(appdata);
+            twist_free(appdata);
             goto error;
         }
 
-        size_t offset = 0;
-        safe_add(offset, strlen((char *)appdata), 1);
-        uint8_t *yaml = &appdata[offset];
-
-        while ((size_t)(yaml - appdata) < appdata_len) {
-            LOGV("Current tobj at offset %zi / %zi is: %s",
-                 yaml - appdata, appdata_len, yaml);
-
-            if (((size_t)(yaml - appdata) > appdata_len - 9) ||
-                    (strlen((char*)yaml) < 10)) {
-                LOGE("Incomplete tobj in appdata");
-                Fapi_Free(appdata);
-                goto error;
-            }
-
-            tobject *tobj = tobject_new();
-            if (!tobj) {
-                LOGE("oom");
-                Fapi_Free(appdata);
-                goto error;
-            }
-
-            if (sscanf((char*)yaml, "%08x:", &tobj->id) != 1) {
-                LOGE("Could not scan tobj id");
-                free(tobj);
-                Fapi_Free(appdata);
-                goto error;
-            }
-
-            maxobjectid = (maxobjectid > tobj->id)? maxobjectid : tobj->id;
-
-            if (!parse_attributes_from_string(&yaml[9], strlen((char*)&yaml[9]),
-                                              &tobj->attrs)) {
-                LOGE("Could not parse FAPI attrs, got: \"%s\"", yaml);
-                free(tobj);
-                Fapi_Free(appdata);
-                goto error;
-            }
-
-            rv = object_init_from_attrs(tobj);
-            if (rv != CKR_OK) {
-                LOGE("Object initialization failed");
-                free(tobj);
-                Fapi_Free(appdata);
-                goto error;
-            }
-
-            rv = token_add_tobject_last(t, tobj);
-            if (rv != CKR_OK) {
-                LOGE("Failed to initialize tobject from FAPI");
-                free(tobj);
-                Fapi_Free(appdata);
-                goto error;
-            }
+        rv = fapi_migrate_appdata(t, (uint8_t *)appdata, twist_len(appdata));
+        twist_free(appdata);
+        if (rv != CKR_OK) {
+            LOGE("Could not copy the objects of token %u out of the FAPI appdata", t->id);
+            goto error;
+        }
 
-            size_t offset = 0;
-            safe_add(offset, strlen((char *)yaml), 1);
-            yaml += offset;
-            LOGV("\nCurrent next is: %zi / %zi", yaml - appdata, appdata_len);
+        rv = fapi_tobjects_load(t);
+        if (rv != CKR_OK) {
+            goto error;
         }
-        Fapi_Free(appdata);
 
         t->config.is_initialized = true;
 
@@ -382,7 +1677,7 @@ CK_RV backend_fapi_add_tokens(token *tok, size_t *len) {
             goto error;
         }
 
-        rc = Fapi_GetAppData(t->fapi.ctx, path, &appdata, NULL);
+        rc = fapi_cached_get_appdata(t->fapi.ctx, path, &appdata);
         free(path);
         if (rc == TSS2_FAPI_RC_KEY_NOT_FOUND) {
             LOGV("No user pin found for token %08x.", t->id);
@@ -393,22 +1688,26 @@ CK_RV backend_fapi_add_tokens(token *tok, size_t *len) {
             goto error;
         }
 
-        t->fapi.userauthsalt = twistbin_new(appdata, strlen((char *)appdata));
-        Fapi_Free(appdata);
+        t->fapi.userauthsalt = twistbin_new(appdata, strlen(appdata));
+        twist_free(appdata);
         if (!t->fapi.userauthsalt) {
             LOGE("OOM");
             goto error;
         }
     }
 
+    /* every token seal is known, drop the objects of deleted ones */
+    fapi_store_sweep(tok, *len);
+
     rv = CKR_OK;
 
 out:
-    Fapi_Free(pathlist);
+    free(pathlist);
+    /* the next process finds the keystore in the cache */
+    fapi_cache_save();
     return rv;
 
 error:
-    Fapi_Free(pathlist);
     if (rv == CKR_OK) {
         rv = CKR_GENERAL_ERROR;
     }
@@ -423,6 +1722,8 @@ CK_RV backend_fapi_init_user(token *t, const twist sealdata,
                         const twist newauthhex, const twist newsalthex) {
     TSS2_RC rc;
 
+    fapi_cache_reset();
+
     char *path = tss_path_from_id(t->id, "usr");
     if (!path) {
         LOGE("No path constructed.");
@@ -484,72 +1785,51 @@ CK_RV backend_fapi_init_user(token *t, const twist sealdata,
  *
  * See backend_add_object()
  *
- * The object is added to the AppData of the token object
- * in the FAPI keystore. The different objects are separated
- * by a \0 delimiter. The first element of the AppData is the
- * salthex, so the first object starts after the first \0.
+ * The object is written to its own file in the token directory, under an
+ * id claimed with fapi_tobject_id_claim().
  */
 CK_RV backend_fapi_add_object(token *t, tobject *tobj) {
-    TSS2_RC rc;
 
     LOGV("Adding object to fapi token %i", t->id);
 
-    char *path = tss_path_from_id(t->id, "so");
-    if (!path) {
-        LOGE("No path constructed.");
-        return CKR_GENERAL_ERROR;
+    char dir[PATH_MAX];
+    CK_RV rv = fapi_token_dir(t->id, dir, sizeof(dir));
+    if (rv != CKR_OK) {
+        return rv;
     }
 
-    safe_adde(maxobjectid, 1);
-    tobj->id = maxobjectid;
+    rv = fapi_mkdirs(dir);
+    if (rv != CKR_OK) {
+        return rv;
+    }
 
     char *attrs = emit_attributes_to_string(tobj->attrs);
     if (!attrs) {
         LOGE("OOM");
-        free(path);
         return CKR_GENERAL_ERROR;
     }
 
-    uint8_t *appdata;
-    size_t appdata_len;
-    rc = Fapi_GetAppData(t->fapi.ctx, path, &appdata, &appdata_len);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
+    /* an id is never handed out twice, even if the object write fails */
+    unsigned id = 0;
+    rv = fapi_tobject_id_claim(t->id, &id);
+    if (rv != CKR_OK) {
+        free(attrs);
+        return rv;
     }
 
-    size_t newappdata_len = appdata_len;
-    safe_adde(newappdata_len, 9); /* id as 8byte hex and ':' */
-    safe_adde(newappdata_len, strlen(attrs));
-    safe_adde(newappdata_len, 1); /* terminating '\0' */
-    uint8_t *newappdata = malloc(newappdata_len);
-    if (!newappdata) {
-        LOGE("OOM");
-        Fapi_Free(appdata);
-        goto error;
+    rv = fapi_tobject_write(t->id, id, attrs);
+    free(attrs);
+    if (rv != CKR_OK) {
+        char path[PATH_MAX];
+        if (fapi_tobject_id_path(t->id, id, path, sizeof(path)) == CKR_OK) {
+            unlink(path);
+        }
+        return rv;
     }
 
-    memcpy(&newappdata[0], &appdata[0], appdata_len);
-    sprintf((char*)&newappdata[appdata_len], "%08x:", tobj->id);
-    memcpy(&newappdata[appdata_len + 9], attrs, strlen(attrs));
-    newappdata[newappdata_len - 1] = '\0';
-    Fapi_Free(appdata);
-
-    rc = Fapi_SetAppData(t->fapi.ctx, path, newappdata, newappdata_len);
-    free(newappdata);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
-    }
+    tobj->id = id;
 
-    free(path);
-    free(attrs);
     return CKR_OK;
-
-error:
-    free(path);
-    free(attrs);
-    return CKR_GENERAL_ERROR;
 }
 
 /** Given a token and tobject, will persist the new attributes in fapi backend.
@@ -557,88 +1837,17 @@ error:
  * see backend_update_tobject_attrs().
  */
 CK_RV backend_fapi_update_tobject_attrs(token *t, tobject *tobj, attr_list *attrlist) {
-    TSS2_RC rc;
-
-    char *path = tss_path_from_id(t->id, "so");
-    if (!path) {
-        LOGE("No path constructed.");
-        return CKR_GENERAL_ERROR;
-    }
-
-    uint8_t *appdata;
-    size_t appdata_len;
-    rc = Fapi_GetAppData(t->fapi.ctx, path, &appdata, &appdata_len);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
-    }
-
-    /* Skip over soauthvalue (the first element of appData) */
-    size_t tobj_start = strlen((char*)appdata) + 1;
-
-    /* Find the offset of the tobj to delete */
-    while (1) {
-        if (tobj_start + 9 >= appdata_len) {
-            LOGE("tobj not found in appdata.");
-            goto error;
-        }
-
-        unsigned id;
-        if (sscanf((char*)&appdata[tobj_start], "%08x:", &id) != 1) {
-            LOGE("bad tobject.");
-            goto error;
-        }
-
-        if (id == tobj->id) {
-            LOGV("Object found at offset %zi.", tobj_start);
-            break;
-        }
-
-        safe_adde(tobj_start, strlen((char*)&appdata[tobj_start]));
-        safe_adde(tobj_start, 1);
-    }
-
-    size_t tobj_len = strlen((char*)&appdata[tobj_start]);
 
     char *attrs = emit_attributes_to_string(attrlist);
     if (!attrs) {
         LOGE("OOM");
-        free(path);
         return CKR_GENERAL_ERROR;
     }
 
-    size_t newappdata_len = appdata_len - tobj_len;
-    safe_adde(newappdata_len, 9); /* id as 8byte hex and ':' */
-    safe_adde(newappdata_len, strlen(attrs));
-    uint8_t *newappdata = malloc(newappdata_len);
-    if (!newappdata) {
-        LOGE("OOM");
-        Fapi_Free(appdata);
-        goto error;
-    }
-
-    memcpy(&newappdata[0], &appdata[0], tobj_start);
-    sprintf((char*)&newappdata[tobj_start], "%08x:%s", tobj->id, attrs);
-    memcpy(&newappdata[tobj_start + 9 + strlen(attrs) + 1],
-           &appdata[tobj_start + tobj_len],
-           appdata_len - tobj_start - tobj_len - 1);
-    newappdata[newappdata_len - 1] = '\0';
-
-    Fapi_Free(appdata);
-
-    rc = Fapi_SetAppData(t->fapi.ctx, path, newappdata, newappdata_len);
-    free(newappdata);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
-    }
-
-    free(path);
-    return CKR_OK;
+    CK_RV rv = fapi_tobject_write(t->id, tobj->id, attrs);
+    free(attrs);
 
-error:
-    free(path);
-    return CKR_GENERAL_ERROR;
+    return rv;
 }
 
 /** Removes a tobject from the fapi backend.
@@ -646,65 +1855,19 @@ error:
  * See backend_rm_tobject().
  */
 CK_RV backend_fapi_rm_tobject(token *t, tobject *tobj) {
-    TSS2_RC rc;
-
-    char *path = tss_path_from_id(t->id, "so");
-    if (!path) {
-        LOGE("No path constructed.");
-        return CKR_GENERAL_ERROR;
-    }
-
-    uint8_t *appdata;
-    size_t appdata_len;
-    rc = Fapi_GetAppData(t->fapi.ctx, path, &appdata, &appdata_len);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
-    }
-
-    /* Skip over soauthvalue (the first element of appData) */
-    size_t tobj_start = strlen((char*)appdata) + 1;
 
-    /* Find the offset of the tobj to delete */
-    while (1) {
-        if (tobj_start + 9 >= appdata_len) {
-            LOGE("tobj not found in appdata.");
-            goto error;
-        }
-
-        unsigned id;
-        if (sscanf((char*)&appdata[tobj_start], "%08x:", &id) != 1) {
-            LOGE("bad tobject.");
-            goto error;
-        }
-
-        if (id == tobj->id) {
-            LOGV("Object found at offset %zi.", tobj_start);
-            break;
-        }
-
-        safe_adde(tobj_start, strlen((char*)&appdata[tobj_start]));
-        safe_adde(tobj_start, 1);
+    char path[PATH_MAX];
+    CK_RV rv = fapi_tobject_id_path(t->id, tobj->id, path, sizeof(path));
+    if (rv != CKR_OK) {
+        return rv;
     }
 
-    size_t tobj_len = strlen((char*)&appdata[tobj_start]);
-    memmove(&appdata[tobj_start - 1], &appdata[tobj_start + tobj_len],
-            appdata_len - tobj_start - tobj_len);
-    appdata_len -= tobj_len + 1;
-
-    rc = Fapi_SetAppData(t->fapi.ctx, path, appdata, appdata_len);
-    Fapi_Free(appdata);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
+    if (unlink(path)) {
+        LOGE("Could not remove \"%s\": %s", path, strerror(errno));
+        return CKR_GENERAL_ERROR;
     }
 
-    free(path);
     return CKR_OK;
-
-error:
-    free(path);
-    return CKR_GENERAL_ERROR;
 }
 
 struct authtable {
@@ -776,7 +1939,9 @@ CK_RV backend_fapi_token_unseal_wrapping_key(token *tok, bool user, twist tpin)
     size_t size;
     rc = Fapi_Unseal(tok->fapi.ctx, path, &data, &size);
     Fapi_SetAuthCB(tok->fapi.ctx, NULL, NULL);
-    twist_free(sealobjauth);
+    if (rc || !user) {
+        twist_free(sealobjauth);
+    }
     if (user && rc == TSS2_FAPI_RC_PATH_NOT_FOUND) {
         rv = CKR_USER_PIN_NOT_INITIALIZED;
         goto error;
@@ -786,6 +1951,11 @@ CK_RV backend_fapi_token_unseal_wrapping_key(token *tok, bool user, twist tpin)
         goto error;
     }
 
+    /* keep the result of the KDF for C_SetPIN, see token_sealauth_for_pin() */
+    if (user) {
+        token_user_sealauth_set(tok, sealobjauth);
+    }
+
     twist wrappingkeyhex = twistbin_new(data, size);
     Fapi_Free(data);
     if (!wrappingkeyhex) {
@@ -838,13 +2008,15 @@ CK_RV backend_fapi_token_changeauth(token *tok, bool user, twist toldpin, twist
     twist newauthhex = NULL;
     twist oldauth = NULL;
 
-    rv = utils_setup_new_object_auth(tnewpin, &newauthhex, &newsalthex);
+    rv = utils_setup_new_object_auth(tnewpin, tok->config.pin_kdf,
+            &newauthhex, &newsalthex);
     if (rv != CKR_OK) {
         goto out;
     }
     rv = CKR_GENERAL_ERROR;
 
-    oldauth = utils_hash_pass(toldpin, user ? tok->fapi.userauthsalt : tok->fapi.soauthsalt);
+    oldauth = token_sealauth_for_pin(tok, user, toldpin,
+            user ? tok->fapi.userauthsalt : tok->fapi.soauthsalt);
     if (!oldauth) {
         goto out;
     }
@@ -868,6 +2040,8 @@ CK_RV backend_fapi_token_changeauth(token *tok, bool user, twist toldpin, twist
 
     LOGV("Attempting to change auth value for %s", path);
 
+    fapi_cache_reset();
+
     rc = Fapi_ChangeAuth(tok->fapi.ctx, path, newauthhex);
     Fapi_SetAuthCB(tok->fapi.ctx, NULL, NULL);
     if (rc) {
@@ -908,6 +2082,10 @@ CK_RV backend_fapi_token_changeauth(token *tok, bool user, twist toldpin, twist
     if (user) {
         twist_free(tok->fapi.userauthsalt);
         tok->fapi.userauthsalt = newsalthex;
+
+        if (tok->login_state == token_user_logged_in) {
+            token_user_sealauth_set(tok, twist_dup(newauthhex));
+        }
     } else {
         twist_free(tok->fapi.soauthsalt);
         tok->fapi.soauthsalt = newsalthex;
@@ -3,6 +3,7 @@
 #define SRC_LIB_BACKEND_FAPI_H_
 
 #include "config.h"
+#include "debug.h"
 #include "pkcs11.h"
 #include "twist.h"
 #include "token.h"
@@ -34,4 +35,11 @@ CK_RV backend_fapi_token_unseal_wrapping_key(token *tok, bool user, twist tpin);
 
 CK_RV backend_fapi_token_changeauth(token *tok, bool user, twist toldpin, twist tnewpin);
 
+/* Debug testing */
+#ifdef TESTING
+CK_RV fapi_tobject_id_claim(unsigned tokid, unsigned *id);
+CK_RV fapi_migrate_appdata(token *t, uint8_t *appdata, size_t appdata_len);
+CK_RV fapi_tobjects_load(token *t);
+#endif
+
 #endif /* SRC_LIB_BACKEND_FAPI_H_ */
@@ -3,10 +3,13 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include <fcntl.h>
 #include <libgen.h>
@@ -23,14 +26,19 @@
 #include "db.h"
 #include "debug.h"
 #include "emitter.h"
+#include "general.h"
 #include "log.h"
 #include "mutex.h"
 #include "object.h"
 #include "parser.h"
+/* the statement probes are fed by a trace hook only installed when traced */
+#define PROBE_WITH_SEMAPHORES
+#include "probes.h"
 #include "session_table.h"
 #include "token.h"
 #include "tpm.h"
 #include "twist.h"
+#include "typed_memory.h"
 #include "utils.h"
 
 #include <openssl/evp.h>
@@ -39,16 +47,36 @@
 #define TPM2_PKCS11_STORE_DIR "/etc/tpm2_pkcs11"
 #endif
 
-#define DB_VERSION 4
+#define DB_VERSION 11
+
+#define DB_JOURNAL_MODE_ENV "TPM2_PKCS11_STORE_JOURNAL_MODE"
+#define DB_BUSY_TIMEOUT_ENV "TPM2_PKCS11_STORE_BUSY_TIMEOUT"
+#define DB_BATCH_WINDOW_ENV "TPM2_PKCS11_STORE_BATCH_WINDOW"
+#define DB_BATCH_COUNT_ENV "TPM2_PKCS11_STORE_BATCH_COUNT"
+
+/* how long to retry a locked store before failing with SQLITE_BUSY */
+#define DB_BUSY_TIMEOUT_DEFAULT_MS 5000
+
+/* bounds of a group commit for tokens with batch durability, 0 disables a bound */
+#define DB_BATCH_WINDOW_DEFAULT_MS 200
+#define DB_BATCH_COUNT_DEFAULT 1000
+
+/* CKA_VALUE of public data objects and certificates at least this big, in bytes, is kept out of line */
+#define DB_VALUE_THRESHOLD_ENV "TPM2_PKCS11_STORE_VALUE_THRESHOLD"
+#define DB_VALUE_THRESHOLD_DEFAULT (64 * 1024)
 
 #define goto_oom(x, l) if (!x) { LOGE("oom"); goto l; }
 #define goto_error(x, l) if (x) { goto l; }
 #define gotobinderror(rc, msg) do { if (rc) { LOGE("cannot bind "msg); goto error; } } while(0)
 
-#define TRANSACTION_START \
+#define TRANSACTION_START TRANSACTION_START_BATCHED(false)
+
+/* when batched is true the transaction joins the open group commit, see start() */
+#define TRANSACTION_START_BATCHED(batched) \
     do { \
         bool _transaction_active = false; \
-        if (start() != SQLITE_OK) { \
+        bool _transaction_batched = (batched); \
+        if (start(_transaction_batched) != SQLITE_OK) { \
             goto error; \
         } \
 	    \
@@ -58,31 +86,163 @@
     error: \
         if (_transaction_active) { \
             if (rv == CKR_OK) { \
-                if(commit() != SQLITE_OK) { \
-                    rollback(); \
+                if(commit(_transaction_batched) != SQLITE_OK) { \
+                    rollback(_transaction_batched); \
                     rx = CKR_GENERAL_ERROR; \
 			    } \
             } else { \
-                rollback(); \
+                rollback(_transaction_batched); \
             } \
         } \
     } while (0);
 
+/* statements on global.db that are worth keeping prepared */
+typedef enum stmt_id stmt_id;
+enum stmt_id {
+    stmt_init_tobjects,
+    stmt_init_pobject,
+    stmt_init_sealobjects,
+    stmt_get_tokens,
+    stmt_pinchange_so,
+    stmt_pinchange_so_nopub,
+    stmt_pinchange_user,
+    stmt_pinchange_user_nopub,
+    stmt_add_tobject,
+    stmt_delete_tobject,
+    stmt_add_primary,
+    stmt_update_token_config,
+    stmt_update_tobject_attrs,
+    stmt_add_token,
+    stmt_add_sealobjects,
+    stmt_get_first_pid,
+    stmt_get_tobject,
+    stmt_get_tobject_rev,
+    stmt_get_tobject_revs,
+    stmt_data_version,
+    stmt_get_tobject_attrs,
+    stmt_set_tobject_attr,
+    stmt_clear_tobject_attrs,
+    stmt_tobject_attrs_in_table,
+    stmt_mark_tobject_attrs,
+    stmt_get_tobject_value_len,
+    stmt_set_tobject_value,
+    stmt_clear_tobject_value,
+    stmt_keypool_add,
+    stmt_keypool_get,
+    stmt_keypool_delete,
+    stmt_keypool_count,
+    stmt_get_pobject_context,
+    stmt_set_pobject_context,
+    stmt_max
+};
+
 static struct {
     sqlite3 *db;
+    /* only connections opened by db_init() cache statements */
+    bool cache_stmts;
+    sqlite3_stmt *stmts[stmt_max];
+    /*
+     * Object writes of tokens with batch durability share one open
+     * transaction on db. Every write transaction on db holds the mutex,
+     * as anything run on the connection while a batch is open joins it.
+     * The application threads, the key pool and prewarm workers and the
+     * flusher all write through db.
+     */
+    struct {
+        void *mutex;
+        bool open;      /* atomic, see db_flush_due() */
+        unsigned writes;
+        uint64_t opened_ms;
+        unsigned window_ms;
+        unsigned count;
+        /* commits a batch once its window is over, see batch_flusher() */
+        struct {
+            bool ready; /* lock and cond are initialized */
+            pthread_mutex_t lock;
+            pthread_cond_t cond;
+            bool has_thread;
+            pthread_t thread;
+            bool quit;
+            uint64_t deadline_ms; /* 0 while no batch waits for its window */
+        } flusher;
+    } batch;
+    /* 0 keeps every value in the attrs, see db_value_take() */
+    unsigned value_threshold;
+#ifdef HAVE_USDT
+    /* the sqlite3_trace_v2() mask installed on db */
+    unsigned trace_mask;
+#endif
 } global;
 
-static inline void _sqlite3_finalize_warn(sqlite3 *db, sqlite3_stmt *stmt) {
+#ifdef HAVE_USDT
+static void db_trace_sync(void);
+#else
+#define db_trace_sync() do { } while (0)
+#endif
+
+static inline int _sqlite3_finalize_warn(sqlite3 *db, sqlite3_stmt *stmt) {
 
     int rc = sqlite3_finalize(stmt);
     if (rc != SQLITE_OK) {
         LOGW("sqlite3_finalize: %s", sqlite3_errmsg(db));
     }
+
+    return rc;
 }
 
-static inline void sqlite3_finalize_warn(sqlite3_stmt *stmt) {
-    if (stmt) {
-        _sqlite3_finalize_warn(global.db, stmt);
+/*
+ * Gets a prepared statement for sql. A cached statement is taken out of
+ * its slot while in use, so a second user of the same statement, nested
+ * or on another thread, prepares a private copy instead of sharing it.
+ */
+static int stmt_get(stmt_id id, const char *sql, sqlite3_stmt **stmt) {
+
+    db_trace_sync();
+
+    if (global.cache_stmts) {
+        *stmt = __atomic_exchange_n(&global.stmts[id], NULL, __ATOMIC_ACQ_REL);
+        if (*stmt) {
+            return SQLITE_OK;
+        }
+    }
+
+    return sqlite3_prepare_v2(global.db, sql, -1, stmt, NULL);
+}
+
+/*
+ * Returns a statement from stmt_get(), resetting it for the next user or
+ * finalizing it when caching is off or the slot was refilled meanwhile.
+ * Returns the sqlite3_finalize() result, or SQLITE_OK when cached.
+ */
+static int stmt_put(stmt_id id, sqlite3_stmt *stmt) {
+
+    if (!stmt) {
+        return SQLITE_OK;
+    }
+
+    if (global.cache_stmts) {
+        /* reset repeats the error of the last step, which the caller handled */
+        UNUSED(sqlite3_reset(stmt));
+        sqlite3_clear_bindings(stmt);
+
+        sqlite3_stmt *expected = NULL;
+        if (__atomic_compare_exchange_n(&global.stmts[id], &expected, stmt,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return SQLITE_OK;
+        }
+    }
+
+    return _sqlite3_finalize_warn(global.db, stmt);
+}
+
+static void stmt_cache_flush(void) {
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(global.stmts); i++) {
+        sqlite3_stmt *stmt = __atomic_exchange_n(&global.stmts[i], NULL, __ATOMIC_ACQ_REL);
+        if (stmt) {
+            _sqlite3_finalize_warn(global.db, stmt);
+        }
     }
 }
 
@@ -125,6 +285,111 @@ struct token_get_cb_ud {
     token *tokens;
 };
 
+/*
+ * Objects of tokens with the table attribute store keep an empty attrs
+ * column and one tobject_attrs row per attribute. The value column holds
+ * the attribute exactly as PKCS#11 presents it, so a template value can be
+ * compared with it directly, and kind holds the type data of the value.
+ */
+static int db_get_tobject_attr_rows(unsigned id, attr_list **attrs) {
+
+    const char *sql =
+            "SELECT type,kind,value FROM tobject_attrs WHERE tobject_id=?;";
+
+    sqlite3_stmt *stmt;
+    int rc = stmt_get(stmt_get_tobject_attrs, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tobject attrs query: %s", sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    attr_list *l = attr_list_new();
+    if (!l) {
+        LOGE("oom");
+        rc = SQLITE_NOMEM;
+        goto out;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, id);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot bind tobject id: %s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+
+        CK_ATTRIBUTE_TYPE type = (CK_ATTRIBUTE_TYPE)sqlite3_column_int64(stmt, 0);
+        CK_BYTE kind = (CK_BYTE)sqlite3_column_int(stmt, 1);
+        CK_BYTE_PTR value = (CK_BYTE_PTR)sqlite3_column_blob(stmt, 2);
+        int len = sqlite3_column_bytes(stmt, 2);
+
+        if (!attr_list_add_typed(l, type, kind, value, len)) {
+            LOGE("Could not add attribute 0x%lx of tobject %u", type, id);
+            rc = SQLITE_ERROR;
+            goto out;
+        }
+    }
+
+    if (rc != SQLITE_DONE) {
+        LOGE("Cannot step tobject attrs query: %s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    if (!attr_list_get_count(l)) {
+        LOGE("tobject %u does not have attributes", id);
+        rc = SQLITE_ERROR;
+        goto out;
+    }
+
+    *attrs = l;
+    l = NULL;
+    rc = SQLITE_OK;
+
+out:
+    attr_list_free(l);
+    stmt_put(stmt_get_tobject_attrs, stmt);
+    return rc;
+}
+
+/*
+ * Large values are kept in tobject_values, with the tobject id as rowid,
+ * and read straight into the caller's buffer when asked for, see
+ * db_read_tobject_value(). Gets the length of the value of tobject id, 0
+ * when it has none.
+ */
+static int db_get_tobject_value_len(unsigned id, CK_ULONG *len) {
+
+    const char *sql = "SELECT length(value) FROM tobject_values WHERE id=?;";
+
+    sqlite3_stmt *stmt;
+    int rc = stmt_get(stmt_get_tobject_value_len, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tobject value query: %s", sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, id);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot bind tobject id: %s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        *len = (CK_ULONG)sqlite3_column_int64(stmt, 0);
+        rc = SQLITE_OK;
+    } else if (rc == SQLITE_DONE) {
+        *len = 0;
+        rc = SQLITE_OK;
+    } else {
+        LOGE("Cannot get value of tobject %u: %s", id, sqlite3_errmsg(global.db));
+    }
+
+out:
+    stmt_put(stmt_get_tobject_value_len, stmt);
+    return rc;
+}
+
 DEBUG_VISIBILITY tobject *__real_db_tobject_new(sqlite3_stmt *stmt) {
 
     tobject *tobj = tobject_new();
@@ -133,6 +398,8 @@ DEBUG_VISIBILITY tobject *__real_db_tobject_new(sqlite3_stmt *stmt) {
         return NULL;
     }
 
+    bool in_table = false;
+
     int i;
     int col_count = sqlite3_data_count(stmt);
     for (i=0; i < col_count; i++) {
@@ -143,15 +410,23 @@ DEBUG_VISIBILITY tobject *__real_db_tobject_new(sqlite3_stmt *stmt) {
 
         } else if (!strcmp(name, "tokid")) {
             // Ignore sid we don't need it as token has that data.
+        } else if (!strcmp(name, "rev")) {
+            tobj->rev = (uint64_t)sqlite3_column_int64(stmt, i);
         } else if (!strcmp(name, "attrs")) {
 
             int bytes = sqlite3_column_bytes(stmt, i);
             const unsigned char *attrs = sqlite3_column_text(stmt, i);
-            if (!attrs || !bytes) {
+            if (!attrs) {
                 LOGE("tobject does not have attributes");
                 goto error;
             }
 
+            /* the attributes are in tobject_attrs, load them once the id is known */
+            if (!bytes) {
+                in_table = true;
+                continue;
+            }
+
             bool res = parse_attributes_from_string(attrs, bytes,
                     &tobj->attrs);
             if (!res) {
@@ -166,12 +441,20 @@ DEBUG_VISIBILITY tobject *__real_db_tobject_new(sqlite3_stmt *stmt) {
 
     assert(tobj->id);
 
+    if (in_table && db_get_tobject_attr_rows(tobj->id, &tobj->attrs) != SQLITE_OK) {
+        goto error;
+    }
+
     CK_RV rv = object_init_from_attrs(tobj);
     if (rv != CKR_OK) {
         LOGE("Object initialization failed");
         goto error;
     }
 
+    if (db_get_tobject_value_len(tobj->id, &tobj->ext_value_len) != SQLITE_OK) {
+        goto error;
+    }
+
     return tobj;
 
 error:
@@ -189,7 +472,7 @@ DEBUG_VISIBILITY int __real_init_tobjects(token *tok) {
             "SELECT * FROM tobjects WHERE tokid=?";
 
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    int rc = stmt_get(stmt_init_tobjects, sql, &stmt);
     if (rc != SQLITE_OK) {
         LOGE("Cannot prepare tobject query: %s\n", sqlite3_errmsg(global.db));
         return rc;
@@ -219,7 +502,7 @@ DEBUG_VISIBILITY int __real_init_tobjects(token *tok) {
     rc = SQLITE_OK;
 
 error:
-    sqlite3_finalize(stmt);
+    stmt_put(stmt_init_tobjects, stmt);
     return rc;
 }
 
@@ -316,179 +599,786 @@ static int start2(sqlite3 *db) {
     return rc;
 }
 
-static int start(void) {
-    return start2(global.db);
-}
-
 static int commit2(sqlite3 *db) {
     return sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
 }
 
-static int commit(void) {
-    return commit2(global.db);
-}
-
 static int rollback2(sqlite3 *db) {
     return sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
 }
 
-static int rollback(void) {
-    return rollback2(global.db);
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
 }
 
-DEBUG_VISIBILITY CK_RV db_add_pobject_v4(sqlite3 *updb, pobject_v4 *new_pobj) {
-
-    CK_RV rv = CKR_GENERAL_ERROR;
-
-    sqlite3_stmt *stmt = NULL;
-
-    const char *sql =
-          "INSERT INTO pobjects2 ("
-            "id,"             // index: 1 type: INT
-            "hierarchy, "     // index: 2 type: TEXT
-            "config,"         // index: 3 type: TEXT
-            "objauth"         // index: 4 type: TEXT
-          ") VALUES ("
-            "?,?,?,?"
-          ");";
+static void batch_lock(void) {
+    if (global.batch.mutex) {
+        mutex_lock_fatal(global.batch.mutex);
+    }
+}
 
-    int rc = sqlite3_prepare_v2(updb, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        LOGE("%s", sqlite3_errmsg(updb));
-        goto error;
+static void batch_unlock(void) {
+    if (global.batch.mutex) {
+        mutex_unlock_fatal(global.batch.mutex);
     }
+}
 
-    rc = sqlite3_bind_int(stmt, 1, new_pobj->id);
-    gotobinderror(rc, "id");
+static bool batch_is_due(void) {
 
-    rc = sqlite3_bind_text(stmt, 2, new_pobj->hierarchy, -1, SQLITE_STATIC);
-    gotobinderror(rc, "hierarchy");
+    if (global.batch.count && global.batch.writes >= global.batch.count) {
+        return true;
+    }
 
-    rc = sqlite3_bind_text(stmt, 3, new_pobj->config, -1, SQLITE_STATIC);
-    gotobinderror(rc, "config");
+    return global.batch.window_ms &&
+            now_ms() - global.batch.opened_ms >= global.batch.window_ms;
+}
 
-    rc = sqlite3_bind_text(stmt, 4, new_pobj->objauth, -1, SQLITE_STATIC);
-    gotobinderror(rc, "objauth");
+/*
+ * Commits the open batch, if any. Must hold the batch lock. On failure
+ * the whole batch is rolled back, its writes were already reported as
+ * done to the application, that is what batch durability trades away.
+ */
+static int batch_commit(void) {
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        LOGE("step error: %s", sqlite3_errmsg(updb));
-        goto error;
+    if (!global.batch.open) {
+        return SQLITE_OK;
     }
 
-    rv = CKR_OK;
-error:
-    rc = sqlite3_finalize(stmt);
+    __atomic_store_n(&global.batch.open, false, __ATOMIC_RELAXED);
+
+    int rc = commit2(global.db);
     if (rc != SQLITE_OK) {
-        LOGW("Could not finalize stmt: %d", rc);
+        LOGE("Cannot commit %u batched object writes: %s",
+                global.batch.writes, sqlite3_errmsg(global.db));
+        rollback2(global.db);
+    } else {
+        LOGV("Committed %u batched object writes", global.batch.writes);
     }
 
-    return rv;
+    global.batch.writes = 0;
+
+    return rc;
 }
 
-DEBUG_VISIBILITY int init_pobject_from_stmt(sqlite3_stmt *stmt, tpm_ctx *tpm, pobject *pobj) {
+/* must hold global.batch.flusher.lock */
+static void batch_flusher_wait(uint64_t ms) {
 
-    /* Get the YAML config and:
-     *   - parse it to the config structure
-     *   - if persistent deserializes the ESYS_TR into the handle
-     *   - if transient, verify that the template_name is set
-     */
-    size_t yaml_size = sqlite3_column_bytes(stmt, 0);
-    const unsigned char *pobj_yaml_conf = sqlite3_column_text(stmt, 0);
-    bool res = parse_pobject_config_from_string(pobj_yaml_conf, yaml_size,
-            &pobj->config);
-    if (!res) {
-        LOGE("Could not parse pobject config");
-        return SQLITE_ERROR;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
     }
 
-    if (!pobj->config.is_transient) {
-        if (!pobj->config.blob) {
-            LOGE("Expected persistent pobject config to have ESYS_TR blob");
-            return SQLITE_ERROR;
+    UNUSED(pthread_cond_timedwait(&global.batch.flusher.cond,
+            &global.batch.flusher.lock, &ts));
+}
+
+/*
+ * Commits batches that outlive their window, so an idle application does
+ * not keep the store's write lock from other processes.
+ */
+static void *batch_flusher(void *arg) {
+    UNUSED(arg);
+
+    pthread_mutex_lock(&global.batch.flusher.lock);
+
+    while (!global.batch.flusher.quit) {
+
+        uint64_t deadline = global.batch.flusher.deadline_ms;
+        if (!deadline) {
+            pthread_cond_wait(&global.batch.flusher.cond,
+                    &global.batch.flusher.lock);
+            continue;
         }
-        res = tpm_deserialize_handle(tpm, pobj->config.blob, &pobj->handle, NULL);
-        if (!res) {
-            /* just set a general error as rc could be success right now */
-            return SQLITE_ERROR;
+
+        uint64_t now = now_ms();
+        if (now < deadline) {
+            batch_flusher_wait(deadline - now);
+            continue;
         }
-    } else if (!pobj->config.template_name) {
-        LOGE("Expected transient pobject config to have a template name");
-        return SQLITE_ERROR;
-    }
 
-    pobj->objauth = twist_new((char *)sqlite3_column_text(stmt, 1));
-    if (!pobj->objauth) {
-        LOGE("oom");
-        return SQLITE_ERROR;
+        global.batch.flusher.deadline_ms = 0;
+
+        pthread_mutex_unlock(&global.batch.flusher.lock);
+        db_flush_due();
+        pthread_mutex_lock(&global.batch.flusher.lock);
     }
 
-    int rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        LOGE("stepping in pobjects, got: %s\n", sqlite3_errstr(rc));
-        return SQLITE_ERROR;
+    pthread_mutex_unlock(&global.batch.flusher.lock);
+
+    return NULL;
+}
+
+/*
+ * Sets the flusher's deadline for a batch that was just opened, starting
+ * the flusher if need be. Must hold the batch lock. Without a flusher, the
+ * window is checked at the end of every API call, see db_flush_due().
+ */
+static void batch_flusher_arm(void) {
+
+    if (!global.batch.window_ms
+            || !global.batch.flusher.ready
+            || !general_can_create_threads()) {
+        return;
     }
 
-    /* if it's a transient primary object create it */
-    if (tpm && pobj->config.is_transient) {
-        CK_RV rv = tpm_create_transient_primary_from_template(tpm,
-                pobj->config.template_name, pobj->objauth, &pobj->handle);
-        if (rv != CKR_OK) {
-            return SQLITE_ERROR;
+    pthread_mutex_lock(&global.batch.flusher.lock);
+
+    if (!global.batch.flusher.has_thread) {
+        int rc = pthread_create(&global.batch.flusher.thread, NULL,
+                batch_flusher, NULL);
+        if (rc) {
+            LOGW("Could not start the batch flusher: %s", strerror(rc));
+            goto out;
         }
+        global.batch.flusher.has_thread = true;
     }
 
-    return SQLITE_OK;
+    global.batch.flusher.deadline_ms =
+            global.batch.opened_ms + global.batch.window_ms;
+    pthread_cond_signal(&global.batch.flusher.cond);
+
+out:
+    pthread_mutex_unlock(&global.batch.flusher.lock);
 }
 
-DEBUG_VISIBILITY int __real_init_pobject(unsigned pid, pobject *pobj, tpm_ctx *tpm) {
+static CK_RV batch_flusher_init(void) {
 
-    const char *sql =
-            "SELECT config,objauth FROM pobjects WHERE id=?";
+    pthread_condattr_t attr;
+    int rc = pthread_condattr_init(&attr);
+    if (rc) {
+        LOGE("pthread_condattr_init: %s", strerror(rc));
+        return CKR_GENERAL_ERROR;
+    }
 
-    sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        LOGE("Cannot prepare sobject query: %s\n", sqlite3_errmsg(global.db));
-        return rc;
+    /* deadlines are measured against the same clock as the window */
+    rc = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (!rc) {
+        rc = pthread_cond_init(&global.batch.flusher.cond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+    if (rc) {
+        LOGE("pthread_cond_init: %s", strerror(rc));
+        return CKR_GENERAL_ERROR;
     }
 
-    rc = sqlite3_bind_int(stmt, 1, pid);
-    if (rc != SQLITE_OK) {
-        LOGE("Cannot bind pobject id: %s\n", sqlite3_errmsg(global.db));
-        goto error;
+    rc = pthread_mutex_init(&global.batch.flusher.lock, NULL);
+    if (rc) {
+        LOGE("pthread_mutex_init: %s", strerror(rc));
+        pthread_cond_destroy(&global.batch.flusher.cond);
+        return CKR_GENERAL_ERROR;
     }
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW) {
-        LOGE("stepping in pobjects, got: %s\n", sqlite3_errstr(rc));
-        goto error;
+    global.batch.flusher.ready = true;
+
+    return CKR_OK;
+}
+
+/* stops the flusher, waiting for a commit it is doing to finish */
+static void batch_flusher_destroy(void) {
+
+    if (!global.batch.flusher.ready) {
+        return;
     }
 
-    rc = init_pobject_from_stmt(stmt, tpm, pobj);
+    pthread_mutex_lock(&global.batch.flusher.lock);
+    global.batch.flusher.quit = true;
+    pthread_cond_signal(&global.batch.flusher.cond);
+    pthread_mutex_unlock(&global.batch.flusher.lock);
 
-error:
-    sqlite3_finalize(stmt);
+    if (global.batch.flusher.has_thread) {
+        pthread_join(global.batch.flusher.thread, NULL);
+    }
 
-    return rc;
-}
+    pthread_cond_destroy(&global.batch.flusher.cond);
+    pthread_mutex_destroy(&global.batch.flusher.lock);
 
-WEAK DEBUG_VISIBILITY int init_pobject(unsigned pid, pobject *pobj, tpm_ctx *tpm) {
-    return __real_init_pobject(pid, pobj, tpm);
+    memset(&global.batch.flusher, 0, sizeof(global.batch.flusher));
 }
 
-CK_RV db_init_pobject(unsigned pid, pobject *pobj, tpm_ctx *tpm) {
-    int rc = init_pobject(pid, pobj, tpm);
-    return rc == SQLITE_OK ? CKR_OK : CKR_GENERAL_ERROR;
-}
+/*
+ * Starts a write transaction on global.db and takes the batch lock, which
+ * is released by commit() or rollback(). A batched write runs in a
+ * savepoint of the open batch, so a failing write only undoes itself.
+ * Anything else commits an open batch first, the same as a batch that
+ * outlived its window.
+ */
+static int start(bool batched) {
 
-DEBUG_VISIBILITY int __real_init_sealobjects(unsigned tokid, sealobject *sealobj) {
+    batch_lock();
 
-    const char *sql =
-            "SELECT * FROM sealobjects WHERE tokid=?";
+    if (global.batch.open && (!batched || batch_is_due())) {
+        UNUSED(batch_commit());
+    }
+
+    int rc;
+    if (!batched) {
+        rc = start2(global.db);
+        goto out;
+    }
+
+    if (!global.batch.open) {
+        rc = start2(global.db);
+        if (rc != SQLITE_OK) {
+            goto out;
+        }
+        __atomic_store_n(&global.batch.open, true, __ATOMIC_RELAXED);
+        global.batch.opened_ms = now_ms();
+        batch_flusher_arm();
+    }
+
+    rc = sqlite3_exec(global.db, "SAVEPOINT batch_write", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+    }
+
+out:
+    if (rc != SQLITE_OK) {
+        batch_unlock();
+    }
+
+    return rc;
+}
+
+/*
+ * Ends a write transaction from start(). On failure the batch lock is kept
+ * for the rollback() that must follow.
+ */
+static int commit(bool batched) {
+
+    int rc;
+    if (!batched) {
+        rc = commit2(global.db);
+        goto out;
+    }
+
+    rc = sqlite3_exec(global.db, "RELEASE batch_write", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        goto out;
+    }
+
+    global.batch.writes++;
+    if (batch_is_due()) {
+        rc = batch_commit();
+    }
+
+out:
+    if (rc == SQLITE_OK) {
+        batch_unlock();
+    }
+
+    return rc;
+}
+
+static int rollback(bool batched) {
+
+    int rc;
+    if (batched) {
+        rc = sqlite3_exec(global.db, "ROLLBACK TO batch_write", NULL, NULL, NULL);
+        /* ROLLBACK TO keeps the savepoint open */
+        UNUSED(sqlite3_exec(global.db, "RELEASE batch_write", NULL, NULL, NULL));
+    } else {
+        rc = rollback2(global.db);
+    }
+
+    batch_unlock();
+
+    return rc;
+}
+
+static inline bool batch_writes(token *tok) {
+    return tok->config.durability == token_durability_batch;
+}
+
+static int db_get_tobject_rev(unsigned id, uint64_t *rev) {
+
+    const char *sql = "SELECT rev FROM tobjects WHERE id=?;";
+
+    sqlite3_stmt *stmt;
+    int rc = stmt_get(stmt_get_tobject_rev, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tobject rev query: %s", sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, id);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot bind tobject id: %s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        LOGE("Cannot get rev of tobject %u: %s", id, sqlite3_errmsg(global.db));
+        rc = SQLITE_ERROR;
+        goto out;
+    }
+
+    *rev = (uint64_t)sqlite3_column_int64(stmt, 0);
+    rc = SQLITE_OK;
+
+out:
+    stmt_put(stmt_get_tobject_rev, stmt);
+    return rc;
+}
+
+static inline bool attrs_in_table(token *tok) {
+    return tok->config.attr_store == token_attr_store_table;
+}
+
+static int db_set_tobject_attr(unsigned id, CK_ATTRIBUTE_PTR a) {
+
+    const char *sql =
+          "REPLACE INTO tobject_attrs ("
+            "tobject_id, "  // index: 1 type: INT
+            "type, "        // index: 2 type: INT
+            "kind, "        // index: 3 type: INT
+            "value"         // index: 4 type: BLOB
+          ") VALUES ("
+            "?,?,?,?"
+          ");";
+
+    sqlite3_stmt *stmt;
+    int rc = stmt_get(stmt_set_tobject_attr, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tobject attr insert: %s", sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, id);
+    gotobinderror(rc, "tobject_id");
+
+    rc = sqlite3_bind_int64(stmt, 2, (sqlite3_int64)a->type);
+    gotobinderror(rc, "type");
+
+    rc = sqlite3_bind_int(stmt, 3, type_from_ptr(a->pValue, a->ulValueLen));
+    gotobinderror(rc, "kind");
+
+    /* empty values are empty blobs, not NULL, so they compare equal to an empty template */
+    rc = a->ulValueLen ?
+            sqlite3_bind_blob(stmt, 4, a->pValue, a->ulValueLen, SQLITE_STATIC) :
+            sqlite3_bind_zeroblob(stmt, 4, 0);
+    gotobinderror(rc, "value");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("Could not set attribute 0x%lx of tobject %u: %s",
+                a->type, id, sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    rc = SQLITE_OK;
+
+error:
+    stmt_put(stmt_set_tobject_attr, stmt);
+    return rc;
+}
+
+static int db_run_tobject_id_stmt(stmt_id sid, const char *sql, unsigned id) {
+
+    sqlite3_stmt *stmt;
+    int rc = stmt_get(sid, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare \"%s\": %s", sql, sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, id);
+    gotobinderror(rc, "id");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("Could not run \"%s\": %s", sql, sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    rc = SQLITE_OK;
+
+error:
+    stmt_put(sid, stmt);
+    return rc;
+}
+
+/*
+ * A write of a tobject's attributes that moves its CKA_VALUE into or out
+ * of tobject_values. The attrs are written with the value taken out of
+ * them, and it is only dropped from memory once the write committed.
+ */
+typedef struct value_write value_write;
+struct value_write {
+    CK_ATTRIBUTE_PTR attr;
+    CK_ATTRIBUTE taken;
+    bool drop;
+};
+
+static void db_value_take(tobject *tobj, attr_list *attrs, value_write *w) {
+
+    memset(w, 0, sizeof(*w));
+
+    if (!global.value_threshold && !tobj->ext_value_len) {
+        return;
+    }
+
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, CKA_VALUE);
+    if (!a) {
+        return;
+    }
+
+    CK_OBJECT_CLASS clazz = attr_list_get_CKA_CLASS(attrs, CK_OBJECT_CLASS_BAD);
+    bool eligible = global.value_threshold
+            && (clazz == CKO_DATA || clazz == CKO_CERTIFICATE)
+            && !attr_list_get_CKA_PRIVATE(attrs, CK_FALSE)
+            && a->ulValueLen >= global.value_threshold;
+
+    if (eligible) {
+        w->attr = a;
+        w->taken = *a;
+        a->pValue = NULL;
+        a->ulValueLen = 0;
+        return;
+    }
+
+    /*
+     * An empty CKA_VALUE of an object with a value in the store is where it
+     * was taken out, anything else replaces it.
+     */
+    w->drop = tobj->ext_value_len && a->ulValueLen;
+}
+
+static int db_value_apply(unsigned id, value_write *w) {
+
+    if (w->drop) {
+        return db_run_tobject_id_stmt(stmt_clear_tobject_value,
+                "DELETE FROM tobject_values WHERE id=?;", id);
+    }
+
+    if (!w->attr) {
+        return SQLITE_OK;
+    }
+
+    const char *sql =
+          "REPLACE INTO tobject_values ("
+            "id, "     // index: 1 type: INT
+            "value"    // index: 2 type: BLOB
+          ") VALUES ("
+            "?,?"
+          ");";
+
+    sqlite3_stmt *stmt;
+    int rc = stmt_get(stmt_set_tobject_value, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tobject value insert: %s", sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, id);
+    gotobinderror(rc, "id");
+
+    rc = sqlite3_bind_blob(stmt, 2, w->taken.pValue, w->taken.ulValueLen, SQLITE_STATIC);
+    gotobinderror(rc, "value");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("Could not store value of tobject %u: %s", id, sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    rc = SQLITE_OK;
+
+error:
+    stmt_put(stmt_set_tobject_value, stmt);
+    return rc;
+}
+
+/*
+ * A write that takes a value out of line frees it from memory once it is
+ * done, so it must not join a batch that may still be rolled back after.
+ * It commits the open batch and itself instead.
+ */
+static inline bool batch_value_write(token *tok, value_write *w) {
+    return batch_writes(tok) && !w->attr;
+}
+
+static void db_value_settle(tobject *tobj, value_write *w, CK_RV rv) {
+
+    if (rv != CKR_OK) {
+        /* the attrs are the caller's again, with their value */
+        if (w->attr) {
+            *w->attr = w->taken;
+        }
+        return;
+    }
+
+    if (w->attr) {
+        tobj->ext_value_len = w->taken.ulValueLen;
+        free(w->taken.pValue);
+    } else if (w->drop) {
+        tobj->ext_value_len = 0;
+    }
+}
+
+CK_RV db_read_tobject_value(tobject *tobj, CK_BYTE_PTR buf, CK_ULONG len) {
+
+    sqlite3_blob *blob = NULL;
+    int rc = sqlite3_blob_open(global.db, "main", "tobject_values", "value",
+            tobj->id, 0, &blob);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot open value of tobject %u: %s", tobj->id, sqlite3_errmsg(global.db));
+        sqlite3_blob_close(blob);
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    /* another process may have changed it, a refresh picks up the new length */
+    int bytes = sqlite3_blob_bytes(blob);
+    if (bytes < 0 || (CK_ULONG)bytes != len) {
+        LOGE("Value of tobject %u changed in the store, expected %lu bytes, got %d",
+                tobj->id, len, bytes);
+        goto out;
+    }
+
+    rc = sqlite3_blob_read(blob, buf, bytes, 0);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot read value of tobject %u: %s", tobj->id, sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    rv = CKR_OK;
+
+out:
+    sqlite3_blob_close(blob);
+    return rv;
+}
+
+static int db_get_tobject_attrs_in_table(unsigned id, bool *in_table) {
+
+    const char *sql = "SELECT attrs='' FROM tobjects WHERE id=?;";
+
+    sqlite3_stmt *stmt;
+    int rc = stmt_get(stmt_tobject_attrs_in_table, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tobject attrs query: %s", sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, id);
+    gotobinderror(rc, "id");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        LOGE("Cannot find tobject %u: %s", id, sqlite3_errmsg(global.db));
+        rc = SQLITE_ERROR;
+        goto error;
+    }
+
+    *in_table = !!sqlite3_column_int(stmt, 0);
+    rc = SQLITE_OK;
+
+error:
+    stmt_put(stmt_tobject_attrs_in_table, stmt);
+    return rc;
+}
+
+/*
+ * Writes the rows of attrs that differ from old, or all of them when old
+ * is NULL. Attributes are only ever added or changed, never removed.
+ */
+static int db_write_tobject_attr_rows(unsigned id, attr_list *old, attr_list *attrs) {
+
+    int rc;
+
+    if (!old) {
+        rc = db_run_tobject_id_stmt(stmt_clear_tobject_attrs,
+                "DELETE FROM tobject_attrs WHERE tobject_id=?;", id);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+    }
+
+    CK_ULONG cnt = attr_list_get_count(attrs);
+    CK_ATTRIBUTE_PTR a = attr_list_get_ptr(attrs);
+
+    CK_ULONG i;
+    for (i = 0; i < cnt; i++) {
+
+        if (old) {
+            CK_ATTRIBUTE_PTR o = attr_get_attribute_by_type(old, a[i].type);
+            if (o && o->ulValueLen == a[i].ulValueLen
+                  && (!o->ulValueLen || !memcmp(o->pValue, a[i].pValue, o->ulValueLen))) {
+                continue;
+            }
+        }
+
+        rc = db_set_tobject_attr(id, &a[i]);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+DEBUG_VISIBILITY CK_RV db_add_pobject_v4(sqlite3 *updb, pobject_v4 *new_pobj) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    sqlite3_stmt *stmt = NULL;
+
+    const char *sql =
+          "INSERT INTO pobjects2 ("
+            "id,"             // index: 1 type: INT
+            "hierarchy, "     // index: 2 type: TEXT
+            "config,"         // index: 3 type: TEXT
+            "objauth"         // index: 4 type: TEXT
+          ") VALUES ("
+            "?,?,?,?"
+          ");";
+
+    int rc = sqlite3_prepare_v2(updb, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(updb));
+        goto error;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, new_pobj->id);
+    gotobinderror(rc, "id");
+
+    rc = sqlite3_bind_text(stmt, 2, new_pobj->hierarchy, -1, SQLITE_STATIC);
+    gotobinderror(rc, "hierarchy");
+
+    rc = sqlite3_bind_text(stmt, 3, new_pobj->config, -1, SQLITE_STATIC);
+    gotobinderror(rc, "config");
+
+    rc = sqlite3_bind_text(stmt, 4, new_pobj->objauth, -1, SQLITE_STATIC);
+    gotobinderror(rc, "objauth");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("step error: %s", sqlite3_errmsg(updb));
+        goto error;
+    }
+
+    rv = CKR_OK;
+error:
+    rc = sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK) {
+        LOGW("Could not finalize stmt: %d", rc);
+    }
+
+    return rv;
+}
+
+DEBUG_VISIBILITY int init_pobject_from_stmt(sqlite3_stmt *stmt, tpm_ctx *tpm, pobject *pobj) {
+
+    /* Get the YAML config and:
+     *   - parse it to the config structure
+     *   - if persistent deserializes the ESYS_TR into the handle
+     *   - if transient, verify that the template_name is set
+     */
+    size_t yaml_size = sqlite3_column_bytes(stmt, 0);
+    const unsigned char *pobj_yaml_conf = sqlite3_column_text(stmt, 0);
+    bool res = parse_pobject_config_from_string(pobj_yaml_conf, yaml_size,
+            &pobj->config);
+    if (!res) {
+        LOGE("Could not parse pobject config");
+        return SQLITE_ERROR;
+    }
+
+    if (!pobj->config.is_transient) {
+        if (!pobj->config.blob) {
+            LOGE("Expected persistent pobject config to have ESYS_TR blob");
+            return SQLITE_ERROR;
+        }
+        /* without a tpm the handle is deserialized by token_pobject_load() */
+        res = !tpm || tpm_deserialize_handle(tpm, pobj->config.blob, &pobj->handle, NULL);
+        if (!res) {
+            /* just set a general error as rc could be success right now */
+            return SQLITE_ERROR;
+        }
+    } else if (!pobj->config.template_name) {
+        LOGE("Expected transient pobject config to have a template name");
+        return SQLITE_ERROR;
+    }
+
+    pobj->objauth = twist_new((char *)sqlite3_column_text(stmt, 1));
+    if (!pobj->objauth) {
+        LOGE("oom");
+        return SQLITE_ERROR;
+    }
+
+    int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("stepping in pobjects, got: %s\n", sqlite3_errstr(rc));
+        return SQLITE_ERROR;
+    }
+
+    /* if it's a transient primary object create it */
+    if (tpm && pobj->config.is_transient) {
+        CK_RV rv = tpm_create_transient_primary_from_template(tpm,
+                pobj->config.template_name, pobj->objauth, &pobj->handle);
+        if (rv != CKR_OK) {
+            return SQLITE_ERROR;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+DEBUG_VISIBILITY int __real_init_pobject(unsigned pid, pobject *pobj, tpm_ctx *tpm) {
+
+    const char *sql =
+            "SELECT config,objauth FROM pobjects WHERE id=?";
+
+    sqlite3_stmt *stmt;
+    int rc = stmt_get(stmt_init_pobject, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare sobject query: %s\n", sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, pid);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot bind pobject id: %s\n", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        LOGE("stepping in pobjects, got: %s\n", sqlite3_errstr(rc));
+        goto error;
+    }
+
+    rc = init_pobject_from_stmt(stmt, tpm, pobj);
+
+error:
+    stmt_put(stmt_init_pobject, stmt);
+
+    return rc;
+}
+
+WEAK DEBUG_VISIBILITY int init_pobject(unsigned pid, pobject *pobj, tpm_ctx *tpm) {
+    return __real_init_pobject(pid, pobj, tpm);
+}
+
+CK_RV db_init_pobject(unsigned pid, pobject *pobj, tpm_ctx *tpm) {
+    int rc = init_pobject(pid, pobj, tpm);
+    return rc == SQLITE_OK ? CKR_OK : CKR_GENERAL_ERROR;
+}
+
+DEBUG_VISIBILITY int __real_init_sealobjects(unsigned tokid, sealobject *sealobj) {
+
+    const char *sql =
+            "SELECT * FROM sealobjects WHERE tokid=?";
 
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    int rc = stmt_get(stmt_init_sealobjects, sql, &stmt);
     if (rc != SQLITE_OK) {
         LOGE("Cannot prepare sealobject query: %s\n", sqlite3_errmsg(global.db));
         return rc;
@@ -541,7 +1431,7 @@ DEBUG_VISIBILITY int __real_init_sealobjects(unsigned tokid, sealobject *sealobj
     rc = SQLITE_OK;
 
 error:
-    sqlite3_finalize(stmt);
+    stmt_put(stmt_init_sealobjects, stmt);
 
     return rc;
 }
@@ -569,7 +1459,7 @@ CK_RV db_get_tokens(token **tok, size_t *len) {
             "SELECT * FROM tokens";
 
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    int rc = stmt_get(stmt_get_tokens, sql, &stmt);
     if (rc != SQLITE_OK) {
         free(tmp);
         LOGE("Cannot prepare tobject query: %s\n", sqlite3_errmsg(global.db));
@@ -653,13 +1543,13 @@ CK_RV db_get_tokens(token **tok, size_t *len) {
 
     *tok = tmp;
     *len = cnt;
-    sqlite3_finalize(stmt);
+    stmt_put(stmt_get_tokens, stmt);
 
     return CKR_OK;
 
 error:
     token_free_list(tmp, cnt);
-    sqlite3_finalize(stmt);
+    stmt_put(stmt_get_tokens, stmt);
     return CKR_GENERAL_ERROR;
 }
 
@@ -679,15 +1569,18 @@ CK_RV db_update_for_pinchange(
     sqlite3_stmt *stmt = NULL;
 
     char *sql = NULL;
+    stmt_id sid;
     /* so update statements */
     if (is_so) {
         if (newpubblob) {
+            sid = stmt_pinchange_so;
             sql = "UPDATE sealobjects SET"
                      " soauthsalt=?,"           /* index: 1 */
                      " sopriv=?,"               /* index: 2 */
                      " sopub=?"                 /* index: 3 */
                      " WHERE tokid=?";          /* index: 4 */
         } else {
+            sid = stmt_pinchange_so_nopub;
             sql = "UPDATE sealobjects SET"
                  " soauthsalt=?,"           /* index: 1 */
                  " sopriv=?"                /* index: 2 */
@@ -696,12 +1589,14 @@ CK_RV db_update_for_pinchange(
     /* user */
     } else {
         if (newpubblob) {
+            sid = stmt_pinchange_user;
             sql = "UPDATE sealobjects SET"
                      " userauthsalt=?,"           /* index: 1 */
                      " userpriv=?,"               /* index: 2 */
                      " userpub=?"                 /* index: 3 */
                      " WHERE tokid=?" ;           /* index: 4 */
         } else {
+            sid = stmt_pinchange_user_nopub;
             sql = "UPDATE sealobjects SET"
                  " userauthsalt=?,"           /* index: 1 */
                  " userpriv=?"                /* index: 2 */
@@ -712,7 +1607,7 @@ CK_RV db_update_for_pinchange(
     /*
      * Prepare statements
      */
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    int rc = stmt_get(sid, sql, &stmt);
     if (rc) {
         LOGE("Could not prepare statement: \"%s\" error: \"%s\"",
         sql, sqlite3_errmsg(global.db));
@@ -736,15 +1631,256 @@ CK_RV db_update_for_pinchange(
         gotobinderror(rc, "newpubblob");
     }
 
-    rc = sqlite3_bind_int(stmt,  index++, tok->id);
-    gotobinderror(rc, "tokid");
+    rc = sqlite3_bind_int(stmt,  index++, tok->id);
+    gotobinderror(rc, "tokid");
+
+    /*
+     * Everything is bound, fire off the sql statements
+     */
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("Could not execute stmt");
+        goto error;
+    }
+
+    rv = CKR_OK;
+
+    TRANSACTION_END(rv);
+
+    stmt_put(sid, stmt);
+
+    return rv;
+}
+
+CK_RV db_add_new_object(token *tok, tobject *tobj) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    sqlite3_stmt *stmt = NULL;
+
+    value_write w;
+    db_value_take(tobj, tobj->attrs, &w);
+
+    /* with the table attribute store the attrs column stays empty */
+    bool in_table = attrs_in_table(tok);
+    char *attrs = in_table ? NULL : emit_attributes_to_string(tobj->attrs);
+    if (!in_table && !attrs) {
+        db_value_settle(tobj, &w, rv);
+        return CKR_GENERAL_ERROR;
+    }
+
+    const char *sql =
+          "INSERT INTO tobjects ("
+            "tokid, "     // index: 1 type: INT
+            "attrs"       // index: 2 type: TEXT (JSON)
+          ") VALUES ("
+            "?,?"
+          ");";
+
+    int rc = stmt_get(stmt_add_tobject, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        free(attrs);
+        db_value_settle(tobj, &w, rv);
+        LOGE("%s", sqlite3_errmsg(global.db));
+        return CKR_GENERAL_ERROR;
+    }
+
+    TRANSACTION_START_BATCHED(batch_value_write(tok, &w));
+
+    rc = sqlite3_bind_int(stmt, 1, tok->id);
+    gotobinderror(rc, "tokid");
+
+    rc = sqlite3_bind_text(stmt, 2, attrs ? attrs : "", -1, SQLITE_STATIC);
+    gotobinderror(rc, "attrs");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    sqlite3_int64 id = sqlite3_last_insert_rowid(global.db);
+    if (id == 0) {
+        LOGE("Could not get id: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    if (id > UINT_MAX) {
+        LOGE("id is larger than unsigned int, got: %lld", id);
+        goto error;
+    }
+
+    tobject_set_id(tobj, (unsigned)id);
+
+    if (in_table) {
+        rc = db_write_tobject_attr_rows(tobj->id, NULL, tobj->attrs);
+        if (rc != SQLITE_OK) {
+            goto error;
+        }
+    }
+
+    rc = db_value_apply(tobj->id, &w);
+    if (rc != SQLITE_OK) {
+        goto error;
+    }
+
+    /* the insert trigger stamped the row, remember it so a refresh keeps this copy */
+    rc = db_get_tobject_rev(tobj->id, &tobj->rev);
+    if (rc != SQLITE_OK) {
+        goto error;
+    }
+
+    rv = CKR_OK;
+
+    TRANSACTION_END(rv);
+
+    stmt_put(stmt_add_tobject, stmt);
+
+    free(attrs);
+
+    db_value_settle(tobj, &w, rv);
+
+    return rv;
+}
+
+CK_RV db_delete_object(token *tok, tobject *tobj) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    sqlite3_stmt *stmt = NULL;
+
+    static const char *sql =
+      "DELETE FROM tobjects WHERE id=?;";
+
+    int rc = stmt_get(stmt_delete_tobject, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+        return CKR_GENERAL_ERROR;
+    }
+
+    TRANSACTION_START_BATCHED(batch_writes(tok));
+
+    rc = sqlite3_bind_int(stmt, 1, tobj->id);
+    gotobinderror(rc, "id");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    rv = CKR_OK;
+
+    TRANSACTION_END(rv);
+    stmt_put(stmt_delete_tobject, stmt);
+
+    return rv;
+}
+
+CK_RV db_add_primary(pobject *pobj, unsigned *pid) {
+    assert(pid);
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    char *yaml_conf = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    const char *sql =
+          "INSERT INTO pobjects ("
+            "hierarchy, "     // index: 1 type: TEXT
+            "config,"         // index: 2 type: BLOB
+            "objauth"         // index: 3 type: TEXT
+          ") VALUES ("
+            "?,?,?"
+          ");";
+
+    yaml_conf = emit_pobject_to_conf_string(&pobj->config);
+    if (!yaml_conf) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    int rc = stmt_get(stmt_add_primary, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        free(yaml_conf);
+        LOGE("%s", sqlite3_errmsg(global.db));
+        return CKR_GENERAL_ERROR;
+    }
+
+    TRANSACTION_START;
+
+    rc = sqlite3_bind_text(stmt, 1, "o", -1, SQLITE_STATIC);
+    gotobinderror(rc, "hierarchy");
+
+    rc = sqlite3_bind_text(stmt, 2, yaml_conf, -1, SQLITE_STATIC);
+    gotobinderror(rc, "config");
+
+    rc = sqlite3_bind_text(stmt, 3, "", -1, SQLITE_STATIC);
+    gotobinderror(rc, "objauth");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    sqlite3_int64 id = sqlite3_last_insert_rowid(global.db);
+    if (id == 0) {
+        LOGE("Could not get id: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    if (id > UINT_MAX) {
+        LOGE("id is larger than unsigned int, got: %lld", id);
+        goto error;
+    }
+
+    *pid = (unsigned)id;
+
+    rv = CKR_OK;
+
+    TRANSACTION_END(rv);
+    stmt_put(stmt_add_primary, stmt);
+
+    free(yaml_conf);
+
+    return rv;
+}
+
+CK_RV db_update_token_config(token *tok) {
+    assert(tok);
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    sqlite3_stmt *stmt = NULL;
+
+    char *config = emit_config_to_string(tok);
+    if (!config) {
+        LOGE("Could not get token config");
+        return CKR_GENERAL_ERROR;
+    }
+
+    const char *sql =
+          "UPDATE tokens SET"
+            " config=?"      // index: 1 type: TEXT (JSON)
+            " WHERE id=?;";  // Index 2 type: int
+    int rc = stmt_get(stmt_update_token_config, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    /* commits on its own, a batch open for object writes is committed first */
+    TRANSACTION_START;
+
+    rc = sqlite3_bind_text(stmt, 1, config, -1, SQLITE_STATIC);
+    gotobinderror(rc, "config");
+
+    rc = sqlite3_bind_int(stmt, 2, tok->id);
+    gotobinderror(rc, "id");
 
-    /*
-     * Everything is bound, fire off the sql statements
-     */
     rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE) {
-        LOGE("Could not execute stmt");
+        LOGE("Could not execute stmt: %s", sqlite3_errmsg(global.db));
         goto error;
     }
 
@@ -752,255 +1888,534 @@ CK_RV db_update_for_pinchange(
 
     TRANSACTION_END(rv);
 
-    sqlite3_finalize_warn(stmt);
-
+out:
+    stmt_put(stmt_update_token_config, stmt);
+    free(config);
     return rv;
 }
 
-CK_RV db_add_new_object(token *tok, tobject *tobj) {
+CK_RV db_update_tobject_attrs(token *tok, tobject *tobj, attr_list *attrs) {
+    assert(attrs);
 
     CK_RV rv = CKR_GENERAL_ERROR;
 
     sqlite3_stmt *stmt = NULL;
 
-    char *attrs = emit_attributes_to_string(tobj->attrs);
-    if (!attrs) {
+    value_write w;
+    db_value_take(tobj, attrs, &w);
+
+    char *attr_str = emit_attributes_to_string(attrs);
+    if (!attr_str) {
+        LOGE("Could not emit tobject attributes");
+        db_value_settle(tobj, &w, rv);
         return CKR_GENERAL_ERROR;
     }
 
     const char *sql =
-          "INSERT INTO tobjects ("
-            "tokid, "     // index: 1 type: INT
-            "attrs"       // index: 2 type: TEXT (JSON)
-          ") VALUES ("
-            "?,?"
-          ");";
-
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+          "UPDATE tobjects SET"
+            " attrs=?"      // index: 1 type: TEXT (JSON)
+            " WHERE id=?;";  // Index 2 type: int
+    int rc = stmt_get(stmt_update_tobject_attrs, sql, &stmt);
     if (rc != SQLITE_OK) {
-        free(attrs);
+        free(attr_str);
+        db_value_settle(tobj, &w, rv);
         LOGE("%s", sqlite3_errmsg(global.db));
         return CKR_GENERAL_ERROR;
     }
 
-    TRANSACTION_START;
-
-    rc = sqlite3_bind_int(stmt, 1, tok->id);
-    gotobinderror(rc, "tokid");
+    TRANSACTION_START_BATCHED(batch_value_write(tok, &w));
 
-    rc = sqlite3_bind_text(stmt, 2, attrs, -1, SQLITE_STATIC);
+    rc = sqlite3_bind_text(stmt, 1, attr_str, -1, SQLITE_STATIC);
     gotobinderror(rc, "attrs");
 
+    rc = sqlite3_bind_int(stmt, 2, tobj->id);
+    gotobinderror(rc, "id");
+
     rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE) {
-        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        LOGE("Could not execute stmt");
         goto error;
     }
 
-    sqlite3_int64 id = sqlite3_last_insert_rowid(global.db);
-    if (id == 0) {
-        LOGE("Could not get id: %s", sqlite3_errmsg(global.db));
+    rc = db_value_apply(tobj->id, &w);
+    if (rc != SQLITE_OK) {
         goto error;
     }
 
-    if (id > UINT_MAX) {
-        LOGE("id is larger than unsigned int, got: %lld", id);
+    rc = db_get_tobject_rev(tobj->id, &tobj->rev);
+    if (rc != SQLITE_OK) {
         goto error;
     }
 
-    tobject_set_id(tobj, (unsigned)id);
-
     rv = CKR_OK;
 
     TRANSACTION_END(rv);
 
-    sqlite3_finalize_warn(stmt);
-
-    free(attrs);
-
+    stmt_put(stmt_update_tobject_attrs, stmt);
+    free(attr_str);
+    db_value_settle(tobj, &w, rv);
     return rv;
 }
 
-CK_RV db_delete_object(tobject *tobj) {
+CK_RV db_update_tobject_attr_rows(token *tok, tobject *tobj, attr_list *attrs) {
+    assert(attrs);
 
     CK_RV rv = CKR_GENERAL_ERROR;
 
-    sqlite3_stmt *stmt = NULL;
+    value_write w;
+    db_value_take(tobj, attrs, &w);
 
-    static const char *sql =
-      "DELETE FROM tobjects WHERE id=?;";
+    TRANSACTION_START_BATCHED(batch_value_write(tok, &w));
 
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    /* an object still stored as YAML is moved to the table as a whole */
+    bool in_table = false;
+    int rc = db_get_tobject_attrs_in_table(tobj->id, &in_table);
     if (rc != SQLITE_OK) {
-        LOGE("%s", sqlite3_errmsg(global.db));
-        return CKR_GENERAL_ERROR;
+        goto error;
     }
 
-    TRANSACTION_START;
+    rc = db_write_tobject_attr_rows(tobj->id, in_table ? tobj->attrs : NULL, attrs);
+    if (rc != SQLITE_OK) {
+        goto error;
+    }
 
-    rc = sqlite3_bind_int(stmt, 1, tobj->id);
-    gotobinderror(rc, "id");
+    rc = db_value_apply(tobj->id, &w);
+    if (rc != SQLITE_OK) {
+        goto error;
+    }
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        LOGE("step error: %s", sqlite3_errmsg(global.db));
+    /* writing attrs fires the rev trigger, so other processes see the change */
+    rc = db_run_tobject_id_stmt(stmt_mark_tobject_attrs,
+            "UPDATE tobjects SET attrs='' WHERE id=?;", tobj->id);
+    if (rc != SQLITE_OK) {
+        goto error;
+    }
+
+    rc = db_get_tobject_rev(tobj->id, &tobj->rev);
+    if (rc != SQLITE_OK) {
         goto error;
     }
 
     rv = CKR_OK;
 
     TRANSACTION_END(rv);
-    sqlite3_finalize_warn(stmt);
 
+    db_value_settle(tobj, &w, rv);
     return rv;
 }
 
-CK_RV db_add_primary(pobject *pobj, unsigned *pid) {
-    assert(pid);
+/* attributes the store does not hold the value of, they can only be matched in memory */
+static bool is_pushable_attr(CK_ATTRIBUTE_PTR a) {
+    return a->type != CKA_VALUE && (a->pValue || !a->ulValueLen);
+}
 
-    CK_RV rv = CKR_GENERAL_ERROR;
+CK_RV db_find_tobjects(token *tok, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        unsigned **ids, size_t *len) {
 
-    char *yaml_conf = NULL;
-    sqlite3_stmt *stmt = NULL;
+    CK_ULONG pushable = 0;
+    CK_ULONG i;
+    for (i = 0; i < count; i++) {
+        pushable += is_pushable_attr(&templ[i]);
+    }
 
-    const char *sql =
-          "INSERT INTO pobjects ("
-            "hierarchy, "     // index: 1 type: TEXT
-            "config,"         // index: 2 type: BLOB
-            "objauth"         // index: 3 type: TEXT
-          ") VALUES ("
-            "?,?,?"
-          ");";
+    if (!pushable) {
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    }
 
-    yaml_conf = emit_pobject_to_conf_string(&pobj->config);
-    if (!yaml_conf) {
-        return CKR_GENERAL_ERROR;
+    /*
+     * Objects still stored as YAML are always candidates, the others need
+     * a row matching every pushable template attribute, found through the
+     * (type, value) index.
+     */
+    static const char head[] =
+            "SELECT id FROM tobjects WHERE tokid=? AND (attrs!='' OR id IN (";
+    static const char term[] =
+            "SELECT tobject_id FROM tobject_attrs WHERE type=? AND value=?";
+    static const char intersect[] = " INTERSECT ";
+    static const char tail[] = ")) ORDER BY id;";
+
+    size_t sql_len = sizeof(head) + sizeof(tail);
+    safe_adde(sql_len, pushable * (sizeof(term) + sizeof(intersect)));
+
+    char *sql = calloc(1, sql_len);
+    if (!sql) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    strcat(sql, head);
+    for (i = 0; i < pushable; i++) {
+        if (i) {
+            strcat(sql, intersect);
+        }
+        strcat(sql, term);
     }
+    strcat(sql, tail);
 
+    CK_RV rv = CKR_GENERAL_ERROR;
+    unsigned *found = NULL;
+    size_t found_len = 0;
+    size_t found_max = 0;
+
+    /* the query depends on the template, so it is not cached */
+    sqlite3_stmt *stmt = NULL;
     int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
-        free(yaml_conf);
-        LOGE("%s", sqlite3_errmsg(global.db));
-        return CKR_GENERAL_ERROR;
+        LOGE("Cannot prepare tobject search: %s", sqlite3_errmsg(global.db));
+        goto out;
     }
 
-    TRANSACTION_START;
-
-    rc = sqlite3_bind_text(stmt, 1, "o", -1, SQLITE_STATIC);
-    gotobinderror(rc, "hierarchy");
+    int index = 1;
+    rc = sqlite3_bind_int(stmt, index++, tok->id);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot bind tokid: %s", sqlite3_errmsg(global.db));
+        goto out;
+    }
 
-    rc = sqlite3_bind_text(stmt, 2, yaml_conf, -1, SQLITE_STATIC);
-    gotobinderror(rc, "config");
+    for (i = 0; i < count; i++) {
+        CK_ATTRIBUTE_PTR a = &templ[i];
+        if (!is_pushable_attr(a)) {
+            continue;
+        }
 
-    rc = sqlite3_bind_text(stmt, 3, "", -1, SQLITE_STATIC);
-    gotobinderror(rc, "objauth");
+        rc = sqlite3_bind_int64(stmt, index++, (sqlite3_int64)a->type);
+        if (rc == SQLITE_OK) {
+            rc = a->ulValueLen ?
+                sqlite3_bind_blob(stmt, index, a->pValue, a->ulValueLen, SQLITE_STATIC) :
+                sqlite3_bind_zeroblob(stmt, index, 0);
+            index++;
+        }
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        LOGE("step error: %s", sqlite3_errmsg(global.db));
-        goto error;
+        if (rc != SQLITE_OK) {
+            LOGE("Cannot bind search attribute 0x%lx: %s", a->type,
+                    sqlite3_errmsg(global.db));
+            goto out;
+        }
     }
 
-    sqlite3_int64 id = sqlite3_last_insert_rowid(global.db);
-    if (id == 0) {
-        LOGE("Could not get id: %s", sqlite3_errmsg(global.db));
-        goto error;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+
+        if (found_len == found_max) {
+            size_t max = found_max ? found_max * 2 : 16;
+            unsigned *tmp = realloc(found, max * sizeof(*found));
+            if (!tmp) {
+                LOGE("oom");
+                rv = CKR_HOST_MEMORY;
+                goto out;
+            }
+            found = tmp;
+            found_max = max;
+        }
+
+        found[found_len++] = (unsigned)sqlite3_column_int(stmt, 0);
     }
 
-    if (id > UINT_MAX) {
-        LOGE("id is larger than unsigned int, got: %lld", id);
-        goto error;
+    if (rc != SQLITE_DONE) {
+        LOGE("Cannot step tobject search: %s", sqlite3_errmsg(global.db));
+        goto out;
     }
 
-    *pid = (unsigned)id;
+    *ids = found;
+    *len = found_len;
+    found = NULL;
 
     rv = CKR_OK;
 
-    TRANSACTION_END(rv);
-    sqlite3_finalize_warn(stmt);
-
-    free(yaml_conf);
+out:
+    if (stmt) {
+        _sqlite3_finalize_warn(global.db, stmt);
+    }
+    free(found);
+    free(sql);
 
     return rv;
 }
 
-CK_RV db_update_token_config(token *tok) {
-    assert(tok);
+CK_RV db_flush(void) {
 
-    CK_RV rv = CKR_GENERAL_ERROR;
+    batch_lock();
+    int rc = batch_commit();
+    batch_unlock();
 
-    sqlite3_stmt *stmt = NULL;
+    return rc == SQLITE_OK ? CKR_OK : CKR_GENERAL_ERROR;
+}
 
-    char *config = emit_config_to_string(tok);
-    if (!config) {
-        LOGE("Could not get token config");
-        return CKR_GENERAL_ERROR;
+void db_flush_due(void) {
+
+    /* the common case, no batch, takes no lock */
+    if (!__atomic_load_n(&global.batch.open, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    batch_lock();
+    if (global.batch.open && batch_is_due()) {
+        UNUSED(batch_commit());
+    }
+    batch_unlock();
+}
+
+typedef struct tobject_rev tobject_rev;
+struct tobject_rev {
+    unsigned id;
+    uint64_t rev;
+    bool seen;
+};
+
+static int tobject_rev_cmp(const void *a, const void *b) {
+
+    const tobject_rev *x = (const tobject_rev *)a;
+    const tobject_rev *y = (const tobject_rev *)b;
+
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static int db_get_data_version(int *version) {
+
+    sqlite3_stmt *stmt;
+    int rc = stmt_get(stmt_data_version, "PRAGMA data_version;", &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare data_version query: %s", sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        *version = sqlite3_column_int(stmt, 0);
+        rc = SQLITE_OK;
+    } else {
+        LOGE("Cannot step data_version query: %s", sqlite3_errmsg(global.db));
+        rc = SQLITE_ERROR;
     }
 
+    stmt_put(stmt_data_version, stmt);
+    return rc;
+}
+
+static int db_get_tobject_revs(unsigned tokid, tobject_rev **revs, size_t *len) {
+
     const char *sql =
-          "UPDATE tokens SET"
-            " config=?"      // index: 1 type: TEXT (JSON)
-            " WHERE id=?;";  // Index 2 type: int
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+            "SELECT id, rev FROM tobjects WHERE tokid=? ORDER BY id;";
+
+    sqlite3_stmt *stmt;
+    int rc = stmt_get(stmt_get_tobject_revs, sql, &stmt);
     if (rc != SQLITE_OK) {
-        LOGE("%s", sqlite3_errmsg(global.db));
+        LOGE("Cannot prepare tobject revs query: %s", sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    tobject_rev *r = NULL;
+    size_t cnt = 0;
+    size_t max = 0;
+
+    rc = sqlite3_bind_int(stmt, 1, tokid);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot bind tobject tokid: %s", sqlite3_errmsg(global.db));
         goto error;
     }
 
-    rc = sqlite3_bind_text(stmt, 1, config, -1, SQLITE_STATIC);
-    gotobinderror(rc, "config");
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
 
-    rc = sqlite3_bind_int(stmt, 2, tok->id);
-    gotobinderror(rc, "id");
+        if (cnt == max) {
+            size_t newmax = max ? max * 2 : 64;
+            tobject_rev *tmp = realloc(r, newmax * sizeof(*r));
+            if (!tmp) {
+                LOGE("oom");
+                rc = SQLITE_NOMEM;
+                goto error;
+            }
+            r = tmp;
+            max = newmax;
+        }
 
-    rv = CKR_OK;
+        r[cnt].id = sqlite3_column_int(stmt, 0);
+        r[cnt].rev = (uint64_t)sqlite3_column_int64(stmt, 1);
+        r[cnt].seen = false;
+        cnt++;
+    }
+
+    if (rc != SQLITE_DONE) {
+        LOGE("Cannot step tobject revs query: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    stmt_put(stmt_get_tobject_revs, stmt);
+
+    *revs = r;
+    *len = cnt;
+
+    return SQLITE_OK;
 
 error:
-    sqlite3_finalize_warn(stmt);
-    free(config);
+    stmt_put(stmt_get_tobject_revs, stmt);
+    free(r);
+    return rc == SQLITE_OK || rc == SQLITE_ROW || rc == SQLITE_DONE ?
+            SQLITE_ERROR : rc;
+}
+
+static CK_RV db_get_tobject(unsigned id, tobject **tobj) {
+
+    const char *sql = "SELECT * FROM tobjects WHERE id=?;";
+
+    sqlite3_stmt *stmt;
+    int rc = stmt_get(stmt_get_tobject, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tobject query: %s", sqlite3_errmsg(global.db));
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    rc = sqlite3_bind_int(stmt, 1, id);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot bind tobject id: %s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+        /* removed since the revs were read */
+        *tobj = NULL;
+        rv = CKR_OK;
+        goto out;
+    }
+
+    if (rc != SQLITE_ROW) {
+        LOGE("Cannot get tobject %u: %s", id, sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    *tobj = db_tobject_new(stmt);
+    if (!*tobj) {
+        LOGE("Failed to initialize tobject from db");
+        goto out;
+    }
+
+    rv = CKR_OK;
+
+out:
+    stmt_put(stmt_get_tobject, stmt);
     return rv;
 }
 
-CK_RV db_update_tobject_attrs(unsigned id, attr_list *attrs) {
-    assert(attrs);
+static void tobject_release(token *tok, tobject *tobj) {
 
-    CK_RV rv = CKR_GENERAL_ERROR;
+    if (tobj->tpm_handle) {
+        bool result = tobj->tpm_handle_persistent ?
+                tpm_closehandle(tok->tctx, tobj->tpm_handle) :
+                tpm_flushcontext(tok->tctx, tobj->tpm_handle);
+        if (!result) {
+            LOGW("Could not flush handle of tobject %u", tobj->id);
+        }
+    }
 
-    sqlite3_stmt *stmt = NULL;
+    tobject_free(tobj);
+}
 
-    char *attr_str = emit_attributes_to_string(attrs);
-    if (!attr_str) {
-        LOGE("Could not emit tobject attributes");
+CK_RV db_refresh_tobjects(token *tok) {
+
+    int data_version = 0;
+    int rc = db_get_data_version(&data_version);
+    if (rc != SQLITE_OK) {
         return CKR_GENERAL_ERROR;
     }
 
-    const char *sql =
-          "UPDATE tobjects SET"
-            " attrs=?"      // index: 1 type: TEXT (JSON)
-            " WHERE id=?;";  // Index 2 type: int
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    /* nothing was committed by another connection since the last sync */
+    if (tok->esysdb.tobjects_synced
+            && tok->esysdb.data_version == data_version) {
+        return CKR_OK;
+    }
+
+    /*
+     * No transaction is needed, anything committed after data_version was
+     * read changes it again and is picked up by the next refresh.
+     */
+    tobject_rev *revs = NULL;
+    size_t len = 0;
+    rc = db_get_tobject_revs(tok->id, &revs, &len);
     if (rc != SQLITE_OK) {
-        LOGE("%s", sqlite3_errmsg(global.db));
-        goto error;
+        return CKR_GENERAL_ERROR;
     }
 
-    rc = sqlite3_bind_text(stmt, 1, attr_str, -1, SQLITE_STATIC);
-    gotobinderror(rc, "attrs");
+    CK_RV rv = CKR_GENERAL_ERROR;
+    bool pending = false;
+
+    /* drop removed objects and reload changed ones in place */
+    list *cur = tok->tobjects.head ? &tok->tobjects.head->l : NULL;
+    while (cur) {
+        tobject *tobj = list_entry(cur, tobject, l);
+        cur = cur->next;
+
+        tobject_rev key = { .id = tobj->id };
+        tobject_rev *r = bsearch(&key, revs, len, sizeof(*revs), tobject_rev_cmp);
+        if (r) {
+            r->seen = true;
+            if (r->rev == tobj->rev) {
+                continue;
+            }
+        }
 
-    rc = sqlite3_bind_int(stmt, 2, id);
-    gotobinderror(rc, "id");
+        /* an operation holds it, try again on the next refresh */
+        if (tobj->active) {
+            LOGV("tobject %u changed in the store but is busy", tobj->id);
+            pending = true;
+            continue;
+        }
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        LOGE("Could not execute stmt");
-        goto error;
+        tobject *fresh = NULL;
+        if (r) {
+            rv = db_get_tobject(tobj->id, &fresh);
+            if (rv != CKR_OK) {
+                goto out;
+            }
+        }
+
+        if (fresh) {
+            LOGV("tobject %u was modified in the store", tobj->id);
+            token_replace_tobject(tok, tobj, fresh);
+        } else {
+            LOGV("tobject %u was removed from the store", tobj->id);
+            token_rm_tobject(tok, tobj);
+        }
+
+        tobject_release(tok, tobj);
+    }
+
+    /* whatever is left was added by another process */
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (revs[i].seen) {
+            continue;
+        }
+
+        tobject *fresh = NULL;
+        rv = db_get_tobject(revs[i].id, &fresh);
+        if (rv != CKR_OK) {
+            goto out;
+        }
+
+        if (!fresh) {
+            continue;
+        }
+
+        LOGV("tobject %u was added to the store", revs[i].id);
+
+        rv = token_add_tobject(tok, fresh);
+        if (rv != CKR_OK) {
+            tobject_free(fresh);
+            goto out;
+        }
+    }
+
+    if (!pending) {
+        tok->esysdb.data_version = data_version;
+        tok->esysdb.tobjects_synced = true;
     }
 
     rv = CKR_OK;
 
-error:
-    sqlite3_finalize_warn(stmt);
-    free(attr_str);
+out:
+    free(revs);
+
     return rv;
 }
 
@@ -1042,7 +2457,8 @@ CK_RV db_add_token(token *tok) {
             "?,?,?"
           ");";
 
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    stmt_id sid = stmt_add_token;
+    int rc = stmt_get(sid, sql, &stmt);
     if (rc != SQLITE_OK) {
         LOGE("%s", sqlite3_errmsg(global.db));
         free(config);
@@ -1079,7 +2495,7 @@ CK_RV db_add_token(token *tok) {
 
     tok->id = id;
 
-    rc = sqlite3_finalize(stmt);
+    rc = stmt_put(sid, stmt);
     gotobinderror(rc, "finalize");
     stmt = NULL;
 
@@ -1088,7 +2504,8 @@ CK_RV db_add_token(token *tok) {
             "(tokid, soauthsalt, sopriv, sopub)"
             "VALUES(?,?,?,?)";
 
-    rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    sid = stmt_add_sealobjects;
+    rc = stmt_get(sid, sql, &stmt);
     if (rc != SQLITE_OK) {
         LOGE("%s", sqlite3_errmsg(global.db));
         goto error;
@@ -1118,7 +2535,7 @@ CK_RV db_add_token(token *tok) {
 
     TRANSACTION_END(rv);
 
-    sqlite3_finalize_warn(stmt);
+    stmt_put(sid, stmt);
 
     free(config);
 
@@ -1134,7 +2551,7 @@ CK_RV db_get_first_pid(unsigned *id) {
             "SELECT id FROM pobjects ORDER BY id ASC LIMIT 1";
 
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    int rc = stmt_get(stmt_get_first_pid, sql, &stmt);
     if (rc != SQLITE_OK) {
         LOGE("Cannot prepare first pid query: %s\n", sqlite3_errmsg(global.db));
         return rv;
@@ -1153,10 +2570,288 @@ CK_RV db_get_first_pid(unsigned *id) {
     rv = CKR_OK;
 
 error:
-    sqlite3_finalize(stmt);
+    stmt_put(stmt_get_first_pid, stmt);
+    return rv;
+}
+
+
+CK_RV db_keypool_add(token *tok, twist template, twist pubblob, twist privblob,
+        twist objauth) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    sqlite3_stmt *stmt = NULL;
+
+    static const char *sql =
+        "INSERT INTO keypool ("
+            "tokid,"    /* index: 1 */
+            "template," /* index: 2 */
+            "pub,"      /* index: 3 */
+            "priv,"     /* index: 4 */
+            "objauth"   /* index: 5 */
+        ") VALUES (?,?,?,?,?);";
+
+    int rc = stmt_get(stmt_keypool_add, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+        return CKR_GENERAL_ERROR;
+    }
+
+    TRANSACTION_START;
+
+    rc = sqlite3_bind_int(stmt, 1, tok->id);
+    gotobinderror(rc, "tokid");
+
+    rc = sqlite3_bind_blob(stmt, 2, template, twist_len(template), SQLITE_STATIC);
+    gotobinderror(rc, "template");
+
+    rc = sqlite3_bind_blob(stmt, 3, pubblob, twist_len(pubblob), SQLITE_STATIC);
+    gotobinderror(rc, "pub");
+
+    rc = sqlite3_bind_blob(stmt, 4, privblob, twist_len(privblob), SQLITE_STATIC);
+    gotobinderror(rc, "priv");
+
+    rc = sqlite3_bind_text(stmt, 5, objauth, twist_len(objauth), SQLITE_STATIC);
+    gotobinderror(rc, "objauth");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    rv = CKR_OK;
+
+    TRANSACTION_END(rv);
+    stmt_put(stmt_keypool_add, stmt);
+
+    return rv;
+}
+
+CK_RV db_keypool_claim(token *tok, twist template, twist *pubblob,
+        twist *privblob, twist *objauth) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    sqlite3_stmt *get = NULL;
+    sqlite3_stmt *del = NULL;
+
+    twist pub = NULL;
+    twist priv = NULL;
+    twist auth = NULL;
+
+    static const char *get_sql =
+        "SELECT id,pub,priv,objauth FROM keypool"
+            " WHERE tokid=? AND template=? LIMIT 1;";
+
+    static const char *del_sql =
+        "DELETE FROM keypool WHERE id=?;";
+
+    int rc = stmt_get(stmt_keypool_get, get_sql, &get);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+        return CKR_GENERAL_ERROR;
+    }
+
+    rc = stmt_get(stmt_keypool_delete, del_sql, &del);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+        stmt_put(stmt_keypool_get, get);
+        return CKR_GENERAL_ERROR;
+    }
+
+    TRANSACTION_START;
+
+    rc = sqlite3_bind_int(get, 1, tok->id);
+    gotobinderror(rc, "tokid");
+
+    rc = sqlite3_bind_blob(get, 2, template, twist_len(template), SQLITE_STATIC);
+    gotobinderror(rc, "template");
+
+    rc = sqlite3_step(get);
+    if (rc == SQLITE_DONE) {
+        /* an empty pool is not an error */
+        rv = CKR_OK;
+        goto error;
+    }
+
+    if (rc != SQLITE_ROW) {
+        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    int id = sqlite3_column_int(get, 0);
+
+    rc = get_blob(get, 1, &pub);
+    goto_error(rc, error);
+
+    rc = get_blob(get, 2, &priv);
+    goto_error(rc, error);
+
+    auth = twist_new((char *)sqlite3_column_text(get, 3));
+    goto_oom(auth, error);
+
+    rc = sqlite3_bind_int(del, 1, id);
+    gotobinderror(rc, "id");
+
+    rc = sqlite3_step(del);
+    if (rc != SQLITE_DONE) {
+        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    /* another process claimed the key first */
+    if (sqlite3_changes(global.db) != 1) {
+        twist_free(pub);
+        twist_free(priv);
+        twist_free(auth);
+        pub = priv = auth = NULL;
+    }
+
+    rv = CKR_OK;
+
+    TRANSACTION_END(rv);
+
+    stmt_put(stmt_keypool_get, get);
+    stmt_put(stmt_keypool_delete, del);
+
+    if (rv != CKR_OK) {
+        twist_free(pub);
+        twist_free(priv);
+        twist_free(auth);
+        return rv;
+    }
+
+    *pubblob = pub;
+    *privblob = priv;
+    *objauth = auth;
+
+    return CKR_OK;
+}
+
+CK_RV db_keypool_count(token *tok, twist template, unsigned *count) {
+    assert(count);
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    static const char *sql =
+        "SELECT COUNT(*) FROM keypool WHERE tokid=? AND template=?;";
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = stmt_get(stmt_keypool_count, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+        return rv;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, tok->id);
+    gotobinderror(rc, "tokid");
+
+    rc = sqlite3_bind_blob(stmt, 2, template, twist_len(template), SQLITE_STATIC);
+    gotobinderror(rc, "template");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    *count = sqlite3_column_int(stmt, 0);
+
+    rv = CKR_OK;
+
+error:
+    stmt_put(stmt_keypool_count, stmt);
     return rv;
 }
 
+CK_RV db_get_pobject_context(unsigned pid, uint32_t *reset_count, twist *context) {
+    assert(reset_count);
+    assert(context);
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    static const char *sql =
+        "SELECT resetcount,context FROM pobject_contexts WHERE pid=?;";
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = stmt_get(stmt_get_pobject_context, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+        return rv;
+    }
+
+    *context = NULL;
+
+    rc = sqlite3_bind_int(stmt, 1, pid);
+    gotobinderror(rc, "pid");
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+        /* nothing saved yet is not an error */
+        rv = CKR_OK;
+        goto error;
+    }
+
+    if (rc != SQLITE_ROW) {
+        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    *reset_count = (uint32_t)sqlite3_column_int64(stmt, 0);
+
+    rc = get_blob(stmt, 1, context);
+    goto_error(rc, error);
+
+    rv = CKR_OK;
+
+error:
+    stmt_put(stmt_get_pobject_context, stmt);
+    return rv;
+}
+
+CK_RV db_set_pobject_context(unsigned pid, uint32_t reset_count, twist context) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    static const char *sql =
+        "REPLACE INTO pobject_contexts ("
+            "pid,"          /* index: 1 */
+            "resetcount,"   /* index: 2 */
+            "context"       /* index: 3 */
+        ") VALUES (?,?,?);";
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = stmt_get(stmt_set_pobject_context, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+        return rv;
+    }
+
+    TRANSACTION_START;
+
+    rc = sqlite3_bind_int(stmt, 1, pid);
+    gotobinderror(rc, "pid");
+
+    rc = sqlite3_bind_int64(stmt, 2, reset_count);
+    gotobinderror(rc, "resetcount");
+
+    rc = sqlite3_bind_blob(stmt, 3, context, twist_len(context), SQLITE_STATIC);
+    gotobinderror(rc, "context");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    rv = CKR_OK;
+
+    TRANSACTION_END(rv);
+    stmt_put(stmt_set_pobject_context, stmt);
+
+    return rv;
+}
 
 #define DB_NAME "tpm2_pkcs11.sqlite3"
 #define PKCS11_STORE_ENV_VAR "TPM2_PKCS11_STORE"
@@ -1431,6 +3126,111 @@ out:
 
 #define DB_EMPTY 0
 
+static const char *db_journal_mode(void) {
+
+    /* WAL is the only mode where readers and a writer do not block each other */
+    static const char *modes[] = { "wal", "delete", "truncate", "persist" };
+
+    const char *env = getenv(DB_JOURNAL_MODE_ENV);
+    if (!env) {
+        return modes[0];
+    }
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(modes); i++) {
+        if (!strcasecmp(env, modes[i])) {
+            return modes[i];
+        }
+    }
+
+    LOGW("Unknown "DB_JOURNAL_MODE_ENV" \"%s\", using \"%s\"", env, modes[0]);
+    return modes[0];
+}
+
+static int db_busy_timeout(void) {
+
+    const char *env = getenv(DB_BUSY_TIMEOUT_ENV);
+    if (!env) {
+        return DB_BUSY_TIMEOUT_DEFAULT_MS;
+    }
+
+    size_t ms = 0;
+    int rc = str_to_ul(env, &ms);
+    if (rc || ms > INT_MAX) {
+        LOGW("Invalid "DB_BUSY_TIMEOUT_ENV" \"%s\", using %d ms",
+                env, DB_BUSY_TIMEOUT_DEFAULT_MS);
+        return DB_BUSY_TIMEOUT_DEFAULT_MS;
+    }
+
+    return (int)ms;
+}
+
+static unsigned db_env_bound(const char *name, unsigned def) {
+
+    const char *env = getenv(name);
+    if (!env) {
+        return def;
+    }
+
+    size_t val = 0;
+    int rc = str_to_ul(env, &val);
+    if (rc || val > UINT_MAX) {
+        LOGW("Invalid %s \"%s\", using %u", name, env, def);
+        return def;
+    }
+
+    return (unsigned)val;
+}
+
+static CK_RV db_open(const char *dbpath, bool readonly, sqlite3 **db) {
+
+    int flags = readonly ? SQLITE_OPEN_READONLY :
+            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+    int rc = sqlite3_open_v2(dbpath, db, flags, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot open database: %s\n", sqlite3_errmsg(*db));
+        sqlite3_close(*db);
+        *db = NULL;
+        return CKR_GENERAL_ERROR;
+    }
+
+    /* wait for writers in other processes rather than failing */
+    sqlite3_busy_timeout(*db, db_busy_timeout());
+
+    return CKR_OK;
+}
+
+static bool db_journal_mode_is(sqlite3 *db, const char *mode) {
+
+    sqlite3_stmt *stmt = NULL;
+    bool is_mode = false;
+
+    int rc = sqlite3_prepare_v2(db, "PRAGMA journal_mode;", -1, &stmt, NULL);
+    if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *cur = (const char *)sqlite3_column_text(stmt, 0);
+        is_mode = cur && !strcasecmp(cur, mode);
+    }
+
+    sqlite3_finalize(stmt);
+    return is_mode;
+}
+
+static void db_set_journal_mode(sqlite3 *db, const char *mode) {
+
+    /*
+     * WAL is persistent in the file, the rollback modes are per connection.
+     * Not being able to switch is not fatal, the store works in any mode.
+     */
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s;", mode);
+
+    int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK || !db_journal_mode_is(db, mode)) {
+        LOGW("Could not set DB journal mode \"%s\": %s", mode, sqlite3_errmsg(db));
+    }
+}
+
 static CK_RV db_get_version(sqlite3 *db, unsigned *version) {
 
     CK_RV rv = CKR_GENERAL_ERROR;
@@ -1440,7 +3240,7 @@ static CK_RV db_get_version(sqlite3 *db, unsigned *version) {
     sqlite3_stmt *stmt;
     int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
-        LOGW("Cannot prepare version query: %s\n", sqlite3_errmsg(global.db));
+        LOGW("Cannot prepare version query: %s\n", sqlite3_errmsg(db));
         *version = DB_EMPTY;
         return CKR_OK;
     }
@@ -1451,7 +3251,7 @@ static CK_RV db_get_version(sqlite3 *db, unsigned *version) {
     } else if (rc == SQLITE_DONE) {
         *version = DB_EMPTY;
     } else {
-        LOGE("Cannot step query: %s\n", sqlite3_errmsg(global.db));
+        LOGE("Cannot step query: %s\n", sqlite3_errmsg(db));
         *version = DB_EMPTY;
         goto error;
     }
@@ -1691,6 +3491,161 @@ error:
     return rv;
 }
 
+static CK_RV dbup_handler_from_4_to_5(sqlite3 *updb) {
+
+    /*
+     * Between version 4 and 5 of the DB the following changes need to be made:
+     *  - Add indexes on the tokid columns, tokens load their objects by tokid
+     *    and without them every load scans the objects of all tokens.
+     */
+    const char *sql[] = {
+        "CREATE INDEX IF NOT EXISTS tobjects_tokid ON tobjects(tokid);",
+        "CREATE INDEX IF NOT EXISTS sealobjects_tokid ON sealobjects(tokid);",
+    };
+
+    return run_sql_list(updb, sql, ARRAY_LEN(sql));
+}
+
+static CK_RV dbup_handler_from_5_to_6(sqlite3 *updb) {
+
+    /*
+     * Between version 5 and 6 of the DB the following changes need to be made:
+     *  - Add a rev column to tobjects, stamped with a new random value by
+     *    triggers whenever a row is inserted or its attrs change. Processes
+     *    compare it with the value they loaded to find changed objects, no
+     *    matter which tool or library version wrote the row.
+     */
+    const char *sql[] = {
+        "ALTER TABLE tobjects ADD COLUMN rev INTEGER NOT NULL DEFAULT 0;",
+        "CREATE TRIGGER tobjects_rev_insert\n"
+        "AFTER INSERT ON tobjects\n"
+        "BEGIN\n"
+        "    UPDATE tobjects SET rev=random() WHERE id=NEW.id;\n"
+        "END;\n",
+        "CREATE TRIGGER tobjects_rev_update\n"
+        "AFTER UPDATE OF attrs ON tobjects\n"
+        "BEGIN\n"
+        "    UPDATE tobjects SET rev=random() WHERE id=NEW.id;\n"
+        "END;\n",
+    };
+
+    return run_sql_list(updb, sql, ARRAY_LEN(sql));
+}
+
+static CK_RV dbup_handler_from_6_to_7(sqlite3 *updb) {
+
+    /*
+     * Between version 6 and 7 of the DB the following changes need to be made:
+     *  - Add the tobject_attrs table, holding one row per attribute of the
+     *    objects of tokens with the table attribute store. Those objects
+     *    have an empty attrs column. Existing objects keep their YAML until
+     *    the library writes them.
+     *  - Index it on (type, value) so object searches can run in SQL.
+     *  - Drop the rows of an object when it is deleted.
+     */
+    const char *sql[] = {
+        "CREATE TABLE IF NOT EXISTS tobject_attrs("
+            "tobject_id INTEGER NOT NULL,"
+            "type INTEGER NOT NULL,"
+            "kind INTEGER NOT NULL,"
+            "value BLOB,"
+            "PRIMARY KEY (tobject_id, type)"
+        ");",
+        "CREATE INDEX IF NOT EXISTS tobject_attrs_type_value ON tobject_attrs(type, value);",
+        "CREATE TRIGGER tobject_attrs_delete\n"
+        "AFTER DELETE ON tobjects\n"
+        "BEGIN\n"
+        "    DELETE FROM tobject_attrs WHERE tobject_id=OLD.id;\n"
+        "END;\n",
+    };
+
+    return run_sql_list(updb, sql, ARRAY_LEN(sql));
+}
+
+static CK_RV dbup_handler_from_7_to_8(sqlite3 *updb) {
+
+    /*
+     * Between version 7 and 8 of the DB the following changes need to be made:
+     *  - Add the tobject_values table, holding the CKA_VALUE of public data
+     *    objects and certificates above TPM2_PKCS11_STORE_VALUE_THRESHOLD
+     *    bytes. Its rowid is the tobject id and the attrs of the object
+     *    hold an empty CKA_VALUE in its place.
+     *  - Drop the value of an object when it is deleted.
+     */
+    const char *sql[] = {
+        "CREATE TABLE IF NOT EXISTS tobject_values("
+            "id INTEGER PRIMARY KEY,"
+            "value BLOB NOT NULL"
+        ");",
+        "CREATE TRIGGER tobject_values_delete\n"
+        "AFTER DELETE ON tobjects\n"
+        "BEGIN\n"
+        "    DELETE FROM tobject_values WHERE id=OLD.id;\n"
+        "END;\n",
+    };
+
+    return run_sql_list(updb, sql, ARRAY_LEN(sql));
+}
+
+static CK_RV dbup_handler_from_8_to_9(sqlite3 *updb) {
+
+    /*
+     * Between version 8 and 9 of the DB the following changes need to be made:
+     *  - Add the keypool table, holding keys created ahead of time for the
+     *    key-pool token config. The template column is the marshalled
+     *    TPM2B_PUBLIC the key was created from.
+     */
+    const char *sql[] = {
+        "CREATE TABLE IF NOT EXISTS keypool("
+            "id INTEGER PRIMARY KEY,"
+            "tokid INTEGER NOT NULL,"
+            "template BLOB NOT NULL,"
+            "pub BLOB NOT NULL,"
+            "priv BLOB NOT NULL,"
+            "objauth TEXT NOT NULL,"
+            "FOREIGN KEY (tokid) REFERENCES tokens(id) ON DELETE CASCADE"
+        ");",
+        "CREATE INDEX IF NOT EXISTS keypool_tokid_template ON keypool(tokid, template);",
+    };
+
+    return run_sql_list(updb, sql, ARRAY_LEN(sql));
+}
+
+static CK_RV dbup_handler_from_9_to_10(sqlite3 *updb) {
+
+    /*
+     * Between version 9 and 10 of the DB the following changes need to be made:
+     *  - Add the pobject_contexts table, holding the TPMS_CONTEXT of a
+     *    transient primary object saved by the process that created it,
+     *    along with the TPM resetCount it is valid for.
+     */
+    const char *sql[] = {
+        "CREATE TABLE IF NOT EXISTS pobject_contexts("
+            "pid INTEGER PRIMARY KEY,"
+            "resetcount INTEGER NOT NULL,"
+            "context BLOB NOT NULL,"
+            "FOREIGN KEY (pid) REFERENCES pobjects(id) ON DELETE CASCADE"
+        ");",
+    };
+
+    return run_sql_list(updb, sql, ARRAY_LEN(sql));
+}
+
+static CK_RV dbup_handler_from_10_to_11(sqlite3 *updb) {
+
+    /*
+     * Between version 10 and 11 of the DB the following changes need to be made:
+     *  - None to the tables. The (user|so)authsalt columns of sealobjects may
+     *    now name the KDF of the PIN, eg "$scrypt$ln=14,r=8,p=1$<salt>", see
+     *    utils_hash_pass(). Existing salts keep SHA256 until the PIN changes.
+     *    The version keeps older releases, which would hash such a salt as is
+     *    and fail the login against the TPM's lockout, off the store.
+     */
+    UNUSED(updb);
+
+    return CKR_OK;
+}
+
 static CK_RV db_backup(sqlite3 *db, const char *dbpath, sqlite3 **updb, char **copypath) {
 
     CK_RV rv = CKR_GENERAL_ERROR;
@@ -1763,6 +3718,13 @@ static CK_RV db_update(sqlite3 **xdb, const char *dbpath, unsigned old_version,
             dbup_handler_from_1_to_2,
             dbup_handler_from_2_to_3,
             dbup_handler_from_3_to_4,
+            dbup_handler_from_4_to_5,
+            dbup_handler_from_5_to_6,
+            dbup_handler_from_6_to_7,
+            dbup_handler_from_7_to_8,
+            dbup_handler_from_8_to_9,
+            dbup_handler_from_9_to_10,
+            dbup_handler_from_10_to_11,
     };
 
     /*
@@ -1811,56 +3773,33 @@ static CK_RV db_update(sqlite3 **xdb, const char *dbpath, unsigned old_version,
     }
 
     /*
-     * Swap the current db with the backup db, by:
-     * 1. closing them
-     * 2. renaming the current db as .old
-     * 3. renaming the bakup db as the old db
-     * 4. unlinking the .old db
-     * 5. opening the new db
+     * Copy the updated backup over the current db with the backup API. It
+     * replaces the db in one transaction through the open connection, so a
+     * failure leaves it as it was and, unlike renaming files over it, the
+     * -wal and -shm files of a db in WAL mode stay consistent with it.
      */
-    sqlite3_close(*xdb);
-    *xdb = NULL;
-
-    sqlite3_close(dbbak);
-    dbbak = NULL;
-
-    char buf[PATH_MAX];
-    unsigned l = snprintf(buf, sizeof(buf), "%s.old", dbpath);
-    if (l >= sizeof(buf)) {
-        LOGE("Old database path is longer than PATH_MAX");
+    sqlite3_backup *restore = sqlite3_backup_init(*xdb, "main", dbbak, "main");
+    if (!restore) {
+        LOGE("Cannot init db restore: %s", sqlite3_errmsg(*xdb));
         rv = CKR_GENERAL_ERROR;
         goto out;
     }
 
-    int rc = rename(dbpath, buf);
-    if (rc != 0) {
-       LOGE("Could not rename \"%s\" --> \"%s\", error: %s",
-               dbpath, buf, strerror(errno));
-       rv = CKR_GENERAL_ERROR;
-       goto out;
-    }
-
-    rc = rename(dbbakpath, dbpath);
-    if (rc != 0) {
-       LOGE("Could not rename \"%s\" --> \"%s\", error: %s",
-               dbbakpath, dbpath, strerror(errno));
-       rv = CKR_GENERAL_ERROR;
-       goto out;
-    }
-
-    rc = sqlite3_open(dbpath, xdb);
-    if (rc != SQLITE_OK) {
-        LOGE("Cannot open database: %s\n", sqlite3_errmsg(*xdb));
+    int rc = sqlite3_backup_step(restore, -1);
+    sqlite3_backup_finish(restore);
+    if (rc != SQLITE_DONE) {
+        LOGE("Cannot step db restore: %s", sqlite3_errmsg(*xdb));
         rv = CKR_GENERAL_ERROR;
         goto out;
     }
 
-    rc = unlink(buf);
+    sqlite3_close(dbbak);
+    dbbak = NULL;
+
+    rc = unlink(dbbakpath);
     if (rc != 0) {
-       LOGE("Could not unlink \"%s\", error: %s",
-               buf, strerror(errno));
-       rv = CKR_GENERAL_ERROR;
-       goto out;
+       LOGW("Could not unlink \"%s\", error: %s",
+               dbbakpath, strerror(errno));
     }
 
     rv = CKR_OK;
@@ -1919,7 +3858,11 @@ static void release_lock(FILE *f, char *lockpath) {
 
 #ifndef NDBEBUG
 void db_debug_set_db(sqlite3 *db) {
+    stmt_cache_flush();
     global.db = db;
+#ifdef HAVE_USDT
+    global.trace_mask = 0;
+#endif
 }
 #endif
 
@@ -1954,8 +3897,59 @@ CK_RV db_init_new(sqlite3 *db) {
             "id INTEGER PRIMARY KEY,"
             "tokid INTEGER NOT NULL,"
             "attrs TEXT NOT NULL,"
+            "rev INTEGER NOT NULL DEFAULT 0,"
+            "FOREIGN KEY (tokid) REFERENCES tokens(id) ON DELETE CASCADE"
+        ");",
+        "CREATE INDEX tobjects_tokid ON tobjects(tokid);",
+        "CREATE TRIGGER tobjects_rev_insert\n"
+        "AFTER INSERT ON tobjects\n"
+        "BEGIN\n"
+        "    UPDATE tobjects SET rev=random() WHERE id=NEW.id;\n"
+        "END;\n",
+        "CREATE TRIGGER tobjects_rev_update\n"
+        "AFTER UPDATE OF attrs ON tobjects\n"
+        "BEGIN\n"
+        "    UPDATE tobjects SET rev=random() WHERE id=NEW.id;\n"
+        "END;\n",
+        "CREATE TABLE tobject_attrs("
+            "tobject_id INTEGER NOT NULL,"
+            "type INTEGER NOT NULL,"
+            "kind INTEGER NOT NULL,"
+            "value BLOB,"
+            "PRIMARY KEY (tobject_id, type)"
+        ");",
+        "CREATE INDEX tobject_attrs_type_value ON tobject_attrs(type, value);",
+        "CREATE TRIGGER tobject_attrs_delete\n"
+        "AFTER DELETE ON tobjects\n"
+        "BEGIN\n"
+        "    DELETE FROM tobject_attrs WHERE tobject_id=OLD.id;\n"
+        "END;\n",
+        "CREATE TABLE tobject_values("
+            "id INTEGER PRIMARY KEY,"
+            "value BLOB NOT NULL"
+        ");",
+        "CREATE TRIGGER tobject_values_delete\n"
+        "AFTER DELETE ON tobjects\n"
+        "BEGIN\n"
+        "    DELETE FROM tobject_values WHERE id=OLD.id;\n"
+        "END;\n",
+        "CREATE INDEX sealobjects_tokid ON sealobjects(tokid);",
+        "CREATE TABLE keypool("
+            "id INTEGER PRIMARY KEY,"
+            "tokid INTEGER NOT NULL,"
+            "template BLOB NOT NULL,"
+            "pub BLOB NOT NULL,"
+            "priv BLOB NOT NULL,"
+            "objauth TEXT NOT NULL,"
             "FOREIGN KEY (tokid) REFERENCES tokens(id) ON DELETE CASCADE"
         ");",
+        "CREATE INDEX keypool_tokid_template ON keypool(tokid, template);",
+        "CREATE TABLE pobject_contexts("
+            "pid INTEGER PRIMARY KEY,"
+            "resetcount INTEGER NOT NULL,"
+            "context BLOB NOT NULL,"
+            "FOREIGN KEY (pid) REFERENCES pobjects(id) ON DELETE CASCADE"
+        ");",
         "CREATE TABLE schema("
             "id INTEGER PRIMARY KEY,"
             "schema_version INTEGER NOT NULL"
@@ -2001,7 +3995,8 @@ static CK_RV db_verify_update_ok(const char *dbpath) {
     return CKR_OK;
 }
 
-static CK_RV db_setup(sqlite3 **xdb, const char *dbpath) {
+static CK_RV db_setup_locked(sqlite3 **xdb, const char *dbpath,
+        bool is_in_mem_db, const char *journal_mode) {
 
     /*
      * take the version check lock and figure out what
@@ -2011,19 +4006,29 @@ static CK_RV db_setup(sqlite3 **xdb, const char *dbpath) {
      *  - upgrade an existing db
      */
 
-    const char *pname = sqlite3_db_filename(*xdb, NULL);
-    bool is_in_mem_db = !pname || pname[0] == '\0';
+    CK_RV rv = CKR_GENERAL_ERROR;
 
     char lockpath[PATH_MAX];
     FILE *f = NULL;
     if (!is_in_mem_db) {
+        /* don't hold the store open while waiting on another process' upgrade */
+        sqlite3_close(*xdb);
+        *xdb = NULL;
+
         f = take_lock(dbpath, lockpath);
         if (!f) {
             return CKR_GENERAL_ERROR;
         }
+
+        /* an upgrade renames the store, so look at whatever is there now */
+        rv = db_open(dbpath, false, xdb);
+        if (rv != CKR_OK) {
+            release_lock(f, lockpath);
+            return rv;
+        }
     }
 
-    CK_RV rv = db_verify_update_ok(dbpath);
+    rv = db_verify_update_ok(dbpath);
     if (rv != CKR_OK) {
         goto out;
     }
@@ -2059,6 +4064,9 @@ out:
     if (rv != CKR_OK) {
         LOGE("Error within db, leaving backup see: "
             "https://github.com/tpm2-software/tpm2-pkcs11/blob/master/docs/DB_UPGRADE.md.");
+    } else if (!is_in_mem_db) {
+        /* switching to WAL needs the store to ourselves, do it while serialized */
+        db_set_journal_mode(*xdb, journal_mode);
     }
 
     if (!is_in_mem_db) {
@@ -2068,6 +4076,64 @@ out:
     return rv;
 }
 
+static CK_RV db_setup(sqlite3 **xdb, const char *dbpath, bool readonly) {
+
+    const char *pname = sqlite3_db_filename(*xdb, NULL);
+    bool is_in_mem_db = !pname || pname[0] == '\0';
+
+    const char *journal_mode = db_journal_mode();
+    bool want_wal = !strcmp(journal_mode, "wal");
+
+    /* a failed upgrade must be looked at, whichever path the open takes */
+    CK_RV rv = db_verify_update_ok(dbpath);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    /*
+     * Check without the lock first: a store that is already at this version
+     * and in the wanted journal mode needs nothing, so processes opening it
+     * concurrently don't queue up behind each other on the lock file.
+     */
+    unsigned version = DB_EMPTY;
+    rv = db_get_version(*xdb, &version);
+    if (rv != CKR_OK) {
+        LOGE("Could not get DB version");
+        return rv;
+    }
+
+    if (version > DB_VERSION) {
+        LOGE("DB Version exceeds library version: %u > %u",
+                version, DB_VERSION);
+        return CKR_OK;
+    }
+
+    if (readonly) {
+        if (version != DB_VERSION) {
+            LOGE("Read-only DB at version %u cannot be brought to version %u, "
+                    "run tpm2_ptool or the library once with write access",
+                    version, DB_VERSION);
+            return CKR_GENERAL_ERROR;
+        }
+
+        LOGV("No DB upgrade needed");
+        return CKR_OK;
+    }
+
+    if (version != DB_VERSION || is_in_mem_db
+            || db_journal_mode_is(*xdb, "wal") != want_wal) {
+        return db_setup_locked(xdb, dbpath, is_in_mem_db, journal_mode);
+    }
+
+    LOGV("No DB upgrade needed");
+
+    if (!want_wal) {
+        db_set_journal_mode(*xdb, journal_mode);
+    }
+
+    return CKR_OK;
+}
+
 DEBUG_VISIBILITY WEAK
 CK_RV db_new(sqlite3 **db) {
 
@@ -2083,19 +4149,32 @@ CK_RV db_new(sqlite3 **db) {
         return rv;
     }
 
-    LOGV("Using sqlite3 DB: \"%s\"", dbpath);
+    /* a store we cannot write, eg. a shared one owned by root, is only read */
+    bool readonly = access(dbpath, F_OK) == 0 && access(dbpath, W_OK) != 0
+            && (errno == EACCES || errno == EROFS);
 
-    int rc = sqlite3_open(dbpath, db);
-    if (rc != SQLITE_OK) {
-        LOGE("Cannot open database: %s\n", sqlite3_errmsg(*db));
-        return CKR_GENERAL_ERROR;
+    LOGV("Using sqlite3 DB: \"%s\"%s", dbpath, readonly ? " read-only" : "");
+
+    rv = db_open(dbpath, readonly, db);
+    if (rv != CKR_OK) {
+        return rv;
     }
 
-    return db_setup(db, dbpath);
+    return db_setup(db, dbpath, readonly);
 }
 
 static CK_RV db_free(sqlite3 **db) {
 
+    /* C_Finalize is the last chance for batched object writes */
+    CK_RV rv = CKR_OK;
+    if (*db == global.db) {
+        rv = db_flush();
+    }
+
+    /* cached statements would keep the connection open */
+    stmt_cache_flush();
+    global.cache_stmts = false;
+
     int rc = sqlite3_close(*db);
     if (rc != SQLITE_OK) {
         LOGE("Cannot close database: %s\n", sqlite3_errmsg(*db));
@@ -2104,14 +4183,104 @@ static CK_RV db_free(sqlite3 **db) {
 
     *db = NULL;
 
-    return CKR_OK;
+    return rv;
+}
+
+#ifdef HAVE_USDT
+PROBE_SEMAPHORE(db__stmt__start);
+PROBE_SEMAPHORE(db__stmt__done);
+
+static int db_trace(unsigned type, void *ctx, void *p, void *x) {
+    UNUSED(ctx);
+
+    sqlite3_stmt *stmt = (sqlite3_stmt *)p;
+
+    switch (type) {
+    case SQLITE_TRACE_STMT:
+        PROBE2(db__stmt__start, stmt, (const char *)x);
+        break;
+    case SQLITE_TRACE_PROFILE:
+        PROBE3(db__stmt__done, stmt, sqlite3_sql(stmt), *(sqlite3_int64 *)x);
+        break;
+        /* no default */
+    }
+
+    return 0;
+}
+
+/*
+ * The trace hook costs every statement a callback, and the done probe makes
+ * sqlite time each one, so the hook is only installed for the statement
+ * probes a tracer is attached to. Called before running statements.
+ */
+static void db_trace_sync(void) {
+
+    unsigned mask = 0;
+    if (PROBE_ENABLED(db__stmt__start)) {
+        mask |= SQLITE_TRACE_STMT;
+    }
+    if (PROBE_ENABLED(db__stmt__done)) {
+        mask |= SQLITE_TRACE_PROFILE;
+    }
+
+    if (!global.db || mask == __atomic_load_n(&global.trace_mask, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    /* the connection mutex is recursive, sqlite3_trace_v2() takes it as well */
+    sqlite3_mutex *m = sqlite3_db_mutex(global.db);
+    sqlite3_mutex_enter(m);
+    if (mask != global.trace_mask) {
+        sqlite3_trace_v2(global.db, mask, mask ? db_trace : NULL, NULL);
+        __atomic_store_n(&global.trace_mask, mask, __ATOMIC_RELEASE);
+    }
+    sqlite3_mutex_leave(m);
 }
+#endif
 
 CK_RV db_init(void) {
 
-    return db_new(&global.db);
+    global.batch.window_ms = db_env_bound(DB_BATCH_WINDOW_ENV,
+            DB_BATCH_WINDOW_DEFAULT_MS);
+    global.batch.count = db_env_bound(DB_BATCH_COUNT_ENV,
+            DB_BATCH_COUNT_DEFAULT);
+    global.value_threshold = db_env_bound(DB_VALUE_THRESHOLD_ENV,
+            DB_VALUE_THRESHOLD_DEFAULT);
+
+    CK_RV rv = mutex_create(&global.batch.mutex);
+    if (rv != CKR_OK) {
+        LOGE("Could not create the store write mutex");
+        return rv;
+    }
+
+    rv = batch_flusher_init();
+    if (rv != CKR_OK) {
+        mutex_destroy(global.batch.mutex);
+        global.batch.mutex = NULL;
+        return rv;
+    }
+
+    rv = db_new(&global.db);
+    global.cache_stmts = rv == CKR_OK;
+    if (rv == CKR_OK) {
+        db_trace_sync();
+    }
+
+    return rv;
 }
 
 CK_RV db_destroy(void) {
-    return db_free(&global.db);
+
+    /* db_free() commits what is left */
+    batch_flusher_destroy();
+
+    CK_RV rv = db_free(&global.db);
+#ifdef HAVE_USDT
+    global.trace_mask = 0;
+#endif
+
+    mutex_destroy(global.batch.mutex);
+    global.batch.mutex = NULL;
+
+    return rv;
 }
@@ -56,11 +56,13 @@ CK_RV db_add_new_object(token *tok, tobject *tobj);
 
 /**
  * Delete a tobject from the DB.
+ * @param tok
+ *  The token the tobject belongs to.
  * @param tobj
  *  The tobject to remove.
  * @return
  */
-CK_RV db_delete_object(tobject *tobj);
+CK_RV db_delete_object(token *tok, tobject *tobj);
 
 CK_RV db_get_first_pid(unsigned *id);
 
@@ -70,7 +72,176 @@ CK_RV db_add_token(token *tok);
 
 CK_RV db_update_token_config(token *tok);
 
-CK_RV db_update_tobject_attrs(unsigned id, attr_list *attrs);
+/**
+ * Persists new attributes of a tobject. A large public CKA_VALUE is moved
+ * to the tobject_values table and left empty in attrs.
+ * @param tok
+ *  The token the tobject belongs to.
+ * @param tobj
+ *  The tobject to update, its store revision is updated on success.
+ * @param attrs
+ *  The new attributes.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV db_update_tobject_attrs(token *tok, tobject *tobj, attr_list *attrs);
+
+/**
+ * Persists new attributes of a tobject of a token with the table attribute
+ * store, writing only the tobject_attrs rows that changed. An object still
+ * stored as YAML is moved to the table.
+ * @param tok
+ *  The token the tobject belongs to.
+ * @param tobj
+ *  The tobject to update, its attrs are the ones the store holds. Its
+ *  store revision is updated on success.
+ * @param attrs
+ *  The new attributes.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV db_update_tobject_attr_rows(token *tok, tobject *tobj, attr_list *attrs);
+
+/**
+ * Narrows a C_FindObjectsInit() search with the tobject_attrs index.
+ * @param tok
+ *  The token to search.
+ * @param templ
+ *  The search template.
+ * @param count
+ *  The number of attributes in templ.
+ * @param ids
+ *  The ids of the candidate tobjects in ascending order, the caller must
+ *  still match them against templ. Free with free().
+ * @param len
+ *  The number of ids.
+ * @return
+ *  CKR_OK on success, CKR_FUNCTION_NOT_SUPPORTED when the template has no
+ *  attribute to search the store with, anything else is an error.
+ */
+CK_RV db_find_tobjects(token *tok, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        unsigned **ids, size_t *len);
+
+/**
+ * Reads the CKA_VALUE of a tobject kept in the tobject_values table,
+ * see tobject::ext_value_len, directly into buf.
+ * @param tobj
+ *  The tobject to read the value of.
+ * @param buf
+ *  The buffer to read into.
+ * @param len
+ *  The length of buf, must be the length of the value.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV db_read_tobject_value(tobject *tobj, CK_BYTE_PTR buf, CK_ULONG len);
+
+/**
+ * Commits the object writes batched for tokens with batch durability.
+ * Batches are also committed once they reach TPM2_PKCS11_STORE_BATCH_COUNT
+ * writes or on the first write after TPM2_PKCS11_STORE_BATCH_WINDOW ms.
+ * @return
+ *  CKR_OK on success, anything else is an error and the batched writes
+ *  are lost.
+ */
+CK_RV db_flush(void);
+
+/**
+ * Commits the open batch if it reached TPM2_PKCS11_STORE_BATCH_COUNT writes
+ * or outlived TPM2_PKCS11_STORE_BATCH_WINDOW ms. Called at the end of every
+ * API call that may write objects, for when the library may not run the
+ * thread that otherwise commits batches once their window is over. Errors
+ * are logged.
+ */
+void db_flush_due(void);
+
+/**
+ * Adds a key created ahead of time to the key pool of a token.
+ * @param tok
+ *  The token owning the key.
+ * @param template
+ *  The marshalled TPM2B_PUBLIC the key was created from.
+ * @param pubblob
+ *  The public blob of the key.
+ * @param privblob
+ *  The private blob of the key.
+ * @param objauth
+ *  The wrapped auth value of the key.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV db_keypool_add(token *tok, twist template, twist pubblob, twist privblob,
+        twist objauth);
+
+/**
+ * Takes a key created from template out of the key pool of a token.
+ * @param tok
+ *  The token owning the key.
+ * @param template
+ *  The marshalled TPM2B_PUBLIC the key must have been created from.
+ * @param pubblob
+ *  The public blob of the key, NULL when the pool had no such key.
+ * @param privblob
+ *  The private blob of the key.
+ * @param objauth
+ *  The wrapped auth value of the key.
+ * @return
+ *  CKR_OK on success, an empty pool is not an error.
+ */
+CK_RV db_keypool_claim(token *tok, twist template, twist *pubblob,
+        twist *privblob, twist *objauth);
+
+/**
+ * Counts the keys created from template in the key pool of a token.
+ * @param tok
+ *  The token owning the keys.
+ * @param template
+ *  The marshalled TPM2B_PUBLIC.
+ * @param count
+ *  The number of keys.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV db_keypool_count(token *tok, twist template, unsigned *count);
+
+/**
+ * Reads the saved context of a transient primary object.
+ * @param pid
+ *  The id of the primary object.
+ * @param reset_count
+ *  The TPM resetCount the context was saved at.
+ * @param context
+ *  The marshalled TPMS_CONTEXT, NULL when none was saved.
+ * @return
+ *  CKR_OK on success, no saved context is not an error.
+ */
+CK_RV db_get_pobject_context(unsigned pid, uint32_t *reset_count, twist *context);
+
+/**
+ * Saves the context of a transient primary object, replacing the
+ * previous one.
+ * @param pid
+ *  The id of the primary object.
+ * @param reset_count
+ *  The TPM resetCount the context was saved at.
+ * @param context
+ *  The marshalled TPMS_CONTEXT.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV db_set_pobject_context(unsigned pid, uint32_t reset_count, twist context);
+
+/**
+ * Brings the tobjects of a token in line with the store, for changes other
+ * processes made. Added objects get new handles, modified objects keep theirs
+ * and removed objects are dropped. Objects in use by an operation are left
+ * alone until a later refresh.
+ * @param tok
+ *  The token to refresh.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV db_refresh_tobjects(token *tok);
 
 /* Debug testing */
 #ifdef TESTING
@@ -1,6 +1,8 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include "config.h"
 #include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <yaml.h>
@@ -240,6 +242,46 @@ doc_delete:
 
 }
 
+/*
+ * Adds a scalar key and its scalar value to the mapping root of doc.
+ * @param doc
+ *  The document to add to.
+ * @param root
+ *  The mapping node.
+ * @param key
+ *  The key, a string.
+ * @param tag
+ *  The tag of the value, eg YAML_STR_TAG.
+ * @param value
+ *  The value.
+ * @return
+ *  true on success, false otherwise.
+ */
+static bool emit_kv(yaml_document_t *doc, int root, const char *key,
+        const char *tag, const char *value) {
+
+    int k = yaml_document_add_scalar(doc, (yaml_char_t *)YAML_STR_TAG,
+         (yaml_char_t *)key, -1, YAML_ANY_SCALAR_STYLE);
+    if (!k) {
+        LOGE("yaml_document_add_scalar for key \"%s\" failed", key);
+        return false;
+    }
+
+    int v = yaml_document_add_scalar(doc, (yaml_char_t *)tag,
+         (yaml_char_t *)value, -1, YAML_ANY_SCALAR_STYLE);
+    if (!v) {
+        LOGE("yaml_document_add_scalar for value of \"%s\" failed", key);
+        return false;
+    }
+
+    if (!yaml_document_append_mapping_pair(doc, root, k, v)) {
+        LOGE("yaml_document_append_mapping_pair for \"%s\" failed", key);
+        return false;
+    }
+
+    return true;
+}
+
 WEAK char *emit_config_to_string(token *t) {
 
     yaml_document_t doc = { 0 };
@@ -265,67 +307,69 @@ WEAK char *emit_config_to_string(token *t) {
     }
 
     /* add config value is initialized */
-    int key = yaml_document_add_scalar(&doc, (yaml_char_t *)YAML_STR_TAG,
-         (yaml_char_t *)"token-init", -1, YAML_ANY_SCALAR_STYLE);
-    if (!key) {
-        LOGE("yaml_document_add_scalar for key failed");
+    if (!emit_kv(&doc, root, "token-init", YAML_BOOL_TAG,
+            t->config.is_initialized ? "true" : "false")) {
         goto doc_delete;
     }
 
-    const char *value = t->config.is_initialized ? "true" : "false";
-
-    int node = yaml_document_add_scalar(&doc, (yaml_char_t *)YAML_BOOL_TAG,
-         (yaml_char_t *)value, -1, YAML_ANY_SCALAR_STYLE);
+    /* add the tcti config value */
+    if (t->config.tcti
+            && !emit_kv(&doc, root, "tcti", YAML_STR_TAG, t->config.tcti)) {
+        goto doc_delete;
+    }
 
-    rc = yaml_document_append_mapping_pair(&doc,
-            root, key, node);
-    if (!rc) {
-        LOGE("yaml_document_append_mapping_pair failed");
+    /* add the pss signature state if known */
+    if (t->config.pss_sigs_good != pss_config_state_unk
+            && !emit_kv(&doc, root, "pss-sigs-good", YAML_BOOL_TAG,
+                    (t->config.pss_sigs_good == pss_config_state_good)
+                    ? "true" : "false")) {
         goto doc_delete;
     }
 
-    /* add the tcti config value */
-    if (t->config.tcti) {
-        key = yaml_document_add_scalar(&doc, (yaml_char_t *)YAML_STR_TAG,
-             (yaml_char_t *)"tcti", -1, YAML_ANY_SCALAR_STYLE);
-        if (!key) {
-            LOGE("yaml_document_add_scalar for key failed");
-            goto doc_delete;
-        }
+    /* full durability is the default, only record a batching token */
+    if (t->config.durability == token_durability_batch
+            && !emit_kv(&doc, root, "durability", YAML_STR_TAG, "batch")) {
+        goto doc_delete;
+    }
 
-        node = yaml_document_add_scalar(&doc, (yaml_char_t *)YAML_STR_TAG,
-             (yaml_char_t *)t->config.tcti, -1, YAML_ANY_SCALAR_STYLE);
+    /* yaml is the default, only record a token using the table */
+    if (t->config.attr_store == token_attr_store_table
+            && !emit_kv(&doc, root, "attr-store", YAML_STR_TAG, "table")) {
+        goto doc_delete;
+    }
 
-        rc = yaml_document_append_mapping_pair(&doc,
-                root, key, node);
-        if (!rc) {
-            LOGE("yaml_document_append_mapping_pair failed");
-            goto doc_delete;
-        }
+    /* host is the default, only record a token checking with the TPM */
+    if (t->config.context_login == token_context_login_tpm
+            && !emit_kv(&doc, root, "context-login", YAML_STR_TAG, "tpm")) {
+        goto doc_delete;
     }
 
-    /* add the pss signature state if known */
-    if (t->config.pss_sigs_good != pss_config_state_unk) {
+    /* the login cache is off by default, only record a TTL */
+    if (t->config.login_cache_ttl) {
+        char ttl[16];
+        snprintf(ttl, sizeof(ttl), "%u", t->config.login_cache_ttl);
 
-        key = yaml_document_add_scalar(&doc, (yaml_char_t *)YAML_STR_TAG,
-             (yaml_char_t *)"pss-sigs-good", -1, YAML_ANY_SCALAR_STYLE);
-        if (!key) {
-            LOGE("yaml_document_add_scalar for key failed");
+        if (!emit_kv(&doc, root, "login-cache-ttl", YAML_INT_TAG, ttl)) {
             goto doc_delete;
         }
+    }
 
-        value = (t->config.pss_sigs_good == pss_config_state_good)
-                ? "true" : "false";
+    /* add the prewarm config if set */
+    if (t->config.prewarm
+            && !emit_kv(&doc, root, "prewarm", YAML_STR_TAG, t->config.prewarm)) {
+        goto doc_delete;
+    }
 
-        node = yaml_document_add_scalar(&doc, (yaml_char_t *)YAML_BOOL_TAG,
-             (yaml_char_t *)value, -1, YAML_ANY_SCALAR_STYLE);
+    /* add the pin kdf config if set */
+    if (t->config.pin_kdf
+            && !emit_kv(&doc, root, "pin-kdf", YAML_STR_TAG, t->config.pin_kdf)) {
+        goto doc_delete;
+    }
 
-        rc = yaml_document_append_mapping_pair(&doc,
-                root, key, node);
-        if (!rc) {
-            LOGE("yaml_document_append_mapping_pair failed");
-            goto doc_delete;
-        }
+    /* add the key pool config if set */
+    if (t->config.key_pool
+            && !emit_kv(&doc, root, "key-pool", YAML_STR_TAG, t->config.key_pool)) {
+        goto doc_delete;
     }
 
     yaml_emitter_t emitter = { 0 };
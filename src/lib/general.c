@@ -13,6 +13,7 @@
 #include "mutex.h"
 #include "pkcs11.h"
 #include "session.h"
+#include "stats.h"
 
 #ifndef VERSION
   #warning "VERSION Not known at compile time, not embedding..."
@@ -180,16 +181,35 @@ bool general_is_init(void) {
     return _g_is_init;
 }
 
+static bool _g_can_create_threads;
+bool general_can_create_threads(void) {
+    return _g_can_create_threads;
+}
+
+static bool _g_os_locking_ok;
+bool general_os_locking_ok(void) {
+    return _g_os_locking_ok;
+}
+
 CK_RV general_init(void *init_args) {
 
     CK_RV rv = CKR_GENERAL_ERROR;
 
+    bool can_create_threads = false;
+    bool os_locking_ok = false;
+
     if (init_args) {
         CK_C_INITIALIZE_ARGS *args = (CK_C_INITIALIZE_ARGS *)init_args;
         if(args->pReserved) {
             return CKR_ARGUMENTS_BAD;
         }
 
+        os_locking_ok = !!(args->flags & CKF_OS_LOCKING_OK);
+
+        /* threads of our own need the native OS primitives */
+        can_create_threads = (args->flags & CKF_OS_LOCKING_OK)
+                && !(args->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS);
+
         /*
          * If their is CKF_OS_LOCKING_OK flag:
          * 1. No function pointers, Use native OS support (default in mutex.h).
@@ -239,6 +259,8 @@ CK_RV general_init(void *init_args) {
      *
      * THESE MUST GO AFTER MUTEX INIT above!!
      */
+    _g_os_locking_ok = os_locking_ok;
+
     rv = backend_init();
     if (rv != CKR_OK) {
         goto err;
@@ -250,6 +272,9 @@ CK_RV general_init(void *init_args) {
         goto err;
     }
 
+    stats_init();
+
+    _g_can_create_threads = can_create_threads;
     _g_is_init = true;
 
     return CKR_OK;
@@ -265,8 +290,11 @@ CK_RV general_finalize(void *reserved) {
 
     _g_is_init = false;
 
+    /* joins the threads of the tokens */
     slot_destroy();
     backend_destroy();
 
+    stats_finalize();
+
     return CKR_OK;
 }
@@ -24,6 +24,23 @@ CK_RV general_get_func_list(CK_FUNCTION_LIST **function_list);
 CK_RV general_get_info(CK_INFO *info);
 bool general_is_init(void);
 
+/**
+ * Whether the application allows the library to create threads, that is
+ * C_Initialize was called with CKF_OS_LOCKING_OK and without
+ * CKF_LIBRARY_CANT_CREATE_OS_THREADS.
+ * @return
+ *  true if the library may create threads.
+ */
+bool general_can_create_threads(void);
+
+/**
+ * Whether the application allows the library to use the native OS locking
+ * primitives, that is C_Initialize was called with CKF_OS_LOCKING_OK.
+ * @return
+ *  true if the library may use OS locking.
+ */
+bool general_os_locking_ok(void);
+
 CK_RV general_finalize(void *reserved);
 
 #endif /* SRC_GENERAL_H_ */
@@ -7,6 +7,7 @@
 #include "backend.h"
 #include "checks.h"
 #include "key.h"
+#include "keypool.h"
 #include "list.h"
 #include "pkcs11.h"
 #include "session.h"
@@ -232,30 +233,41 @@ CK_RV key_gen (
         goto out;
     }
 
-    rv = utils_new_random_object_auth(&newauthhex);
+    rv = token_auth_session_load(tok);
     if (rv != CKR_OK) {
-        LOGE("Failed to create new object auth");
         goto out;
     }
 
-    rv = utils_ctx_wrap_objauth(tok->wrappingkey, newauthhex, &newwrapped_auth);
-    if (rv != CKR_OK) {
-        LOGE("Failed to wrap new object auth");
-        goto out;
-    }
-
-    rv = tpm2_generate_key(
-            tok->tctx,
-            tok->pobject.handle,
-            tok->pobject.objauth,
-            newauthhex,
-            mechanism,
-            pubkey_templ_w_types,
-            privkey_templ_w_types,
-            &objdata);
-    if (rv != CKR_OK) {
-        LOGE("Failed to generate key");
-        goto out;
+    /* a key created ahead of time saves the wait for the TPM */
+    bool claimed = keypool_claim(tok, mechanism,
+            pubkey_templ_w_types, privkey_templ_w_types,
+            &newauthhex, &newwrapped_auth, &objdata);
+    if (!claimed) {
+        rv = utils_new_random_object_auth(&newauthhex);
+        if (rv != CKR_OK) {
+            LOGE("Failed to create new object auth");
+            goto out;
+        }
+
+        rv = utils_ctx_wrap_objauth(tok->wrappingkey, newauthhex, &newwrapped_auth);
+        if (rv != CKR_OK) {
+            LOGE("Failed to wrap new object auth");
+            goto out;
+        }
+
+        rv = tpm2_generate_key(
+                tok->tctx,
+                tok->pobject.handle,
+                tok->pobject.objauth,
+                newauthhex,
+                mechanism,
+                pubkey_templ_w_types,
+                privkey_templ_w_types,
+                &objdata);
+        if (rv != CKR_OK) {
+            LOGE("Failed to generate key");
+            goto out;
+        }
     }
 
     /* set the tpm object handles */
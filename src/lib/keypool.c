@@ -0,0 +1,861 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/crypto.h>
+#include <openssl/objects.h>
+
+#include "backend.h"
+#include "general.h"
+#include "keypool.h"
+#include "log.h"
+#include "utils.h"
+
+/*
+ * The worker only creates a key once the token has not been used for
+ * TPM2_PKCS11_KEYPOOL_IDLE_MS, so it stays out of the way of the TPM
+ * commands of the application.
+ */
+#define KEYPOOL_IDLE_ENV "TPM2_PKCS11_KEYPOOL_IDLE_MS"
+#define KEYPOOL_IDLE_DEFAULT_MS 1000
+
+/* how often the worker looks at a pool that needs no keys, a claim wakes it earlier */
+#define KEYPOOL_RECHECK_MS (30 * 1000)
+
+typedef struct keypool_entry keypool_entry;
+struct keypool_entry {
+    keypool_kind kind;
+    twist template;     /* the marshalled TPM2B_PUBLIC keys of the kind are created from */
+    bool filling;       /* the pool went down to low and has not reached high since */
+};
+
+struct keypool {
+    token *tok;
+
+    size_t len;
+    keypool_entry entries[KEYPOOL_MAX_KINDS];
+
+    unsigned idle_ms;
+    uint64_t last_use_ms; /* atomic, see keypool_touch() */
+
+    /* protects everything below */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool has_thread;
+    pthread_t thread;
+    bool quit;
+    /* the worker's copies, NULL while no user is logged in */
+    twist wrappingkey;
+    char *tcti;
+    twist objauth;
+    pobject_config pconfig;
+};
+
+/*
+ * The TPM state of the worker, separate from the token's. It owns copies of
+ * what it needs of the token, so it never reads the token's primary object,
+ * which C_InitToken may free under it.
+ */
+typedef struct keypool_tpm keypool_tpm;
+struct keypool_tpm {
+    tpm_ctx *tctx;
+    uint32_t primary;
+    bool flush_primary;
+    char *tcti;
+    twist objauth;
+    pobject_config pconfig;
+};
+
+static const struct {
+    const char *name;
+    CK_MECHANISM_TYPE mech;
+    CK_ULONG bits;
+    int nid;
+} keypool_algs[] = {
+    { "rsa1024", CKM_RSA_PKCS_KEY_PAIR_GEN, 1024, 0 },
+    { "rsa2048", CKM_RSA_PKCS_KEY_PAIR_GEN, 2048, 0 },
+    { "p192",    CKM_EC_KEY_PAIR_GEN, 0, NID_X9_62_prime192v1 },
+    { "p224",    CKM_EC_KEY_PAIR_GEN, 0, NID_secp224r1 },
+    { "p256",    CKM_EC_KEY_PAIR_GEN, 0, NID_X9_62_prime256v1 },
+    { "p384",    CKM_EC_KEY_PAIR_GEN, 0, NID_secp384r1 },
+    { "p521",    CKM_EC_KEY_PAIR_GEN, 0, NID_secp521r1 },
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static bool parse_count(const char *str, unsigned *count) {
+
+    if (!str[0]) {
+        return false;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long val = strtoul(str, &end, 10);
+    if (errno || *end || val > KEYPOOL_MAX_KEYS) {
+        return false;
+    }
+
+    *count = val;
+    return true;
+}
+
+static bool parse_usage(const char *str, unsigned *usage) {
+
+    if (!strcmp(str, "sign")) {
+        *usage = keypool_usage_sign;
+    } else if (!strcmp(str, "decrypt")) {
+        *usage = keypool_usage_decrypt;
+    } else if (!strcmp(str, "sign+decrypt")) {
+        *usage = keypool_usage_sign | keypool_usage_decrypt;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static bool parse_kind(char *str, keypool_kind *kind) {
+
+    memset(kind, 0, sizeof(*kind));
+
+    char *low = strchr(str, ':');
+    char *high = low ? strchr(low + 1, ':') : NULL;
+    if (!high || strchr(high + 1, ':')) {
+        LOGE("Expected alg[/usage]:low:high, got: \"%s\"", str);
+        return false;
+    }
+
+    char *alg = str;
+    *low++ = '\0';
+    *high++ = '\0';
+
+    char *usage = strchr(alg, '/');
+    if (usage) {
+        *usage++ = '\0';
+        if (!parse_usage(usage, &kind->usage)) {
+            LOGE("Unknown key pool usage, got: \"%s\"", usage);
+            return false;
+        }
+    }
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(keypool_algs); i++) {
+        if (!strcmp(alg, keypool_algs[i].name)) {
+            kind->mech = keypool_algs[i].mech;
+            kind->bits = keypool_algs[i].bits;
+            kind->nid = keypool_algs[i].nid;
+            break;
+        }
+    }
+
+    if (i == ARRAY_LEN(keypool_algs)) {
+        LOGE("Unknown key pool alg, got: \"%s\"", alg);
+        return false;
+    }
+
+    if (!parse_count(low, &kind->low) || !parse_count(high, &kind->high)) {
+        LOGE("Key pool watermarks must be integers up to %u, got: \"%s\" and \"%s\"",
+                KEYPOOL_MAX_KEYS, low, high);
+        return false;
+    }
+
+    if (!kind->high || kind->low > kind->high) {
+        LOGE("Key pool watermarks must be low <= high and high > 0, got: %u and %u",
+                kind->low, kind->high);
+        return false;
+    }
+
+    return true;
+}
+
+bool keypool_spec_parse(const char *str, keypool_spec *spec) {
+
+    memset(spec, 0, sizeof(*spec));
+
+    char *copy = strdup(str);
+    if (!copy) {
+        LOGE("oom");
+        return false;
+    }
+
+    bool result = false;
+
+    char *saveptr = NULL;
+    char *entry;
+    for (entry = strtok_r(copy, ",", &saveptr); entry;
+            entry = strtok_r(NULL, ",", &saveptr)) {
+
+        while (*entry == ' ') {
+            entry++;
+        }
+
+        if (spec->len == ARRAY_LEN(spec->kinds)) {
+            LOGE("A key pool can have at most %zu kinds", ARRAY_LEN(spec->kinds));
+            goto out;
+        }
+
+        keypool_kind *kind = &spec->kinds[spec->len];
+        if (!parse_kind(entry, kind)) {
+            goto out;
+        }
+
+        size_t i;
+        for (i = 0; i < spec->len; i++) {
+            keypool_kind *other = &spec->kinds[i];
+            if (other->mech == kind->mech && other->bits == kind->bits
+                    && other->nid == kind->nid && other->usage == kind->usage) {
+                LOGE("Key pool kind listed twice, got: \"%s\"", str);
+                goto out;
+            }
+        }
+
+        spec->len++;
+    }
+
+    if (!spec->len) {
+        LOGE("Empty key pool config");
+        goto out;
+    }
+
+    result = true;
+
+out:
+    free(copy);
+    return result;
+}
+
+/*
+ * Builds the template of a kind from the same attributes an application
+ * would pass to C_GenerateKeyPair, so requests for that kind of key match.
+ */
+static CK_RV kind_template(keypool_kind *kind, twist *template) {
+
+    CK_RV rv = CKR_HOST_MEMORY;
+
+    unsigned char *params = NULL;
+
+    attr_list *pubattrs = attr_list_new();
+    attr_list *privattrs = attr_list_new();
+    if (!pubattrs || !privattrs) {
+        LOGE("oom");
+        goto out;
+    }
+
+    bool r;
+    if (kind->mech == CKM_RSA_PKCS_KEY_PAIR_GEN) {
+        r = attr_list_add_int(pubattrs, CKA_MODULUS_BITS, kind->bits);
+    } else {
+        ASN1_OBJECT *obj = OBJ_nid2obj(kind->nid);
+        int len = obj ? i2d_ASN1_OBJECT(obj, &params) : -1;
+        if (len <= 0) {
+            LOGE("Could not encode the EC params of nid %d", kind->nid);
+            rv = CKR_GENERAL_ERROR;
+            goto out;
+        }
+        r = attr_list_add_buf(pubattrs, CKA_EC_PARAMS, params, len);
+    }
+
+    if (r && kind->usage) {
+        r = attr_list_add_bool(privattrs, CKA_SIGN,
+                !!(kind->usage & keypool_usage_sign))
+            && attr_list_add_bool(privattrs, CKA_DECRYPT,
+                !!(kind->usage & keypool_usage_decrypt));
+    }
+
+    if (!r) {
+        LOGE("oom");
+        goto out;
+    }
+
+    CK_MECHANISM mechanism = { .mechanism = kind->mech };
+    rv = tpm2_keygen_template(&mechanism, pubattrs, privattrs, template);
+
+out:
+    OPENSSL_free(params);
+    attr_list_free(pubattrs);
+    attr_list_free(privattrs);
+    return rv;
+}
+
+static unsigned keypool_idle_ms(void) {
+
+    const char *env = getenv(KEYPOOL_IDLE_ENV);
+    if (!env) {
+        return KEYPOOL_IDLE_DEFAULT_MS;
+    }
+
+    size_t val = 0;
+    int rc = str_to_ul(env, &val);
+    if (rc || val > UINT_MAX) {
+        LOGW("Invalid %s \"%s\", using %u", KEYPOOL_IDLE_ENV, env,
+                KEYPOOL_IDLE_DEFAULT_MS);
+        return KEYPOOL_IDLE_DEFAULT_MS;
+    }
+
+    return (unsigned)val;
+}
+
+static CK_RV keypool_new(token *tok, keypool **pool) {
+
+    keypool_spec spec;
+    if (!keypool_spec_parse(tok->config.key_pool, &spec)) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    keypool *kp = calloc(1, sizeof(*kp));
+    if (!kp) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    size_t i;
+    for (i = 0; i < spec.len; i++) {
+        keypool_entry *e = &kp->entries[i];
+        e->kind = spec.kinds[i];
+        rv = kind_template(&e->kind, &e->template);
+        if (rv != CKR_OK) {
+            goto error;
+        }
+        kp->len++;
+    }
+
+    pthread_condattr_t attr;
+    int rc = pthread_condattr_init(&attr);
+    if (rc) {
+        LOGE("pthread_condattr_init: %s", strerror(rc));
+        rv = CKR_GENERAL_ERROR;
+        goto error;
+    }
+
+    /* waits are measured against the same clock as the idle time */
+    rc = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (!rc) {
+        rc = pthread_cond_init(&kp->cond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+    if (rc) {
+        LOGE("pthread_cond_init: %s", strerror(rc));
+        rv = CKR_GENERAL_ERROR;
+        goto error;
+    }
+
+    rc = pthread_mutex_init(&kp->lock, NULL);
+    if (rc) {
+        LOGE("pthread_mutex_init: %s", strerror(rc));
+        pthread_cond_destroy(&kp->cond);
+        rv = CKR_GENERAL_ERROR;
+        goto error;
+    }
+
+    kp->tok = tok;
+    kp->idle_ms = keypool_idle_ms();
+    kp->last_use_ms = now_ms();
+
+    *pool = kp;
+
+    return CKR_OK;
+
+error:
+    for (i = 0; i < kp->len; i++) {
+        twist_free(kp->entries[i].template);
+    }
+    free(kp);
+    return rv;
+}
+
+static void pconfig_free(pobject_config *config) {
+
+    if (config->is_transient) {
+        free(config->template_name);
+    } else {
+        twist_free(config->blob);
+    }
+    memset(config, 0, sizeof(*config));
+}
+
+static CK_RV pconfig_dup(const pobject_config *src, pobject_config *dst) {
+
+    dst->is_transient = src->is_transient;
+    if (src->is_transient) {
+        dst->template_name = src->template_name ? strdup(src->template_name) : NULL;
+        if (src->template_name && !dst->template_name) {
+            LOGE("oom");
+            return CKR_HOST_MEMORY;
+        }
+    } else {
+        dst->blob = twist_dup(src->blob);
+        if (src->blob && !dst->blob) {
+            LOGE("oom");
+            return CKR_HOST_MEMORY;
+        }
+    }
+
+    return CKR_OK;
+}
+
+/* drops the copies of the token state, must hold kp->lock */
+static void keypool_clear(keypool *kp) {
+
+    if (kp->wrappingkey) {
+        OPENSSL_cleanse((void *)kp->wrappingkey, twist_len(kp->wrappingkey));
+        twist_free(kp->wrappingkey);
+        kp->wrappingkey = NULL;
+    }
+
+    if (kp->objauth) {
+        OPENSSL_cleanse((void *)kp->objauth, twist_len(kp->objauth));
+        twist_free(kp->objauth);
+        kp->objauth = NULL;
+    }
+
+    free(kp->tcti);
+    kp->tcti = NULL;
+
+    pconfig_free(&kp->pconfig);
+}
+
+static void worker_tpm_close(keypool_tpm *kt) {
+
+    if (kt->tctx) {
+        if (tpm_session_active(kt->tctx)) {
+            tpm_session_stop(kt->tctx);
+        }
+
+        if (kt->flush_primary) {
+            tpm_flushcontext(kt->tctx, kt->primary);
+        }
+
+        tpm_ctx_free(kt->tctx);
+    }
+
+    if (kt->objauth) {
+        OPENSSL_cleanse((void *)kt->objauth, twist_len(kt->objauth));
+        twist_free(kt->objauth);
+    }
+    free(kt->tcti);
+    pconfig_free(&kt->pconfig);
+
+    memset(kt, 0, sizeof(*kt));
+}
+
+/*
+ * Brings up a transient primary from the context the token saved, as
+ * token_pobject_load() does, and only creates it when that is stale.
+ */
+static CK_RV worker_primary_transient(keypool *kp, keypool_tpm *kt) {
+
+    uint32_t reset_count = 0;
+    uint32_t saved_count = 0;
+    twist context = NULL;
+
+    CK_RV rv = tpm_get_reset_count(kt->tctx, &reset_count);
+    if (rv == CKR_OK) {
+        rv = backend_get_pobject_context(kp->tok, &saved_count, &context);
+    }
+
+    if (rv == CKR_OK && context && saved_count == reset_count) {
+        rv = tpm_load_transient_primary_context(kt->tctx,
+                kt->pconfig.template_name, kt->objauth, context, &kt->primary);
+        twist_free(context);
+        if (rv == CKR_OK) {
+            return CKR_OK;
+        }
+        LOGV("Key pool could not load the saved primary context, creating the primary");
+    } else {
+        twist_free(context);
+    }
+
+    return tpm_create_transient_primary_from_template(kt->tctx,
+            kt->pconfig.template_name, kt->objauth, &kt->primary);
+}
+
+static CK_RV worker_tpm_open(keypool *kp, keypool_tpm *kt) {
+
+    /* the copies are only replaced under the lock, see keypool_start() */
+    pthread_mutex_lock(&kp->lock);
+
+    CK_RV rv = CKR_USER_NOT_LOGGED_IN;
+    if (kp->wrappingkey) {
+        rv = CKR_HOST_MEMORY;
+        kt->tcti = kp->tcti ? strdup(kp->tcti) : NULL;
+        kt->objauth = twist_dup(kp->objauth);
+        if ((!kp->tcti || kt->tcti) && (!kp->objauth || kt->objauth)) {
+            rv = pconfig_dup(&kp->pconfig, &kt->pconfig);
+        }
+    }
+
+    pthread_mutex_unlock(&kp->lock);
+
+    if (rv == CKR_OK) {
+        rv = tpm_ctx_new(kt->tcti, &kt->tctx);
+    }
+
+    if (rv == CKR_OK) {
+        if (kt->pconfig.is_transient) {
+            rv = worker_primary_transient(kp, kt);
+            kt->flush_primary = rv == CKR_OK;
+        } else {
+            bool res = tpm_deserialize_handle(kt->tctx, kt->pconfig.blob,
+                    &kt->primary, NULL);
+            rv = res ? CKR_OK : CKR_GENERAL_ERROR;
+        }
+    }
+
+    if (rv == CKR_OK) {
+        rv = tpm_session_start(kt->tctx, kt->objauth, kt->primary);
+    }
+
+    if (rv != CKR_OK) {
+        worker_tpm_close(kt);
+    }
+
+    return rv;
+}
+
+/*
+ * Finds a kind that needs keys. A kind starts filling once it is down to
+ * its low watermark and keeps filling until it reaches the high one.
+ */
+static keypool_entry *worker_next(keypool *kp) {
+
+    size_t i;
+    for (i = 0; i < kp->len; i++) {
+        keypool_entry *e = &kp->entries[i];
+
+        unsigned count = 0;
+        CK_RV rv = backend_keypool_count(kp->tok, e->template, &count);
+        if (rv != CKR_OK) {
+            LOGW("Could not count the pooled keys of token %u: 0x%lx",
+                    kp->tok->id, rv);
+            return NULL;
+        }
+
+        if (count <= e->kind.low) {
+            e->filling = true;
+        }
+
+        if (count >= e->kind.high) {
+            e->filling = false;
+        }
+
+        if (e->filling) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+static CK_RV worker_fill(keypool *kp, keypool_tpm *kt, keypool_entry *e) {
+
+    twist authhex = NULL;
+    twist wrapped = NULL;
+    twist pubblob = NULL;
+    twist privblob = NULL;
+
+    CK_RV rv = utils_new_random_object_auth(&authhex);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
+    /* the user may have logged out since the worker woke up */
+    pthread_mutex_lock(&kp->lock);
+    rv = kp->wrappingkey ?
+            utils_ctx_wrap_objauth(kp->wrappingkey, authhex, &wrapped) :
+            CKR_USER_NOT_LOGGED_IN;
+    pthread_mutex_unlock(&kp->lock);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
+    rv = tpm2_create_key(kt->tctx, kt->primary, kt->objauth,
+            authhex, e->template, &pubblob, &privblob);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
+    rv = backend_keypool_add(kp->tok, e->template, pubblob, privblob, wrapped);
+
+out:
+    twist_free(authhex);
+    twist_free(wrapped);
+    twist_free(pubblob);
+    twist_free(privblob);
+
+    return rv;
+}
+
+/* must hold kp->lock */
+static void worker_wait(keypool *kp, uint64_t ms) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    UNUSED(pthread_cond_timedwait(&kp->cond, &kp->lock, &ts));
+}
+
+static void *worker(void *arg) {
+
+    keypool *kp = (keypool *)arg;
+
+    keypool_tpm kt = { 0 };
+
+    pthread_mutex_lock(&kp->lock);
+
+    while (!kp->quit) {
+
+        if (!kp->wrappingkey) {
+            pthread_cond_wait(&kp->cond, &kp->lock);
+            continue;
+        }
+
+        uint64_t idle = now_ms() - __atomic_load_n(&kp->last_use_ms, __ATOMIC_RELAXED);
+        if (idle < kp->idle_ms) {
+            worker_wait(kp, kp->idle_ms - idle);
+            continue;
+        }
+
+        pthread_mutex_unlock(&kp->lock);
+
+        CK_RV rv = CKR_OK;
+        keypool_entry *e = worker_next(kp);
+        if (e) {
+            if (!kt.tctx) {
+                rv = worker_tpm_open(kp, &kt);
+            }
+            if (rv == CKR_OK) {
+                rv = worker_fill(kp, &kt, e);
+            }
+        }
+
+        pthread_mutex_lock(&kp->lock);
+
+        if (rv != CKR_OK && rv != CKR_USER_NOT_LOGGED_IN) {
+            LOGW("Could not add a key to the pool of token %u: 0x%lx",
+                    kp->tok->id, rv);
+            /* start over with a fresh TPM context on the next try */
+            worker_tpm_close(&kt);
+        }
+
+        if (kp->quit) {
+            break;
+        }
+
+        if (!e || rv != CKR_OK) {
+            worker_wait(kp, KEYPOOL_RECHECK_MS);
+        }
+    }
+
+    pthread_mutex_unlock(&kp->lock);
+
+    worker_tpm_close(&kt);
+
+    return NULL;
+}
+
+void keypool_start(token *tok) {
+
+    if (!tok->config.key_pool
+            || tok->type != token_type_esysdb
+            || tok->read_only) {
+        return;
+    }
+
+    if (!tok->keypool) {
+        CK_RV rv = keypool_new(tok, &tok->keypool);
+        if (rv != CKR_OK) {
+            LOGW("Could not set up the key pool of token %u: 0x%lx", tok->id, rv);
+            return;
+        }
+    }
+
+    /* without threads the pool is only consumed, other processes may fill it */
+    if (!general_can_create_threads()) {
+        return;
+    }
+
+    keypool *kp = tok->keypool;
+
+    /*
+     * The caller holds the token lock, the worker gets what it needs of the
+     * token here and does not look at the token itself.
+     */
+    pthread_mutex_lock(&kp->lock);
+
+    assert(!kp->wrappingkey);
+    kp->wrappingkey = twist_dup(tok->wrappingkey);
+    kp->objauth = twist_dup(tok->pobject.objauth);
+    kp->tcti = tok->config.tcti ? strdup(tok->config.tcti) : NULL;
+    if (!kp->wrappingkey
+            || (tok->pobject.objauth && !kp->objauth)
+            || (tok->config.tcti && !kp->tcti)
+            || pconfig_dup(&tok->pobject.config, &kp->pconfig) != CKR_OK) {
+        LOGW("oom");
+        keypool_clear(kp);
+        goto out;
+    }
+
+    if (!kp->has_thread) {
+        int rc = pthread_create(&kp->thread, NULL, worker, kp);
+        if (rc) {
+            LOGW("Could not start the key pool worker of token %u: %s",
+                    tok->id, strerror(rc));
+            keypool_clear(kp);
+            goto out;
+        }
+        kp->has_thread = true;
+    }
+
+    pthread_cond_signal(&kp->cond);
+
+out:
+    pthread_mutex_unlock(&kp->lock);
+}
+
+void keypool_stop(token *tok) {
+
+    keypool *kp = tok->keypool;
+    if (!kp) {
+        return;
+    }
+
+    pthread_mutex_lock(&kp->lock);
+    keypool_clear(kp);
+    pthread_mutex_unlock(&kp->lock);
+}
+
+void keypool_free(keypool *kp) {
+
+    if (!kp) {
+        return;
+    }
+
+    pthread_mutex_lock(&kp->lock);
+    kp->quit = true;
+    pthread_cond_signal(&kp->cond);
+    pthread_mutex_unlock(&kp->lock);
+
+    /* waits for a key being created to finish */
+    if (kp->has_thread) {
+        pthread_join(kp->thread, NULL);
+    }
+
+    keypool_clear(kp);
+
+    size_t i;
+    for (i = 0; i < kp->len; i++) {
+        twist_free(kp->entries[i].template);
+    }
+
+    pthread_cond_destroy(&kp->cond);
+    pthread_mutex_destroy(&kp->lock);
+
+    free(kp);
+}
+
+void keypool_touch(keypool *kp) {
+    __atomic_store_n(&kp->last_use_ms, now_ms(), __ATOMIC_RELAXED);
+}
+
+bool keypool_claim(token *tok, CK_MECHANISM_PTR mechanism,
+        attr_list *pubattrs, attr_list *privattrs,
+        twist *authhex, twist *wrapped_auth, tpm_object_data *objdata) {
+
+    keypool *kp = tok->keypool;
+    if (!kp || !tok->wrappingkey) {
+        return false;
+    }
+
+    bool claimed = false;
+
+    twist template = NULL;
+    twist pubblob = NULL;
+    twist privblob = NULL;
+    twist wrapped = NULL;
+    twist unwrapped = NULL;
+
+    /* a template the handlers reject is reported by the keygen path */
+    CK_RV rv = tpm2_keygen_template(mechanism, pubattrs, privattrs, &template);
+    if (rv != CKR_OK) {
+        return false;
+    }
+
+    size_t i;
+    for (i = 0; i < kp->len; i++) {
+        if (twist_eq(kp->entries[i].template, template)) {
+            break;
+        }
+    }
+
+    if (i == kp->len) {
+        goto out;
+    }
+
+    rv = backend_keypool_claim(tok, template, &pubblob, &privblob, &wrapped);
+
+    /* the claim is use of the token and the pool may need a refill */
+    keypool_touch(kp);
+    pthread_mutex_lock(&kp->lock);
+    pthread_cond_signal(&kp->cond);
+    pthread_mutex_unlock(&kp->lock);
+
+    if (rv != CKR_OK) {
+        LOGW("Could not claim a pooled key: 0x%lx", rv);
+        goto out;
+    }
+
+    if (!pubblob) {
+        LOGV("Key pool of token %u is empty", tok->id);
+        goto out;
+    }
+
+    rv = utils_ctx_unwrap_objauth(tok->wrappingkey, wrapped, &unwrapped);
+    if (rv != CKR_OK) {
+        LOGW("Could not unwrap the auth of a pooled key: 0x%lx", rv);
+        goto out;
+    }
+
+    rv = tpm2_load_key(tok->tctx, tok->pobject.handle, tok->pobject.objauth,
+            mechanism->mechanism, pubblob, privblob, objdata);
+    if (rv != CKR_OK) {
+        LOGW("Could not load a pooled key: 0x%lx", rv);
+        goto out;
+    }
+
+    *authhex = unwrapped;
+    *wrapped_auth = wrapped;
+    unwrapped = wrapped = NULL;
+
+    claimed = true;
+
+out:
+    twist_free(template);
+    twist_free(pubblob);
+    twist_free(privblob);
+    twist_free(wrapped);
+    twist_free(unwrapped);
+
+    return claimed;
+}
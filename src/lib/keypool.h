@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_KEYPOOL_H_
+#define SRC_LIB_KEYPOOL_H_
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "attrs.h"
+#include "pkcs11.h"
+#include "token.h"
+#include "tpm.h"
+#include "twist.h"
+
+/* the most key kinds a key-pool config can list */
+#define KEYPOOL_MAX_KINDS 8
+
+/* the most keys of one kind a pool keeps */
+#define KEYPOOL_MAX_KEYS 1024
+
+typedef enum keypool_usage keypool_usage;
+enum keypool_usage {
+    keypool_usage_default = 0,  /* the usage of the keygen template */
+    keypool_usage_sign    = 1 << 0,
+    keypool_usage_decrypt = 1 << 1,
+};
+
+typedef struct keypool_kind keypool_kind;
+struct keypool_kind {
+    CK_MECHANISM_TYPE mech; /* CKM_RSA_PKCS_KEY_PAIR_GEN or CKM_EC_KEY_PAIR_GEN */
+    CK_ULONG bits;          /* modulus bits of RSA keys */
+    int nid;                /* curve of EC keys */
+    unsigned usage;         /* keypool_usage flags */
+    unsigned low;           /* refill once the pool is down to this many keys */
+    unsigned high;          /* stop refilling at this many keys */
+};
+
+typedef struct keypool_spec keypool_spec;
+struct keypool_spec {
+    size_t len;
+    keypool_kind kinds[KEYPOOL_MAX_KINDS];
+};
+
+/**
+ * Parses the key-pool token config value. It is a comma separated list of
+ * alg[/usage]:low:high entries, where alg is one of rsa1024, rsa2048, p192,
+ * p224, p256, p384 or p521 and usage is one of sign, decrypt or
+ * sign+decrypt, eg "rsa2048:2:8,p256/sign:4:16".
+ * @param str
+ *  The config value.
+ * @param spec
+ *  The parsed kinds.
+ * @return
+ *  true on success, false if str is not a valid key-pool config.
+ */
+bool keypool_spec_parse(const char *str, keypool_spec *spec);
+
+/**
+ * Sets up the key pool of a token with a key-pool config and starts the
+ * worker filling it, if the library may create threads. Called when the
+ * user logs in, the worker needs the wrapping key to protect the key auths.
+ * The worker gets copies of the token state it uses, the caller must hold
+ * the token lock. Failures are logged and leave the pool unfilled, the login
+ * goes ahead.
+ * @param tok
+ *  The token the user logged in to.
+ */
+void keypool_start(token *tok);
+
+/**
+ * Pauses the worker of a token's key pool and drops its copy of the
+ * wrapping key. Called when the user logs out, does not wait for a key
+ * being created.
+ * @param tok
+ *  The token the user logged out of.
+ */
+void keypool_stop(token *tok);
+
+/**
+ * Stops the worker, waiting for it to exit, and frees a key pool.
+ * @param kp
+ *  The key pool to free, may be NULL.
+ */
+void keypool_free(keypool *kp);
+
+/**
+ * Records that the token is in use, the worker only creates keys after
+ * the token has been idle for a while.
+ * @param kp
+ *  The key pool of the token.
+ */
+void keypool_touch(keypool *kp);
+
+/**
+ * Takes a key matching a keygen request out of the pool and loads it.
+ * @param tok
+ *  The token to generate the key on, the user must be logged in.
+ * @param mechanism
+ *  The key generation mechanism.
+ * @param pubattrs
+ *  The public template attributes.
+ * @param privattrs
+ *  The private template attributes.
+ * @param authhex
+ *  The auth value of the key.
+ * @param wrapped_auth
+ *  The wrapped auth value of the key.
+ * @param objdata
+ *  The object data, as tpm2_generate_key() returns it.
+ * @return
+ *  true if a key was claimed, false if the request has to be served by
+ *  generating a key.
+ */
+bool keypool_claim(token *tok, CK_MECHANISM_PTR mechanism,
+        attr_list *pubattrs, attr_list *privattrs,
+        twist *authhex, twist *wrapped_auth, tpm_object_data *objdata);
+
+#endif /* SRC_LIB_KEYPOOL_H_ */
@@ -0,0 +1,261 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "log.h"
+#include "login_cache.h"
+#include "utils.h"
+
+#if defined(__linux__)
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(SYS_add_key) && defined(SYS_keyctl)
+#define HAVE_KEYRING 1
+#endif
+
+/*
+ * Anyone who can read the entry can try PINs against it without the TPM's
+ * dictionary attack protection. The key is derived with the scrypt cost of
+ * the token's pin-kdf, so guessing is no cheaper here than against the
+ * stored auth values. Each entry starts with the cost it was made with,
+ * ln, r and p a byte each, then the salt.
+ */
+#define LOGIN_CACHE_KDF_SIZE 3
+
+#define LOGIN_CACHE_SALT_SIZE 16
+
+#define LOGIN_CACHE_HDR_SIZE (LOGIN_CACHE_KDF_SIZE + LOGIN_CACHE_SALT_SIZE)
+
+/* entries are small, the encrypted key and the header */
+#define LOGIN_CACHE_MAX_ENTRY 512
+
+#define LOGIN_CACHE_DESC_PREFIX "tpm2_pkcs11:login:"
+
+typedef char login_cache_desc[sizeof(LOGIN_CACHE_DESC_PREFIX) + 2 * 16];
+
+static bool desc_from_id(twist id, login_cache_desc desc) {
+
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    if (!EVP_Digest(id, twist_len(id), md, NULL, EVP_sha256(), NULL)) {
+        LOGE("EVP_Digest failed");
+        return false;
+    }
+
+    /* the first 16 bytes are plenty to tell tokens apart */
+    size_t off = snprintf(desc, sizeof(login_cache_desc), "%s",
+            LOGIN_CACHE_DESC_PREFIX);
+    size_t i;
+    for (i = 0; i < 16; i++) {
+        off += snprintf(&desc[off], sizeof(login_cache_desc) - off,
+                "%02x", md[i]);
+    }
+
+    return true;
+}
+
+static twist kdf(twist pin, const pin_kdf *k, const unsigned char *salt) {
+
+    twist key = twist_calloc(32);
+    if (!key) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    bool res = utils_pin_kdf_derive(k, pin, salt, LOGIN_CACHE_SALT_SIZE,
+            (unsigned char *)key, 32);
+    if (!res) {
+        twist_free(key);
+        return NULL;
+    }
+
+    return key;
+}
+
+static void key_free(twist key) {
+    if (key) {
+        OPENSSL_cleanse((void *)key, twist_len(key));
+        twist_free(key);
+    }
+}
+
+#ifdef HAVE_KEYRING
+
+/* key permissions, see keyctl_setperm(3) */
+#define LOGIN_CACHE_KEY_POS_ALL 0x3f000000
+#define LOGIN_CACHE_KEY_USR_VIEW 0x00010000
+
+static long keyring_search(const char *desc) {
+    return syscall(SYS_keyctl, KEYCTL_SEARCH, KEY_SPEC_SESSION_KEYRING,
+            "user", desc, 0);
+}
+
+bool login_cache_get(twist id, twist pin, twist *wrappingkey) {
+
+    *wrappingkey = NULL;
+
+    login_cache_desc desc;
+    if (!desc_from_id(id, desc)) {
+        return false;
+    }
+
+    long serial = keyring_search(desc);
+    if (serial < 0) {
+        LOGV("No cached login: %s", strerror(errno));
+        return false;
+    }
+
+    unsigned char entry[LOGIN_CACHE_MAX_ENTRY];
+    long len = syscall(SYS_keyctl, KEYCTL_READ, serial, entry, sizeof(entry));
+    if (len < 0 || (size_t)len > sizeof(entry)
+            || len <= LOGIN_CACHE_HDR_SIZE) {
+        LOGW("Could not read cached login");
+        return false;
+    }
+
+    bool hit = false;
+    twist key = NULL;
+    twist sealed = twistbin_new(&entry[LOGIN_CACHE_HDR_SIZE],
+            len - LOGIN_CACHE_HDR_SIZE);
+    if (!sealed) {
+        LOGE("oom");
+        goto out;
+    }
+
+    pin_kdf k = {
+        .alg = pin_kdf_scrypt,
+        .ln = entry[0],
+        .r = entry[1],
+        .p = entry[2],
+    };
+
+    key = kdf(pin, &k, &entry[LOGIN_CACHE_KDF_SIZE]);
+    if (!key) {
+        goto out;
+    }
+
+    /* a wrong PIN fails the GCM tag check */
+    *wrappingkey = aes256_gcm_decrypt(key, sealed);
+    hit = *wrappingkey != NULL;
+    if (!hit) {
+        LOGV("Cached login does not match the PIN");
+    }
+
+out:
+    OPENSSL_cleanse(entry, sizeof(entry));
+    twist_free(sealed);
+    key_free(key);
+
+    return hit;
+}
+
+void login_cache_put(twist id, twist pin, const char *pinkdf,
+        twist wrappingkey, unsigned ttl) {
+
+    login_cache_desc desc;
+    if (!desc_from_id(id, desc)) {
+        return;
+    }
+
+    /* a token on the old sha256 KDF still gets the scrypt default */
+    pin_kdf k;
+    if (!utils_pin_kdf_parse(pinkdf, &k)) {
+        return;
+    }
+    k.alg = pin_kdf_scrypt;
+
+    unsigned char hdr[LOGIN_CACHE_HDR_SIZE] = { k.ln, k.r, k.p };
+    if (RAND_bytes(&hdr[LOGIN_CACHE_KDF_SIZE], LOGIN_CACHE_SALT_SIZE) != 1) {
+        LOGE("Could not generate random bytes");
+        return;
+    }
+
+    twist sealed = NULL;
+    twist entry = NULL;
+    twist key = kdf(pin, &k, &hdr[LOGIN_CACHE_KDF_SIZE]);
+    if (!key) {
+        return;
+    }
+
+    sealed = aes256_gcm_encrypt(key, wrappingkey);
+    if (!sealed) {
+        goto out;
+    }
+
+    entry = twistbin_new(hdr, sizeof(hdr));
+    if (!entry) {
+        LOGE("oom");
+        goto out;
+    }
+
+    twist tmp = twist_append_twist(entry, sealed);
+    if (!tmp) {
+        LOGE("oom");
+        goto out;
+    }
+    entry = tmp;
+
+    /* add_key() replaces the payload of an entry of the same description */
+    long serial = syscall(SYS_add_key, "user", desc, entry, twist_len(entry),
+            KEY_SPEC_SESSION_KEYRING);
+    if (serial < 0) {
+        LOGW("Could not cache login in the session keyring: %s",
+                strerror(errno));
+        goto out;
+    }
+
+    /* only processes possessing the session keyring may read it */
+    long rc = syscall(SYS_keyctl, KEYCTL_SETPERM, serial,
+            LOGIN_CACHE_KEY_POS_ALL | LOGIN_CACHE_KEY_USR_VIEW);
+    if (rc == 0) {
+        rc = syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, serial, ttl);
+    }
+
+    if (rc < 0) {
+        LOGW("Could not restrict cached login, dropping it: %s",
+                strerror(errno));
+        syscall(SYS_keyctl, KEYCTL_UNLINK, serial, KEY_SPEC_SESSION_KEYRING);
+    }
+
+out:
+    key_free(key);
+    twist_free(sealed);
+    twist_free(entry);
+}
+
+#else
+
+bool login_cache_get(twist id, twist pin, twist *wrappingkey) {
+    UNUSED(id);
+    UNUSED(pin);
+    UNUSED(desc_from_id);
+    UNUSED(kdf);
+    UNUSED(key_free);
+
+    *wrappingkey = NULL;
+    LOGV("No kernel keyring, login cache disabled");
+    return false;
+}
+
+void login_cache_put(twist id, twist pin, const char *pinkdf,
+        twist wrappingkey, unsigned ttl) {
+    UNUSED(id);
+    UNUSED(pin);
+    UNUSED(pinkdf);
+    UNUSED(wrappingkey);
+    UNUSED(ttl);
+}
+
+#endif
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_LOGIN_CACHE_H_
+#define SRC_LIB_LOGIN_CACHE_H_
+
+#include <stdbool.h>
+
+#include "pkcs11.h"
+#include "twist.h"
+
+/**
+ * Looks up the wrapping key of a token in the session keyring of the
+ * calling process, where login_cache_put() left it. The cached key is
+ * encrypted under a key derived from the PIN with scrypt, so a wrong PIN
+ * is a miss.
+ * @param id
+ *  Bytes that identify the token and its current PIN, eg the public area
+ *  and auth salt of the user seal object. Hashed into the key description.
+ * @param pin
+ *  The PIN of the login.
+ * @param wrappingkey
+ *  The wrapping key on a hit, NULL on a miss.
+ * @return
+ *  true on a hit, false on a miss, including when the keyring is not
+ *  available.
+ */
+bool login_cache_get(twist id, twist pin, twist *wrappingkey);
+
+/**
+ * Caches the wrapping key of a token in the session keyring of the
+ * calling process, replacing an earlier entry of the token. Failures are
+ * logged and otherwise ignored.
+ * @param id
+ *  See login_cache_get().
+ * @param pin
+ *  The PIN the wrapping key was unsealed with.
+ * @param pinkdf
+ *  The pin-kdf config of the token, see utils_pin_kdf_parse(). Its scrypt
+ *  cost, or the default one for "sha256", protects the entry.
+ * @param wrappingkey
+ *  The wrapping key.
+ * @param ttl
+ *  Seconds until the kernel drops the entry.
+ */
+void login_cache_put(twist id, twist pin, const char *pinkdf,
+        twist wrappingkey, unsigned ttl);
+
+#endif /* SRC_LIB_LOGIN_CACHE_H_ */
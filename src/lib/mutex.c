@@ -8,6 +8,7 @@
 #include "log.h"
 #include "mutex.h"
 #include "pkcs11.h"
+#include "probes.h"
 
 /*
  * Default handlers for mutex operations
@@ -159,7 +160,13 @@ CK_RV mutex_lock(void *mutex) {
         return CKR_OK;
     }
 
-    return _g_lock(mutex);
+    PROBE1(lock__attempt, mutex);
+
+    CK_RV rv = _g_lock(mutex);
+
+    PROBE2(lock__acquire, mutex, rv);
+
+    return rv;
 }
 
 CK_RV mutex_unlock(void *mutex) {
@@ -168,5 +175,7 @@ CK_RV mutex_unlock(void *mutex) {
         return CKR_OK;
     }
 
+    PROBE1(lock__release, mutex);
+
     return _g_unlock(mutex);
 }
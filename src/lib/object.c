@@ -54,6 +54,8 @@ void tobject_free(tobject *tobj) {
         tobj->unsealed_auth = NULL;
     }
 
+    EVP_PKEY_free(tobj->pkey);
+
     attr_list *a = tobject_get_attrs(tobj);
     attr_list_free(a);
     free(tobj);
@@ -243,6 +245,46 @@ tobject *object_attr_filter(tobject *tobj, CK_ATTRIBUTE_PTR templ, CK_ULONG coun
     return res ? tobj : NULL;
 }
 
+/*
+ * Like object_attr_filter() for a tobject whose CKA_VALUE is kept in the
+ * store, which is only read when the lengths match.
+ */
+static tobject *object_ext_value_filter(token *tok, tobject *tobj,
+        CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        CK_ATTRIBUTE_PTR search = &templ[i];
+
+        if (search->type != CKA_VALUE) {
+            if (!attr_filter(tobj->attrs, search, 1)) {
+                return NULL;
+            }
+            continue;
+        }
+
+        if (search->ulValueLen != tobj->ext_value_len || !search->pValue) {
+            return NULL;
+        }
+
+        CK_BYTE_PTR value = malloc(tobj->ext_value_len);
+        if (!value) {
+            LOGE("oom");
+            return NULL;
+        }
+
+        CK_RV rv = backend_read_tobject_value(tok, tobj, value, tobj->ext_value_len);
+        bool match = rv == CKR_OK &&
+                !memcmp(value, search->pValue, search->ulValueLen);
+        free(value);
+        if (!match) {
+            return NULL;
+        }
+    }
+
+    return tobj;
+}
+
 
 void object_find_data_free(object_find_data **fd) {
 
@@ -267,6 +309,14 @@ static object_find_data *object_find_data_new(void) {
     return calloc(1, sizeof(object_find_data));
 }
 
+static int id_cmp(const void *a, const void *b) {
+
+    unsigned x = *(const unsigned *)a;
+    unsigned y = *(const unsigned *)b;
+
+    return (x > y) - (x < y);
+}
+
 static CK_RV do_match_set(tobject_match_list *match_cur, tobject *tobj) {
 
     match_cur->tobj_handle = tobj->obj_handle;
@@ -309,11 +359,30 @@ CK_RV object_find_init(session_ctx *ctx, CK_ATTRIBUTE_PTR templ, CK_ULONG count)
     token *tok = session_ctx_get_token(ctx);
     assert(tok);
 
+    /* a failed refresh is not fatal, search what is loaded */
+    rv = backend_refresh_tobjects(tok);
+    if (rv != CKR_OK) {
+        LOGW("Could not refresh objects of token %u from the store", tok->id);
+    }
+
     if (!tok->tobjects.head) {
         LOGV("Token %i contains no objects.", tok->id);
         goto empty;
     }
 
+    /* let the store rule out objects, when it can, before comparing them */
+    unsigned *ids = NULL;
+    size_t ids_len = 0;
+    bool narrowed = false;
+    if (count > 0) {
+        rv = backend_find_tobjects(tok, templ, count, &ids, &ids_len);
+        if (rv == CKR_OK) {
+            narrowed = true;
+        } else if (rv != CKR_FUNCTION_NOT_SUPPORTED) {
+            LOGW("Could not search token %u in the store", tok->id);
+        }
+    }
+
     tobject_match_list *match_cur = NULL;
     list *cur = &tok->tobjects.head->l;
     while(cur) {
@@ -322,7 +391,15 @@ CK_RV object_find_init(session_ctx *ctx, CK_ATTRIBUTE_PTR templ, CK_ULONG count)
         tobject *tobj = list_entry(cur, tobject, l);
         cur = cur->next;
 
-        tobject *match = object_attr_filter(tobj, templ, count);
+        /* objects not in the store yet have no id, always compare them */
+        if (narrowed && tobj->id &&
+                !bsearch(&tobj->id, ids, ids_len, sizeof(*ids), id_cmp)) {
+            continue;
+        }
+
+        tobject *match = tobj->ext_value_len ?
+                object_ext_value_filter(tok, tobj, templ, count) :
+                object_attr_filter(tobj, templ, count);
         if (!match) {
             continue;
         }
@@ -332,6 +409,7 @@ CK_RV object_find_init(session_ctx *ctx, CK_ATTRIBUTE_PTR templ, CK_ULONG count)
             /* set the head to point into the list */
             fd->head = calloc(1, sizeof(*match_cur));
             if (!fd->head) {
+                free(ids);
                 rv = CKR_HOST_MEMORY;
                 goto out;
             }
@@ -342,6 +420,7 @@ CK_RV object_find_init(session_ctx *ctx, CK_ATTRIBUTE_PTR templ, CK_ULONG count)
             assert(match_cur);
             match_cur->next = calloc(1, sizeof(*match_cur));
             if (!match_cur->next) {
+                free(ids);
                 rv = CKR_HOST_MEMORY;
                 goto out;
             }
@@ -351,10 +430,13 @@ CK_RV object_find_init(session_ctx *ctx, CK_ATTRIBUTE_PTR templ, CK_ULONG count)
 
         rv = do_match_set(match_cur, tobj);
         if (rv != CKR_OK) {
+            free(ids);
             goto out;
         }
     }
 
+    free(ids);
+
     fd->cur = fd->head;
 
 empty:
@@ -593,6 +675,32 @@ CK_RV object_get_attributes(session_ctx *ctx, CK_OBJECT_HANDLE object, CK_ATTRIB
             /* continue on processing */
         }
 
+        /* a large value stays in the store, read it straight into the caller's buffer */
+        if (t->type == CKA_VALUE && tobj->ext_value_len &&
+                found && !found->ulValueLen) {
+            if (!t->pValue) {
+                t->ulValueLen = tobj->ext_value_len;
+                continue;
+            }
+
+            if (tobj->ext_value_len > t->ulValueLen) {
+                t->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+                rv = CKR_BUFFER_TOO_SMALL;
+                continue;
+            }
+
+            CK_RV tmp_rv = backend_read_tobject_value(tok, tobj, t->pValue,
+                    tobj->ext_value_len);
+            if (tmp_rv != CKR_OK) {
+                t->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+                rv = tmp_rv;
+                continue;
+            }
+
+            t->ulValueLen = tobj->ext_value_len;
+            continue;
+        }
+
         if (found) {
             if (!t->pValue) {
                 /* only populate size if the buffer is null */
@@ -720,6 +828,10 @@ CK_RV object_set_attributes(session_ctx *ctx, CK_OBJECT_HANDLE object, CK_ATTRIB
     attr_list_free(tobj->attrs);
     tobj->attrs = tmp;
 
+    /* the public key is built from the attributes, build it again on next use */
+    EVP_PKEY_free(tobj->pkey);
+    tobj->pkey = NULL;
+
     rv = CKR_OK;
 
 out:
@@ -6,6 +6,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <openssl/evp.h>
+
 #include "attrs.h"
 #include "debug.h"
 #include "list.h"
@@ -22,6 +24,8 @@ struct tobject {
 
     unsigned id; /** external handle */
 
+    uint64_t rev; /** store revision of the attributes, changes on every write */
+
     CK_OBJECT_HANDLE obj_handle; /** application visible handle */
 
     /*
@@ -34,12 +38,18 @@ struct tobject {
 
     attr_list *attrs;    /** object attributes */
 
+    CK_ULONG ext_value_len; /** length of a CKA_VALUE kept out of the attrs in the store, 0 if none */
+
     list l;             /** list pointer for "listifying" tobjects */
 
     twist unsealed_auth; /** unwrapped auth value */
 
     uint32_t tpm_handle;     /** loaded tpm handle */
 
+    bool tpm_handle_persistent; /** tpm_handle is a persistent object, close it rather than flush it */
+
+    EVP_PKEY *pkey;      /** public key, built on first use by ssl_util_tobject_to_evp() */
+
     bool is_authenticated; /** true if a context specific login has authenticated use of the object */
 };
 
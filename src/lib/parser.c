@@ -1,13 +1,16 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include "config.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <yaml.h>
 
+#include "keypool.h"
 #include "parser.h"
 #include "pkcs11.h"
+#include "prewarm.h"
 #include "token.h"
 #include "twist.h"
 #include "typed_memory.h"
@@ -376,6 +379,96 @@ struct config_state {
     char key[64];
 };
 
+bool parse_token_config_value(const char *key, const char *value,
+        token_config *config) {
+
+    if (!strcmp(key, "tcti")) {
+        free(config->tcti);
+        config->tcti = strdup(value);
+        if (!config->tcti) {
+            LOGE("oom");
+            return false;
+        }
+    } else if(!strcmp(key, "token-init")) {
+        config->is_initialized = !strcmp(value, "true")
+                ? true : false;
+    } else if(!strcmp(key, "pss-sigs-good")) {
+        config->pss_sigs_good = !strcmp(value, "true")
+                ? pss_config_state_good : pss_config_state_bad;
+    } else if(!strcmp(key, "durability")) {
+        if (!strcmp(value, "full")) {
+            config->durability = token_durability_full;
+        } else if (!strcmp(value, "batch")) {
+            config->durability = token_durability_batch;
+        } else {
+            LOGE("Unknown durability, got: \"%s\"\n", value);
+            return false;
+        }
+    } else if(!strcmp(key, "attr-store")) {
+        if (!strcmp(value, "yaml")) {
+            config->attr_store = token_attr_store_yaml;
+        } else if (!strcmp(value, "table")) {
+            config->attr_store = token_attr_store_table;
+        } else {
+            LOGE("Unknown attr-store, got: \"%s\"\n", value);
+            return false;
+        }
+    } else if(!strcmp(key, "context-login")) {
+        if (!strcmp(value, "host")) {
+            config->context_login = token_context_login_host;
+        } else if (!strcmp(value, "tpm")) {
+            config->context_login = token_context_login_tpm;
+        } else {
+            LOGE("Unknown context-login, got: \"%s\"\n", value);
+            return false;
+        }
+    } else if(!strcmp(key, "login-cache-ttl")) {
+        size_t ttl;
+        if (str_to_ul(value, &ttl) || ttl > UINT_MAX) {
+            LOGE("Bad login-cache-ttl, got: \"%s\"\n", value);
+            return false;
+        }
+        config->login_cache_ttl = ttl;
+    } else if(!strcmp(key, "prewarm")) {
+        if (!prewarm_spec_valid(value)) {
+            return false;
+        }
+        free(config->prewarm);
+        config->prewarm = strdup(value);
+        if (!config->prewarm) {
+            LOGE("oom");
+            return false;
+        }
+    } else if(!strcmp(key, "pin-kdf")) {
+        pin_kdf kdf;
+        if (!utils_pin_kdf_parse(value, &kdf)) {
+            return false;
+        }
+        free(config->pin_kdf);
+        config->pin_kdf = strdup(value);
+        if (!config->pin_kdf) {
+            LOGE("oom");
+            return false;
+        }
+    } else if(!strcmp(key, "key-pool")) {
+        keypool_spec spec;
+        if (!keypool_spec_parse(value, &spec)) {
+            return false;
+        }
+        free(config->key_pool);
+        config->key_pool = strdup(value);
+        if (!config->key_pool) {
+            LOGE("oom");
+            return false;
+        }
+    } else {
+        LOGE("Unknown key, got: \"%s\"\n", key);
+        return false;
+    }
+
+    return true;
+}
+
 bool handle_token_config_event(yaml_event_t *e,
         config_state *state, token_config *config) {
 
@@ -424,21 +517,8 @@ bool handle_token_config_event(yaml_event_t *e,
                     e->data.scalar.value);
         } else {
 
-            if (!strcmp(state->key, "tcti")) {
-                config->tcti = strdup((const char *)e->data.scalar.value);
-                if (!config->tcti) {
-                    LOGE("oom");
-                    return false;
-                }
-            } else if(!strcmp(state->key, "token-init")) {
-                config->is_initialized = !strcmp((const char *)e->data.scalar.value, "true")
-                        ? true : false;
-            } else if(!strcmp(state->key, "pss-sigs-good")) {
-                config->pss_sigs_good = !strcmp((const char *)e->data.scalar.value, "true")
-                        ? pss_config_state_good : pss_config_state_bad;
-            } else {
-                LOGE("Unknown key, got: \"%s\"\n",
-                        state->key);
+            if (!parse_token_config_value(state->key,
+                    (const char *)e->data.scalar.value, config)) {
                 return false;
             }
 
@@ -15,6 +15,20 @@ WEAK bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
 bool parse_token_config_from_string(const unsigned char *yaml, size_t size,
         token_config *config);
 
+/**
+ * Sets one token config key, as it is found in the config YAML of a token.
+ * @param key
+ *  The config key, eg "durability".
+ * @param value
+ *  The scalar value of the key, eg "batch".
+ * @param config
+ *  The config to update.
+ * @return
+ *  true on success, false for an unknown key or a bad value.
+ */
+bool parse_token_config_value(const char *key, const char *value,
+        token_config *config);
+
 bool parse_pobject_config_from_string(const unsigned char *yaml, size_t size,
         pobject_config *config);
 
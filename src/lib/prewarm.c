@@ -0,0 +1,318 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include "config.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+#include "general.h"
+#include "log.h"
+#include "object.h"
+#include "prewarm.h"
+#include "ssl_util.h"
+#include "utils.h"
+
+struct prewarm {
+    token *tok;
+
+    /* protects everything below */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool has_thread;
+    pthread_t thread;
+    bool quit;
+    bool pending;   /* a login asked for a run that has not started */
+};
+
+static bool is_id(const char *entry) {
+
+    const char *c;
+    for (c = entry; *c; c++) {
+        if (!isdigit((unsigned char)*c)) {
+            return false;
+        }
+    }
+
+    return c != entry;
+}
+
+bool prewarm_spec_valid(const char *str) {
+
+    size_t entries = 0;
+    const char *start = str;
+    while (true) {
+        const char *end = strchr(start, ',');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        if (!len) {
+            LOGE("Empty prewarm entry in \"%s\"", str);
+            return false;
+        }
+
+        if (++entries > PREWARM_MAX_ENTRIES) {
+            LOGE("prewarm lists more than %u objects, got: \"%s\"",
+                    PREWARM_MAX_ENTRIES, str);
+            return false;
+        }
+
+        if (!end) {
+            return true;
+        }
+        start = end + 1;
+    }
+}
+
+static tobject *find_entry(token *tok, const char *entry) {
+
+    if (!tok->tobjects.head) {
+        return NULL;
+    }
+
+    bool by_id = is_id(entry);
+    unsigned long id = by_id ? strtoul(entry, NULL, 10) : 0;
+    size_t len = strlen(entry);
+
+    list *cur = &tok->tobjects.head->l;
+    while (cur) {
+        tobject *tobj = list_entry(cur, tobject, l);
+        cur = cur->next;
+
+        if (by_id) {
+            if (tobj->id == id) {
+                return tobj;
+            }
+            continue;
+        }
+
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_LABEL);
+        if (a && a->ulValueLen == len && !memcmp(a->pValue, entry, len)) {
+            return tobj;
+        }
+    }
+
+    return NULL;
+}
+
+/* the token must be locked */
+static void warm_entry(token *tok, const char *entry) {
+
+    /* the user may have logged out while the worker waited for the lock */
+    if (!token_is_user_logged_in(tok)) {
+        return;
+    }
+
+    CK_RV rv = backend_refresh_tobjects(tok);
+    if (rv != CKR_OK) {
+        LOGW("Could not refresh the objects of token %u: 0x%lx", tok->id, rv);
+        return;
+    }
+
+    tobject *tobj = find_entry(tok, entry);
+    if (!tobj) {
+        LOGW("No object \"%s\" to prewarm in token %u", entry, tok->id);
+        return;
+    }
+
+    CK_OBJECT_CLASS clazz = attr_list_get_CKA_CLASS(tobj->attrs, CK_OBJECT_CLASS_BAD);
+    if (clazz != CKO_PRIVATE_KEY
+            && clazz != CKO_PUBLIC_KEY
+            && clazz != CKO_SECRET_KEY) {
+        LOGW("Object \"%s\" of token %u is not a key, not prewarming it",
+                entry, tok->id);
+        return;
+    }
+
+    /* loads the key and unwraps its auth, both stay until logout */
+    unsigned active = tobj->active;
+    rv = token_load_object(tok, tobj->obj_handle, &tobj);
+    if (tobj->active > active) {
+        tobject_user_decrement(tobj);
+    }
+    if (rv != CKR_OK) {
+        LOGW("Could not prewarm object \"%s\" of token %u: 0x%lx",
+                entry, tok->id, rv);
+        return;
+    }
+
+    if (clazz == CKO_SECRET_KEY) {
+        return;
+    }
+
+    /* the public key stays with the object, see ssl_util_tobject_to_evp() */
+    EVP_PKEY *pkey = NULL;
+    rv = ssl_util_tobject_to_evp(&pkey, tobj);
+    if (rv != CKR_OK) {
+        LOGW("Could not build the public key of object \"%s\" of token %u: 0x%lx",
+                entry, tok->id, rv);
+        return;
+    }
+    EVP_PKEY_free(pkey);
+}
+
+static void *worker(void *arg) {
+
+    prewarm *pw = (prewarm *)arg;
+    token *tok = pw->tok;
+
+    pthread_mutex_lock(&pw->lock);
+
+    while (!pw->quit) {
+
+        if (!pw->pending) {
+            pthread_cond_wait(&pw->cond, &pw->lock);
+            continue;
+        }
+        pw->pending = false;
+
+        pthread_mutex_unlock(&pw->lock);
+
+        /* the config does not change while the token is loaded */
+        char *spec = strdup(tok->config.prewarm);
+        if (!spec) {
+            LOGW("oom");
+        }
+
+        char *saveptr = NULL;
+        char *entry = spec ? strtok_r(spec, ",", &saveptr) : NULL;
+        while (entry) {
+
+            /* only hold the token lock for one object at a time */
+            token_lock(tok);
+            warm_entry(tok, entry);
+            token_unlock(tok);
+
+            pthread_mutex_lock(&pw->lock);
+            bool quit = pw->quit;
+            pthread_mutex_unlock(&pw->lock);
+            if (quit) {
+                break;
+            }
+
+            entry = strtok_r(NULL, ",", &saveptr);
+        }
+
+        free(spec);
+
+        pthread_mutex_lock(&pw->lock);
+    }
+
+    pthread_mutex_unlock(&pw->lock);
+
+    return NULL;
+}
+
+static CK_RV prewarm_new(token *tok, prewarm **out) {
+
+    prewarm *pw = calloc(1, sizeof(*pw));
+    if (!pw) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    pw->tok = tok;
+
+    int rc = pthread_cond_init(&pw->cond, NULL);
+    if (rc) {
+        LOGE("pthread_cond_init: %s", strerror(rc));
+        free(pw);
+        return CKR_GENERAL_ERROR;
+    }
+
+    rc = pthread_mutex_init(&pw->lock, NULL);
+    if (rc) {
+        LOGE("pthread_mutex_init: %s", strerror(rc));
+        pthread_cond_destroy(&pw->cond);
+        free(pw);
+        return CKR_GENERAL_ERROR;
+    }
+
+    *out = pw;
+
+    return CKR_OK;
+}
+
+static void prewarm_inline(token *tok) {
+
+    char *spec = strdup(tok->config.prewarm);
+    if (!spec) {
+        LOGW("oom");
+        return;
+    }
+
+    char *saveptr = NULL;
+    char *entry = strtok_r(spec, ",", &saveptr);
+    while (entry) {
+        warm_entry(tok, entry);
+        entry = strtok_r(NULL, ",", &saveptr);
+    }
+
+    free(spec);
+}
+
+void prewarm_start(token *tok) {
+
+    if (!tok->config.prewarm) {
+        return;
+    }
+
+    /*
+     * The worker shares the token, and its TPM context, with the
+     * application threads, which only works with real locks.
+     */
+    if (!general_can_create_threads() || !general_os_locking_ok()) {
+        prewarm_inline(tok);
+        return;
+    }
+
+    if (!tok->prewarm) {
+        CK_RV rv = prewarm_new(tok, &tok->prewarm);
+        if (rv != CKR_OK) {
+            LOGW("Could not set up prewarming of token %u: 0x%lx", tok->id, rv);
+            return;
+        }
+    }
+
+    prewarm *pw = tok->prewarm;
+
+    pthread_mutex_lock(&pw->lock);
+
+    if (!pw->has_thread) {
+        int rc = pthread_create(&pw->thread, NULL, worker, pw);
+        if (rc) {
+            LOGW("Could not start the prewarm worker of token %u: %s",
+                    tok->id, strerror(rc));
+            goto out;
+        }
+        pw->has_thread = true;
+    }
+
+    pw->pending = true;
+    pthread_cond_signal(&pw->cond);
+
+out:
+    pthread_mutex_unlock(&pw->lock);
+}
+
+void prewarm_free(prewarm *pw) {
+
+    if (!pw) {
+        return;
+    }
+
+    pthread_mutex_lock(&pw->lock);
+    pw->quit = true;
+    pthread_cond_signal(&pw->cond);
+    pthread_mutex_unlock(&pw->lock);
+
+    if (pw->has_thread) {
+        pthread_join(pw->thread, NULL);
+    }
+
+    pthread_cond_destroy(&pw->cond);
+    pthread_mutex_destroy(&pw->lock);
+
+    free(pw);
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_PREWARM_H_
+#define SRC_LIB_PREWARM_H_
+
+#include <stdbool.h>
+
+#include "token.h"
+
+/* the most objects a prewarm config can list */
+#define PREWARM_MAX_ENTRIES 16
+
+/**
+ * Checks the prewarm token config value. It is a comma separated list of
+ * objects, an entry of only digits is the id of an object as tpm2_ptool
+ * listobjects shows it, any other entry is a CKA_LABEL, eg "3,tls-server".
+ * @param str
+ *  The config value.
+ * @return
+ *  true if str is a valid prewarm config.
+ */
+bool prewarm_spec_valid(const char *str);
+
+/**
+ * Prepares the objects of a token's prewarm config for use: loads keys
+ * into the TPM, unwraps their auth values and builds their public keys.
+ * Called with the token locked when the user logs in. Does so on a worker
+ * thread, which takes the token lock for each object, if the library may
+ * create threads and uses OS locking, otherwise before returning. Failures
+ * are logged, the login goes ahead.
+ * @param tok
+ *  The token the user logged in to.
+ */
+void prewarm_start(token *tok);
+
+/**
+ * Stops the worker, waiting for an object being prepared, and frees it.
+ * Must be called without the token lock held.
+ * @param pw
+ *  The worker to free, may be NULL.
+ */
+void prewarm_free(prewarm *pw);
+
+#endif /* SRC_LIB_PREWARM_H_ */
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_PROBES_H_
+#define SRC_LIB_PROBES_H_
+
+#include "config.h"
+
+/*
+ * USDT probes for external tracing with tools like bpftrace or perf, all under
+ * the "tpm2_pkcs11" provider. They compile to a single nop per site when no
+ * tracer is attached, and to nothing when configured without --enable-usdt.
+ * See docs/PERFORMANCE.md for the list of probes and their arguments.
+ *
+ * A file can define PROBE_WITH_SEMAPHORES before including this header to
+ * give each of its probes a semaphore, declared with PROBE_SEMAPHORE(), so
+ * that work only done for a probe can be skipped with PROBE_ENABLED() while
+ * no tracer is attached to it. Every probe in such a file needs one.
+ */
+#ifdef HAVE_USDT
+#ifdef PROBE_WITH_SEMAPHORES
+#define _SDT_HAS_SEMAPHORES 1
+#endif
+#include <sys/sdt.h>
+
+#define PROBE_SEMAPHORE(name) \
+    __attribute__((visibility("hidden"))) __attribute__((section(".probes"))) \
+    unsigned short tpm2_pkcs11_##name##_semaphore
+#define PROBE_ENABLED(name) \
+    __builtin_expect(tpm2_pkcs11_##name##_semaphore != 0, 0)
+
+#define PROBE0(name) \
+    DTRACE_PROBE(tpm2_pkcs11, name)
+#define PROBE1(name, a1) \
+    DTRACE_PROBE1(tpm2_pkcs11, name, a1)
+#define PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(tpm2_pkcs11, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(tpm2_pkcs11, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(tpm2_pkcs11, name, a1, a2, a3, a4)
+#define PROBE5(name, a1, a2, a3, a4, a5) \
+    DTRACE_PROBE5(tpm2_pkcs11, name, a1, a2, a3, a4, a5)
+#else
+#define PROBE_ENABLED(name) 0
+#define PROBE0(name) do { } while (0)
+#define PROBE1(name, a1) do { } while (0)
+#define PROBE2(name, a1, a2) do { } while (0)
+#define PROBE3(name, a1, a2, a3) do { } while (0)
+#define PROBE4(name, a1, a2, a3, a4) do { } while (0)
+#define PROBE5(name, a1, a2, a3, a4, a5) do { } while (0)
+#endif
+
+#endif /* SRC_LIB_PROBES_H_ */
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "backend.h"
 #include "checks.h"
 #include "general.h"
 #include "log.h"
@@ -88,6 +89,14 @@ CK_RV session_open(CK_SLOT_ID slot_id, CK_FLAGS flags, void *application,
 	    return CKR_SESSION_READ_WRITE_SO_EXISTS;
 	}
 
+	/* the first session on a token brings up its tpm context */
+	token_lock(t);
+	rv = token_tpm_load(t);
+	token_unlock(t);
+	if (rv != CKR_OK) {
+	    return rv;
+	}
+
 	rv = session_table_new_entry(t->s_table, session, t, flags);
     if (rv != CKR_OK) {
         return rv;
@@ -104,7 +113,13 @@ CK_RV session_close(CK_SESSION_HANDLE session) {
     unsigned tokid = get_tokid_from_session_handle_and_cleanse(&session);
     check_slot_id(tokid, t, CKR_SESSION_HANDLE_INVALID);
 
-    return session_table_free_ctx(t, session);
+    CK_RV rv = session_table_free_ctx(t, session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    /* batched object writes do not outlive the session that made them */
+    return backend_flush();
 }
 
 CK_RV session_closeall(CK_SLOT_ID slot_id) {
@@ -112,7 +127,12 @@ CK_RV session_closeall(CK_SLOT_ID slot_id) {
     token *t;
     check_slot_id(slot_id, t, CKR_SLOT_ID_INVALID);
 
-    return session_table_free_ctx_all(t);
+    CK_RV rv = session_table_free_ctx_all(t);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return backend_flush();
 }
 
 CK_RV session_lookup(CK_SESSION_HANDLE session, token **tok, session_ctx **ctx) {
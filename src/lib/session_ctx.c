@@ -9,9 +9,11 @@
 #include <openssl/crypto.h>
 
 #include "attrs.h"
+#include "keypool.h"
 #include "log.h"
 #include "mutex.h"
 #include "pkcs11.h"
+#include "prewarm.h"
 #include "session_ctx.h"
 #include "session_table.h"
 #include "token.h"
@@ -244,13 +246,64 @@ CK_RV session_ctx_login(session_ctx *ctx, CK_USER_TYPE user, CK_BYTE_PTR pin, CK
         return CKR_HOST_MEMORY;
     }
 
-    rv = backend_token_unseal_wrapping_key(tok, is_user(user), tpin);
-    twist_free(tpin);
-    if (rv != CKR_OK) {
-        LOGE("Error unsealing wrapping key");
-        return rv;
+    /*
+     * The user PIN was checked by the user login, check context specific
+     * logins against the verifier it left rather than unsealing the
+     * wrapping key again, unless the token config asks for the TPM.
+     */
+    if (user == CKU_CONTEXT_SPECIFIC
+            && tok->user_verifier.is_set
+            && tok->config.context_login == token_context_login_host) {
+        bool match = utils_pin_verifier_check(&tok->user_verifier, tpin);
+        twist_free(tpin);
+        if (!match) {
+            LOGE("Context specific login with an incorrect PIN");
+            return CKR_PIN_INCORRECT;
+        }
+
+        ctx->opdata.tobj->is_authenticated = true;
+        return CKR_OK;
     }
 
+    /*
+     * A user login another process of this session left in the login cache
+     * needs no TPM commands, the primary object and the auth session come
+     * up with the first operation that needs them, see
+     * token_auth_session_load().
+     */
+    bool cached = false;
+    if (user == CKU_USER) {
+        rv = backend_token_login_cache_get(tok, tpin, &cached);
+        if (rv != CKR_OK && rv != CKR_FUNCTION_NOT_SUPPORTED) {
+            twist_free(tpin);
+            return rv;
+        }
+    }
+
+    if (!cached) {
+        /* the first login brings up the primary object, see token_pobject_load() */
+        rv = token_pobject_load(tok);
+        if (rv != CKR_OK) {
+            twist_free(tpin);
+            return rv;
+        }
+
+        rv = backend_token_unseal_wrapping_key(tok, is_user(user), tpin);
+        if (rv != CKR_OK) {
+            twist_free(tpin);
+            LOGE("Error unsealing wrapping key");
+            return rv;
+        }
+    }
+
+    if (is_user(user)) {
+        rv = utils_pin_verifier_set(&tok->user_verifier, tpin);
+        if (rv != CKR_OK) {
+            LOGW("No PIN verifier, context specific logins use the TPM");
+        }
+    }
+    twist_free(tpin);
+
     /*
      * Indicate that the token has been logged in. For CKU_CONTEXT_SPECIFIC the spec
      * states that on both cases (appears to be fail or success of C_Login) session
@@ -267,6 +320,11 @@ CK_RV session_ctx_login(session_ctx *ctx, CK_USER_TYPE user, CK_BYTE_PTR pin, CK
          * State transition all *EXISTING* sessions in the table
          */
         session_table_login_event(tok->s_table, user);
+
+        if (user == CKU_USER) {
+            keypool_start(tok);
+            prewarm_start(tok);
+        }
     }
 
     return CKR_OK;
@@ -285,6 +343,11 @@ CK_RV session_ctx_logout(session_ctx *ctx) {
     /* clear the wrapping key */
     assert(tok->wrappingkey);
 
+    keypool_stop(tok);
+
+    utils_pin_verifier_clear(&tok->user_verifier);
+    token_user_sealauth_set(tok, NULL);
+
     /* cleanse the wrapping key */
     if (tok->wrappingkey) {
         OPENSSL_cleanse((void *)tok->wrappingkey, twist_len(tok->wrappingkey));
@@ -318,10 +381,13 @@ CK_RV session_ctx_logout(session_ctx *ctx) {
             }
 
             if (tobj->tpm_handle) {
-                bool result = tpm_flushcontext(tpm, tobj->tpm_handle);
+                bool result = tobj->tpm_handle_persistent ?
+                        tpm_closehandle(tpm, tobj->tpm_handle) :
+                        tpm_flushcontext(tpm, tobj->tpm_handle);
                 assert(result);
                 UNUSED(result);
                 tobj->tpm_handle = 0;
+                tobj->tpm_handle_persistent = false;
 
                 /* Clear the unwrapped auth value for tertiary objects */
                 twist_free(tobj->unsealed_auth);
@@ -340,7 +406,10 @@ CK_RV session_ctx_logout(session_ctx *ctx) {
      */
     tok->login_state = token_no_one_logged_in;
 
-    tpm_session_stop(tok->tctx);
+    /* a login served by the login cache may never have started one */
+    if (tpm_session_active(tok->tctx)) {
+        tpm_session_stop(tok->tctx);
+    }
 
     return CKR_OK;
 }
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "checks.h"
@@ -11,10 +12,23 @@
 #include "token.h"
 #include "utils.h"
 
+typedef struct tpm_info tpm_info;
+struct tpm_info {
+    enum token_type type;
+    char *tcti;
+    CK_VERSION hardwareVersion;
+    CK_VERSION firmwareVersion;
+    CK_UTF8CHAR manufacturerID[32];
+    CK_UTF8CHAR model[16];
+};
+
 static struct {
     size_t token_cnt;
     token *token;
     void *mutex;
+    /* what the TPM of each TCTI reported, see slot_get_tpm_info() */
+    tpm_info tpm_info[MAX_TOKEN_CNT];
+    size_t tpm_info_cnt;
 } global;
 
 CK_RV slot_init(void) {
@@ -39,6 +53,13 @@ void slot_destroy(void) {
 
     token_free_list(global.token, global.token_cnt);
 
+    size_t i;
+    for (i=0; i < global.tpm_info_cnt; i++) {
+        free(global.tpm_info[i].tcti);
+    }
+    memset(global.tpm_info, 0, sizeof(global.tpm_info));
+    global.tpm_info_cnt = 0;
+
     CK_RV rv = mutex_destroy(global.mutex);
     global.mutex = NULL;
     if (rv != CKR_OK) {
@@ -63,6 +84,87 @@ token *slot_get_token(CK_SLOT_ID slot_id) {
     return NULL;
 }
 
+static bool tpm_info_match(tpm_info *i, token *t) {
+
+    if (i->type != t->type) {
+        return false;
+    }
+
+    if (!i->tcti || !t->config.tcti) {
+        return i->tcti == t->config.tcti;
+    }
+
+    return !strcmp(i->tcti, t->config.tcti);
+}
+
+static void tpm_info_to_token_info(tpm_info *i, CK_TOKEN_INFO *info) {
+
+    info->hardwareVersion = i->hardwareVersion;
+    info->firmwareVersion = i->firmwareVersion;
+    memcpy(info->manufacturerID, i->manufacturerID, sizeof(info->manufacturerID));
+    memcpy(info->model, i->model, sizeof(info->model));
+}
+
+CK_RV slot_get_tpm_info(token *t, CK_TOKEN_INFO *info) {
+
+    check_pointer(t);
+    check_pointer(info);
+
+    slot_lock();
+
+    size_t i;
+    for (i=0; i < global.tpm_info_cnt; i++) {
+        tpm_info *cached = &global.tpm_info[i];
+        if (tpm_info_match(cached, t)) {
+            tpm_info_to_token_info(cached, info);
+            slot_unlock();
+            return CKR_OK;
+        }
+    }
+
+    slot_unlock();
+
+    /* the first token to ask on a TCTI pays for a tpm context */
+    if (!t->tctx) {
+        CK_RV rv = backend_ctx_new(t);
+        if (rv != CKR_OK) {
+            LOGE("Could not initialize tpm ctx: 0x%lx", rv);
+            return rv;
+        }
+    }
+
+    CK_RV rv = tpm_get_token_info(t->tctx, info);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    slot_lock();
+
+    /* another token on the same TCTI may have raced us here */
+    for (i=0; i < global.tpm_info_cnt; i++) {
+        if (tpm_info_match(&global.tpm_info[i], t)) {
+            break;
+        }
+    }
+
+    if (i == global.tpm_info_cnt && i < ARRAY_LEN(global.tpm_info)) {
+        tpm_info *cached = &global.tpm_info[i];
+        cached->tcti = t->config.tcti ? strdup(t->config.tcti) : NULL;
+        if (!t->config.tcti || cached->tcti) {
+            cached->type = t->type;
+            cached->hardwareVersion = info->hardwareVersion;
+            cached->firmwareVersion = info->firmwareVersion;
+            memcpy(cached->manufacturerID, info->manufacturerID, sizeof(cached->manufacturerID));
+            memcpy(cached->model, info->model, sizeof(cached->model));
+            global.tpm_info_cnt++;
+        }
+    }
+
+    slot_unlock();
+
+    return CKR_OK;
+}
+
 CK_RV slot_get_list (CK_BYTE token_present, CK_SLOT_ID *slot_list, CK_ULONG_PTR count) {
 
     /*
@@ -140,7 +242,10 @@ CK_RV slot_mechanism_list_get (CK_SLOT_ID slot_id, CK_MECHANISM_TYPE *mechanism_
     }
 
     token_lock(t);
-    CK_RV rv = mech_get_supported(t->mdtl, mechanism_list, count);
+    CK_RV rv = token_tpm_load(t);
+    if (rv == CKR_OK) {
+        rv = mech_get_supported(t->mdtl, mechanism_list, count);
+    }
     token_unlock(t);
     return rv;
 }
@@ -156,7 +261,13 @@ CK_RV slot_mechanism_info_get (CK_SLOT_ID slot_id, CK_MECHANISM_TYPE type, CK_ME
 
     token_lock(t);
 
-    CK_RV rv = mech_get_info(t->mdtl, t->tctx, type, info);
+    CK_RV rv = token_tpm_load(t);
+    if (rv != CKR_OK) {
+        token_unlock(t);
+        return rv;
+    }
+
+    rv = mech_get_info(t->mdtl, t->tctx, type, info);
     if (rv != CKR_OK) {
         token_unlock(t);
         return rv;
@@ -22,4 +22,17 @@ CK_RV slot_mechanism_list_get (CK_SLOT_ID slotID, CK_MECHANISM_TYPE *mechanism_l
 CK_RV slot_mechanism_info_get (CK_SLOT_ID slot_id, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO *info);
 CK_RV slot_add_uninit_token(void);
 
+/**
+ * Fills in the fields of a CK_TOKEN_INFO that come from the TPM, the versions,
+ * manufacturer and model. They are asked of the TPM once per TCTI, so tokens
+ * that share one can answer without a tpm context of their own.
+ * @param t
+ *  The token asking, locked by the caller.
+ * @param info
+ *  The token info to fill in.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV slot_get_tpm_info(token *t, CK_TOKEN_INFO *info);
+
 #endif /* SRC_SLOT_H_ */
@@ -0,0 +1,479 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "attrs.h"
+#include "backend.h"
+#include "log.h"
+#include "object.h"
+#include "parser.h"
+#include "snapshot.h"
+#include "tpm.h"
+#include "twist.h"
+
+#define SNAPSHOT_HEADER_SIZE 32
+
+/* how a tobject attribute value is stored, see docs/SNAPSHOT.md */
+enum snapshot_attr_kind {
+    snapshot_attr_int = 0,
+    snapshot_attr_bool,
+    snapshot_attr_bytes,
+    snapshot_attr_int_seq,
+};
+
+static struct {
+    const uint8_t *base;
+    size_t size;
+    unsigned token_cnt;
+} global;
+
+/*
+ * Bounds checked little endian reader over the mapping. The first read
+ * past the end latches bad, so callers can check once per record.
+ */
+typedef struct cursor cursor;
+struct cursor {
+    const uint8_t *p;
+    size_t left;
+    bool bad;
+};
+
+static const uint8_t *take(cursor *c, size_t len) {
+
+    if (c->bad || len > c->left) {
+        c->bad = true;
+        return NULL;
+    }
+
+    const uint8_t *p = c->p;
+    c->p += len;
+    c->left -= len;
+    return p;
+}
+
+static uint8_t get_u8(cursor *c) {
+    const uint8_t *p = take(c, 1);
+    return p ? p[0] : 0;
+}
+
+static uint32_t get_u32(cursor *c) {
+    const uint8_t *p = take(c, 4);
+    if (!p) {
+        return 0;
+    }
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+            (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_u64(cursor *c) {
+    uint64_t lo = get_u32(c);
+    uint64_t hi = get_u32(c);
+    return lo | hi << 32;
+}
+
+static const uint8_t *get_blob(cursor *c, uint32_t *len) {
+    *len = get_u32(c);
+    return take(c, *len);
+}
+
+/* empty blobs are NULL twists, like NULL columns in the store */
+static bool get_twist(cursor *c, twist *t) {
+
+    uint32_t len;
+    const uint8_t *data = get_blob(c, &len);
+    if (c->bad) {
+        return false;
+    }
+
+    if (!len) {
+        *t = NULL;
+        return true;
+    }
+
+    *t = twistbin_new(data, len);
+    if (!*t) {
+        LOGE("oom");
+        return false;
+    }
+
+    return true;
+}
+
+static bool get_str(cursor *c, char **s) {
+
+    uint32_t len;
+    const uint8_t *data = get_blob(c, &len);
+    if (c->bad) {
+        return false;
+    }
+
+    if (!len) {
+        *s = NULL;
+        return true;
+    }
+
+    *s = strndup((const char *)data, len);
+    if (!*s) {
+        LOGE("oom");
+        return false;
+    }
+
+    return true;
+}
+
+CK_RV snapshot_init(const char *path) {
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Could not open snapshot \"%s\": %s", path, strerror(errno));
+        return CKR_GENERAL_ERROR;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb)) {
+        LOGE("Could not stat snapshot \"%s\": %s", path, strerror(errno));
+        close(fd);
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (sb.st_size < SNAPSHOT_HEADER_SIZE) {
+        LOGE("Snapshot \"%s\" is too small", path);
+        close(fd);
+        return CKR_GENERAL_ERROR;
+    }
+
+    size_t size = (size_t)sb.st_size;
+    void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOGE("Could not map snapshot \"%s\": %s", path, strerror(errno));
+        return CKR_GENERAL_ERROR;
+    }
+
+    cursor c = { .p = base, .left = size };
+
+    const uint8_t *magic = take(&c, sizeof(SNAPSHOT_MAGIC) - 1);
+    uint32_t version = get_u32(&c);
+    uint32_t schema = get_u32(&c);
+    uint32_t token_cnt = get_u32(&c);
+    UNUSED(get_u32(&c));
+    uint64_t file_size = get_u64(&c);
+
+    if (memcmp(magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1)) {
+        LOGE("\"%s\" is not a tpm2-pkcs11 snapshot", path);
+        goto error;
+    }
+
+    if (version != SNAPSHOT_FORMAT_VERSION) {
+        LOGE("Snapshot \"%s\" has format version %u, expected %u",
+                path, version, SNAPSHOT_FORMAT_VERSION);
+        goto error;
+    }
+
+    if (file_size != size) {
+        LOGE("Snapshot \"%s\" is truncated, expected %"PRIu64" bytes, got %zu",
+                path, file_size, size);
+        goto error;
+    }
+
+    if (token_cnt > MAX_TOKEN_CNT) {
+        LOGE("Snapshot \"%s\" has too many tokens: %u", path, token_cnt);
+        goto error;
+    }
+
+    /* the whole file is read once while building the tokens */
+    UNUSED(madvise(base, size, MADV_WILLNEED));
+
+    LOGV("Using snapshot \"%s\" of store schema version %u, %u tokens",
+            path, schema, token_cnt);
+
+    global.base = base;
+    global.size = size;
+    global.token_cnt = token_cnt;
+
+    return CKR_OK;
+
+error:
+    munmap(base, size);
+    return CKR_GENERAL_ERROR;
+}
+
+void snapshot_destroy(void) {
+
+    if (global.base) {
+        munmap((void *)global.base, global.size);
+    }
+
+    memset(&global, 0, sizeof(global));
+}
+
+static bool get_attrs(cursor *c, attr_list **attrs) {
+
+    uint32_t cnt = get_u32(c);
+    if (c->bad) {
+        return false;
+    }
+
+    attr_list *l = attr_list_new();
+    if (!l) {
+        LOGE("oom");
+        return false;
+    }
+
+    uint32_t i;
+    for (i = 0; i < cnt; i++) {
+        CK_ATTRIBUTE_TYPE type = get_u64(c);
+        uint8_t kind = get_u8(c);
+        uint32_t len;
+        const uint8_t *value = get_blob(c, &len);
+        if (c->bad) {
+            goto error;
+        }
+
+        cursor v = { .p = value, .left = len };
+
+        bool res;
+        switch (kind) {
+        case snapshot_attr_int:
+            res = len == sizeof(uint64_t) &&
+                attr_list_add_int(l, type, (CK_ULONG)get_u64(&v));
+            break;
+        case snapshot_attr_bool:
+            res = len == 1 && attr_list_add_bool(l, type, get_u8(&v));
+            break;
+        case snapshot_attr_bytes:
+            res = attr_list_add_buf(l, type, (CK_BYTE_PTR)value, len);
+            break;
+        case snapshot_attr_int_seq: {
+            /* stored as 64 bit values, CK_ULONG may be narrower */
+            size_t n = len / sizeof(uint64_t);
+            if (len % sizeof(uint64_t)) {
+                res = false;
+                break;
+            }
+            CK_ULONG_PTR seq = n ? calloc(n, sizeof(*seq)) : NULL;
+            if (n && !seq) {
+                LOGE("oom");
+                goto error;
+            }
+            size_t j;
+            for (j = 0; j < n; j++) {
+                seq[j] = (CK_ULONG)get_u64(&v);
+            }
+            res = attr_list_add_buf(l, type, (CK_BYTE_PTR)seq, n * sizeof(*seq));
+            free(seq);
+        } break;
+        default:
+            LOGE("Unknown snapshot attribute kind %u for 0x%lx", kind, type);
+            res = false;
+        }
+
+        if (!res) {
+            LOGE("Could not add snapshot attribute 0x%lx", type);
+            goto error;
+        }
+    }
+
+    *attrs = l;
+    return true;
+
+error:
+    attr_list_free(l);
+    return false;
+}
+
+static CK_RV get_tobjects(cursor *c, token *t) {
+
+    uint32_t cnt = get_u32(c);
+
+    uint32_t i;
+    for (i = 0; i < cnt && !c->bad; i++) {
+
+        tobject *tobj = tobject_new();
+        if (!tobj) {
+            LOGE("oom");
+            return CKR_HOST_MEMORY;
+        }
+
+        tobj->id = get_u32(c);
+        if (!get_attrs(c, &tobj->attrs)) {
+            tobject_free(tobj);
+            return CKR_GENERAL_ERROR;
+        }
+
+        CK_RV rv = object_init_from_attrs(tobj);
+        if (rv != CKR_OK) {
+            LOGE("Object initialization failed");
+            tobject_free(tobj);
+            return rv;
+        }
+
+        rv = token_add_tobject_last(t, tobj);
+        if (rv != CKR_OK) {
+            tobject_free(tobj);
+            return rv;
+        }
+    }
+
+    return c->bad ? CKR_GENERAL_ERROR : CKR_OK;
+}
+
+static CK_RV get_pobject(cursor *c, token *t) {
+
+    pobject *pobj = &t->pobject;
+
+    pobj->config.is_transient = get_u8(c);
+    UNUSED(take(c, 3));
+
+    bool res = pobj->config.is_transient ?
+            get_str(c, &pobj->config.template_name) :
+            get_twist(c, &pobj->config.blob);
+    if (!res || !get_twist(c, &pobj->objauth)) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (!pobj->config.is_transient) {
+        if (!pobj->config.blob) {
+            LOGE("Expected persistent pobject to have ESYS_TR blob");
+            return CKR_GENERAL_ERROR;
+        }
+    } else if (!pobj->config.template_name) {
+        LOGE("Expected transient pobject to have a template name");
+        return CKR_GENERAL_ERROR;
+    }
+
+    /* the primary is brought up on first use, see token_pobject_load() */
+    return CKR_OK;
+}
+
+/*
+ * The config is the key value map of the token's config YAML, set with the
+ * same code as the YAML, so a key this library does not know is an error
+ * rather than silently dropped.
+ */
+static CK_RV get_config(cursor *c, token_config *config) {
+
+    uint32_t cnt = get_u32(c);
+
+    uint32_t i;
+    for (i = 0; i < cnt && !c->bad; i++) {
+        char *key = NULL;
+        char *value = NULL;
+        bool res = get_str(c, &key) && get_str(c, &value) && key;
+        if (res) {
+            res = parse_token_config_value(key, value ? value : "", config);
+            if (!res) {
+                LOGE("Bad snapshot token config key \"%s\"", key);
+            }
+        }
+        free(key);
+        free(value);
+        if (!res) {
+            return CKR_GENERAL_ERROR;
+        }
+    }
+
+    return c->bad ? CKR_GENERAL_ERROR : CKR_OK;
+}
+
+static CK_RV get_token(cursor *c, token *t) {
+
+    t->id = get_u32(c);
+    t->pid = get_u32(c);
+
+    uint32_t len;
+    const uint8_t *label = get_blob(c, &len);
+    if (c->bad || len > sizeof(t->label)) {
+        LOGE("Bad snapshot token label");
+        return CKR_GENERAL_ERROR;
+    }
+    memcpy(t->label, label, len);
+
+    CK_RV rv = get_config(c, &t->config);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    t->read_only = true;
+
+    rv = token_min_init(t);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = get_pobject(c, t);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    sealobject *s = &t->esysdb.sealobject;
+    bool res = get_twist(c, &s->userauthsalt)
+            && get_twist(c, &s->userpriv)
+            && get_twist(c, &s->userpub)
+            && get_twist(c, &s->soauthsalt)
+            && get_twist(c, &s->sopriv)
+            && get_twist(c, &s->sopub);
+    if (!res) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    /* uninitialized tokens are exported with no tobjects */
+    rv = get_tobjects(c, t);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    /* a snapshot never changes, there is nothing to refresh */
+    t->esysdb.tobjects_synced = true;
+
+    return CKR_OK;
+}
+
+CK_RV snapshot_get_tokens(token **tok, size_t *len) {
+
+    if (!global.base) {
+        LOGE("No snapshot mapped");
+        return CKR_GENERAL_ERROR;
+    }
+
+    token *tmp = calloc(MAX_TOKEN_CNT, sizeof(token));
+    if (!tmp) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    cursor c = {
+        .p = global.base + SNAPSHOT_HEADER_SIZE,
+        .left = global.size - SNAPSHOT_HEADER_SIZE,
+    };
+
+    size_t cnt;
+    for (cnt = 0; cnt < global.token_cnt; cnt++) {
+        CK_RV rv = get_token(&c, &tmp[cnt]);
+        if (rv != CKR_OK || c.bad) {
+            LOGE("Could not load token %zu from the snapshot", cnt);
+            /* the failed token is partly built, free it with the others */
+            token_free_list(tmp, cnt + 1);
+            return rv == CKR_OK ? CKR_GENERAL_ERROR : rv;
+        }
+    }
+
+    if (c.left) {
+        LOGW("Ignoring %zu trailing bytes in the snapshot", c.left);
+    }
+
+    *tok = tmp;
+    *len = cnt;
+
+    return CKR_OK;
+}
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_SNAPSHOT_H_
+#define SRC_LIB_SNAPSHOT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pkcs11.h"
+#include "token.h"
+
+/*
+ * A snapshot is a read-only image of a store written by
+ * "tpm2_ptool export-snapshot". It is selected by pointing
+ * TPM2_PKCS11_SNAPSHOT at the file, in which case the esysdb backend
+ * never opens the sqlite store. See docs/SNAPSHOT.md for the layout.
+ */
+#define SNAPSHOT_ENV "TPM2_PKCS11_SNAPSHOT"
+
+#define SNAPSHOT_MAGIC "TPM2P11S"
+#define SNAPSHOT_FORMAT_VERSION 2
+
+/**
+ * Maps a snapshot file and validates its header.
+ * @param path
+ *  The snapshot file.
+ * @return
+ *  CKR_OK on success, CKR_GENERAL_ERROR if the file cannot be mapped or
+ *  is not a snapshot this library understands.
+ */
+CK_RV snapshot_init(const char *path);
+
+/**
+ * Unmaps the snapshot, if any.
+ */
+void snapshot_destroy(void);
+
+/**
+ * Builds the tokens of the mapped snapshot, the same as db_get_tokens()
+ * does for a store. The tokens are marked read only.
+ * @param tok
+ *  The allocated token array, MAX_TOKEN_CNT entries.
+ * @param len
+ *  The number of tokens in tok.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV snapshot_get_tokens(token **tok, size_t *len);
+
+#endif /* SRC_LIB_SNAPSHOT_H_ */
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include "config.h"
 #include <assert.h>
+#include <string.h>
 
 #include <openssl/bn.h>
 #include <openssl/crypto.h>
@@ -95,21 +96,6 @@ int RSA_set0_key(RSA *r, BIGNUM *n, BIGNUM *e, BIGNUM *d) {
     return 1;
 }
 
-int ECDSA_SIG_set0(ECDSA_SIG *sig, BIGNUM *r, BIGNUM *s) {
-
-    if (!r || !s) {
-        return 0;
-    }
-
-    BN_free(sig->r);
-    BN_free(sig->s);
-
-    sig->r = r;
-    sig->s = s;
-
-    return 1;
-}
-
 EC_KEY *EVP_PKEY_get0_EC_KEY(EVP_PKEY *pkey) {
     if (pkey->type != EVP_PKEY_EC) {
         return NULL;
@@ -228,6 +214,13 @@ static CK_RV convert_pubkey_ECC(EC_KEY **outkey, attr_list *attrs) {
 
 CK_RV ssl_util_tobject_to_evp(EVP_PKEY **outpkey, tobject *obj) {
 
+    /* hand out another reference to the key built before */
+    if (obj->pkey) {
+        EVP_PKEY_up_ref(obj->pkey);
+        *outpkey = obj->pkey;
+        return CKR_OK;
+    }
+
     CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(obj->attrs, CKA_KEY_TYPE);
     if (!a) {
         LOGE("Expected object to have attribute CKA_KEY_TYPE");
@@ -279,6 +272,10 @@ CK_RV ssl_util_tobject_to_evp(EVP_PKEY **outpkey, tobject *obj) {
         return CKR_KEY_TYPE_INCONSISTENT;
     }
 
+    /* keep one reference for the next caller, see tobject_free() */
+    EVP_PKEY_up_ref(pkey);
+    obj->pkey = pkey;
+
     *outpkey = pkey;
 
     return CKR_OK;
@@ -436,46 +433,76 @@ static CK_RV do_sig_verify_rsa(EVP_PKEY *pkey,
     return rv;
 }
 
-static CK_RV create_ecdsa_sig(CK_BYTE_PTR sig, CK_ULONG siglen, ECDSA_SIG **outsig) {
+/*
+ * The length of the DER INTEGER content of the unsigned big endian value x,
+ * which may have leading zeros, and how many of them to skip. A set top bit
+ * needs a zero byte in front to keep the INTEGER positive.
+ */
+static size_t der_uint_len(const CK_BYTE *x, size_t len, size_t *skip) {
 
-    if (siglen & 1) {
-        LOGE("Expected ECDSA signature length to be even, got : %lu",
-                siglen);
-        return CKR_SIGNATURE_LEN_RANGE;
+    /* zero is a single zero byte */
+    size_t i = 0;
+    while (i < len - 1 && !x[i]) {
+        i++;
     }
 
-    size_t len = siglen >> 1;
+    *skip = i;
 
-    unsigned char *rbuf = sig;
-    unsigned char *sbuf = &sig[len];
+    return len - i + (x[i] & 0x80 ? 1 : 0);
+}
 
-    BIGNUM *r = BN_bin2bn(rbuf, len, NULL);
-    if (!r) {
-        LOGE("Could not make bignum for r");
-        return CKR_GENERAL_ERROR;
+static CK_BYTE_PTR der_put_uint(CK_BYTE_PTR p, const CK_BYTE *x, size_t len,
+        size_t skip, size_t content) {
+
+    *p++ = 0x02;
+    *p++ = content;
+    if (content > len - skip) {
+        *p++ = 0;
     }
 
-    BIGNUM *s = BN_bin2bn(sbuf, len, NULL);
-    if (!s) {
-        LOGE("Could not make bignum for s");
-        BN_free(r);
-        return CKR_GENERAL_ERROR;
+    memcpy(p, &x[skip], len - skip);
+
+    return p + len - skip;
+}
+
+CK_RV ssl_util_ecdsa_sig_to_der(const CK_BYTE *sig, CK_ULONG siglen,
+        CK_BYTE_PTR der, CK_ULONG_PTR derlen) {
+
+    if (!siglen || siglen & 1 || siglen > SSL_UTIL_ECDSA_MAX_SIG_LEN) {
+        LOGE("Expected ECDSA signature length to be even and at most %u, got : %lu",
+                SSL_UTIL_ECDSA_MAX_SIG_LEN, siglen);
+        return CKR_SIGNATURE_LEN_RANGE;
     }
 
-    ECDSA_SIG *ossl_sig = ECDSA_SIG_new();
-    if (!ossl_sig) {
-        LOGE("oom");
-        return CKR_HOST_MEMORY;
+    size_t len = siglen >> 1;
+
+    const CK_BYTE *r = sig;
+    const CK_BYTE *s = &sig[len];
+
+    /* with at most 66 bytes each, only the SEQUENCE may need a long length */
+    size_t rskip, sskip;
+    size_t rlen = der_uint_len(r, len, &rskip);
+    size_t slen = der_uint_len(s, len, &sskip);
+    size_t content = 2 + rlen + 2 + slen;
+    size_t total = content + (content < 0x80 ? 2 : 3);
+
+    if (*derlen < total) {
+        *derlen = total;
+        return CKR_BUFFER_TOO_SMALL;
     }
 
-    int rc = ECDSA_SIG_set0(ossl_sig, r, s);
-    if (!rc) {
-        LOGE("Could not call ECDSA_SIG_set0");
-        ECDSA_SIG_free(ossl_sig);
-        return CKR_GENERAL_ERROR;
+    CK_BYTE_PTR p = der;
+    *p++ = 0x30;
+    if (content >= 0x80) {
+        *p++ = 0x81;
     }
+    *p++ = content;
+
+    p = der_put_uint(p, r, len, rskip, rlen);
+    p = der_put_uint(p, s, len, sskip, slen);
+    assert((size_t)(p - der) == total);
 
-    *outsig = ossl_sig;
+    *derlen = total;
 
     return CKR_OK;
 }
@@ -497,19 +524,18 @@ static CK_RV do_sig_verify_ec(EVP_PKEY *pkey,
      *   https://github.com/tpm2-software/tpm2-pkcs11/issues/277
      * For details.
      */
-    ECDSA_SIG *ossl_sig = NULL;
-    CK_RV rv = create_ecdsa_sig(signature, signature_len, &ossl_sig);
+    CK_BYTE der[SSL_UTIL_ECDSA_DER_MAX(SSL_UTIL_ECDSA_MAX_SIG_LEN)];
+    CK_ULONG der_len = sizeof(der);
+    CK_RV rv = ssl_util_ecdsa_sig_to_der(signature, signature_len, der, &der_len);
     if (rv != CKR_OK) {
         return rv;
     }
 
-    int rc = ECDSA_do_verify(digest, digest_len, ossl_sig, eckey);
+    int rc = ECDSA_verify(0, digest, digest_len, der, der_len, eckey);
     if (rc < 0) {
-        ECDSA_SIG_free(ossl_sig);
-        SSL_UTIL_LOGE("ECDSA_do_verify failed");
+        SSL_UTIL_LOGE("ECDSA_verify failed");
         return CKR_GENERAL_ERROR;
     }
-    ECDSA_SIG_free(ossl_sig);
 
     return rc == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
 }
@@ -30,10 +30,13 @@ const unsigned char *ASN1_STRING_get0_data(const ASN1_STRING *x);
 
 int RSA_set0_key(RSA *r, BIGNUM *n, BIGNUM *e, BIGNUM *d);
 
-int ECDSA_SIG_set0(ECDSA_SIG *sig, BIGNUM *r, BIGNUM *s);
-
 EC_KEY *EVP_PKEY_get0_EC_KEY(EVP_PKEY *pkey);
 
+static inline int EVP_PKEY_up_ref(EVP_PKEY *pkey) {
+    CRYPTO_add(&pkey->references, 1, CRYPTO_LOCK_EVP_PKEY);
+    return 1;
+}
+
 static inline void *OPENSSL_memdup(const void *dup, size_t l) {
 
     void *p = OPENSSL_malloc(l);
@@ -67,6 +70,30 @@ CK_RV ssl_util_sig_verify(EVP_PKEY *pkey,
         CK_BYTE_PTR digest, CK_ULONG digest_len,
         CK_BYTE_PTR signature, CK_ULONG signature_len);
 
+/* r and s of the largest supported curve, P-521, are 66 bytes each */
+#define SSL_UTIL_ECDSA_MAX_SIG_LEN (2 * 66)
+
+/* the most bytes the DER encoding of a siglen bytes r || s signature takes */
+#define SSL_UTIL_ECDSA_DER_MAX(siglen) ((siglen) + 9)
+
+/**
+ * Encodes a PKCS#11 ECDSA signature, r and s of equal length concatenated,
+ * as the DER ECDSA-Sig-Value OpenSSL verifies, without allocating.
+ * @param sig
+ *  The r || s signature.
+ * @param siglen
+ *  The length of sig, even and at most SSL_UTIL_ECDSA_MAX_SIG_LEN.
+ * @param der
+ *  The buffer to write the encoding to.
+ * @param derlen
+ *  The size of der, set to the length of the encoding.
+ * @return
+ *  CKR_OK on success, CKR_SIGNATURE_LEN_RANGE for a bad siglen or
+ *  CKR_BUFFER_TOO_SMALL, with derlen set to the size needed.
+ */
+CK_RV ssl_util_ecdsa_sig_to_der(const CK_BYTE *sig, CK_ULONG siglen,
+        CK_BYTE_PTR der, CK_ULONG_PTR derlen);
+
 CK_RV ssl_util_verify_recover(EVP_PKEY *pkey,
         int padding, const EVP_MD *md,
         CK_BYTE_PTR signature, CK_ULONG signature_len,
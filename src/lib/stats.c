@@ -0,0 +1,393 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "stats.h"
+#include "tpm_sched.h"
+#include "tpm_stats.h"
+#include "utils.h"
+
+/*
+ * Statistics are enabled by setting TPM2_PKCS11_STATS to a file path,
+ * the JSON document is appended to that file on C_Finalize and on SIGUSR1.
+ * The special values "-" and "stderr" write to stderr instead.
+ */
+#define STATS_ENV "TPM2_PKCS11_STATS"
+
+static struct {
+    pthread_once_t once;
+    bool enabled;
+    const char *sink;
+    stats_site *sites;
+    volatile sig_atomic_t dump_requested;
+    bool handler_installed;
+    pthread_mutex_t dump_lock;
+} global = {
+    .once = PTHREAD_ONCE_INIT,
+    .dump_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void stats_read_env(void) {
+
+    const char *env = getenv(STATS_ENV);
+    if (!env || !env[0]) {
+        return;
+    }
+
+    global.sink = env;
+    global.enabled = true;
+}
+
+bool stats_is_enabled(void) {
+
+    pthread_once(&global.once, stats_read_env);
+    return global.enabled;
+}
+
+static void stats_sigusr1(int signum) {
+    UNUSED(signum);
+    /* async signal safe, the dump happens on the next entry point exit */
+    global.dump_requested = 1;
+}
+
+void stats_init(void) {
+
+    if (!stats_is_enabled() || global.handler_installed) {
+        return;
+    }
+
+    /*
+     * Never steal a handler from the application, only claim SIGUSR1
+     * if it is still at its default disposition.
+     */
+    struct sigaction old = { 0 };
+    int rc = sigaction(SIGUSR1, NULL, &old);
+    if (rc || old.sa_handler != SIG_DFL) {
+        LOGW("SIGUSR1 is in use, stats will only be written on C_Finalize");
+        return;
+    }
+
+    struct sigaction sa = { 0 };
+    sa.sa_handler = stats_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    rc = sigaction(SIGUSR1, &sa, NULL);
+    if (rc) {
+        LOGW("sigaction: %s", strerror(errno));
+        return;
+    }
+
+    global.handler_installed = true;
+}
+
+static void stats_dump(void) {
+
+    bool is_stderr = !strcmp(global.sink, "-") || !strcmp(global.sink, "stderr");
+
+    FILE *f = is_stderr ? stderr : fopen(global.sink, "a");
+    if (!f) {
+        LOGW("Could not open stats file \"%s\": %s", global.sink, strerror(errno));
+        return;
+    }
+
+    pthread_mutex_lock(&global.dump_lock);
+    stats_emit_json(f);
+    fputc('\n', f);
+    pthread_mutex_unlock(&global.dump_lock);
+
+    if (is_stderr) {
+        fflush(f);
+    } else {
+        fclose(f);
+    }
+}
+
+void stats_finalize(void) {
+
+    if (!stats_is_enabled()) {
+        return;
+    }
+
+    global.dump_requested = 0;
+    stats_dump();
+}
+
+static unsigned hist_index(uint64_t value) {
+
+    if (value < STATS_HIST_SUB_CNT) {
+        return (unsigned)value;
+    }
+
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - STATS_HIST_SUB_BITS;
+    unsigned sub = (unsigned)(value >> shift) & (STATS_HIST_SUB_CNT - 1);
+
+    return (shift + 1) * STATS_HIST_SUB_CNT + sub;
+}
+
+static uint64_t hist_lower_bound(unsigned index) {
+
+    if (index < STATS_HIST_SUB_CNT) {
+        return index;
+    }
+
+    unsigned shift = index / STATS_HIST_SUB_CNT - 1;
+    uint64_t sub = index % STATS_HIST_SUB_CNT;
+
+    return (STATS_HIST_SUB_CNT + sub) << shift;
+}
+
+static uint64_t hist_upper_bound(unsigned index) {
+
+    if (index < STATS_HIST_SUB_CNT) {
+        return index;
+    }
+
+    unsigned shift = index / STATS_HIST_SUB_CNT - 1;
+
+    return hist_lower_bound(index) + ((1ULL << shift) - 1);
+}
+
+void stats_hist_init(stats_hist *h) {
+
+    memset(h, 0, sizeof(*h));
+
+    /* any first record is below it */
+    h->min = UINT64_MAX;
+}
+
+void stats_hist_record(stats_hist *h, uint64_t value) {
+
+    __atomic_fetch_add(&h->buckets[hist_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+
+    /* cnt is bumped last so readers see min set */
+    uint64_t cur = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while (value < cur
+            && !__atomic_compare_exchange_n(&h->min, &cur, value, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > cur
+            && !__atomic_compare_exchange_n(&h->max, &cur, value, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    __atomic_fetch_add(&h->cnt, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t stats_hist_percentile(const stats_hist *h, double percentile) {
+
+    uint64_t cnt = __atomic_load_n(&h->cnt, __ATOMIC_ACQUIRE);
+    if (!cnt) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)((percentile / 100.0) * (double)cnt + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    unsigned i;
+    for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= target) {
+            uint64_t upper = hist_upper_bound(i);
+            return upper > h->max ? h->max : upper;
+        }
+    }
+
+    return h->max;
+}
+
+void stats_hist_emit_json(FILE *f, const stats_hist *h) {
+
+    uint64_t cnt = __atomic_load_n(&h->cnt, __ATOMIC_ACQUIRE);
+
+    fprintf(f, "{\"count\":%"PRIu64",\"min\":%"PRIu64",\"max\":%"PRIu64
+            ",\"mean\":%"PRIu64",\"p50\":%"PRIu64",\"p90\":%"PRIu64
+            ",\"p99\":%"PRIu64",\"p999\":%"PRIu64",\"buckets\":[",
+            cnt, cnt ? h->min : 0, h->max,
+            cnt ? h->sum / cnt : 0,
+            stats_hist_percentile(h, 50.0),
+            stats_hist_percentile(h, 90.0),
+            stats_hist_percentile(h, 99.0),
+            stats_hist_percentile(h, 99.9));
+
+    /* sparse [lower_bound, count] pairs so consumers can merge histograms */
+    bool first = true;
+    unsigned i;
+    for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+        uint64_t n = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (!n) {
+            continue;
+        }
+        fprintf(f, "%s[%"PRIu64",%"PRIu64"]", first ? "" : ",",
+                hist_lower_bound(i), n);
+        first = false;
+    }
+
+    fputs("]}", f);
+}
+
+static void site_register(stats_site *site) {
+
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&site->registered, &expected, 1, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    stats_site *head = __atomic_load_n(&global.sites, __ATOMIC_ACQUIRE);
+    do {
+        site->next = head;
+    } while (!__atomic_compare_exchange_n(&global.sites, &head, site, true,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+static stats_entry *site_get_entry(stats_site *site, unsigned tokid) {
+
+    if (tokid >= STATS_TOKEN_SLOTS) {
+        tokid = 0;
+    }
+
+    stats_entry *e = __atomic_load_n(&site->tokens[tokid], __ATOMIC_ACQUIRE);
+    if (e) {
+        return e;
+    }
+
+    stats_entry *n = calloc(1, sizeof(*n));
+    if (!n) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    stats_hist_init(&n->latency);
+    stats_hist_init(&n->lock_wait);
+    stats_hist_init(&n->lock_hold);
+
+    /* lost the race, use the winners entry */
+    if (!__atomic_compare_exchange_n(&site->tokens[tokid], &e, n, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(n);
+        return e;
+    }
+
+    return n;
+}
+
+void stats_call_end(stats_site *site, stats_call *c, unsigned tokid, CK_RV rv) {
+
+    if (!c->enabled) {
+        return;
+    }
+
+    uint64_t latency = stats_now() - c->start;
+
+    site_register(site);
+
+    stats_entry *e = site_get_entry(site, tokid);
+    if (e) {
+        __atomic_fetch_add(&e->calls, 1, __ATOMIC_RELAXED);
+        if (rv != CKR_OK) {
+            __atomic_fetch_add(&e->errors, 1, __ATOMIC_RELAXED);
+        }
+
+        stats_hist_record(&e->latency, latency);
+        if (c->locked) {
+            stats_hist_record(&e->lock_wait, c->lock_wait);
+            stats_hist_record(&e->lock_hold, c->lock_hold);
+        }
+    }
+
+    if (global.dump_requested) {
+        global.dump_requested = 0;
+        stats_dump();
+    }
+}
+
+void stats_emit_json(FILE *f) {
+
+    fputs("{\"unit\":\"ns\",\"entry_points\":[", f);
+
+    bool first = true;
+    stats_site *site = __atomic_load_n(&global.sites, __ATOMIC_ACQUIRE);
+    for (; site; site = site->next) {
+        unsigned i;
+        for (i = 0; i < STATS_TOKEN_SLOTS; i++) {
+            stats_entry *e = __atomic_load_n(&site->tokens[i], __ATOMIC_ACQUIRE);
+            if (!e) {
+                continue;
+            }
+
+            fprintf(f, "%s{\"function\":\"%s\",\"token\":%u"
+                    ",\"calls\":%"PRIu64",\"errors\":%"PRIu64",\"latency\":",
+                    first ? "" : ",", site->name, i,
+                    __atomic_load_n(&e->calls, __ATOMIC_RELAXED),
+                    __atomic_load_n(&e->errors, __ATOMIC_RELAXED));
+            stats_hist_emit_json(f, &e->latency);
+            fputs(",\"lock_wait\":", f);
+            stats_hist_emit_json(f, &e->lock_wait);
+            fputs(",\"lock_hold\":", f);
+            stats_hist_emit_json(f, &e->lock_hold);
+            fputc('}', f);
+            first = false;
+        }
+    }
+
+    fputs("],\"tpm_commands\":", f);
+    tpm_stats_emit_json(f);
+    fputs(",\"tpm_scheduler\":", f);
+    tpm_sched_emit_json(f);
+    fputc('}', f);
+}
+
+CK_RV stats_get_json(CK_BYTE_PTR buf, CK_ULONG_PTR len) {
+
+    if (!len) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (!stats_is_enabled()) {
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    }
+
+    char *doc = NULL;
+    size_t doc_len = 0;
+    FILE *f = open_memstream(&doc, &doc_len);
+    if (!f) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    stats_emit_json(f);
+    if (fclose(f)) {
+        free(doc);
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_RV rv = CKR_OK;
+    CK_ULONG needed = doc_len + 1;
+    if (buf) {
+        if (*len < needed) {
+            rv = CKR_BUFFER_TOO_SMALL;
+        } else {
+            memcpy(buf, doc, needed);
+        }
+    }
+
+    *len = needed;
+    free(doc);
+
+    return rv;
+}
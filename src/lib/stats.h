@@ -0,0 +1,193 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_STATS_H_
+#define SRC_LIB_STATS_H_
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "pkcs11.h"
+
+/*
+ * Histogram layout: values below 2^STATS_HIST_SUB_BITS get an exact bucket,
+ * everything above gets 2^STATS_HIST_SUB_BITS linear sub-buckets per power
+ * of two (HDR style), bounding the relative error of a reported value to
+ * 1/2^STATS_HIST_SUB_BITS.
+ */
+#define STATS_HIST_SUB_BITS 3
+#define STATS_HIST_SUB_CNT  (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_BUCKETS  ((64 - STATS_HIST_SUB_BITS + 1) * STATS_HIST_SUB_CNT)
+
+/* index 0 is used for calls that are not bound to a token */
+#define STATS_TOKEN_SLOTS 256
+
+typedef struct stats_hist stats_hist;
+struct stats_hist {
+    uint64_t cnt;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+typedef struct stats_entry stats_entry;
+struct stats_entry {
+    uint64_t calls;
+    uint64_t errors;
+    stats_hist latency;
+    stats_hist lock_wait;
+    stats_hist lock_hold;
+};
+
+/*
+ * A stats_site is a statically allocated per entry-point record, it
+ * registers itself on first use and allocates per-token entries lazily.
+ */
+typedef struct stats_site stats_site;
+struct stats_site {
+    const char *name;
+    stats_site *next;
+    int registered;
+    stats_entry *tokens[STATS_TOKEN_SLOTS];
+};
+
+#define STATS_SITE_INIT(n) { .name = n }
+
+/*
+ * Per call scratch state, lives on the stack of the entry point.
+ */
+typedef struct stats_call stats_call;
+struct stats_call {
+    bool enabled;
+    uint64_t start;
+    uint64_t lock_start;
+    uint64_t locked;
+    uint64_t lock_wait;
+    uint64_t lock_hold;
+};
+
+static inline uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Returns true when statistics collection was requested through the
+ * TPM2_PKCS11_STATS environment variable.
+ */
+bool stats_is_enabled(void);
+
+/**
+ * Installs the SIGUSR1 dump handler if statistics are enabled.
+ * Called from C_Initialize.
+ */
+void stats_init(void);
+
+/**
+ * Writes the statistics to the configured sink if statistics are enabled.
+ * Called from C_Finalize.
+ */
+void stats_finalize(void);
+
+/**
+ * Readies an empty histogram, a zeroed one is not, as 0 is a valid minimum.
+ * @param h
+ *  The histogram to initialize.
+ */
+void stats_hist_init(stats_hist *h);
+
+/**
+ * Records a value into a histogram, safe to call from multiple threads.
+ * @param h
+ *  The histogram to update.
+ * @param value
+ *  The value, typically a duration in nanoseconds.
+ */
+void stats_hist_record(stats_hist *h, uint64_t value);
+
+/**
+ * Computes the value at a given percentile of a histogram.
+ * @param h
+ *  The histogram.
+ * @param percentile
+ *  The percentile in the range [0, 100].
+ * @return
+ *  The upper bound of the bucket containing the percentile.
+ */
+uint64_t stats_hist_percentile(const stats_hist *h, double percentile);
+
+/**
+ * Emits a histogram as a JSON object.
+ * @param f
+ *  The stream to write to.
+ * @param h
+ *  The histogram to write.
+ */
+void stats_hist_emit_json(FILE *f, const stats_hist *h);
+
+static inline void stats_call_start(stats_call *c) {
+    c->enabled = stats_is_enabled();
+    if (c->enabled) {
+        c->start = stats_now();
+    }
+}
+
+static inline void stats_call_lock_attempt(stats_call *c) {
+    if (c->enabled) {
+        c->lock_start = stats_now();
+    }
+}
+
+static inline void stats_call_lock_acquired(stats_call *c) {
+    if (c->enabled) {
+        c->locked = stats_now();
+        c->lock_wait = c->locked - c->lock_start;
+    }
+}
+
+static inline void stats_call_lock_released(stats_call *c) {
+    if (c->enabled) {
+        c->lock_hold = stats_now() - c->locked;
+    }
+}
+
+/**
+ * Finishes accounting for an entry point call.
+ * @param site
+ *  The entry point's site record.
+ * @param c
+ *  The per call state, filled in by the stats_call_* helpers.
+ * @param tokid
+ *  The token id the call operated on or 0 if none.
+ * @param rv
+ *  The return value of the call.
+ */
+void stats_call_end(stats_site *site, stats_call *c, unsigned tokid, CK_RV rv);
+
+/**
+ * Writes all collected statistics as a JSON document.
+ * @param f
+ *  The stream to write to.
+ */
+void stats_emit_json(FILE *f);
+
+/**
+ * Vendor entry point returning collected statistics as a JSON document,
+ * using the usual cryptoki two call convention for sizing the buffer.
+ * @param buf
+ *  The buffer to write to or NULL to query the size.
+ * @param len
+ *  The size of buf on input, the size of the document, including the
+ *  terminating NUL byte, on output.
+ * @return
+ *  CKR_OK on success, CKR_BUFFER_TOO_SMALL if buf cannot hold the
+ *  document and CKR_FUNCTION_NOT_SUPPORTED if stats are disabled.
+ */
+CK_RV stats_get_json(CK_BYTE_PTR buf, CK_ULONG_PTR len);
+
+#endif /* SRC_LIB_STATS_H_ */
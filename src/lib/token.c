@@ -7,13 +7,17 @@
 #include <string.h>
 #include <time.h>
 
+#include <openssl/crypto.h>
+
 #include "attrs.h"
 #include "backend.h"
 #include "checks.h"
+#include "keypool.h"
 #include "list.h"
 #include "mech.h"
 #include "object.h"
 #include "pkcs11.h"
+#include "prewarm.h"
 #include "session.h"
 #include "session_table.h"
 #include "slot.h"
@@ -52,26 +56,150 @@ WEAK CK_RV token_min_init(token *t) {
     }
 
     /*
-     * Initialize the per-token tpm context
+     * The tpm context and mechanism details table are left to
+     * token_tpm_load(), most processes only ever use one token.
      */
-    rv = backend_ctx_new(t);
+    rv = mutex_create(&t->mutex);
     if (rv != CKR_OK) {
-        LOGE("Could not initialize tpm ctx: 0x%lx", rv);
+        LOGE("Could not initialize mutex: 0x%lx", rv);
+    }
+
+    return rv;
+}
+
+/*
+ * Loads the context of a transient primary another process saved, or
+ * creates the primary and saves its context for the next process. A saved
+ * context is only good until the next TPM Reset, so it is stored along
+ * with the TPM's resetCount.
+ */
+static CK_RV pobject_load_transient(token *t) {
+
+    pobject *pobj = &t->pobject;
+
+    uint32_t reset_count = 0;
+    CK_RV rv = tpm_get_reset_count(t->tctx, &reset_count);
+    bool can_save = rv == CKR_OK;
+    if (can_save) {
+        uint32_t saved_count = 0;
+        twist context = NULL;
+        rv = backend_get_pobject_context(t, &saved_count, &context);
+        if (rv == CKR_OK && context && saved_count == reset_count) {
+            rv = tpm_load_transient_primary_context(t->tctx,
+                    pobj->config.template_name, pobj->objauth, context,
+                    &pobj->handle);
+            if (rv == CKR_OK) {
+                twist_free(context);
+                return CKR_OK;
+            }
+            LOGV("Could not load the saved primary context, creating the primary");
+        }
+        twist_free(context);
+    }
+
+    rv = tpm_create_transient_primary_from_template(t->tctx,
+            pobj->config.template_name, pobj->objauth, &pobj->handle);
+    if (rv != CKR_OK || !can_save) {
         return rv;
     }
 
+    /* the primary is usable either way, a read only store just can't keep it */
+    twist context = NULL;
+    CK_RV tmp = tpm_save_primary_context(t->tctx, pobj->handle, &context);
+    if (tmp == CKR_OK) {
+        tmp = backend_set_pobject_context(t, reset_count, context);
+        twist_free(context);
+    }
+    if (tmp != CKR_OK) {
+        LOGV("Could not save the primary context: 0x%lx", tmp);
+    }
+
+    return CKR_OK;
+}
+
+/*
+ * Brings up the primary object read from the store. Tokens without one
+ * yet, or whose backend loads it itself, are left alone.
+ */
+static CK_RV pobject_load(token *t) {
+
+    pobject *pobj = &t->pobject;
+    if (pobj->handle) {
+        return CKR_OK;
+    }
+
+    if (pobj->config.is_transient) {
+        return !pobj->config.template_name ? CKR_OK :
+                pobject_load_transient(t);
+    }
+
+    if (!pobj->config.blob) {
+        return CKR_OK;
+    }
+
+    bool res = tpm_deserialize_handle(t->tctx, pobj->config.blob, &pobj->handle, NULL);
+    return res ? CKR_OK : CKR_GENERAL_ERROR;
+}
+
+CK_RV token_tpm_load(token *t) {
+
+    CK_RV rv;
+
+    /*
+     * Initialize the per-token tpm context
+     */
+    if (!t->tctx) {
+        rv = backend_ctx_new(t);
+        if (rv != CKR_OK) {
+            LOGE("Could not initialize tpm ctx: 0x%lx", rv);
+            return rv;
+        }
+    }
+
     /*
      * Initalize the per-token mechanism details table
      */
-    rv = mdetail_new(t->tctx, &t->mdtl, t->config.pss_sigs_good);
+    if (!t->mdtl) {
+        rv = mdetail_new(t->tctx, &t->mdtl, t->config.pss_sigs_good);
+        if (rv != CKR_OK) {
+            LOGE("Could not initialize tpm mdetails: 0x%lx", rv);
+            return rv;
+        }
+    }
+
+    return CKR_OK;
+}
+
+CK_RV token_pobject_load(token *t) {
+
+    CK_RV rv = token_tpm_load(t);
     if (rv != CKR_OK) {
-        LOGE("Could not initialize tpm mdetails: 0x%lx", rv);
         return rv;
     }
 
-    rv = mutex_create(&t->mutex);
+    rv = pobject_load(t);
     if (rv != CKR_OK) {
-        LOGE("Could not initialize mutex: 0x%lx", rv);
+        LOGE("Could not load primary object: 0x%lx", rv);
+    }
+
+    return rv;
+}
+
+CK_RV token_auth_session_load(token *t) {
+
+    if (t->login_state != token_user_logged_in
+            || tpm_session_active(t->tctx)) {
+        return CKR_OK;
+    }
+
+    CK_RV rv = token_pobject_load(t);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = tpm_session_start(t->tctx, t->pobject.objauth, t->pobject.handle);
+    if (rv != CKR_OK) {
+        LOGE("Could not start Auth Session with the TPM.");
     }
 
     return rv;
@@ -79,6 +207,13 @@ WEAK CK_RV token_min_init(token *t) {
 
 void token_reset(token *t) {
 
+    /*
+     * the key pool worker copied the primary object it was started with,
+     * join it so the next login starts one for the new primary
+     */
+    keypool_free(t->keypool);
+    t->keypool = NULL;
+
     /* forget the primary object so it can be reinitialized as needed */
     pobject_free(&t->pobject);
 
@@ -237,6 +372,26 @@ void token_rm_tobject(token *tok, tobject *t) {
     t->l.next = t->l.prev = NULL;
 }
 
+void token_replace_tobject(token *tok, tobject *old, tobject *t) {
+
+    t->obj_handle = old->obj_handle;
+    t->l = old->l;
+
+    if (t->l.prev) {
+        t->l.prev->next = &t->l;
+    } else {
+        tok->tobjects.head = t;
+    }
+
+    if (t->l.next) {
+        t->l.next->prev = &t->l;
+    } else {
+        tok->tobjects.tail = t;
+    }
+
+    old->l.next = old->l.prev = NULL;
+}
+
 void token_config_free(token_config *c) {
 
     if (!c) {
@@ -244,11 +399,24 @@ void token_config_free(token_config *c) {
     }
 
     free(c->tcti);
+    free(c->key_pool);
+    free(c->prewarm);
+    free(c->pin_kdf);
     memset(c, 0, sizeof(*c));
 }
 
 void token_free(token *t) {
 
+    /* the workers use the primary object, stop them first */
+    keypool_free(t->keypool);
+    t->keypool = NULL;
+
+    prewarm_free(t->prewarm);
+    t->prewarm = NULL;
+
+    utils_pin_verifier_clear(&t->user_verifier);
+    token_user_sealauth_set(t, NULL);
+
     /*
      * for each session remove them
      */
@@ -256,7 +424,7 @@ void token_free(token *t) {
     session_table_free(t->s_table);
     t->s_table = NULL;
 
-    if (t->pobject.config.is_transient) {
+    if (t->tctx && t->pobject.handle && t->pobject.config.is_transient) {
         tpm_flushcontext(t->tctx, t->pobject.handle);
     }
 
@@ -293,7 +461,7 @@ CK_RV token_get_info (token *t, CK_TOKEN_INFO *info) {
 
     memset(info, 0, sizeof(*info));
 
-    rval = tpm_get_token_info(t->tctx, info);
+    rval = slot_get_tpm_info(t, info);
     if (rval != CKR_OK) {
         return CKR_GENERAL_ERROR;
     }
@@ -307,6 +475,10 @@ CK_RV token_get_info (token *t, CK_TOKEN_INFO *info) {
         info->flags |= CKF_USER_PIN_INITIALIZED;
     }
 
+    if (t->read_only) {
+        info->flags |= CKF_WRITE_PROTECTED;
+    }
+
     // Identification
     str_padded_copy(info->label, t->label, sizeof(info->label));
     str_padded_copy(info->serialNumber, (unsigned char*) TPM2_TOKEN_SERIAL_NUMBER, sizeof(info->serialNumber));
@@ -361,6 +533,11 @@ CK_RV token_init(token *t, CK_BYTE_PTR pin, CK_ULONG pin_len, CK_BYTE_PTR label)
         return CKR_ARGUMENTS_BAD;
     }
 
+    rv = token_pobject_load(t);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
     twist sopin = twistbin_new(pin, pin_len);
     if (!sopin) {
         LOGE("oom");
@@ -374,7 +551,7 @@ CK_RV token_init(token *t, CK_BYTE_PTR pin, CK_ULONG pin_len, CK_BYTE_PTR label)
         goto out;
     }
 
-    rv = utils_setup_new_object_auth(sopin, &newauth, &newsalthex);
+    rv = utils_setup_new_object_auth(sopin, t->config.pin_kdf, &newauth, &newsalthex);
     if (rv != CKR_OK) {
         goto error;
     }
@@ -418,6 +595,27 @@ bool token_is_user_logged_in(token *tok) {
     return tok->login_state & token_user_logged_in;
 }
 
+void token_user_sealauth_set(token *tok, twist auth) {
+
+    if (tok->user_sealauth) {
+        OPENSSL_cleanse((void *)tok->user_sealauth, twist_len(tok->user_sealauth));
+        twist_free(tok->user_sealauth);
+    }
+
+    tok->user_sealauth = auth;
+}
+
+twist token_sealauth_for_pin(token *tok, bool user, twist pin, twist salt) {
+
+    /* the verifier holds the PIN the kept auth was derived from */
+    if (user && tok->user_sealauth && tok->user_verifier.is_set
+            && utils_pin_verifier_check(&tok->user_verifier, pin)) {
+        return twist_dup(tok->user_sealauth);
+    }
+
+    return utils_hash_pass(pin, salt);
+}
+
 bool token_is_so_logged_in(token *tok) {
 
     return tok->login_state & token_so_logged_in;
@@ -429,6 +627,9 @@ void token_lock(token *t) {
 }
 
 void token_unlock(token *t) {
+    if (t->keypool) {
+        keypool_touch(t->keypool);
+    }
     mutex_unlock_fatal(t->mutex);
 }
 
@@ -454,12 +655,25 @@ CK_RV token_setpin(token *tok, CK_UTF8CHAR_PTR oldpin, CK_ULONG oldlen, CK_UTF8C
         goto out;
     }
 
+    rv = token_pobject_load(tok);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
     rv = backend_token_changeauth(tok, !is_so, toldpin, tnewpin);
     if (rv != CKR_OK) {
         LOGE("Changing token auth");
         goto out;
     }
 
+    /* context specific logins from now on need the new PIN */
+    if (tok->login_state == token_user_logged_in) {
+        CK_RV tmp_rv = utils_pin_verifier_set(&tok->user_verifier, tnewpin);
+        if (tmp_rv != CKR_OK) {
+            LOGW("No PIN verifier, context specific logins use the TPM");
+        }
+    }
+
 out:
 
     twist_free(toldpin);
@@ -489,7 +703,8 @@ CK_RV token_initpin(token *tok, CK_UTF8CHAR_PTR newpin, CK_ULONG newlen) {
     }
 
     /* generate a new auth */
-    rv = utils_setup_new_object_auth(tnewpin, &newauthhex, &newsalthex);
+    rv = utils_setup_new_object_auth(tnewpin, tok->config.pin_kdf,
+            &newauthhex, &newsalthex);
     if (rv != CKR_OK) {
         goto out;
     }
@@ -570,15 +785,45 @@ CK_RV token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj)
         return CKR_OK;
     }
 
-    rv = tpm_loadobj(
-            tpm,
-            tok->pobject.handle, tok->pobject.objauth,
-            tobj->pub, tobj->priv,
-            &tobj->tpm_handle);
+    rv = token_auth_session_load(tok);
     if (rv != CKR_OK) {
         return rv;
     }
 
+    /*
+     * Keys pinned with tpm2_ptool persist are already in the TPM, use the
+     * persistent handle and fall back to loading the key if it is gone.
+     */
+    a = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_PERSISTENT_TR);
+    if (a && a->pValue && a->ulValueLen && tobj->priv) {
+        twist tr_blob = twistbin_new(a->pValue, a->ulValueLen);
+        if (!tr_blob) {
+            LOGE("oom");
+            return CKR_HOST_MEMORY;
+        }
+
+        rv = tpm_load_persistent(tpm, tr_blob, tobj->pub, &tobj->tpm_handle);
+        twist_free(tr_blob);
+        if (rv == CKR_OK) {
+            tobj->tpm_handle_persistent = true;
+        } else {
+            LOGW("Could not use the persistent handle of tobj id %u,"
+                    " loading it", tobj->id);
+            tobj->tpm_handle = 0;
+        }
+    }
+
+    if (!tobj->tpm_handle) {
+        rv = tpm_loadobj(
+                tpm, tobj->id,
+                tok->pobject.handle, tok->pobject.objauth,
+                tobj->pub, tobj->priv,
+                &tobj->tpm_handle);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+
     rv = utils_ctx_unwrap_objauth(tok->wrappingkey, tobj->objauth,
             &tobj->unsealed_auth);
     if (rv != CKR_OK) {
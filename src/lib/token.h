@@ -17,11 +17,36 @@ enum pss_config_state {
     pss_config_state_good,
 };
 
+typedef enum token_durability token_durability;
+enum token_durability {
+    token_durability_full = 0, /* every object write is committed before returning */
+    token_durability_batch,    /* object writes are group committed, see db_flush() */
+};
+
+typedef enum token_attr_store token_attr_store;
+enum token_attr_store {
+    token_attr_store_yaml = 0, /* object attributes are one YAML document per object */
+    token_attr_store_table,    /* one tobject_attrs row per attribute, see db.c */
+};
+
+typedef enum token_context_login token_context_login;
+enum token_context_login {
+    token_context_login_host = 0, /* checked against the verifier of the user login */
+    token_context_login_tpm,      /* unseals the wrapping key every time */
+};
+
 typedef struct token_config token_config;
 struct token_config {
     bool is_initialized;  /* token initialization state */
     char *tcti;           /* token specific tcti config */
     pss_config_state pss_sigs_good;
+    token_durability durability;
+    token_attr_store attr_store;
+    char *key_pool;       /* key-pool config, see keypool_spec_parse() */
+    token_context_login context_login; /* how CKU_CONTEXT_SPECIFIC logins are checked */
+    unsigned login_cache_ttl; /* seconds user logins stay in the session keyring, 0 disables */
+    char *prewarm;        /* prewarm config, see prewarm_spec_valid() */
+    char *pin_kdf;        /* KDF of new PINs, see utils_pin_kdf_parse(), NULL for the default */
 };
 
 typedef struct session_table session_table;
@@ -36,6 +61,10 @@ enum token_login_state {
 
 typedef struct tobject tobject;
 
+typedef struct keypool keypool;
+
+typedef struct prewarm prewarm;
+
 typedef struct pobject_config pobject_config;
 struct pobject_config {
     bool is_transient;
@@ -82,11 +111,16 @@ struct token {
 
     token_config config;
 
+    bool read_only; /* the backing store cannot be written, eg a snapshot */
+
     pobject pobject;
 
     union { /* anon union for backend data */
         struct {
             sealobject sealobject;
+            /* store data_version the tobjects were last synced at */
+            int data_version;
+            bool tobjects_synced;
         } esysdb; /* esysdb */
         struct {
             void *ctx;
@@ -109,8 +143,15 @@ struct token {
 
     token_login_state login_state;
 
+    pin_verifier user_verifier; /* user PIN while the user is logged in, checks context specific logins */
+    twist user_sealauth; /* seal object auth derived at the user login, spares C_SetPIN the KDF */
+
     mdetail *mdtl;
 
+    keypool *keypool; /* NULL without a key-pool config or before the first user login */
+
+    prewarm *prewarm; /* NULL without a prewarm config or before the first user login */
+
     void *mutex;
 };
 
@@ -169,6 +210,19 @@ CK_RV token_add_tobject_last(token *tok, tobject *t);
 
 void token_rm_tobject(token *tok, tobject *t);
 
+/**
+ * Puts a tobject in the place of another one in the token tobject list.
+ * The new tobject takes over the object handle, so handles the application
+ * holds stay valid.
+ * @param tok
+ *  The token whose list to modify.
+ * @param old
+ *  The tobject to replace, it is unlinked but not freed.
+ * @param t
+ *  The tobject to insert.
+ */
+void token_replace_tobject(token *tok, tobject *old, tobject *t);
+
 CK_RV token_get_info(token *t, CK_TOKEN_INFO *info);
 
 /**
@@ -182,6 +236,34 @@ bool token_is_any_user_logged_in(token *tok);
 
 bool token_is_user_logged_in(token *tok);
 
+/**
+ * Replaces the seal object auth kept for the logged in user, cleansing the
+ * old one.
+ * @param tok
+ *  The token.
+ * @param auth
+ *  The auth derived from the user PIN, the token takes ownership. NULL
+ *  only clears it.
+ */
+void token_user_sealauth_set(token *tok, twist auth);
+
+/**
+ * Derives the seal object auth of a PIN for a PIN change. The auth of the
+ * user login is reused when the PIN is the one the user logged in with,
+ * which spares running the KDF again.
+ * @param tok
+ *  The token.
+ * @param user
+ *  true for the user PIN, false for the SO PIN.
+ * @param pin
+ *  The PIN.
+ * @param salt
+ *  The salt of the seal object.
+ * @return
+ *  The hex encoded auth value, NULL on error.
+ */
+twist token_sealauth_for_pin(token *tok, bool user, twist pin, twist salt);
+
 bool token_is_so_logged_in(token *tok);
 
 /**
@@ -217,6 +299,43 @@ void token_unlock(token *t);
 CK_RV token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj);
 
 CK_RV token_min_init(token *t);
+
+/**
+ * Creates the tpm context and builds the mechanism details table of a
+ * token, the parts token_min_init() leaves for first use. Does nothing for
+ * the parts already there. The caller holds the token lock.
+ * @param t
+ *  The token to load.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV token_tpm_load(token *t);
+
+/**
+ * Does what token_tpm_load() does and brings up the primary object, for
+ * the operations that need it as a parent. A transient primary is loaded
+ * from the context a process saved since the last TPM Reset, or created
+ * and its context saved. The caller holds the token lock.
+ * @param t
+ *  The token to load.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV token_pobject_load(token *t);
+
+/**
+ * Brings up the primary object and the auth session of a logged in user
+ * for an operation that needs the TPM. A login served by the login cache
+ * leaves both for the first such operation. The caller holds the token
+ * lock.
+ * @param t
+ *  The token.
+ * @return
+ *  CKR_OK on success, including when no user is logged in or the session
+ *  is already active.
+ */
+CK_RV token_auth_session_load(token *t);
+
 void token_reset(token *t);
 
 CK_RV token_init(token *t, CK_BYTE_PTR pin, CK_ULONG pin_len, CK_BYTE_PTR label);
@@ -12,6 +12,7 @@
 
 #include <openssl/asn1.h>
 #include <openssl/bn.h>
+#include <openssl/crypto.h>
 #include <openssl/ec.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
@@ -30,8 +31,11 @@
 #include "log.h"
 #include "mutex.h"
 #include "pkcs11.h"
+#include "probes.h"
 #include "ssl_util.h"
 #include "tpm.h"
+#include "tpm_sched.h"
+#include "tpm_stats.h"
 
 #ifndef ESAPI_MANAGE_FLAGS
 #define ESAPI_MANAGE_FLAGS 0
@@ -157,8 +161,22 @@ static const char *TPM2_MANUFACTURER_MAP[][2] = {
     {"STM ", "STMicro"}
 };
 
+/* how many handles set_esys_auth() remembers the auth of */
+#define TPM_AUTH_CACHE_SIZE 16
+
+typedef struct tpm_auth_cache_entry tpm_auth_cache_entry;
+struct tpm_auth_cache_entry {
+    bool used;
+    ESYS_TR handle;
+    TPM2B_AUTH auth;
+};
+
 struct tpm_ctx {
     TSS2_TCTI_CONTEXT *tcti_ctx;
+    /* tcti_ctx or the stats wrapper around it */
+    TSS2_TCTI_CONTEXT *tcti_stats;
+    /* what ESAPI talks to, tcti_stats or the scheduler wrapper around it */
+    TSS2_TCTI_CONTEXT *tcti_esys;
     ESYS_CONTEXT *esys_ctx;
     bool esapi_manage_session_flags;
     ESYS_TR hmac_session;
@@ -173,6 +191,14 @@ struct tpm_ctx {
 
     bool did_check_for_encdec2;
     bool use_encdec2;
+
+    /*
+     * The auth last set on each handle, so set_esys_auth() can skip setting
+     * the same one again. Entries go when their handle is flushed or closed,
+     * as ESAPI hands out the same ESYS_TR to the next object.
+     */
+    tpm_auth_cache_entry auth_cache[TPM_AUTH_CACHE_SIZE];
+    unsigned auth_cache_next;
 };
 
 #define TPM2B_INIT(xsize) { .size = xsize, }
@@ -192,6 +218,8 @@ struct tpm_op_data {
 
     CK_KEY_TYPE op_type;
 
+    CK_MECHANISM_TYPE mech;
+
     union {
         struct {
             TPMT_SIG_SCHEME sig;
@@ -208,8 +236,12 @@ struct tpm_op_data {
     };
 };
 
-static inline tpm_op_data *tpm_opdata_new(void) {
-    return (tpm_op_data *)calloc(1, sizeof(tpm_op_data));
+static inline tpm_op_data *tpm_opdata_new(CK_MECHANISM_PTR mech) {
+    tpm_op_data *opdata = (tpm_op_data *)calloc(1, sizeof(tpm_op_data));
+    if (opdata) {
+        opdata->mech = mech->mechanism;
+    }
+    return opdata;
 }
 
 static ESYS_CONTEXT* esys_ctx_init(TSS2_TCTI_CONTEXT *tcti_ctx) {
@@ -276,12 +308,36 @@ void tpm_ctx_free(tpm_ctx *ctx) {
     SAFE_ESYS_FREE(ctx->tpms_fixed_property_cache);
 
     Esys_Finalize(&ctx->esys_ctx);
+    OPENSSL_cleanse(ctx->auth_cache, sizeof(ctx->auth_cache));
+    tpm_sched_tcti_free(ctx->tcti_stats, ctx->tcti_esys);
+    tpm_stats_tcti_free(ctx->tcti_ctx, ctx->tcti_stats);
     Tss2_TctiLdr_Finalize(&ctx->tcti_ctx);
 
     free(ctx);
 }
 
-static bool set_esys_auth(ESYS_CONTEXT *esys_ctx, ESYS_TR handle, twist auth) {
+static tpm_auth_cache_entry *auth_cache_find(tpm_ctx *ctx, ESYS_TR handle) {
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(ctx->auth_cache); i++) {
+        tpm_auth_cache_entry *e = &ctx->auth_cache[i];
+        if (e->used && e->handle == handle) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+static void auth_cache_drop(tpm_ctx *ctx, ESYS_TR handle) {
+
+    tpm_auth_cache_entry *e = auth_cache_find(ctx, handle);
+    if (e) {
+        OPENSSL_cleanse(e, sizeof(*e));
+    }
+}
+
+static bool set_esys_auth(tpm_ctx *ctx, ESYS_TR handle, twist auth) {
 
     TPM2B_AUTH tpm_auth = TPM2B_EMPTY_INIT;
 
@@ -297,12 +353,32 @@ static bool set_esys_auth(ESYS_CONTEXT *esys_ctx, ESYS_TR handle, twist auth) {
         memcpy(tpm_auth.buffer, auth, auth_len);
     }
 
-    TSS2_RC rval = Esys_TR_SetAuth(esys_ctx, handle, &tpm_auth);
+    /* back to back operations with one key set the same auth */
+    tpm_auth_cache_entry *e = auth_cache_find(ctx, handle);
+    if (e && e->auth.size == tpm_auth.size
+            && !CRYPTO_memcmp(e->auth.buffer, tpm_auth.buffer, tpm_auth.size)) {
+        OPENSSL_cleanse(&tpm_auth, sizeof(tpm_auth));
+        return true;
+    }
+
+    TSS2_RC rval = Esys_TR_SetAuth(ctx->esys_ctx, handle, &tpm_auth);
     if (rval != TSS2_RC_SUCCESS) {
         LOGE("Esys_TR_SetAuth: 0x%x:", rval);
+        auth_cache_drop(ctx, handle);
+        OPENSSL_cleanse(&tpm_auth, sizeof(tpm_auth));
         return false;
     }
 
+    if (!e) {
+        e = &ctx->auth_cache[ctx->auth_cache_next];
+        ctx->auth_cache_next = (ctx->auth_cache_next + 1) % ARRAY_LEN(ctx->auth_cache);
+    }
+
+    e->used = true;
+    e->handle = handle;
+    e->auth = tpm_auth;
+    OPENSSL_cleanse(&tpm_auth, sizeof(tpm_auth));
+
     return true;
 }
 
@@ -314,7 +390,7 @@ CK_RV tpm_session_start(tpm_ctx *ctx, twist auth, uint32_t handle) {
 
     assert(!ctx->hmac_session);
 
-    bool res = set_esys_auth(ctx->esys_ctx, handle, auth);
+    bool res = set_esys_auth(ctx, handle, auth);
     if (!res) {
         return CKR_GENERAL_ERROR;
     }
@@ -376,23 +452,39 @@ CK_RV tpm_session_stop(tpm_ctx *ctx) {
     return CKR_OK;
 }
 
-CK_RV tpm_ctx_new_fromtcti(void *tcti, tpm_ctx **tctx) {
+/* config picks the scheduler the TPM commands go through, NULL for the default TCTI */
+static CK_RV ctx_new_fromtcti(const char *config, void *tcti, tpm_ctx **tctx) {
 
     ESYS_CONTEXT *esys = NULL;
+    void *tcti_stats = NULL;
+    void *tcti_esys = NULL;
 
     tpm_ctx *t = calloc(1, sizeof(*t));
     if (!t) {
         return CKR_HOST_MEMORY;
     }
 
-    esys = esys_ctx_init(tcti);
+    /* the stats go beneath the scheduler so they don't count queueing as TPM time */
+    CK_RV rv = tpm_stats_tcti_new(tcti, &tcti_stats);
+    if (rv != CKR_OK) {
+        goto error;
+    }
+
+    rv = tpm_sched_tcti_new(config, tcti_stats, &tcti_esys);
+    if (rv != CKR_OK) {
+        goto error;
+    }
+
+    esys = esys_ctx_init(tcti_esys);
     if (!esys) {
         goto error;
     }
 
-    /* populate */
+    /* populate, the tcti stays the caller's until here */
     t->esys_ctx = esys;
     t->tcti_ctx = tcti;
+    t->tcti_stats = tcti_stats;
+    t->tcti_esys = tcti_esys;
 
     /*
      * allow TPM2_PKCS11_ESAPI_MANAGE_FLAGS to override the configure time default on whether or
@@ -407,10 +499,17 @@ CK_RV tpm_ctx_new_fromtcti(void *tcti, tpm_ctx **tctx) {
     return CKR_OK;
 
 error:
-    tpm_ctx_free(t);
+    tpm_sched_tcti_free(tcti_stats, tcti_esys);
+    tpm_stats_tcti_free(tcti, tcti_stats);
+    free(t);
     return CKR_GENERAL_ERROR;
 }
 
+CK_RV tpm_ctx_new_fromtcti(void *tcti, tpm_ctx **tctx) {
+
+    return ctx_new_fromtcti(NULL, tcti, tctx);
+}
+
 CK_RV tpm_ctx_new(const char *config, tpm_ctx **tctx) {
 
     TSS2_TCTI_CONTEXT *tcti = NULL;
@@ -426,7 +525,12 @@ CK_RV tpm_ctx_new(const char *config, tpm_ctx **tctx) {
         return CKR_GENERAL_ERROR;
     }
 
-    return tpm_ctx_new_fromtcti(tcti, tctx);
+    CK_RV rv = ctx_new_fromtcti(config, tcti, tctx);
+    if (rv != CKR_OK) {
+        Tss2_TctiLdr_Finalize(&tcti);
+    }
+
+    return rv;
 }
 
 static CK_RV tpm_get_properties(tpm_ctx *ctx, TPMS_CAPABILITY_DATA **d) {
@@ -935,7 +1039,7 @@ static bool tpm_loadexternal(tpm_ctx *ctx,
 }
 
 CK_RV tpm_loadobj(
-        tpm_ctx *ctx,
+        tpm_ctx *ctx, unsigned id,
         uint32_t phandle, twist auth,
         twist pub_data, twist priv_data,
         uint32_t *handle) {
@@ -950,22 +1054,30 @@ CK_RV tpm_loadobj(
         return CKR_GENERAL_ERROR;
     }
 
-    bool tmp_rc = set_esys_auth(ctx->esys_ctx, phandle, auth);
+    bool tmp_rc = set_esys_auth(ctx, phandle, auth);
     if (!tmp_rc) {
         return CKR_GENERAL_ERROR;
     }
 
-    if (priv_data) {
-        return tpm_load(ctx, phandle, &pub, priv_data, handle);
+    PROBE3(tpm__loadobj__entry, id, phandle, priv_data != NULL);
 
+    CK_RV rv;
+    if (priv_data) {
+        rv = tpm_load(ctx, phandle, &pub, priv_data, handle);
+    } else {
+        rv = tpm_loadexternal(ctx, &pub, handle) ?
+            CKR_OK : CKR_GENERAL_ERROR;
     }
 
-    return tpm_loadexternal(ctx, &pub, handle) ?
-            CKR_OK : CKR_GENERAL_ERROR;
+    PROBE3(tpm__loadobj__return, id, rv == CKR_OK ? *handle : 0, rv);
+
+    return rv;
 }
 
 bool tpm_flushcontext(tpm_ctx *ctx, uint32_t handle) {
 
+    auth_cache_drop(ctx, handle);
+
     TSS2_RC rval = Esys_FlushContext(
                 ctx->esys_ctx,
                 handle);
@@ -981,7 +1093,7 @@ twist tpm_unseal(tpm_ctx *ctx, uint32_t handle, twist objauth) {
 
     twist t = NULL;
 
-    bool result = set_esys_auth(ctx->esys_ctx, handle, objauth);
+    bool result = set_esys_auth(ctx, handle, objauth);
     if (!result) {
         return false;
     }
@@ -1077,18 +1189,19 @@ static CK_RV flatten_ecdsa(TPMS_SIGNATURE_ECDSA *ecdsa, CK_BYTE_PTR sig, CK_ULON
     /* this can't overflow, but it doesn't hurt */
     CK_ULONG rs = 0;
     safe_add(rs, R->size, S->size);
-    *siglen = rs;
 
-    if (!sig) {
-        return CKR_OK;
+    if (sig && *siglen < rs) {
+        *siglen = rs;
+        return CKR_BUFFER_TOO_SMALL;
     }
 
-    if (rs > *siglen) {
-        return CKR_BUFFER_TOO_SMALL;
+    *siglen = rs;
+
+    if (sig) {
+        memcpy(sig, R->buffer, R->size);
+        memcpy(sig + R->size, S->buffer, S->size);
     }
 
-    memcpy(sig, R->buffer, R->size);
-    memcpy(sig + R->size, S->buffer, S->size);
     return CKR_OK;
 }
 
@@ -1158,7 +1271,7 @@ CK_RV tpm_sign(tpm_op_data *opdata, CK_BYTE_PTR data, CK_ULONG datalen, CK_BYTE_
     memcpy(tdigest.buffer, data, datalen);
     tdigest.size = datalen;
 
-    bool result = set_esys_auth(opdata->ctx->esys_ctx, handle, auth);
+    bool result = set_esys_auth(opdata->ctx, handle, auth);
     if (!result) {
         return CKR_GENERAL_ERROR;
     }
@@ -1178,6 +1291,8 @@ CK_RV tpm_sign(tpm_op_data *opdata, CK_BYTE_PTR data, CK_ULONG datalen, CK_BYTE_
 
     flags_turndown(opdata->ctx, TPMA_SESSION_ENCRYPT);
 
+    PROBE3(tpm__sign__entry, tobj->id, opdata->mech, datalen);
+
     TPMT_SIGNATURE *signature = NULL;
     TSS2_RC rval = Esys_Sign(
             ectx,
@@ -1190,6 +1305,8 @@ CK_RV tpm_sign(tpm_op_data *opdata, CK_BYTE_PTR data, CK_ULONG datalen, CK_BYTE_
             &validation,
             &signature);
     flags_restore(opdata->ctx);
+
+    PROBE3(tpm__sign__return, tobj->id, opdata->mech, rval);
     if (rval != TPM2_RC_SUCCESS) {
         LOGE("Esys_Sign: %s", Tss2_RC_Decode(rval));
         return CKR_GENERAL_ERROR;
@@ -1315,7 +1432,7 @@ CK_RV tpm_rsa_oaep_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech,
     }
     */
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1355,7 +1472,7 @@ CK_RV tpm_rsa_pkcs_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1379,7 +1496,7 @@ CK_RV tpm_rsa_pss_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, t
     CK_RSA_PKCS_PSS_PARAMS_PTR params;
     SAFE_CAST(mech, params);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1418,7 +1535,7 @@ CK_RV tpm_rsa_pss_sha1_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1440,7 +1557,7 @@ CK_RV tpm_rsa_pss_sha256_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1462,7 +1579,7 @@ CK_RV tpm_rsa_pss_sha384_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1484,7 +1601,7 @@ CK_RV tpm_rsa_pss_sha512_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1506,7 +1623,7 @@ CK_RV tpm_rsa_pkcs_sha1_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1528,7 +1645,7 @@ CK_RV tpm_rsa_pkcs_sha256_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1550,7 +1667,7 @@ CK_RV tpm_rsa_pkcs_sha384_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1572,7 +1689,7 @@ CK_RV tpm_rsa_pkcs_sha512_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1594,7 +1711,7 @@ CK_RV tpm_ec_ecdsa_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1621,7 +1738,7 @@ CK_RV tpm_ec_ecdsa_sha1_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1658,7 +1775,7 @@ CK_RV tpm_aes_cbc_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1682,7 +1799,7 @@ CK_RV tpm_aes_cfb_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1706,7 +1823,7 @@ CK_RV tpm_aes_ecb_get_opdata(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new();
+    tpm_op_data *opdata = tpm_opdata_new(mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1758,13 +1875,16 @@ CK_RV tpm_rsa_decrypt(tpm_op_data *tpm_enc_data,
 
     twist auth = tpm_enc_data->tobj->unsealed_auth;
     ESYS_TR handle = tpm_enc_data->tobj->tpm_handle;
-    bool result = set_esys_auth(ctx->esys_ctx, handle, auth);
+    bool result = set_esys_auth(ctx, handle, auth);
     if (!result) {
         return CKR_GENERAL_ERROR;
     }
 
     TPM2B_PUBLIC_KEY_RSA *tpm_ptext;
 
+    PROBE3(tpm__rsa__decrypt__entry, tpm_enc_data->tobj->id, tpm_enc_data->mech,
+            ctextlen);
+
     TSS2_RC rc = Esys_RSA_Decrypt(
             ctx->esys_ctx,
             handle,
@@ -1775,6 +1895,10 @@ CK_RV tpm_rsa_decrypt(tpm_op_data *tpm_enc_data,
             scheme,
             label,
             &tpm_ptext);
+
+    PROBE3(tpm__rsa__decrypt__return, tpm_enc_data->tobj->id, tpm_enc_data->mech,
+            rc);
+
     if (rc != TPM2_RC_SUCCESS) {
         LOGE("Esys_RSA_Decrypt: %s", Tss2_RC_Decode(rc));
         return CKR_GENERAL_ERROR;
@@ -1873,7 +1997,7 @@ static CK_RV encrypt_decrypt(tpm_ctx *ctx, uint32_t handle, twist objauth, TPMI_
         }
     }
 
-    bool result = set_esys_auth(ctx->esys_ctx, handle, objauth);
+    bool result = set_esys_auth(ctx, handle, objauth);
     if (!result) {
         return CKR_GENERAL_ERROR;
     }
@@ -1991,8 +2115,16 @@ CK_RV tpm_encrypt(crypto_op_data *opdata,
     twist auth = tpm_enc_data->tobj->unsealed_auth;
     ESYS_TR handle = tpm_enc_data->tobj->tpm_handle;
 
-    return encrypt_decrypt(ctx, handle, auth, mode, ENCRYPT,
+    PROBE4(tpm__encrypt__decrypt__entry, tpm_enc_data->tobj->id,
+            tpm_enc_data->mech, ENCRYPT, ptextlen);
+
+    CK_RV rv = encrypt_decrypt(ctx, handle, auth, mode, ENCRYPT,
             iv, ptext, ptextlen, ctext, ctextlen);
+
+    PROBE4(tpm__encrypt__decrypt__return, tpm_enc_data->tobj->id,
+            tpm_enc_data->mech, ENCRYPT, rv);
+
+    return rv;
 }
 
 CK_RV tpm_decrypt(crypto_op_data *opdata,
@@ -2012,8 +2144,16 @@ CK_RV tpm_decrypt(crypto_op_data *opdata,
     twist auth = tpm_enc_data->tobj->unsealed_auth;
     ESYS_TR handle = tpm_enc_data->tobj->tpm_handle;
 
-    return encrypt_decrypt(ctx, handle, auth, mode, DECRYPT,
+    PROBE4(tpm__encrypt__decrypt__entry, tpm_enc_data->tobj->id,
+            tpm_enc_data->mech, DECRYPT, ctextlen);
+
+    CK_RV rv = encrypt_decrypt(ctx, handle, auth, mode, DECRYPT,
             iv, ctext, ctextlen, ptext, ptextlen);
+
+    PROBE4(tpm__encrypt__decrypt__return, tpm_enc_data->tobj->id,
+            tpm_enc_data->mech, DECRYPT, rv);
+
+    return rv;
 }
 
 CK_RV tpm_changeauth(tpm_ctx *ctx, uint32_t parent_handle, uint32_t object_handle,
@@ -2031,7 +2171,7 @@ CK_RV tpm_changeauth(tpm_ctx *ctx, uint32_t parent_handle, uint32_t object_handl
     memcpy(new_tpm_auth.buffer, newauth, newauthlen);
 
     /* set the old auth value */
-    bool result = set_esys_auth(ctx->esys_ctx, object_handle, oldauth);
+    bool result = set_esys_auth(ctx, object_handle, oldauth);
     if (!result) {
         return CKR_GENERAL_ERROR;
     }
@@ -2221,7 +2361,7 @@ CK_RV tpm2_create_seal_obj(tpm_ctx *ctx, twist parentauth, uint32_t parent_handl
         }
         started_session = true;
     } else {
-        bool res = set_esys_auth(ctx->esys_ctx, parent_handle, parentauth);
+        bool res = set_esys_auth(ctx, parent_handle, parentauth);
         if (!res) {
             return CKR_GENERAL_ERROR;
         }
@@ -2887,6 +3027,85 @@ static CK_RV serialize_pub_priv_blobs(TPM2B_PUBLIC *pub,
     return CKR_OK;
 }
 
+/*
+ * Fills in the attributes of objdata that follow from the public area of
+ * a key the TPM created.
+ */
+static CK_RV tpm_object_data_attrs(CK_MECHANISM_TYPE mech, TPM2B_PUBLIC *out_pub,
+        tpm_object_data *objdata) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    objdata->attrs = attr_list_new();
+    if (!objdata->attrs) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    switch(mech) {
+    case CKM_RSA_PKCS_KEY_PAIR_GEN:
+        rv = tpm_object_data_populate_rsa(out_pub, objdata);
+        break;
+    case CKM_EC_KEY_PAIR_GEN:
+        rv = tpm_object_data_populate_ecc(out_pub, objdata);
+        break;
+    default:
+        LOGE("Impossible keygen type, got: 0x%lx", mech);
+        rv = CKR_MECHANISM_INVALID;
+        assert(rv == CKR_OK);
+        goto error;
+    }
+
+    if (rv != CKR_OK) {
+        goto error;
+    }
+
+    rv = CKR_GENERAL_ERROR;
+
+    /* everything common*/
+    TPMA_OBJECT objattrs = out_pub->publicArea.objectAttributes;
+
+    CK_BBOOL extractable = !!!(objattrs & (TPMA_OBJECT_FIXEDTPM|TPMA_OBJECT_FIXEDPARENT));
+    bool r = attr_list_add_bool(objdata->attrs, CKA_EXTRACTABLE, extractable);
+    goto_error_false(r);
+
+
+    CK_BBOOL sensitive = !extractable;
+    r = attr_list_add_bool(objdata->attrs, CKA_ALWAYS_SENSITIVE, sensitive);
+    goto_error_false(r);
+
+
+    CK_BBOOL never_extractable = !extractable;
+    r = attr_list_add_bool(objdata->attrs, CKA_NEVER_EXTRACTABLE, never_extractable);
+    goto_error_false(r);
+
+    CK_BBOOL local = !!(objattrs & TPMA_OBJECT_SENSITIVEDATAORIGIN);
+    r = attr_list_add_bool(objdata->attrs, CKA_LOCAL, local);
+    goto_error_false(r);
+
+    /* conditional block */
+    CK_BBOOL decrypt = !!(objattrs & TPMA_OBJECT_DECRYPT);
+    r = attr_list_add_bool(objdata->attrs, CKA_DECRYPT, decrypt);
+    goto_error_false(r);
+
+    /* decrypt and verify are the same */
+    r = attr_list_add_bool(objdata->attrs, CKA_VERIFY, decrypt);
+    goto_error_false(r);
+
+    CK_BBOOL sign = !!(objattrs & TPMA_OBJECT_SIGN_ENCRYPT);
+    r = attr_list_add_bool(objdata->attrs, CKA_SIGN, sign);
+    goto_error_false(r);
+
+    /* sign and encrypt are same */
+    r = attr_list_add_bool(objdata->attrs, CKA_ENCRYPT, sign);
+    goto_error_false(r);
+
+    rv = CKR_OK;
+
+error:
+    return rv;
+}
+
 CK_RV tpm2_generate_key(
         tpm_ctx *tpm,
 
@@ -2929,7 +3148,7 @@ CK_RV tpm2_generate_key(
         goto error;
     }
 
-    bool res = set_esys_auth(tpm->esys_ctx, parent, parentauth);
+    bool res = set_esys_auth(tpm, parent, parentauth);
     if (!res) {
         rv = CKR_GENERAL_ERROR;
         goto error;
@@ -2978,85 +3197,166 @@ CK_RV tpm2_generate_key(
         goto error;
     }
 
-    objdata->attrs = attr_list_new();
-    if (!objdata->attrs) {
+    rv = tpm_object_data_attrs(mechanism->mechanism, out_pub, objdata);
+    if (rv != CKR_OK) {
         twist_free(tmppub);
         twist_free(tmppriv);
-        LOGE("oom");
-        rv = CKR_HOST_MEMORY;
         goto error;
     }
 
-    switch(mechanism->mechanism) {
-    case CKM_RSA_PKCS_KEY_PAIR_GEN:
-        rv = tpm_object_data_populate_rsa(out_pub, objdata);
-        break;
-    case CKM_EC_KEY_PAIR_GEN:
-        rv = tpm_object_data_populate_ecc(out_pub, objdata);
-        break;
-    default:
-        LOGE("Impossible keygen type, got: 0x%lx", mechanism->mechanism);
-        rv = CKR_MECHANISM_INVALID;
-        assert(rv == CKR_OK);
-        goto error;
-    }
+    objdata->privblob = tmppriv;
+    objdata->pubblob = tmppub;
+    objdata->privhandle = out_handle;
+
+    rv = CKR_OK;
+error:
+
+    Esys_Free(out_pub);
+    Esys_Free(out_priv);
 
     if (rv != CKR_OK) {
-        goto error;
+        tpm_objdata_free(objdata);
     }
 
-    /* everything common*/
-    TPMA_OBJECT objattrs = out_pub->publicArea.objectAttributes;
+    return rv;
+}
 
-    CK_BBOOL extractable = !!!(objattrs & (TPMA_OBJECT_FIXEDTPM|TPMA_OBJECT_FIXEDPARENT));
-    bool r = attr_list_add_bool(objdata->attrs, CKA_EXTRACTABLE, extractable);
-    goto_error_false(r);
+CK_RV tpm2_keygen_template(CK_MECHANISM_PTR mechanism,
+        attr_list *pubattrs, attr_list *privattrs, twist *template) {
 
+    CK_RV rv = sanity_check_mech(mechanism);
+    if (rv != CKR_OK) {
+        return rv;
+    }
 
-    CK_BBOOL sensitive = !extractable;
-    r = attr_list_add_bool(objdata->attrs, CKA_ALWAYS_SENSITIVE, sensitive);
-    goto_error_false(r);
+    tpm_key_data tpmdat;
+    rv = tpm_data_init(mechanism, pubattrs, privattrs, &tpmdat);
+    if (rv != CKR_OK) {
+        return rv;
+    }
 
+    /* the TPM reads an exponent of 0 as the default 65537 */
+    TPMS_RSA_PARMS *rsa = &tpmdat.pub.publicArea.parameters.rsaDetail;
+    if (tpmdat.pub.publicArea.type == TPM2_ALG_RSA && rsa->exponent == 65537) {
+        rsa->exponent = 0;
+    }
 
-    CK_BBOOL never_extractable = !extractable;
-    r = attr_list_add_bool(objdata->attrs, CKA_NEVER_EXTRACTABLE, never_extractable);
-    goto_error_false(r);
+    BYTE buf[sizeof(tpmdat.pub)];
+    size_t offset = 0;
+    TSS2_RC rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&tpmdat.pub, buf, sizeof(buf), &offset);
+    if (rc != TSS2_RC_SUCCESS) {
+        LOGE("Tss2_MU_TPM2B_PUBLIC_Marshal: %s", Tss2_RC_Decode(rc));
+        return CKR_GENERAL_ERROR;
+    }
 
-    CK_BBOOL local = !!(objattrs & TPMA_OBJECT_SENSITIVEDATAORIGIN);
-    r = attr_list_add_bool(objdata->attrs, CKA_LOCAL, local);
-    goto_error_false(r);
+    *template = twistbin_new(buf, offset);
+    if (!*template) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
 
-    /* conditional block */
-    CK_BBOOL decrypt = !!(objattrs & TPMA_OBJECT_DECRYPT);
-    r = attr_list_add_bool(objdata->attrs, CKA_DECRYPT, decrypt);
-    goto_error_false(r);
+    return CKR_OK;
+}
 
-    /* decrypt and verify are the same */
-    r = attr_list_add_bool(objdata->attrs, CKA_VERIFY, decrypt);
-    goto_error_false(r);
+CK_RV tpm2_create_key(tpm_ctx *tpm, uint32_t parent, twist parentauth,
+        twist newauthbin, twist template, twist *pubblob, twist *privblob) {
 
-    CK_BBOOL sign = !!(objattrs & TPMA_OBJECT_SIGN_ENCRYPT);
-    r = attr_list_add_bool(objdata->attrs, CKA_SIGN, sign);
-    goto_error_false(r);
+    TPM2B_PUBLIC pub = { .size = 0 };
+    size_t offset = 0;
+    TSS2_RC rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal((uint8_t *)template,
+            twist_len(template), &offset, &pub);
+    if (rc != TSS2_RC_SUCCESS) {
+        LOGE("Tss2_MU_TPM2B_PUBLIC_Unmarshal: %s", Tss2_RC_Decode(rc));
+        return CKR_GENERAL_ERROR;
+    }
 
-    /* sign and encrypt are same */
-    r = attr_list_add_bool(objdata->attrs, CKA_ENCRYPT, sign);
-    goto_error_false(r);
+    TPM2B_SENSITIVE_CREATE sensitive = { .size = 0 };
+    TPM2B_AUTH *auth = &sensitive.sensitive.userAuth;
+    size_t len = twist_len(newauthbin);
+    if (len > sizeof(auth->buffer)) {
+        LOGE("Auth value too big");
+        return CKR_GENERAL_ERROR;
+    }
+    auth->size = len;
+    memcpy(auth->buffer, newauthbin, len);
 
-    objdata->privblob = tmppriv;
-    objdata->pubblob = tmppub;
-    objdata->privhandle = out_handle;
+    bool res = set_esys_auth(tpm, parent, parentauth);
+    if (!res) {
+        return CKR_GENERAL_ERROR;
+    }
 
-    rv = CKR_OK;
-error:
+    TPM2B_PUBLIC *out_pub = NULL;
+    TPM2B_PRIVATE *out_priv = NULL;
+    rc = create_loaded(
+            tpm,
+            parent,
+            tpm->hmac_session,
+            &sensitive,
+            &pub,
+            NULL,
+            &out_pub,
+            &out_priv);
+    if (rc != TSS2_RC_SUCCESS) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = serialize_pub_priv_blobs(out_pub, out_priv, pubblob, privblob);
 
     Esys_Free(out_pub);
     Esys_Free(out_priv);
 
+    return rv;
+}
+
+CK_RV tpm2_load_key(tpm_ctx *tpm, uint32_t parent, twist parentauth,
+        CK_MECHANISM_TYPE mech, twist pubblob, twist privblob,
+        tpm_object_data *objdata) {
+
+    assert(objdata);
+
+    TPM2B_PUBLIC pub = { .size = 0 };
+    size_t offset = 0;
+    TSS2_RC rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal((uint8_t *)pubblob,
+            twist_len(pubblob), &offset, &pub);
+    if (rc != TSS2_RC_SUCCESS) {
+        LOGE("Tss2_MU_TPM2B_PUBLIC_Unmarshal: %s", Tss2_RC_Decode(rc));
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = tpm_loadobj(tpm, 0, parent, parentauth, pubblob, privblob,
+            &objdata->privhandle);
     if (rv != CKR_OK) {
-        tpm_objdata_free(objdata);
+        return rv;
+    }
+
+    bool res = tpm_loadexternal(tpm, &pub, &objdata->pubhandle);
+    if (!res) {
+        rv = CKR_GENERAL_ERROR;
+        goto error;
+    }
+
+    rv = tpm_object_data_attrs(mech, &pub, objdata);
+    if (rv != CKR_OK) {
+        goto error;
     }
 
+    objdata->pubblob = twist_dup(pubblob);
+    objdata->privblob = twist_dup(privblob);
+    if (!objdata->pubblob || !objdata->privblob) {
+        LOGE("oom");
+        rv = CKR_HOST_MEMORY;
+        goto error;
+    }
+
+    return CKR_OK;
+
+error:
+    tpm_flushcontext(tpm, objdata->privhandle);
+    if (objdata->pubhandle) {
+        tpm_flushcontext(tpm, objdata->pubhandle);
+    }
+    tpm_objdata_free(objdata);
+    objdata->privhandle = objdata->pubhandle = 0;
     return rv;
 }
 
@@ -3552,23 +3852,27 @@ static const key_template TEMPLATES[] = {
     }
 };
 
-WEAK CK_RV tpm_create_transient_primary_from_template(tpm_ctx *tpm,
-        const char *template_name, twist pobj_auth,
-        uint32_t *primary_handle) {
+static const key_template *template_from_name(const char *template_name) {
 
-    const key_template *templ = NULL;
     size_t i;
     for(i=0; i < ARRAY_LEN(TEMPLATES); i++) {
         const key_template *t = &TEMPLATES[i];
 
         if (!strcmp(template_name, t->template_name)) {
-            templ = t;
-            break;
+            return t;
         }
     }
 
+    LOGE("No match for template with name: \"%s\"", template_name);
+    return NULL;
+}
+
+WEAK CK_RV tpm_create_transient_primary_from_template(tpm_ctx *tpm,
+        const char *template_name, twist pobj_auth,
+        uint32_t *primary_handle) {
+
+    const key_template *templ = template_from_name(template_name);
     if (!templ) {
-        LOGE("No match for template with name: \"%s\"", template_name);
         return CKR_GENERAL_ERROR;
     }
 
@@ -3612,6 +3916,7 @@ WEAK CK_RV tpm_create_transient_primary_from_template(tpm_ctx *tpm,
         memcpy(a->buffer, pobj_auth, len);
     }
 
+    auth_cache_drop(tpm, hierarchy);
     TSS2_RC rval = Esys_TR_SetAuth(tpm->esys_ctx, hierarchy, &hieararchy_auth);
     if (rval != TSS2_RC_SUCCESS) {
         LOGE("Esys_TR_SetAuth: %s:", Tss2_RC_Decode(rval));
@@ -3655,6 +3960,233 @@ WEAK CK_RV tpm_create_transient_primary_from_template(tpm_ctx *tpm,
     return CKR_OK;
 }
 
+CK_RV tpm_get_reset_count(tpm_ctx *tpm, uint32_t *reset_count) {
+    assert(tpm);
+    assert(reset_count);
+
+    TPMS_TIME_INFO *info = NULL;
+    TSS2_RC rval = Esys_ReadClock(tpm->esys_ctx,
+            ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &info);
+    if (rval != TSS2_RC_SUCCESS) {
+        LOGE("Esys_ReadClock: %s:", Tss2_RC_Decode(rval));
+        return CKR_GENERAL_ERROR;
+    }
+
+    *reset_count = info->clockInfo.resetCount;
+    Esys_Free(info);
+
+    return CKR_OK;
+}
+
+CK_RV tpm_save_primary_context(tpm_ctx *tpm, uint32_t primary_handle, twist *context) {
+    assert(tpm);
+    assert(context);
+
+    /* saving an object context leaves the object loaded */
+    TPMS_CONTEXT *ctx = NULL;
+    TSS2_RC rval = Esys_ContextSave(tpm->esys_ctx, primary_handle, &ctx);
+    if (rval != TSS2_RC_SUCCESS) {
+        LOGE("Esys_ContextSave: %s:", Tss2_RC_Decode(rval));
+        return CKR_GENERAL_ERROR;
+    }
+
+    uint8_t buf[sizeof(*ctx)];
+    size_t offset = 0;
+    rval = Tss2_MU_TPMS_CONTEXT_Marshal(ctx, buf, sizeof(buf), &offset);
+    Esys_Free(ctx);
+    if (rval != TSS2_RC_SUCCESS) {
+        LOGE("Tss2_MU_TPMS_CONTEXT_Marshal: %s:", Tss2_RC_Decode(rval));
+        return CKR_GENERAL_ERROR;
+    }
+
+    *context = twistbin_new(buf, offset);
+    if (!*context) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    return CKR_OK;
+}
+
+static bool public_parms_equal(const TPMT_PUBLIC *a, const TPMT_PUBLIC *b) {
+
+    if (a->type != b->type
+            || a->nameAlg != b->nameAlg
+            || a->objectAttributes != b->objectAttributes
+            || a->authPolicy.size != b->authPolicy.size
+            || memcmp(a->authPolicy.buffer, b->authPolicy.buffer, a->authPolicy.size)) {
+        return false;
+    }
+
+    /* compare the marshalled form, the unions have padding */
+    uint8_t abuf[sizeof(TPMU_PUBLIC_PARMS)];
+    uint8_t bbuf[sizeof(TPMU_PUBLIC_PARMS)];
+    size_t alen = 0;
+    size_t blen = 0;
+
+    TSS2_RC rval = Tss2_MU_TPMU_PUBLIC_PARMS_Marshal(&a->parameters, a->type,
+            abuf, sizeof(abuf), &alen);
+    if (rval != TSS2_RC_SUCCESS) {
+        LOGE("Tss2_MU_TPMU_PUBLIC_PARMS_Marshal: %s:", Tss2_RC_Decode(rval));
+        return false;
+    }
+
+    rval = Tss2_MU_TPMU_PUBLIC_PARMS_Marshal(&b->parameters, b->type,
+            bbuf, sizeof(bbuf), &blen);
+    if (rval != TSS2_RC_SUCCESS) {
+        LOGE("Tss2_MU_TPMU_PUBLIC_PARMS_Marshal: %s:", Tss2_RC_Decode(rval));
+        return false;
+    }
+
+    return alen == blen && !memcmp(abuf, bbuf, alen);
+}
+
+CK_RV tpm_load_transient_primary_context(tpm_ctx *tpm,
+        const char *template_name, twist pobj_auth, twist context,
+        uint32_t *primary_handle) {
+    assert(tpm);
+    assert(context);
+    assert(primary_handle);
+
+    const key_template *templ = template_from_name(template_name);
+    if (!templ) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    TPMS_CONTEXT ctx = { 0 };
+    TSS2_RC rval = Tss2_MU_TPMS_CONTEXT_Unmarshal((uint8_t *)context,
+            twist_len(context), NULL, &ctx);
+    if (rval != TSS2_RC_SUCCESS) {
+        LOGE("Tss2_MU_TPMS_CONTEXT_Unmarshal: %s:", Tss2_RC_Decode(rval));
+        return CKR_GENERAL_ERROR;
+    }
+
+    /* the primaries of templates are always created under the owner hierarchy */
+    if (ctx.hierarchy != TPM2_RH_OWNER) {
+        LOGE("Saved primary context is not in the owner hierarchy");
+        return CKR_GENERAL_ERROR;
+    }
+
+    ESYS_TR handle = ESYS_TR_NONE;
+    rval = Esys_ContextLoad(tpm->esys_ctx, &ctx, &handle);
+    if (rval != TSS2_RC_SUCCESS) {
+        /* expected after TPM2_Clear or on another TPM, the caller creates it */
+        LOGV("Esys_ContextLoad: %s:", Tss2_RC_Decode(rval));
+        return CKR_GENERAL_ERROR;
+    }
+
+    /*
+     * ESAPI takes the name of the object from the saved context, ask the TPM
+     * for the public area and make sure it is a primary of this template.
+     */
+    TPM2B_PUBLIC expected = { 0 };
+    CK_RV rv = templ->fn(tpm, &expected);
+    if (rv != CKR_OK) {
+        LOGE("Template population routine failed: 0x%lx", rv);
+        goto error;
+    }
+
+    TPM2B_PUBLIC *pub = NULL;
+    rval = Esys_ReadPublic(tpm->esys_ctx, handle,
+            ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+            &pub, NULL, NULL);
+    if (rval != TSS2_RC_SUCCESS) {
+        LOGE("Esys_ReadPublic: %s:", Tss2_RC_Decode(rval));
+        rv = CKR_GENERAL_ERROR;
+        goto error;
+    }
+
+    bool match = public_parms_equal(&pub->publicArea, &expected.publicArea);
+    Esys_Free(pub);
+    if (!match) {
+        LOGE("Saved primary context does not match template \"%s\"", template_name);
+        rv = CKR_GENERAL_ERROR;
+        goto error;
+    }
+
+    if (!set_esys_auth(tpm, handle, pobj_auth)) {
+        rv = CKR_GENERAL_ERROR;
+        goto error;
+    }
+
+    *primary_handle = handle;
+
+    return CKR_OK;
+
+error:
+    tpm_flushcontext(tpm, handle);
+    return rv;
+}
+
+CK_RV tpm_load_persistent(tpm_ctx *tpm, twist tr_blob, twist pub_data,
+        uint32_t *handle) {
+    assert(tpm);
+    assert(tr_blob);
+    assert(pub_data);
+    assert(handle);
+
+    ESYS_TR tr = ESYS_TR_NONE;
+    TSS2_RC rval = Esys_TR_Deserialize(tpm->esys_ctx,
+                        (uint8_t *)tr_blob, twist_len(tr_blob), &tr);
+    if (rval != TSS2_RC_SUCCESS) {
+        LOGE("Esys_TR_Deserialize: %s:", Tss2_RC_Decode(rval));
+        return CKR_GENERAL_ERROR;
+    }
+
+    PROBE1(tpm__loadpersistent__entry, tr);
+
+    /*
+     * The handle may have been evicted, or reused for another key, since it
+     * was recorded. Make sure the TPM holds the object of this tobject.
+     */
+    TPM2B_PUBLIC *pub = NULL;
+    rval = Esys_ReadPublic(tpm->esys_ctx, tr,
+            ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+            &pub, NULL, NULL);
+    if (rval != TSS2_RC_SUCCESS) {
+        LOGW("Esys_ReadPublic: %s:", Tss2_RC_Decode(rval));
+        goto error;
+    }
+
+    uint8_t buf[sizeof(TPM2B_PUBLIC)];
+    size_t offset = 0;
+    rval = Tss2_MU_TPM2B_PUBLIC_Marshal(pub, buf, sizeof(buf), &offset);
+    Esys_Free(pub);
+    if (rval != TSS2_RC_SUCCESS) {
+        LOGE("Tss2_MU_TPM2B_PUBLIC_Marshal: %s:", Tss2_RC_Decode(rval));
+        goto error;
+    }
+
+    if (offset != twist_len(pub_data) || memcmp(buf, pub_data, offset)) {
+        LOGW("Persistent handle holds another object");
+        goto error;
+    }
+
+    *handle = tr;
+
+    PROBE2(tpm__loadpersistent__return, tr, CKR_OK);
+
+    return CKR_OK;
+
+error:
+    tpm_closehandle(tpm, tr);
+    PROBE2(tpm__loadpersistent__return, ESYS_TR_NONE, CKR_GENERAL_ERROR);
+    return CKR_GENERAL_ERROR;
+}
+
+bool tpm_closehandle(tpm_ctx *ctx, uint32_t handle) {
+
+    auth_cache_drop(ctx, handle);
+
+    TSS2_RC rval = Esys_TR_Close(ctx->esys_ctx, &handle);
+    if (rval != TSS2_RC_SUCCESS) {
+        LOGE("Esys_TR_Close: %s", Tss2_RC_Decode(rval));
+        return false;
+    }
+
+    return true;
+}
+
 CK_RV tpm_create_persistent_primary(tpm_ctx *tpm, uint32_t *primary_handle, twist *primary_blob) {
     assert(tpm);
     assert(primary_blob);
@@ -3707,6 +4239,7 @@ CK_RV tpm_create_persistent_primary(tpm_ctx *tpm, uint32_t *primary_handle, twis
     TPM2B_DATA outside_info = { 0 };
     TPML_PCR_SELECTION pcrs = { 0 };
 
+    auth_cache_drop(tpm, hierarchy);
     TSS2_RC rval = Esys_TR_SetAuth(tpm->esys_ctx, hierarchy, &hieararchy_auth);
     if (rval != TSS2_RC_SUCCESS) {
         LOGE("Esys_TR_SetAuth: %s:", Tss2_RC_Decode(rval));
@@ -3815,7 +4348,7 @@ CK_RV tpm_get_pss_sig_state(tpm_ctx *tctx, tobject *tobj,
             .digest = { 0 }
     };
 
-    bool res = set_esys_auth(tctx->esys_ctx, tobj->tpm_handle,
+    bool res = set_esys_auth(tctx, tobj->tpm_handle,
             tobj->unsealed_auth);
     if (!res) {
         return CKR_GENERAL_ERROR;
@@ -87,11 +87,44 @@ bool tpm_getrandom(tpm_ctx *ctx, uint8_t *data, size_t size);
 
 CK_RV tpm_stirrandom(tpm_ctx *ctx, unsigned char *seed, unsigned long seed_len);
 
-CK_RV tpm_loadobj(tpm_ctx *ctx, uint32_t phandle, twist auth,
-        twist pub_path, twist priv_path, uint32_t *handle);
+/**
+ * Loads an object under a parent, or its public part only when there is
+ * no private blob.
+ * @param ctx
+ *  The TPM context.
+ * @param id
+ *  The tobject id the USDT probes report, 0 for objects that are not
+ *  tobjects, like seal objects and pooled keys.
+ * @param phandle
+ *  The parent handle.
+ * @param auth
+ *  The auth of the parent.
+ * @param pub_data
+ *  The marshalled TPM2B_PUBLIC.
+ * @param priv_data
+ *  The marshalled TPM2B_PRIVATE, or NULL.
+ * @param handle
+ *  The handle of the loaded object.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV tpm_loadobj(tpm_ctx *ctx, unsigned id, uint32_t phandle, twist auth,
+        twist pub_data, twist priv_data, uint32_t *handle);
 
 bool tpm_flushcontext(tpm_ctx *ctx, uint32_t handle);
 
+/**
+ * Releases the ESYS_TR of an object that stays in the TPM, like a
+ * persistent object, without flushing the object.
+ * @param ctx
+ *  The TPM context.
+ * @param handle
+ *  The ESYS_TR to release.
+ * @return
+ *  true on success.
+ */
+bool tpm_closehandle(tpm_ctx *ctx, uint32_t handle);
+
 twist tpm_unseal(tpm_ctx *ctx, uint32_t handle, twist objauth);
 
 WEAK bool tpm_deserialize_handle(tpm_ctx *ctx, twist handle_blob, uint32_t *handle, uint32_t *tpmHandle);
@@ -168,6 +201,71 @@ CK_RV tpm2_generate_key(
 
         tpm_object_data *objdata);
 
+/**
+ * Builds the marshalled TPM2B_PUBLIC that tpm2_generate_key() would use for
+ * the given mechanism and templates. Two key requests with equal templates
+ * produce interchangeable keys.
+ * @param mechanism
+ *  The key generation mechanism.
+ * @param pubattrs
+ *  The public template attributes.
+ * @param privattrs
+ *  The private template attributes.
+ * @param template
+ *  The marshalled TPM2B_PUBLIC, free with twist_free().
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV tpm2_keygen_template(CK_MECHANISM_PTR mechanism,
+        attr_list *pubattrs, attr_list *privattrs, twist *template);
+
+/**
+ * Creates a key from a template built by tpm2_keygen_template() without
+ * loading it.
+ * @param tpm
+ *  The tpm context.
+ * @param parent
+ *  The parent object handle.
+ * @param parentauth
+ *  The parent auth value.
+ * @param newauthbin
+ *  The auth value of the new key.
+ * @param template
+ *  The marshalled TPM2B_PUBLIC.
+ * @param pubblob
+ *  The public blob of the new key, free with twist_free().
+ * @param privblob
+ *  The private blob of the new key, free with twist_free().
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV tpm2_create_key(tpm_ctx *tpm, uint32_t parent, twist parentauth,
+        twist newauthbin, twist template, twist *pubblob, twist *privblob);
+
+/**
+ * Loads a key made by tpm2_create_key() and fills in objdata as
+ * tpm2_generate_key() would have.
+ * @param tpm
+ *  The tpm context.
+ * @param parent
+ *  The parent object handle.
+ * @param parentauth
+ *  The parent auth value.
+ * @param mech
+ *  The key generation mechanism the key was made for.
+ * @param pubblob
+ *  The public blob.
+ * @param privblob
+ *  The private blob.
+ * @param objdata
+ *  The object data, free with tpm_objdata_free().
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV tpm2_load_key(tpm_ctx *tpm, uint32_t parent, twist parentauth,
+        CK_MECHANISM_TYPE mech, twist pubblob, twist privblob,
+        tpm_object_data *objdata);
+
 CK_RV tpm2_getmechanisms(tpm_ctx *ctx, CK_MECHANISM_TYPE *mechanism_list, CK_ULONG_PTR count);
 
 CK_RV tpm_get_existing_primary(tpm_ctx *tpm, uint32_t *primary_handle, twist *primary_blob);
@@ -178,6 +276,71 @@ CK_RV tpm_create_transient_primary_from_template(tpm_ctx *tpm,
         const char *template_name, const char *pobj_auth,
         uint32_t *primary_handle);
 
+/**
+ * Reads the TPM resetCount, saved object contexts are only valid for the
+ * resetCount they were saved at.
+ * @param tpm
+ *  The TPM context.
+ * @param reset_count
+ *  The resetCount.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV tpm_get_reset_count(tpm_ctx *tpm, uint32_t *reset_count);
+
+/**
+ * Saves the context of a transient primary object, which stays loaded.
+ * @param tpm
+ *  The TPM context.
+ * @param primary_handle
+ *  The primary object.
+ * @param context
+ *  The marshalled TPMS_CONTEXT.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV tpm_save_primary_context(tpm_ctx *tpm, uint32_t primary_handle, twist *context);
+
+/**
+ * Loads a transient primary object from a context saved with
+ * tpm_save_primary_context() and checks that it was created from a
+ * template, as tpm_create_transient_primary_from_template() would.
+ * @param tpm
+ *  The TPM context.
+ * @param template_name
+ *  The name of the template.
+ * @param pobj_auth
+ *  The auth value of the primary object.
+ * @param context
+ *  The marshalled TPMS_CONTEXT.
+ * @param primary_handle
+ *  The loaded primary object.
+ * @return
+ *  CKR_OK on success, an error if the context can no longer be loaded,
+ *  eg after TPM2_Clear, or is not one of the template.
+ */
+CK_RV tpm_load_transient_primary_context(tpm_ctx *tpm,
+        const char *template_name, twist pobj_auth, twist context,
+        uint32_t *primary_handle);
+
+/**
+ * Gets an ESYS_TR for a key made persistent with TPM2_EvictControl, so it
+ * can be used without loading it. Only reads the public area from the TPM
+ * to make sure the persistent handle still holds the key.
+ * @param tpm
+ *  The TPM context.
+ * @param tr_blob
+ *  The serialized ESYS_TR of the persistent handle.
+ * @param pub_data
+ *  The marshalled TPM2B_PUBLIC of the key.
+ * @param handle
+ *  The ESYS_TR, release it with tpm_closehandle().
+ * @return
+ *  CKR_OK on success, an error if the handle is gone or holds another object.
+ */
+CK_RV tpm_load_persistent(tpm_ctx *tpm, twist tr_blob, twist pub_data,
+        uint32_t *handle);
+
 CK_RV tpm_get_pss_sig_state(tpm_ctx *tctx, tobject *tobj, bool *pss_sigs_good);
 
 void tpm_init(void);
@@ -0,0 +1,561 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tss2/tss2_tcti.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "general.h"
+#include "log.h"
+#include "stats.h"
+#include "tpm_sched.h"
+#include "utils.h"
+
+/*
+ * The TPM runs one command at a time, and a command can not be taken back
+ * once it was sent. So the scheduler can not preempt a key creation that
+ * is already running, what it does is decide who goes next when the TPM
+ * contexts of the process, those of the tokens and of the key pool
+ * workers, have commands waiting. It sits at the TCTI layer so it sees
+ * every command, ESAPI's session handling included, and orders them by
+ * command code:
+ *
+ *  - Waiting classes take turns, each getting up to its weight of commands
+ *    in a round, interactive before bulk before background within a round.
+ *  - A command that has waited longer than TPM2_PKCS11_TPM_SCHED_MAX_WAIT_MS
+ *    goes before all others that have not, so no class starves.
+ *
+ * Commands within a class go in arrival order. There is one scheduler per
+ * TCTI config string, so the contexts of different TPMs do not wait for
+ * each other. A TPM context sends one command at a time, which means the
+ * scheduler only orders the commands of different contexts: a token still
+ * waits for its own earlier commands, whatever their class.
+ */
+
+#define TCTI_SCHED_MAGIC 0x7470326b73636864ULL
+
+#define TPM_HEADER_SIZE 10
+#define TPM_HEADER_CODE_OFFSET 6
+
+#define SCHED_ENV "TPM2_PKCS11_TPM_SCHED"
+#define SCHED_MAX_WAIT_ENV "TPM2_PKCS11_TPM_SCHED_MAX_WAIT_MS"
+#define SCHED_MAX_WAIT_DEFAULT_MS 500
+
+typedef enum sched_class sched_class;
+enum sched_class {
+    sched_interactive = 0,
+    sched_bulk,
+    sched_background,
+    SCHED_CLASSES
+};
+
+static const struct {
+    const char *name;
+    unsigned weight;
+} class_info[SCHED_CLASSES] = {
+    [sched_interactive] = { "interactive", 8 },
+    [sched_bulk]        = { "bulk",        4 },
+    [sched_background]  = { "background",  1 },
+};
+
+typedef struct sched_stats sched_stats;
+struct sched_stats {
+    uint64_t max_depth;
+    uint64_t overdue;
+    stats_hist depth;   /* commands already waiting in the class on arrival */
+    stats_hist wait;
+};
+
+/* the scheduler of one TCTI config, everything but the stats is protected by lock */
+typedef struct sched sched;
+struct sched {
+    sched *next;
+    char *tcti;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t max_wait_ms;
+    bool busy;
+    unsigned credits[SCHED_CLASSES];
+    uint64_t next_ticket[SCHED_CLASSES];
+    uint64_t serving[SCHED_CLASSES];
+    unsigned overdue[SCHED_CLASSES];
+    sched_stats stats[SCHED_CLASSES];
+};
+
+typedef struct tcti_sched tcti_sched;
+struct tcti_sched {
+    /* must be first, ESAPI treats this as the TCTI context */
+    TSS2_TCTI_CONTEXT_COMMON_V2 common;
+    TSS2_TCTI_CONTEXT *inner;
+    sched *s;
+    /* ESAPI has at most one command outstanding per context */
+    bool admitted;
+};
+
+/*
+ * The schedulers, one per TCTI config string seen. There are few and they
+ * live as long as the process, so their stats outlast the TPM contexts.
+ */
+static struct {
+    pthread_mutex_t lock;
+    sched *head;
+} _g_scheds = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t sched_max_wait_ms(void) {
+
+    const char *env = getenv(SCHED_MAX_WAIT_ENV);
+    if (!env) {
+        return SCHED_MAX_WAIT_DEFAULT_MS;
+    }
+
+    size_t val = 0;
+    int rc = str_to_ul(env, &val);
+    if (rc || val > UINT_MAX) {
+        LOGW("Invalid %s \"%s\", using %u", SCHED_MAX_WAIT_ENV, env,
+                SCHED_MAX_WAIT_DEFAULT_MS);
+        return SCHED_MAX_WAIT_DEFAULT_MS;
+    }
+
+    return val;
+}
+
+static sched *sched_new(const char *tcti) {
+
+    sched *s = calloc(1, sizeof(*s));
+    if (!s) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    s->tcti = strdup(tcti);
+    if (!s->tcti) {
+        LOGE("oom");
+        free(s);
+        return NULL;
+    }
+
+    s->max_wait_ms = sched_max_wait_ms();
+
+    unsigned c;
+    for (c = 0; c < SCHED_CLASSES; c++) {
+        stats_hist_init(&s->stats[c].depth);
+        stats_hist_init(&s->stats[c].wait);
+    }
+
+    pthread_condattr_t attr;
+    int rc = pthread_condattr_init(&attr);
+    if (rc) {
+        LOGE("pthread_condattr_init: %s", strerror(rc));
+        goto error;
+    }
+
+    /* deadlines are taken from the same clock as the stats */
+    rc = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (!rc) {
+        rc = pthread_cond_init(&s->cond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+    if (rc) {
+        LOGE("pthread_cond_init: %s", strerror(rc));
+        goto error;
+    }
+
+    rc = pthread_mutex_init(&s->lock, NULL);
+    if (rc) {
+        LOGE("pthread_mutex_init: %s", strerror(rc));
+        pthread_cond_destroy(&s->cond);
+        goto error;
+    }
+
+    return s;
+
+error:
+    free(s->tcti);
+    free(s);
+    return NULL;
+}
+
+/* gets the scheduler of a TCTI config, NULL is the default TCTI */
+static sched *sched_get(const char *tcti) {
+
+    if (!tcti) {
+        tcti = "";
+    }
+
+    pthread_mutex_lock(&_g_scheds.lock);
+
+    sched *s;
+    for (s = _g_scheds.head; s; s = s->next) {
+        if (!strcmp(s->tcti, tcti)) {
+            break;
+        }
+    }
+
+    if (!s) {
+        s = sched_new(tcti);
+        if (s) {
+            s->next = _g_scheds.head;
+            __atomic_store_n(&_g_scheds.head, s, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_unlock(&_g_scheds.lock);
+
+    return s;
+}
+
+static bool sched_is_enabled(void) {
+
+    /* the scheduler's own locks are OS primitives */
+    if (!general_os_locking_ok()) {
+        return false;
+    }
+
+    const char *env = getenv(SCHED_ENV);
+    return env && !strcmp(env, "1");
+}
+
+static sched_class cc_to_class(uint32_t cc) {
+
+    switch (cc) {
+    case TPM2_CC_Create:
+        /* falls-thru */
+    case TPM2_CC_CreateLoaded:
+        /* falls-thru */
+    case TPM2_CC_CreatePrimary:
+        return sched_background;
+    case TPM2_CC_EncryptDecrypt:
+        /* falls-thru */
+    case TPM2_CC_EncryptDecrypt2:
+        /* falls-thru */
+    case TPM2_CC_RSA_Encrypt:
+        /* falls-thru */
+    case TPM2_CC_GetRandom:
+        /* falls-thru */
+    case TPM2_CC_StirRandom:
+        return sched_bulk;
+        /* no default */
+    }
+
+    return sched_interactive;
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+            | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/* must hold s->lock */
+static inline uint64_t waiting(sched *s, sched_class c) {
+    return s->next_ticket[c] - s->serving[c];
+}
+
+/*
+ * Returns the class whose oldest command goes next, must hold
+ * s->lock and have at least one command waiting.
+ */
+static unsigned pick(sched *s) {
+
+    unsigned c;
+    for (c = 0; c < SCHED_CLASSES; c++) {
+        if (s->overdue[c]) {
+            return c;
+        }
+    }
+
+    for (c = 0; c < SCHED_CLASSES; c++) {
+        if (waiting(s, c) && s->credits[c]) {
+            return c;
+        }
+    }
+
+    /* every waiting class used up its turns, start a new round */
+    for (c = 0; c < SCHED_CLASSES; c++) {
+        s->credits[c] = class_info[c].weight;
+    }
+
+    for (c = 0; c < SCHED_CLASSES; c++) {
+        if (waiting(s, c)) {
+            break;
+        }
+    }
+
+    return c;
+}
+
+static void deadline_after(struct timespec *ts, uint64_t ms) {
+
+    clock_gettime(CLOCK_MONOTONIC, ts);
+
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void sched_admit(sched *s, uint32_t cc) {
+
+    sched_class c = cc_to_class(cc);
+    sched_stats *st = &s->stats[c];
+    bool record = stats_is_enabled();
+    uint64_t start = record ? stats_now() : 0;
+
+    struct timespec deadline;
+    deadline_after(&deadline, s->max_wait_ms);
+
+    pthread_mutex_lock(&s->lock);
+
+    uint64_t depth = waiting(s, c);
+    uint64_t ticket = s->next_ticket[c]++;
+    bool late = false;
+
+    while (s->busy
+            || s->serving[c] != ticket
+            || pick(s) != c) {
+
+        if (late) {
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+
+        int rc = pthread_cond_timedwait(&s->cond, &s->lock, &deadline);
+        if (rc == ETIMEDOUT) {
+            late = true;
+            s->overdue[c]++;
+            /* this can change who goes next, the head of the class may be asleep */
+            pthread_cond_broadcast(&s->cond);
+        }
+    }
+
+    s->serving[c]++;
+    if (late) {
+        s->overdue[c]--;
+    }
+    if (s->credits[c]) {
+        s->credits[c]--;
+    }
+    s->busy = true;
+
+    pthread_mutex_unlock(&s->lock);
+
+    if (!record) {
+        return;
+    }
+
+    stats_hist_record(&st->wait, stats_now() - start);
+    stats_hist_record(&st->depth, depth);
+    if (late) {
+        __atomic_fetch_add(&st->overdue, 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t max = __atomic_load_n(&st->max_depth, __ATOMIC_RELAXED);
+    while (depth > max
+            && !__atomic_compare_exchange_n(&st->max_depth, &max, depth, false,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        /* max was reloaded, try again */
+    }
+}
+
+static void sched_release(tcti_sched *t) {
+
+    if (!t->admitted) {
+        return;
+    }
+
+    t->admitted = false;
+
+    sched *s = t->s;
+    pthread_mutex_lock(&s->lock);
+    s->busy = false;
+    /* the next command is picked by the waiters themselves */
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static TSS2_RC tcti_sched_transmit(TSS2_TCTI_CONTEXT *ctx, size_t size,
+        const uint8_t *command) {
+
+    tcti_sched *t = (tcti_sched *)ctx;
+
+    /* ESAPI never sends while a response is pending, don't queue behind ourselves */
+    if (!t->admitted) {
+        uint32_t cc = size >= TPM_HEADER_SIZE ?
+                read_be32(&command[TPM_HEADER_CODE_OFFSET]) : 0;
+        sched_admit(t->s, cc);
+        t->admitted = true;
+    }
+
+    TSS2_RC rc = TSS2_TCTI_TRANSMIT(t->inner)(t->inner, size, command);
+    if (rc != TSS2_RC_SUCCESS) {
+        sched_release(t);
+    }
+
+    return rc;
+}
+
+static TSS2_RC tcti_sched_receive(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        uint8_t *response, int32_t timeout) {
+
+    tcti_sched *t = (tcti_sched *)ctx;
+
+    TSS2_RC rc = TSS2_TCTI_RECEIVE(t->inner)(t->inner, size, response, timeout);
+
+    /* size queries and polls with no response yet keep the TPM to ourselves */
+    if (!response || rc == TSS2_TCTI_RC_TRY_AGAIN) {
+        return rc;
+    }
+
+    sched_release(t);
+
+    return rc;
+}
+
+static void tcti_sched_finalize(TSS2_TCTI_CONTEXT *ctx) {
+    /* the inner TCTI is finalized by its owner */
+    UNUSED(ctx);
+}
+
+static TSS2_RC tcti_sched_cancel(TSS2_TCTI_CONTEXT *ctx) {
+
+    tcti_sched *t = (tcti_sched *)ctx;
+    TSS2_RC rc = TSS2_TCTI_CANCEL(t->inner)(t->inner);
+    sched_release(t);
+    return rc;
+}
+
+static TSS2_RC tcti_sched_get_poll_handles(TSS2_TCTI_CONTEXT *ctx,
+        TSS2_TCTI_POLL_HANDLE *handles, size_t *num_handles) {
+
+    tcti_sched *t = (tcti_sched *)ctx;
+    return TSS2_TCTI_GET_POLL_HANDLES(t->inner)(t->inner, handles, num_handles);
+}
+
+static TSS2_RC tcti_sched_set_locality(TSS2_TCTI_CONTEXT *ctx, uint8_t locality) {
+
+    tcti_sched *t = (tcti_sched *)ctx;
+    return TSS2_TCTI_SET_LOCALITY(t->inner)(t->inner, locality);
+}
+
+static TSS2_RC tcti_sched_make_sticky(TSS2_TCTI_CONTEXT *ctx,
+        TPM2_HANDLE *handle, uint8_t sticky) {
+
+    tcti_sched *t = (tcti_sched *)ctx;
+    return TSS2_TCTI_MAKE_STICKY(t->inner)(t->inner, handle, sticky);
+}
+
+CK_RV tpm_sched_tcti_new(const char *config, void *inner, void **wrapped) {
+
+    *wrapped = inner;
+
+    if (!inner || !sched_is_enabled()) {
+        return CKR_OK;
+    }
+
+    sched *s = sched_get(config);
+    if (!s) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    TSS2_TCTI_CONTEXT *i = (TSS2_TCTI_CONTEXT *)inner;
+
+    tcti_sched *t = calloc(1, sizeof(*t));
+    if (!t) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    t->inner = i;
+    t->s = s;
+
+    TSS2_TCTI_CONTEXT *ctx = (TSS2_TCTI_CONTEXT *)t;
+    TSS2_TCTI_MAGIC(ctx) = TCTI_SCHED_MAGIC;
+    TSS2_TCTI_VERSION(ctx) = TSS2_TCTI_VERSION(i);
+    TSS2_TCTI_TRANSMIT(ctx) = tcti_sched_transmit;
+    TSS2_TCTI_RECEIVE(ctx) = tcti_sched_receive;
+    TSS2_TCTI_FINALIZE(ctx) = tcti_sched_finalize;
+    TSS2_TCTI_CANCEL(ctx) = TSS2_TCTI_CANCEL(i) ? tcti_sched_cancel : NULL;
+    TSS2_TCTI_GET_POLL_HANDLES(ctx) =
+            TSS2_TCTI_GET_POLL_HANDLES(i) ? tcti_sched_get_poll_handles : NULL;
+    TSS2_TCTI_SET_LOCALITY(ctx) =
+            TSS2_TCTI_SET_LOCALITY(i) ? tcti_sched_set_locality : NULL;
+    if (TSS2_TCTI_VERSION(i) >= 2) {
+        TSS2_TCTI_MAKE_STICKY(ctx) =
+                TSS2_TCTI_MAKE_STICKY(i) ? tcti_sched_make_sticky : NULL;
+    }
+
+    *wrapped = ctx;
+
+    return CKR_OK;
+}
+
+void tpm_sched_tcti_free(void *inner, void *wrapped) {
+
+    if (!wrapped || wrapped == inner) {
+        return;
+    }
+
+    /* a context torn down mid command must not keep the TPM from the others */
+    sched_release((tcti_sched *)wrapped);
+    free(wrapped);
+}
+
+/* TCTI configs are free form, they may need escaping */
+static void emit_json_string(FILE *f, const char *str) {
+
+    fputc('"', f);
+    for (; *str; str++) {
+        unsigned char ch = (unsigned char)*str;
+        if (ch == '"' || ch == '\\') {
+            fprintf(f, "\\%c", ch);
+        } else if (ch < 0x20) {
+            fprintf(f, "\\u%04x", ch);
+        } else {
+            fputc(ch, f);
+        }
+    }
+    fputc('"', f);
+}
+
+void tpm_sched_emit_json(FILE *f) {
+
+    fputc('[', f);
+
+    /* schedulers are only ever added at the head, the list is safe to walk */
+    bool first = true;
+    sched *s;
+    for (s = __atomic_load_n(&_g_scheds.head, __ATOMIC_ACQUIRE); s; s = s->next) {
+        unsigned c;
+        for (c = 0; c < SCHED_CLASSES; c++) {
+            sched_stats *st = &s->stats[c];
+
+            fprintf(f, "%s{\"tcti\":", first ? "" : ",");
+            emit_json_string(f, s->tcti);
+            fprintf(f, ",\"class\":\"%s\",\"weight\":%u,\"count\":%"PRIu64
+                    ",\"overdue\":%"PRIu64",\"max_depth\":%"PRIu64",\"depth\":",
+                    class_info[c].name, class_info[c].weight,
+                    __atomic_load_n(&st->wait.cnt, __ATOMIC_ACQUIRE),
+                    __atomic_load_n(&st->overdue, __ATOMIC_RELAXED),
+                    __atomic_load_n(&st->max_depth, __ATOMIC_RELAXED));
+            stats_hist_emit_json(f, &st->depth);
+            fputs(",\"wait\":", f);
+            stats_hist_emit_json(f, &st->wait);
+            fputc('}', f);
+            first = false;
+        }
+    }
+
+    fputc(']', f);
+}
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_TPM_SCHED_H_
+#define SRC_LIB_TPM_SCHED_H_
+
+#include <stdio.h>
+
+#include "pkcs11.h"
+
+/**
+ * Wraps a TCTI context in a pass-through TCTI that takes every TPM command
+ * sent through it past the command scheduler of its TCTI config. The
+ * scheduler lets one command at a time go to the TPM and, when commands of
+ * several TPM contexts wait, picks the next one by class: interactive
+ * (signing, decryption and everything not listed below), bulk (symmetric
+ * encryption and random numbers) and background (key and primary creation).
+ *
+ * Only does so when C_Initialize allowed OS locking and the scheduler was
+ * turned on with TPM2_PKCS11_TPM_SCHED=1.
+ *
+ * The wrapper does not own the inner TCTI, it must be freed with
+ * tpm_sched_tcti_free() before the inner one is finalized.
+ * @param config
+ *  The TCTI config string the inner TCTI was made from, contexts with the
+ *  same config share a scheduler. NULL for the default TCTI.
+ * @param inner
+ *  The TCTI context to wrap.
+ * @param wrapped
+ *  The TCTI context to hand to ESAPI. Set to inner if the scheduler is
+ *  disabled.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV tpm_sched_tcti_new(const char *config, void *inner, void **wrapped);
+
+/**
+ * Frees a TCTI context returned by tpm_sched_tcti_new(), a no-op
+ * if it did not create a wrapper.
+ * @param inner
+ *  The inner TCTI context passed to tpm_sched_tcti_new().
+ * @param wrapped
+ *  The TCTI context returned by tpm_sched_tcti_new().
+ */
+void tpm_sched_tcti_free(void *inner, void *wrapped);
+
+/**
+ * Writes the statistics of each scheduler class as a JSON array, one entry
+ * per TCTI config and class.
+ * @param f
+ *  The stream to write to.
+ */
+void tpm_sched_emit_json(FILE *f);
+
+#endif /* SRC_LIB_TPM_SCHED_H_ */
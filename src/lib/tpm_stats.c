@@ -0,0 +1,393 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tss2/tss2_tcti.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "log.h"
+#include "stats.h"
+#include "tpm_stats.h"
+#include "utils.h"
+
+/*
+ * Accounting happens at the TCTI layer, beneath every Esys_* call, so the
+ * recorded latency is the time the TPM (and the transport) took for a
+ * command, excluding ESAPI session and parameter encryption work on the
+ * host. Commands ESAPI retries internally show up as individual
+ * transmissions and are counted as retries.
+ */
+
+#define TCTI_STATS_MAGIC 0x7470326b73746174ULL
+
+#define TPM_HEADER_SIZE 10
+#define TPM_HEADER_CODE_OFFSET 6
+
+/* covers TPM2_CC_FIRST up to past TPM2_CC_LAST, the last slot collects the rest */
+#define CC_SLOTS 256
+
+#define RC_SLOTS 8
+
+typedef struct rc_count rc_count;
+struct rc_count {
+    uint32_t rc;
+    uint64_t cnt;
+};
+
+typedef struct cc_stats cc_stats;
+struct cc_stats {
+    uint32_t cc;
+    uint64_t errors;
+    uint64_t retries;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t rc_overflow;
+    rc_count rcs[RC_SLOTS];
+    stats_hist latency;
+};
+
+typedef struct tcti_stats tcti_stats;
+struct tcti_stats {
+    /* must be first, ESAPI treats this as the TCTI context */
+    TSS2_TCTI_CONTEXT_COMMON_V2 common;
+    TSS2_TCTI_CONTEXT *inner;
+    /* ESAPI has at most one command outstanding per context */
+    bool pending;
+    uint32_t cc;
+    uint64_t start;
+};
+
+static cc_stats *_g_cc_stats[CC_SLOTS];
+
+static const struct {
+    uint32_t cc;
+    const char *name;
+} cc_names[] = {
+    { TPM2_CC_ContextLoad,      "ContextLoad"      },
+    { TPM2_CC_ContextSave,      "ContextSave"      },
+    { TPM2_CC_Create,           "Create"           },
+    { TPM2_CC_CreateLoaded,     "CreateLoaded"     },
+    { TPM2_CC_CreatePrimary,    "CreatePrimary"    },
+    { TPM2_CC_EncryptDecrypt,   "EncryptDecrypt"   },
+    { TPM2_CC_EncryptDecrypt2,  "EncryptDecrypt2"  },
+    { TPM2_CC_EvictControl,     "EvictControl"     },
+    { TPM2_CC_FlushContext,     "FlushContext"     },
+    { TPM2_CC_GetCapability,    "GetCapability"    },
+    { TPM2_CC_GetRandom,        "GetRandom"        },
+    { TPM2_CC_Load,             "Load"             },
+    { TPM2_CC_LoadExternal,     "LoadExternal"     },
+    { TPM2_CC_ObjectChangeAuth, "ObjectChangeAuth" },
+    { TPM2_CC_ReadPublic,       "ReadPublic"       },
+    { TPM2_CC_RSA_Decrypt,      "RSA_Decrypt"      },
+    { TPM2_CC_Sign,             "Sign"             },
+    { TPM2_CC_StartAuthSession, "StartAuthSession" },
+    { TPM2_CC_StirRandom,       "StirRandom"       },
+    { TPM2_CC_TestParms,        "TestParms"        },
+    { TPM2_CC_Unseal,           "Unseal"           },
+};
+
+static const char *cc_to_name(uint32_t cc) {
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(cc_names); i++) {
+        if (cc_names[i].cc == cc) {
+            return cc_names[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+static unsigned cc_to_slot(uint32_t cc) {
+
+    if (cc < TPM2_CC_FIRST || cc - TPM2_CC_FIRST >= CC_SLOTS - 1) {
+        return CC_SLOTS - 1;
+    }
+
+    return cc - TPM2_CC_FIRST;
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+            | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static cc_stats *cc_stats_get(uint32_t cc) {
+
+    unsigned slot = cc_to_slot(cc);
+
+    cc_stats *s = __atomic_load_n(&_g_cc_stats[slot], __ATOMIC_ACQUIRE);
+    if (s) {
+        return s;
+    }
+
+    cc_stats *n = calloc(1, sizeof(*n));
+    if (!n) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    n->cc = slot == CC_SLOTS - 1 ? 0 : cc;
+    stats_hist_init(&n->latency);
+
+    if (!__atomic_compare_exchange_n(&_g_cc_stats[slot], &s, n, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(n);
+        return s;
+    }
+
+    return n;
+}
+
+static void cc_stats_add_rc(cc_stats *s, uint32_t rc) {
+
+    unsigned i;
+    for (i = 0; i < RC_SLOTS; i++) {
+        uint32_t cur = __atomic_load_n(&s->rcs[i].rc, __ATOMIC_ACQUIRE);
+        if (!cur) {
+            /* claim the free slot, on a lost race re-check what was stored */
+            __atomic_compare_exchange_n(&s->rcs[i].rc, &cur, rc, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            if (!cur) {
+                cur = rc;
+            }
+        }
+
+        if (cur == rc) {
+            __atomic_fetch_add(&s->rcs[i].cnt, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    __atomic_fetch_add(&s->rc_overflow, 1, __ATOMIC_RELAXED);
+}
+
+static bool rc_is_retry(uint32_t rc) {
+
+    switch (rc) {
+    case TPM2_RC_RETRY:
+        /* falls-thru */
+    case TPM2_RC_YIELDED:
+        /* falls-thru */
+    case TPM2_RC_TESTING:
+        return true;
+        /* no default */
+    }
+
+    return false;
+}
+
+static void record(tcti_stats *t, size_t resp_size, const uint8_t *resp) {
+
+    uint64_t latency = stats_now() - t->start;
+    t->pending = false;
+
+    cc_stats *s = cc_stats_get(t->cc);
+    if (!s) {
+        return;
+    }
+
+    __atomic_fetch_add(&s->bytes_out, resp_size, __ATOMIC_RELAXED);
+    stats_hist_record(&s->latency, latency);
+
+    if (resp_size < TPM_HEADER_SIZE) {
+        return;
+    }
+
+    uint32_t rc = read_be32(&resp[TPM_HEADER_CODE_OFFSET]);
+    if (rc == TPM2_RC_SUCCESS) {
+        return;
+    }
+
+    if (rc_is_retry(rc)) {
+        __atomic_fetch_add(&s->retries, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+    }
+
+    cc_stats_add_rc(s, rc);
+}
+
+static TSS2_RC tcti_stats_transmit(TSS2_TCTI_CONTEXT *ctx, size_t size,
+        const uint8_t *command) {
+
+    tcti_stats *t = (tcti_stats *)ctx;
+
+    if (size >= TPM_HEADER_SIZE) {
+        t->cc = read_be32(&command[TPM_HEADER_CODE_OFFSET]);
+        t->pending = true;
+
+        cc_stats *s = cc_stats_get(t->cc);
+        if (s) {
+            __atomic_fetch_add(&s->bytes_in, size, __ATOMIC_RELAXED);
+        }
+    }
+
+    t->start = stats_now();
+
+    TSS2_RC rc = TSS2_TCTI_TRANSMIT(t->inner)(t->inner, size, command);
+    if (rc != TSS2_RC_SUCCESS) {
+        t->pending = false;
+    }
+
+    return rc;
+}
+
+static TSS2_RC tcti_stats_receive(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        uint8_t *response, int32_t timeout) {
+
+    tcti_stats *t = (tcti_stats *)ctx;
+
+    TSS2_RC rc = TSS2_TCTI_RECEIVE(t->inner)(t->inner, size, response, timeout);
+
+    /* size queries and polls with no response yet keep the command pending */
+    if (!t->pending || !response || rc == TSS2_TCTI_RC_TRY_AGAIN) {
+        return rc;
+    }
+
+    if (rc != TSS2_RC_SUCCESS) {
+        t->pending = false;
+        return rc;
+    }
+
+    record(t, *size, response);
+
+    return rc;
+}
+
+static void tcti_stats_finalize(TSS2_TCTI_CONTEXT *ctx) {
+    /* the inner TCTI is finalized by its owner */
+    UNUSED(ctx);
+}
+
+static TSS2_RC tcti_stats_cancel(TSS2_TCTI_CONTEXT *ctx) {
+
+    tcti_stats *t = (tcti_stats *)ctx;
+    t->pending = false;
+    return TSS2_TCTI_CANCEL(t->inner)(t->inner);
+}
+
+static TSS2_RC tcti_stats_get_poll_handles(TSS2_TCTI_CONTEXT *ctx,
+        TSS2_TCTI_POLL_HANDLE *handles, size_t *num_handles) {
+
+    tcti_stats *t = (tcti_stats *)ctx;
+    return TSS2_TCTI_GET_POLL_HANDLES(t->inner)(t->inner, handles, num_handles);
+}
+
+static TSS2_RC tcti_stats_set_locality(TSS2_TCTI_CONTEXT *ctx, uint8_t locality) {
+
+    tcti_stats *t = (tcti_stats *)ctx;
+    return TSS2_TCTI_SET_LOCALITY(t->inner)(t->inner, locality);
+}
+
+static TSS2_RC tcti_stats_make_sticky(TSS2_TCTI_CONTEXT *ctx,
+        TPM2_HANDLE *handle, uint8_t sticky) {
+
+    tcti_stats *t = (tcti_stats *)ctx;
+    return TSS2_TCTI_MAKE_STICKY(t->inner)(t->inner, handle, sticky);
+}
+
+CK_RV tpm_stats_tcti_new(void *inner, void **wrapped) {
+
+    *wrapped = inner;
+
+    if (!inner || !stats_is_enabled()) {
+        return CKR_OK;
+    }
+
+    TSS2_TCTI_CONTEXT *i = (TSS2_TCTI_CONTEXT *)inner;
+
+    tcti_stats *t = calloc(1, sizeof(*t));
+    if (!t) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    t->inner = i;
+
+    TSS2_TCTI_CONTEXT *ctx = (TSS2_TCTI_CONTEXT *)t;
+    TSS2_TCTI_MAGIC(ctx) = TCTI_STATS_MAGIC;
+    TSS2_TCTI_VERSION(ctx) = TSS2_TCTI_VERSION(i);
+    TSS2_TCTI_TRANSMIT(ctx) = tcti_stats_transmit;
+    TSS2_TCTI_RECEIVE(ctx) = tcti_stats_receive;
+    TSS2_TCTI_FINALIZE(ctx) = tcti_stats_finalize;
+    TSS2_TCTI_CANCEL(ctx) = TSS2_TCTI_CANCEL(i) ? tcti_stats_cancel : NULL;
+    TSS2_TCTI_GET_POLL_HANDLES(ctx) =
+            TSS2_TCTI_GET_POLL_HANDLES(i) ? tcti_stats_get_poll_handles : NULL;
+    TSS2_TCTI_SET_LOCALITY(ctx) =
+            TSS2_TCTI_SET_LOCALITY(i) ? tcti_stats_set_locality : NULL;
+    if (TSS2_TCTI_VERSION(i) >= 2) {
+        TSS2_TCTI_MAKE_STICKY(ctx) =
+                TSS2_TCTI_MAKE_STICKY(i) ? tcti_stats_make_sticky : NULL;
+    }
+
+    *wrapped = ctx;
+
+    return CKR_OK;
+}
+
+void tpm_stats_tcti_free(void *inner, void *wrapped) {
+
+    if (wrapped && wrapped != inner) {
+        free(wrapped);
+    }
+}
+
+void tpm_stats_emit_json(FILE *f) {
+
+    fputc('[', f);
+
+    bool first = true;
+    unsigned i;
+    for (i = 0; i < CC_SLOTS; i++) {
+        cc_stats *s = __atomic_load_n(&_g_cc_stats[i], __ATOMIC_ACQUIRE);
+        if (!s) {
+            continue;
+        }
+
+        const char *name = cc_to_name(s->cc);
+        fprintf(f, "%s{\"cc\":%"PRIu32",\"count\":%"PRIu64",",
+                first ? "" : ",", s->cc,
+                __atomic_load_n(&s->latency.cnt, __ATOMIC_ACQUIRE));
+        if (name) {
+            fprintf(f, "\"command\":\"%s\",", name);
+        }
+
+        fprintf(f, "\"errors\":%"PRIu64",\"retries\":%"PRIu64
+                ",\"bytes_in\":%"PRIu64",\"bytes_out\":%"PRIu64
+                ",\"rc\":{",
+                __atomic_load_n(&s->errors, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->retries, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->bytes_in, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->bytes_out, __ATOMIC_RELAXED));
+
+        bool first_rc = true;
+        unsigned j;
+        for (j = 0; j < RC_SLOTS; j++) {
+            uint32_t rc = __atomic_load_n(&s->rcs[j].rc, __ATOMIC_ACQUIRE);
+            if (!rc) {
+                break;
+            }
+            fprintf(f, "%s\"0x%"PRIx32"\":%"PRIu64, first_rc ? "" : ",", rc,
+                    __atomic_load_n(&s->rcs[j].cnt, __ATOMIC_RELAXED));
+            first_rc = false;
+        }
+
+        uint64_t overflow = __atomic_load_n(&s->rc_overflow, __ATOMIC_RELAXED);
+        if (overflow) {
+            fprintf(f, "%s\"other\":%"PRIu64, first_rc ? "" : ",", overflow);
+        }
+
+        fputs("},\"latency\":", f);
+        stats_hist_emit_json(f, &s->latency);
+        fputc('}', f);
+        first = false;
+    }
+
+    fputc(']', f);
+}
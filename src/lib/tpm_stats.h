@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_TPM_STATS_H_
+#define SRC_LIB_TPM_STATS_H_
+
+#include <stdio.h>
+
+#include "pkcs11.h"
+
+/**
+ * Wraps a TCTI context in a pass-through TCTI that accounts every TPM
+ * command sent through it: count, TPM latency, response codes, retries
+ * and bytes in and out. Only does so when stats are enabled, see stats.h.
+ *
+ * The wrapper does not own the inner TCTI, it must be freed with
+ * tpm_stats_tcti_free() before the inner one is finalized.
+ * @param inner
+ *  The TCTI context to wrap.
+ * @param wrapped
+ *  The TCTI context to hand to ESAPI. Set to inner if stats are disabled.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV tpm_stats_tcti_new(void *inner, void **wrapped);
+
+/**
+ * Frees a TCTI context returned by tpm_stats_tcti_new(), a no-op
+ * if it did not create a wrapper.
+ * @param inner
+ *  The inner TCTI context passed to tpm_stats_tcti_new().
+ * @param wrapped
+ *  The TCTI context returned by tpm_stats_tcti_new().
+ */
+void tpm_stats_tcti_free(void *inner, void *wrapped);
+
+/**
+ * Writes the per TPM command statistics as a JSON array.
+ * @param f
+ *  The stream to write to.
+ */
+void tpm_stats_emit_json(FILE *f);
+
+#endif /* SRC_LIB_TPM_STATS_H_ */
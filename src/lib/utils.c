@@ -1,8 +1,12 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 
@@ -22,7 +26,8 @@ int str_to_ul(const char *val, size_t *res) {
     return 0;
 }
 
-CK_RV utils_setup_new_object_auth(twist newpin, twist *newauthhex, twist *newsalthex) {
+CK_RV utils_setup_new_object_auth(twist newpin, const char *kdf,
+        twist *newauthhex, twist *newsalthex) {
 
     CK_RV rv = CKR_GENERAL_ERROR;
 
@@ -43,6 +48,31 @@ CK_RV utils_setup_new_object_auth(twist newpin, twist *newauthhex, twist *newsal
         }
     } else {
         pin_to_use = newpin;
+
+        pin_kdf k;
+        if (!utils_pin_kdf_parse(kdf, &k)) {
+            goto out;
+        }
+
+        /* the salt carries the KDF, which makes utils_hash_pass() use it */
+        if (k.alg == pin_kdf_scrypt) {
+            char prefix[64];
+            snprintf(prefix, sizeof(prefix), "$scrypt$ln=%u,r=%u,p=%u$",
+                    k.ln, k.r, k.p);
+
+            binarybuffer parts[] = {
+                { .data = prefix, .size = strlen(prefix) },
+                { .data = salt_to_use, .size = twist_len(salt_to_use) },
+            };
+            twist tmp = twistbin_create(parts, ARRAY_LEN(parts));
+            if (!tmp) {
+                LOGE("oom");
+                rv = CKR_HOST_MEMORY;
+                goto out;
+            }
+            twist_free(salt_to_use);
+            salt_to_use = tmp;
+        }
     }
 
     *newauthhex = utils_hash_pass(pin_to_use, salt_to_use);
@@ -328,8 +358,163 @@ out:
 
 }
 
+/*
+ * Parses name=value scrypt parameters separated by commas up to the end
+ * character, returns a pointer to it or NULL on error.
+ */
+static const char *scrypt_params_parse(const char *s, char end, pin_kdf *k) {
+
+    while (true) {
+        unsigned *v;
+        if (!strncmp(s, "ln=", 3)) {
+            v = &k->ln;
+            s += 3;
+        } else if (!strncmp(s, "r=", 2)) {
+            v = &k->r;
+            s += 2;
+        } else if (!strncmp(s, "p=", 2)) {
+            v = &k->p;
+            s += 2;
+        } else {
+            return NULL;
+        }
+
+        if (!isdigit((unsigned char)*s)) {
+            return NULL;
+        }
+
+        char *e = NULL;
+        errno = 0;
+        unsigned long x = strtoul(s, &e, 10);
+        if (errno || x > UINT_MAX) {
+            return NULL;
+        }
+        *v = x;
+        s = e;
+
+        if (*s == end) {
+            return s;
+        }
+
+        if (*s != ',') {
+            return NULL;
+        }
+        s++;
+    }
+}
+
+/* 128 * r * 2^ln bytes of memory, a derivation must fit in 1 GiB */
+#define PIN_KDF_SCRYPT_MAX_MEM (1ULL << 30)
+
+static bool scrypt_params_ok(const pin_kdf *k) {
+
+    if (k->ln < 10 || k->ln > 22
+            || k->r < 1 || k->r > 32
+            || k->p < 1 || k->p > 16) {
+        return false;
+    }
+
+    return 128ULL * k->r * (1ULL << k->ln) <= PIN_KDF_SCRYPT_MAX_MEM;
+}
+
+bool utils_pin_kdf_parse(const char *spec, pin_kdf *kdf) {
+
+    pin_kdf k = {
+        .alg = pin_kdf_scrypt,
+        .ln = PIN_KDF_SCRYPT_DEFAULT_LN,
+        .r = PIN_KDF_SCRYPT_DEFAULT_R,
+        .p = PIN_KDF_SCRYPT_DEFAULT_P,
+    };
+
+    if (!spec || !strcmp(spec, "scrypt")) {
+        *kdf = k;
+        return true;
+    }
+
+    if (!strcmp(spec, "sha256")) {
+        k.alg = pin_kdf_sha256;
+        *kdf = k;
+        return true;
+    }
+
+    if (strncmp(spec, "scrypt:", 7)
+            || !scrypt_params_parse(&spec[7], '\0', &k)
+            || !scrypt_params_ok(&k)) {
+        LOGE("pin-kdf must be \"sha256\", \"scrypt\" or"
+                " \"scrypt:ln=<10-22>,r=<1-32>,p=<1-16>\" using at most 1 GiB,"
+                " got: \"%s\"", spec);
+        return false;
+    }
+
+    *kdf = k;
+    return true;
+}
+
+bool utils_pin_kdf_derive(const pin_kdf *kdf, const twist pin,
+        const unsigned char *salt, size_t saltlen,
+        unsigned char *out, size_t outlen) {
+
+    if (kdf->alg != pin_kdf_scrypt || !scrypt_params_ok(kdf)) {
+        LOGE("Bad scrypt parameters ln=%u, r=%u, p=%u", kdf->ln, kdf->r, kdf->p);
+        return false;
+    }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    UNUSED(pin);
+    UNUSED(salt);
+    UNUSED(saltlen);
+    UNUSED(out);
+    UNUSED(outlen);
+    LOGE("scrypt needs OpenSSL 1.1.0 or newer");
+    return false;
+#else
+    /* the scratch space OpenSSL checks against maxmem */
+    uint64_t n = 1ULL << kdf->ln;
+    uint64_t maxmem = 128ULL * kdf->r * (n + 2 + kdf->p);
+
+    int rc = EVP_PBE_scrypt((const char *)pin, twist_len(pin),
+            salt, saltlen, n, kdf->r, kdf->p, maxmem, out, outlen);
+    if (rc != 1) {
+        LOGE("EVP_PBE_scrypt failed");
+        return false;
+    }
+
+    return true;
+#endif
+}
+
+static twist hash_pass_scrypt(const twist pin, const char *salt, const pin_kdf *k) {
+
+    unsigned char md[AUTH_HEX_STR_SIZE / 2];
+
+    bool res = utils_pin_kdf_derive(k, pin, (const unsigned char *)salt,
+            strlen(salt), md, sizeof(md));
+    if (!res) {
+        return NULL;
+    }
+
+    twist auth = twist_hex_new((char *)md, sizeof(md));
+    OPENSSL_cleanse(md, sizeof(md));
+    return auth;
+}
+
 twist utils_hash_pass(const twist pin, const twist salt) {
 
+    if (salt[0] == '$') {
+        /* every parameter is in the salt, defaults could change */
+        pin_kdf k = { .alg = pin_kdf_scrypt };
+        const char *end = NULL;
+        if (!strncmp(salt, "$scrypt$", 8)) {
+            end = scrypt_params_parse(&salt[8], '$', &k);
+        }
+
+        if (!end || !scrypt_params_ok(&k)) {
+            LOGE("Unknown PIN KDF in seal object salt, got: \"%.32s\"", salt);
+            return NULL;
+        }
+
+        return hash_pass_scrypt(pin, &end[1], &k);
+    }
 
     unsigned char md[SHA256_DIGEST_LENGTH];
 
@@ -439,6 +624,70 @@ CK_RV utils_ctx_wrap_objauth(twist wrappingkey, twist data, twist *wrapped_auth)
     return CKR_OK;
 }
 
+static bool pin_verifier_mac(const unsigned char *key, twist pin,
+        unsigned char mac[PIN_VERIFIER_SIZE]) {
+
+    unsigned int len = PIN_VERIFIER_SIZE;
+    unsigned char *r = HMAC(EVP_sha256(), key, PIN_VERIFIER_SIZE,
+            (const unsigned char *)pin, twist_len(pin), mac, &len);
+    if (!r || len != PIN_VERIFIER_SIZE) {
+        LOGE("HMAC failed");
+        return false;
+    }
+
+    return true;
+}
+
+CK_RV utils_pin_verifier_set(pin_verifier *v, twist pin) {
+    assert(v);
+    assert(pin);
+
+    utils_pin_verifier_clear(v);
+
+    /*
+     * The verifier lives as long as the wrapping key it stands in for, which
+     * unlocks more than the PIN does, so a keyed hash is enough. The key
+     * keeps the MAC from being checked against a list of common PINs
+     * computed ahead of time.
+     */
+    if (RAND_bytes(v->key, sizeof(v->key)) != 1) {
+        LOGE("Could not generate random bytes");
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (!pin_verifier_mac(v->key, pin, v->mac)) {
+        utils_pin_verifier_clear(v);
+        return CKR_GENERAL_ERROR;
+    }
+
+    v->is_set = true;
+
+    return CKR_OK;
+}
+
+bool utils_pin_verifier_check(const pin_verifier *v, twist pin) {
+    assert(v);
+    assert(v->is_set);
+    assert(pin);
+
+    unsigned char mac[PIN_VERIFIER_SIZE];
+    if (!pin_verifier_mac(v->key, pin, mac)) {
+        return false;
+    }
+
+    bool match = !CRYPTO_memcmp(mac, v->mac, sizeof(mac));
+    OPENSSL_cleanse(mac, sizeof(mac));
+
+    return match;
+}
+
+void utils_pin_verifier_clear(pin_verifier *v) {
+    assert(v);
+
+    OPENSSL_cleanse(v, sizeof(*v));
+    v->is_set = false;
+}
+
 CK_RV ec_params_to_nid(CK_ATTRIBUTE_PTR ecparams, int *nid) {
 
     const unsigned char *p = ecparams->pValue;
@@ -42,6 +42,73 @@ static inline void str_padded_copy(CK_UTF8CHAR_PTR dst, const CK_UTF8CHAR_PTR sr
     memcpy(dst, src, strnlen((char *)(src), dst_len));
 }
 
+/* derives seal object auth values from PINs, see utils_hash_pass() */
+enum pin_kdf_alg {
+    pin_kdf_sha256 = 0, /* SHA256(pin || salt), the only KDF before schema version 11 */
+    pin_kdf_scrypt
+};
+
+#define PIN_KDF_SCRYPT_DEFAULT_LN 14
+#define PIN_KDF_SCRYPT_DEFAULT_R  8
+#define PIN_KDF_SCRYPT_DEFAULT_P  1
+
+typedef struct pin_kdf pin_kdf;
+struct pin_kdf {
+    enum pin_kdf_alg alg;
+    /* scrypt cost, N is 2^ln */
+    unsigned ln;
+    unsigned r;
+    unsigned p;
+};
+
+/**
+ * Parses a pin-kdf token config: "sha256", "scrypt" or scrypt with its
+ * cost, eg "scrypt:ln=15,r=8,p=1", where a left out parameter keeps its
+ * default.
+ * @param spec
+ *  The config value, NULL for the default, scrypt with ln=14, r=8 and p=1.
+ * @param kdf
+ *  The parsed KDF.
+ * @return
+ *  true on success, false if spec is not valid.
+ */
+bool utils_pin_kdf_parse(const char *spec, pin_kdf *kdf);
+
+/**
+ * Derives key material from a PIN with scrypt.
+ * @param kdf
+ *  The scrypt cost, the parameters are checked as utils_pin_kdf_parse()
+ *  checks them.
+ * @param pin
+ *  The PIN.
+ * @param salt
+ *  The salt.
+ * @param saltlen
+ *  The length of the salt.
+ * @param out
+ *  The derived bytes.
+ * @param outlen
+ *  The number of bytes to derive.
+ * @return
+ *  true on success, false if kdf is not scrypt with valid parameters or
+ *  on error.
+ */
+bool utils_pin_kdf_derive(const pin_kdf *kdf, const twist pin,
+        const unsigned char *salt, size_t saltlen,
+        unsigned char *out, size_t outlen);
+
+/**
+ * Derives the auth value of a seal object from a PIN with the KDF the salt
+ * names. A salt of only hex digits is a SHA256(pin || salt) salt of schema
+ * versions before 11, other salts start with the KDF and its cost, eg
+ * "$scrypt$ln=14,r=8,p=1$<hex salt>".
+ * @param pin
+ *  The PIN.
+ * @param salt
+ *  The salt, as utils_setup_new_object_auth() made it.
+ * @return
+ *  The hex encoded auth value, NULL on error.
+ */
 twist utils_hash_pass(const twist pin, const twist salt);
 
 twist aes256_gcm_decrypt(const twist key, const twist objauth);
@@ -64,15 +131,72 @@ size_t utils_get_halg_size(CK_MECHANISM_TYPE mttype);
  */
 twist utils_get_rand_hex_str(size_t size);
 
-CK_RV utils_setup_new_object_auth(twist newpin, twist *newauthhex, twist *newsalthex);
+/**
+ * Makes a new auth value and its salt.
+ * @param newpin
+ *  The PIN to derive the auth value from, NULL for a random auth value.
+ * @param kdf
+ *  The pin-kdf config of the token, NULL for the default. Unused without a
+ *  PIN, random auth values need no stretching.
+ * @param newauthhex
+ *  The hex encoded auth value.
+ * @param newsalthex
+ *  The salt to store, may be NULL.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV utils_setup_new_object_auth(twist newpin, const char *kdf,
+        twist *newauthhex, twist *newsalthex);
 
 static inline CK_RV utils_new_random_object_auth(twist *newauthhex) {
-    return utils_setup_new_object_auth(NULL, newauthhex, NULL);
+    return utils_setup_new_object_auth(NULL, NULL, newauthhex, NULL);
 }
 
 CK_RV utils_ctx_unwrap_objauth(twist wrappingkey, twist objauth, twist *unwrapped_auth);
 CK_RV utils_ctx_wrap_objauth(twist wrappingkey, twist objauth, twist *wrapped_auth);
 
+#define PIN_VERIFIER_SIZE 32
+
+/**
+ * An in memory verifier of a PIN, an HMAC-SHA256 of the PIN under a
+ * random key.
+ */
+typedef struct pin_verifier pin_verifier;
+struct pin_verifier {
+    bool is_set;
+    unsigned char key[PIN_VERIFIER_SIZE];
+    unsigned char mac[PIN_VERIFIER_SIZE];
+};
+
+/**
+ * Sets a verifier of a PIN with a new random key.
+ * @param v
+ *  The verifier to set, left unset on error.
+ * @param pin
+ *  The PIN.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV utils_pin_verifier_set(pin_verifier *v, twist pin);
+
+/**
+ * Checks a PIN against a verifier in constant time.
+ * @param v
+ *  The verifier, must be set.
+ * @param pin
+ *  The PIN to check.
+ * @return
+ *  true if the PIN is the one of the verifier.
+ */
+bool utils_pin_verifier_check(const pin_verifier *v, twist pin);
+
+/**
+ * Cleanses a verifier and marks it unset.
+ * @param v
+ *  The verifier to clear.
+ */
+void utils_pin_verifier_clear(pin_verifier *v);
+
 /**
  * Given an attribute of CKA_EC_PARAMS returns the nid value.
  * @param ecparams
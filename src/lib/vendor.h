@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_VENDOR_H_
+#define SRC_LIB_VENDOR_H_
+
+#include "pkcs11.h"
+
+/*
+ * Vendor specific entry points exported from libtpm2_pkcs11.so in addition
+ * to the cryptoki API. They are not part of CK_FUNCTION_LIST, so callers
+ * need to resolve them with dlsym().
+ */
+
+/**
+ * Returns the entry point statistics collected when TPM2_PKCS11_STATS
+ * is set, as a JSON document. See stats_get_json().
+ */
+CK_RV tpm2_pkcs11_get_stats(CK_BYTE_PTR buf, CK_ULONG_PTR len);
+
+/**
+ * Commits the object writes held back for tokens configured with
+ * "durability: batch". See backend_flush().
+ */
+CK_RV tpm2_pkcs11_flush(void);
+
+#endif /* SRC_LIB_VENDOR_H_ */
@@ -7,17 +7,21 @@
 
 #include "pkcs11.h"
 
+#include "backend.h"
 #include "digest.h"
 #include "encrypt.h"
 #include "key.h"
 #include "log.h"
 #include "general.h"
 #include "object.h"
+#include "probes.h"
 #include "random.h"
 #include "session.h"
 #include "sign.h"
 #include "slot.h"
+#include "stats.h"
 #include "token.h"
+#include "vendor.h"
 
 // TODO REMOVE ME
 #pragma GCC diagnostic push
@@ -34,6 +38,66 @@
  */
 #define _TRACE_RET(rv) LOGV("return \"%s\" value: %lu", __func__, rv);
 
+/**
+ * Fires the pkcs11__entry USDT probe.
+ * @param slot
+ *  The slot id the call was made with, 0 if none.
+ * @param session
+ *  The session handle the call was made with, 0 if none.
+ */
+#define _PROBE_ENTRY(slot, session) \
+    PROBE3(pkcs11__entry, __func__, (unsigned long)(slot), (unsigned long)(session))
+
+/**
+ * Fires the pkcs11__return USDT probe. It expects rv to be declared as a CK_RV
+ * and contain the actual return value.
+ * @param slot
+ *  The slot id the call operated on, 0 if none.
+ * @param session
+ *  The session handle the call was made with, 0 if none.
+ */
+#define _PROBE_RETURN(slot, session) \
+    PROBE4(pkcs11__return, __func__, (unsigned long)(slot), (unsigned long)(session), rv)
+
+/**
+ * Starts latency accounting for the calling entry point, see stats.h. The
+ * per function site record is a static local, so it costs nothing when
+ * TPM2_PKCS11_STATS is not set beyond a flag check.
+ */
+#define _STATS_START \
+    static stats_site _stats_site = STATS_SITE_INIT(__func__); \
+    stats_call _stats = { 0 }; \
+    stats_call_start(&_stats)
+
+/**
+ * Finishes latency accounting for the calling entry point. It expects rv to
+ * be declared as a CK_RV and contain the actual return value.
+ * @param tokid
+ *  The id of the token the call operated on, 0 if none.
+ */
+#define _STATS_END(tokid) stats_call_end(&_stats_site, &_stats, tokid, rv)
+
+/**
+ * Locks a token, accounting the time spent waiting for the lock.
+ */
+#define _STATS_TOKEN_LOCK(t) \
+    stats_call_lock_attempt(&_stats); \
+    token_lock(t); \
+    stats_call_lock_acquired(&_stats)
+
+/**
+ * Unlocks a token, accounting the time the lock was held.
+ */
+#define _STATS_TOKEN_UNLOCK(t) \
+    stats_call_lock_released(&_stats); \
+    token_unlock(t)
+
+/**
+ * Commits batched object writes that outlived their window, for when the
+ * library may not run a thread to do it.
+ */
+#define _FLUSH_DUE backend_flush_due()
+
 /**
  * Calls a user supplied function with arguments logging the function entry and
  * exit.
@@ -52,25 +116,64 @@
 #define TOKEN_CALL_INIT(fn, ...) \
      CK_RV rv = CKR_GENERAL_ERROR; \
     _TRACE_CALL; \
+    _PROBE_ENTRY(0, 0); \
+    _STATS_START; \
     _CHECK_INIT(out); \
     rv = fn(__VA_ARGS__); \
   out: \
+    _STATS_END(0); \
+    _PROBE_RETURN(0, 0); \
+    _TRACE_RET(rv); \
+    return rv;
+
+/**
+ * Same as TOKEN_CALL_INIT for routines that take a slot id as their first
+ * argument, accounting the call to the slot's token.
+ * @param fn
+ *   The user function to run.
+ * @param slot
+ *  The slot id, passed to fn.
+ * @param varargs
+ *  The remaining arguments to pass to fn
+ * @return
+ *  The rv value of running fn.
+ */
+#define TOKEN_CALL_INIT_SLOT(fn, slot, ...) \
+     CK_RV rv = CKR_GENERAL_ERROR; \
+    token *t = NULL; \
+    _TRACE_CALL; \
+    _PROBE_ENTRY(slot, 0); \
+    _STATS_START; \
+    _CHECK_INIT(out); \
+    t = slot_get_token(slot); \
+    rv = fn(slot, ##__VA_ARGS__); \
+  out: \
+    _STATS_END(t ? t->id : 0); \
+    _PROBE_RETURN(slot, 0); \
     _TRACE_RET(rv); \
     return rv;
 
 #define TOKEN_CALL(fn, ...) \
      CK_RV rv = CKR_GENERAL_ERROR; \
     _TRACE_CALL; \
+    _PROBE_ENTRY(0, 0); \
+    _STATS_START; \
     rv = fn(__VA_ARGS__); \
+    _STATS_END(0); \
+    _PROBE_RETURN(0, 0); \
     _TRACE_RET(rv); \
     return rv;
 
 #define TOKEN_CALL_NO_INIT(fn, ...) \
     CK_RV rv = CKR_GENERAL_ERROR; \
     _TRACE_CALL; \
+    _PROBE_ENTRY(0, 0); \
+    _STATS_START; \
     _CHECK_NO_INIT(out); \
     rv = fn(__VA_ARGS__); \
   out: \
+    _STATS_END(0); \
+    _PROBE_RETURN(0, 0); \
     _TRACE_RET(rv); \
     return rv;
 
@@ -135,19 +238,25 @@
 do { \
     \
     _TRACE_CALL; \
+    _PROBE_ENTRY(slot, 0); \
+    _STATS_START; \
     CK_RV rv = CKR_GENERAL_ERROR; \
+    token *t = NULL; \
     _CHECK_INIT(out); \
     \
-    token *t = slot_get_token(slot); \
+    t = slot_get_token(slot); \
     if (!t) { \
         rv = CKR_SLOT_ID_INVALID; \
         goto out; \
     } \
     \
-    token_lock(t); \
+    _STATS_TOKEN_LOCK(t); \
     rv = userfunc(t, ##__VA_ARGS__); \
-    token_unlock(t); \
+    _STATS_TOKEN_UNLOCK(t); \
+    _FLUSH_DUE; \
   out: \
+    _STATS_END(t ? t->id : 0); \
+    _PROBE_RETURN(slot, 0); \
     _TRACE_RET(rv); \
     return rv; \
 } while (0)
@@ -171,16 +280,22 @@ do { \
 #define __TOKEN_WITH_LOCK_BY_SESSION(authfn, userfunc, session, ...) \
 do { \
     _TRACE_CALL; \
+    _PROBE_ENTRY(0, session); \
+    _STATS_START; \
     CK_RV rv = CKR_GENERAL_ERROR; \
+    token *t = NULL; \
+    session_ctx *ctx = NULL; \
     \
     _CHECK_INIT(out); \
     \
-    token *t = NULL; \
-    session_ctx *ctx = NULL; \
+    /* session_lookup() returns with the token locked */ \
+    stats_call_lock_attempt(&_stats); \
     rv = session_lookup(session, &t, &ctx); \
     if (rv != CKR_OK) { \
+        t = NULL; \
         goto out; \
     } \
+    stats_call_lock_acquired(&_stats); \
     \
     rv = authfn(ctx); \
     if (rv != CKR_OK) { \
@@ -188,8 +303,11 @@ do { \
     } \
     rv = userfunc(ctx, ##__VA_ARGS__); \
   unlock: \
-    token_unlock(t); \
+    _STATS_TOKEN_UNLOCK(t); \
+    _FLUSH_DUE; \
   out: \
+    _STATS_END(t ? t->id : 0); \
+    _PROBE_RETURN(t ? t->id : 0, session); \
     _TRACE_RET(rv); \
     return rv; \
 } while (0)
@@ -197,16 +315,22 @@ do { \
 #define __TOKEN_WITH_LOCK_BY_SESSION_TOKEN(authfn, userfunc, session, ...) \
 do { \
     _TRACE_CALL; \
+    _PROBE_ENTRY(0, session); \
+    _STATS_START; \
     CK_RV rv = CKR_GENERAL_ERROR; \
+    token *t = NULL; \
+    session_ctx *ctx = NULL; \
     \
     _CHECK_INIT(out); \
     \
-    token *t = NULL; \
-    session_ctx *ctx = NULL; \
+    /* session_lookup() returns with the token locked */ \
+    stats_call_lock_attempt(&_stats); \
     rv = session_lookup(session, &t, &ctx); \
     if (rv != CKR_OK) { \
+        t = NULL; \
         goto out; \
     } \
+    stats_call_lock_acquired(&_stats); \
     \
     rv = authfn(ctx); \
     if (rv != CKR_OK) { \
@@ -214,8 +338,11 @@ do { \
     } \
     rv = userfunc(t, ##__VA_ARGS__); \
   unlock: \
-    token_unlock(t); \
+    _STATS_TOKEN_UNLOCK(t); \
+    _FLUSH_DUE; \
   out: \
+    _STATS_END(t ? t->id : 0); \
+    _PROBE_RETURN(t ? t->id : 0, session); \
     _TRACE_RET(rv); \
     return rv; \
 } while (0)
@@ -227,15 +354,21 @@ do { \
 do { \
     \
     _TRACE_CALL; \
+    _PROBE_ENTRY(0, session); \
+    _STATS_START; \
     CK_RV rv = CKR_GENERAL_ERROR; \
-    _CHECK_INIT(out); \
-    \
     token *t = NULL; \
     session_ctx *ctx = NULL; \
+    _CHECK_INIT(out); \
+    \
+    /* session_lookup() returns with the token locked */ \
+    stats_call_lock_attempt(&_stats); \
     rv = session_lookup(session, &t, &ctx); \
     if (rv != CKR_OK) { \
+        t = NULL; \
         goto out; \
     } \
+    stats_call_lock_acquired(&_stats); \
     \
     rv = authfn(ctx); \
     if (rv != CKR_OK) { \
@@ -243,8 +376,11 @@ do { \
     } \
     rv = userfunc(t, ctx, ##__VA_ARGS__); \
   unlock: \
-    token_unlock(t); \
+    _STATS_TOKEN_UNLOCK(t); \
+    _FLUSH_DUE; \
   out: \
+    _STATS_END(t ? t->id : 0); \
+    _PROBE_RETURN(t ? t->id : 0, session); \
     _TRACE_RET(rv); \
     return rv; \
 } while (0)
@@ -392,7 +528,7 @@ CK_RV C_GetSlotList (CK_BYTE token_present, CK_SLOT_ID *slot_list, CK_ULONG_PTR
 }
 
 CK_RV C_GetSlotInfo (CK_SLOT_ID slotID, CK_SLOT_INFO *info) {
-    TOKEN_CALL_INIT(slot_get_info, slotID, info);
+    TOKEN_CALL_INIT_SLOT(slot_get_info, slotID, info);
 }
 
 CK_RV C_GetTokenInfo (CK_SLOT_ID slotID, CK_TOKEN_INFO *info) {
@@ -404,11 +540,11 @@ CK_RV C_WaitForSlotEvent (CK_FLAGS flags, CK_SLOT_ID *slot, void *pReserved) {
 }
 
 CK_RV C_GetMechanismList (CK_SLOT_ID slotID, CK_MECHANISM_TYPE *mechanism_list, CK_ULONG_PTR count) {
-    TOKEN_CALL_INIT(slot_mechanism_list_get, slotID, mechanism_list, count);
+    TOKEN_CALL_INIT_SLOT(slot_mechanism_list_get, slotID, mechanism_list, count);
 }
 
 CK_RV C_GetMechanismInfo (CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO *info) {
-    TOKEN_CALL_INIT(slot_mechanism_info_get, slotID, type, info);
+    TOKEN_CALL_INIT_SLOT(slot_mechanism_info_get, slotID, type, info);
 }
 
 CK_RV C_InitToken (CK_SLOT_ID slotID, CK_BYTE_PTR pin, CK_ULONG pin_len, CK_BYTE_PTR label) {
@@ -424,7 +560,7 @@ CK_RV C_SetPIN (CK_SESSION_HANDLE session, CK_UTF8CHAR_PTR old_pin, CK_ULONG old
 }
 
 CK_RV C_OpenSession (CK_SLOT_ID slotID, CK_FLAGS flags, void *application, CK_NOTIFY notify, CK_SESSION_HANDLE *session) {
-    TOKEN_CALL_INIT(session_open, slotID, flags, application, notify, session);
+    TOKEN_CALL_INIT_SLOT(session_open, slotID, flags, application, notify, session);
 }
 
 CK_RV C_CloseSession (CK_SESSION_HANDLE session) {
@@ -432,7 +568,7 @@ CK_RV C_CloseSession (CK_SESSION_HANDLE session) {
 }
 
 CK_RV C_CloseAllSessions (CK_SLOT_ID slotID) {
-    TOKEN_CALL_INIT(session_closeall, slotID);
+    TOKEN_CALL_INIT_SLOT(session_closeall, slotID);
 }
 
 CK_RV C_GetSessionInfo (CK_SESSION_HANDLE session, CK_SESSION_INFO *info) {
@@ -643,5 +779,13 @@ CK_RV C_CancelFunction (CK_SESSION_HANDLE session) {
     TOKEN_UNSUPPORTED;
 }
 
+CK_RV tpm2_pkcs11_get_stats (CK_BYTE_PTR buf, CK_ULONG_PTR len) {
+    TOKEN_CALL(stats_get_json, buf, len);
+}
+
+CK_RV tpm2_pkcs11_flush (void) {
+    TOKEN_CALL_INIT(backend_flush);
+}
+
 // TODO REMOVE ME
 #pragma GCC diagnostic pop
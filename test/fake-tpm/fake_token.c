@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cmocka.h>
+
+#include "db.h"
+#include "fake_tpm.h"
+#include "fake_token.h"
+#include "slot.h"
+
+static void init(fake_token *ft, CK_FLAGS flags) {
+
+    CK_C_INITIALIZE_ARGS args = { .flags = flags };
+    CK_RV rv = C_Initialize(&args);
+    assert_int_equal(rv, CKR_OK);
+
+    ft->tok = slot_get_token(ft->slot);
+    assert_non_null(ft->tok);
+}
+
+/* a store whose first primary object is the transient one of a template */
+static void add_transient_primary(const char *template_name) {
+
+    CK_RV rv = db_init();
+    assert_int_equal(rv, CKR_OK);
+
+    pobject pobj = { 0 };
+    pobj.config.is_transient = true;
+    pobj.config.template_name = (char *)template_name;
+
+    unsigned pid = 0;
+    rv = db_add_primary(&pobj, &pid);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(pid, 1);
+
+    rv = db_destroy();
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void login(CK_SESSION_HANDLE session, CK_USER_TYPE user, const char *pin) {
+
+    CK_RV rv = C_Login(session, user, (CK_UTF8CHAR_PTR)pin, strlen(pin));
+    assert_int_equal(rv, CKR_OK);
+}
+
+void fake_token_setup(fake_token *ft, CK_FLAGS flags, const char *template_name) {
+
+    memset(ft, 0, sizeof(*ft));
+
+    fake_tpm_reset();
+
+    snprintf(ft->dir, sizeof(ft->dir), "%s/tpm2-pkcs11-test-XXXXXX",
+            getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    assert_non_null(mkdtemp(ft->dir));
+    assert_int_equal(setenv("TPM2_PKCS11_STORE", ft->dir, 1), 0);
+
+    if (template_name) {
+        add_transient_primary(template_name);
+    }
+
+    /* a new store has the empty token in the first slot */
+    ft->slot = 1;
+    init(ft, flags);
+
+    CK_UTF8CHAR label[32];
+    memset(label, ' ', sizeof(label));
+    memcpy(label, "fake", 4);
+
+    CK_RV rv = C_InitToken(ft->slot, (CK_UTF8CHAR_PTR)FAKE_TOKEN_SOPIN,
+            strlen(FAKE_TOKEN_SOPIN), label);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_SESSION_HANDLE session;
+    rv = C_OpenSession(ft->slot, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+            NULL, NULL, &session);
+    assert_int_equal(rv, CKR_OK);
+
+    login(session, CKU_SO, FAKE_TOKEN_SOPIN);
+
+    rv = C_InitPIN(session, (CK_UTF8CHAR_PTR)FAKE_TOKEN_USERPIN,
+            strlen(FAKE_TOKEN_USERPIN));
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+void fake_token_reload(fake_token *ft, CK_FLAGS flags) {
+
+    CK_RV rv = C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+
+    init(ft, flags);
+}
+
+void fake_token_reboot(fake_token *ft, CK_FLAGS flags) {
+
+    CK_RV rv = C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+
+    fake_tpm_reset();
+
+    init(ft, flags);
+}
+
+void fake_token_teardown(fake_token *ft) {
+
+    CK_RV rv = C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+    ft->tok = NULL;
+
+    DIR *d = opendir(ft->dir);
+    assert_non_null(d);
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", ft->dir, e->d_name);
+        assert_int_equal(unlink(path), 0);
+    }
+    closedir(d);
+
+    assert_int_equal(rmdir(ft->dir), 0);
+    unsetenv("TPM2_PKCS11_STORE");
+}
+
+CK_SESSION_HANDLE fake_token_login(fake_token *ft) {
+
+    CK_SESSION_HANDLE session;
+    CK_RV rv = C_OpenSession(ft->slot, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+            NULL, NULL, &session);
+    assert_int_equal(rv, CKR_OK);
+
+    login(session, CKU_USER, FAKE_TOKEN_USERPIN);
+
+    return session;
+}
+
+sqlite3 *fake_token_db_open(fake_token *ft) {
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/tpm2_pkcs11.sqlite3", ft->dir);
+
+    sqlite3 *db = NULL;
+    int rc = sqlite3_open(path, &db);
+    assert_int_equal(rc, SQLITE_OK);
+
+    return db;
+}
+
+void fake_token_sleep_ms(unsigned ms) {
+
+    struct timespec ts = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (long)(ms % 1000) * 1000000,
+    };
+    nanosleep(&ts, NULL);
+}
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef TEST_FAKE_TOKEN_H_
+#define TEST_FAKE_TOKEN_H_
+
+#include <limits.h>
+
+#include <sqlite3.h>
+
+#include "pkcs11.h"
+#include "token.h"
+
+/*
+ * A token in a store of its own, for unit tests that drive the library
+ * through the PKCS#11 API against the fake TPM. The store is a temporary
+ * directory TPM2_PKCS11_STORE points to, so tests do not see each other's
+ * tokens. The helpers fail the running cmocka test on errors.
+ */
+
+#define FAKE_TOKEN_SOPIN "mysopin"
+#define FAKE_TOKEN_USERPIN "myuserpin"
+
+typedef struct fake_token fake_token;
+struct fake_token {
+    char dir[PATH_MAX];
+    CK_SLOT_ID slot;
+    token *tok;     /* the initialized token, valid until the library is finalized */
+};
+
+/**
+ * Resets the fake TPM, creates a store and initializes the library, then
+ * initializes a token and its user PIN.
+ * @param ft
+ *  The token to set up.
+ * @param flags
+ *  The CK_C_INITIALIZE_ARGS flags, eg CKF_OS_LOCKING_OK.
+ * @param template_name
+ *  The template of a transient primary object for the token, NULL for the
+ *  persistent storage key of the fake TPM.
+ */
+void fake_token_setup(fake_token *ft, CK_FLAGS flags, const char *template_name);
+
+/**
+ * Finalizes and initializes the library, so it reads the store again as
+ * the next process would.
+ * @param ft
+ *  The token.
+ * @param flags
+ *  The CK_C_INITIALIZE_ARGS flags.
+ */
+void fake_token_reload(fake_token *ft, CK_FLAGS flags);
+
+/**
+ * Like fake_token_reload(), with a reset of the fake TPM in between, as if
+ * the machine was rebooted.
+ * @param ft
+ *  The token.
+ * @param flags
+ *  The CK_C_INITIALIZE_ARGS flags.
+ */
+void fake_token_reboot(fake_token *ft, CK_FLAGS flags);
+
+/**
+ * Finalizes the library and removes the store.
+ * @param ft
+ *  The token.
+ */
+void fake_token_teardown(fake_token *ft);
+
+/**
+ * Opens a R/W session and logs in the user.
+ * @param ft
+ *  The token.
+ * @return
+ *  The session.
+ */
+CK_SESSION_HANDLE fake_token_login(fake_token *ft);
+
+/**
+ * Opens a connection of its own to the store, as another process using the
+ * token would have.
+ * @param ft
+ *  The token.
+ * @return
+ *  The connection, close it with sqlite3_close().
+ */
+sqlite3 *fake_token_db_open(fake_token *ft);
+
+/**
+ * Sleeps, for tests that wait on a worker thread of the library.
+ * @param ms
+ *  The time to sleep in milliseconds.
+ */
+void fake_token_sleep_ms(unsigned ms);
+
+#endif /* TEST_FAKE_TOKEN_H_ */
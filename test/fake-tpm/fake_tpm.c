@@ -0,0 +1,2713 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <openssl/bn.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+#include <tss2/tss2_esys.h>
+#include <tss2/tss2_mu.h>
+#include <tss2/tss2_tctildr.h>
+
+#include "pkcs11.h"
+
+#include "fake_tpm.h"
+#include "fake_tpm_caps.h"
+
+#define UNUSED(x) (void)x
+
+#define FAKE_TPM_LATENCY_ENV "TPM2_PKCS11_FAKE_TPM_LATENCY"
+#define FAKE_TPM_SLOTS_ENV   "TPM2_PKCS11_FAKE_TPM_SLOTS"
+
+#define FAKE_SRK_HANDLE 0x81000001
+
+/* "FTPM" and "FTTR", tags for private blobs and serialized ESYS_TRs */
+#define BLOB_MAGIC 0x4654504DU
+#define TR_MAGIC   0x46545452U
+#define CTX_MAGIC  0x46544358U
+
+#define CC_SLOTS 256
+
+/* the ESYS_TRs Esys_TR_SetAuth calls are counted for, per reset */
+#define SET_AUTH_SLOTS 256
+
+#define AUTH_FAIL(n) (TPM2_RC_AUTH_FAIL | TPM2_RC_S | (n))
+#define PARAM(rc, n) ((rc) | TPM2_RC_P | (n))
+#define HANDLE(rc, n) ((rc) | TPM2_RC_H | (n))
+
+enum type_index {
+    type_any,
+    type_rsa,
+    type_ecc,
+    type_sym,
+    type_keyedhash,
+    type_max
+};
+
+typedef struct fake_object fake_object;
+struct fake_object {
+    TPM2B_PUBLIC pub;
+    TPM2B_AUTH auth;
+    /* RSA and ECC keys, NULL for storage parents and public only objects */
+    EVP_PKEY *pkey;
+    /* symmetric key or sealed data */
+    TPM2B_SENSITIVE_DATA data;
+    /* auth is not enforced, set for objects of unknown origin */
+    bool any_auth;
+    unsigned refs;
+};
+
+typedef enum tr_kind tr_kind;
+enum tr_kind {
+    tr_transient,
+    tr_persistent,
+    tr_session,
+};
+
+typedef struct fake_tr fake_tr;
+struct fake_tr {
+    ESYS_TR tr;
+    tr_kind kind;
+    ESYS_CONTEXT *owner;
+    TPM2_HANDLE tpm_handle;
+    fake_object *obj;
+    TPM2B_AUTH auth;
+    TPMA_SESSION attrs;
+    /* closed with Esys_TR_Close, still occupies a slot until finalize */
+    bool closed;
+    fake_tr *next;
+};
+
+typedef struct fake_persistent fake_persistent;
+struct fake_persistent {
+    TPM2_HANDLE handle;
+    fake_object *obj;
+    fake_persistent *next;
+};
+
+typedef struct fake_esys fake_esys;
+struct fake_esys {
+    uint32_t magic;
+};
+
+static struct {
+    pthread_once_t once;
+    /* the TPM executes one command at a time, this also guards all state */
+    pthread_mutex_t lock;
+    fake_tr *trs;
+    fake_persistent *persistent;
+    ESYS_TR next_tr;
+    TPM2_HANDLE next_transient;
+    unsigned slots;
+    unsigned loaded;
+    uint64_t sequence;
+    uint32_t epoch;
+    int64_t latency[CC_SLOTS][type_max];
+    int64_t default_latency;
+    uint64_t commands;
+    uint64_t cc_commands[CC_SLOTS];
+    uint64_t busy_ns;
+    struct {
+        ESYS_TR tr;
+        uint64_t count;
+    } set_auths[SET_AUTH_SLOTS];
+    unsigned set_auths_len;
+    uint64_t set_auths_total;
+    uint64_t esys_inits;
+} _g = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const struct {
+    const char *name;
+    TPM2_CC cc;
+} cc_names[] = {
+    { "ContextLoad",      TPM2_CC_ContextLoad      },
+    { "ContextSave",      TPM2_CC_ContextSave      },
+    { "Create",           TPM2_CC_Create           },
+    { "CreateLoaded",     TPM2_CC_CreateLoaded     },
+    { "CreatePrimary",    TPM2_CC_CreatePrimary    },
+    { "EncryptDecrypt",   TPM2_CC_EncryptDecrypt   },
+    { "EncryptDecrypt2",  TPM2_CC_EncryptDecrypt2  },
+    { "EvictControl",     TPM2_CC_EvictControl     },
+    { "FlushContext",     TPM2_CC_FlushContext     },
+    { "GetCapability",    TPM2_CC_GetCapability    },
+    { "GetRandom",        TPM2_CC_GetRandom        },
+    { "Load",             TPM2_CC_Load             },
+    { "LoadExternal",     TPM2_CC_LoadExternal     },
+    { "ObjectChangeAuth", TPM2_CC_ObjectChangeAuth },
+    { "ReadClock",        TPM2_CC_ReadClock        },
+    { "ReadPublic",       TPM2_CC_ReadPublic       },
+    { "RSA_Decrypt",      TPM2_CC_RSA_Decrypt      },
+    { "Sign",             TPM2_CC_Sign             },
+    { "StartAuthSession", TPM2_CC_StartAuthSession },
+    { "StirRandom",       TPM2_CC_StirRandom       },
+    { "TestParms",        TPM2_CC_TestParms        },
+    { "Unseal",           TPM2_CC_Unseal           },
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline) {
+
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000ULL,
+        .tv_nsec = deadline % 1000000000ULL,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static enum type_index type_to_index(TPM2_ALG_ID type) {
+
+    switch (type) {
+    case TPM2_ALG_RSA:
+        return type_rsa;
+    case TPM2_ALG_ECC:
+        return type_ecc;
+    case TPM2_ALG_SYMCIPHER:
+        return type_sym;
+    case TPM2_ALG_KEYEDHASH:
+        return type_keyedhash;
+    default:
+        return type_any;
+    }
+}
+
+/*
+ * Configuration
+ */
+static bool parse_duration(const char *s, uint64_t *ns) {
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s) {
+        return false;
+    }
+
+    uint64_t mult;
+    if (!*end || !strcmp(end, "ns")) {
+        mult = 1;
+    } else if (!strcmp(end, "us")) {
+        mult = 1000ULL;
+    } else if (!strcmp(end, "ms")) {
+        mult = 1000000ULL;
+    } else if (!strcmp(end, "s")) {
+        mult = 1000000000ULL;
+    } else {
+        return false;
+    }
+
+    *ns = v * mult;
+    return true;
+}
+
+static bool parse_type(const char *s, TPM2_ALG_ID *type) {
+
+    if (!strcasecmp(s, "rsa")) {
+        *type = TPM2_ALG_RSA;
+    } else if (!strcasecmp(s, "ecc")) {
+        *type = TPM2_ALG_ECC;
+    } else if (!strcasecmp(s, "aes") || !strcasecmp(s, "symcipher")) {
+        *type = TPM2_ALG_SYMCIPHER;
+    } else if (!strcasecmp(s, "keyedhash")) {
+        *type = TPM2_ALG_KEYEDHASH;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static bool set_latency_locked(TPM2_CC cc, TPM2_ALG_ID type, uint64_t ns) {
+
+    if (cc < TPM2_CC_FIRST || cc - TPM2_CC_FIRST >= CC_SLOTS) {
+        return false;
+    }
+
+    enum type_index t = type_to_index(type);
+    if (t == type_any && type != TPM2_ALG_NULL) {
+        return false;
+    }
+
+    _g.latency[cc - TPM2_CC_FIRST][t] = (int64_t)ns;
+    return true;
+}
+
+static bool set_latency_spec_locked(const char *spec) {
+
+    char *copy = strdup(spec);
+    if (!copy) {
+        return false;
+    }
+
+    bool result = true;
+    char *saveptr = NULL;
+    char *tok;
+    for (tok = strtok_r(copy, ",", &saveptr); tok;
+            tok = strtok_r(NULL, ",", &saveptr)) {
+
+        char *eq = strchr(tok, '=');
+        if (!eq) {
+            result = false;
+            break;
+        }
+        *eq = '\0';
+
+        uint64_t ns;
+        if (!parse_duration(eq + 1, &ns)) {
+            result = false;
+            break;
+        }
+
+        if (!strcmp(tok, "*")) {
+            _g.default_latency = (int64_t)ns;
+            continue;
+        }
+
+        TPM2_ALG_ID type = TPM2_ALG_NULL;
+        char *colon = strchr(tok, ':');
+        if (colon) {
+            *colon = '\0';
+            if (!parse_type(colon + 1, &type)) {
+                result = false;
+                break;
+            }
+        }
+
+        size_t i;
+        bool found = false;
+        for (i = 0; i < sizeof(cc_names)/sizeof(cc_names[0]); i++) {
+            if (!strcasecmp(cc_names[i].name, tok)) {
+                found = set_latency_locked(cc_names[i].cc, type, ns);
+                break;
+            }
+        }
+
+        if (!found) {
+            result = false;
+            break;
+        }
+    }
+
+    if (!result) {
+        fprintf(stderr, "fake-tpm: bad latency specification \"%s\"\n", spec);
+    }
+
+    free(copy);
+    return result;
+}
+
+static fake_object *object_new(void) {
+
+    fake_object *o = calloc(1, sizeof(*o));
+    if (o) {
+        o->refs = 1;
+    }
+
+    return o;
+}
+
+static void object_unref(fake_object *o) {
+
+    if (!o || --o->refs) {
+        return;
+    }
+
+    EVP_PKEY_free(o->pkey);
+    OPENSSL_cleanse(o, sizeof(*o));
+    free(o);
+}
+
+static fake_object *storage_key_new(void) {
+
+    fake_object *o = object_new();
+    if (!o) {
+        return NULL;
+    }
+
+    TPMT_PUBLIC *p = &o->pub.publicArea;
+    p->type = TPM2_ALG_ECC;
+    p->nameAlg = TPM2_ALG_SHA256;
+    p->objectAttributes = TPMA_OBJECT_USERWITHAUTH | TPMA_OBJECT_RESTRICTED
+            | TPMA_OBJECT_DECRYPT | TPMA_OBJECT_FIXEDTPM
+            | TPMA_OBJECT_FIXEDPARENT | TPMA_OBJECT_SENSITIVEDATAORIGIN;
+    p->parameters.eccDetail.symmetric.algorithm = TPM2_ALG_AES;
+    p->parameters.eccDetail.symmetric.keyBits.aes = 128;
+    p->parameters.eccDetail.symmetric.mode.aes = TPM2_ALG_CFB;
+    p->parameters.eccDetail.scheme.scheme = TPM2_ALG_NULL;
+    p->parameters.eccDetail.curveID = TPM2_ECC_NIST_P256;
+    p->parameters.eccDetail.kdf.scheme = TPM2_ALG_NULL;
+    p->unique.ecc.x.size = 32;
+    p->unique.ecc.y.size = 32;
+    RAND_bytes(p->unique.ecc.x.buffer, 32);
+    RAND_bytes(p->unique.ecc.y.buffer, 32);
+
+    return o;
+}
+
+static void reset_locked(void) {
+
+    while (_g.trs) {
+        fake_tr *t = _g.trs;
+        _g.trs = t->next;
+        object_unref(t->obj);
+        free(t);
+    }
+
+    while (_g.persistent) {
+        fake_persistent *p = _g.persistent;
+        _g.persistent = p->next;
+        object_unref(p->obj);
+        free(p);
+    }
+
+    _g.next_tr = ESYS_TR_MIN_OBJECT;
+    _g.next_transient = TPM2_TRANSIENT_FIRST;
+    _g.loaded = 0;
+    _g.commands = 0;
+    memset(_g.cc_commands, 0, sizeof(_g.cc_commands));
+    _g.busy_ns = 0;
+    _g.set_auths_len = 0;
+    _g.set_auths_total = 0;
+    _g.esys_inits = 0;
+    /* saved contexts do not survive a TPM Reset */
+    _g.epoch++;
+
+    _g.default_latency = -1;
+    size_t i, j;
+    for (i = 0; i < CC_SLOTS; i++) {
+        for (j = 0; j < type_max; j++) {
+            _g.latency[i][j] = -1;
+        }
+    }
+
+    const char *env = getenv(FAKE_TPM_LATENCY_ENV);
+    if (env && env[0]) {
+        set_latency_spec_locked(env);
+    }
+
+    env = getenv(FAKE_TPM_SLOTS_ENV);
+    _g.slots = env ? (unsigned)strtoul(env, NULL, 0) : 0;
+
+    fake_persistent *srk = calloc(1, sizeof(*srk));
+    if (srk) {
+        srk->handle = FAKE_SRK_HANDLE;
+        srk->obj = storage_key_new();
+        if (srk->obj) {
+            _g.persistent = srk;
+        } else {
+            free(srk);
+        }
+    }
+}
+
+static void init_once(void) {
+    reset_locked();
+}
+
+static void lock(void) {
+    pthread_once(&_g.once, init_once);
+    pthread_mutex_lock(&_g.lock);
+}
+
+static void unlock(void) {
+    pthread_mutex_unlock(&_g.lock);
+}
+
+void fake_tpm_reset(void) {
+    lock();
+    reset_locked();
+    unlock();
+}
+
+bool fake_tpm_set_latency(TPM2_CC cc, TPM2_ALG_ID type, uint64_t ns) {
+    lock();
+    bool result = set_latency_locked(cc, type, ns);
+    unlock();
+    return result;
+}
+
+bool fake_tpm_set_latency_spec(const char *spec) {
+    lock();
+    bool result = set_latency_spec_locked(spec);
+    unlock();
+    return result;
+}
+
+void fake_tpm_set_object_slots(unsigned slots) {
+    lock();
+    _g.slots = slots;
+    unlock();
+}
+
+unsigned fake_tpm_loaded_objects(void) {
+    lock();
+    unsigned loaded = _g.loaded;
+    unlock();
+    return loaded;
+}
+
+uint64_t fake_tpm_command_count(void) {
+    lock();
+    uint64_t cnt = _g.commands;
+    unlock();
+    return cnt;
+}
+
+uint64_t fake_tpm_cc_count(TPM2_CC cc) {
+
+    if (cc < TPM2_CC_FIRST || cc - TPM2_CC_FIRST >= CC_SLOTS) {
+        return 0;
+    }
+
+    lock();
+    uint64_t cnt = _g.cc_commands[cc - TPM2_CC_FIRST];
+    unlock();
+    return cnt;
+}
+
+uint64_t fake_tpm_set_auth_count(ESYS_TR handle) {
+
+    lock();
+    uint64_t cnt = handle == ESYS_TR_NONE ? _g.set_auths_total : 0;
+    unsigned i;
+    for (i = 0; i < _g.set_auths_len && handle != ESYS_TR_NONE; i++) {
+        if (_g.set_auths[i].tr == handle) {
+            cnt = _g.set_auths[i].count;
+            break;
+        }
+    }
+    unlock();
+    return cnt;
+}
+
+uint64_t fake_tpm_esys_init_count(void) {
+    lock();
+    uint64_t cnt = _g.esys_inits;
+    unlock();
+    return cnt;
+}
+
+uint64_t fake_tpm_busy_ns(void) {
+    lock();
+    uint64_t busy = _g.busy_ns;
+    unlock();
+    return busy;
+}
+
+/*
+ * Command execution, every TPM command runs between cmd_begin and
+ * cmd_end, which hold the TPM lock and pad successful commands to
+ * their configured latency.
+ */
+typedef struct cmd cmd;
+struct cmd {
+    TPM2_CC cc;
+    TPM2_ALG_ID type;
+    uint64_t start;
+};
+
+static void cmd_begin(cmd *c, TPM2_CC cc) {
+    lock();
+    c->cc = cc;
+    c->type = TPM2_ALG_NULL;
+    c->start = now_ns();
+}
+
+static uint64_t latency_for(TPM2_CC cc, TPM2_ALG_ID type) {
+
+    unsigned idx = cc - TPM2_CC_FIRST;
+    if (cc >= TPM2_CC_FIRST && idx < CC_SLOTS) {
+        int64_t l = _g.latency[idx][type_to_index(type)];
+        if (l >= 0) {
+            return (uint64_t)l;
+        }
+        l = _g.latency[idx][type_any];
+        if (l >= 0) {
+            return (uint64_t)l;
+        }
+    }
+
+    return _g.default_latency >= 0 ? (uint64_t)_g.default_latency : 0;
+}
+
+static TSS2_RC cmd_end(cmd *c, TSS2_RC rc) {
+
+    if (rc == TSS2_RC_SUCCESS) {
+        sleep_until(c->start + latency_for(c->cc, c->type));
+    }
+
+    _g.commands++;
+    if (c->cc >= TPM2_CC_FIRST && c->cc - TPM2_CC_FIRST < CC_SLOTS) {
+        _g.cc_commands[c->cc - TPM2_CC_FIRST]++;
+    }
+    _g.busy_ns += now_ns() - c->start;
+    unlock();
+
+    return rc;
+}
+
+/*
+ * Handle management, all called with the lock held
+ */
+static fake_tr *tr_find(ESYS_TR handle) {
+
+    fake_tr *t;
+    for (t = _g.trs; t; t = t->next) {
+        if (t->tr == handle && !t->closed) {
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+static fake_tr *tr_new(ESYS_CONTEXT *owner, tr_kind kind, fake_object *obj) {
+
+    fake_tr *t = calloc(1, sizeof(*t));
+    if (!t) {
+        return NULL;
+    }
+
+    t->tr = _g.next_tr++;
+    t->kind = kind;
+    t->owner = owner;
+    t->obj = obj;
+    if (kind == tr_transient) {
+        t->tpm_handle = _g.next_transient++;
+        _g.loaded++;
+    }
+
+    t->next = _g.trs;
+    _g.trs = t;
+
+    return t;
+}
+
+static void tr_free(fake_tr *t) {
+
+    fake_tr **pp;
+    for (pp = &_g.trs; *pp; pp = &(*pp)->next) {
+        if (*pp == t) {
+            *pp = t->next;
+            break;
+        }
+    }
+
+    if (t->kind == tr_transient) {
+        _g.loaded--;
+    }
+
+    object_unref(t->obj);
+    free(t);
+}
+
+static bool slot_available(void) {
+    return !_g.slots || _g.loaded < _g.slots;
+}
+
+static fake_persistent *persistent_find(TPM2_HANDLE handle) {
+
+    fake_persistent *p;
+    for (p = _g.persistent; p; p = p->next) {
+        if (p->handle == handle) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+static void trim_auth(const TPM2B_AUTH *in, TPM2B_AUTH *out) {
+
+    *out = *in;
+    while (out->size && !out->buffer[out->size - 1]) {
+        out->size--;
+    }
+}
+
+/*
+ * Resolves an object handle and checks the authorization set with
+ * Esys_TR_SetAuth against the object's authValue.
+ */
+static TSS2_RC object_get(ESYS_TR handle, unsigned index, bool check_auth,
+        fake_tr **out) {
+
+    fake_tr *t = tr_find(handle);
+    if (!t || t->kind == tr_session || !t->obj) {
+        return HANDLE(TPM2_RC_HANDLE, index);
+    }
+
+    if (check_auth && !t->obj->any_auth) {
+        TPM2B_AUTH a, b;
+        trim_auth(&t->auth, &a);
+        trim_auth(&t->obj->auth, &b);
+        if (a.size != b.size || memcmp(a.buffer, b.buffer, a.size)) {
+            return AUTH_FAIL(index);
+        }
+    }
+
+    *out = t;
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Crypto helpers
+ */
+static const EVP_MD *halg_to_md(TPMI_ALG_HASH halg) {
+
+    switch (halg) {
+    case TPM2_ALG_SHA1:
+        return EVP_sha1();
+    case TPM2_ALG_SHA256:
+        return EVP_sha256();
+    case TPM2_ALG_SHA384:
+        return EVP_sha384();
+    case TPM2_ALG_SHA512:
+        return EVP_sha512();
+    default:
+        return NULL;
+    }
+}
+
+static int curve_to_nid(TPMI_ECC_CURVE curve, unsigned *coord_len) {
+
+    switch (curve) {
+    case TPM2_ECC_NIST_P256:
+        *coord_len = 32;
+        return NID_X9_62_prime256v1;
+    case TPM2_ECC_NIST_P384:
+        *coord_len = 48;
+        return NID_secp384r1;
+    default:
+        return NID_undef;
+    }
+}
+
+static bool is_storage_key(const TPMT_PUBLIC *p) {
+
+    TPMA_OBJECT need = TPMA_OBJECT_RESTRICTED | TPMA_OBJECT_DECRYPT;
+    return (p->objectAttributes & need) == need
+            && !(p->objectAttributes & TPMA_OBJECT_SIGN_ENCRYPT);
+}
+
+static EVP_PKEY *keygen(int type, int bits, int nid) {
+
+    EVP_PKEY *pkey = NULL;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(type, NULL);
+    if (!ctx) {
+        return NULL;
+    }
+
+    if (EVP_PKEY_keygen_init(ctx) <= 0) {
+        goto out;
+    }
+
+    if (type == EVP_PKEY_RSA) {
+        if (EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, bits) <= 0) {
+            goto out;
+        }
+    } else if (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, nid) <= 0) {
+        goto out;
+    }
+
+    if (EVP_PKEY_keygen(ctx, &pkey) <= 0) {
+        pkey = NULL;
+    }
+
+out:
+    EVP_PKEY_CTX_free(ctx);
+    return pkey;
+}
+
+/*
+ * Extracts the modulus from a DER RSAPublicKey, SEQUENCE { INTEGER n, INTEGER e },
+ * avoiding the RSA accessors that differ between OpenSSL versions.
+ */
+static bool der_read_len(const unsigned char **p, const unsigned char *end, size_t *len) {
+
+    if (*p >= end) {
+        return false;
+    }
+
+    unsigned char b = *(*p)++;
+    if (!(b & 0x80)) {
+        *len = b;
+        return true;
+    }
+
+    unsigned n = b & 0x7F;
+    if (n == 0 || n > 2 || end - *p < (ptrdiff_t)n) {
+        return false;
+    }
+
+    *len = 0;
+    while (n--) {
+        *len = (*len << 8) | *(*p)++;
+    }
+
+    return true;
+}
+
+static bool rsa_get_modulus(EVP_PKEY *pkey, TPM2B_PUBLIC_KEY_RSA *modulus) {
+
+    unsigned char *der = NULL;
+    int der_len = i2d_PublicKey(pkey, &der);
+    if (der_len <= 0) {
+        return false;
+    }
+
+    bool result = false;
+    const unsigned char *p = der;
+    const unsigned char *end = der + der_len;
+    size_t len;
+
+    if (*p++ != 0x30 || !der_read_len(&p, end, &len)) {
+        goto out;
+    }
+
+    if (p >= end || *p++ != 0x02 || !der_read_len(&p, end, &len)
+            || (size_t)(end - p) < len) {
+        goto out;
+    }
+
+    /* drop the sign padding byte */
+    while (len && !*p) {
+        p++;
+        len--;
+    }
+
+    if (len > sizeof(modulus->buffer)) {
+        goto out;
+    }
+
+    modulus->size = (UINT16)len;
+    memcpy(modulus->buffer, p, len);
+    result = true;
+
+out:
+    OPENSSL_free(der);
+    return result;
+}
+
+static bool ecc_get_point(EVP_PKEY *pkey, unsigned coord_len, TPMS_ECC_POINT *point) {
+
+    unsigned char *der = NULL;
+    int der_len = i2d_PublicKey(pkey, &der);
+    if (der_len <= 0) {
+        return false;
+    }
+
+    /* uncompressed point: 0x04 || x || y */
+    bool result = der_len == (int)(1 + 2 * coord_len) && der[0] == 0x04;
+    if (result) {
+        point->x.size = coord_len;
+        memcpy(point->x.buffer, &der[1], coord_len);
+        point->y.size = coord_len;
+        memcpy(point->y.buffer, &der[1 + coord_len], coord_len);
+    }
+
+    OPENSSL_free(der);
+    return result;
+}
+
+static TSS2_RC check_parms(const TPMT_PUBLIC_PARMS *parms, unsigned index) {
+
+    unsigned coord_len;
+
+    switch (parms->type) {
+    case TPM2_ALG_RSA: {
+        TPMI_RSA_KEY_BITS bits = parms->parameters.rsaDetail.keyBits;
+        if (bits != 1024 && bits != 2048) {
+            return PARAM(TPM2_RC_KEY_SIZE, index);
+        }
+        UINT32 exp = parms->parameters.rsaDetail.exponent;
+        if (exp != 0 && exp != 65537) {
+            return PARAM(TPM2_RC_VALUE, index);
+        }
+    } break;
+    case TPM2_ALG_ECC:
+        if (curve_to_nid(parms->parameters.eccDetail.curveID, &coord_len) == NID_undef) {
+            return PARAM(TPM2_RC_CURVE, index);
+        }
+        break;
+    case TPM2_ALG_SYMCIPHER: {
+        const TPMT_SYM_DEF_OBJECT *s = &parms->parameters.symDetail.sym;
+        if (s->algorithm != TPM2_ALG_AES) {
+            return PARAM(TPM2_RC_SYMMETRIC, index);
+        }
+        if (s->keyBits.aes != 128 && s->keyBits.aes != 192 && s->keyBits.aes != 256) {
+            return PARAM(TPM2_RC_KEY_SIZE, index);
+        }
+    } break;
+    case TPM2_ALG_KEYEDHASH:
+        break;
+    default:
+        return PARAM(TPM2_RC_TYPE, index);
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Creates a new object from a template, generating key material as needed.
+ * Storage parents carry no key material, blobs are not wrapped.
+ */
+static TSS2_RC object_create(const TPM2B_SENSITIVE_CREATE *in_sens,
+        const TPMT_PUBLIC *templ, fake_object **out) {
+
+    TPMT_PUBLIC_PARMS parms = {
+        .type = templ->type,
+        .parameters = templ->parameters,
+    };
+
+    TSS2_RC rc = check_parms(&parms, TPM2_RC_2);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+
+    if (!halg_to_md(templ->nameAlg)) {
+        return PARAM(TPM2_RC_HASH, TPM2_RC_2);
+    }
+
+    fake_object *o = object_new();
+    if (!o) {
+        return TSS2_ESYS_RC_MEMORY;
+    }
+
+    o->pub.publicArea = *templ;
+    if (in_sens) {
+        o->auth = in_sens->sensitive.userAuth;
+    }
+
+    TPMT_PUBLIC *p = &o->pub.publicArea;
+    const TPM2B_SENSITIVE_DATA *sdata = in_sens ? &in_sens->sensitive.data : NULL;
+    bool storage = is_storage_key(p);
+    unsigned coord_len = 0;
+
+    switch (p->type) {
+    case TPM2_ALG_RSA: {
+        int bits = p->parameters.rsaDetail.keyBits;
+        if (storage) {
+            p->unique.rsa.size = bits / 8;
+            RAND_bytes(p->unique.rsa.buffer, p->unique.rsa.size);
+            p->unique.rsa.buffer[0] |= 0x80;
+            break;
+        }
+        o->pkey = keygen(EVP_PKEY_RSA, bits, NID_undef);
+        if (!o->pkey || !rsa_get_modulus(o->pkey, &p->unique.rsa)) {
+            rc = TSS2_ESYS_RC_GENERAL_FAILURE;
+        }
+    } break;
+    case TPM2_ALG_ECC: {
+        int nid = curve_to_nid(p->parameters.eccDetail.curveID, &coord_len);
+        if (storage) {
+            p->unique.ecc.x.size = p->unique.ecc.y.size = coord_len;
+            RAND_bytes(p->unique.ecc.x.buffer, coord_len);
+            RAND_bytes(p->unique.ecc.y.buffer, coord_len);
+            break;
+        }
+        o->pkey = keygen(EVP_PKEY_EC, 0, nid);
+        if (!o->pkey || !ecc_get_point(o->pkey, coord_len, &p->unique.ecc)) {
+            rc = TSS2_ESYS_RC_GENERAL_FAILURE;
+        }
+    } break;
+    case TPM2_ALG_SYMCIPHER: {
+        UINT16 len = p->parameters.symDetail.sym.keyBits.aes / 8;
+        if (sdata && sdata->size) {
+            if (sdata->size != len) {
+                rc = PARAM(TPM2_RC_SIZE, TPM2_RC_1);
+                break;
+            }
+            o->data = *sdata;
+        } else {
+            o->data.size = len;
+            RAND_bytes(o->data.buffer, len);
+        }
+        p->unique.sym.size = 32;
+        RAND_bytes(p->unique.sym.buffer, 32);
+    } break;
+    case TPM2_ALG_KEYEDHASH:
+        if (sdata && sdata->size) {
+            o->data = *sdata;
+        } else {
+            o->data.size = 32;
+            RAND_bytes(o->data.buffer, 32);
+        }
+        p->unique.keyedHash.size = 32;
+        RAND_bytes(p->unique.keyedHash.buffer, 32);
+        break;
+    }
+
+    if (rc != TSS2_RC_SUCCESS) {
+        object_unref(o);
+        return rc;
+    }
+
+    *out = o;
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Private blob layout, all integers big endian:
+ *   magic(4) type(2) auth_len(2) auth data_len(2) data der_len(2) der
+ */
+static void put_u16(uint8_t **p, uint16_t v) {
+    (*p)[0] = v >> 8;
+    (*p)[1] = v & 0xFF;
+    *p += 2;
+}
+
+static void put_u32(uint8_t **p, uint32_t v) {
+    put_u16(p, v >> 16);
+    put_u16(p, v & 0xFFFF);
+}
+
+static bool get_u16(const uint8_t **p, const uint8_t *end, uint16_t *v) {
+    if (end - *p < 2) {
+        return false;
+    }
+    *v = (uint16_t)(((*p)[0] << 8) | (*p)[1]);
+    *p += 2;
+    return true;
+}
+
+static bool get_u32(const uint8_t **p, const uint8_t *end, uint32_t *v) {
+    uint16_t hi, lo;
+    if (!get_u16(p, end, &hi) || !get_u16(p, end, &lo)) {
+        return false;
+    }
+    *v = ((uint32_t)hi << 16) | lo;
+    return true;
+}
+
+static TSS2_RC blob_encode(const fake_object *o, TPM2B_PRIVATE *priv) {
+
+    int der_len = o->pkey ? i2d_PrivateKey(o->pkey, NULL) : 0;
+    if (der_len < 0) {
+        return TSS2_ESYS_RC_GENERAL_FAILURE;
+    }
+
+    size_t need = 4 + 2 + 2 + o->auth.size + 2 + o->data.size + 2 + der_len;
+    if (need > sizeof(priv->buffer)) {
+        return PARAM(TPM2_RC_KEY_SIZE, TPM2_RC_2);
+    }
+
+    uint8_t *p = priv->buffer;
+    put_u32(&p, BLOB_MAGIC);
+    put_u16(&p, o->pub.publicArea.type);
+    put_u16(&p, o->auth.size);
+    memcpy(p, o->auth.buffer, o->auth.size);
+    p += o->auth.size;
+    put_u16(&p, o->data.size);
+    memcpy(p, o->data.buffer, o->data.size);
+    p += o->data.size;
+    put_u16(&p, (uint16_t)der_len);
+    if (der_len) {
+        i2d_PrivateKey(o->pkey, &p);
+    }
+
+    priv->size = (UINT16)(p - priv->buffer);
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC blob_decode(const TPM2B_PRIVATE *priv, const TPM2B_PUBLIC *pub,
+        fake_object **out) {
+
+    const uint8_t *p = priv->buffer;
+    const uint8_t *end = priv->buffer + priv->size;
+
+    uint32_t magic;
+    uint16_t type, len;
+    if (!get_u32(&p, end, &magic) || magic != BLOB_MAGIC
+            || !get_u16(&p, end, &type) || type != pub->publicArea.type) {
+        return PARAM(TPM2_RC_INTEGRITY, TPM2_RC_1);
+    }
+
+    fake_object *o = object_new();
+    if (!o) {
+        return TSS2_ESYS_RC_MEMORY;
+    }
+
+    o->pub = *pub;
+
+    if (!get_u16(&p, end, &len) || len > sizeof(o->auth.buffer) || end - p < len) {
+        goto bad;
+    }
+    o->auth.size = len;
+    memcpy(o->auth.buffer, p, len);
+    p += len;
+
+    if (!get_u16(&p, end, &len) || len > sizeof(o->data.buffer) || end - p < len) {
+        goto bad;
+    }
+    o->data.size = len;
+    memcpy(o->data.buffer, p, len);
+    p += len;
+
+    if (!get_u16(&p, end, &len) || end - p < len) {
+        goto bad;
+    }
+    if (len) {
+        const unsigned char *der = p;
+        o->pkey = d2i_AutoPrivateKey(NULL, &der, len);
+        if (!o->pkey) {
+            goto bad;
+        }
+    }
+
+    *out = o;
+    return TSS2_RC_SUCCESS;
+
+bad:
+    object_unref(o);
+    return PARAM(TPM2_RC_INTEGRITY, TPM2_RC_1);
+}
+
+static TSS2_RC compute_name(const TPM2B_PUBLIC *pub, TPM2B_NAME *name) {
+
+    uint8_t buf[sizeof(TPMT_PUBLIC)];
+    size_t offset = 0;
+    TSS2_RC rc = Tss2_MU_TPMT_PUBLIC_Marshal(&pub->publicArea, buf, sizeof(buf), &offset);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+
+    const EVP_MD *md = halg_to_md(pub->publicArea.nameAlg);
+    if (!md) {
+        return TSS2_ESYS_RC_BAD_VALUE;
+    }
+
+    uint8_t *p = name->name;
+    put_u16(&p, pub->publicArea.nameAlg);
+
+    unsigned len = 0;
+    if (!EVP_Digest(buf, offset, p, &len, md, NULL)) {
+        return TSS2_ESYS_RC_GENERAL_FAILURE;
+    }
+
+    name->size = (UINT16)(2 + len);
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * ESAPI context and TCTI
+ */
+TSS2_RC __wrap_Tss2_TctiLdr_Initialize(const char *nameConf,
+        TSS2_TCTI_CONTEXT **context) {
+
+    UNUSED(nameConf);
+
+    TSS2_TCTI_CONTEXT_COMMON_V2 *tcti = calloc(1, sizeof(*tcti));
+    if (!tcti) {
+        return TSS2_TCTI_RC_MEMORY;
+    }
+
+    /* never called, ESAPI is faked above the TCTI */
+    tcti->v1.magic = 0x46414B45;
+    tcti->v1.version = 2;
+
+    *context = (TSS2_TCTI_CONTEXT *)tcti;
+    return TSS2_RC_SUCCESS;
+}
+
+void __wrap_Tss2_TctiLdr_Finalize(TSS2_TCTI_CONTEXT **context) {
+
+    if (context) {
+        free(*context);
+        *context = NULL;
+    }
+}
+
+CK_RV __wrap_backend_fapi_init(void) {
+    /* FAPI talks to the TPM on its own, it is not supported by the fake */
+    return CKR_GENERAL_ERROR;
+}
+
+TSS2_RC __wrap_Esys_Initialize(ESYS_CONTEXT **esys_context,
+        TSS2_TCTI_CONTEXT *tcti, TSS2_ABI_VERSION *abiVersion) {
+
+    UNUSED(tcti);
+    UNUSED(abiVersion);
+
+    pthread_once(&_g.once, init_once);
+
+    fake_esys *e = calloc(1, sizeof(*e));
+    if (!e) {
+        return TSS2_ESYS_RC_MEMORY;
+    }
+
+    e->magic = 0x46455359;
+    *esys_context = (ESYS_CONTEXT *)e;
+
+    lock();
+    _g.esys_inits++;
+    unlock();
+
+    return TSS2_RC_SUCCESS;
+}
+
+void __wrap_Esys_Finalize(ESYS_CONTEXT **context) {
+
+    if (!context || !*context) {
+        return;
+    }
+
+    /* like a resource manager, flush what the connection left behind */
+    lock();
+    fake_tr *t = _g.trs;
+    while (t) {
+        fake_tr *next = t->next;
+        if (t->owner == *context) {
+            tr_free(t);
+        }
+        t = next;
+    }
+    unlock();
+
+    free(*context);
+    *context = NULL;
+}
+
+TSS2_RC __wrap_Esys_TR_SetAuth(ESYS_CONTEXT *esysContext, ESYS_TR handle,
+        TPM2B_AUTH const *authValue) {
+
+    UNUSED(esysContext);
+
+    if (authValue && authValue->size > sizeof(authValue->buffer)) {
+        return TSS2_ESYS_RC_BAD_SIZE;
+    }
+
+    lock();
+
+    /* counted whether the handle exists or not, a stale one is a bug too */
+    _g.set_auths_total++;
+    unsigned i;
+    for (i = 0; i < _g.set_auths_len; i++) {
+        if (_g.set_auths[i].tr == handle) {
+            break;
+        }
+    }
+    if (i == _g.set_auths_len && i < SET_AUTH_SLOTS) {
+        _g.set_auths[i].tr = handle;
+        _g.set_auths[i].count = 0;
+        _g.set_auths_len++;
+    }
+    if (i < _g.set_auths_len) {
+        _g.set_auths[i].count++;
+    }
+
+    fake_tr *t = tr_find(handle);
+    if (t) {
+        if (authValue) {
+            t->auth = *authValue;
+        } else {
+            t->auth.size = 0;
+        }
+    }
+    unlock();
+
+    /* hierarchy and password handles are accepted, their auth is not enforced */
+    return t || handle < ESYS_TR_MIN_OBJECT ?
+            TSS2_RC_SUCCESS : TSS2_ESYS_RC_BAD_TR;
+}
+
+TSS2_RC __wrap_Esys_TR_Close(ESYS_CONTEXT *esys_context, ESYS_TR *rsrc_handle) {
+
+    UNUSED(esys_context);
+
+    lock();
+    fake_tr *t = tr_find(*rsrc_handle);
+    if (t) {
+        /* a closed transient object stays loaded in the TPM */
+        if (t->kind == tr_transient) {
+            t->closed = true;
+        } else {
+            tr_free(t);
+        }
+        *rsrc_handle = ESYS_TR_NONE;
+    }
+    unlock();
+
+    return t ? TSS2_RC_SUCCESS : TSS2_ESYS_RC_BAD_TR;
+}
+
+TSS2_RC __wrap_Esys_TR_Serialize(ESYS_CONTEXT *esys_context, ESYS_TR object,
+        uint8_t **buffer, size_t *buffer_size) {
+
+    UNUSED(esys_context);
+
+    lock();
+    fake_tr *t = tr_find(object);
+    bool found = t && t->kind != tr_session;
+    TPM2_HANDLE handle = found ? t->tpm_handle : 0;
+    unlock();
+
+    if (!found) {
+        return TSS2_ESYS_RC_BAD_TR;
+    }
+
+    uint8_t *buf = malloc(8);
+    if (!buf) {
+        return TSS2_ESYS_RC_MEMORY;
+    }
+
+    uint8_t *p = buf;
+    put_u32(&p, TR_MAGIC);
+    put_u32(&p, handle);
+
+    *buffer = buf;
+    *buffer_size = 8;
+
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC tr_from_persistent(ESYS_CONTEXT *esys_context, TPM2_HANDLE handle,
+        ESYS_TR *object) {
+
+    fake_persistent *p = persistent_find(handle);
+    if (!p) {
+        return HANDLE(TPM2_RC_HANDLE, TPM2_RC_1);
+    }
+
+    fake_tr *t = tr_new(esys_context, tr_persistent, p->obj);
+    if (!t) {
+        return TSS2_ESYS_RC_MEMORY;
+    }
+
+    p->obj->refs++;
+    t->tpm_handle = handle;
+    *object = t->tr;
+
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_RC __wrap_Esys_TR_Deserialize(ESYS_CONTEXT *esys_context,
+        uint8_t const *buffer, size_t buffer_size, ESYS_TR *esys_handle) {
+
+    const uint8_t *p = buffer;
+    const uint8_t *end = buffer + buffer_size;
+    uint32_t magic, handle;
+    if (!get_u32(&p, end, &magic) || magic != TR_MAGIC
+            || !get_u32(&p, end, &handle)) {
+        return TSS2_ESYS_RC_BAD_VALUE;
+    }
+
+    lock();
+    TSS2_RC rc = tr_from_persistent(esys_context, handle, esys_handle);
+    unlock();
+
+    return rc;
+}
+
+bool fake_tpm_persist(ESYS_TR object, TPM2_HANDLE handle,
+        uint8_t **blob, size_t *blob_len) {
+
+    uint8_t *buf = malloc(8);
+    if (!buf) {
+        return false;
+    }
+
+    lock();
+    fake_tr *t = tr_find(object);
+    fake_persistent *p = NULL;
+    if (t && t->kind == tr_transient && t->obj
+            && (handle & TPM2_HR_RANGE_MASK) == TPM2_HR_PERSISTENT
+            && !persistent_find(handle)) {
+        p = calloc(1, sizeof(*p));
+    }
+    if (p) {
+        p->handle = handle;
+        p->obj = t->obj;
+        p->obj->refs++;
+        p->next = _g.persistent;
+        _g.persistent = p;
+    }
+    unlock();
+
+    if (!p) {
+        free(buf);
+        return false;
+    }
+
+    uint8_t *q = buf;
+    put_u32(&q, TR_MAGIC);
+    put_u32(&q, handle);
+
+    *blob = buf;
+    *blob_len = 8;
+
+    return true;
+}
+
+bool fake_tpm_evict(TPM2_HANDLE handle) {
+
+    lock();
+    fake_persistent **pp;
+    for (pp = &_g.persistent; *pp; pp = &(*pp)->next) {
+        if ((*pp)->handle == handle) {
+            break;
+        }
+    }
+
+    fake_persistent *p = *pp;
+    if (p) {
+        *pp = p->next;
+        object_unref(p->obj);
+        free(p);
+    }
+    unlock();
+
+    return p != NULL;
+}
+
+TSS2_RC __wrap_Esys_TR_FromTPMPublic(ESYS_CONTEXT *esysContext, TPM2_HANDLE tpm_handle,
+        ESYS_TR optionalSession1, ESYS_TR optionalSession2, ESYS_TR optionalSession3,
+        ESYS_TR *object) {
+
+    UNUSED(optionalSession1);
+    UNUSED(optionalSession2);
+    UNUSED(optionalSession3);
+
+    /* issues a ReadPublic on a real TPM */
+    cmd c;
+    cmd_begin(&c, TPM2_CC_ReadPublic);
+    TSS2_RC rc = tr_from_persistent(esysContext, tpm_handle, object);
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_TR_GetTpmHandle(ESYS_CONTEXT *esys_context, ESYS_TR esys_handle,
+        TPM2_HANDLE *tpm_handle) {
+
+    UNUSED(esys_context);
+
+    lock();
+    fake_tr *t = tr_find(esys_handle);
+    if (t) {
+        *tpm_handle = t->tpm_handle;
+    }
+    unlock();
+
+    return t ? TSS2_RC_SUCCESS : TSS2_ESYS_RC_BAD_TR;
+}
+
+TSS2_RC __wrap_Esys_TRSess_GetAttributes(ESYS_CONTEXT *esysContext, ESYS_TR session,
+        TPMA_SESSION *flags) {
+
+    UNUSED(esysContext);
+
+    lock();
+    fake_tr *t = tr_find(session);
+    bool found = t && t->kind == tr_session;
+    if (found) {
+        *flags = t->attrs;
+    }
+    unlock();
+
+    return found ? TSS2_RC_SUCCESS : TSS2_ESYS_RC_BAD_TR;
+}
+
+TSS2_RC __wrap_Esys_TRSess_SetAttributes(ESYS_CONTEXT *esysContext, ESYS_TR session,
+        TPMA_SESSION flags, TPMA_SESSION mask) {
+
+    UNUSED(esysContext);
+
+    lock();
+    fake_tr *t = tr_find(session);
+    bool found = t && t->kind == tr_session;
+    if (found) {
+        t->attrs = (t->attrs & ~mask) | (flags & mask);
+    }
+    unlock();
+
+    return found ? TSS2_RC_SUCCESS : TSS2_ESYS_RC_BAD_TR;
+}
+
+/*
+ * TPM commands
+ */
+TSS2_RC __wrap_Esys_StartAuthSession(ESYS_CONTEXT *esysContext, ESYS_TR tpmKey,
+        ESYS_TR bind, ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        const TPM2B_NONCE *nonceCaller, TPM2_SE sessionType,
+        const TPMT_SYM_DEF *symmetric, TPMI_ALG_HASH authHash,
+        ESYS_TR *sessionHandle) {
+
+    UNUSED(bind);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+    UNUSED(nonceCaller);
+    UNUSED(sessionType);
+    UNUSED(symmetric);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_StartAuthSession);
+
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    if (tpmKey != ESYS_TR_NONE && !tr_find(tpmKey)) {
+        rc = HANDLE(TPM2_RC_HANDLE, TPM2_RC_1);
+    } else if (!halg_to_md(authHash)) {
+        rc = PARAM(TPM2_RC_HASH, TPM2_RC_4);
+    } else {
+        fake_tr *t = tr_new(esysContext, tr_session, NULL);
+        if (!t) {
+            rc = TSS2_ESYS_RC_MEMORY;
+        } else {
+            t->tpm_handle = TPM2_HMAC_SESSION_FIRST + (t->tr & 0xFFFF);
+            *sessionHandle = t->tr;
+        }
+    }
+
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_FlushContext(ESYS_CONTEXT *esysContext, ESYS_TR flushHandle) {
+
+    UNUSED(esysContext);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_FlushContext);
+
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    fake_tr *t = tr_find(flushHandle);
+    if (!t || t->kind == tr_persistent) {
+        rc = PARAM(TPM2_RC_HANDLE, TPM2_RC_1);
+    } else {
+        tr_free(t);
+    }
+
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_GetCapability(ESYS_CONTEXT *esysContext, ESYS_TR shandle1,
+        ESYS_TR shandle2, ESYS_TR shandle3, TPM2_CAP capability, UINT32 property,
+        UINT32 propertyCount, TPMI_YES_NO *moreData,
+        TPMS_CAPABILITY_DATA **capabilityData) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_GetCapability);
+
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    TPMS_CAPABILITY_DATA *data = calloc(1, sizeof(*data));
+    if (!data) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+
+    const TPMS_CAPABILITY_DATA *tmp = NULL;
+    switch (capability) {
+    case TPM2_CAP_COMMANDS:
+        rc = get_commands(property, propertyCount, moreData, &tmp);
+        break;
+    case TPM2_CAP_ALGS:
+        rc = get_algs(property, propertyCount, moreData, &tmp);
+        break;
+    case TPM2_CAP_TPM_PROPERTIES:
+        rc = get_properties(property, propertyCount, moreData, &tmp);
+        break;
+    case TPM2_CAP_HANDLES: {
+        data->capability = TPM2_CAP_HANDLES;
+        TPML_HANDLE *h = &data->data.handles;
+        if ((property & TPM2_HR_RANGE_MASK) == TPM2_HR_PERSISTENT) {
+            fake_persistent *p;
+            for (p = _g.persistent; p && h->count < TPM2_MAX_CAP_HANDLES; p = p->next) {
+                if (p->handle >= property && h->count < propertyCount) {
+                    h->handle[h->count++] = p->handle;
+                }
+            }
+        } else if ((property & TPM2_HR_RANGE_MASK) == TPM2_HR_TRANSIENT) {
+            fake_tr *t;
+            for (t = _g.trs; t && h->count < TPM2_MAX_CAP_HANDLES; t = t->next) {
+                if (t->kind == tr_transient && h->count < propertyCount) {
+                    h->handle[h->count++] = t->tpm_handle;
+                }
+            }
+        }
+        *moreData = TPM2_NO;
+    } break;
+    case TPM2_CAP_ECC_CURVES:
+        data->capability = TPM2_CAP_ECC_CURVES;
+        data->data.eccCurves.count = 2;
+        data->data.eccCurves.eccCurves[0] = TPM2_ECC_NIST_P256;
+        data->data.eccCurves.eccCurves[1] = TPM2_ECC_NIST_P384;
+        *moreData = TPM2_NO;
+        break;
+    default:
+        rc = PARAM(TPM2_RC_VALUE, TPM2_RC_1);
+    }
+
+    if (rc == TSS2_RC_SUCCESS) {
+        if (tmp) {
+            *data = *tmp;
+        }
+        *capabilityData = data;
+        data = NULL;
+    }
+
+out:
+    free(data);
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_TestParms(ESYS_CONTEXT *esysContext, ESYS_TR shandle1,
+        ESYS_TR shandle2, ESYS_TR shandle3, const TPMT_PUBLIC_PARMS *parameters) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_TestParms);
+    c.type = parameters->type;
+    TSS2_RC rc = check_parms(parameters, TPM2_RC_1);
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_GetRandom(ESYS_CONTEXT *esysContext, ESYS_TR shandle1,
+        ESYS_TR shandle2, ESYS_TR shandle3, UINT16 bytesRequested,
+        TPM2B_DIGEST **randomBytes) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_GetRandom);
+
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    TPM2B_DIGEST *r = calloc(1, sizeof(*r));
+    if (!r) {
+        rc = TSS2_ESYS_RC_MEMORY;
+    } else {
+        /* like a TPM, never more than the largest digest */
+        r->size = bytesRequested > sizeof(r->buffer) ?
+                sizeof(r->buffer) : bytesRequested;
+        if (RAND_bytes(r->buffer, r->size) != 1) {
+            free(r);
+            rc = TSS2_ESYS_RC_GENERAL_FAILURE;
+        } else {
+            *randomBytes = r;
+        }
+    }
+
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_StirRandom(ESYS_CONTEXT *esysContext, ESYS_TR shandle1,
+        ESYS_TR shandle2, ESYS_TR shandle3, const TPM2B_SENSITIVE_DATA *inData) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_StirRandom);
+    RAND_add(inData->buffer, inData->size, 0);
+    return cmd_end(&c, TSS2_RC_SUCCESS);
+}
+
+static TSS2_RC load_object(ESYS_CONTEXT *ctx, fake_object *o, ESYS_TR *handle) {
+
+    if (!slot_available()) {
+        object_unref(o);
+        return TPM2_RC_OBJECT_MEMORY;
+    }
+
+    fake_tr *t = tr_new(ctx, tr_transient, o);
+    if (!t) {
+        object_unref(o);
+        return TSS2_ESYS_RC_MEMORY;
+    }
+
+    *handle = t->tr;
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC creation_outputs(TPM2B_CREATION_DATA **creationData,
+        TPM2B_DIGEST **creationHash, TPMT_TK_CREATION **creationTicket) {
+
+    TPM2B_CREATION_DATA *cdata = calloc(1, sizeof(*cdata));
+    TPM2B_DIGEST *chash = calloc(1, sizeof(*chash));
+    TPMT_TK_CREATION *cticket = calloc(1, sizeof(*cticket));
+    if (!cdata || !chash || !cticket) {
+        free(cdata);
+        free(chash);
+        free(cticket);
+        return TSS2_ESYS_RC_MEMORY;
+    }
+
+    cticket->tag = TPM2_ST_CREATION;
+    cticket->hierarchy = TPM2_RH_OWNER;
+
+    *creationData = cdata;
+    *creationHash = chash;
+    *creationTicket = cticket;
+
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_RC __wrap_Esys_CreatePrimary(ESYS_CONTEXT *esysContext, ESYS_TR primaryHandle,
+        ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        const TPM2B_SENSITIVE_CREATE *inSensitive, const TPM2B_PUBLIC *inPublic,
+        const TPM2B_DATA *outsideInfo, const TPML_PCR_SELECTION *creationPCR,
+        ESYS_TR *objectHandle, TPM2B_PUBLIC **outPublic,
+        TPM2B_CREATION_DATA **creationData, TPM2B_DIGEST **creationHash,
+        TPMT_TK_CREATION **creationTicket) {
+
+    UNUSED(primaryHandle);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+    UNUSED(outsideInfo);
+    UNUSED(creationPCR);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_CreatePrimary);
+    c.type = inPublic->publicArea.type;
+
+    TPM2B_PUBLIC *pub = NULL;
+    fake_object *o = NULL;
+    TSS2_RC rc = object_create(inSensitive, &inPublic->publicArea, &o);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    pub = malloc(sizeof(*pub));
+    if (!pub) {
+        object_unref(o);
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+    *pub = o->pub;
+
+    rc = creation_outputs(creationData, creationHash, creationTicket);
+    if (rc != TSS2_RC_SUCCESS) {
+        object_unref(o);
+        goto out;
+    }
+
+    rc = load_object(esysContext, o, objectHandle);
+    if (rc != TSS2_RC_SUCCESS) {
+        free(*creationData);
+        free(*creationHash);
+        free(*creationTicket);
+        goto out;
+    }
+
+    *outPublic = pub;
+    pub = NULL;
+
+out:
+    free(pub);
+    return cmd_end(&c, rc);
+}
+
+static TSS2_RC create_common(ESYS_TR parentHandle,
+        const TPM2B_SENSITIVE_CREATE *inSensitive, const TPMT_PUBLIC *templ,
+        fake_object **o, TPM2B_PRIVATE **outPrivate, TPM2B_PUBLIC **outPublic) {
+
+    fake_tr *parent = NULL;
+    TSS2_RC rc = object_get(parentHandle, TPM2_RC_1, true, &parent);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+
+    if (!is_storage_key(&parent->obj->pub.publicArea)) {
+        return HANDLE(TPM2_RC_TYPE, TPM2_RC_1);
+    }
+
+    rc = object_create(inSensitive, templ, o);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+
+    TPM2B_PRIVATE *priv = calloc(1, sizeof(*priv));
+    TPM2B_PUBLIC *pub = malloc(sizeof(*pub));
+    if (!priv || !pub) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto error;
+    }
+
+    rc = blob_encode(*o, priv);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto error;
+    }
+
+    *pub = (*o)->pub;
+    *outPrivate = priv;
+    *outPublic = pub;
+
+    return TSS2_RC_SUCCESS;
+
+error:
+    free(priv);
+    free(pub);
+    object_unref(*o);
+    *o = NULL;
+    return rc;
+}
+
+TSS2_RC __wrap_Esys_Create(ESYS_CONTEXT *esysContext, ESYS_TR parentHandle,
+        ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        const TPM2B_SENSITIVE_CREATE *inSensitive, const TPM2B_PUBLIC *inPublic,
+        const TPM2B_DATA *outsideInfo, const TPML_PCR_SELECTION *creationPCR,
+        TPM2B_PRIVATE **outPrivate, TPM2B_PUBLIC **outPublic,
+        TPM2B_CREATION_DATA **creationData, TPM2B_DIGEST **creationHash,
+        TPMT_TK_CREATION **creationTicket) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+    UNUSED(outsideInfo);
+    UNUSED(creationPCR);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_Create);
+    c.type = inPublic->publicArea.type;
+
+    fake_object *o = NULL;
+    TSS2_RC rc = create_common(parentHandle, inSensitive, &inPublic->publicArea,
+            &o, outPrivate, outPublic);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    /* Create does not load the object */
+    object_unref(o);
+
+    rc = creation_outputs(creationData, creationHash, creationTicket);
+    if (rc != TSS2_RC_SUCCESS) {
+        free(*outPrivate);
+        free(*outPublic);
+    }
+
+out:
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_CreateLoaded(ESYS_CONTEXT *esysContext, ESYS_TR parentHandle,
+        ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        const TPM2B_SENSITIVE_CREATE *inSensitive, const TPM2B_TEMPLATE *inPublic,
+        ESYS_TR *objectHandle, TPM2B_PRIVATE **outPrivate, TPM2B_PUBLIC **outPublic) {
+
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_CreateLoaded);
+
+    TPMT_PUBLIC templ = { 0 };
+    size_t offset = 0;
+    TSS2_RC rc = Tss2_MU_TPMT_PUBLIC_Unmarshal(inPublic->buffer, inPublic->size,
+            &offset, &templ);
+    if (rc != TSS2_RC_SUCCESS) {
+        rc = PARAM(TPM2_RC_SIZE, TPM2_RC_2);
+        goto out;
+    }
+
+    c.type = templ.type;
+
+    if (!slot_available()) {
+        rc = TPM2_RC_OBJECT_MEMORY;
+        goto out;
+    }
+
+    fake_object *o = NULL;
+    rc = create_common(parentHandle, inSensitive, &templ, &o, outPrivate, outPublic);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    rc = load_object(esysContext, o, objectHandle);
+    if (rc != TSS2_RC_SUCCESS) {
+        free(*outPrivate);
+        free(*outPublic);
+    }
+
+out:
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_Load(ESYS_CONTEXT *esysContext, ESYS_TR parentHandle,
+        ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        const TPM2B_PRIVATE *inPrivate, const TPM2B_PUBLIC *inPublic,
+        ESYS_TR *objectHandle) {
+
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_Load);
+    c.type = inPublic->publicArea.type;
+
+    fake_tr *parent = NULL;
+    TSS2_RC rc = object_get(parentHandle, TPM2_RC_1, true, &parent);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    fake_object *o = NULL;
+    rc = blob_decode(inPrivate, inPublic, &o);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    rc = load_object(esysContext, o, objectHandle);
+
+out:
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_LoadExternal(ESYS_CONTEXT *esysContext, ESYS_TR shandle1,
+        ESYS_TR shandle2, ESYS_TR shandle3, const TPM2B_SENSITIVE *inPrivate,
+        const TPM2B_PUBLIC *inPublic,
+        ESYS_TR hierarchy,
+        ESYS_TR *objectHandle) {
+
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+    UNUSED(hierarchy);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_LoadExternal);
+    c.type = inPublic->publicArea.type;
+
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    if (inPrivate && inPrivate->size) {
+        /* only public keys are loaded by the library */
+        rc = PARAM(TPM2_RC_VALUE, TPM2_RC_1);
+        goto out;
+    }
+
+    fake_object *o = object_new();
+    if (!o) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+
+    o->pub = *inPublic;
+    rc = load_object(esysContext, o, objectHandle);
+
+out:
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_ReadPublic(ESYS_CONTEXT *esysContext, ESYS_TR objectHandle,
+        ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        TPM2B_PUBLIC **outPublic, TPM2B_NAME **name, TPM2B_NAME **qualifiedName) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_ReadPublic);
+
+    TPM2B_PUBLIC *pub = NULL;
+    TPM2B_NAME *n = NULL;
+    TPM2B_NAME *qn = NULL;
+
+    fake_tr *t = NULL;
+    TSS2_RC rc = object_get(objectHandle, TPM2_RC_1, false, &t);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    c.type = t->obj->pub.publicArea.type;
+
+    pub = malloc(sizeof(*pub));
+    n = calloc(1, sizeof(*n));
+    qn = calloc(1, sizeof(*qn));
+    if (!pub || !n || !qn) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+
+    *pub = t->obj->pub;
+    rc = compute_name(pub, n);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    /* the hierarchy is not tracked, the qualified name is the name */
+    *qn = *n;
+
+    *outPublic = pub;
+    if (name) {
+        *name = n;
+        n = NULL;
+    }
+    if (qualifiedName) {
+        *qualifiedName = qn;
+        qn = NULL;
+    }
+    pub = NULL;
+
+out:
+    free(pub);
+    free(n);
+    free(qn);
+    return cmd_end(&c, rc);
+}
+
+static TSS2_RC sign_rsa(fake_object *o, const TPM2B_DIGEST *digest,
+        TPMI_ALG_SIG_SCHEME scheme, TPMI_ALG_HASH halg, TPMT_SIGNATURE *sig) {
+
+    const EVP_MD *md = halg_to_md(halg);
+    if (!md) {
+        return PARAM(TPM2_RC_HASH, TPM2_RC_2);
+    }
+
+    if (digest->size != EVP_MD_size(md)) {
+        return PARAM(TPM2_RC_SIZE, TPM2_RC_1);
+    }
+
+    TSS2_RC rc = TSS2_ESYS_RC_GENERAL_FAILURE;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(o->pkey, NULL);
+    if (!ctx) {
+        return TSS2_ESYS_RC_MEMORY;
+    }
+
+    bool pss = scheme == TPM2_ALG_RSAPSS;
+    if (EVP_PKEY_sign_init(ctx) <= 0
+            || EVP_PKEY_CTX_set_rsa_padding(ctx,
+                    pss ? RSA_PKCS1_PSS_PADDING : RSA_PKCS1_PADDING) <= 0
+            || EVP_PKEY_CTX_set_signature_md(ctx, md) <= 0
+            || (pss && EVP_PKEY_CTX_set_rsa_pss_saltlen(ctx, -1) <= 0)) {
+        goto out;
+    }
+
+    TPM2B_PUBLIC_KEY_RSA *out = pss ? &sig->signature.rsapss.sig
+            : &sig->signature.rsassa.sig;
+    size_t len = sizeof(out->buffer);
+    if (EVP_PKEY_sign(ctx, out->buffer, &len, digest->buffer, digest->size) <= 0) {
+        goto out;
+    }
+
+    sig->sigAlg = scheme;
+    if (pss) {
+        sig->signature.rsapss.hash = halg;
+    } else {
+        sig->signature.rsassa.hash = halg;
+    }
+    out->size = (UINT16)len;
+    rc = TSS2_RC_SUCCESS;
+
+out:
+    EVP_PKEY_CTX_free(ctx);
+    return rc;
+}
+
+static TSS2_RC sign_ecdsa(fake_object *o, const TPM2B_DIGEST *digest,
+        TPMI_ALG_HASH halg, TPMT_SIGNATURE *sig) {
+
+    const EVP_MD *md = halg_to_md(halg);
+    if (!md) {
+        return PARAM(TPM2_RC_HASH, TPM2_RC_2);
+    }
+
+    if (digest->size != EVP_MD_size(md)) {
+        return PARAM(TPM2_RC_SIZE, TPM2_RC_1);
+    }
+
+    unsigned coord_len = 0;
+    curve_to_nid(o->pub.publicArea.parameters.eccDetail.curveID, &coord_len);
+
+    TSS2_RC rc = TSS2_ESYS_RC_GENERAL_FAILURE;
+    unsigned char der[256];
+    size_t der_len = sizeof(der);
+    ECDSA_SIG *esig = NULL;
+
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(o->pkey, NULL);
+    if (!ctx) {
+        return TSS2_ESYS_RC_MEMORY;
+    }
+
+    if (EVP_PKEY_sign_init(ctx) <= 0
+            || EVP_PKEY_sign(ctx, der, &der_len, digest->buffer, digest->size) <= 0) {
+        goto out;
+    }
+
+    const unsigned char *p = der;
+    esig = d2i_ECDSA_SIG(NULL, &p, der_len);
+    if (!esig) {
+        goto out;
+    }
+
+    const BIGNUM *r = NULL;
+    const BIGNUM *s = NULL;
+    ECDSA_SIG_get0(esig, &r, &s);
+
+    TPMS_SIGNATURE_ECDSA *e = &sig->signature.ecdsa;
+    if (BN_bn2binpad(r, e->signatureR.buffer, coord_len) < 0
+            || BN_bn2binpad(s, e->signatureS.buffer, coord_len) < 0) {
+        goto out;
+    }
+
+    sig->sigAlg = TPM2_ALG_ECDSA;
+    e->hash = halg;
+    e->signatureR.size = coord_len;
+    e->signatureS.size = coord_len;
+    rc = TSS2_RC_SUCCESS;
+
+out:
+    ECDSA_SIG_free(esig);
+    EVP_PKEY_CTX_free(ctx);
+    return rc;
+}
+
+TSS2_RC __wrap_Esys_Sign(ESYS_CONTEXT *esysContext, ESYS_TR keyHandle,
+        ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        const TPM2B_DIGEST *digest, const TPMT_SIG_SCHEME *inScheme,
+        const TPMT_TK_HASHCHECK *validation, TPMT_SIGNATURE **signature) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+    UNUSED(validation);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_Sign);
+
+    TPMT_SIGNATURE *sig = NULL;
+    fake_tr *t = NULL;
+    TSS2_RC rc = object_get(keyHandle, TPM2_RC_1, true, &t);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    fake_object *o = t->obj;
+    TPMT_PUBLIC *p = &o->pub.publicArea;
+    c.type = p->type;
+
+    if (!o->pkey || !(p->objectAttributes & TPMA_OBJECT_SIGN_ENCRYPT)) {
+        rc = HANDLE(TPM2_RC_KEY, TPM2_RC_1);
+        goto out;
+    }
+
+    /* the key scheme wins unless it is TPM2_ALG_NULL */
+    const TPMT_RSA_SCHEME *ks = p->type == TPM2_ALG_RSA ?
+            &p->parameters.rsaDetail.scheme : NULL;
+    TPMI_ALG_SIG_SCHEME scheme = inScheme->scheme;
+    TPMI_ALG_HASH halg = inScheme->details.any.hashAlg;
+    if (ks && ks->scheme != TPM2_ALG_NULL) {
+        if (scheme != TPM2_ALG_NULL && scheme != ks->scheme) {
+            rc = PARAM(TPM2_RC_SCHEME, TPM2_RC_2);
+            goto out;
+        }
+        scheme = ks->scheme;
+        halg = ks->details.anySig.hashAlg;
+    } else if (p->type == TPM2_ALG_ECC
+            && p->parameters.eccDetail.scheme.scheme != TPM2_ALG_NULL) {
+        scheme = p->parameters.eccDetail.scheme.scheme;
+        halg = p->parameters.eccDetail.scheme.details.anySig.hashAlg;
+    }
+
+    sig = calloc(1, sizeof(*sig));
+    if (!sig) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+
+    if (p->type == TPM2_ALG_RSA
+            && (scheme == TPM2_ALG_RSASSA || scheme == TPM2_ALG_RSAPSS)) {
+        rc = sign_rsa(o, digest, scheme, halg, sig);
+    } else if (p->type == TPM2_ALG_ECC && scheme == TPM2_ALG_ECDSA) {
+        rc = sign_ecdsa(o, digest, halg, sig);
+    } else {
+        rc = PARAM(TPM2_RC_SCHEME, TPM2_RC_2);
+    }
+
+    if (rc == TSS2_RC_SUCCESS) {
+        *signature = sig;
+        sig = NULL;
+    }
+
+out:
+    free(sig);
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_RSA_Decrypt(ESYS_CONTEXT *esysContext, ESYS_TR keyHandle,
+        ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        const TPM2B_PUBLIC_KEY_RSA *cipherText, const TPMT_RSA_DECRYPT *inScheme,
+        const TPM2B_DATA *label, TPM2B_PUBLIC_KEY_RSA **message) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_RSA_Decrypt);
+    c.type = TPM2_ALG_RSA;
+
+    EVP_PKEY_CTX *ctx = NULL;
+    TPM2B_PUBLIC_KEY_RSA *msg = NULL;
+
+    fake_tr *t = NULL;
+    TSS2_RC rc = object_get(keyHandle, TPM2_RC_1, true, &t);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    fake_object *o = t->obj;
+    TPMT_PUBLIC *p = &o->pub.publicArea;
+    if (p->type != TPM2_ALG_RSA || !o->pkey
+            || !(p->objectAttributes & TPMA_OBJECT_DECRYPT)
+            || (p->objectAttributes & TPMA_OBJECT_RESTRICTED)) {
+        rc = HANDLE(TPM2_RC_KEY, TPM2_RC_1);
+        goto out;
+    }
+
+    TPMI_ALG_RSA_DECRYPT scheme = inScheme->scheme;
+    TPMI_ALG_HASH halg = inScheme->details.oaep.hashAlg;
+    if (p->parameters.rsaDetail.scheme.scheme != TPM2_ALG_NULL) {
+        scheme = p->parameters.rsaDetail.scheme.scheme;
+        halg = p->parameters.rsaDetail.scheme.details.oaep.hashAlg;
+    }
+
+    int padding;
+    switch (scheme) {
+    case TPM2_ALG_RSAES:
+        padding = RSA_PKCS1_PADDING;
+        break;
+    case TPM2_ALG_OAEP:
+        padding = RSA_PKCS1_OAEP_PADDING;
+        break;
+    case TPM2_ALG_NULL:
+        padding = RSA_NO_PADDING;
+        break;
+    default:
+        rc = PARAM(TPM2_RC_SCHEME, TPM2_RC_2);
+        goto out;
+    }
+
+    const EVP_MD *md = NULL;
+    if (padding == RSA_PKCS1_OAEP_PADDING) {
+        md = halg_to_md(halg);
+        if (!md) {
+            rc = PARAM(TPM2_RC_HASH, TPM2_RC_2);
+            goto out;
+        }
+    }
+
+    msg = calloc(1, sizeof(*msg));
+    ctx = EVP_PKEY_CTX_new(o->pkey, NULL);
+    if (!msg || !ctx) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+
+    rc = TSS2_ESYS_RC_GENERAL_FAILURE;
+    if (EVP_PKEY_decrypt_init(ctx) <= 0
+            || EVP_PKEY_CTX_set_rsa_padding(ctx, padding) <= 0) {
+        goto out;
+    }
+
+    if (md) {
+        if (EVP_PKEY_CTX_set_rsa_oaep_md(ctx, md) <= 0
+                || EVP_PKEY_CTX_set_rsa_mgf1_md(ctx, md) <= 0) {
+            goto out;
+        }
+
+        if (label && label->size) {
+            unsigned char *l = OPENSSL_memdup(label->buffer, label->size);
+            if (!l || EVP_PKEY_CTX_set0_rsa_oaep_label(ctx, l, label->size) <= 0) {
+                OPENSSL_free(l);
+                goto out;
+            }
+        }
+    }
+
+    size_t len = sizeof(msg->buffer);
+    if (EVP_PKEY_decrypt(ctx, msg->buffer, &len,
+            cipherText->buffer, cipherText->size) <= 0) {
+        /* padding errors surface as a value error on the ciphertext */
+        rc = PARAM(TPM2_RC_VALUE, TPM2_RC_1);
+        goto out;
+    }
+
+    msg->size = (UINT16)len;
+    *message = msg;
+    msg = NULL;
+    rc = TSS2_RC_SUCCESS;
+
+out:
+    EVP_PKEY_CTX_free(ctx);
+    free(msg);
+    return cmd_end(&c, rc);
+}
+
+static const EVP_CIPHER *aes_cipher(UINT16 bits, TPMI_ALG_SYM_MODE mode) {
+
+    switch (mode) {
+    case TPM2_ALG_CFB:
+        return bits == 128 ? EVP_aes_128_cfb128() :
+               bits == 192 ? EVP_aes_192_cfb128() : EVP_aes_256_cfb128();
+    case TPM2_ALG_CBC:
+        return bits == 128 ? EVP_aes_128_cbc() :
+               bits == 192 ? EVP_aes_192_cbc() : EVP_aes_256_cbc();
+    case TPM2_ALG_ECB:
+        return bits == 128 ? EVP_aes_128_ecb() :
+               bits == 192 ? EVP_aes_192_ecb() : EVP_aes_256_ecb();
+    case TPM2_ALG_CTR:
+        return bits == 128 ? EVP_aes_128_ctr() :
+               bits == 192 ? EVP_aes_192_ctr() : EVP_aes_256_ctr();
+    case TPM2_ALG_OFB:
+        return bits == 128 ? EVP_aes_128_ofb() :
+               bits == 192 ? EVP_aes_192_ofb() : EVP_aes_256_ofb();
+    default:
+        return NULL;
+    }
+}
+
+static TSS2_RC encrypt_decrypt(ESYS_TR keyHandle, TPMI_YES_NO decrypt,
+        TPMI_ALG_SYM_MODE mode, const TPM2B_IV *ivIn, const TPM2B_MAX_BUFFER *inData,
+        TPM2B_MAX_BUFFER **outData, TPM2B_IV **ivOut, cmd *c) {
+
+    EVP_CIPHER_CTX *ctx = NULL;
+    TPM2B_MAX_BUFFER *out = NULL;
+    TPM2B_IV *iv = NULL;
+
+    fake_tr *t = NULL;
+    TSS2_RC rc = object_get(keyHandle, TPM2_RC_1, true, &t);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+
+    fake_object *o = t->obj;
+    TPMT_PUBLIC *p = &o->pub.publicArea;
+    c->type = p->type;
+
+    TPMA_OBJECT need = decrypt ? TPMA_OBJECT_DECRYPT : TPMA_OBJECT_SIGN_ENCRYPT;
+    if (p->type != TPM2_ALG_SYMCIPHER || !(p->objectAttributes & need)
+            || (p->objectAttributes & TPMA_OBJECT_RESTRICTED)) {
+        return HANDLE(TPM2_RC_KEY, TPM2_RC_1);
+    }
+
+    const TPMT_SYM_DEF_OBJECT *sym = &p->parameters.symDetail.sym;
+    if (sym->mode.aes != TPM2_ALG_NULL) {
+        if (mode != TPM2_ALG_NULL && mode != sym->mode.aes) {
+            return PARAM(TPM2_RC_MODE, TPM2_RC_2);
+        }
+        mode = sym->mode.aes;
+    }
+
+    const EVP_CIPHER *cipher = aes_cipher(sym->keyBits.aes, mode);
+    if (!cipher) {
+        return PARAM(TPM2_RC_MODE, TPM2_RC_2);
+    }
+
+    bool block_mode = mode == TPM2_ALG_CBC || mode == TPM2_ALG_ECB;
+    if (block_mode && inData->size % 16) {
+        return PARAM(TPM2_RC_SIZE, TPM2_RC_1);
+    }
+
+    if (mode != TPM2_ALG_ECB && ivIn->size != 16) {
+        return PARAM(TPM2_RC_SIZE, TPM2_RC_3);
+    }
+
+    out = calloc(1, sizeof(*out));
+    iv = calloc(1, sizeof(*iv));
+    ctx = EVP_CIPHER_CTX_new();
+    if (!out || !iv || !ctx) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+
+    rc = TSS2_ESYS_RC_GENERAL_FAILURE;
+    int len = 0;
+    if (!EVP_CipherInit_ex(ctx, cipher, NULL, o->data.buffer,
+                mode == TPM2_ALG_ECB ? NULL : ivIn->buffer, !decrypt)
+            || !EVP_CIPHER_CTX_set_padding(ctx, 0)
+            || !EVP_CipherUpdate(ctx, out->buffer, &len, inData->buffer, inData->size)) {
+        goto out;
+    }
+
+    int tail = 0;
+    if (!EVP_CipherFinal_ex(ctx, out->buffer + len, &tail)) {
+        goto out;
+    }
+    out->size = (UINT16)(len + tail);
+
+    if (mode != TPM2_ALG_ECB) {
+        iv->size = 16;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        if (!EVP_CIPHER_CTX_get_updated_iv(ctx, iv->buffer, iv->size)) {
+            goto out;
+        }
+#else
+        memcpy(iv->buffer, EVP_CIPHER_CTX_iv(ctx), iv->size);
+#endif
+    }
+
+    *outData = out;
+    *ivOut = iv;
+    out = NULL;
+    iv = NULL;
+    rc = TSS2_RC_SUCCESS;
+
+out:
+    EVP_CIPHER_CTX_free(ctx);
+    free(out);
+    free(iv);
+    return rc;
+}
+
+TSS2_RC __wrap_Esys_EncryptDecrypt(ESYS_CONTEXT *esysContext, ESYS_TR keyHandle,
+        ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3, TPMI_YES_NO decrypt,
+        TPMI_ALG_SYM_MODE mode, const TPM2B_IV *ivIn, const TPM2B_MAX_BUFFER *inData,
+        TPM2B_MAX_BUFFER **outData, TPM2B_IV **ivOut) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_EncryptDecrypt);
+    TSS2_RC rc = encrypt_decrypt(keyHandle, decrypt, mode, ivIn, inData,
+            outData, ivOut, &c);
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_EncryptDecrypt2(ESYS_CONTEXT *esysContext, ESYS_TR keyHandle,
+        ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        const TPM2B_MAX_BUFFER *inData, TPMI_YES_NO decrypt, TPMI_ALG_SYM_MODE mode,
+        const TPM2B_IV *ivIn, TPM2B_MAX_BUFFER **outData, TPM2B_IV **ivOut) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_EncryptDecrypt2);
+    TSS2_RC rc = encrypt_decrypt(keyHandle, decrypt, mode, ivIn, inData,
+            outData, ivOut, &c);
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_Unseal(ESYS_CONTEXT *esysContext, ESYS_TR itemHandle,
+        ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        TPM2B_SENSITIVE_DATA **outData) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_Unseal);
+    c.type = TPM2_ALG_KEYEDHASH;
+
+    fake_tr *t = NULL;
+    TSS2_RC rc = object_get(itemHandle, TPM2_RC_1, true, &t);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    TPMT_PUBLIC *p = &t->obj->pub.publicArea;
+    if (p->type != TPM2_ALG_KEYEDHASH
+            || (p->objectAttributes & (TPMA_OBJECT_SIGN_ENCRYPT
+                    | TPMA_OBJECT_DECRYPT | TPMA_OBJECT_RESTRICTED))) {
+        rc = HANDLE(TPM2_RC_TYPE, TPM2_RC_1);
+        goto out;
+    }
+
+    TPM2B_SENSITIVE_DATA *d = malloc(sizeof(*d));
+    if (!d) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+
+    *d = t->obj->data;
+    *outData = d;
+
+out:
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_ObjectChangeAuth(ESYS_CONTEXT *esysContext, ESYS_TR objectHandle,
+        ESYS_TR parentHandle, ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        const TPM2B_AUTH *newAuth, TPM2B_PRIVATE **outPrivate) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_ObjectChangeAuth);
+
+    TPM2B_PRIVATE *priv = NULL;
+
+    fake_tr *t = NULL;
+    TSS2_RC rc = object_get(objectHandle, TPM2_RC_1, true, &t);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    fake_tr *parent = NULL;
+    rc = object_get(parentHandle, TPM2_RC_2, false, &parent);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    c.type = t->obj->pub.publicArea.type;
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+
+    /* the loaded object keeps its old auth, only the new blob changes */
+    fake_object copy = *t->obj;
+    copy.auth = *newAuth;
+    rc = blob_encode(&copy, priv);
+    OPENSSL_cleanse(&copy, sizeof(copy));
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    *outPrivate = priv;
+    priv = NULL;
+
+out:
+    free(priv);
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_EvictControl(ESYS_CONTEXT *esysContext, ESYS_TR auth,
+        ESYS_TR objectHandle, ESYS_TR shandle1, ESYS_TR shandle2, ESYS_TR shandle3,
+        TPMI_DH_PERSISTENT persistentHandle, ESYS_TR *newObjectHandle) {
+
+    UNUSED(auth);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_EvictControl);
+
+    fake_tr *t = tr_find(objectHandle);
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    if (!t || !t->obj) {
+        rc = HANDLE(TPM2_RC_HANDLE, TPM2_RC_2);
+        goto out;
+    }
+
+    if (t->kind == tr_persistent) {
+        /* evict */
+        fake_persistent **pp;
+        for (pp = &_g.persistent; *pp; pp = &(*pp)->next) {
+            if ((*pp)->handle == t->tpm_handle) {
+                fake_persistent *p = *pp;
+                *pp = p->next;
+                object_unref(p->obj);
+                free(p);
+                break;
+            }
+        }
+        tr_free(t);
+        *newObjectHandle = ESYS_TR_NONE;
+        goto out;
+    }
+
+    if ((persistentHandle & TPM2_HR_RANGE_MASK) != TPM2_HR_PERSISTENT) {
+        rc = PARAM(TPM2_RC_RANGE, TPM2_RC_1);
+        goto out;
+    }
+
+    if (persistent_find(persistentHandle)) {
+        rc = TPM2_RC_NV_DEFINED;
+        goto out;
+    }
+
+    fake_persistent *p = calloc(1, sizeof(*p));
+    if (!p) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+
+    p->handle = persistentHandle;
+    p->obj = t->obj;
+    p->obj->refs++;
+    p->next = _g.persistent;
+    _g.persistent = p;
+
+    rc = tr_from_persistent(esysContext, persistentHandle, newObjectHandle);
+
+out:
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_ReadClock(ESYS_CONTEXT *esysContext, ESYS_TR shandle1,
+        ESYS_TR shandle2, ESYS_TR shandle3, TPMS_TIME_INFO **currentTime) {
+
+    UNUSED(esysContext);
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_ReadClock);
+
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    TPMS_TIME_INFO *info = calloc(1, sizeof(*info));
+    if (!info) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+
+    uint64_t ms = now_ns() / 1000000ULL;
+    info->time = ms;
+    info->clockInfo.clock = ms;
+    /* a reset of the fake is a TPM Reset, the same thing saved contexts go by */
+    info->clockInfo.resetCount = _g.epoch;
+    info->clockInfo.safe = TPM2_YES;
+    *currentTime = info;
+
+out:
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_ContextSave(ESYS_CONTEXT *esysContext, ESYS_TR saveHandle,
+        TPMS_CONTEXT **context) {
+
+    UNUSED(esysContext);
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_ContextSave);
+
+    TPMS_CONTEXT *ctx = NULL;
+    fake_tr *t = tr_find(saveHandle);
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    if (!t || t->kind != tr_transient) {
+        rc = HANDLE(TPM2_RC_HANDLE, TPM2_RC_1);
+        goto out;
+    }
+
+    c.type = t->obj->pub.publicArea.type;
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        rc = TSS2_ESYS_RC_MEMORY;
+        goto out;
+    }
+
+    ctx->sequence = ++_g.sequence;
+    ctx->savedHandle = TPM2_TRANSIENT_FIRST;
+    ctx->hierarchy = TPM2_RH_OWNER;
+
+    /* epoch || TPM2B_PUBLIC || TPM2B_PRIVATE */
+    TPM2B_PRIVATE priv = { 0 };
+    rc = blob_encode(t->obj, &priv);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    uint8_t *p = ctx->contextBlob.buffer;
+    put_u32(&p, CTX_MAGIC);
+    put_u32(&p, _g.epoch);
+    size_t offset = p - ctx->contextBlob.buffer;
+    size_t max = sizeof(ctx->contextBlob.buffer);
+    rc = Tss2_MU_TPM2B_PUBLIC_Marshal(&t->obj->pub, ctx->contextBlob.buffer, max, &offset);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPM2B_PRIVATE_Marshal(&priv, ctx->contextBlob.buffer, max, &offset);
+    }
+    OPENSSL_cleanse(&priv, sizeof(priv));
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    ctx->contextBlob.size = (UINT16)offset;
+    *context = ctx;
+    ctx = NULL;
+
+out:
+    free(ctx);
+    return cmd_end(&c, rc);
+}
+
+TSS2_RC __wrap_Esys_ContextLoad(ESYS_CONTEXT *esysContext, const TPMS_CONTEXT *context,
+        ESYS_TR *loadedHandle) {
+
+    cmd c;
+    cmd_begin(&c, TPM2_CC_ContextLoad);
+
+    const uint8_t *p = context->contextBlob.buffer;
+    const uint8_t *end = p + context->contextBlob.size;
+    uint32_t magic, epoch;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    if (!get_u32(&p, end, &magic) || magic != CTX_MAGIC
+            || !get_u32(&p, end, &epoch) || epoch != _g.epoch) {
+        rc = PARAM(TPM2_RC_INTEGRITY, TPM2_RC_1);
+        goto out;
+    }
+
+    TPM2B_PUBLIC pub = { 0 };
+    TPM2B_PRIVATE priv = { 0 };
+    size_t offset = p - context->contextBlob.buffer;
+    rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(context->contextBlob.buffer,
+            context->contextBlob.size, &offset, &pub);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(context->contextBlob.buffer,
+                context->contextBlob.size, &offset, &priv);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        rc = PARAM(TPM2_RC_INTEGRITY, TPM2_RC_1);
+        goto out;
+    }
+
+    c.type = pub.publicArea.type;
+
+    fake_object *o = NULL;
+    rc = blob_decode(&priv, &pub, &o);
+    OPENSSL_cleanse(&priv, sizeof(priv));
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+
+    rc = load_object(esysContext, o, loadedHandle);
+
+out:
+    return cmd_end(&c, rc);
+}
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef TEST_FAKE_TPM_H_
+#define TEST_FAKE_TPM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tss2/tss2_esys.h>
+
+/*
+ * A stand-in TPM for host side testing and benchmarking.
+ *
+ * Unlike the cmocka wrappers in wrap_tpm.h, which return canned values,
+ * the fake TPM keeps real objects and performs the cryptography with
+ * OpenSSL, so signatures verify and decryption round trips. It is linked
+ * the same way, by wrapping the ESAPI symbols the library uses with
+ * -Wl,--wrap (see FAKE_TPM_WRAP_FLAGS in Makefile.am), and needs no
+ * cmocka, TCTI or simulator.
+ *
+ * Like a real TPM it executes one command at a time, and every command
+ * takes at least its configured latency, so lock, pool, cache and
+ * scheduler changes in the library can be measured deterministically.
+ *
+ * Configuration is read from the environment on first use and on reset:
+ *
+ *  - TPM2_PKCS11_FAKE_TPM_LATENCY: a comma separated list of
+ *    <command>[:<type>]=<duration> entries, where command is a TPM command
+ *    name as in the TPM2_CC_ constants, e.g. Sign or RSA_Decrypt, or * for
+ *    every command, type optionally restricts it to objects of type rsa,
+ *    ecc, aes or keyedhash, and duration takes a ns, us, ms or s suffix.
+ *    For example: "Sign:rsa=80ms,Sign:ecc=25ms,Load=5ms,*=500us".
+ *  - TPM2_PKCS11_FAKE_TPM_SLOTS: the number of transient objects that can
+ *    be loaded at once, 0, the default, is unlimited. Loading beyond the
+ *    limit fails with TPM2_RC_OBJECT_MEMORY as on a TPM without a resource
+ *    manager.
+ *
+ * Private blobs carry the key material in the clear and are only
+ * understood by the fake TPM. RSA keys are limited to 2048 bits so the
+ * blob fits a TPM2B_PRIVATE. A persistent storage key exists at
+ * 0x81000001 from the start, as on a provisioned TPM. A reset is a TPM
+ * Reset: TPM2_ReadClock reports a new resetCount and saved contexts no
+ * longer load.
+ */
+
+/**
+ * Restores the power-on state: all transient objects and sessions are
+ * flushed, persistent objects other than the storage key are evicted and
+ * the configuration is re-read from the environment.
+ */
+void fake_tpm_reset(void);
+
+/**
+ * Sets the minimum latency of a command.
+ * @param cc
+ *  The command code.
+ * @param type
+ *  The object type, TPM2_ALG_RSA, TPM2_ALG_ECC, TPM2_ALG_SYMCIPHER or
+ *  TPM2_ALG_KEYEDHASH, or TPM2_ALG_NULL for any object.
+ * @param ns
+ *  The latency in nanoseconds.
+ * @return
+ *  true on success, false if the command or type is not known.
+ */
+bool fake_tpm_set_latency(TPM2_CC cc, TPM2_ALG_ID type, uint64_t ns);
+
+/**
+ * Sets latencies from a specification string, see the
+ * TPM2_PKCS11_FAKE_TPM_LATENCY format above.
+ * @param spec
+ *  The specification.
+ * @return
+ *  true on success, false on a parse error, in which case entries before
+ *  the error have been applied.
+ */
+bool fake_tpm_set_latency_spec(const char *spec);
+
+/**
+ * Limits the number of loaded transient objects.
+ * @param slots
+ *  The number of slots, 0 for unlimited.
+ */
+void fake_tpm_set_object_slots(unsigned slots);
+
+/**
+ * Makes a loaded transient object persistent, as TPM2_EvictControl does,
+ * without a command or an ESYS context of the test.
+ * @param object
+ *  The ESYS_TR of the transient object.
+ * @param handle
+ *  The persistent handle, it must be free.
+ * @param blob
+ *  The serialized ESYS_TR of the persistent object, as Esys_TR_Serialize()
+ *  returns it. Free it with free().
+ * @param blob_len
+ *  The length of blob.
+ * @return
+ *  true on success, false if the object is not loaded or the handle is
+ *  not a free persistent handle.
+ */
+bool fake_tpm_persist(ESYS_TR object, TPM2_HANDLE handle,
+        uint8_t **blob, size_t *blob_len);
+
+/**
+ * Evicts a persistent object, ESYS_TRs of it already handed out keep
+ * working until closed.
+ * @param handle
+ *  The persistent handle.
+ * @return
+ *  true if an object was evicted, false if the handle was free.
+ */
+bool fake_tpm_evict(TPM2_HANDLE handle);
+
+/**
+ * Returns the number of currently loaded transient objects.
+ */
+unsigned fake_tpm_loaded_objects(void);
+
+/**
+ * Returns the number of commands executed since the last reset.
+ */
+uint64_t fake_tpm_command_count(void);
+
+/**
+ * Returns the number of times a command was executed since the last reset.
+ * @param cc
+ *  The command code.
+ */
+uint64_t fake_tpm_cc_count(TPM2_CC cc);
+
+/**
+ * Returns the number of Esys_TR_SetAuth() calls since the last reset. It
+ * is not a TPM command, so the command counts leave it out.
+ * @param handle
+ *  The ESYS_TR the calls set the auth of, ESYS_TR_NONE for all of them.
+ */
+uint64_t fake_tpm_set_auth_count(ESYS_TR handle);
+
+/**
+ * Returns the number of ESYS contexts created since the last reset.
+ */
+uint64_t fake_tpm_esys_init_count(void);
+
+/**
+ * Returns the total time, in nanoseconds, the fake TPM spent executing
+ * commands, including injected latency, since the last reset.
+ */
+uint64_t fake_tpm_busy_ns(void);
+
+#endif /* TEST_FAKE_TPM_H_ */
@@ -0,0 +1,302 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef TEST_FAKE_TPM_CAPS_H_
+#define TEST_FAKE_TPM_CAPS_H_
+
+#include <tss2/tss2_esys.h>
+
+/*
+ * Capability data captured from a simulator, shared by the cmocka wrappers
+ * in wrap_tpm.h and the fake TPM library.
+ */
+
+static inline TSS2_RC get_commands(UINT32 property,
+        UINT32 propertyCount,
+        TPMI_YES_NO *moreData,
+        const TPMS_CAPABILITY_DATA **capabilityData) {
+
+    if (property != TPM2_CC_FIRST) {
+        return TPM2_RC_P | TPM2_RC_2 | TPM2_RC_VALUE;
+    }
+
+    if (propertyCount != TPM2_MAX_CAP_CC) {
+        return TPM2_RC_P | TPM2_RC_3 | TPM2_RC_VALUE;
+    }
+
+    *moreData = TPM2_NO;
+
+    static const TPMS_CAPABILITY_DATA _data = {
+        .capability = TPM2_CAP_COMMANDS,
+        .data = {
+            .command = {
+                /* tpm2_getcap commands | grep value: | sort | cut -d: -f 2-2 | sed s/' '// | wc -l */
+                .count = 113,
+                /* for v in `tpm2_getcap commands | grep value: | sort | cut -d: -f 2-2 | sed s/' '//`; do echo $v,; done; */
+                .commandAttributes = {
+                        0x10000161,
+                        0x10000167,
+                        0x10000186,
+                        0x12000131,
+                        0x12000157,
+                        0x1200015B,
+                        0x12000191,
+                        0x14000176,
+                        0x165,
+                        0x178,
+                        0x17A,
+                        0x17B,
+                        0x17C,
+                        0x17D,
+                        0x17E,
+                        0x181,
+                        0x18A,
+                        0x18E,
+                        0x20000000,
+                        0x2000130,
+                        0x2000153,
+                        0x2000154,
+                        0x2000155,
+                        0x2000156,
+                        0x2000158,
+                        0x2000159,
+                        0x200015C,
+                        0x200015D,
+                        0x200015E,
+                        0x2000162,
+                        0x2000163,
+                        0x2000164,
+                        0x2000168,
+                        0x2000169,
+                        0x200016A,
+                        0x200016B,
+                        0x200016C,
+                        0x200016D,
+                        0x200016E,
+                        0x200016F,
+                        0x2000170,
+                        0x2000171,
+                        0x2000172,
+                        0x2000173,
+                        0x2000174,
+                        0x2000177,
+                        0x200017F,
+                        0x2000180,
+                        0x2000183,
+                        0x2000187,
+                        0x2000188,
+                        0x2000189,
+                        0x200018B,
+                        0x200018C,
+                        0x200018D,
+                        0x200018F,
+                        0x2000190,
+                        0x2000193,
+                        0x20400211,
+                        0x20400212,
+                        0x20400213,
+                        0x2400127,
+                        0x2400128,
+                        0x2400129,
+                        0x240012A,
+                        0x240012B,
+                        0x240012C,
+                        0x240012D,
+                        0x240012E,
+                        0x2400132,
+                        0x2400139,
+                        0x240013A,
+                        0x240013B,
+                        0x240013C,
+                        0x240013D,
+                        0x240013F,
+                        0x2400140,
+                        0x2400182,
+                        0x2C00121,
+                        0x2C00124,
+                        0x2C00125,
+                        0x2C00126,
+                        0x300013E,
+                        0x4000147,
+                        0x4000148,
+                        0x400014A,
+                        0x400014B,
+                        0x400014C,
+                        0x400014E,
+                        0x4000150,
+                        0x4000151,
+                        0x4000152,
+                        0x4000160,
+                        0x400142,
+                        0x400143,
+                        0x400144,
+                        0x400145,
+                        0x400146,
+                        0x440011F,
+                        0x4400120,
+                        0x4400122,
+                        0x4400133,
+                        0x4400134,
+                        0x4400135,
+                        0x4400136,
+                        0x4400137,
+                        0x4400138,
+                        0x440014F,
+                        0x5400185,
+                        0x6000149,
+                        0x600014D,
+                        0x6000184,
+                        0x6000192,
+                },
+            },
+        },
+    };
+
+    *capabilityData = &_data;
+
+    return TSS2_RC_SUCCESS;
+}
+
+static inline TSS2_RC get_algs(UINT32 property,
+        UINT32 propertyCount,
+        TPMI_YES_NO *moreData,
+        const TPMS_CAPABILITY_DATA **capabilityData) {
+
+    if (property != TPM2_ALG_FIRST) {
+        return TPM2_RC_P | TPM2_RC_2 | TPM2_RC_VALUE;
+    }
+
+    if (propertyCount != TPM2_MAX_CAP_ALGS) {
+        return TPM2_RC_P | TPM2_RC_3 | TPM2_RC_VALUE;
+    }
+
+    *moreData = TPM2_NO;
+
+    static const TPMS_CAPABILITY_DATA _data = {
+        .capability = TPM2_CAP_ALGS,
+        .data = {
+            .algorithms = {
+                /* tpm2_getcap algorithms | grep value: | sort | wc -l */
+                .count = 26,
+                /* alg, properties */
+                /* for v in `tpm2_getcap algorithms | grep value: | cut -d: -f 2-2 | sed s/' '//`; do echo "{$v,},"; done; */
+                /* hand jammed the rest, notice no sort, need order to be same to match alg with property */
+                .algProperties = {
+                    {0x1, 0x9},
+                    {0x4, 0x4},
+                    {0x5, 0x104},
+                    {0x6, 0x2},
+                    {0x7, 0x404},
+                    {0x8, 0x30C},
+                    {0xA, 0x6},
+                    {0xB, 0x4},
+                    {0xC, 0x4},
+                    {0x14, 0x101},
+                    {0x15, 0x201},
+                    {0x16, 0x101},
+                    {0x17, 0x201},
+                    {0x18, 0x501},
+                    {0x19, 0x401},
+                    {0x1A, 0x101},
+                    {0x1C, 0x101},
+                    {0x20, 0x404},
+                    {0x22, 0x404},
+                    {0x23, 0x9},
+                    {0x25, 0x8},
+                    {0x40, 0x202},
+                    {0x41, 0x202},
+                    {0x42, 0x202},
+                    {0x43, 0x202},
+                    {0x44, 0x202},
+                },
+            },
+        },
+    };
+
+    *capabilityData = &_data;
+
+    return TSS2_RC_SUCCESS;
+}
+
+static inline TSS2_RC get_properties(UINT32 property,
+        UINT32 propertyCount,
+        TPMI_YES_NO *moreData,
+        const TPMS_CAPABILITY_DATA **capabilityData) {
+
+    if (property != TPM2_PT_FIXED) {
+        return TPM2_RC_P | TPM2_RC_2 | TPM2_RC_VALUE;
+    }
+
+    if (propertyCount != TPM2_MAX_TPM_PROPERTIES) {
+        return TPM2_RC_P | TPM2_RC_3 | TPM2_RC_VALUE;
+    }
+
+    *moreData = TPM2_NO;
+
+    static const TPMS_CAPABILITY_DATA _data = {
+        .capability = TPM2_CAP_TPM_PROPERTIES,
+        .data = {
+            .tpmProperties = {
+                /* tpm2_getcap properties-fixed | grep raw | wc -l */
+                .count = 44,
+                /* python script
+                 *   - https://gist.github.com/williamcroberts/15c3b7721a74cf5e0f1e9c733a88e511
+                 * with this patch applied to tpm2-tools:
+                 *   - https://github.com/tpm2-software/tpm2-tools/pull/1986
+                 */
+                .tpmProperty = {
+                    {.property=TPM2_PT_FIRMWARE_VERSION_2, .value=0x162800},
+                    {.property=TPM2_PT_FIRMWARE_VERSION_1, .value=0x20160511},
+                    {.property=TPM2_PT_NV_COUNTERS_MAX, .value=0x0},
+                    {.property=TPM2_PT_PCR_COUNT, .value=0x18},
+                    {.property=TPM2_PT_PS_REVISION, .value=0x92},
+                    {.property=TPM2_PT_CLOCK_UPDATE, .value=0x1000},
+                    {.property=TPM2_PT_MEMORY, .value=0x6},
+                    {.property=TPM2_PT_INPUT_BUFFER, .value=0x400},
+                    {.property=TPM2_PT_SPLIT_MAX, .value=0x80},
+                    {.property=TPM2_PT_DAY_OF_YEAR, .value=0xA7},
+                    {.property=TPM2_PT_YEAR, .value=0x7E1},
+                    {.property=TPM2_PT_HR_LOADED_MIN, .value=0x3},
+                    {.property=TPM2_PT_PS_YEAR, .value=0x7E1},
+                    {.property=TPM2_PT_LIBRARY_COMMANDS, .value=0x6D},
+                    {.property=TPM2_PT_REVISION, .value=0x92},
+                    {.property=TPM2_PT_VENDOR_COMMANDS, .value=0x4},
+                    {.property=TPM2_PT_MODES, .value=0x0},
+                    {.property=TPM2_PT_MAX_SESSION_CONTEXT, .value=0x144},
+                    {.property=TPM2_PT_HR_TRANSIENT_MIN, .value=0x3},
+                    {.property=TPM2_PT_TOTAL_COMMANDS, .value=0x71},
+                    {.property=TPM2_PT_FAMILY_INDICATOR, .value=0x322E3000},
+                    {.property=TPM2_PT_PS_FAMILY_INDICATOR, .value=0x322E3000},
+                    {.property=TPM2_PT_ORDERLY_COUNT, .value=0xFF},
+                    {.property=TPM2_PT_MAX_DIGEST, .value=0x30},
+                    {.property=TPM2_PT_NV_BUFFER_MAX, .value=0x400},
+                    {.property=TPM2_PT_MAX_COMMAND_SIZE, .value=0x1000},
+                    {.property=TPM2_PT_VENDOR_STRING_1, .value=0x53572020},
+                    {.property=TPM2_PT_VENDOR_STRING_3, .value=0x0},
+                    {.property=TPM2_PT_VENDOR_STRING_2, .value=0x2054504D},
+                    {.property=TPM2_PT_CONTEXT_SYM_SIZE, .value=0x100},
+                    {.property=TPM2_PT_VENDOR_STRING_4, .value=0x0},
+                    {.property=TPM2_PT_CONTEXT_GAP_MAX, .value=0xFFFFFFFF},
+                    {.property=TPM2_PT_CONTEXT_HASH, .value=0xC},
+                    {.property=TPM2_PT_MANUFACTURER, .value=0x49424D20},
+                    {.property=TPM2_PT_CONTEXT_SYM, .value=0x6},
+                    {.property=TPM2_PT_MAX_RESPONSE_SIZE, .value=0x1000},
+                    {.property=TPM2_PT_NV_INDEX_MAX, .value=0x800},
+                    {.property=TPM2_PT_LEVEL, .value=0x0},
+                    {.property=TPM2_PT_PS_LEVEL, .value=0x0},
+                    {.property=TPM2_PT_HR_PERSISTENT_MIN, .value=0x2},
+                    {.property=TPM2_PT_PCR_SELECT_MIN, .value=0x3},
+                    {.property=TPM2_PT_PS_DAY_OF_YEAR, .value=0xA7},
+                    {.property=TPM2_PT_ACTIVE_SESSIONS_MAX, .value=0x40},
+                    {.property=TPM2_PT_MAX_OBJECT_CONTEXT, .value=0x764},
+                    {.property=TPM2_PT_VENDOR_TPM_TYPE, .value=0x1},
+                },
+            },
+        },
+    };
+
+    *capabilityData = &_data;
+
+    return TSS2_RC_SUCCESS;
+}
+
+#endif /* TEST_FAKE_TPM_CAPS_H_ */
@@ -513,6 +513,64 @@ static void db_tobject_new_tobject_object_init_from_attrs_fail(void **state) {
     assert_null(t);
 }
 
+static void db_tobject_new_tobject_attr_rows_prepare_fail(void **state) {
+    (void) state;
+
+    will_return_data d[] = {
+        { .call_real = true },      /* db_tobject_new call real */
+		{ .data = *state },         /* tobject_new */
+		{ .rc = 2 },                /* sqlite3_data_count */
+		{ .data = "id" },           /* sqlite3_column_name */
+		{ .rc = 42 },               /* sqlite3_column_int */
+		{ .data = "attrs" },        /* sqlite3_column_name */
+		{ .rc = 0 },                /* sqlite3_column_bytes */
+		{ .data = "" },             /* sqlite3_column_text */
+		{ .rc = SQLITE_ERROR },     /* sqlite3_prepare_v2 */
+    };
+
+    will_return(db_tobject_new,               &d[0]);
+    will_return(tobject_new,                  &d[1]);
+    will_return(__wrap_sqlite3_data_count,    &d[2]);
+    will_return(__wrap_sqlite3_column_name,   &d[3]);
+    will_return(__wrap_sqlite3_column_int,    &d[4]);
+    will_return(__wrap_sqlite3_column_name,   &d[5]);
+    will_return(__wrap_sqlite3_column_bytes,  &d[6]);
+    will_return(__wrap_sqlite3_column_text,   &d[7]);
+    will_return(__wrap_sqlite3_prepare_v2,    &d[8]);
+
+    tobject *t = db_tobject_new(BAD_PTR);
+    assert_null(t);
+}
+
+static void db_tobject_new_tobject_value_len_prepare_fail(void **state) {
+    (void) state;
+
+    will_return_data d[] = {
+        { .call_real = true },      /* db_tobject_new call real */
+		{ .data = *state },         /* tobject_new */
+		{ .rc = 1 },                /* sqlite3_data_count */
+		{ .data = "attrs" },        /* sqlite3_column_name */
+		{ .rc = 3 },                /* sqlite3_column_bytes */
+		{ .data = "good" },         /* sqlite3_column_text */
+		{ .rcb = true },            /* parse_attributes_from_string */
+		{ .rv = CKR_OK },           /* object_init_from_attrs */
+		{ .rc = SQLITE_ERROR },     /* sqlite3_prepare_v2 */
+    };
+
+    will_return(db_tobject_new,               &d[0]);
+    will_return(tobject_new,                  &d[1]);
+    will_return(__wrap_sqlite3_data_count,    &d[2]);
+    will_return(__wrap_sqlite3_column_name,   &d[3]);
+    will_return(__wrap_sqlite3_column_bytes,  &d[4]);
+    will_return(__wrap_sqlite3_column_text,   &d[5]);
+    will_return(parse_attributes_from_string, &d[6]);
+    will_return(object_init_from_attrs,       &d[7]);
+    will_return(__wrap_sqlite3_prepare_v2,    &d[8]);
+
+    tobject *t = db_tobject_new(BAD_PTR);
+    assert_null(t);
+}
+
 static void init_pobject_v3_from_stmt_sqlite3_column_text_fail(void **state) {
     (void) state;
 
@@ -1810,6 +1868,7 @@ static void test_db_add_new_object_sqlite3_last_insert_rowid_fail(void **state)
 static void test_db_delete_object_sqlite3_prepare_v2_fail(void **state) {
     UNUSED(state);
 
+    token t = { 0 };
     tobject tobj = { 0 };
 
     will_return_data d[] = {
@@ -1818,13 +1877,14 @@ static void test_db_delete_object_sqlite3_prepare_v2_fail(void **state) {
 
     will_return(__wrap_sqlite3_prepare_v2,  &d[0]);
 
-    CK_RV rv = db_delete_object(&tobj);
+    CK_RV rv = db_delete_object(&t, &tobj);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
 static void test_db_delete_object_sqlite3_bind_int_fail(void **state) {
     UNUSED(state);
 
+    token t = { 0 };
     tobject tobj = { 0 };
 
     will_return_data d[] = {
@@ -1841,13 +1901,14 @@ static void test_db_delete_object_sqlite3_bind_int_fail(void **state) {
     will_return(__wrap_sqlite3_finalize,    &d[3]);
     will_return(__wrap_sqlite3_exec,        &d[4]);
 
-    CK_RV rv = db_delete_object(&tobj);
+    CK_RV rv = db_delete_object(&t, &tobj);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
 static void test_db_delete_object_sqlite3_step_fail(void **state) {
     UNUSED(state);
 
+    token t = { 0 };
     tobject tobj = { 0 };
 
     will_return_data d[] = {
@@ -1866,7 +1927,7 @@ static void test_db_delete_object_sqlite3_step_fail(void **state) {
     will_return(__wrap_sqlite3_finalize,    &d[4]);
     will_return(__wrap_sqlite3_exec,        &d[5]);
 
-    CK_RV rv = db_delete_object(&tobj);
+    CK_RV rv = db_delete_object(&t, &tobj);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
@@ -2103,16 +2164,20 @@ static void test_db_update_token_sqlite3_bind_text_fail(void **state) {
     will_return_data d[] = {
         { .data = __real_strdup("foobar") }, /* emit_config_to_string */
         { .rc = SQLITE_OK                 }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (BEGIN TRANSACTION) */
         { .rc = SQLITE_ERROR              }, /* sqlite3_bind_text */
         { .rc = SQLITE_OK                 }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (ROLLBACK) */
     };
 
     assert_non_null(d[0].data);
 
     will_return(emit_config_to_string,      &d[0]);
     will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
-    will_return(__wrap_sqlite3_bind_text,   &d[2]);
-    will_return(__wrap_sqlite3_finalize,    &d[3]);
+    will_return(__wrap_sqlite3_exec,        &d[2]);
+    will_return(__wrap_sqlite3_bind_text,   &d[3]);
+    will_return(__wrap_sqlite3_finalize,    &d[4]);
+    will_return(__wrap_sqlite3_exec,        &d[5]);
 
     CK_RV rv = db_update_token_config(&tok);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
@@ -2126,39 +2191,111 @@ static void test_db_update_token_sqlite3_bind_int_fail(void **state) {
     will_return_data d[] = {
         { .data = __real_strdup("foobar") }, /* emit_config_to_string */
         { .rc = SQLITE_OK                 }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (BEGIN TRANSACTION) */
         { .rc = SQLITE_OK                 }, /* sqlite3_bind_text */
         { .rc = SQLITE_ERROR              }, /* sqlite3_bind_int */
         { .rc = SQLITE_OK                 }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (ROLLBACK) */
     };
 
     assert_non_null(d[0].data);
 
     will_return(emit_config_to_string,      &d[0]);
     will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
-    will_return(__wrap_sqlite3_bind_text,   &d[2]);
-    will_return(__wrap_sqlite3_bind_int,    &d[3]);
-    will_return(__wrap_sqlite3_finalize,    &d[4]);
+    will_return(__wrap_sqlite3_exec,        &d[2]);
+    will_return(__wrap_sqlite3_bind_text,   &d[3]);
+    will_return(__wrap_sqlite3_bind_int,    &d[4]);
+    will_return(__wrap_sqlite3_finalize,    &d[5]);
+    will_return(__wrap_sqlite3_exec,        &d[6]);
+
+    CK_RV rv = db_update_token_config(&tok);
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+}
+
+static void test_db_update_token_sqlite3_step_fail(void **state) {
+    UNUSED(state);
+
+    token tok = { 0 };
+
+    will_return_data d[] = {
+        { .data = __real_strdup("foobar") }, /* emit_config_to_string */
+        { .rc = SQLITE_OK                 }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (BEGIN TRANSACTION) */
+        { .rc = SQLITE_OK                 }, /* sqlite3_bind_text */
+        { .rc = SQLITE_OK                 }, /* sqlite3_bind_int */
+        { .rc = SQLITE_ERROR              }, /* sqlite3_step */
+        { .rc = SQLITE_OK                 }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (ROLLBACK) */
+    };
+
+    assert_non_null(d[0].data);
+
+    will_return(emit_config_to_string,      &d[0]);
+    will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
+    will_return(__wrap_sqlite3_exec,        &d[2]);
+    will_return(__wrap_sqlite3_bind_text,   &d[3]);
+    will_return(__wrap_sqlite3_bind_int,    &d[4]);
+    will_return(__wrap_sqlite3_step,        &d[5]);
+    will_return(__wrap_sqlite3_finalize,    &d[6]);
+    will_return(__wrap_sqlite3_exec,        &d[7]);
 
     CK_RV rv = db_update_token_config(&tok);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
+static void test_db_update_token_commits(void **state) {
+    UNUSED(state);
+
+    token tok = { 0 };
+
+    will_return_data d[] = {
+        { .data = __real_strdup("foobar") }, /* emit_config_to_string */
+        { .rc = SQLITE_OK                 }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (BEGIN TRANSACTION) */
+        { .rc = SQLITE_OK                 }, /* sqlite3_bind_text */
+        { .rc = SQLITE_OK                 }, /* sqlite3_bind_int */
+        { .rc = SQLITE_DONE               }, /* sqlite3_step */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (COMMIT) */
+        { .rc = SQLITE_OK                 }, /* sqlite3_finalize */
+    };
+
+    assert_non_null(d[0].data);
+
+    will_return(emit_config_to_string,      &d[0]);
+    will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
+    will_return(__wrap_sqlite3_exec,        &d[2]);
+    will_return(__wrap_sqlite3_bind_text,   &d[3]);
+    will_return(__wrap_sqlite3_bind_int,    &d[4]);
+    will_return(__wrap_sqlite3_step,        &d[5]);
+    will_return(__wrap_sqlite3_exec,        &d[6]);
+    will_return(__wrap_sqlite3_finalize,    &d[7]);
+
+    CK_RV rv = db_update_token_config(&tok);
+    assert_int_equal(rv, CKR_OK);
+}
+
 static void test_db_update_tobject_attrs_emit_attributes_to_string_fail(void **state) {
     UNUSED(state);
 
+    token t = { 0 };
+    tobject tobj = { .id = 42 };
+
     will_return_data d[] = {
         { .data = NULL }, /* emit_attributes_to_string */
     };
 
     will_return(emit_attributes_to_string,  &d[0]);
 
-    CK_RV rv = db_update_tobject_attrs(42, (attr_list *)0xDEADBEEF);
+    CK_RV rv = db_update_tobject_attrs(&t, &tobj, (attr_list *)0xDEADBEEF);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
 static void test_db_update_tobject_attrs_sqlite3_prepare_v2_fail(void **state) {
     UNUSED(state);
 
+    token t = { 0 };
+    tobject tobj = { .id = 42 };
+
     will_return_data d[] = {
         { .data = __real_strdup("foobar") }, /* emit_attributes_to_string */
         { .rc = SQLITE_ERROR              }, /* sqlite3_prepare_v2 */
@@ -2169,79 +2306,143 @@ static void test_db_update_tobject_attrs_sqlite3_prepare_v2_fail(void **state) {
     will_return(emit_attributes_to_string,  &d[0]);
     will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
 
-    CK_RV rv = db_update_tobject_attrs(42, (attr_list *)0xDEADBEEF);
+    CK_RV rv = db_update_tobject_attrs(&t, &tobj, (attr_list *)0xDEADBEEF);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
 static void test_db_update_tobject_attrs_sqlite3_bind_text_fail(void **state) {
     UNUSED(state);
 
+    token t = { 0 };
+    tobject tobj = { .id = 42 };
+
     will_return_data d[] = {
         { .data = __real_strdup("foobar") }, /* emit_attributes_to_string */
         { .rc = SQLITE_OK                 }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (BEGIN TRANSACTION) */
         { .rc = SQLITE_ERROR              }, /* sqlite3_bind_text */
         { .rc = SQLITE_OK                 }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (ROLLBACK) */
     };
 
     assert_non_null(d[0].data);
 
     will_return(emit_attributes_to_string,  &d[0]);
     will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
-    will_return(__wrap_sqlite3_bind_text,   &d[2]);
-    will_return(__wrap_sqlite3_finalize,    &d[3]);
+    will_return(__wrap_sqlite3_exec,        &d[2]);
+    will_return(__wrap_sqlite3_bind_text,   &d[3]);
+    will_return(__wrap_sqlite3_finalize,    &d[4]);
+    will_return(__wrap_sqlite3_exec,        &d[5]);
 
-    CK_RV rv = db_update_tobject_attrs(42, (attr_list *)0xDEADBEEF);
+    CK_RV rv = db_update_tobject_attrs(&t, &tobj, (attr_list *)0xDEADBEEF);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
 static void test_db_update_tobject_attrs_sqlite3_bind_int_fail(void **state) {
     UNUSED(state);
 
+    token t = { 0 };
+    tobject tobj = { .id = 42 };
+
     will_return_data d[] = {
         { .data = __real_strdup("foobar") }, /* emit_attributes_to_string */
         { .rc = SQLITE_OK                 }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (BEGIN TRANSACTION) */
         { .rc = SQLITE_OK                 }, /* sqlite3_bind_text */
         { .rc = SQLITE_ERROR              }, /* sqlite3_bind_int */
         { .rc = SQLITE_OK                 }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (ROLLBACK) */
     };
 
     assert_non_null(d[0].data);
 
     will_return(emit_attributes_to_string,  &d[0]);
     will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
-    will_return(__wrap_sqlite3_bind_text,   &d[2]);
-    will_return(__wrap_sqlite3_bind_int,    &d[3]);
-    will_return(__wrap_sqlite3_finalize,    &d[4]);
+    will_return(__wrap_sqlite3_exec,        &d[2]);
+    will_return(__wrap_sqlite3_bind_text,   &d[3]);
+    will_return(__wrap_sqlite3_bind_int,    &d[4]);
+    will_return(__wrap_sqlite3_finalize,    &d[5]);
+    will_return(__wrap_sqlite3_exec,        &d[6]);
 
-    CK_RV rv = db_update_tobject_attrs(42, (attr_list *)0xDEADBEEF);
+    CK_RV rv = db_update_tobject_attrs(&t, &tobj, (attr_list *)0xDEADBEEF);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
 static void test_db_update_tobject_attrs_sqlite3_step_fail(void **state) {
     UNUSED(state);
 
+    token t = { 0 };
+    tobject tobj = { .id = 42 };
+
     will_return_data d[] = {
         { .data = __real_strdup("foobar") }, /* emit_attributes_to_string */
         { .rc = SQLITE_OK                 }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (BEGIN TRANSACTION) */
         { .rc = SQLITE_OK                 }, /* sqlite3_bind_text */
         { .rc = SQLITE_OK                 }, /* sqlite3_bind_int */
         { .rc = SQLITE_ERROR              }, /* sqlite3_step */
         { .rc = SQLITE_OK                 }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                 }, /* sqlite_exec (ROLLBACK) */
     };
 
     assert_non_null(d[0].data);
 
     will_return(emit_attributes_to_string,  &d[0]);
     will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
-    will_return(__wrap_sqlite3_bind_text,   &d[2]);
-    will_return(__wrap_sqlite3_bind_int,    &d[3]);
-    will_return(__wrap_sqlite3_step,        &d[4]);
-    will_return(__wrap_sqlite3_finalize,    &d[5]);
+    will_return(__wrap_sqlite3_exec,        &d[2]);
+    will_return(__wrap_sqlite3_bind_text,   &d[3]);
+    will_return(__wrap_sqlite3_bind_int,    &d[4]);
+    will_return(__wrap_sqlite3_step,        &d[5]);
+    will_return(__wrap_sqlite3_finalize,    &d[6]);
+    will_return(__wrap_sqlite3_exec,        &d[7]);
+
+    CK_RV rv = db_update_tobject_attrs(&t, &tobj, (attr_list *)0xDEADBEEF);
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+}
+
+static void test_db_refresh_tobjects_sqlite3_prepare_v2_fail(void **state) {
+    UNUSED(state);
+
+    token t = { .id = 3 };
 
-    CK_RV rv = db_update_tobject_attrs(42, (attr_list *)0xDEADBEEF);
+    will_return_data d[] = {
+        { .rc = SQLITE_ERROR }, /* sqlite3_prepare_v2 (data_version) */
+    };
+
+    will_return(__wrap_sqlite3_prepare_v2,  &d[0]);
+
+    CK_RV rv = db_refresh_tobjects(&t);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
+static void test_db_refresh_tobjects_unchanged(void **state) {
+    UNUSED(state);
+
+    token t = {
+        .id = 3,
+        .esysdb = {
+            .data_version = 7,
+            .tobjects_synced = true,
+        },
+    };
+
+    will_return_data d[] = {
+        { .rc = SQLITE_OK  }, /* sqlite3_prepare_v2 (data_version) */
+        { .rc = SQLITE_ROW }, /* sqlite3_step */
+        { .rc = 7          }, /* sqlite3_column_int */
+        { .rc = SQLITE_OK  }, /* sqlite3_finalize */
+    };
+
+    /* no other connection committed anything, so the objects are not read */
+    will_return(__wrap_sqlite3_prepare_v2,  &d[0]);
+    will_return(__wrap_sqlite3_step,        &d[1]);
+    will_return(__wrap_sqlite3_column_int,  &d[2]);
+    will_return(__wrap_sqlite3_finalize,    &d[3]);
+
+    CK_RV rv = db_refresh_tobjects(&t);
+    assert_int_equal(rv, CKR_OK);
+}
+
 static void test_db_add_token_emit_config_to_string_fail(void **state) {
     UNUSED(state);
 
@@ -2865,6 +3066,12 @@ int main(int argc, char* argv[]) {
 		cmocka_unit_test_setup(
 			db_tobject_new_tobject_object_init_from_attrs_fail,
 			tobject_setup),
+		cmocka_unit_test_setup(
+			db_tobject_new_tobject_attr_rows_prepare_fail,
+			tobject_setup),
+		cmocka_unit_test_setup(
+			db_tobject_new_tobject_value_len_prepare_fail,
+			tobject_setup),
 		cmocka_unit_test(init_tobjects_db_tobject_new_fail),
 		cmocka_unit_test(init_pobject_v3_from_stmt_sqlite3_column_text_fail),
 		cmocka_unit_test(init_pobject_v3_from_stmt_strdup_fail),
@@ -2929,11 +3136,15 @@ int main(int argc, char* argv[]) {
         cmocka_unit_test(test_db_update_token_sqlite3_prepare_v2_fail),
         cmocka_unit_test(test_db_update_token_sqlite3_bind_text_fail),
         cmocka_unit_test(test_db_update_token_sqlite3_bind_int_fail),
+        cmocka_unit_test(test_db_update_token_sqlite3_step_fail),
+        cmocka_unit_test(test_db_update_token_commits),
         cmocka_unit_test(test_db_update_tobject_attrs_emit_attributes_to_string_fail),
         cmocka_unit_test(test_db_update_tobject_attrs_sqlite3_prepare_v2_fail),
         cmocka_unit_test(test_db_update_tobject_attrs_sqlite3_bind_text_fail),
         cmocka_unit_test(test_db_update_tobject_attrs_sqlite3_bind_int_fail),
         cmocka_unit_test(test_db_update_tobject_attrs_sqlite3_step_fail),
+        cmocka_unit_test(test_db_refresh_tobjects_sqlite3_prepare_v2_fail),
+        cmocka_unit_test(test_db_refresh_tobjects_unchanged),
         cmocka_unit_test(test_db_add_token_emit_config_to_string_fail),
         cmocka_unit_test(test_db_add_token_sqlite3_prepare_v2_fail),
         cmocka_unit_test(test_db_add_token_sqlite3_exec_fail),
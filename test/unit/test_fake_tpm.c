@@ -0,0 +1,299 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+
+#include <cmocka.h>
+
+#include <openssl/bn.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <tss2/tss2_esys.h>
+#include <tss2/tss2_mu.h>
+
+#include "fake_tpm.h"
+
+#define SRK_HANDLE 0x81000001
+
+typedef struct test_state test_state;
+struct test_state {
+    ESYS_CONTEXT *esys;
+    ESYS_TR srk;
+};
+
+static int setup(void **state) {
+
+    fake_tpm_reset();
+
+    test_state *s = calloc(1, sizeof(*s));
+    assert_non_null(s);
+
+    TSS2_RC rc = Esys_Initialize(&s->esys, NULL, NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    rc = Esys_TR_FromTPMPublic(s->esys, SRK_HANDLE,
+            ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &s->srk);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    *state = s;
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    Esys_Finalize(&s->esys);
+    free(s);
+
+    return 0;
+}
+
+static TSS2_RC create_ecc_key(test_state *s, const char *auth,
+        ESYS_TR *handle, TPM2B_PUBLIC **pub) {
+
+    TPMT_PUBLIC templ = {
+        .type = TPM2_ALG_ECC,
+        .nameAlg = TPM2_ALG_SHA256,
+        .objectAttributes = TPMA_OBJECT_USERWITHAUTH | TPMA_OBJECT_SIGN_ENCRYPT
+            | TPMA_OBJECT_FIXEDTPM | TPMA_OBJECT_FIXEDPARENT
+            | TPMA_OBJECT_SENSITIVEDATAORIGIN,
+        .parameters.eccDetail = {
+            .symmetric.algorithm = TPM2_ALG_NULL,
+            .scheme.scheme = TPM2_ALG_NULL,
+            .curveID = TPM2_ECC_NIST_P256,
+            .kdf.scheme = TPM2_ALG_NULL,
+        },
+    };
+
+    TPM2B_TEMPLATE tmpl = { 0 };
+    size_t offset = 0;
+    TSS2_RC rc = Tss2_MU_TPMT_PUBLIC_Marshal(&templ, tmpl.buffer,
+            sizeof(tmpl.buffer), &offset);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    tmpl.size = offset;
+
+    TPM2B_SENSITIVE_CREATE sens = { 0 };
+    sens.sensitive.userAuth.size = strlen(auth);
+    memcpy(sens.sensitive.userAuth.buffer, auth, strlen(auth));
+
+    TPM2B_PRIVATE *priv = NULL;
+    TPM2B_PUBLIC *p = NULL;
+    rc = Esys_CreateLoaded(s->esys, s->srk,
+            ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+            &sens, &tmpl, handle, &priv, &p);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+
+    Esys_Free(priv);
+    if (pub) {
+        *pub = p;
+    } else {
+        Esys_Free(p);
+    }
+
+    return rc;
+}
+
+static EVP_PKEY *pub_to_pkey(const TPM2B_PUBLIC *pub) {
+
+    unsigned char point[65] = { 0x04 };
+    const TPMS_ECC_POINT *u = &pub->publicArea.unique.ecc;
+    assert_int_equal(u->x.size, 32);
+    assert_int_equal(u->y.size, 32);
+    memcpy(&point[1], u->x.buffer, 32);
+    memcpy(&point[33], u->y.buffer, 32);
+
+    EVP_PKEY *params = NULL;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    assert_non_null(ctx);
+    assert_true(EVP_PKEY_paramgen_init(ctx) > 0);
+    assert_true(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) > 0);
+    assert_true(EVP_PKEY_paramgen(ctx, &params) > 0);
+    EVP_PKEY_CTX_free(ctx);
+
+    const unsigned char *p = point;
+    EVP_PKEY *pkey = d2i_PublicKey(EVP_PKEY_EC, &params, &p, sizeof(point));
+    assert_non_null(pkey);
+
+    return pkey;
+}
+
+static void test_fake_tpm_sign_verify(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    ESYS_TR key = ESYS_TR_NONE;
+    TPM2B_PUBLIC *pub = NULL;
+    TSS2_RC rc = create_ecc_key(s, "mykeyauth", &key, &pub);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    TPM2B_DIGEST digest = { .size = 32 };
+    RAND_bytes(digest.buffer, digest.size);
+
+    TPMT_SIG_SCHEME scheme = {
+        .scheme = TPM2_ALG_ECDSA,
+        .details.ecdsa.hashAlg = TPM2_ALG_SHA256,
+    };
+
+    TPMT_TK_HASHCHECK validation = {
+        .tag = TPM2_ST_HASHCHECK,
+        .hierarchy = TPM2_RH_NULL,
+    };
+
+    /* no auth set yet */
+    TPMT_SIGNATURE *sig = NULL;
+    rc = Esys_Sign(s->esys, key, ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+            &digest, &scheme, &validation, &sig);
+    assert_int_equal(rc, TPM2_RC_S | TPM2_RC_1 | TPM2_RC_AUTH_FAIL);
+
+    TPM2B_AUTH auth = { .size = 9 };
+    memcpy(auth.buffer, "mykeyauth", 9);
+    rc = Esys_TR_SetAuth(s->esys, key, &auth);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    rc = Esys_Sign(s->esys, key, ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+            &digest, &scheme, &validation, &sig);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_int_equal(sig->sigAlg, TPM2_ALG_ECDSA);
+
+    ECDSA_SIG *esig = ECDSA_SIG_new();
+    assert_non_null(esig);
+    BIGNUM *r = BN_bin2bn(sig->signature.ecdsa.signatureR.buffer,
+            sig->signature.ecdsa.signatureR.size, NULL);
+    BIGNUM *sv = BN_bin2bn(sig->signature.ecdsa.signatureS.buffer,
+            sig->signature.ecdsa.signatureS.size, NULL);
+    assert_true(ECDSA_SIG_set0(esig, r, sv));
+
+    unsigned char *der = NULL;
+    int der_len = i2d_ECDSA_SIG(esig, &der);
+    assert_true(der_len > 0);
+
+    EVP_PKEY *pkey = pub_to_pkey(pub);
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(pkey, NULL);
+    assert_non_null(ctx);
+    assert_true(EVP_PKEY_verify_init(ctx) > 0);
+    assert_int_equal(EVP_PKEY_verify(ctx, der, der_len,
+            digest.buffer, digest.size), 1);
+
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(pkey);
+    OPENSSL_free(der);
+    ECDSA_SIG_free(esig);
+    Esys_Free(sig);
+    Esys_Free(pub);
+
+    rc = Esys_FlushContext(s->esys, key);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+}
+
+static void test_fake_tpm_object_slots(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    fake_tpm_set_object_slots(2);
+
+    ESYS_TR keys[3];
+    TSS2_RC rc = create_ecc_key(s, "", &keys[0], NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    rc = create_ecc_key(s, "", &keys[1], NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_int_equal(fake_tpm_loaded_objects(), 2);
+
+    rc = create_ecc_key(s, "", &keys[2], NULL);
+    assert_int_equal(rc, TPM2_RC_OBJECT_MEMORY);
+
+    rc = Esys_FlushContext(s->esys, keys[0]);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    rc = create_ecc_key(s, "", &keys[2], NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    /* finalize flushes whatever the context left loaded */
+    Esys_Finalize(&s->esys);
+    assert_int_equal(fake_tpm_loaded_objects(), 0);
+
+    rc = Esys_Initialize(&s->esys, NULL, NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void test_fake_tpm_latency(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    assert_false(fake_tpm_set_latency_spec("NoSuchCommand=1ms"));
+    assert_false(fake_tpm_set_latency_spec("Sign:dsa=1ms"));
+    assert_false(fake_tpm_set_latency_spec("Sign=1fortnight"));
+
+    assert_true(fake_tpm_set_latency_spec("GetRandom=20ms,Sign:rsa=1s"));
+
+    uint64_t busy = fake_tpm_busy_ns();
+    uint64_t cnt = fake_tpm_command_count();
+    uint64_t start = now_ms();
+
+    TPM2B_DIGEST *rand = NULL;
+    TSS2_RC rc = Esys_GetRandom(s->esys, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+            16, &rand);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_int_equal(rand->size, 16);
+    Esys_Free(rand);
+
+    assert_true(now_ms() - start >= 20);
+    assert_true(fake_tpm_busy_ns() - busy >= 20000000ULL);
+    assert_int_equal(fake_tpm_command_count() - cnt, 1);
+
+    /* the RSA specific latency must not apply to ECC keys */
+    ESYS_TR key;
+    rc = create_ecc_key(s, "", &key, NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    TPM2B_DIGEST digest = { .size = 32 };
+    TPMT_SIG_SCHEME scheme = {
+        .scheme = TPM2_ALG_ECDSA,
+        .details.ecdsa.hashAlg = TPM2_ALG_SHA256,
+    };
+    TPMT_TK_HASHCHECK validation = {
+        .tag = TPM2_ST_HASHCHECK,
+        .hierarchy = TPM2_RH_NULL,
+    };
+
+    start = now_ms();
+    TPMT_SIGNATURE *sig = NULL;
+    rc = Esys_Sign(s->esys, key, ESYS_TR_PASSWORD, ESYS_TR_NONE, ESYS_TR_NONE,
+            &digest, &scheme, &validation, &sig);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_true(now_ms() - start < 1000);
+    Esys_Free(sig);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    /* configuration comes from the test, not the environment */
+    unsetenv("TPM2_PKCS11_FAKE_TPM_LATENCY");
+    unsetenv("TPM2_PKCS11_FAKE_TPM_SLOTS");
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_fake_tpm_sign_verify, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_fake_tpm_object_slots, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_fake_tpm_latency, setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
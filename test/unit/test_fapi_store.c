@@ -0,0 +1,520 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <cmocka.h>
+
+#include <tss2/tss2_fapi.h>
+
+#include "attrs.h"
+#include "backend_fapi.h"
+#include "emitter.h"
+#include "object.h"
+#include "pkcs11.h"
+#include "token.h"
+#include "utils.h"
+
+#define TOKID 1
+
+/* the tests use the object store only, there is no FAPI keystore */
+TSS2_RC __wrap_Fapi_Initialize(FAPI_CONTEXT **context, char const *uri) {
+    UNUSED(uri);
+    *context = (FAPI_CONTEXT *)0xbadcc0de;
+    return TSS2_RC_SUCCESS;
+}
+
+void __wrap_Fapi_Finalize(FAPI_CONTEXT **context) {
+    *context = NULL;
+}
+
+typedef struct test_state test_state;
+struct test_state {
+    char dir[PATH_MAX];
+    token tok;
+};
+
+static void token_dir_path(test_state *s, const char *name, char *path) {
+
+    unsigned l = snprintf(path, PATH_MAX, "%s/token-%08x/%s", s->dir, TOKID, name);
+    assert_true(l < PATH_MAX);
+}
+
+static void id_path(test_state *s, unsigned id, char *path) {
+
+    char name[9];
+    snprintf(name, sizeof(name), "%08x", id);
+    token_dir_path(s, name, path);
+}
+
+static int setup(void **state) {
+
+    test_state *s = calloc(1, sizeof(*s));
+    assert_non_null(s);
+
+    snprintf(s->dir, sizeof(s->dir), "/tmp/tpm2-pkcs11-fapi-XXXXXX");
+    assert_non_null(mkdtemp(s->dir));
+
+    assert_int_equal(setenv("TPM2_PKCS11_FAPI_STORE", s->dir, 1), 0);
+    assert_int_equal(setenv("TPM2_PKCS11_FAPI_CACHE", "0", 1), 0);
+    assert_int_equal(setenv("TSS2_FAPICONF", "/nonexistent", 1), 0);
+
+    CK_RV rv = backend_fapi_init();
+    assert_int_equal(rv, CKR_OK);
+
+    s->tok.id = TOKID;
+    s->tok.type = token_type_fapi;
+
+    *state = s;
+    return 0;
+}
+
+static void tobjects_free(token *tok) {
+
+    list *cur = tok->tobjects.head ? &tok->tobjects.head->l : NULL;
+    while (cur) {
+        tobject *tobj = list_entry(cur, tobject, l);
+        cur = cur->next;
+        tobject_free(tobj);
+    }
+    tok->tobjects.head = tok->tobjects.tail = NULL;
+}
+
+/* removes the store, the token directories in it and their files */
+static void dir_remove(const char *dir) {
+
+    DIR *d = opendir(dir);
+    assert_non_null(d);
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+            continue;
+        }
+
+        char path[PATH_MAX];
+        unsigned l = snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        assert_true(l < sizeof(path));
+
+        struct stat sb;
+        assert_int_equal(lstat(path, &sb), 0);
+        if (S_ISDIR(sb.st_mode)) {
+            dir_remove(path);
+        } else {
+            assert_int_equal(unlink(path), 0);
+        }
+    }
+    closedir(d);
+
+    assert_int_equal(rmdir(dir), 0);
+}
+
+static int teardown(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    tobjects_free(&s->tok);
+
+    CK_RV rv = backend_fapi_destroy();
+    assert_int_equal(rv, CKR_OK);
+
+    dir_remove(s->dir);
+
+    unsetenv("TPM2_PKCS11_FAPI_STORE");
+    unsetenv("TPM2_PKCS11_FAPI_CACHE");
+    unsetenv("TSS2_FAPICONF");
+    free(s);
+
+    return 0;
+}
+
+static attr_list *attrs_new(const char *label) {
+
+    attr_list *attrs = attr_list_new();
+    assert_non_null(attrs);
+
+    assert_true(attr_list_add_int(attrs, CKA_CLASS, CKO_DATA));
+    assert_true(attr_list_add_buf(attrs, CKA_LABEL,
+            (CK_BYTE_PTR)label, strlen(label)));
+
+    return attrs;
+}
+
+static unsigned add(test_state *s, const char *label) {
+
+    tobject *tobj = tobject_new();
+    assert_non_null(tobj);
+    tobj->attrs = attrs_new(label);
+
+    CK_RV rv = backend_fapi_add_object(&s->tok, tobj);
+    assert_int_equal(rv, CKR_OK);
+
+    unsigned id = tobj->id;
+    assert_int_not_equal(id, 0);
+    tobject_free(tobj);
+
+    return id;
+}
+
+static void file_write(const char *path, const char *data) {
+
+    FILE *f = fopen(path, "w");
+    assert_non_null(f);
+    assert_true(fputs(data, f) >= 0);
+    assert_int_equal(fclose(f), 0);
+}
+
+static long file_size(const char *path) {
+
+    struct stat sb;
+    if (stat(path, &sb)) {
+        assert_int_equal(errno, ENOENT);
+        return -1;
+    }
+    return sb.st_size;
+}
+
+static void manifest_check(test_state *s, unsigned maxid) {
+
+    char path[PATH_MAX];
+    token_dir_path(s, "manifest", path);
+
+    char expected[32];
+    snprintf(expected, sizeof(expected), "1 %08x\n", maxid);
+
+    char got[32] = { 0 };
+    FILE *f = fopen(path, "r");
+    assert_non_null(f);
+    assert_non_null(fgets(got, sizeof(got), f));
+    fclose(f);
+
+    assert_string_equal(got, expected);
+}
+
+static void manifest_write(test_state *s, unsigned maxid) {
+
+    char path[PATH_MAX];
+    token_dir_path(s, "manifest", path);
+
+    char data[32];
+    snprintf(data, sizeof(data), "1 %08x\n", maxid);
+    file_write(path, data);
+}
+
+/* loads the objects of the token as a new process would */
+static void load(test_state *s) {
+
+    tobjects_free(&s->tok);
+
+    CK_RV rv = fapi_tobjects_load(&s->tok);
+    assert_int_equal(rv, CKR_OK);
+}
+
+/* checks the loaded objects, ids in order with their labels */
+static void loaded_check(test_state *s, const unsigned *ids,
+        const char **labels, size_t len) {
+
+    size_t i = 0;
+    list *cur = s->tok.tobjects.head ? &s->tok.tobjects.head->l : NULL;
+    while (cur) {
+        tobject *tobj = list_entry(cur, tobject, l);
+        cur = cur->next;
+
+        assert_true(i < len);
+        assert_int_equal(tobj->id, ids[i]);
+
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_LABEL);
+        assert_non_null(a);
+        assert_int_equal(a->ulValueLen, strlen(labels[i]));
+        assert_memory_equal(a->pValue, labels[i], a->ulValueLen);
+        i++;
+    }
+
+    assert_int_equal(i, len);
+}
+
+static void test_fapi_store_objects(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    /* each object goes to its own file, the manifest has the highest id */
+    assert_int_equal(add(s, "one"), 1);
+    assert_int_equal(add(s, "two"), 2);
+    manifest_check(s, 2);
+
+    char path[PATH_MAX];
+    id_path(s, 1, path);
+    assert_true(file_size(path) > 0);
+
+    load(s);
+    unsigned ids[] = { 1, 2 };
+    const char *labels[] = { "one", "two" };
+    loaded_check(s, ids, labels, ARRAY_LEN(ids));
+
+    /* an update only rewrites the file of the object */
+    tobject *one = s->tok.tobjects.head;
+    attr_list *attrs = attrs_new("uno");
+    CK_RV rv = backend_fapi_update_tobject_attrs(&s->tok, one, attrs);
+    attr_list_free(attrs);
+    assert_int_equal(rv, CKR_OK);
+
+    load(s);
+    const char *updated[] = { "uno", "two" };
+    loaded_check(s, ids, updated, ARRAY_LEN(ids));
+
+    /* the id of a removed object is not handed out again */
+    tobject *two = list_entry(s->tok.tobjects.head->l.next, tobject, l);
+    rv = backend_fapi_rm_tobject(&s->tok, two);
+    assert_int_equal(rv, CKR_OK);
+    id_path(s, 2, path);
+    assert_int_equal(file_size(path), -1);
+
+    assert_int_equal(add(s, "three"), 3);
+    manifest_check(s, 3);
+
+    load(s);
+    unsigned left[] = { 1, 3 };
+    const char *left_labels[] = { "uno", "three" };
+    loaded_check(s, left, left_labels, ARRAY_LEN(left));
+}
+
+static void test_fapi_store_claim_taken(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    assert_int_equal(add(s, "one"), 1);
+
+    /* another process wrote id 2 but the manifest does not say so yet */
+    char path[PATH_MAX];
+    id_path(s, 2, path);
+    file_write(path, "taken");
+    manifest_write(s, 1);
+
+    assert_int_equal(add(s, "three"), 3);
+    manifest_check(s, 3);
+
+    /* which is left alone */
+    assert_int_equal(file_size(path), strlen("taken"));
+
+    /* ids another process used and removed are skipped too */
+    manifest_write(s, 9);
+    assert_int_equal(add(s, "ten"), 10);
+    manifest_check(s, 10);
+}
+
+static void test_fapi_store_claim_pending(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    assert_int_equal(add(s, "one"), 1);
+
+    /* an add of another process that has not written its object yet */
+    unsigned id = 0;
+    CK_RV rv = fapi_tobject_id_claim(TOKID, &id);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(id, 2);
+
+    char path[PATH_MAX];
+    id_path(s, id, path);
+    assert_int_equal(file_size(path), 0);
+
+    /* does not keep the token from loading, nor its id from being claimed */
+    load(s);
+    unsigned ids[] = { 1 };
+    const char *labels[] = { "one" };
+    loaded_check(s, ids, labels, ARRAY_LEN(ids));
+
+    assert_int_equal(add(s, "three"), 3);
+}
+
+static void test_fapi_store_claim_concurrent(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    enum { PROCS = 4, ADDS = 25 };
+
+    /* processes adding objects at once each get ids of their own */
+    pid_t pids[PROCS];
+    unsigned i;
+    for (i = 0; i < PROCS; i++) {
+        pids[i] = fork();
+        assert_true(pids[i] >= 0);
+        if (pids[i]) {
+            continue;
+        }
+
+        unsigned j;
+        for (j = 0; j < ADDS; j++) {
+            tobject tobj = { .attrs = attrs_new("child") };
+            CK_RV rv = backend_fapi_add_object(&s->tok, &tobj);
+            attr_list_free(tobj.attrs);
+            if (rv != CKR_OK) {
+                _exit(1);
+            }
+        }
+        _exit(0);
+    }
+
+    for (i = 0; i < PROCS; i++) {
+        int status = 0;
+        assert_int_equal(waitpid(pids[i], &status, 0), pids[i]);
+        assert_true(WIFEXITED(status));
+        assert_int_equal(WEXITSTATUS(status), 0);
+    }
+
+    manifest_check(s, PROCS * ADDS);
+
+    load(s);
+    unsigned expected = 1;
+    list *cur = &s->tok.tobjects.head->l;
+    while (cur) {
+        tobject *tobj = list_entry(cur, tobject, l);
+        cur = cur->next;
+        assert_int_equal(tobj->id, expected++);
+    }
+    assert_int_equal(expected - 1, PROCS * ADDS);
+}
+
+/* builds SO seal appdata as older versions kept it, the salt then the objects */
+static size_t appdata_new(uint8_t *buf, size_t len, const unsigned *ids,
+        const char **labels, size_t count) {
+
+    const char salt[] = "0123456789abcdef";
+    size_t off = 0;
+
+    assert_true(sizeof(salt) <= len);
+    memcpy(buf, salt, sizeof(salt));
+    off += sizeof(salt);
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        attr_list *attrs = attrs_new(labels[i]);
+        char *yaml = emit_attributes_to_string(attrs);
+        attr_list_free(attrs);
+        assert_non_null(yaml);
+
+        int l = snprintf((char *)&buf[off], len - off, "%08x:%s", ids[i], yaml);
+        free(yaml);
+        assert_true(l > 0 && (size_t)l < len - off);
+        off += l + 1;
+    }
+
+    return off;
+}
+
+static void test_fapi_store_migrate(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    uint8_t appdata[4096];
+    unsigned ids[] = { 2, 5 };
+    const char *labels[] = { "two", "five" };
+    size_t len = appdata_new(appdata, sizeof(appdata), ids, labels, ARRAY_LEN(ids));
+
+    CK_RV rv = fapi_migrate_appdata(&s->tok, appdata, len);
+    assert_int_equal(rv, CKR_OK);
+    manifest_check(s, 5);
+
+    load(s);
+    loaded_check(s, ids, labels, ARRAY_LEN(ids));
+
+    /* new objects follow the copied ones */
+    assert_int_equal(add(s, "six"), 6);
+
+    /* once copied, the appdata is ignored */
+    tobject *two = s->tok.tobjects.head;
+    attr_list *attrs = attrs_new("deux");
+    rv = backend_fapi_update_tobject_attrs(&s->tok, two, attrs);
+    attr_list_free(attrs);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = fapi_migrate_appdata(&s->tok, appdata, len);
+    assert_int_equal(rv, CKR_OK);
+    manifest_check(s, 6);
+
+    load(s);
+    unsigned all[] = { 2, 5, 6 };
+    const char *all_labels[] = { "deux", "five", "six" };
+    loaded_check(s, all, all_labels, ARRAY_LEN(all));
+}
+
+static void test_fapi_store_migrate_empty(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    /* a token without objects has only the salt, nothing to copy */
+    uint8_t appdata[64];
+    size_t len = appdata_new(appdata, sizeof(appdata), NULL, NULL, 0);
+
+    CK_RV rv = fapi_migrate_appdata(&s->tok, appdata, len);
+    assert_int_equal(rv, CKR_OK);
+
+    char path[PATH_MAX];
+    token_dir_path(s, "manifest", path);
+    assert_int_equal(file_size(path), -1);
+
+    load(s);
+    assert_null(s->tok.tobjects.head);
+
+    assert_int_equal(add(s, "one"), 1);
+}
+
+static void test_fapi_store_migrate_bad(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    uint8_t appdata[4096];
+    unsigned ids[] = { 2 };
+    const char *labels[] = { "two" };
+    size_t len = appdata_new(appdata, sizeof(appdata), ids, labels, ARRAY_LEN(ids));
+
+    /* an object cut short */
+    const char cut[] = "00000003:";
+    memcpy(&appdata[len], cut, sizeof(cut));
+    len += sizeof(cut);
+
+    CK_RV rv = fapi_migrate_appdata(&s->tok, appdata, len);
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+
+    /* without a manifest the next load copies them again */
+    char path[PATH_MAX];
+    token_dir_path(s, "manifest", path);
+    assert_int_equal(file_size(path), -1);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_fapi_store_objects,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_fapi_store_claim_taken,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_fapi_store_claim_pending,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_fapi_store_claim_concurrent,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_fapi_store_migrate,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_fapi_store_migrate_empty,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_fapi_store_migrate_bad,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,391 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include <sqlite3.h>
+
+#include "backend.h"
+#include "db.h"
+#include "fake_token.h"
+#include "object.h"
+#include "pkcs11.h"
+#include "token.h"
+#include "utils.h"
+
+typedef struct test_state test_state;
+struct test_state {
+    fake_token ft;
+    CK_SESSION_HANDLE session;
+    sqlite3 *db;        /* a connection of its own to look at the rows */
+    CK_OBJECT_HANDLE yaml;  /* added before the token moved to the table */
+};
+
+static CK_OBJECT_HANDLE data_add(test_state *s, const char *label,
+        CK_BYTE value) {
+
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_BBOOL ck_true = CK_TRUE;
+    CK_BBOOL ck_false = CK_FALSE;
+
+    CK_ATTRIBUTE templ[] = {
+        { CKA_CLASS,   &clazz,        sizeof(clazz)    },
+        { CKA_TOKEN,   &ck_true,      sizeof(ck_true)  },
+        { CKA_PRIVATE, &ck_false,     sizeof(ck_false) },
+        { CKA_LABEL,   (void *)label, strlen(label)    },
+        { CKA_VALUE,   &value,        sizeof(value)    },
+    };
+
+    CK_OBJECT_HANDLE handle;
+    CK_RV rv = C_CreateObject(s->session, templ, ARRAY_LEN(templ), &handle);
+    assert_int_equal(rv, CKR_OK);
+
+    return handle;
+}
+
+/*
+ * A token with one object stored as YAML, as from before the table
+ * attribute store, that then moves to the table.
+ */
+static int setup(void **state) {
+
+    test_state *s = calloc(1, sizeof(*s));
+    assert_non_null(s);
+
+    fake_token_setup(&s->ft, CKF_OS_LOCKING_OK, NULL);
+
+    s->session = fake_token_login(&s->ft);
+    s->db = fake_token_db_open(&s->ft);
+
+    s->yaml = data_add(s, "yaml", 0x01);
+
+    s->ft.tok->config.attr_store = token_attr_store_table;
+    CK_RV rv = backend_update_token_config(s->ft.tok);
+    assert_int_equal(rv, CKR_OK);
+
+    *state = s;
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    assert_int_equal(sqlite3_close(s->db), SQLITE_OK);
+
+    CK_RV rv = C_CloseSession(s->session);
+    assert_int_equal(rv, CKR_OK);
+
+    fake_token_teardown(&s->ft);
+    free(s);
+
+    return 0;
+}
+
+static unsigned id_of(test_state *s, CK_OBJECT_HANDLE handle) {
+
+    tobject *tobj = NULL;
+    CK_RV rv = token_find_tobject(s->ft.tok, handle, &tobj);
+    assert_int_equal(rv, CKR_OK);
+    return tobj->id;
+}
+
+/* the candidates the store returns for a template */
+static size_t candidates(test_state *s, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        unsigned *out, size_t max) {
+
+    unsigned *ids = NULL;
+    size_t len = 0;
+    CK_RV rv = db_find_tobjects(s->ft.tok, templ, count, &ids, &len);
+    assert_int_equal(rv, CKR_OK);
+    assert_true(len <= max);
+
+    if (len) {
+        memcpy(out, ids, len * sizeof(*ids));
+    }
+    free(ids);
+
+    return len;
+}
+
+/* what the application finds for a template */
+static CK_ULONG find(test_state *s, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        CK_OBJECT_HANDLE *handle) {
+
+    CK_RV rv = C_FindObjectsInit(s->session, templ, count);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_OBJECT_HANDLE found[4];
+    CK_ULONG len = 0;
+    rv = C_FindObjects(s->session, found, ARRAY_LEN(found), &len);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_FindObjectsFinal(s->session);
+    assert_int_equal(rv, CKR_OK);
+
+    if (handle) {
+        *handle = len ? found[0] : CK_INVALID_HANDLE;
+    }
+
+    return len;
+}
+
+#define ALL_ROWS ((CK_ATTRIBUTE_TYPE)-1)
+
+/* the number of attribute rows of a tobject, of one type or ALL_ROWS */
+static int rows(test_state *s, unsigned id, CK_ATTRIBUTE_TYPE type) {
+
+    const char *sql = type == ALL_ROWS ?
+            "SELECT COUNT(*) FROM tobject_attrs WHERE tobject_id=?1;" :
+            "SELECT COUNT(*) FROM tobject_attrs WHERE tobject_id=?1 AND type=?2;";
+
+    sqlite3_stmt *stmt = NULL;
+    assert_int_equal(sqlite3_prepare_v2(s->db, sql, -1, &stmt, NULL), SQLITE_OK);
+    assert_int_equal(sqlite3_bind_int(stmt, 1, id), SQLITE_OK);
+    if (type != ALL_ROWS) {
+        assert_int_equal(sqlite3_bind_int64(stmt, 2, (sqlite3_int64)type), SQLITE_OK);
+    }
+    assert_int_equal(sqlite3_step(stmt), SQLITE_ROW);
+    int cnt = sqlite3_column_int(stmt, 0);
+    assert_int_equal(sqlite3_finalize(stmt), SQLITE_OK);
+
+    return cnt;
+}
+
+/* the CKA_LABEL row of a tobject */
+static void label_row(test_state *s, unsigned id, const char *expected) {
+
+    const char *sql =
+            "SELECT value FROM tobject_attrs WHERE tobject_id=? AND type=?;";
+
+    sqlite3_stmt *stmt = NULL;
+    assert_int_equal(sqlite3_prepare_v2(s->db, sql, -1, &stmt, NULL), SQLITE_OK);
+    assert_int_equal(sqlite3_bind_int(stmt, 1, id), SQLITE_OK);
+    assert_int_equal(sqlite3_bind_int64(stmt, 2, CKA_LABEL), SQLITE_OK);
+    assert_int_equal(sqlite3_step(stmt), SQLITE_ROW);
+
+    size_t len = strlen(expected);
+    assert_int_equal(sqlite3_column_bytes(stmt, 0), len);
+    assert_memory_equal(sqlite3_column_blob(stmt, 0), expected, len);
+    assert_int_equal(sqlite3_finalize(stmt), SQLITE_OK);
+}
+
+#define LABEL(l) { CKA_LABEL, (void *)(l), sizeof(l) - 1 }
+
+static void test_find_match(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_OBJECT_HANDLE a = data_add(s, "aaaa", 0x0a);
+    data_add(s, "bbbb", 0x0b);
+
+    /* the table objects are ruled out by the store, the YAML one is not */
+    CK_ATTRIBUTE templ[] = { LABEL("aaaa") };
+    unsigned ids[4];
+    size_t len = candidates(s, templ, ARRAY_LEN(templ), ids, ARRAY_LEN(ids));
+    assert_int_equal(len, 2);
+    assert_int_equal(ids[0], id_of(s, s->yaml));
+    assert_int_equal(ids[1], id_of(s, a));
+
+    CK_OBJECT_HANDLE found;
+    assert_int_equal(find(s, templ, ARRAY_LEN(templ), &found), 1);
+    assert_int_equal(found, a);
+
+    /* every pushed attribute has to match */
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_ATTRIBUTE both[] = {
+        LABEL("aaaa"),
+        { CKA_CLASS, &clazz, sizeof(clazz) },
+    };
+    len = candidates(s, both, ARRAY_LEN(both), ids, ARRAY_LEN(ids));
+    assert_int_equal(len, 2);
+    assert_int_equal(ids[1], id_of(s, a));
+
+    clazz = CKO_CERTIFICATE;
+    len = candidates(s, both, ARRAY_LEN(both), ids, ARRAY_LEN(ids));
+    assert_int_equal(len, 1);
+    assert_int_equal(find(s, both, ARRAY_LEN(both), NULL), 0);
+}
+
+static void test_find_no_match(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    data_add(s, "aaaa", 0x0a);
+
+    CK_ATTRIBUTE templ[] = { LABEL("zzzz") };
+    unsigned ids[4];
+    size_t len = candidates(s, templ, ARRAY_LEN(templ), ids, ARRAY_LEN(ids));
+    assert_int_equal(len, 1);
+    assert_int_equal(ids[0], id_of(s, s->yaml));
+
+    assert_int_equal(find(s, templ, ARRAY_LEN(templ), NULL), 0);
+}
+
+static void test_find_without_rows(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    /* the YAML object has no rows, it is a candidate of any search */
+    unsigned yaml_id = id_of(s, s->yaml);
+    assert_int_equal(rows(s, yaml_id, ALL_ROWS), 0);
+
+    CK_ATTRIBUTE other[] = { LABEL("aaaa") };
+    unsigned ids[4];
+    size_t len = candidates(s, other, ARRAY_LEN(other), ids, ARRAY_LEN(ids));
+    assert_int_equal(len, 1);
+    assert_int_equal(ids[0], yaml_id);
+    assert_int_equal(find(s, other, ARRAY_LEN(other), NULL), 0);
+
+    CK_ATTRIBUTE own[] = { LABEL("yaml") };
+    CK_OBJECT_HANDLE found;
+    assert_int_equal(find(s, own, ARRAY_LEN(own), &found), 1);
+    assert_int_equal(found, s->yaml);
+
+    /* as are objects another process added as YAML */
+    CK_OBJECT_HANDLE a = data_add(s, "aaaa", 0x0a);
+    char *sql = sqlite3_mprintf(
+            "INSERT INTO tobjects (tokid, attrs) "
+            "SELECT tokid, attrs FROM tobjects WHERE id=%u;", yaml_id);
+    assert_non_null(sql);
+    assert_int_equal(sqlite3_exec(s->db, sql, NULL, NULL, NULL), SQLITE_OK);
+    sqlite3_free(sql);
+
+    assert_int_equal(find(s, own, ARRAY_LEN(own), NULL), 2);
+    assert_int_equal(find(s, other, ARRAY_LEN(other), &found), 1);
+    assert_int_equal(found, a);
+
+    /* and both kinds are read back by the next process */
+    fake_token_reload(&s->ft, CKF_OS_LOCKING_OK);
+    s->session = fake_token_login(&s->ft);
+
+    assert_int_equal(find(s, own, ARRAY_LEN(own), NULL), 2);
+    assert_int_equal(find(s, other, ARRAY_LEN(other), NULL), 1);
+}
+
+static void test_find_value_not_pushed(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_OBJECT_HANDLE a = data_add(s, "aaaa", 0x0a);
+    data_add(s, "bbbb", 0x0b);
+
+    /* with nothing but CKA_VALUE the store has nothing to search with */
+    CK_BYTE value = 0x0a;
+    CK_ATTRIBUTE only[] = {
+        { CKA_VALUE, &value, sizeof(value) },
+    };
+    unsigned *ids = NULL;
+    size_t len = 0;
+    CK_RV rv = db_find_tobjects(s->ft.tok, only, ARRAY_LEN(only), &ids, &len);
+    assert_int_equal(rv, CKR_FUNCTION_NOT_SUPPORTED);
+    assert_null(ids);
+
+    CK_OBJECT_HANDLE found;
+    assert_int_equal(find(s, only, ARRAY_LEN(only), &found), 1);
+    assert_int_equal(found, a);
+
+    /* next to another attribute it is left to the in memory match */
+    value = 0x0b;
+    CK_ATTRIBUTE mixed[] = {
+        LABEL("aaaa"),
+        { CKA_VALUE, &value, sizeof(value) },
+    };
+    unsigned cand[4];
+    len = candidates(s, mixed, ARRAY_LEN(mixed), cand, ARRAY_LEN(cand));
+    assert_int_equal(len, 2);
+    assert_int_equal(cand[1], id_of(s, a));
+    assert_int_equal(find(s, mixed, ARRAY_LEN(mixed), NULL), 0);
+
+    value = 0x0a;
+    assert_int_equal(find(s, mixed, ARRAY_LEN(mixed), &found), 1);
+    assert_int_equal(found, a);
+}
+
+static void test_find_rows_updated(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_OBJECT_HANDLE a = data_add(s, "aaaa", 0x0a);
+    unsigned id = id_of(s, a);
+    label_row(s, id, "aaaa");
+
+    CK_ATTRIBUTE templ[] = { LABEL("cccc") };
+    CK_RV rv = C_SetAttributeValue(s->session, a, templ, ARRAY_LEN(templ));
+    assert_int_equal(rv, CKR_OK);
+    label_row(s, id, "cccc");
+    assert_int_equal(rows(s, id, CKA_LABEL), 1);
+
+    CK_ATTRIBUTE old[] = { LABEL("aaaa") };
+    unsigned ids[4];
+    assert_int_equal(candidates(s, old, ARRAY_LEN(old), ids, ARRAY_LEN(ids)), 1);
+    assert_int_equal(find(s, old, ARRAY_LEN(old), NULL), 0);
+
+    CK_OBJECT_HANDLE found;
+    assert_int_equal(candidates(s, templ, ARRAY_LEN(templ), ids, ARRAY_LEN(ids)), 2);
+    assert_int_equal(find(s, templ, ARRAY_LEN(templ), &found), 1);
+    assert_int_equal(found, a);
+
+    /* a YAML object that is written moves to the rows as a whole */
+    unsigned yaml_id = id_of(s, s->yaml);
+    CK_ATTRIBUTE renamed[] = { LABEL("dddd") };
+    rv = C_SetAttributeValue(s->session, s->yaml, renamed, ARRAY_LEN(renamed));
+    assert_int_equal(rv, CKR_OK);
+
+    label_row(s, yaml_id, "dddd");
+    assert_int_equal(rows(s, yaml_id, CKA_CLASS), 1);
+    assert_int_equal(candidates(s, old, ARRAY_LEN(old), ids, ARRAY_LEN(ids)), 0);
+    assert_int_equal(candidates(s, renamed, ARRAY_LEN(renamed), ids, ARRAY_LEN(ids)), 1);
+    assert_int_equal(ids[0], yaml_id);
+}
+
+static void test_find_rows_deleted(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_OBJECT_HANDLE a = data_add(s, "aaaa", 0x0a);
+    CK_OBJECT_HANDLE b = data_add(s, "bbbb", 0x0b);
+    unsigned a_id = id_of(s, a);
+    unsigned b_id = id_of(s, b);
+    assert_true(rows(s, a_id, ALL_ROWS) > 0);
+
+    CK_RV rv = C_DestroyObject(s->session, a);
+    assert_int_equal(rv, CKR_OK);
+
+    assert_int_equal(rows(s, a_id, ALL_ROWS), 0);
+    assert_true(rows(s, b_id, ALL_ROWS) > 0);
+
+    CK_ATTRIBUTE templ[] = { LABEL("aaaa") };
+    unsigned ids[4];
+    assert_int_equal(candidates(s, templ, ARRAY_LEN(templ), ids, ARRAY_LEN(ids)), 1);
+    assert_int_equal(find(s, templ, ARRAY_LEN(templ), NULL), 0);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_find_match,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_find_no_match,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_find_without_rows,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_find_value_not_pushed,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_find_rows_updated,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_find_rows_deleted,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "attrs.h"
+#include "backend.h"
+#include "fake_tpm.h"
+#include "fake_token.h"
+#include "keypool.h"
+#include "tpm.h"
+#include "utils.h"
+
+/* how long a test waits for the worker before it gives up */
+#define WAIT_MS (10 * 1000)
+
+static void test_keypool_spec_parse(void **state) {
+    (void) state;
+
+    keypool_spec spec;
+    bool res = keypool_spec_parse("rsa1024/sign+decrypt:0:1, p521/decrypt:3:3", &spec);
+    assert_true(res);
+    assert_int_equal(spec.len, 2);
+    assert_int_equal(spec.kinds[0].mech, CKM_RSA_PKCS_KEY_PAIR_GEN);
+    assert_int_equal(spec.kinds[0].bits, 1024);
+    assert_int_equal(spec.kinds[0].usage, keypool_usage_sign | keypool_usage_decrypt);
+    assert_int_equal(spec.kinds[0].low, 0);
+    assert_int_equal(spec.kinds[0].high, 1);
+    assert_int_equal(spec.kinds[1].mech, CKM_EC_KEY_PAIR_GEN);
+    assert_int_equal(spec.kinds[1].usage, keypool_usage_decrypt);
+}
+
+static void test_keypool_spec_parse_bad(void **state) {
+    (void) state;
+
+    static const char *bad_specs[] = {
+        "",
+        "rsa4096:1:2",
+        "rsa2048:2",
+        "rsa2048:2:8:9",
+        "rsa2048:8:2",
+        "rsa2048:0:0",
+        "rsa2048:x:2",
+        "rsa2048:1:100000",
+        "p256/wrap:1:2",
+        "p256:1:2,p256:2:4",
+    };
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(bad_specs); i++) {
+        keypool_spec spec;
+        bool res = keypool_spec_parse(bad_specs[i], &spec);
+        assert_false(res);
+    }
+}
+
+typedef struct test_state test_state;
+struct test_state {
+    fake_token ft;
+    twist template;     /* the template of the p256 keys in the pool */
+};
+
+static int setup(void **state) {
+
+    /* the worker starts on a key as soon as it is woken */
+    assert_int_equal(setenv("TPM2_PKCS11_KEYPOOL_IDLE_MS", "0", 1), 0);
+
+    test_state *s = calloc(1, sizeof(*s));
+    assert_non_null(s);
+
+    fake_token_setup(&s->ft, CKF_OS_LOCKING_OK, NULL);
+
+    s->ft.tok->config.key_pool = strdup("p256:1:2");
+    assert_non_null(s->ft.tok->config.key_pool);
+
+    /* prime256v1, as an application would ask for it */
+    static CK_BYTE params[] = {
+        0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07
+    };
+
+    attr_list *pubattrs = attr_list_new();
+    attr_list *privattrs = attr_list_new();
+    assert_non_null(pubattrs);
+    assert_non_null(privattrs);
+    assert_true(attr_list_add_buf(pubattrs, CKA_EC_PARAMS, params, sizeof(params)));
+
+    CK_MECHANISM mechanism = { .mechanism = CKM_EC_KEY_PAIR_GEN };
+    CK_RV rv = tpm2_keygen_template(&mechanism, pubattrs, privattrs, &s->template);
+    assert_int_equal(rv, CKR_OK);
+
+    attr_list_free(pubattrs);
+    attr_list_free(privattrs);
+
+    *state = s;
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    fake_token_teardown(&s->ft);
+    twist_free(s->template);
+    free(s);
+
+    unsetenv("TPM2_PKCS11_KEYPOOL_IDLE_MS");
+
+    return 0;
+}
+
+static unsigned pool_count(test_state *s) {
+
+    unsigned count = 0;
+    CK_RV rv = backend_keypool_count(s->ft.tok, s->template, &count);
+    assert_int_equal(rv, CKR_OK);
+    return count;
+}
+
+/* waits for the worker to bring the pool to count keys */
+static void wait_for_count(test_state *s, unsigned count) {
+
+    unsigned waited;
+    for (waited = 0; waited < WAIT_MS; waited += 10) {
+        if (pool_count(s) >= count) {
+            return;
+        }
+        fake_token_sleep_ms(10);
+    }
+
+    fail_msg("Key pool stayed below %u keys", count);
+}
+
+static void test_keypool_fills_after_login(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    assert_int_equal(pool_count(s), 0);
+
+    CK_SESSION_HANDLE session = fake_token_login(&s->ft);
+    assert_non_null(s->ft.tok->keypool);
+
+    wait_for_count(s, 2);
+
+    CK_RV rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_keypool_logout_pauses(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_SESSION_HANDLE session = fake_token_login(&s->ft);
+    wait_for_count(s, 2);
+
+    CK_RV rv = C_Logout(session);
+    assert_int_equal(rv, CKR_OK);
+
+    /* take the pool below low, a logged in worker would refill it */
+    twist pubblob = NULL;
+    twist privblob = NULL;
+    twist objauth = NULL;
+    unsigned i;
+    for (i = 0; i < 2; i++) {
+        rv = backend_keypool_claim(s->ft.tok, s->template, &pubblob, &privblob, &objauth);
+        assert_int_equal(rv, CKR_OK);
+        assert_non_null(pubblob);
+        twist_free(pubblob);
+        twist_free(privblob);
+        twist_free(objauth);
+    }
+    keypool_touch(s->ft.tok->keypool);
+
+    fake_token_sleep_ms(200);
+    assert_int_equal(pool_count(s), 0);
+
+    /* and logging in again resumes it */
+    CK_SESSION_HANDLE session2 = fake_token_login(&s->ft);
+    wait_for_count(s, 2);
+
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+    rv = C_CloseSession(session2);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_keypool_reset_joins_worker(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    /* slow key creation, so the reset lands while the worker is in one */
+    s->ft.tok->config.key_pool[strlen("p256:1:")] = '8';
+    assert_true(fake_tpm_set_latency_spec("Create=50ms,CreateLoaded=50ms"));
+
+    CK_SESSION_HANDLE session = fake_token_login(&s->ft);
+    wait_for_count(s, 1);
+
+    /*
+     * C_InitToken resets the token under its lock, freeing the primary
+     * object the worker creates keys under. The worker must be gone by then.
+     */
+    token_lock(s->ft.tok);
+    token_reset(s->ft.tok);
+    assert_null(s->ft.tok->keypool);
+    token_unlock(s->ft.tok);
+
+    unsigned count = pool_count(s);
+    fake_token_sleep_ms(200);
+    assert_int_equal(pool_count(s), count);
+
+    CK_RV rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_keypool_spec_parse),
+        cmocka_unit_test(test_keypool_spec_parse_bad),
+        cmocka_unit_test_setup_teardown(test_keypool_fills_after_login,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_keypool_logout_pauses,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_keypool_reset_joins_worker,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,365 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include <cmocka.h>
+
+#include "backend.h"
+#include "fake_tpm.h"
+#include "fake_token.h"
+#include "login_cache.h"
+#include "pkcs11.h"
+#include "twist.h"
+#include "utils.h"
+
+/* keeps the cache tests that call it directly quick */
+#define CHEAP_PIN_KDF "scrypt:ln=10,r=8,p=1"
+
+static const char wrappingkey[] = "0123456789abcdef0123456789abcdef";
+
+static int setup(void **state) {
+
+    fake_token *ft = calloc(1, sizeof(*ft));
+    assert_non_null(ft);
+
+    fake_token_setup(ft, CKF_OS_LOCKING_OK, NULL);
+
+    *state = ft;
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    fake_token_teardown(ft);
+    free(ft);
+
+    return 0;
+}
+
+static bool verifier_matches(token *tok, const char *pin) {
+
+    twist tpin = twist_new(pin);
+    assert_non_null(tpin);
+
+    bool match = utils_pin_verifier_check(&tok->user_verifier, tpin);
+    twist_free(tpin);
+
+    return match;
+}
+
+/* a session keyring of its own, so no test sees the entries of another */
+static void session_keyring_new(void) {
+
+#if defined(__linux__) && defined(SYS_keyctl)
+    long serial = syscall(SYS_keyctl, KEYCTL_JOIN_SESSION_KEYRING, NULL);
+    if (serial < 0) {
+        skip();
+    }
+#else
+    skip();
+#endif
+}
+
+static twist cache_put(const char *id, const char *pin, const char *kdf,
+        unsigned ttl) {
+
+    twist tid = twist_new(id);
+    twist tpin = twist_new(pin);
+    twist twk = twistbin_new(wrappingkey, sizeof(wrappingkey) - 1);
+    assert_non_null(tid);
+    assert_non_null(tpin);
+    assert_non_null(twk);
+
+    login_cache_put(tid, tpin, kdf, twk, ttl);
+
+    twist_free(tid);
+    twist_free(tpin);
+
+    return twk;
+}
+
+static bool cache_get(const char *id, const char *pin, twist *wk) {
+
+    twist tid = twist_new(id);
+    twist tpin = twist_new(pin);
+    assert_non_null(tid);
+    assert_non_null(tpin);
+
+    bool hit = login_cache_get(tid, tpin, wk);
+
+    twist_free(tid);
+    twist_free(tpin);
+
+    assert_true(hit == (*wk != NULL));
+    return hit;
+}
+
+static CK_OBJECT_HANDLE always_auth_key(CK_SESSION_HANDLE session) {
+
+    /* prime256v1 */
+    CK_BYTE params[] = {
+        0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07
+    };
+    CK_BBOOL ck_true = CK_TRUE;
+
+    CK_ATTRIBUTE pub[] = {
+        { CKA_EC_PARAMS, params,   sizeof(params)  },
+        { CKA_VERIFY,    &ck_true, sizeof(ck_true) },
+    };
+
+    CK_ATTRIBUTE priv[] = {
+        { CKA_SIGN,                &ck_true, sizeof(ck_true) },
+        { CKA_ALWAYS_AUTHENTICATE, &ck_true, sizeof(ck_true) },
+    };
+
+    CK_MECHANISM mechanism = { .mechanism = CKM_EC_KEY_PAIR_GEN };
+    CK_OBJECT_HANDLE pubkey;
+    CK_OBJECT_HANDLE privkey;
+    CK_RV rv = C_GenerateKeyPair(session, &mechanism,
+            pub, ARRAY_LEN(pub), priv, ARRAY_LEN(priv), &pubkey, &privkey);
+    assert_int_equal(rv, CKR_OK);
+
+    return privkey;
+}
+
+static void test_login_verifier_set_and_cleared(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    assert_false(ft->tok->user_verifier.is_set);
+
+    CK_SESSION_HANDLE session = fake_token_login(ft);
+
+    assert_true(ft->tok->user_verifier.is_set);
+    assert_true(verifier_matches(ft->tok, FAKE_TOKEN_USERPIN));
+    assert_false(verifier_matches(ft->tok, FAKE_TOKEN_SOPIN));
+
+    CK_RV rv = C_Logout(session);
+    assert_int_equal(rv, CKR_OK);
+
+    assert_false(ft->tok->user_verifier.is_set);
+
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_login_verifier_set_pin(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    CK_SESSION_HANDLE session = fake_token_login(ft);
+
+    static const char newpin[] = "mynewuserpin";
+    CK_RV rv = C_SetPIN(session,
+            (CK_UTF8CHAR_PTR)FAKE_TOKEN_USERPIN, strlen(FAKE_TOKEN_USERPIN),
+            (CK_UTF8CHAR_PTR)newpin, strlen(newpin));
+    assert_int_equal(rv, CKR_OK);
+
+    /* the old PIN no longer passes a context specific login */
+    assert_true(ft->tok->user_verifier.is_set);
+    assert_false(verifier_matches(ft->tok, FAKE_TOKEN_USERPIN));
+    assert_true(verifier_matches(ft->tok, newpin));
+
+    rv = C_Logout(session);
+    assert_int_equal(rv, CKR_OK);
+    assert_false(ft->tok->user_verifier.is_set);
+
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_login_context_specific(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    CK_SESSION_HANDLE session = fake_token_login(ft);
+    CK_OBJECT_HANDLE key = always_auth_key(session);
+
+    CK_MECHANISM mechanism = { .mechanism = CKM_ECDSA };
+    CK_RV rv = C_SignInit(session, &mechanism, key);
+    assert_int_equal(rv, CKR_OK);
+
+    uint64_t unseals = fake_tpm_cc_count(TPM2_CC_Unseal);
+
+    static const char badpin[] = "notmyuserpin";
+    rv = C_Login(session, CKU_CONTEXT_SPECIFIC,
+            (CK_UTF8CHAR_PTR)badpin, strlen(badpin));
+    assert_int_equal(rv, CKR_PIN_INCORRECT);
+
+    rv = C_Login(session, CKU_CONTEXT_SPECIFIC,
+            (CK_UTF8CHAR_PTR)FAKE_TOKEN_USERPIN, strlen(FAKE_TOKEN_USERPIN));
+    assert_int_equal(rv, CKR_OK);
+
+    /* both were checked against the verifier, not the TPM */
+    assert_int_equal(fake_tpm_cc_count(TPM2_CC_Unseal), unseals);
+
+    CK_BYTE digest[32];
+    memset(digest, 0x5a, sizeof(digest));
+    CK_BYTE sig[64];
+    CK_ULONG siglen = sizeof(sig);
+    rv = C_Sign(session, digest, sizeof(digest), sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_login_cache_hit(void **state) {
+    UNUSED(state);
+
+    session_keyring_new();
+
+    twist put = cache_put("token0", FAKE_TOKEN_USERPIN, CHEAP_PIN_KDF, 60);
+
+    twist got = NULL;
+    assert_true(cache_get("token0", FAKE_TOKEN_USERPIN, &got));
+    assert_int_equal(twist_len(got), twist_len(put));
+    assert_memory_equal(got, put, twist_len(put));
+    twist_free(got);
+    twist_free(put);
+
+    /* a token still on the sha256 KDF gets scrypt here */
+    put = cache_put("token1", FAKE_TOKEN_USERPIN, "sha256", 60);
+
+    assert_true(cache_get("token1", FAKE_TOKEN_USERPIN, &got));
+    assert_memory_equal(got, put, twist_len(put));
+    twist_free(got);
+    twist_free(put);
+}
+
+static void test_login_cache_miss(void **state) {
+    UNUSED(state);
+
+    session_keyring_new();
+
+    twist got = NULL;
+    assert_false(cache_get("token0", FAKE_TOKEN_USERPIN, &got));
+
+    twist put = cache_put("token0", FAKE_TOKEN_USERPIN, CHEAP_PIN_KDF, 60);
+    twist_free(put);
+
+    /* the wrong PIN fails the tag check, another token has no entry */
+    assert_false(cache_get("token0", FAKE_TOKEN_SOPIN, &got));
+    assert_false(cache_get("token1", FAKE_TOKEN_USERPIN, &got));
+
+    assert_true(cache_get("token0", FAKE_TOKEN_USERPIN, &got));
+    twist_free(got);
+}
+
+static void test_login_cache_expires(void **state) {
+    UNUSED(state);
+
+    session_keyring_new();
+
+    twist put = cache_put("token0", FAKE_TOKEN_USERPIN, CHEAP_PIN_KDF, 1);
+    twist_free(put);
+
+    sleep(2);
+
+    twist got = NULL;
+    assert_false(cache_get("token0", FAKE_TOKEN_USERPIN, &got));
+}
+
+static void test_login_cache_skips_tpm(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    session_keyring_new();
+
+    ft->tok->config.login_cache_ttl = 60;
+    CK_RV rv = backend_update_token_config(ft->tok);
+    assert_int_equal(rv, CKR_OK);
+
+    /* the first login unseals the wrapping key and caches it */
+    uint64_t unseals = fake_tpm_cc_count(TPM2_CC_Unseal);
+
+    CK_SESSION_HANDLE session = fake_token_login(ft);
+    assert_int_equal(fake_tpm_cc_count(TPM2_CC_Unseal), unseals + 1);
+
+    rv = C_Logout(session);
+    assert_int_equal(rv, CKR_OK);
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+
+    /* the next process of the session finds it */
+    fake_token_reload(ft, CKF_OS_LOCKING_OK);
+    assert_int_equal(ft->tok->config.login_cache_ttl, 60);
+
+    rv = C_OpenSession(ft->slot, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+            NULL, NULL, &session);
+    assert_int_equal(rv, CKR_OK);
+
+    uint64_t commands = fake_tpm_command_count();
+    uint64_t sessions = fake_tpm_cc_count(TPM2_CC_StartAuthSession);
+
+    rv = C_Login(session, CKU_USER,
+            (CK_UTF8CHAR_PTR)FAKE_TOKEN_USERPIN, strlen(FAKE_TOKEN_USERPIN));
+    assert_int_equal(rv, CKR_OK);
+
+    /* no unseal, nor the primary object or auth session it would need */
+    assert_int_equal(fake_tpm_command_count(), commands);
+    assert_non_null(ft->tok->wrappingkey);
+    assert_true(ft->tok->user_verifier.is_set);
+
+    /* the first operation on the TPM brings them up */
+    CK_OBJECT_HANDLE key = always_auth_key(session);
+    assert_int_equal(fake_tpm_cc_count(TPM2_CC_StartAuthSession), sessions + 1);
+
+    CK_MECHANISM mechanism = { .mechanism = CKM_ECDSA };
+    rv = C_SignInit(session, &mechanism, key);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_Login(session, CKU_CONTEXT_SPECIFIC,
+            (CK_UTF8CHAR_PTR)FAKE_TOKEN_USERPIN, strlen(FAKE_TOKEN_USERPIN));
+    assert_int_equal(rv, CKR_OK);
+
+    CK_BYTE digest[32];
+    memset(digest, 0x5a, sizeof(digest));
+    CK_BYTE sig[64];
+    CK_ULONG siglen = sizeof(sig);
+    rv = C_Sign(session, digest, sizeof(digest), sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+
+    assert_int_equal(fake_tpm_cc_count(TPM2_CC_Unseal), unseals + 1);
+    assert_int_equal(fake_tpm_cc_count(TPM2_CC_StartAuthSession), sessions + 1);
+
+    rv = C_Logout(session);
+    assert_int_equal(rv, CKR_OK);
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_login_verifier_set_and_cleared,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_login_verifier_set_pin,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_login_context_specific,
+                setup, teardown),
+        cmocka_unit_test(test_login_cache_hit),
+        cmocka_unit_test(test_login_cache_miss),
+        cmocka_unit_test(test_login_cache_expires),
+        cmocka_unit_test_setup_teardown(test_login_cache_skips_tpm,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
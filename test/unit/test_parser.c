@@ -270,6 +270,89 @@ static void test_token_config_parser_missing_tags(void **state) {
     assert_false(res);
 }
 
+static void check_durability(token_config *conf) {
+    assert_int_equal(conf->durability, token_durability_batch);
+}
+
+static void check_attr_store(token_config *conf) {
+    assert_int_equal(conf->attr_store, token_attr_store_table);
+}
+
+static void check_context_login(token_config *conf) {
+    assert_int_equal(conf->context_login, token_context_login_tpm);
+}
+
+static void check_login_cache_ttl(token_config *conf) {
+    assert_int_equal(conf->login_cache_ttl, 300);
+}
+
+static void check_prewarm(token_config *conf) {
+    assert_string_equal(conf->prewarm, "3,tls-server");
+}
+
+static void check_pin_kdf(token_config *conf) {
+    assert_string_equal(conf->pin_kdf, "scrypt:ln=16,r=8,p=1");
+}
+
+static void check_key_pool(token_config *conf) {
+    assert_string_equal(conf->key_pool, "rsa2048:2:8,p256/sign:4:16");
+}
+
+typedef struct config_key_test config_key_test;
+struct config_key_test {
+    const char *key;
+    const char *tag;    /* the YAML tag of the values */
+    const char *good;
+    const char *bad;
+    void (*check)(token_config *conf);
+};
+
+static bool parse_config_key(const config_key_test *t, const char *value,
+        token_config *conf) {
+
+    char yaml_config[256];
+    int len = snprintf(yaml_config, sizeof(yaml_config),
+        "---\n"
+        "!!map {\n"
+            "? !!str \"token-init\"\n"
+            ": !!bool \"true\",\n"
+            "? !!str \"%s\"\n"
+            ": !!%s \"%s\",\n"
+        "}\n", t->key, t->tag, value);
+    assert_true(len > 0 && (size_t)len < sizeof(yaml_config));
+
+    return parse_token_config_from_string((const unsigned char *)yaml_config,
+            len, conf);
+}
+
+static void test_token_config_parser_keys(void **state) {
+    (void) state;
+
+    static const config_key_test tests[] = {
+        { "durability",      "str", "batch",                      "sometimes",    check_durability      },
+        { "attr-store",      "str", "table",                      "json",         check_attr_store      },
+        { "context-login",   "str", "tpm",                        "never",        check_context_login   },
+        { "login-cache-ttl", "int", "300",                        "99999999999",  check_login_cache_ttl },
+        { "prewarm",         "str", "3,tls-server",               "a,,b",         check_prewarm         },
+        { "pin-kdf",         "str", "scrypt:ln=16,r=8,p=1",       "scrypt:ln=4",  check_pin_kdf         },
+        { "key-pool",        "str", "rsa2048:2:8,p256/sign:4:16", "rsa2048:8:2",  check_key_pool        },
+    };
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(tests); i++) {
+        token_config conf = {0};
+        bool res = parse_config_key(&tests[i], tests[i].good, &conf);
+        assert_true(res);
+        tests[i].check(&conf);
+        token_config_free(&conf);
+
+        token_config bad = {0};
+        res = parse_config_key(&tests[i], tests[i].bad, &bad);
+        assert_false(res);
+        token_config_free(&bad);
+    }
+}
+
 int main(int argc, char* argv[]) {
     (void) argc;
     (void) argv;
@@ -280,6 +363,7 @@ int main(int argc, char* argv[]) {
         cmocka_unit_test(test_config_parser_good),
         cmocka_unit_test(test_token_config_parser_no_tags),
         cmocka_unit_test(test_token_config_parser_missing_tags),
+        cmocka_unit_test(test_token_config_parser_keys),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,246 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "attrs.h"
+#include "fake_tpm.h"
+#include "fake_token.h"
+#include "object.h"
+#include "pkcs11.h"
+#include "tpm.h"
+#include "twist.h"
+#include "utils.h"
+
+/* where the tests pin keys, as tpm2_ptool persist would */
+#define PERSISTENT_HANDLE 0x81000010
+
+typedef struct test_state test_state;
+struct test_state {
+    fake_token ft;
+    CK_SESSION_HANDLE session;
+    tobject *key;       /* the private key the tests pin */
+    CK_OBJECT_HANDLE key_pub;
+    tobject *other;     /* a second private key */
+};
+
+static tobject *key_add(test_state *s, CK_OBJECT_HANDLE *pubkey) {
+
+    /* prime256v1 */
+    CK_BYTE params[] = {
+        0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07
+    };
+    CK_BBOOL ck_true = CK_TRUE;
+
+    CK_ATTRIBUTE pub[] = {
+        { CKA_EC_PARAMS, params,   sizeof(params)  },
+        { CKA_VERIFY,    &ck_true, sizeof(ck_true) },
+    };
+
+    CK_ATTRIBUTE priv[] = {
+        { CKA_SIGN, &ck_true, sizeof(ck_true) },
+    };
+
+    CK_MECHANISM mechanism = { .mechanism = CKM_EC_KEY_PAIR_GEN };
+    CK_OBJECT_HANDLE privkey;
+    CK_RV rv = C_GenerateKeyPair(s->session, &mechanism,
+            pub, ARRAY_LEN(pub), priv, ARRAY_LEN(priv), pubkey, &privkey);
+    assert_int_equal(rv, CKR_OK);
+
+    tobject *tobj = NULL;
+    rv = token_find_tobject(s->ft.tok, privkey, &tobj);
+    assert_int_equal(rv, CKR_OK);
+
+    return tobj;
+}
+
+static int setup(void **state) {
+
+    test_state *s = calloc(1, sizeof(*s));
+    assert_non_null(s);
+
+    fake_token_setup(&s->ft, CKF_OS_LOCKING_OK, NULL);
+
+    s->session = fake_token_login(&s->ft);
+    s->key = key_add(s, &s->key_pub);
+
+    CK_OBJECT_HANDLE other_pub;
+    s->other = key_add(s, &other_pub);
+
+    *state = s;
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_RV rv = C_CloseSession(s->session);
+    assert_int_equal(rv, CKR_OK);
+
+    fake_token_teardown(&s->ft);
+    free(s);
+
+    return 0;
+}
+
+/* drops the key from the TPM as a logout does */
+static void unload(test_state *s, tobject *tobj) {
+
+    tpm_ctx *tpm = s->ft.tok->tctx;
+
+    if (tobj->tpm_handle) {
+        bool result = tobj->tpm_handle_persistent ?
+                tpm_closehandle(tpm, tobj->tpm_handle) :
+                tpm_flushcontext(tpm, tobj->tpm_handle);
+        assert_true(result);
+        tobj->tpm_handle = 0;
+        tobj->tpm_handle_persistent = false;
+    }
+
+    twist_free(tobj->unsealed_auth);
+    tobj->unsealed_auth = NULL;
+}
+
+/*
+ * Makes a copy of the key persistent at handle and, if record is set,
+ * records the ESYS_TR of it on the key, as tpm2_ptool persist does.
+ */
+static void persist(test_state *s, tobject *tobj, bool record) {
+
+    token *tok = s->ft.tok;
+
+    uint32_t handle = 0;
+    CK_RV rv = tpm_loadobj(tok->tctx, tobj->id,
+            tok->pobject.handle, tok->pobject.objauth,
+            tobj->pub, tobj->priv, &handle);
+    assert_int_equal(rv, CKR_OK);
+
+    uint8_t *blob = NULL;
+    size_t blob_len = 0;
+    assert_true(fake_tpm_persist(handle, PERSISTENT_HANDLE, &blob, &blob_len));
+    assert_true(tpm_flushcontext(tok->tctx, handle));
+
+    if (record) {
+        CK_ATTRIBUTE a = { CKA_TPM2_PERSISTENT_TR, blob, blob_len };
+        rv = attr_list_append_entry(&tobj->attrs, &a);
+        assert_int_equal(rv, CKR_OK);
+    }
+
+    free(blob);
+}
+
+static void load(test_state *s, tobject *tobj) {
+
+    token *tok = s->ft.tok;
+
+    unload(s, tobj);
+
+    token_lock(tok);
+    tobject *loaded = NULL;
+    CK_RV rv = token_load_object(tok, tobj->obj_handle, &loaded);
+    token_unlock(tok);
+
+    assert_int_equal(rv, CKR_OK);
+    assert_ptr_equal(loaded, tobj);
+    assert_int_not_equal(tobj->tpm_handle, 0);
+    assert_non_null(tobj->unsealed_auth);
+}
+
+/* signs with the key and checks the signature with its public half */
+static void sign_verify(test_state *s) {
+
+    CK_BYTE digest[32];
+    memset(digest, 0x5a, sizeof(digest));
+    CK_BYTE sig[64];
+    CK_ULONG siglen = sizeof(sig);
+
+    CK_MECHANISM mechanism = { .mechanism = CKM_ECDSA };
+    CK_RV rv = C_SignInit(s->session, &mechanism, s->key->obj_handle);
+    assert_int_equal(rv, CKR_OK);
+    rv = C_Sign(s->session, digest, sizeof(digest), sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_VerifyInit(s->session, &mechanism, s->key_pub);
+    assert_int_equal(rv, CKR_OK);
+    rv = C_Verify(s->session, digest, sizeof(digest), sig, siglen);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_persistent_hit(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    persist(s, s->key, true);
+
+    uint64_t loads = fake_tpm_cc_count(TPM2_CC_Load);
+    uint64_t reads = fake_tpm_cc_count(TPM2_CC_ReadPublic);
+    load(s, s->key);
+
+    /* the handle is used after checking it holds the key */
+    assert_true(s->key->tpm_handle_persistent);
+    assert_int_equal(fake_tpm_cc_count(TPM2_CC_Load), loads);
+    assert_int_equal(fake_tpm_cc_count(TPM2_CC_ReadPublic), reads + 1);
+
+    sign_verify(s);
+    assert_int_equal(fake_tpm_cc_count(TPM2_CC_Load), loads);
+}
+
+static void test_persistent_gone(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    persist(s, s->key, true);
+    assert_true(fake_tpm_evict(PERSISTENT_HANDLE));
+
+    uint64_t loads = fake_tpm_cc_count(TPM2_CC_Load);
+    load(s, s->key);
+
+    /* evicted since it was recorded, the key is loaded instead */
+    assert_false(s->key->tpm_handle_persistent);
+    assert_int_equal(fake_tpm_cc_count(TPM2_CC_Load), loads + 1);
+
+    sign_verify(s);
+}
+
+static void test_persistent_other_key(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    /* the handle of the key now holds another one */
+    persist(s, s->key, true);
+    assert_true(fake_tpm_evict(PERSISTENT_HANDLE));
+    persist(s, s->other, false);
+
+    uint64_t loads = fake_tpm_cc_count(TPM2_CC_Load);
+    load(s, s->key);
+
+    /* which is not used, the key is loaded instead */
+    assert_false(s->key->tpm_handle_persistent);
+    assert_int_equal(fake_tpm_cc_count(TPM2_CC_Load), loads + 1);
+
+    sign_verify(s);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_persistent_hit,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_persistent_gone,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_persistent_other_key,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,177 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "fake_tpm.h"
+#include "fake_token.h"
+#include "pkcs11.h"
+
+/* the command counts of a test, taken since a mark */
+typedef struct counts counts;
+struct counts {
+    uint64_t create_primary;
+    uint64_t context_load;
+    uint64_t read_clock;
+};
+
+static void counts_mark(counts *c) {
+
+    c->create_primary = fake_tpm_cc_count(TPM2_CC_CreatePrimary);
+    c->context_load = fake_tpm_cc_count(TPM2_CC_ContextLoad);
+    c->read_clock = fake_tpm_cc_count(TPM2_CC_ReadClock);
+}
+
+static void counts_since(const counts *mark, counts *c) {
+
+    counts now;
+    counts_mark(&now);
+
+    c->create_primary = now.create_primary - mark->create_primary;
+    c->context_load = now.context_load - mark->context_load;
+    c->read_clock = now.read_clock - mark->read_clock;
+}
+
+static int setup(void **state) {
+
+    fake_token *ft = calloc(1, sizeof(*ft));
+    assert_non_null(ft);
+
+    /* C_InitToken creates the transient primary and saves its context */
+    fake_token_setup(ft, CKF_OS_LOCKING_OK, "tpm2-tools-default");
+
+    *state = ft;
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    fake_token_teardown(ft);
+    free(ft);
+
+    return 0;
+}
+
+static void test_pobject_deferred_until_login(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    fake_token_reload(ft, CKF_OS_LOCKING_OK);
+
+    counts mark;
+    counts_mark(&mark);
+
+    /* opening a session does not touch the primary */
+    CK_SESSION_HANDLE session;
+    CK_RV rv = C_OpenSession(ft->slot, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+            NULL, NULL, &session);
+    assert_int_equal(rv, CKR_OK);
+
+    counts c;
+    counts_since(&mark, &c);
+    assert_int_equal(c.create_primary, 0);
+    assert_int_equal(c.context_load, 0);
+
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+
+    /* logging in does, once */
+    session = fake_token_login(ft);
+
+    counts_since(&mark, &c);
+    assert_int_equal(c.create_primary + c.context_load, 1);
+
+    CK_SESSION_HANDLE session2 = fake_token_login(ft);
+
+    counts_since(&mark, &c);
+    assert_int_equal(c.create_primary + c.context_load, 1);
+
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+    rv = C_CloseSession(session2);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_pobject_saved_context_reloaded(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    unsigned i;
+    for (i = 0; i < 2; i++) {
+        fake_token_reload(ft, CKF_OS_LOCKING_OK);
+
+        counts mark;
+        counts_mark(&mark);
+
+        CK_SESSION_HANDLE session = fake_token_login(ft);
+
+        /* the context C_InitToken saved is loaded, not created again */
+        counts c;
+        counts_since(&mark, &c);
+        assert_int_equal(c.read_clock, 1);
+        assert_int_equal(c.context_load, 1);
+        assert_int_equal(c.create_primary, 0);
+
+        CK_RV rv = C_CloseSession(session);
+        assert_int_equal(rv, CKR_OK);
+    }
+}
+
+static void test_pobject_context_stale_after_reset(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    /* a new resetCount, the saved context is not even tried */
+    fake_token_reboot(ft, CKF_OS_LOCKING_OK);
+
+    counts mark;
+    counts_mark(&mark);
+
+    CK_SESSION_HANDLE session = fake_token_login(ft);
+
+    counts c;
+    counts_since(&mark, &c);
+    assert_int_equal(c.context_load, 0);
+    assert_int_equal(c.create_primary, 1);
+
+    CK_RV rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+
+    /* the primary created then was saved in turn */
+    fake_token_reload(ft, CKF_OS_LOCKING_OK);
+    counts_mark(&mark);
+
+    session = fake_token_login(ft);
+
+    counts_since(&mark, &c);
+    assert_int_equal(c.context_load, 1);
+    assert_int_equal(c.create_primary, 0);
+
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_pobject_deferred_until_login,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_pobject_saved_context_reloaded,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_pobject_context_stale_after_reset,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,246 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "attrs.h"
+#include "backend.h"
+#include "fake_tpm.h"
+#include "fake_token.h"
+#include "list.h"
+#include "object.h"
+#include "pkcs11.h"
+#include "utils.h"
+
+/* how long a test waits for the worker before it gives up */
+#define WAIT_MS (10 * 1000)
+
+typedef struct test_state test_state;
+struct test_state {
+    fake_token ft;
+    CK_FLAGS flags;
+};
+
+static int setup(test_state **out, CK_FLAGS flags) {
+
+    test_state *s = calloc(1, sizeof(*s));
+    assert_non_null(s);
+
+    s->flags = flags;
+    fake_token_setup(&s->ft, flags, NULL);
+
+    *out = s;
+    return 0;
+}
+
+/* the application allows OS locks, a worker warms the keys */
+static int setup_worker(void **state) {
+    return setup((test_state **)state, CKF_OS_LOCKING_OK);
+}
+
+/* no OS locks, C_Login warms the keys itself */
+static int setup_inline(void **state) {
+    return setup((test_state **)state, 0);
+}
+
+static int teardown(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    fake_token_teardown(&s->ft);
+    free(s);
+
+    return 0;
+}
+
+static CK_OBJECT_HANDLE key_add(CK_SESSION_HANDLE session, const char *label) {
+
+    /* prime256v1 */
+    CK_BYTE params[] = {
+        0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07
+    };
+    CK_BBOOL ck_true = CK_TRUE;
+
+    CK_ATTRIBUTE pub[] = {
+        { CKA_EC_PARAMS, params,   sizeof(params)  },
+        { CKA_VERIFY,    &ck_true, sizeof(ck_true) },
+    };
+
+    CK_ATTRIBUTE priv[] = {
+        { CKA_SIGN,  &ck_true,      sizeof(ck_true) },
+        { CKA_LABEL, (void *)label, strlen(label)   },
+    };
+
+    CK_MECHANISM mechanism = { .mechanism = CKM_EC_KEY_PAIR_GEN };
+    CK_OBJECT_HANDLE pubkey;
+    CK_OBJECT_HANDLE privkey;
+    CK_RV rv = C_GenerateKeyPair(session, &mechanism,
+            pub, ARRAY_LEN(pub), priv, ARRAY_LEN(priv), &pubkey, &privkey);
+    assert_int_equal(rv, CKR_OK);
+
+    return privkey;
+}
+
+/* the private key of a label, once the objects of the token are read */
+static tobject *key_find(token *tok, const char *label) {
+
+    assert_non_null(tok->tobjects.head);
+
+    size_t len = strlen(label);
+    list *cur = &tok->tobjects.head->l;
+    while (cur) {
+        tobject *tobj = list_entry(cur, tobject, l);
+        cur = cur->next;
+
+        CK_OBJECT_CLASS clazz = attr_list_get_CKA_CLASS(tobj->attrs,
+                CK_OBJECT_CLASS_BAD);
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_LABEL);
+        if (clazz == CKO_PRIVATE_KEY && a && a->ulValueLen == len
+                && !memcmp(a->pValue, label, len)) {
+            return tobj;
+        }
+    }
+
+    fail_msg("No private key \"%s\"", label);
+    return NULL;
+}
+
+/* loaded by the TPM with its auth unwrapped */
+static bool is_warm(token *tok, const char *label) {
+
+    token_lock(tok);
+    tobject *tobj = key_find(tok, label);
+    bool warm = tobj->tpm_handle && tobj->unsealed_auth;
+    token_unlock(tok);
+
+    return warm;
+}
+
+/*
+ * Adds the keys "warm", "byid" and "cold" and a prewarm config that lists
+ * the first by label, the second by id and a key that is not there, then
+ * loads the token again so none of them is in the TPM.
+ */
+static void keys_add(test_state *s) {
+
+    CK_SESSION_HANDLE session = fake_token_login(&s->ft);
+
+    key_add(session, "warm");
+    CK_OBJECT_HANDLE byid = key_add(session, "byid");
+    key_add(session, "cold");
+
+    tobject *tobj = NULL;
+    CK_RV rv = token_find_tobject(s->ft.tok, byid, &tobj);
+    assert_int_equal(rv, CKR_OK);
+
+    char spec[64];
+    snprintf(spec, sizeof(spec), "warm,%u,missing", tobj->id);
+
+    s->ft.tok->config.prewarm = strdup(spec);
+    assert_non_null(s->ft.tok->config.prewarm);
+    rv = backend_update_token_config(s->ft.tok);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_Logout(session);
+    assert_int_equal(rv, CKR_OK);
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+
+    fake_token_reload(&s->ft, s->flags);
+    assert_string_equal(s->ft.tok->config.prewarm, spec);
+}
+
+static void test_prewarm_worker(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    keys_add(s);
+
+    CK_SESSION_HANDLE session = fake_token_login(&s->ft);
+    assert_non_null(s->ft.tok->prewarm);
+
+    unsigned waited;
+    for (waited = 0; waited < WAIT_MS; waited += 10) {
+        if (is_warm(s->ft.tok, "warm") && is_warm(s->ft.tok, "byid")) {
+            break;
+        }
+        fake_token_sleep_ms(10);
+    }
+
+    assert_true(is_warm(s->ft.tok, "warm"));
+    assert_true(is_warm(s->ft.tok, "byid"));
+
+    /* the missing entry is skipped, a key that is not listed stays cold */
+    fake_token_sleep_ms(100);
+    assert_false(is_warm(s->ft.tok, "cold"));
+
+    CK_RV rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_prewarm_inline(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    keys_add(s);
+
+    /* without a worker C_Login returns with the keys warm */
+    CK_SESSION_HANDLE session = fake_token_login(&s->ft);
+    assert_null(s->ft.tok->prewarm);
+
+    assert_true(is_warm(s->ft.tok, "warm"));
+    assert_true(is_warm(s->ft.tok, "byid"));
+    assert_false(is_warm(s->ft.tok, "cold"));
+
+    /* the first signature needs no TPM2_Load */
+    tobject *tobj = key_find(s->ft.tok, "warm");
+    uint64_t loads = fake_tpm_cc_count(TPM2_CC_Load);
+
+    CK_MECHANISM mechanism = { .mechanism = CKM_ECDSA };
+    CK_RV rv = C_SignInit(session, &mechanism, tobj->obj_handle);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_BYTE digest[32];
+    memset(digest, 0x5a, sizeof(digest));
+    CK_BYTE sig[64];
+    CK_ULONG siglen = sizeof(sig);
+    rv = C_Sign(session, digest, sizeof(digest), sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+
+    assert_int_equal(fake_tpm_cc_count(TPM2_CC_Load), loads);
+
+    /* logging out unloads them, the next login warms them again */
+    rv = C_Logout(session);
+    assert_int_equal(rv, CKR_OK);
+    assert_false(is_warm(s->ft.tok, "warm"));
+
+    rv = C_Login(session, CKU_USER,
+            (CK_UTF8CHAR_PTR)FAKE_TOKEN_USERPIN, strlen(FAKE_TOKEN_USERPIN));
+    assert_int_equal(rv, CKR_OK);
+    assert_true(is_warm(s->ft.tok, "warm"));
+
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_prewarm_worker,
+                setup_worker, teardown),
+        cmocka_unit_test_setup_teardown(test_prewarm_inline,
+                setup_inline, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,229 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include <sqlite3.h>
+
+#include "fake_token.h"
+#include "object.h"
+#include "pkcs11.h"
+#include "token.h"
+#include "utils.h"
+
+/* the labels as the YAML attribute store keeps them, in hex */
+#define HEX_KEEP "6b656570"
+#define HEX_EDIT "65646974"
+#define HEX_DONE "646f6e65"
+#define HEX_ADDS "61646473"
+
+typedef struct test_state test_state;
+struct test_state {
+    fake_token ft;
+    CK_SESSION_HANDLE session;
+    sqlite3 *db;    /* the connection of another process */
+};
+
+static int setup(void **state) {
+
+    test_state *s = calloc(1, sizeof(*s));
+    assert_non_null(s);
+
+    fake_token_setup(&s->ft, CKF_OS_LOCKING_OK, NULL);
+
+    s->session = fake_token_login(&s->ft);
+    s->db = fake_token_db_open(&s->ft);
+
+    *state = s;
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    assert_int_equal(sqlite3_close(s->db), SQLITE_OK);
+
+    CK_RV rv = C_CloseSession(s->session);
+    assert_int_equal(rv, CKR_OK);
+
+    fake_token_teardown(&s->ft);
+    free(s);
+
+    return 0;
+}
+
+static CK_OBJECT_HANDLE data_add(test_state *s, const char *label) {
+
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_BBOOL ck_true = CK_TRUE;
+    CK_BBOOL ck_false = CK_FALSE;
+    CK_BYTE value[] = { 0x01, 0x02, 0x03 };
+
+    CK_ATTRIBUTE templ[] = {
+        { CKA_CLASS,   &clazz,        sizeof(clazz)    },
+        { CKA_TOKEN,   &ck_true,      sizeof(ck_true)  },
+        { CKA_PRIVATE, &ck_false,     sizeof(ck_false) },
+        { CKA_LABEL,   (void *)label, strlen(label)    },
+        { CKA_VALUE,   value,         sizeof(value)    },
+    };
+
+    CK_OBJECT_HANDLE handle;
+    CK_RV rv = C_CreateObject(s->session, templ, ARRAY_LEN(templ), &handle);
+    assert_int_equal(rv, CKR_OK);
+
+    return handle;
+}
+
+/* searches by label, which refreshes the objects of the token */
+static CK_ULONG find(test_state *s, const char *label, CK_OBJECT_HANDLE *handle) {
+
+    CK_ATTRIBUTE templ[] = {
+        { CKA_LABEL, (void *)label, strlen(label) },
+    };
+
+    CK_RV rv = C_FindObjectsInit(s->session, templ, ARRAY_LEN(templ));
+    assert_int_equal(rv, CKR_OK);
+
+    CK_OBJECT_HANDLE found[4];
+    CK_ULONG count = 0;
+    rv = C_FindObjects(s->session, found, ARRAY_LEN(found), &count);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_FindObjectsFinal(s->session);
+    assert_int_equal(rv, CKR_OK);
+
+    if (handle) {
+        *handle = count ? found[0] : CK_INVALID_HANDLE;
+    }
+
+    return count;
+}
+
+static CK_OBJECT_HANDLE find_one(test_state *s, const char *label) {
+
+    CK_OBJECT_HANDLE handle;
+    assert_int_equal(find(s, label, &handle), 1);
+    return handle;
+}
+
+static tobject *tobject_get(test_state *s, CK_OBJECT_HANDLE handle) {
+
+    tobject *tobj = NULL;
+    CK_RV rv = token_find_tobject(s->ft.tok, handle, &tobj);
+    assert_int_equal(rv, CKR_OK);
+    return tobj;
+}
+
+/* runs a statement taking a tobject id on the other connection */
+static void db_exec(test_state *s, const char *fmt, unsigned id) {
+
+    char *sql = sqlite3_mprintf(fmt, id);
+    assert_non_null(sql);
+
+    char *err = NULL;
+    int rc = sqlite3_exec(s->db, sql, NULL, NULL, &err);
+    if (rc != SQLITE_OK) {
+        fail_msg("%s: %s", sql, err);
+    }
+
+    sqlite3_free(sql);
+}
+
+static void test_refresh_tobjects(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_OBJECT_HANDLE keep = data_add(s, "keep");
+    CK_OBJECT_HANDLE edit = data_add(s, "edit");
+    CK_OBJECT_HANDLE gone = data_add(s, "gone");
+
+    assert_int_equal(find_one(s, "keep"), keep);
+
+    tobject *kept = tobject_get(s, keep);
+    unsigned keep_id = kept->id;
+    unsigned edit_id = tobject_get(s, edit)->id;
+    unsigned gone_id = tobject_get(s, gone)->id;
+
+    /* another process modifies one object and deletes another */
+    db_exec(s, "UPDATE tobjects SET attrs=replace(attrs, '" HEX_EDIT "', '"
+            HEX_DONE "') WHERE id=%u;", edit_id);
+    db_exec(s, "DELETE FROM tobjects WHERE id=%u;", gone_id);
+
+    /* the modified object keeps its handle */
+    assert_int_equal(find_one(s, "done"), edit);
+    assert_int_equal(find(s, "edit", NULL), 0);
+    assert_int_equal(tobject_get(s, edit)->id, edit_id);
+
+    CK_BYTE label[8];
+    CK_ATTRIBUTE a = { CKA_LABEL, label, sizeof(label) };
+    CK_RV rv = C_GetAttributeValue(s->session, edit, &a, 1);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(a.ulValueLen, 4);
+    assert_memory_equal(label, "done", 4);
+
+    /* the deleted one is dropped from the token */
+    assert_int_equal(find(s, "gone", NULL), 0);
+    tobject *tobj = NULL;
+    rv = token_find_tobject(s->ft.tok, gone, &tobj);
+    assert_int_equal(rv, CKR_KEY_HANDLE_INVALID);
+
+    /* and the unchanged one was not even read again */
+    assert_int_equal(find_one(s, "keep"), keep);
+    assert_ptr_equal(tobject_get(s, keep), kept);
+
+    /* another process adds an object, a copy of keep under a new label */
+    db_exec(s, "INSERT INTO tobjects (tokid, attrs) SELECT tokid, replace(attrs, '"
+            HEX_KEEP "', '" HEX_ADDS "') FROM tobjects WHERE id=%u;", keep_id);
+
+    /* it gets a handle of its own, the others keep theirs */
+    CK_OBJECT_HANDLE adds = find_one(s, "adds");
+    assert_int_not_equal(adds, keep);
+    assert_int_not_equal(adds, edit);
+    assert_int_not_equal(tobject_get(s, adds)->id, keep_id);
+
+    assert_int_equal(find_one(s, "keep"), keep);
+    assert_int_equal(find_one(s, "done"), edit);
+    assert_ptr_equal(tobject_get(s, keep), kept);
+}
+
+static void test_refresh_tobjects_own_writes(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_OBJECT_HANDLE keep = data_add(s, "keep");
+    assert_int_equal(find_one(s, "keep"), keep);
+    tobject *kept = tobject_get(s, keep);
+
+    /* objects this process adds and destroys are not read back */
+    CK_OBJECT_HANDLE edit = data_add(s, "edit");
+    assert_int_equal(find_one(s, "edit"), edit);
+    assert_ptr_equal(tobject_get(s, keep), kept);
+
+    CK_RV rv = C_DestroyObject(s->session, edit);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(find(s, "edit", NULL), 0);
+    assert_int_equal(find_one(s, "keep"), keep);
+    assert_ptr_equal(tobject_get(s, keep), kept);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_refresh_tobjects,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_refresh_tobjects_own_writes,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,287 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+
+#include <cmocka.h>
+
+#include "snapshot.h"
+#include "token.h"
+#include "utils.h"
+
+#define HEADER_SIZE 32
+
+typedef struct test_file test_file;
+struct test_file {
+    char path[64];
+};
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    put_u32(p, v & 0xFFFFFFFF);
+    put_u32(p + 4, v >> 32);
+}
+
+/* a valid header for a snapshot with no tokens */
+static void make_header(uint8_t *hdr, uint32_t version, uint32_t token_cnt, uint64_t size) {
+
+    memset(hdr, 0, HEADER_SIZE);
+    memcpy(hdr, SNAPSHOT_MAGIC, 8);
+    put_u32(&hdr[8], version);
+    put_u32(&hdr[12], 6);
+    put_u32(&hdr[16], token_cnt);
+    put_u64(&hdr[24], size);
+}
+
+static int setup(void **state) {
+
+    test_file *f = calloc(1, sizeof(*f));
+    assert_non_null(f);
+
+    strcpy(f->path, "/tmp/test_snapshot_XXXXXX");
+    int fd = mkstemp(f->path);
+    assert_true(fd >= 0);
+    close(fd);
+
+    *state = f;
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    test_file *f = *state;
+    snapshot_destroy();
+    unlink(f->path);
+    free(f);
+    return 0;
+}
+
+static void write_file(test_file *f, const uint8_t *data, size_t len) {
+
+    FILE *fp = fopen(f->path, "wb");
+    assert_non_null(fp);
+    assert_int_equal(fwrite(data, 1, len, fp), len);
+    fclose(fp);
+}
+
+/* appends records to a snapshot built in memory */
+typedef struct builder builder;
+struct builder {
+    uint8_t buf[1024];
+    size_t len;
+};
+
+static void add_u8(builder *b, uint8_t v) {
+    assert_true(b->len + 1 <= sizeof(b->buf));
+    b->buf[b->len++] = v;
+}
+
+static void add_u32(builder *b, uint32_t v) {
+    assert_true(b->len + 4 <= sizeof(b->buf));
+    put_u32(&b->buf[b->len], v);
+    b->len += 4;
+}
+
+static void add_str(builder *b, const char *s) {
+    size_t len = s ? strlen(s) : 0;
+    add_u32(b, len);
+    assert_true(b->len + len <= sizeof(b->buf));
+    memcpy(&b->buf[b->len], s, len);
+    b->len += len;
+}
+
+/* a token with a transient primary, no seal objects and no tobjects */
+static void add_token(builder *b, const char *config[][2], size_t config_len) {
+
+    add_u32(b, 1);      /* id */
+    add_u32(b, 1);      /* pid */
+    add_str(b, "label");
+
+    add_u32(b, config_len);
+    size_t i;
+    for (i = 0; i < config_len; i++) {
+        add_str(b, config[i][0]);
+        add_str(b, config[i][1]);
+    }
+
+    add_u8(b, 1);       /* transient */
+    add_u8(b, 0);
+    add_u8(b, 0);
+    add_u8(b, 0);
+    add_str(b, "tpm2-tools-default");
+    add_str(b, "objauth");
+
+    for (i = 0; i < 6; i++) {
+        add_str(b, NULL);   /* sealobject blobs */
+    }
+
+    add_u32(b, 0);      /* tobjects */
+}
+
+static void write_snapshot(test_file *f, builder *b, uint32_t token_cnt) {
+
+    make_header(b->buf, SNAPSHOT_FORMAT_VERSION, token_cnt, b->len);
+    write_file(f, b->buf, b->len);
+}
+
+static void test_snapshot_empty(void **state) {
+
+    test_file *f = *state;
+
+    uint8_t hdr[HEADER_SIZE];
+    make_header(hdr, SNAPSHOT_FORMAT_VERSION, 0, sizeof(hdr));
+    write_file(f, hdr, sizeof(hdr));
+
+    assert_int_equal(snapshot_init(f->path), CKR_OK);
+
+    token *t = NULL;
+    size_t len = 1;
+    assert_int_equal(snapshot_get_tokens(&t, &len), CKR_OK);
+    assert_int_equal(len, 0);
+    token_free_list(t, len);
+}
+
+static void test_snapshot_bad_magic(void **state) {
+
+    test_file *f = *state;
+
+    uint8_t hdr[HEADER_SIZE];
+    make_header(hdr, SNAPSHOT_FORMAT_VERSION, 0, sizeof(hdr));
+    hdr[0] = 'X';
+    write_file(f, hdr, sizeof(hdr));
+
+    assert_int_equal(snapshot_init(f->path), CKR_GENERAL_ERROR);
+}
+
+static void test_snapshot_bad_version(void **state) {
+
+    test_file *f = *state;
+
+    uint8_t hdr[HEADER_SIZE];
+    make_header(hdr, SNAPSHOT_FORMAT_VERSION + 1, 0, sizeof(hdr));
+    write_file(f, hdr, sizeof(hdr));
+
+    assert_int_equal(snapshot_init(f->path), CKR_GENERAL_ERROR);
+}
+
+static void test_snapshot_truncated(void **state) {
+
+    test_file *f = *state;
+
+    uint8_t hdr[HEADER_SIZE];
+    make_header(hdr, SNAPSHOT_FORMAT_VERSION, 1, sizeof(hdr) + 64);
+    write_file(f, hdr, sizeof(hdr));
+
+    assert_int_equal(snapshot_init(f->path), CKR_GENERAL_ERROR);
+
+    /* shorter than the header */
+    write_file(f, hdr, 16);
+    assert_int_equal(snapshot_init(f->path), CKR_GENERAL_ERROR);
+}
+
+static void test_snapshot_short_token(void **state) {
+
+    test_file *f = *state;
+
+    /* header claims a token, but the record ends after the ids */
+    uint8_t buf[HEADER_SIZE + 8];
+    make_header(buf, SNAPSHOT_FORMAT_VERSION, 1, sizeof(buf));
+    put_u32(&buf[HEADER_SIZE], 1);
+    put_u32(&buf[HEADER_SIZE + 4], 1);
+    write_file(f, buf, sizeof(buf));
+
+    assert_int_equal(snapshot_init(f->path), CKR_OK);
+
+    token *t = NULL;
+    size_t len = 0;
+    assert_int_equal(snapshot_get_tokens(&t, &len), CKR_GENERAL_ERROR);
+}
+
+static void test_snapshot_config(void **state) {
+
+    test_file *f = *state;
+
+    const char *config[][2] = {
+        { "context-login",   "tpm"     },
+        { "durability",      "batch"   },
+        { "login-cache-ttl", "300"     },
+        { "prewarm",         "3,tls"   },
+        { "pss-sigs-good",   "false"   },
+        { "tcti",            "mssim:"  },
+        { "token-init",      "true"    },
+    };
+
+    builder b = { .len = HEADER_SIZE };
+    add_token(&b, config, ARRAY_LEN(config));
+    write_snapshot(f, &b, 1);
+
+    assert_int_equal(snapshot_init(f->path), CKR_OK);
+
+    token *t = NULL;
+    size_t len = 0;
+    assert_int_equal(snapshot_get_tokens(&t, &len), CKR_OK);
+    assert_int_equal(len, 1);
+
+    assert_true(t->read_only);
+    assert_true(t->config.is_initialized);
+    assert_int_equal(t->config.pss_sigs_good, pss_config_state_bad);
+    assert_int_equal(t->config.durability, token_durability_batch);
+    assert_int_equal(t->config.context_login, token_context_login_tpm);
+    assert_int_equal(t->config.login_cache_ttl, 300);
+    assert_string_equal(t->config.prewarm, "3,tls");
+    assert_string_equal(t->config.tcti, "mssim:");
+    assert_true(t->pobject.config.is_transient);
+    assert_string_equal(t->pobject.config.template_name, "tpm2-tools-default");
+
+    token_free_list(t, len);
+}
+
+static void test_snapshot_config_unknown_key(void **state) {
+
+    test_file *f = *state;
+
+    const char *config[][2] = {
+        { "token-init",   "true" },
+        { "no-such-key",  "1"    },
+    };
+
+    builder b = { .len = HEADER_SIZE };
+    add_token(&b, config, ARRAY_LEN(config));
+    write_snapshot(f, &b, 1);
+
+    assert_int_equal(snapshot_init(f->path), CKR_OK);
+
+    token *t = NULL;
+    size_t len = 0;
+    assert_int_equal(snapshot_get_tokens(&t, &len), CKR_GENERAL_ERROR);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_snapshot_empty, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_bad_magic, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_bad_version, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_truncated, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_short_token, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_config, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_config_unknown_key, setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
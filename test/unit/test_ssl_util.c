@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include <openssl/bn.h>
+#include <openssl/ecdsa.h>
+#include <openssl/rand.h>
+
+#include "pkcs11.h"
+#include "ssl_util.h"
+#include "utils.h"
+
+typedef struct der_vector der_vector;
+struct der_vector {
+    const CK_BYTE *sig;
+    CK_ULONG siglen;
+    const CK_BYTE *der;
+    CK_ULONG derlen;
+};
+
+static void test_ssl_util_ecdsa_sig_to_der(void **state) {
+    (void) state;
+
+    /* r needs no padding, s gets a zero byte for its top bit */
+    static const CK_BYTE sig_pad[] = { 0x12, 0x34, 0x80, 0x01 };
+    static const CK_BYTE der_pad[] = {
+        0x30, 0x09,
+        0x02, 0x02, 0x12, 0x34,
+        0x02, 0x03, 0x00, 0x80, 0x01
+    };
+
+    /* leading zeros go, unless they keep a top bit from reading negative */
+    static const CK_BYTE sig_strip[] = { 0x00, 0x00, 0x7f, 0x00, 0x00, 0x81 };
+    static const CK_BYTE der_strip[] = {
+        0x30, 0x07,
+        0x02, 0x01, 0x7f,
+        0x02, 0x02, 0x00, 0x81
+    };
+
+    /* zero is one zero byte */
+    static const CK_BYTE sig_zero[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    static const CK_BYTE der_zero[] = {
+        0x30, 0x06,
+        0x02, 0x01, 0x00,
+        0x02, 0x01, 0x01
+    };
+
+    static const der_vector vectors[] = {
+        { sig_pad,   sizeof(sig_pad),   der_pad,   sizeof(der_pad)   },
+        { sig_strip, sizeof(sig_strip), der_strip, sizeof(der_strip) },
+        { sig_zero,  sizeof(sig_zero),  der_zero,  sizeof(der_zero)  },
+    };
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(vectors); i++) {
+        CK_BYTE der[SSL_UTIL_ECDSA_DER_MAX(SSL_UTIL_ECDSA_MAX_SIG_LEN)];
+        CK_ULONG derlen = sizeof(der);
+        CK_RV rv = ssl_util_ecdsa_sig_to_der(vectors[i].sig, vectors[i].siglen,
+                der, &derlen);
+        assert_int_equal(rv, CKR_OK);
+        assert_int_equal(derlen, vectors[i].derlen);
+        assert_memory_equal(der, vectors[i].der, derlen);
+    }
+}
+
+/* checks the encoding against OpenSSL's for r and s of len bytes */
+static void check_against_openssl(const CK_BYTE *sig, size_t len) {
+
+    CK_BYTE der[SSL_UTIL_ECDSA_DER_MAX(SSL_UTIL_ECDSA_MAX_SIG_LEN)];
+    CK_ULONG derlen = sizeof(der);
+    CK_RV rv = ssl_util_ecdsa_sig_to_der(sig, 2 * len, der, &derlen);
+    assert_int_equal(rv, CKR_OK);
+    assert_true(derlen <= SSL_UTIL_ECDSA_DER_MAX(2 * len));
+
+    const unsigned char *p = der;
+    ECDSA_SIG *esig = d2i_ECDSA_SIG(NULL, &p, derlen);
+    assert_non_null(esig);
+    assert_int_equal(p - der, derlen);
+
+    const BIGNUM *r = NULL;
+    const BIGNUM *s = NULL;
+    ECDSA_SIG_get0(esig, &r, &s);
+
+    BIGNUM *er = BN_bin2bn(sig, len, NULL);
+    BIGNUM *es = BN_bin2bn(&sig[len], len, NULL);
+    assert_non_null(er);
+    assert_non_null(es);
+    assert_int_equal(BN_cmp(r, er), 0);
+    assert_int_equal(BN_cmp(s, es), 0);
+
+    /* OpenSSL only accepts the one DER encoding it makes itself */
+    unsigned char *ossl_der = NULL;
+    int ossl_len = i2d_ECDSA_SIG(esig, &ossl_der);
+    assert_int_equal(ossl_len, derlen);
+    assert_memory_equal(ossl_der, der, derlen);
+
+    OPENSSL_free(ossl_der);
+    BN_free(er);
+    BN_free(es);
+    ECDSA_SIG_free(esig);
+}
+
+static void test_ssl_util_ecdsa_sig_to_der_curves(void **state) {
+    (void) state;
+
+    /* P-256, P-384 and P-521 */
+    static const size_t lens[] = { 32, 48, 66 };
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(lens); i++) {
+        size_t len = lens[i];
+
+        unsigned j;
+        for (j = 0; j < 64; j++) {
+            CK_BYTE sig[SSL_UTIL_ECDSA_MAX_SIG_LEN];
+            assert_int_equal(RAND_bytes(sig, 2 * len), 1);
+
+            /* cover set top bits and leading zeros in r and s */
+            if (j & 1) {
+                sig[0] |= 0x80;
+            }
+            if (j & 2) {
+                sig[len] &= 0x7f;
+            }
+            if (j & 4) {
+                sig[0] = 0;
+                sig[1] |= 0x80;
+            }
+            if (j & 8) {
+                sig[len] = 0;
+                sig[len + 1] = 0;
+            }
+
+            check_against_openssl(sig, len);
+        }
+    }
+}
+
+static void test_ssl_util_ecdsa_sig_to_der_long_length(void **state) {
+    (void) state;
+
+    /* P-521 with set top bits is over 127 bytes of content */
+    CK_BYTE sig[2 * 66];
+    memset(sig, 0xff, sizeof(sig));
+
+    CK_BYTE der[SSL_UTIL_ECDSA_DER_MAX(sizeof(sig))];
+    CK_ULONG derlen = sizeof(der);
+    CK_RV rv = ssl_util_ecdsa_sig_to_der(sig, sizeof(sig), der, &derlen);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(derlen, sizeof(der));
+    assert_int_equal(der[0], 0x30);
+    assert_int_equal(der[1], 0x81);
+    assert_int_equal(der[2], 2 * (2 + 67));
+}
+
+static void test_ssl_util_ecdsa_sig_to_der_bad_len(void **state) {
+    (void) state;
+
+    CK_BYTE sig[SSL_UTIL_ECDSA_MAX_SIG_LEN + 2] = { 0 };
+    CK_BYTE der[SSL_UTIL_ECDSA_DER_MAX(sizeof(sig))];
+
+    static const CK_ULONG siglens[] = {
+        0,
+        63,
+        SSL_UTIL_ECDSA_MAX_SIG_LEN + 2,
+    };
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(siglens); i++) {
+        CK_ULONG derlen = sizeof(der);
+        CK_RV rv = ssl_util_ecdsa_sig_to_der(sig, siglens[i], der, &derlen);
+        assert_int_equal(rv, CKR_SIGNATURE_LEN_RANGE);
+    }
+}
+
+static void test_ssl_util_ecdsa_sig_to_der_too_small(void **state) {
+    (void) state;
+
+    CK_BYTE sig[64];
+    memset(sig, 0x80, sizeof(sig));
+
+    /* both INTEGERs get a zero byte */
+    CK_BYTE der[SSL_UTIL_ECDSA_DER_MAX(sizeof(sig))];
+    CK_ULONG derlen = 2 + 2 * (2 + 33) - 1;
+    CK_RV rv = ssl_util_ecdsa_sig_to_der(sig, sizeof(sig), der, &derlen);
+    assert_int_equal(rv, CKR_BUFFER_TOO_SMALL);
+    assert_int_equal(derlen, 2 + 2 * (2 + 33));
+
+    rv = ssl_util_ecdsa_sig_to_der(sig, sizeof(sig), der, &derlen);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(derlen, 2 + 2 * (2 + 33));
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_ssl_util_ecdsa_sig_to_der),
+        cmocka_unit_test(test_ssl_util_ecdsa_sig_to_der_curves),
+        cmocka_unit_test(test_ssl_util_ecdsa_sig_to_der_long_length),
+        cmocka_unit_test(test_ssl_util_ecdsa_sig_to_der_bad_len),
+        cmocka_unit_test(test_ssl_util_ecdsa_sig_to_der_too_small),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "stats.h"
+#include "utils.h"
+
+static void test_stats_hist_exact_small(void **state) {
+    (void) state;
+
+    stats_hist h;
+    stats_hist_init(&h);
+
+    uint64_t i;
+    for (i = 1; i <= 4; i++) {
+        stats_hist_record(&h, i);
+    }
+
+    assert_int_equal(h.cnt, 4);
+    assert_int_equal(h.sum, 10);
+    assert_int_equal(h.min, 1);
+    assert_int_equal(h.max, 4);
+    assert_int_equal(stats_hist_percentile(&h, 50.0), 2);
+    assert_int_equal(stats_hist_percentile(&h, 100.0), 4);
+}
+
+static void test_stats_hist_relative_error(void **state) {
+    (void) state;
+
+    stats_hist h;
+    stats_hist_init(&h);
+
+    /* 1..1000us, uniformly */
+    uint64_t i;
+    for (i = 1; i <= 1000; i++) {
+        stats_hist_record(&h, i * 1000);
+    }
+
+    uint64_t p50 = stats_hist_percentile(&h, 50.0);
+    uint64_t p99 = stats_hist_percentile(&h, 99.0);
+
+    /* bucket resolution is 1/8th of the value */
+    assert_true(p50 >= 500000 && p50 <= 500000 + 500000 / 8);
+    assert_true(p99 >= 990000 && p99 <= 990000 + 990000 / 8);
+    assert_int_equal(stats_hist_percentile(&h, 100.0), 1000000);
+}
+
+static void test_stats_hist_min_zero(void **state) {
+    (void) state;
+
+    stats_hist h;
+    stats_hist_init(&h);
+
+    /* an uncontended lock wait or an empty queue records 0 */
+    stats_hist_record(&h, 0);
+    stats_hist_record(&h, 5);
+
+    assert_int_equal(h.cnt, 2);
+    assert_int_equal(h.min, 0);
+    assert_int_equal(h.max, 5);
+}
+
+static void test_stats_hist_empty(void **state) {
+    (void) state;
+
+    stats_hist h;
+    stats_hist_init(&h);
+    assert_int_equal(stats_hist_percentile(&h, 99.0), 0);
+
+    /* no samples, no minimum */
+    char *json = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&json, &len);
+    assert_non_null(f);
+    stats_hist_emit_json(f, &h);
+    fclose(f);
+    assert_non_null(strstr(json, "\"count\":0,\"min\":0,"));
+    free(json);
+}
+
+static void test_stats_get_json(void **state) {
+    (void) state;
+
+    static stats_site site = STATS_SITE_INIT("C_Test");
+
+    stats_call c = { 0 };
+    stats_call_start(&c);
+    assert_true(c.enabled);
+    stats_call_lock_attempt(&c);
+    stats_call_lock_acquired(&c);
+    stats_call_lock_released(&c);
+    stats_call_end(&site, &c, 3, CKR_GENERAL_ERROR);
+
+    CK_ULONG len = 0;
+    CK_RV rv = stats_get_json(NULL, &len);
+    assert_int_equal(rv, CKR_OK);
+    assert_true(len > 1);
+
+    CK_ULONG small = 1;
+    CK_BYTE tiny[1];
+    rv = stats_get_json(tiny, &small);
+    assert_int_equal(rv, CKR_BUFFER_TOO_SMALL);
+    assert_int_equal(small, len);
+
+    CK_BYTE_PTR buf = malloc(len);
+    assert_non_null(buf);
+
+    rv = stats_get_json(buf, &len);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(buf[len - 1], '\0');
+
+    const char *doc = (const char *)buf;
+    assert_non_null(strstr(doc, "\"function\":\"C_Test\",\"token\":3"));
+    assert_non_null(strstr(doc, "\"calls\":1,\"errors\":1"));
+    assert_non_null(strstr(doc, "\"lock_wait\":{\"count\":1"));
+
+    free(buf);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    /* must be set before the first stats_is_enabled() call */
+    setenv("TPM2_PKCS11_STATS", "-", 1);
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_stats_hist_exact_small),
+        cmocka_unit_test(test_stats_hist_relative_error),
+        cmocka_unit_test(test_stats_hist_min_zero),
+        cmocka_unit_test(test_stats_hist_empty),
+        cmocka_unit_test(test_stats_get_json),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,235 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "fake_tpm.h"
+#include "fake_token.h"
+#include "object.h"
+#include "pkcs11.h"
+#include "tpm.h"
+#include "twist.h"
+#include "utils.h"
+
+typedef struct test_state test_state;
+struct test_state {
+    fake_token ft;
+    CK_SESSION_HANDLE session;
+    CK_OBJECT_HANDLE key;
+    tobject *tobj;      /* the private key, its blobs load under any parent */
+    twist auth;         /* the auth of the primary objects the tests create */
+};
+
+static CK_OBJECT_HANDLE key_add(CK_SESSION_HANDLE session) {
+
+    /* prime256v1 */
+    CK_BYTE params[] = {
+        0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07
+    };
+    CK_BBOOL ck_true = CK_TRUE;
+
+    CK_ATTRIBUTE pub[] = {
+        { CKA_EC_PARAMS, params,   sizeof(params)  },
+        { CKA_VERIFY,    &ck_true, sizeof(ck_true) },
+    };
+
+    CK_ATTRIBUTE priv[] = {
+        { CKA_SIGN, &ck_true, sizeof(ck_true) },
+    };
+
+    CK_MECHANISM mechanism = { .mechanism = CKM_EC_KEY_PAIR_GEN };
+    CK_OBJECT_HANDLE pubkey;
+    CK_OBJECT_HANDLE privkey;
+    CK_RV rv = C_GenerateKeyPair(session, &mechanism,
+            pub, ARRAY_LEN(pub), priv, ARRAY_LEN(priv), &pubkey, &privkey);
+    assert_int_equal(rv, CKR_OK);
+
+    return privkey;
+}
+
+static int setup(void **state) {
+
+    test_state *s = calloc(1, sizeof(*s));
+    assert_non_null(s);
+
+    fake_token_setup(&s->ft, CKF_OS_LOCKING_OK, NULL);
+
+    s->session = fake_token_login(&s->ft);
+    s->key = key_add(s->session);
+
+    CK_RV rv = token_find_tobject(s->ft.tok, s->key, &s->tobj);
+    assert_int_equal(rv, CKR_OK);
+
+    s->auth = twist_new("primaryauth");
+    assert_non_null(s->auth);
+
+    *state = s;
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_RV rv = C_CloseSession(s->session);
+    assert_int_equal(rv, CKR_OK);
+
+    fake_token_teardown(&s->ft);
+    twist_free(s->auth);
+    free(s);
+
+    return 0;
+}
+
+static void sign(test_state *s) {
+
+    CK_MECHANISM mechanism = { .mechanism = CKM_ECDSA };
+    CK_RV rv = C_SignInit(s->session, &mechanism, s->key);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_BYTE digest[32];
+    memset(digest, 0x5a, sizeof(digest));
+    CK_BYTE sig[64];
+    CK_ULONG siglen = sizeof(sig);
+    rv = C_Sign(s->session, digest, sizeof(digest), sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+}
+
+/* a primary of the test's own, so flushing it leaves the token alone */
+static uint32_t primary_new(test_state *s) {
+
+    uint32_t handle = 0;
+    CK_RV rv = tpm_create_transient_primary_from_template(s->ft.tok->tctx,
+            "tpm2-tools-default", s->auth, &handle);
+    assert_int_equal(rv, CKR_OK);
+
+    return handle;
+}
+
+/*
+ * Loads the key under parent, which sets the auth of the parent, and
+ * returns whether the load worked.
+ */
+static bool load_under(test_state *s, uint32_t parent, twist auth) {
+
+    uint32_t handle = 0;
+    CK_RV rv = tpm_loadobj(s->ft.tok->tctx, s->tobj->id, parent, auth,
+            s->tobj->pub, s->tobj->priv, &handle);
+    if (rv != CKR_OK) {
+        return false;
+    }
+
+    assert_true(tpm_flushcontext(s->ft.tok->tctx, handle));
+    return true;
+}
+
+static void test_tpm_auth_skipped_on_repeat(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    sign(s);
+
+    uint32_t handle = s->tobj->tpm_handle;
+    assert_int_not_equal(handle, 0);
+    uint64_t key_sets = fake_tpm_set_auth_count(handle);
+    assert_true(key_sets >= 1);
+
+    /* the same key with the same auth, nothing to set */
+    uint64_t sets = fake_tpm_set_auth_count(ESYS_TR_NONE);
+    sign(s);
+    assert_int_equal(s->tobj->tpm_handle, handle);
+    assert_int_equal(fake_tpm_set_auth_count(handle), key_sets);
+    assert_int_equal(fake_tpm_set_auth_count(ESYS_TR_NONE), sets);
+
+    /* nor for a parent loading one key after another */
+    uint32_t primary = primary_new(s);
+    assert_true(load_under(s, primary, s->auth));
+    assert_int_equal(fake_tpm_set_auth_count(primary), 1);
+    assert_true(load_under(s, primary, s->auth));
+    assert_int_equal(fake_tpm_set_auth_count(primary), 1);
+
+    /* a new auth is set */
+    twist other = twist_new("otherauth");
+    assert_non_null(other);
+    load_under(s, primary, other);
+    assert_int_equal(fake_tpm_set_auth_count(primary), 2);
+    twist_free(other);
+
+    assert_true(tpm_flushcontext(s->ft.tok->tctx, primary));
+}
+
+static void test_tpm_auth_set_after_flush(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    uint32_t primary = primary_new(s);
+    assert_true(load_under(s, primary, s->auth));
+    assert_int_equal(fake_tpm_set_auth_count(primary), 1);
+
+    /*
+     * ESAPI may hand a flushed ESYS_TR to the next object, the same handle
+     * with the same auth must be set again. It is gone, so the load fails.
+     */
+    assert_true(tpm_flushcontext(s->ft.tok->tctx, primary));
+    assert_false(load_under(s, primary, s->auth));
+    assert_int_equal(fake_tpm_set_auth_count(primary), 2);
+}
+
+static void test_tpm_auth_set_after_close(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    uint32_t primary = primary_new(s);
+    assert_true(load_under(s, primary, s->auth));
+    assert_int_equal(fake_tpm_set_auth_count(primary), 1);
+
+    assert_true(tpm_closehandle(s->ft.tok->tctx, primary));
+    assert_false(load_under(s, primary, s->auth));
+    assert_int_equal(fake_tpm_set_auth_count(primary), 2);
+}
+
+static void test_tpm_auth_set_after_hierarchy_change(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    /* the fake TPM does not load under a hierarchy, the auth is set anyway */
+    uint64_t sets = fake_tpm_set_auth_count(ESYS_TR_RH_OWNER);
+    load_under(s, ESYS_TR_RH_OWNER, s->auth);
+    assert_int_equal(fake_tpm_set_auth_count(ESYS_TR_RH_OWNER), sets + 1);
+    load_under(s, ESYS_TR_RH_OWNER, s->auth);
+    assert_int_equal(fake_tpm_set_auth_count(ESYS_TR_RH_OWNER), sets + 1);
+
+    /* creating a primary sets the owner auth directly */
+    uint32_t primary = primary_new(s);
+    assert_int_equal(fake_tpm_set_auth_count(ESYS_TR_RH_OWNER), sets + 2);
+    assert_true(tpm_flushcontext(s->ft.tok->tctx, primary));
+
+    /* which the remembered auth no longer matches */
+    load_under(s, ESYS_TR_RH_OWNER, s->auth);
+    assert_int_equal(fake_tpm_set_auth_count(ESYS_TR_RH_OWNER), sets + 3);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_tpm_auth_skipped_on_repeat,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_auth_set_after_flush,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_auth_set_after_close,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_auth_set_after_hierarchy_change,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,162 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "fake_tpm.h"
+#include "fake_token.h"
+#include "pkcs11.h"
+#include "slot.h"
+#include "token.h"
+#include "utils.h"
+
+/* the slot of the empty token, next to the token of the fake store */
+#define EMPTY_SLOT 2
+
+static int setup(void **state) {
+
+    fake_token *ft = calloc(1, sizeof(*ft));
+    assert_non_null(ft);
+
+    fake_token_setup(ft, CKF_OS_LOCKING_OK, NULL);
+
+    *state = ft;
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    fake_token_teardown(ft);
+    free(ft);
+
+    return 0;
+}
+
+static void slots_get(CK_SLOT_ID *slots, CK_ULONG *count) {
+
+    CK_RV rv = C_GetSlotList(CK_TRUE, slots, count);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(*count, 2);
+    assert_int_equal(slots[0], 1);
+    assert_int_equal(slots[1], EMPTY_SLOT);
+}
+
+static void token_info_get(CK_SLOT_ID slot, CK_TOKEN_INFO *info) {
+
+    CK_RV rv = C_GetTokenInfo(slot, info);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_tpm_ctx_none_until_session(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    uint64_t inits = fake_tpm_esys_init_count();
+
+    /* loading the store talks to no TPM */
+    fake_token_reload(ft, CKF_OS_LOCKING_OK);
+    assert_int_equal(fake_tpm_esys_init_count(), inits);
+    assert_null(ft->tok->tctx);
+
+    CK_SLOT_ID slots[4];
+    CK_ULONG count = ARRAY_LEN(slots);
+    slots_get(slots, &count);
+    assert_int_equal(fake_tpm_esys_init_count(), inits);
+
+    /* the first session pays for exactly one */
+    CK_SESSION_HANDLE session;
+    CK_RV rv = C_OpenSession(ft->slot, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+            NULL, NULL, &session);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(fake_tpm_esys_init_count(), inits + 1);
+    assert_non_null(ft->tok->tctx);
+
+    /* which every later call on the token uses */
+    CK_SESSION_HANDLE other;
+    rv = C_OpenSession(ft->slot, CKF_SERIAL_SESSION, NULL, NULL, &other);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_TOKEN_INFO info;
+    token_info_get(ft->slot, &info);
+    assert_int_equal(fake_tpm_esys_init_count(), inits + 1);
+
+    /* and the empty token on the same TPM answers from the cache */
+    token_info_get(EMPTY_SLOT, &info);
+    assert_int_equal(fake_tpm_esys_init_count(), inits + 1);
+    assert_null(slot_get_token(EMPTY_SLOT)->tctx);
+
+    rv = C_CloseSession(other);
+    assert_int_equal(rv, CKR_OK);
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_tpm_ctx_token_info_cached(void **state) {
+
+    fake_token *ft = (fake_token *)*state;
+
+    fake_token_reload(ft, CKF_OS_LOCKING_OK);
+    uint64_t inits = fake_tpm_esys_init_count();
+
+    /* the first token to ask on a TCTI creates the context it keeps */
+    CK_TOKEN_INFO first;
+    token_info_get(ft->slot, &first);
+    assert_int_equal(fake_tpm_esys_init_count(), inits + 1);
+    assert_non_null(ft->tok->tctx);
+
+    /* the others get the cached TPM info without one */
+    token *empty = slot_get_token(EMPTY_SLOT);
+    assert_non_null(empty);
+
+    CK_TOKEN_INFO cached = { 0 };
+    CK_RV rv = slot_get_tpm_info(empty, &cached);
+    assert_int_equal(rv, CKR_OK);
+    assert_null(empty->tctx);
+    assert_int_equal(fake_tpm_esys_init_count(), inits + 1);
+
+    assert_memory_equal(cached.manufacturerID, first.manufacturerID,
+            sizeof(cached.manufacturerID));
+    assert_memory_equal(cached.model, first.model, sizeof(cached.model));
+    assert_memory_equal(&cached.hardwareVersion, &first.hardwareVersion,
+            sizeof(cached.hardwareVersion));
+    assert_memory_equal(&cached.firmwareVersion, &first.firmwareVersion,
+            sizeof(cached.firmwareVersion));
+
+    CK_TOKEN_INFO info;
+    token_info_get(EMPTY_SLOT, &info);
+    token_info_get(ft->slot, &info);
+    assert_int_equal(fake_tpm_esys_init_count(), inits + 1);
+
+    /* a session reuses the context of the token */
+    CK_SESSION_HANDLE session;
+    rv = C_OpenSession(ft->slot, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+            NULL, NULL, &session);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(fake_tpm_esys_init_count(), inits + 1);
+
+    rv = C_CloseSession(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_tpm_ctx_none_until_session,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_ctx_token_info_cached,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
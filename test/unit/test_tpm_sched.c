@@ -0,0 +1,350 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <cmocka.h>
+
+#include <tss2/tss2_tcti.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tpm_sched.h"
+#include "utils.h"
+
+#define FAKE_TCTI_MAGIC 0x66616b6574637469ULL
+
+#define MAX_SENT 16
+
+/* the commands the TPM got, in order, over all fake TCTIs */
+static struct {
+    pthread_mutex_t lock;
+    uint32_t ccs[MAX_SENT];
+    unsigned len;
+} _g_sent = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* the scheduler only uses OS locks when the application allows them */
+static bool _g_locking_ok = true;
+
+bool __wrap_general_os_locking_ok(void);
+bool __wrap_general_os_locking_ok(void) {
+    return _g_locking_ok;
+}
+
+static TSS2_RC fake_transmit(TSS2_TCTI_CONTEXT *ctx, size_t size,
+        const uint8_t *command) {
+    UNUSED(ctx);
+
+    assert_int_equal(size, 10);
+    uint32_t cc = ((uint32_t)command[6] << 24) | ((uint32_t)command[7] << 16)
+            | ((uint32_t)command[8] << 8) | (uint32_t)command[9];
+
+    pthread_mutex_lock(&_g_sent.lock);
+    assert_true(_g_sent.len < MAX_SENT);
+    _g_sent.ccs[_g_sent.len++] = cc;
+    pthread_mutex_unlock(&_g_sent.lock);
+
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC fake_receive(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        uint8_t *response, int32_t timeout) {
+    UNUSED(ctx);
+    UNUSED(timeout);
+
+    static const uint8_t success[] = {
+        0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00
+    };
+
+    if (response) {
+        memcpy(response, success, sizeof(success));
+    }
+    *size = sizeof(success);
+
+    return TSS2_RC_SUCCESS;
+}
+
+static void fake_tcti_init(TSS2_TCTI_CONTEXT_COMMON_V2 *fake) {
+
+    memset(fake, 0, sizeof(*fake));
+
+    TSS2_TCTI_CONTEXT *ctx = (TSS2_TCTI_CONTEXT *)fake;
+    TSS2_TCTI_MAGIC(ctx) = FAKE_TCTI_MAGIC;
+    TSS2_TCTI_VERSION(ctx) = 2;
+    TSS2_TCTI_TRANSMIT(ctx) = fake_transmit;
+    TSS2_TCTI_RECEIVE(ctx) = fake_receive;
+}
+
+static unsigned sent_count(void) {
+
+    pthread_mutex_lock(&_g_sent.lock);
+    unsigned len = _g_sent.len;
+    pthread_mutex_unlock(&_g_sent.lock);
+    return len;
+}
+
+static void sleep_ms(unsigned ms) {
+
+    struct timespec ts = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (long)(ms % 1000) * 1000000,
+    };
+    nanosleep(&ts, NULL);
+}
+
+static void send_cc(TSS2_TCTI_CONTEXT *ctx, uint32_t cc) {
+
+    uint8_t command[10] = {
+        0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+        cc >> 24, cc >> 16, cc >> 8, cc
+    };
+
+    TSS2_RC rc = TSS2_TCTI_TRANSMIT(ctx)(ctx, sizeof(command), command);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+}
+
+static void recv_rsp(TSS2_TCTI_CONTEXT *ctx) {
+
+    uint8_t response[10];
+    size_t size = sizeof(response);
+    TSS2_RC rc = TSS2_TCTI_RECEIVE(ctx)(ctx, &size, response, TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+}
+
+/* a TPM context of its own that sends one command from a thread */
+typedef struct sender sender;
+struct sender {
+    TSS2_TCTI_CONTEXT_COMMON_V2 inner;
+    void *wrapped;
+    uint32_t cc;
+    pthread_t thread;
+};
+
+static void *sender_run(void *arg) {
+
+    sender *s = (sender *)arg;
+    send_cc((TSS2_TCTI_CONTEXT *)s->wrapped, s->cc);
+    recv_rsp((TSS2_TCTI_CONTEXT *)s->wrapped);
+    return NULL;
+}
+
+static void sender_start(sender *s, const char *config, uint32_t cc) {
+
+    fake_tcti_init(&s->inner);
+    s->cc = cc;
+
+    CK_RV rv = tpm_sched_tcti_new(config, &s->inner, &s->wrapped);
+    assert_int_equal(rv, CKR_OK);
+    assert_ptr_not_equal(s->wrapped, &s->inner);
+
+    assert_int_equal(pthread_create(&s->thread, NULL, sender_run, s), 0);
+}
+
+static void sender_join(sender *s) {
+
+    assert_int_equal(pthread_join(s->thread, NULL), 0);
+    tpm_sched_tcti_free(&s->inner, s->wrapped);
+}
+
+static int setup(void **state) {
+    UNUSED(state);
+
+    _g_locking_ok = true;
+    _g_sent.len = 0;
+    assert_int_equal(setenv("TPM2_PKCS11_TPM_SCHED", "1", 1), 0);
+
+    return 0;
+}
+
+static int teardown(void **state) {
+    UNUSED(state);
+
+    unsetenv("TPM2_PKCS11_TPM_SCHED");
+
+    return 0;
+}
+
+static void test_tpm_sched_off_by_default(void **state) {
+    UNUSED(state);
+
+    TSS2_TCTI_CONTEXT_COMMON_V2 inner;
+    fake_tcti_init(&inner);
+
+    static const struct {
+        const char *env;
+        bool locking_ok;
+    } cases[] = {
+        { NULL, true },
+        { "0",  true },
+        { "1",  false },
+    };
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(cases); i++) {
+        _g_locking_ok = cases[i].locking_ok;
+        if (cases[i].env) {
+            assert_int_equal(setenv("TPM2_PKCS11_TPM_SCHED", cases[i].env, 1), 0);
+        } else {
+            unsetenv("TPM2_PKCS11_TPM_SCHED");
+        }
+
+        void *wrapped = NULL;
+        CK_RV rv = tpm_sched_tcti_new("fake:off", &inner, &wrapped);
+        assert_int_equal(rv, CKR_OK);
+        assert_ptr_equal(wrapped, &inner);
+        tpm_sched_tcti_free(&inner, wrapped);
+    }
+}
+
+static void test_tpm_sched_pass_through(void **state) {
+    UNUSED(state);
+
+    TSS2_TCTI_CONTEXT_COMMON_V2 inner;
+    fake_tcti_init(&inner);
+
+    void *wrapped = NULL;
+    CK_RV rv = tpm_sched_tcti_new("fake:pass", &inner, &wrapped);
+    assert_int_equal(rv, CKR_OK);
+    assert_ptr_not_equal(wrapped, &inner);
+
+    send_cc((TSS2_TCTI_CONTEXT *)wrapped, TPM2_CC_Sign);
+    recv_rsp((TSS2_TCTI_CONTEXT *)wrapped);
+
+    /* the next command is not held up by the last one */
+    send_cc((TSS2_TCTI_CONTEXT *)wrapped, TPM2_CC_Create);
+    recv_rsp((TSS2_TCTI_CONTEXT *)wrapped);
+
+    assert_int_equal(sent_count(), 2);
+    assert_int_equal(_g_sent.ccs[0], TPM2_CC_Sign);
+    assert_int_equal(_g_sent.ccs[1], TPM2_CC_Create);
+
+    tpm_sched_tcti_free(&inner, wrapped);
+}
+
+static void test_tpm_sched_same_tcti_waits(void **state) {
+    UNUSED(state);
+
+    TSS2_TCTI_CONTEXT_COMMON_V2 inner;
+    fake_tcti_init(&inner);
+
+    void *wrapped = NULL;
+    CK_RV rv = tpm_sched_tcti_new("fake:same", &inner, &wrapped);
+    assert_int_equal(rv, CKR_OK);
+
+    /* holds the TPM until it gets its response */
+    send_cc((TSS2_TCTI_CONTEXT *)wrapped, TPM2_CC_Create);
+
+    sender other;
+    sender_start(&other, "fake:same", TPM2_CC_Sign);
+
+    sleep_ms(100);
+    assert_int_equal(sent_count(), 1);
+
+    recv_rsp((TSS2_TCTI_CONTEXT *)wrapped);
+    sender_join(&other);
+
+    assert_int_equal(sent_count(), 2);
+    assert_int_equal(_g_sent.ccs[1], TPM2_CC_Sign);
+
+    tpm_sched_tcti_free(&inner, wrapped);
+}
+
+static void test_tpm_sched_other_tcti_does_not_wait(void **state) {
+    UNUSED(state);
+
+    TSS2_TCTI_CONTEXT_COMMON_V2 inner;
+    fake_tcti_init(&inner);
+
+    void *wrapped = NULL;
+    CK_RV rv = tpm_sched_tcti_new("fake:tpm0", &inner, &wrapped);
+    assert_int_equal(rv, CKR_OK);
+
+    send_cc((TSS2_TCTI_CONTEXT *)wrapped, TPM2_CC_Create);
+
+    /* another TPM, it goes while the first one is busy */
+    sender other;
+    sender_start(&other, "fake:tpm1", TPM2_CC_Sign);
+    sender_join(&other);
+    assert_int_equal(sent_count(), 2);
+
+    recv_rsp((TSS2_TCTI_CONTEXT *)wrapped);
+    tpm_sched_tcti_free(&inner, wrapped);
+
+    /* both show up in the stats, each with its own classes */
+    char *json = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&json, &len);
+    assert_non_null(f);
+    tpm_sched_emit_json(f);
+    fclose(f);
+
+    assert_non_null(strstr(json, "{\"tcti\":\"fake:tpm0\",\"class\":\"interactive\""));
+    assert_non_null(strstr(json, "{\"tcti\":\"fake:tpm1\",\"class\":\"background\""));
+    free(json);
+}
+
+static void test_tpm_sched_interactive_first(void **state) {
+    UNUSED(state);
+
+    TSS2_TCTI_CONTEXT_COMMON_V2 inner;
+    fake_tcti_init(&inner);
+
+    void *wrapped = NULL;
+    CK_RV rv = tpm_sched_tcti_new("fake:order", &inner, &wrapped);
+    assert_int_equal(rv, CKR_OK);
+
+    send_cc((TSS2_TCTI_CONTEXT *)wrapped, TPM2_CC_Sign);
+
+    /* the key creation queues up first, the signature goes first anyway */
+    sender create;
+    sender_start(&create, "fake:order", TPM2_CC_Create);
+    sleep_ms(50);
+
+    sender sign;
+    sender_start(&sign, "fake:order", TPM2_CC_Sign);
+    sleep_ms(50);
+
+    assert_int_equal(sent_count(), 1);
+    recv_rsp((TSS2_TCTI_CONTEXT *)wrapped);
+
+    sender_join(&create);
+    sender_join(&sign);
+
+    assert_int_equal(sent_count(), 3);
+    assert_int_equal(_g_sent.ccs[1], TPM2_CC_Sign);
+    assert_int_equal(_g_sent.ccs[2], TPM2_CC_Create);
+
+    tpm_sched_tcti_free(&inner, wrapped);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    /* the order tests must not see a command go overdue */
+    setenv("TPM2_PKCS11_TPM_SCHED_MAX_WAIT_MS", "60000", 1);
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_tpm_sched_off_by_default,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_sched_pass_through,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_sched_same_tcti_waits,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_sched_other_tcti_does_not_wait,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_sched_interactive_first,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
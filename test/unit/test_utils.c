@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "twist.h"
+#include "utils.h"
+
+typedef struct hash_pass_vector hash_pass_vector;
+struct hash_pass_vector {
+    const char *salt;
+    const char *auth;
+};
+
+/* the same as hash_pass() in tools/tpm2_pkcs11/utils.py derives */
+static void test_utils_hash_pass(void **state) {
+    (void) state;
+
+    static const hash_pass_vector vectors[] = {
+        { "abcd",                           "221b37fcdb52d0f7c39bbd0be211db0e" },
+        { "$scrypt$ln=14,r=8,p=1$00112233", "e4bb5318e939ba2885ac14162b816c4c" },
+        { "$scrypt$ln=10,r=1,p=1$00112233", "d1402976b73dce6d3ad063a6cba39f34" },
+    };
+
+    twist pin = twist_new("1234");
+    assert_non_null(pin);
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(vectors); i++) {
+        twist salt = twist_new(vectors[i].salt);
+        assert_non_null(salt);
+
+        twist auth = utils_hash_pass(pin, salt);
+        assert_non_null(auth);
+        assert_string_equal(auth, vectors[i].auth);
+
+        twist_free(auth);
+        twist_free(salt);
+    }
+
+    twist_free(pin);
+}
+
+static void test_utils_hash_pass_bad_salt(void **state) {
+    (void) state;
+
+    static const char *salts[] = {
+        "$scrypt$ln=9,r=8,p=1$00",   /* below the minimum cost */
+        "$scrypt$ln=14,r=8$00",      /* p missing */
+        "$scrypt$ln=14,r=8,p=1",     /* no salt */
+        "$argon2id$m=65536$00",      /* unknown KDF */
+    };
+
+    twist pin = twist_new("1234");
+    assert_non_null(pin);
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(salts); i++) {
+        twist salt = twist_new(salts[i]);
+        assert_non_null(salt);
+
+        twist auth = utils_hash_pass(pin, salt);
+        assert_null(auth);
+
+        twist_free(salt);
+    }
+
+    twist_free(pin);
+}
+
+static void test_utils_pin_kdf_parse(void **state) {
+    (void) state;
+
+    pin_kdf kdf;
+    assert_true(utils_pin_kdf_parse(NULL, &kdf));
+    assert_int_equal(kdf.alg, pin_kdf_scrypt);
+    assert_int_equal(kdf.ln, PIN_KDF_SCRYPT_DEFAULT_LN);
+    assert_int_equal(kdf.r, PIN_KDF_SCRYPT_DEFAULT_R);
+    assert_int_equal(kdf.p, PIN_KDF_SCRYPT_DEFAULT_P);
+
+    assert_true(utils_pin_kdf_parse("sha256", &kdf));
+    assert_int_equal(kdf.alg, pin_kdf_sha256);
+
+    assert_true(utils_pin_kdf_parse("scrypt:p=2,ln=16", &kdf));
+    assert_int_equal(kdf.alg, pin_kdf_scrypt);
+    assert_int_equal(kdf.ln, 16);
+    assert_int_equal(kdf.r, PIN_KDF_SCRYPT_DEFAULT_R);
+    assert_int_equal(kdf.p, 2);
+
+    assert_false(utils_pin_kdf_parse("scrypt:", &kdf));
+    assert_false(utils_pin_kdf_parse("scrypt:ln=+14", &kdf));
+    assert_false(utils_pin_kdf_parse("scrypt:ln=22,r=8", &kdf));
+    assert_false(utils_pin_kdf_parse("pbkdf2", &kdf));
+}
+
+static void test_utils_setup_new_object_auth_kdf(void **state) {
+    (void) state;
+
+    twist pin = twist_new("1234");
+    assert_non_null(pin);
+
+    twist auth = NULL;
+    twist salt = NULL;
+    CK_RV rv = utils_setup_new_object_auth(pin, "scrypt:ln=10,r=1", &auth, &salt);
+    assert_int_equal(rv, CKR_OK);
+    assert_non_null(auth);
+    assert_non_null(salt);
+    assert_int_equal(twist_len(auth), AUTH_HEX_STR_SIZE);
+    assert_memory_equal(salt, "$scrypt$ln=10,r=1,p=1$", 22);
+
+    /* the salt is all a login needs */
+    twist again = utils_hash_pass(pin, salt);
+    assert_non_null(again);
+    assert_string_equal(auth, again);
+    twist_free(again);
+    twist_free(auth);
+    twist_free(salt);
+
+    auth = NULL;
+    salt = NULL;
+    rv = utils_setup_new_object_auth(pin, "sha256", &auth, &salt);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_not_equal(salt[0], '$');
+    twist_free(auth);
+    twist_free(salt);
+
+    twist_free(pin);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_utils_hash_pass),
+        cmocka_unit_test(test_utils_hash_pass_bad_salt),
+        cmocka_unit_test(test_utils_pin_kdf_parse),
+        cmocka_unit_test(test_utils_setup_new_object_auth_kdf),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,328 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include <sqlite3.h>
+
+#include "attrs.h"
+#include "backend.h"
+#include "fake_token.h"
+#include "object.h"
+#include "pkcs11.h"
+#include "token.h"
+#include "utils.h"
+
+/* values of at least this many bytes are kept out of the attrs */
+#define THRESHOLD "64"
+
+#define SMALL_LEN 16
+#define LARGE_LEN 256
+
+typedef struct test_state test_state;
+struct test_state {
+    fake_token ft;
+    CK_SESSION_HANDLE session;
+    sqlite3 *db;    /* the connection of another process */
+    CK_BYTE small[SMALL_LEN];
+    CK_BYTE large[LARGE_LEN];
+};
+
+static int setup(void **state) {
+
+    test_state *s = calloc(1, sizeof(*s));
+    assert_non_null(s);
+
+    memset(s->small, 0x11, sizeof(s->small));
+    size_t i;
+    for (i=0; i < sizeof(s->large); i++) {
+        s->large[i] = (CK_BYTE)i;
+    }
+
+    assert_int_equal(setenv("TPM2_PKCS11_STORE_VALUE_THRESHOLD", THRESHOLD, 1), 0);
+    fake_token_setup(&s->ft, CKF_OS_LOCKING_OK, NULL);
+
+    s->session = fake_token_login(&s->ft);
+    s->db = fake_token_db_open(&s->ft);
+
+    *state = s;
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    assert_int_equal(sqlite3_close(s->db), SQLITE_OK);
+
+    CK_RV rv = C_CloseSession(s->session);
+    assert_int_equal(rv, CKR_OK);
+
+    fake_token_teardown(&s->ft);
+    unsetenv("TPM2_PKCS11_STORE_VALUE_THRESHOLD");
+    free(s);
+
+    return 0;
+}
+
+static CK_OBJECT_HANDLE data_add(test_state *s, CK_BYTE_PTR value, CK_ULONG len) {
+
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_BBOOL ck_true = CK_TRUE;
+    CK_BBOOL ck_false = CK_FALSE;
+    char label[] = "value";
+
+    CK_ATTRIBUTE templ[] = {
+        { CKA_CLASS,   &clazz,    sizeof(clazz)     },
+        { CKA_TOKEN,   &ck_true,  sizeof(ck_true)   },
+        { CKA_PRIVATE, &ck_false, sizeof(ck_false)  },
+        { CKA_LABEL,   label,     sizeof(label) - 1 },
+        { CKA_VALUE,   value,     len               },
+    };
+
+    CK_OBJECT_HANDLE handle;
+    CK_RV rv = C_CreateObject(s->session, templ, ARRAY_LEN(templ), &handle);
+    assert_int_equal(rv, CKR_OK);
+
+    return handle;
+}
+
+static void value_set(test_state *s, CK_OBJECT_HANDLE handle,
+        CK_BYTE_PTR value, CK_ULONG len) {
+
+    CK_ATTRIBUTE a = { CKA_VALUE, value, len };
+    CK_RV rv = C_SetAttributeValue(s->session, handle, &a, 1);
+    assert_int_equal(rv, CKR_OK);
+}
+
+/* asks for the length of the value first, then for the value */
+static void value_check(test_state *s, CK_OBJECT_HANDLE handle,
+        CK_BYTE_PTR expected, CK_ULONG len) {
+
+    CK_ATTRIBUTE a = { CKA_VALUE, NULL, 0 };
+    CK_RV rv = C_GetAttributeValue(s->session, handle, &a, 1);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(a.ulValueLen, len);
+
+    a.pValue = malloc(a.ulValueLen);
+    assert_non_null(a.pValue);
+    rv = C_GetAttributeValue(s->session, handle, &a, 1);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(a.ulValueLen, len);
+    assert_memory_equal(a.pValue, expected, len);
+    free(a.pValue);
+}
+
+static tobject *tobject_get(test_state *s, CK_OBJECT_HANDLE handle) {
+
+    tobject *tobj = NULL;
+    CK_RV rv = token_find_tobject(s->ft.tok, handle, &tobj);
+    assert_int_equal(rv, CKR_OK);
+    return tobj;
+}
+
+/* the length of the value in tobject_values as another process sees it, -1 if none */
+static int stored_len(test_state *s, unsigned id) {
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(s->db,
+            "SELECT length(value) FROM tobject_values WHERE id=?;", -1, &stmt, NULL);
+    assert_int_equal(rc, SQLITE_OK);
+    assert_int_equal(sqlite3_bind_int(stmt, 1, id), SQLITE_OK);
+
+    int len = -1;
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        len = sqlite3_column_int(stmt, 0);
+        rc = sqlite3_step(stmt);
+    }
+    assert_int_equal(rc, SQLITE_DONE);
+
+    sqlite3_finalize(stmt);
+    return len;
+}
+
+static CK_ULONG find_value(test_state *s, CK_BYTE_PTR value, CK_ULONG len,
+        CK_OBJECT_HANDLE *handle) {
+
+    CK_ATTRIBUTE templ[] = {
+        { CKA_VALUE, value, len },
+    };
+
+    CK_RV rv = C_FindObjectsInit(s->session, templ, ARRAY_LEN(templ));
+    assert_int_equal(rv, CKR_OK);
+
+    CK_OBJECT_HANDLE found[4];
+    CK_ULONG count = 0;
+    rv = C_FindObjects(s->session, found, ARRAY_LEN(found), &count);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_FindObjectsFinal(s->session);
+    assert_int_equal(rv, CKR_OK);
+
+    if (handle) {
+        *handle = count ? found[0] : CK_INVALID_HANDLE;
+    }
+
+    return count;
+}
+
+static void test_value_inline(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_OBJECT_HANDLE handle = data_add(s, s->small, sizeof(s->small));
+
+    tobject *tobj = tobject_get(s, handle);
+    assert_int_equal(tobj->ext_value_len, 0);
+    assert_int_equal(stored_len(s, tobj->id), -1);
+
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_VALUE);
+    assert_non_null(a);
+    assert_int_equal(a->ulValueLen, sizeof(s->small));
+
+    value_check(s, handle, s->small, sizeof(s->small));
+}
+
+static void test_value_out_of_line(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_OBJECT_HANDLE handle = data_add(s, s->large, sizeof(s->large));
+
+    /* the value is in the store, not in memory */
+    tobject *tobj = tobject_get(s, handle);
+    assert_int_equal(tobj->ext_value_len, sizeof(s->large));
+    assert_int_equal(stored_len(s, tobj->id), sizeof(s->large));
+
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_VALUE);
+    assert_non_null(a);
+    assert_int_equal(a->ulValueLen, 0);
+
+    value_check(s, handle, s->large, sizeof(s->large));
+
+    /* a buffer short of the value */
+    CK_BYTE buf[LARGE_LEN - 1];
+    CK_ATTRIBUTE t = { CKA_VALUE, buf, sizeof(buf) };
+    CK_RV rv = C_GetAttributeValue(s->session, handle, &t, 1);
+    assert_int_equal(rv, CKR_BUFFER_TOO_SMALL);
+    assert_int_equal(t.ulValueLen, CK_UNAVAILABLE_INFORMATION);
+
+    /* other attributes change without touching it */
+    char label[] = "other";
+    CK_ATTRIBUTE l = { CKA_LABEL, label, sizeof(label) - 1 };
+    rv = C_SetAttributeValue(s->session, handle, &l, 1);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(tobj->ext_value_len, sizeof(s->large));
+    assert_int_equal(stored_len(s, tobj->id), sizeof(s->large));
+    value_check(s, handle, s->large, sizeof(s->large));
+
+    /* and it is read from the store after a reload */
+    rv = C_CloseSession(s->session);
+    assert_int_equal(rv, CKR_OK);
+    fake_token_reload(&s->ft, CKF_OS_LOCKING_OK);
+    s->session = fake_token_login(&s->ft);
+
+    assert_int_equal(tobject_get(s, handle)->ext_value_len, sizeof(s->large));
+    value_check(s, handle, s->large, sizeof(s->large));
+}
+
+static void test_value_moves(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_OBJECT_HANDLE handle = data_add(s, s->small, sizeof(s->small));
+    tobject *tobj = tobject_get(s, handle);
+
+    /* inline to out of line */
+    value_set(s, handle, s->large, sizeof(s->large));
+    assert_int_equal(tobj->ext_value_len, sizeof(s->large));
+    assert_int_equal(stored_len(s, tobj->id), sizeof(s->large));
+    value_check(s, handle, s->large, sizeof(s->large));
+
+    /* a new large value replaces the stored one */
+    CK_BYTE larger[LARGE_LEN * 2];
+    memset(larger, 0x22, sizeof(larger));
+    value_set(s, handle, larger, sizeof(larger));
+    assert_int_equal(tobj->ext_value_len, sizeof(larger));
+    assert_int_equal(stored_len(s, tobj->id), sizeof(larger));
+    value_check(s, handle, larger, sizeof(larger));
+
+    /* and back inline, which drops it from the store */
+    value_set(s, handle, s->small, sizeof(s->small));
+    assert_int_equal(tobj->ext_value_len, 0);
+    assert_int_equal(stored_len(s, tobj->id), -1);
+    value_check(s, handle, s->small, sizeof(s->small));
+}
+
+static void test_value_find(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_OBJECT_HANDLE large = data_add(s, s->large, sizeof(s->large));
+    CK_OBJECT_HANDLE small = data_add(s, s->small, sizeof(s->small));
+
+    CK_OBJECT_HANDLE found;
+    assert_int_equal(find_value(s, s->large, sizeof(s->large), &found), 1);
+    assert_int_equal(found, large);
+    assert_int_equal(find_value(s, s->small, sizeof(s->small), &found), 1);
+    assert_int_equal(found, small);
+
+    /* the same length, other bytes */
+    CK_BYTE other[LARGE_LEN];
+    memcpy(other, s->large, sizeof(other));
+    other[LARGE_LEN - 1] ^= 0xff;
+    assert_int_equal(find_value(s, other, sizeof(other), NULL), 0);
+
+    /* a prefix of it */
+    assert_int_equal(find_value(s, s->large, sizeof(s->large) - 1, NULL), 0);
+}
+
+static void test_value_batched(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    s->ft.tok->config.durability = token_durability_batch;
+    CK_RV rv = backend_update_token_config(s->ft.tok);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_OBJECT_HANDLE small = data_add(s, s->small, sizeof(s->small));
+
+    /* a write that takes a value out of line is committed with it */
+    CK_OBJECT_HANDLE large = data_add(s, s->large, sizeof(s->large));
+    tobject *tobj = tobject_get(s, large);
+    assert_int_equal(stored_len(s, tobj->id), sizeof(s->large));
+
+    value_set(s, small, s->large, sizeof(s->large));
+    assert_int_equal(stored_len(s, tobject_get(s, small)->id), sizeof(s->large));
+
+    value_check(s, large, s->large, sizeof(s->large));
+    value_check(s, small, s->large, sizeof(s->large));
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_value_inline,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_value_out_of_line,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_value_moves,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_value_find,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_value_batched,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
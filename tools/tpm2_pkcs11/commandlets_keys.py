@@ -503,6 +503,12 @@ class ObjDel(Command):
 
         with Db(path) as db:
             obj = db.getobject(tid)
+            attrs = yaml.safe_load(obj['attrs'])
+            if CKA_TPM2_PERSISTENT_TR in attrs:
+                handle = tr_to_handle(attrs[CKA_TPM2_PERSISTENT_TR])
+                print('Object {} is persistent, handle 0x{:x} stays in the TPM until '
+                      'it is reclaimed with listpersistent --reclaim'.format(tid, handle),
+                      file=sys.stderr)
             db.rmobject(obj['id'])
 
     # adhere to an interface
@@ -516,6 +522,244 @@ class ObjDel(Command):
 
         ObjDel.delete(path, args['id'])
 
+# Keys are made persistent at handles of this range unless --handle is given,
+# listpersistent --reclaim only ever evicts handles in it.
+PERSIST_HANDLE_FIRST = 0x81000100
+PERSIST_HANDLE_LAST = 0x810001FF
+
+def tr_to_handle(trhex):
+    # a serialized ESYS_TR starts with the big endian TPM handle
+    return struct.unpack('>I', binascii.unhexlify(trhex)[:4])[0]
+
+def persistent_handles(tpm2):
+    y = yaml.safe_load(tpm2.getcap('handles-persistent'))
+    return y if y else []
+
+@commandlet("persist")
+class PersistCommand(Command):
+    '''
+    Makes a key persistent in the TPM, so the library uses it without loading it.
+    '''
+
+    # adhere to an interface
+    # pylint: disable=no-self-use
+    def generate_options(self, group_parser):
+        group_parser.add_argument(
+            '--id', help='The id of the key object.\n', required=True)
+        group_parser.add_argument(
+            '--handle',
+            type=lambda x: int(x, 0),
+            help='The persistent handle to use, defaults to the first free one '
+            'between 0x{:x} and 0x{:x}.\n'.format(PERSIST_HANDLE_FIRST, PERSIST_HANDLE_LAST))
+        group_parser.add_argument(
+            '--hierarchy-auth',
+            help='The authorization password for the owner hiearchy\n',
+            default="")
+
+    @staticmethod
+    def persist(db, tpm2, args):
+
+        tid = args['id']
+        hierarchyauth = args['hierarchy_auth']
+
+        obj = db.getobject(tid)
+        if obj is None:
+            sys.exit('Not found, object with id: {}'.format(tid))
+
+        attrs = yaml.safe_load(obj['attrs'])
+        if CKA_TPM2_PRIV_BLOB not in attrs:
+            sys.exit('Object {} is not a TPM key'.format(tid))
+
+        if CKA_TPM2_PERSISTENT_TR in attrs:
+            sys.exit('Object {} is already persistent at handle 0x{:x}'.format(
+                tid, tr_to_handle(attrs[CKA_TPM2_PERSISTENT_TR])))
+
+        used = persistent_handles(tpm2)
+        handle = args['handle']
+        if handle is None:
+            free = [h for h in range(PERSIST_HANDLE_FIRST, PERSIST_HANDLE_LAST + 1)
+                    if h not in used]
+            if not free:
+                sys.exit('No free persistent handle, see listpersistent --reclaim')
+            handle = free[0]
+        elif handle in used:
+            sys.exit('Handle 0x{:x} is in use'.format(handle))
+
+        token = db.gettokenbyid(obj['tokid'])
+        pobject = db.getprimary(token['pid'])
+
+        pobj_handle = get_pobject(pobject, tpm2, hierarchyauth, tpm2.tmpdir)
+
+        priv = binascii.unhexlify(attrs[CKA_TPM2_PRIV_BLOB])
+        pub = binascii.unhexlify(attrs[CKA_TPM2_PUB_BLOB])
+        ctx = tpm2.load(pobj_handle, pobject['objauth'], priv, pub)
+
+        tr_file = tpm2.evictcontrol(hierarchyauth, ctx, handle=handle)
+        with open(tr_file, 'rb') as f:
+            attrs[CKA_TPM2_PERSISTENT_TR] = bytes.hex(f.read())
+
+        try:
+            db.updatetertiary(obj['id'], attrs)
+        except Exception:
+            tpm2.evictcontrol(hierarchyauth, hex(handle), get_tr_file=False)
+            raise
+
+        d = {
+            'id' : obj['id'],
+            'handle' : '0x{:x}'.format(handle),
+            'action' : 'Persisted'
+        }
+
+        print(yaml.safe_dump(d, default_flow_style=False))
+
+    def __call__(self, args):
+
+        path = args['path']
+
+        with Db(path) as db:
+            with TemporaryDirectory() as d:
+                tpm2 = Tpm2(d)
+                PersistCommand.persist(db, tpm2, args)
+
+@commandlet("unpersist")
+class UnpersistCommand(Command):
+    '''
+    Evicts the persistent handle of a key, the library loads it again on use.
+    '''
+
+    # adhere to an interface
+    # pylint: disable=no-self-use
+    def generate_options(self, group_parser):
+        group_parser.add_argument(
+            '--id', help='The id of the key object.\n', required=True)
+        group_parser.add_argument(
+            '--hierarchy-auth',
+            help='The authorization password for the owner hiearchy\n',
+            default="")
+
+    @staticmethod
+    def unpersist(db, tpm2, args):
+
+        tid = args['id']
+
+        obj = db.getobject(tid)
+        if obj is None:
+            sys.exit('Not found, object with id: {}'.format(tid))
+
+        attrs = yaml.safe_load(obj['attrs'])
+        if CKA_TPM2_PERSISTENT_TR not in attrs:
+            sys.exit('Object {} is not persistent'.format(tid))
+
+        handle = tr_to_handle(attrs.pop(CKA_TPM2_PERSISTENT_TR))
+
+        # the handle may already have been evicted, eg by TPM2_Clear
+        if handle in persistent_handles(tpm2):
+            tpm2.evictcontrol(args['hierarchy_auth'], hex(handle), get_tr_file=False)
+
+        db.updatetertiary(obj['id'], attrs)
+
+        d = {
+            'id' : obj['id'],
+            'handle' : '0x{:x}'.format(handle),
+            'action' : 'Evicted'
+        }
+
+        print(yaml.safe_dump(d, default_flow_style=False))
+
+    def __call__(self, args):
+
+        path = args['path']
+
+        with Db(path) as db:
+            with TemporaryDirectory() as d:
+                tpm2 = Tpm2(d)
+                UnpersistCommand.unpersist(db, tpm2, args)
+
+@commandlet("listpersistent")
+class ListPersistentCommand(Command):
+    '''
+    Lists the persistent handles of the TPM and which store object uses them.
+    '''
+
+    # adhere to an interface
+    # pylint: disable=no-self-use
+    def generate_options(self, group_parser):
+        group_parser.add_argument(
+            '--reclaim',
+            action='store_true',
+            help='Evict the handles between 0x{:x} and 0x{:x} no object of the '
+            'store uses.\n'.format(PERSIST_HANDLE_FIRST, PERSIST_HANDLE_LAST))
+        group_parser.add_argument(
+            '--hierarchy-auth',
+            help='The authorization password for the owner hiearchy\n',
+            default="")
+
+    @staticmethod
+    def owners(db):
+        owners = {}
+        for pobject in db.getprimaries():
+            pobjconf = yaml.safe_load(pobject['config'])
+            if not pobjconf['transient']:
+                owners[tr_to_handle(pobjconf['esys-tr'])] = \
+                    'primary object {}'.format(pobject['id'])
+
+            for token in db.gettokens(pobject['id']):
+                for tobj in db.gettertiary(token['id']):
+                    attrs = yaml.safe_load(tobj['attrs'])
+                    if CKA_TPM2_PERSISTENT_TR in attrs:
+                        owners[tr_to_handle(attrs[CKA_TPM2_PERSISTENT_TR])] = \
+                            'object {} of token "{}"'.format(tobj['id'], token['label'])
+        return owners
+
+    @staticmethod
+    def available(tpm2):
+        y = yaml.safe_load(tpm2.getcap('properties-variable'))
+        avail = y.get('TPM2_PT_HR_PERSISTENT_AVAIL') if y else None
+        return int(str(avail), 0) if avail is not None else None
+
+    @staticmethod
+    def list(db, tpm2, args):
+
+        owners = ListPersistentCommand.owners(db)
+        present = persistent_handles(tpm2)
+
+        handles = []
+        reclaimed = []
+        for h in present:
+            d = {
+                'handle' : '0x{:x}'.format(h),
+            }
+            if h in owners:
+                d['used-by'] = owners[h]
+            elif args['reclaim'] and PERSIST_HANDLE_FIRST <= h <= PERSIST_HANDLE_LAST:
+                tpm2.evictcontrol(args['hierarchy_auth'], hex(h), get_tr_file=False)
+                reclaimed.append(d['handle'])
+                continue
+            handles.append(d)
+
+        output = {
+            'handles' : handles,
+            'available' : ListPersistentCommand.available(tpm2)
+        }
+
+        if args['reclaim']:
+            output['reclaimed'] = reclaimed
+
+        missing = sorted(h for h in owners if h not in present)
+        if missing:
+            output['missing'] = [ '0x{:x} ({})'.format(h, owners[h]) for h in missing ]
+
+        print(yaml.safe_dump(output, default_flow_style=False))
+
+    def __call__(self, args):
+
+        path = args['path']
+
+        with Db(path) as db:
+            with TemporaryDirectory() as d:
+                tpm2 = Tpm2(d)
+                ListPersistentCommand.list(db, tpm2, args)
+
 @commandlet("link")
 class LinkCommand(NewKeyCommandBase):
     '''
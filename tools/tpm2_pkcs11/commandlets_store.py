@@ -10,6 +10,7 @@ from .command import Command
 from .command import commandlet
 
 from .db import Db
+from .snapshot import export_snapshot
 from .utils import bytes_to_file
 from .utils import TemporaryDirectory
 from .utils import query_yes_no
@@ -222,3 +223,26 @@ class DbUp(Command):
             }
 
             print(yaml.safe_dump(y, default_flow_style=False))
+
+@commandlet("export-snapshot")
+class ExportSnapshotCommand(Command):
+    '''
+    Exports a tpm2-pkcs11 store to a read-only snapshot file
+    '''
+
+    # adhere to an interface
+    # pylint: disable=no-self-use
+    def generate_options(self, group_parser):
+        group_parser.add_argument(
+            '--output',
+            required=True,
+            help='The snapshot file to write, it is replaced atomically if it exists.\n')
+
+    def __call__(self, args):
+
+        path = args['path']
+
+        with Db(path) as db:
+            count = export_snapshot(db, args['output'])
+
+        print('exported {} token(s) to "{}"'.format(count, args['output']))
@@ -14,6 +14,7 @@ from .db import Db
 from .utils import check_pss_signature
 from .utils import TemporaryDirectory
 from .utils import hash_pass
+from .utils import pin_kdf_parse
 from .utils import rand_hex_str
 from .utils import AESAuthUnwrapper
 from .utils import load_sealobject
@@ -21,10 +22,17 @@ from .utils import str2bool
 from .utils import pkcs11_cko_to_str
 from .utils import pkcs11_ckk_to_str
 from .utils import get_pobject
+from .utils import create_primary
 from .tpm2 import Tpm2
 
 from .pkcs11t import *  # noqa
 
+def _token_pin_kdf(token):
+    '''the pin-kdf config of a token, None for the default'''
+    token_config = yaml.safe_load(io.StringIO(token['config']))
+    return token_config.get('pin-kdf') if token_config else None
+
+
 @commandlet("rmtoken")
 class RmTokenCommand(Command):
     '''
@@ -376,7 +384,7 @@ class ChangePinCommand(Command):
             sealctx, sealauth = load_sealobject(token, db, tpm2, pobj_handle, pobjauth,
                                                       oldpin, is_so)
 
-            newsealauth = hash_pass(newpin)
+            newsealauth = hash_pass(newpin, kdf=_token_pin_kdf(token))
 
             # call tpm2_changeauth and get new private portion
             newsealpriv = tpm2.changeauth(pobj_handle, sealctx, sealauth,
@@ -444,7 +452,7 @@ class InitPinCommand(Command):
 
             # call tpm2_create and create a new sealobject protected by the seal auth and sealing
             #    the wrapping key auth value
-            newsealauth = hash_pass(newpin)
+            newsealauth = hash_pass(newpin, kdf=_token_pin_kdf(token))
 
 
             newsealpriv, newsealpub, _ = tpm2.create(
@@ -465,10 +473,194 @@ class InitPinCommand(Command):
                 tpm2 = Tpm2(d)
                 InitPinCommand.initpin(db, tpm2, args)
 
+
+@commandlet("changeprimary")
+class ChangePrimaryCommand(Command):
+    '''
+    Moves a token to a new transient primary object, resealing its wrapping key.
+    '''
+
+    # adhere to an interface
+    # pylint: disable=no-self-use
+    def generate_options(self, group_parser):
+        group_parser.add_argument(
+            '--sopin', type=str, help='The sopin.\n', required=True)
+        group_parser.add_argument(
+            '--userpin',
+            type=str,
+            help='The user pin, required if the user pin is initialized.\n')
+        group_parser.add_argument(
+            '--label',
+            type=str,
+            help='The label of the token.\n',
+            required=True)
+        group_parser.add_argument(
+            '--transient-parent',
+            default='tpm2-tools-ecc-default',
+            choices=[ t for t in Tpm2.TEMPLATES.keys() if t is not None ],
+            help='The template of the new primary object, defaults to "tpm2-tools-ecc-default".\n')
+        group_parser.add_argument(
+            '--hierarchy-auth',
+            help='The authorization password for the owner hiearchy\n',
+            default="")
+
+    @staticmethod
+    def changeprimary(db, tpm2, args):
+
+        label = args['label']
+        sopin = args['sopin']
+        userpin = args['userpin']
+        template = args['transient_parent']
+        hierarchyauth = args['hierarchy_auth']
+
+        token = db.gettoken(label)
+
+        # keys are created under the primary object and can't be moved to another
+        for tobj in db.gettertiary(token['id']):
+            attrs = yaml.safe_load(tobj['attrs'])
+            if CKA_TPM2_PRIV_BLOB in attrs:
+                sys.exit('Token "{}" has TPM key objects, they are bound to '
+                         'the current primary object'.format(label))
+
+        sealobject = db.getsealobject(token['id'])
+        has_user = sealobject['userpub'] is not None
+        if has_user and userpin is None:
+            sys.exit('The user pin of token "{}" is initialized, expected --userpin'.format(label))
+
+        pobject = db.getprimary(token['pid'])
+        pobjauth = pobject['objauth']
+
+        with TemporaryDirectory() as d:
+
+            pobj_handle = get_pobject(pobject, tpm2, hierarchyauth, d)
+
+            sealctx, sosealauth = load_sealobject(token, db, tpm2, pobj_handle,
+                                                  pobjauth, sopin, True)
+            wrappingkey = tpm2.unseal(sealctx, sosealauth)
+
+            if has_user:
+                sealctx, usersealauth = load_sealobject(token, db, tpm2, pobj_handle,
+                                                        pobjauth, userpin, False)
+                if tpm2.unseal(sealctx, usersealauth) != wrappingkey:
+                    sys.exit('The user and so seal objects of token "{}" differ'.format(label))
+
+            newpobj_handle = create_primary(tpm2, hierarchyauth, pobjauth, template)
+
+            # the seal auths stay the same, so do the salts in the db
+            sopriv, sopub, _ = tpm2.create(newpobj_handle, pobjauth, sosealauth,
+                                           seal=wrappingkey)
+            sealobjects = {
+                'sopriv': sopriv,
+                'sopub': sopub,
+            }
+
+            if has_user:
+                userpriv, userpub, _ = tpm2.create(newpobj_handle, pobjauth,
+                                                   usersealauth, seal=wrappingkey)
+                sealobjects['userpriv'] = userpriv
+                sealobjects['userpub'] = userpub
+
+            config = {
+                'transient': True,
+                'template-name': template
+            }
+            pid = db.addprimary(config, pobjauth)
+            db.updateprimary(token, pid, sealobjects)
+
+        d = {
+            'id' : pid,
+            'action' : 'Created'
+        }
+
+        print(yaml.safe_dump(d, default_flow_style=False))
+
+    def __call__(self, args):
+
+        path = args['path']
+
+        with Db(path) as db:
+            with TemporaryDirectory() as d:
+                tpm2 = Tpm2(d)
+                ChangePrimaryCommand.changeprimary(db, tpm2, args)
+
 @staticmethod
 def _empty_validator(s):
     return s
 
+@staticmethod
+def _durability_validator(s):
+    if s not in ('full', 'batch'):
+        sys.exit('durability must be "full" or "batch", got: "{}"'.format(s))
+    return s
+
+@staticmethod
+def _attr_store_validator(s):
+    if s not in ('yaml', 'table'):
+        sys.exit('attr-store must be "yaml" or "table", got: "{}"'.format(s))
+    return s
+
+@staticmethod
+def _context_login_validator(s):
+    if s not in ('host', 'tpm'):
+        sys.exit('context-login must be "host" or "tpm", got: "{}"'.format(s))
+    return s
+
+@staticmethod
+def _login_cache_ttl_validator(s):
+    try:
+        ttl = int(s)
+    except ValueError:
+        ttl = -1
+    if not 0 <= ttl <= 0xFFFFFFFF:
+        sys.exit('login-cache-ttl must be a number of seconds, got: "{}"'.format(s))
+    return ttl
+
+@staticmethod
+def _prewarm_validator(s):
+    # mirrors prewarm_spec_valid() in src/lib/prewarm.c
+    entries = s.split(',')
+    if not all(entries):
+        sys.exit('prewarm must not have empty entries, got: "{}"'.format(s))
+    if len(entries) > 16:
+        sys.exit('prewarm must list at most 16 objects, got: "{}"'.format(s))
+    return s
+
+@staticmethod
+def _pin_kdf_validator(s):
+    try:
+        pin_kdf_parse(s)
+    except ValueError as e:
+        sys.exit('pin-kdf: {}'.format(e))
+    return s
+
+@staticmethod
+def _key_pool_validator(s):
+    # mirrors keypool_spec_parse() in src/lib/keypool.c
+    algs = ('rsa1024', 'rsa2048', 'p192', 'p224', 'p256', 'p384', 'p521')
+    usages = (None, 'sign', 'decrypt', 'sign+decrypt')
+    seen = set()
+    for entry in [e.strip() for e in s.split(',') if e.strip()]:
+        parts = entry.split(':')
+        if len(parts) != 3:
+            sys.exit('key-pool entries must be alg[/usage]:low:high, got: "{}"'.format(entry))
+        alg, _, usage = parts[0].partition('/')
+        usage = usage or None
+        if alg not in algs or usage not in usages:
+            sys.exit('key-pool alg must be one of {} with an optional /{}, got: "{}"'.format(
+                ', '.join(algs), '|'.join(usages[1:]), parts[0]))
+        try:
+            low, high = int(parts[1]), int(parts[2])
+        except ValueError:
+            sys.exit('key-pool watermarks must be integers, got: "{}"'.format(entry))
+        if not 0 <= low <= high <= 1024 or high == 0:
+            sys.exit('key-pool watermarks must be 0 <= low <= high <= 1024 and high > 0, got: "{}"'.format(entry))
+        if (alg, usage) in seen:
+            sys.exit('key-pool kind listed twice, got: "{}"'.format(parts[0]))
+        seen.add((alg, usage))
+    if len(seen) not in range(1, 9):
+        sys.exit('key-pool must list between 1 and 8 kinds, got: "{}"'.format(s))
+    return s
+
 @commandlet("config")
 class ConfigCommand(Command):
     '''
@@ -477,7 +669,14 @@ class ConfigCommand(Command):
     _keys = {
         'token-init' : str2bool,
         'log-level'  : _empty_validator.__func__,
-        'tcti'       : _empty_validator.__func__
+        'tcti'       : _empty_validator.__func__,
+        'durability' : _durability_validator.__func__,
+        'attr-store' : _attr_store_validator.__func__,
+        'context-login' : _context_login_validator.__func__,
+        'login-cache-ttl' : _login_cache_ttl_validator.__func__,
+        'prewarm'    : _prewarm_validator.__func__,
+        'pin-kdf'    : _pin_kdf_validator.__func__,
+        'key-pool'   : _key_pool_validator.__func__
     }
 
     # adhere to an interface
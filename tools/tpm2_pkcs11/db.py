@@ -3,10 +3,138 @@ import fcntl
 import os
 import sys
 import sqlite3
+import struct
 import textwrap
 import yaml
 
-VERSION = 4
+VERSION = 11
+
+# Keep in sync with the library, see src/lib/db.c
+JOURNAL_MODES = ('wal', 'delete', 'truncate', 'persist')
+BUSY_TIMEOUT_DEFAULT_MS = 5000
+
+# Stamp tobjects rows with a new random rev whenever they are written, so
+# library processes can tell which objects changed, see src/lib/db.c
+TOBJECT_REV_TRIGGERS = (
+    textwrap.dedent('''
+        CREATE TRIGGER tobjects_rev_insert
+        AFTER INSERT ON tobjects
+        BEGIN
+            UPDATE tobjects SET rev=random() WHERE id=NEW.id;
+        END;
+    '''),
+    textwrap.dedent('''
+        CREATE TRIGGER tobjects_rev_update
+        AFTER UPDATE OF attrs ON tobjects
+        BEGIN
+            UPDATE tobjects SET rev=random() WHERE id=NEW.id;
+        END;
+    '''),
+)
+
+# Objects of tokens with the "attr-store: table" config keep an empty attrs
+# column and one tobject_attrs row per attribute, see src/lib/db.c
+TOBJECT_ATTRS_SCHEMA = (
+    textwrap.dedent('''
+        CREATE TABLE IF NOT EXISTS tobject_attrs(
+            tobject_id INTEGER NOT NULL,
+            type INTEGER NOT NULL,
+            kind INTEGER NOT NULL,
+            value BLOB,
+            PRIMARY KEY (tobject_id, type)
+        );
+    '''),
+    'CREATE INDEX IF NOT EXISTS tobject_attrs_type_value ON tobject_attrs(type, value);',
+    textwrap.dedent('''
+        CREATE TRIGGER tobject_attrs_delete
+        AFTER DELETE ON tobjects
+        BEGIN
+            DELETE FROM tobject_attrs WHERE tobject_id=OLD.id;
+        END;
+    '''),
+)
+
+# The CKA_VALUE of large public data objects and certificates, the attrs of
+# the object hold an empty CKA_VALUE in its place, see src/lib/db.c
+TOBJECT_VALUES_SCHEMA = (
+    textwrap.dedent('''
+        CREATE TABLE IF NOT EXISTS tobject_values(
+            id INTEGER PRIMARY KEY,
+            value BLOB NOT NULL
+        );
+    '''),
+    textwrap.dedent('''
+        CREATE TRIGGER tobject_values_delete
+        AFTER DELETE ON tobjects
+        BEGIN
+            DELETE FROM tobject_values WHERE id=OLD.id;
+        END;
+    '''),
+)
+
+# Keys created ahead of time for the key-pool token config, template is the
+# marshalled TPM2B_PUBLIC the key was created from, see src/lib/keypool.c
+KEYPOOL_SCHEMA = (
+    textwrap.dedent('''
+        CREATE TABLE IF NOT EXISTS keypool(
+            id INTEGER PRIMARY KEY,
+            tokid INTEGER NOT NULL,
+            template BLOB NOT NULL,
+            pub BLOB NOT NULL,
+            priv BLOB NOT NULL,
+            objauth TEXT NOT NULL,
+            FOREIGN KEY (tokid) REFERENCES tokens(id) ON DELETE CASCADE
+        );
+    '''),
+    'CREATE INDEX IF NOT EXISTS keypool_tokid_template ON keypool(tokid, template);',
+)
+
+# The TPMS_CONTEXT of a transient primary object saved by the library and
+# the TPM resetCount it is valid for, see src/lib/token.c
+POBJECT_CONTEXTS_SCHEMA = (
+    textwrap.dedent('''
+        CREATE TABLE IF NOT EXISTS pobject_contexts(
+            pid INTEGER PRIMARY KEY,
+            resetcount INTEGER NOT NULL,
+            context BLOB NOT NULL,
+            FOREIGN KEY (pid) REFERENCES pobjects(id) ON DELETE CASCADE
+        );
+    '''),
+)
+
+CKA_VALUE = 0x11
+
+# The kind column, the type data of src/lib/typed_memory.h
+ATTR_KIND_INT = 1
+ATTR_KIND_BOOL = 2
+ATTR_KIND_INT_SEQ = 3
+ATTR_KIND_HEX_STR = 4
+
+
+def _attr_from_row(kind, value):
+    value = bytes(value) if value is not None else b''
+    if kind == ATTR_KIND_INT:
+        return struct.unpack('@L', value)[0]
+    if kind == ATTR_KIND_BOOL:
+        return value != b'\x00'
+    if kind == ATTR_KIND_INT_SEQ:
+        return list(struct.unpack('@%dL' % (len(value) // struct.calcsize('@L')), value))
+    return value.hex()
+
+
+def _journal_mode():
+    mode = os.environ.get('TPM2_PKCS11_STORE_JOURNAL_MODE', JOURNAL_MODES[0]).lower()
+    return mode if mode in JOURNAL_MODES else JOURNAL_MODES[0]
+
+
+def _busy_timeout():
+    try:
+        ms = int(os.environ.get('TPM2_PKCS11_STORE_BUSY_TIMEOUT',
+                                str(BUSY_TIMEOUT_DEFAULT_MS)), 0)
+    except ValueError:
+        ms = BUSY_TIMEOUT_DEFAULT_MS
+    return ms / 1000.0
+
 
 #
 # With Db() as db:
@@ -17,7 +145,7 @@ class Db(object):
         self._path = os.path.join(dirpath, "tpm2_pkcs11.sqlite3")
 
     def __enter__(self):
-        self._conn = sqlite3.connect(self._path)
+        self._conn = sqlite3.connect(self._path, timeout=_busy_timeout())
         self._conn.row_factory = sqlite3.Row
         self._conn.execute('PRAGMA foreign_keys = ON;')
         self._create()
@@ -38,6 +166,12 @@ class Db(object):
             sys.exit('No token labeled "%s"' % label)
         return x
 
+    def gettokenbyid(self, tokid):
+        c = self._conn.cursor()
+        c.execute("SELECT * from tokens WHERE id=?", (tokid, ))
+        x = c.fetchone()
+        return x
+
     def getsealobject(self, tokid):
         c = self._conn.cursor()
         c.execute("SELECT * from sealobjects WHERE tokid=?", (tokid, ))
@@ -56,10 +190,39 @@ class Db(object):
         x = c.fetchall()
         return x
 
+    def _tobject(self, row):
+        '''
+        Returns a tobject row with the attributes of a table stored object as YAML,
+        and a CKA_VALUE kept in tobject_values merged back in.
+        '''
+        if row is None:
+            return row
+
+        c = self._conn.cursor()
+        c.execute("SELECT value from tobject_values WHERE id=?", (row['id'], ))
+        value = c.fetchone()
+
+        if row['attrs'] and value is None:
+            return row
+
+        if row['attrs']:
+            attrs = yaml.safe_load(row['attrs'])
+        else:
+            c.execute("SELECT type, kind, value from tobject_attrs WHERE tobject_id=?",
+                      (row['id'], ))
+            attrs = {r['type']: _attr_from_row(r['kind'], r['value']) for r in c.fetchall()}
+
+        if value is not None:
+            attrs[CKA_VALUE] = bytes(value['value']).hex()
+
+        x = dict(row)
+        x['attrs'] = yaml.safe_dump(attrs, canonical=True)
+        return x
+
     def getobjects(self, tokid):
         c = self._conn.cursor()
         c.execute("SELECT * from tobjects WHERE tokid=?", (tokid, ))
-        x = c.fetchall()
+        x = [self._tobject(r) for r in c.fetchall()]
         return x
 
     def rmtoken(self, label):
@@ -81,13 +244,13 @@ class Db(object):
     def gettertiary(self, tokid):
         c = self._conn.cursor()
         c.execute("SELECT * from tobjects WHERE tokid=?", (tokid, ))
-        x = c.fetchall()
+        x = [self._tobject(r) for r in c.fetchall()]
         return x
 
     def getobject(self, tid):
         c = self._conn.cursor()
         c.execute("SELECT * from tobjects WHERE id=?", (tid, ))
-        x = c.fetchone()
+        x = self._tobject(c.fetchone())
         return x
 
     def rmobject(self, tid):
@@ -203,6 +366,10 @@ class Db(object):
         sql = 'UPDATE tobjects SET attrs=? WHERE id=?'
         c.execute(sql, values)
 
+        # the YAML is authoritative again, the library moves it back on its next write
+        c.execute('DELETE FROM tobject_attrs WHERE tobject_id=?', (tid, ))
+        c.execute('DELETE FROM tobject_values WHERE id=?', (tid, ))
+
     def updatepin(self, is_so, token, sealauth, sealpriv, sealpub=None):
 
         tokid = token['id']
@@ -224,6 +391,20 @@ class Db(object):
                 * ['so' if is_so else 'user'] * 2)
             c.execute(sql, (sealauth['salt'], Db._blobify(sealpriv), tokid))
 
+    def updateprimary(self, token, pid, sealobjects):
+        '''
+        Moves a token to the primary object pid, sealobjects holds the
+        [user|so][pub|priv] blobs of the seal objects created under it.
+        '''
+        c = self._conn.cursor()
+
+        c.execute('UPDATE tokens SET pid=? WHERE id=?;', (pid, token['id']))
+
+        columns = ', '.join('{}=?'.format(k) for k in sealobjects.keys())
+        values = [Db._blobify(v) for v in sealobjects.values()]
+        sql = 'UPDATE sealobjects SET {} WHERE tokid=?;'.format(columns)
+        c.execute(sql, values + [token['id']])
+
     def commit(self):
         self._conn.commit()
 
@@ -382,6 +563,73 @@ class Db(object):
         s = 'ALTER TABLE pobjects2 RENAME TO pobjects;'
         dbbakcon.execute(s)
 
+    def _update_on_5(self, dbbakcon):
+        '''
+        Between version 4 and 5 of the DB the following changes need to be made:
+          - Add indexes on the tokid columns, tokens load their objects by tokid
+            and without them every load scans the objects of all tokens.
+        '''
+        dbbakcon.execute(
+            'CREATE INDEX IF NOT EXISTS tobjects_tokid ON tobjects(tokid);')
+        dbbakcon.execute(
+            'CREATE INDEX IF NOT EXISTS sealobjects_tokid ON sealobjects(tokid);')
+
+    def _update_on_6(self, dbbakcon):
+        '''
+        Between version 5 and 6 of the DB the following changes need to be made:
+          - Add a rev column to tobjects, stamped with a new random value by
+            triggers whenever a row is inserted or its attrs change.
+        '''
+        dbbakcon.execute(
+            'ALTER TABLE tobjects ADD COLUMN rev INTEGER NOT NULL DEFAULT 0;')
+        for t in TOBJECT_REV_TRIGGERS:
+            dbbakcon.execute(t)
+
+    def _update_on_7(self, dbbakcon):
+        '''
+        Between version 6 and 7 of the DB the following changes need to be made:
+          - Add the tobject_attrs table, one row per attribute of the objects
+            of tokens with the table attribute store, indexed on (type, value).
+        '''
+        for s in TOBJECT_ATTRS_SCHEMA:
+            dbbakcon.execute(s)
+
+    def _update_on_8(self, dbbakcon):
+        '''
+        Between version 7 and 8 of the DB the following changes need to be made:
+          - Add the tobject_values table, holding the CKA_VALUE of large public
+            data objects and certificates out of the attrs.
+        '''
+        for s in TOBJECT_VALUES_SCHEMA:
+            dbbakcon.execute(s)
+
+    def _update_on_9(self, dbbakcon):
+        '''
+        Between version 8 and 9 of the DB the following changes need to be made:
+          - Add the keypool table, holding keys created ahead of time for the
+            key-pool token config.
+        '''
+        for s in KEYPOOL_SCHEMA:
+            dbbakcon.execute(s)
+
+    def _update_on_10(self, dbbakcon):
+        '''
+        Between version 9 and 10 of the DB the following changes need to be made:
+          - Add the pobject_contexts table, holding the saved context of a
+            transient primary object.
+        '''
+        for s in POBJECT_CONTEXTS_SCHEMA:
+            dbbakcon.execute(s)
+
+    def _update_on_11(self, dbbakcon):
+        '''
+        Between version 10 and 11 of the DB the following changes need to be made:
+          - None to the tables. The [user|so]authsalt columns of sealobjects may
+            now name the KDF of the PIN, see hash_pass(). The version keeps older
+            releases, which would hash such a salt as is, off the store.
+        '''
+        # pylint: disable=unused-argument
+
     def update_db(self, old_version, new_version=VERSION):
 
         # were doing the update, so make a backup to manipulate
@@ -398,27 +646,17 @@ class Db(object):
                     REPLACE INTO schema (id, schema_version) VALUES (1, {version});
                 '''.format(version=new_version))
             dbbakcon.execute(sql)
-        finally:
-            # Close the connections
-            self._conn.commit()
-            self._conn.close()
-
             dbbakcon.commit()
-            dbbakcon.close()
 
-            # move old db to ".old" suffix
-            olddbpath = self._path + ".old"
-            os.rename(self._path, olddbpath)
-
-            # move the backup to the normal dbpath
-            os.rename(dbbakpath, self._path)
-
-            # unlink the old
-            os.unlink(olddbpath)
+            # Copy the updated backup over the db in one transaction, which
+            # unlike renaming files keeps the -wal and -shm files of a db in
+            # WAL mode consistent with it.
+            self._conn.commit()
+            dbbakcon.backup(self._conn)
+        finally:
+            dbbakcon.close()
 
-            # re-establish a connection
-            self._conn = sqlite3.connect(self._path)
-            self._conn.row_factory = sqlite3.Row
+        os.unlink(dbbakpath)
 
     def _get_version(self):
         c = self._conn.cursor()
@@ -468,9 +706,22 @@ class Db(object):
                 id INTEGER PRIMARY KEY,
                 tokid INTEGER NOT NULL,
                 attrs TEXT NOT NULL,
+                rev INTEGER NOT NULL DEFAULT 0,
                 FOREIGN KEY (tokid) REFERENCES tokens(id) ON DELETE CASCADE
             );
             '''),
+            'CREATE INDEX tobjects_tokid ON tobjects(tokid);',
+            TOBJECT_REV_TRIGGERS[0],
+            TOBJECT_REV_TRIGGERS[1],
+            TOBJECT_ATTRS_SCHEMA[0],
+            TOBJECT_ATTRS_SCHEMA[1],
+            TOBJECT_ATTRS_SCHEMA[2],
+            TOBJECT_VALUES_SCHEMA[0],
+            TOBJECT_VALUES_SCHEMA[1],
+            'CREATE INDEX sealobjects_tokid ON sealobjects(tokid);',
+            KEYPOOL_SCHEMA[0],
+            KEYPOOL_SCHEMA[1],
+            POBJECT_CONTEXTS_SCHEMA[0],
             textwrap.dedent('''
             CREATE TABLE schema(
                 id INTEGER PRIMARY KEY,
@@ -547,6 +798,18 @@ class Db(object):
             sys.stderr.write('DB Upgrade failed: "{}", backup located in "{}"'.format(e, dbbakpath))
             raise e
 
+    def _set_journal_mode(self):
+        # switching to WAL needs the store to ourselves, so do it under the lock
+        self._conn.commit()
+        mode = _journal_mode()
+        try:
+            c = self._conn.execute('PRAGMA journal_mode={};'.format(mode))
+            cur = c.fetchone()[0]
+        except sqlite3.OperationalError as e:
+            cur = str(e)
+        if cur.lower() != mode:
+            sys.stderr.write('Could not set DB journal mode "{}": {}\n'.format(mode, cur))
+
     def _create(self):
 
         # create a lock from the db name plush .lock suffix
@@ -557,6 +820,7 @@ class Db(object):
             fcntl.flock(fd, fcntl.LOCK_EX)
             holds_lock = True
             self._do_create()
+            self._set_journal_mode()
         finally:
             # we always want unlink to occur
             os.unlink(lockpath)
@@ -95,6 +95,7 @@ CKA_VENDOR_TPM2_DEFINED=0x0F000000
 CKA_TPM2_OBJAUTH_ENC=CKA_VENDOR_DEFINED|CKA_VENDOR_TPM2_DEFINED|0x1
 CKA_TPM2_PUB_BLOB=CKA_VENDOR_DEFINED|CKA_VENDOR_TPM2_DEFINED|0x2
 CKA_TPM2_PRIV_BLOB=CKA_VENDOR_DEFINED|CKA_VENDOR_TPM2_DEFINED|0x3
+CKA_TPM2_PERSISTENT_TR=CKA_VENDOR_DEFINED|CKA_VENDOR_TPM2_DEFINED|0x5
 
 CKC_X_509 = 0
 
@@ -0,0 +1,138 @@
+# SPDX-License-Identifier: BSD-2-Clause
+import io
+import os
+import struct
+import tempfile
+
+import yaml
+
+# Keep in sync with src/lib/snapshot.h, the layout is described in docs/SNAPSHOT.md
+SNAPSHOT_MAGIC = b'TPM2P11S'
+SNAPSHOT_FORMAT_VERSION = 2
+
+ATTR_INT = 0
+ATTR_BOOL = 1
+ATTR_BYTES = 2
+ATTR_INT_SEQ = 3
+
+
+
+def _blob(data):
+    if data is None:
+        data = b''
+    elif isinstance(data, str):
+        data = data.encode()
+    return struct.pack('<I', len(data)) + bytes(data)
+
+
+def _load_yaml(text):
+    return yaml.safe_load(io.StringIO(text)) or {}
+
+
+def _attr(key, value):
+    # bool first, it is an int in python
+    if isinstance(value, bool):
+        kind, data = ATTR_BOOL, struct.pack('<B', 1 if value else 0)
+    elif isinstance(value, int):
+        kind, data = ATTR_INT, struct.pack('<Q', value)
+    elif isinstance(value, list):
+        kind, data = ATTR_INT_SEQ, struct.pack('<%dQ' % len(value), *value)
+    elif isinstance(value, str):
+        kind, data = ATTR_BYTES, bytes.fromhex(value)
+    else:
+        raise RuntimeError('Cannot snapshot attribute {} of type {}'.format(
+            hex(key), type(value).__name__))
+
+    return struct.pack('<QB', key, kind) + _blob(data)
+
+
+def _config_value(value):
+    # the scalar the library sees in the config YAML
+    if isinstance(value, bool):
+        return 'true' if value else 'false'
+    return str(value)
+
+
+def _config(config):
+    # all of it, the library rejects keys it does not know
+    out = struct.pack('<I', len(config))
+    for key in sorted(config):
+        out += _blob(str(key)) + _blob(_config_value(config[key]))
+    return out
+
+
+def _tobject(tobj):
+    attrs = _load_yaml(tobj['attrs'])
+    out = struct.pack('<II', tobj['id'], len(attrs))
+    for key in sorted(attrs):
+        out += _attr(key, attrs[key])
+    return out
+
+
+def _pobject(pobj):
+    config = _load_yaml(pobj['config'])
+    transient = bool(config.get('transient', False))
+    out = struct.pack('<B3x', 1 if transient else 0)
+    if transient:
+        out += _blob(config['template-name'])
+    else:
+        out += _blob(bytes.fromhex(config['esys-tr']))
+    return out + _blob(pobj['objauth'])
+
+
+def _token(db, token, pobj):
+    config = _load_yaml(token['config'])
+
+    label = token['label'] or ''
+    if len(label.encode()) > 32:
+        raise RuntimeError('Token label "{}" is too long'.format(label))
+
+    out = struct.pack('<II', token['id'], token['pid'])
+    out += _blob(label)
+    out += _config(config)
+    out += _pobject(pobj)
+
+    sealobj = db.getsealobject(token['id'])
+    for col in ('userauthsalt', 'userpriv', 'userpub',
+                'soauthsalt', 'sopriv', 'sopub'):
+        out += _blob(sealobj[col] if sealobj else None)
+
+    # like the library, only initialized tokens carry objects
+    tobjects = db.getobjects(token['id']) if sealobj else []
+    out += struct.pack('<I', len(tobjects))
+    for tobj in sorted(tobjects, key=lambda t: t['id']):
+        out += _tobject(tobj)
+
+    return out
+
+
+def export_snapshot(db, path):
+    '''Writes the tokens of db to a snapshot file at path, replacing it atomically.'''
+
+    body = b''
+    count = 0
+    for pobj in db.getprimaries():
+        for token in db.gettokens(pobj['id']):
+            body += _token(db, token, pobj)
+            count += 1
+
+    header_size = 32
+    header = SNAPSHOT_MAGIC + struct.pack('<IIIIQ', SNAPSHOT_FORMAT_VERSION,
+                                          db.VERSION, count, 0,
+                                          header_size + len(body))
+
+    dirname = os.path.dirname(os.path.abspath(path))
+    fd, tmp = tempfile.mkstemp(dir=dirname, prefix='.snapshot-')
+    try:
+        with os.fdopen(fd, 'wb') as f:
+            f.write(header)
+            f.write(body)
+            f.flush()
+            os.fsync(f.fileno())
+        os.chmod(tmp, 0o644)
+        os.rename(tmp, path)
+    except Exception:
+        os.unlink(tmp)
+        raise
+
+    return count
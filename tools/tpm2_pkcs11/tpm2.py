@@ -81,11 +81,17 @@ class Tpm2(object):
                                stderr)
         return ctx
 
-    def evictcontrol(self, hierarchyauth, ctx):
+    def evictcontrol(self, hierarchyauth, ctx, handle=None, get_tr_file=True):
 
         tr_file = os.path.join(self._tmp, "primary.handle")
 
-        cmd = ['tpm2_evictcontrol', '-c', str(ctx), '-o', tr_file]
+        cmd = ['tpm2_evictcontrol', '-c', str(ctx)]
+
+        if handle is not None:
+            cmd.append(hex(handle))
+
+        if get_tr_file:
+            cmd.extend(['-o', tr_file])
 
         if hierarchyauth and len(hierarchyauth) > 0:
             cmd.extend(['-P', hierarchyauth])
@@ -95,7 +101,7 @@ class Tpm2(object):
         if (p.wait()):
             raise RuntimeError("Could not execute tpm2_evictcontrol: %s",
                                stderr)
-        return tr_file
+        return tr_file if get_tr_file else None
 
     def readpublic(self, handle, get_tr_file=True):
 
@@ -39,11 +39,58 @@ def rand_hex_str(num=32):
     return binascii.hexlify(os.urandom(num // 2)).decode()
 
 
-def hash_pass(password, salt=None):
+# the scrypt cost of new PINs without a pin-kdf token config
+PIN_KDF_SCRYPT_DEFAULT = {'ln': 14, 'r': 8, 'p': 1}
+
+
+def _scrypt_params(s, defaults):
+    # mirrors scrypt_params_parse() and scrypt_params_ok() in src/lib/utils.c
+    params = dict(defaults)
+    for entry in s.split(','):
+        name, _, value = entry.partition('=')
+        if name not in ('ln', 'r', 'p') or not value.isdigit():
+            raise ValueError('scrypt parameters must be ln=N,r=N,p=N, got: "{}"'.format(s))
+        params[name] = int(value)
+
+    ln, r, p = params.get('ln', 0), params.get('r', 0), params.get('p', 0)
+    if not (10 <= ln <= 22 and 1 <= r <= 32 and 1 <= p <= 16) \
+            or 128 * r * (1 << ln) > 1 << 30:
+        raise ValueError('scrypt needs ln=<10-22>,r=<1-32>,p=<1-16> using at most 1 GiB, got: "{}"'.format(s))
+
+    return ln, r, p
+
+
+def pin_kdf_parse(spec):
+    '''
+    Parses a pin-kdf token config, see utils_pin_kdf_parse() in src/lib/utils.c.
+    Returns None for sha256 and the scrypt (ln, r, p) otherwise, raises
+    ValueError if spec is not valid.
+    '''
+    if spec is None or spec == 'scrypt':
+        return PIN_KDF_SCRYPT_DEFAULT['ln'], PIN_KDF_SCRYPT_DEFAULT['r'], PIN_KDF_SCRYPT_DEFAULT['p']
+
+    if spec == 'sha256':
+        return None
+
+    if not spec.startswith('scrypt:'):
+        raise ValueError('pin-kdf must be "sha256", "scrypt" or "scrypt:ln=N,r=N,p=N", got: "{}"'.format(spec))
+
+    return _scrypt_params(spec[len('scrypt:'):], PIN_KDF_SCRYPT_DEFAULT)
+
+
+def hash_pass(password, salt=None, kdf=None):
+    '''
+    Derives a seal object auth from a password, see utils_hash_pass() in
+    src/lib/utils.c. A new salt names the KDF of the pin-kdf config kdf, an
+    existing salt picks the KDF it was made with.
+    '''
 
     if salt is None:
         # get a 32 bit salt hex encoded (hex len 64)
         salt = rand_hex_str(64)
+        params = pin_kdf_parse(kdf)
+        if params:
+            salt = '$scrypt$ln={},r={},p={}${}'.format(*params, salt)
 
     # python 3.5.2 (doesn't seem to affect >= 3.5.6) is dumb...
     if isinstance(password, str):
@@ -52,11 +99,21 @@ def hash_pass(password, salt=None):
     if isinstance(salt, str):
         salt = salt.encode()
 
-    m = hashlib.sha256(password)
-    m.update(salt)
+    if salt.startswith(b'$'):
+        parts = salt.split(b'$')
+        if len(parts) != 4 or parts[1] != b'scrypt':
+            raise RuntimeError('Unknown PIN KDF in seal object salt, got: "{}"'.format(
+                salt[:32].decode(errors='replace')))
+        ln, r, p = _scrypt_params(parts[2].decode(), {})
+        n = 1 << ln
+        digest = binascii.hexlify(hashlib.scrypt(password, salt=parts[3],
+            n=n, r=r, p=p, maxmem=128 * r * (n + 2 + p), dklen=16)).decode()
+    else:
+        m = hashlib.sha256(password)
+        m.update(salt)
 
-    # the TPM auth size is limited to 32 bytes in most cases
-    digest = m.hexdigest()[:32]
+        # the TPM auth size is limited to 32 bytes in most cases
+        digest = m.hexdigest()[:32]
 
     return {
         'salt': salt,